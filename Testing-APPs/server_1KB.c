@@ -38,28 +38,39 @@ int peeloff_setup(sock_context *context) {
 }
 
 int peeloff_sock_ops(sock_context *context) {
+    struct homa_reply_recv_args rr;
+    int msg_len;
+
+    context->args.flags = HOMA_RECVMSG_REQUEST;
+    context->args.id    = 0;
+    context->hdr.msg_controllen = sizeof(context->args); // Reset controllen
+    msg_len = recvmsg(context->fd, &context->hdr, MSG_DONTWAIT);
+    if (msg_len < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        printf("err in recvmsg, fd %d, errno %d", context->fd, errno);
+        return -1;
+    }
+
+    // Reply to each request and receive the next one with a single
+    // system call; this also returns the request's bpages to Homa.
+    rr.recv = context->args;
     while(1) {
-        context->args.flags = HOMA_RECVMSG_REQUEST;
-        context->args.id    = 0;
-        context->hdr.msg_controllen = sizeof(context->args); // Reset controllen
-        int msg_len;
-        msg_len = recvmsg(context->fd, &context->hdr, MSG_DONTWAIT);
+        char* peeloff_msg_buffer = context->buf_args.start;
+        uint64_t id = rr.recv.id;
+
+        rr.recv.flags = HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_NONBLOCKING;
+        rr.recv.id    = 0;
+        msg_len = homa_reply_recv(context->fd, peeloff_msg_buffer, msg_len,
+                NULL, 0, id, &rr);
         if (msg_len < 0) {
             if (errno == EAGAIN)
                 break;
-            else {
-                printf("err in recvmsg, fd %d, errno %d", context->fd, errno);
-                return -1;
-            }
-        }
-        else {
-            char* peeloff_msg_buffer = context->buf_args.start;
-            if (homa_reply_connected(context->fd, peeloff_msg_buffer, msg_len, context->args.id) < 0) {
-                perror("failed to reply!");
-                return -1;
-            }
+            perror("failed to reply and receive!");
+            return -1;
         }
     }
+    context->args = rr.recv;
     return 0;
 }
 
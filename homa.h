@@ -77,6 +77,92 @@ _Static_assert(sizeof(struct homa_sendmsg_args) <= 16,
 	       "homa_sendmsg_args grew");
 #endif
 
+/**
+ * struct homa_sendmmsg_msg - Describes one of the messages sent by a
+ * batched sendmsg (see struct homa_sendmmsg_args).
+ */
+struct homa_sendmmsg_msg {
+	/**
+	 * @id: (in/out) Same meaning as the id field of struct
+	 * homa_sendmsg_args.
+	 */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: (in) Same meaning as the completion_cookie
+	 * field of struct homa_sendmsg_args.
+	 */
+	uint64_t completion_cookie;
+
+	/** @buf: (in) Contents of the message. */
+	void *buf;
+
+	/** @length: (in) Number of bytes in @buf. */
+	uint32_t length;
+
+	/**
+	 * @error: (out) 0 if the message was sent, or a negative errno if
+	 * it couldn't be sent. Valid only for the first num_sent + 1
+	 * messages.
+	 */
+	int32_t error;
+
+	/**
+	 * @dest: (in) For requests, the destination of the message; for
+	 * responses, the address of the client (same as msg_name for
+	 * an individual sendmsg). Ignored on connected sockets.
+	 */
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} dest;
+
+	uint32_t _pad1;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendmmsg_msg) >= 64,
+	       "homa_sendmmsg_msg shrunk");
+_Static_assert(sizeof(struct homa_sendmmsg_msg) <= 64,
+	       "homa_sendmmsg_msg grew");
+#endif
+
+/**
+ * struct homa_sendmmsg_args - Passed to sendmsg (using the msg_control
+ * field) instead of struct homa_sendmsg_args in order to send several
+ * requests and/or responses in a single call. Homa distinguishes the two
+ * structures by msg_controllen. The msg_name and msg_iov fields of the
+ * msghdr are ignored.
+ */
+struct homa_sendmmsg_args {
+	/**
+	 * @msgs: (in/out) The messages to send (@num_msgs entries). Ids
+	 * of new requests and per-message errors are returned here.
+	 */
+	struct homa_sendmmsg_msg *msgs;
+
+	/** @num_msgs: (in) Number of entries in @msgs. */
+	uint32_t num_msgs;
+
+	/** @flags: (in) Must be zero; reserved for future use. */
+	uint32_t flags;
+
+	/**
+	 * @num_sent: (out) Number of messages that were sent successfully.
+	 * Messages are sent in order, stopping at the first error.
+	 */
+	uint32_t num_sent;
+
+	uint32_t _pad1;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_sendmmsg_args) >= 24,
+	       "homa_sendmmsg_args shrunk");
+_Static_assert(sizeof(struct homa_sendmmsg_args) <= 24,
+	       "homa_sendmmsg_args grew");
+#endif
+
 /**
  * struct homa_recvmsg_args - Provides information needed by Homa's
  * recvmsg; passed to recvmsg using the msg_control field.
@@ -91,7 +177,9 @@ struct homa_recvmsg_args {
 	/**
 	 * @completion_cookie: (out) If the incoming message is a response,
 	 * this will return the completion cookie specified when the
-	 * request was sent. For requests this will always be zero.
+	 * request was sent. For requests this will be zero, unless the
+	 * request arrived on a member of this socket's group (see
+	 * SO_HOMA_GROUP), in which case it is the member's cookie.
 	 */
 	uint64_t completion_cookie;
 
@@ -128,6 +216,136 @@ _Static_assert(sizeof(struct homa_recvmsg_args) <= 88,
 	       "homa_recvmsg_args grew");
 #endif
 
+/**
+ * struct homa_recvmmsg_result - Describes one of the messages returned
+ * by a batched recvmsg (see struct homa_recvmmsg_args).
+ */
+struct homa_recvmmsg_result {
+	/** @id: Id of the RPC. */
+	uint64_t id;
+
+	/**
+	 * @completion_cookie: Same meaning as the completion_cookie field
+	 * of struct homa_recvmsg_args.
+	 */
+	uint64_t completion_cookie;
+
+	/**
+	 * @length: Length of the message, or a negative errno if the
+	 * RPC failed.
+	 */
+	int32_t length;
+
+	/** @num_bpages: Number of valid entries in @bpage_offsets. */
+	uint32_t num_bpages;
+
+	/**
+	 * @bpage_offsets: Where the message is stored in the buffer region;
+	 * same meaning as the bpage_offsets field of struct
+	 * homa_recvmsg_args. The application now owns these bpages.
+	 */
+	uint32_t bpage_offsets[HOMA_MAX_BPAGES];
+
+	/** @peer: Address of the message's sender. */
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} peer;
+
+	/**
+	 * @inline_offset: If the message was delivered inline (see
+	 * SO_HOMA_INLINE), its data starts at this offset in msg_iov (it
+	 * is truncated if msg_iov ran out of space). Zero otherwise.
+	 */
+	uint32_t inline_offset;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvmmsg_result) >= 120,
+	       "homa_recvmmsg_result shrunk");
+_Static_assert(sizeof(struct homa_recvmmsg_result) <= 120,
+	       "homa_recvmmsg_result grew");
+#endif
+
+/**
+ * struct homa_recvmmsg_args - Passed to recvmsg (using the msg_control
+ * field) instead of struct homa_recvmsg_args in order to receive several
+ * messages in a single call. Homa distinguishes the two structures by
+ * msg_controllen.
+ */
+struct homa_recvmmsg_args {
+	/**
+	 * @results: (in) Array with room for @max_results entries, in
+	 * which information about received messages will be returned.
+	 */
+	struct homa_recvmmsg_result *results;
+
+	/**
+	 * @bpage_offsets: (in) Bpages from previous messages that can now
+	 * be recycled (@num_bpages entries).
+	 */
+	uint32_t *bpage_offsets;
+
+	/** @num_bpages: (in) Number of entries in @bpage_offsets. */
+	uint32_t num_bpages;
+
+	/**
+	 * @flags: (in) Same as the flags field of struct homa_recvmsg_args;
+	 * the call waits only until at least one message is available.
+	 */
+	uint32_t flags;
+
+	/** @max_results: (in) Number of entries available in @results. */
+	uint32_t max_results;
+
+	/** @num_results: (out) Number of entries filled in @results. */
+	uint32_t num_results;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_recvmmsg_args) >= 32,
+	       "homa_recvmmsg_args shrunk");
+_Static_assert(sizeof(struct homa_recvmmsg_args) <= 32,
+	       "homa_recvmmsg_args grew");
+#endif
+
+/**
+ * struct homa_reply_recv_args - Passed to sendmsg (using the msg_control
+ * field) instead of struct homa_sendmsg_args in order to send a response
+ * and then receive the next incoming message in a single call. Homa
+ * distinguishes the structures by msg_controllen.
+ */
+struct homa_reply_recv_args {
+	/**
+	 * @reply_id: (in) Id of the RPC whose response is being sent (the
+	 * response is described by msg_name and msg_iov, as for an
+	 * ordinary response).
+	 */
+	uint64_t reply_id;
+
+	/**
+	 * @recv: (in/out) Controls the receive that follows the response,
+	 * exactly as for recvmsg. In particular, bpage_offsets can return
+	 * the buffers of the request being responded to.
+	 */
+	struct homa_recvmsg_args recv;
+
+	/** @peer: (out) Address of the sender of the message received. */
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} peer;
+
+	uint32_t _pad1;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_reply_recv_args) >= 128,
+	       "homa_reply_recv_args shrunk");
+_Static_assert(sizeof(struct homa_reply_recv_args) <= 128,
+	       "homa_reply_recv_args grew");
+#endif
+
 /* Flag bits for homa_recvmsg_args.flags (see man page for documentation):
  */
 #define HOMA_RECVMSG_REQUEST       0x01
@@ -162,6 +380,26 @@ _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 #define SO_HOMA_RCVBUF 10
 /** define SO_HOMA_PEELOFF: getsockopt option for returning the fd of a branched-off socket */
 #define SO_HOMA_PEELOFF 11
+/** define SO_HOMA_GROUP: setsockopt option for joining a socket group. */
+#define SO_HOMA_GROUP 12
+/**
+ * define SO_HOMA_INLINE: setsockopt option (int value) for the largest
+ * incoming message that recvmsg will deliver inline (copied into the
+ * caller's msg_iov rather than the buffer pool); 0 disables inline delivery.
+ */
+#define SO_HOMA_INLINE 13
+/**
+ * define SO_HOMA_CONN_STATS: getsockopt option that returns statistics
+ * for a connected socket (struct homa_conn_stats).
+ */
+#define SO_HOMA_CONN_STATS 14
+
+/**
+ * define HOMA_MAX_INLINE - Largest value that may be specified for
+ * SO_HOMA_INLINE. Inline messages are held in packet buffers until
+ * they are received, so this is kept small.
+ */
+#define HOMA_MAX_INLINE 8192
 
 /** struct homa_rcvbuf_args - setsockopt argument for SO_HOMA_RCVBUF. */
 struct homa_rcvbuf_args {
@@ -172,6 +410,157 @@ struct homa_rcvbuf_args {
 	size_t length;
 };
 
+/**
+ * struct homa_group_args - setsockopt argument for SO_HOMA_GROUP, which
+ * makes a connected socket a member of a socket group. Messages arriving
+ * on members are received with recvmsg on the group socket, into the
+ * group socket's buffer region.
+ */
+struct homa_group_args {
+	/**
+	 * @fd: File descriptor for the group socket (an unconnected Homa
+	 * socket), or -1 to remove the socket from its current group.
+	 */
+	int32_t fd;
+
+	int32_t _pad1;
+
+	/**
+	 * @cookie: Returned in the completion_cookie field by recvmsg on the
+	 * group socket for request messages that arrived on this socket.
+	 */
+	uint64_t cookie;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_group_args) >= 16, "homa_group_args shrunk");
+_Static_assert(sizeof(struct homa_group_args) <= 16, "homa_group_args grew");
+#endif
+
+/**
+ * struct homa_conn_stats - getsockopt result for SO_HOMA_CONN_STATS.
+ * Statistics are only gathered while a socket is connected (either with
+ * connect or by SO_HOMA_PEELOFF); all fields are cumulative except
+ * @srtt_ns.
+ */
+struct homa_conn_stats {
+	/** @requests_sent: Request messages sent on the socket. */
+	uint64_t requests_sent;
+
+	/** @responses_sent: Response messages sent on the socket. */
+	uint64_t responses_sent;
+
+	/** @requests_received: Request messages received on the socket. */
+	uint64_t requests_received;
+
+	/** @responses_received: Response messages received on the socket. */
+	uint64_t responses_received;
+
+	/** @bytes_sent: Total bytes in messages sent on the socket. */
+	uint64_t bytes_sent;
+
+	/** @bytes_received: Total bytes in messages received on the socket. */
+	uint64_t bytes_received;
+
+	/**
+	 * @resends_sent: RESEND packets sent to the peer because of
+	 * missing incoming data.
+	 */
+	uint64_t resends_sent;
+
+	/**
+	 * @retransmits: Data packets retransmitted in response to RESENDs
+	 * from the peer.
+	 */
+	uint64_t retransmits;
+
+	/** @timeouts: RPCs aborted because the peer stopped responding. */
+	uint64_t timeouts;
+
+	/**
+	 * @pool_wait_ns: Total time incoming messages spent waiting for
+	 * space in the socket's buffer pool.
+	 */
+	uint64_t pool_wait_ns;
+
+	/**
+	 * @grant_wait_ns: Total time incoming messages spent waiting to be
+	 * fully granted.
+	 */
+	uint64_t grant_wait_ns;
+
+	/**
+	 * @srtt_ns: Smoothed time between sending a request and receiving
+	 * the first packet of its response (0 if no samples yet).
+	 */
+	uint64_t srtt_ns;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_conn_stats) >= 96, "homa_conn_stats shrunk");
+_Static_assert(sizeof(struct homa_conn_stats) <= 96, "homa_conn_stats grew");
+#endif
+
+/**
+ * define HOMA_METRICS_MAGIC - Value of the @magic field in struct
+ * homa_metrics_hdr ("HMET").
+ */
+#define HOMA_METRICS_MAGIC 0x484d4554
+
+/**
+ * define HOMA_METRICS_VERSION - Version of the layout of
+ * /proc/net/homa_metrics_bin. Adding counters doesn't change the version,
+ * since readers locate counters using the schema.
+ */
+#define HOMA_METRICS_VERSION 1
+
+/**
+ * struct homa_metrics_hdr - Appears at the beginning of
+ * /proc/net/homa_metrics_bin, which provides Homa's performance counters
+ * in binary form. The header is followed by a schema and then by the
+ * counters for each core. The schema is ASCII text with one line per
+ * counter field, containing the field's name and the number of 64-bit
+ * counters in it (more than 1 for arrays), separated by a space. The
+ * counters for each core are an array of @num_counters uint64_t values,
+ * laid out in schema order; the arrays for all cores are contiguous.
+ * Readers can take repeated samples by re-reading just the counters.
+ */
+struct homa_metrics_hdr {
+	/** @magic: Always HOMA_METRICS_MAGIC. */
+	uint32_t magic;
+
+	/** @version: HOMA_METRICS_VERSION. */
+	uint32_t version;
+
+	/** @time_ns: sched_clock() time when the file was opened. */
+	uint64_t time_ns;
+
+	/** @num_cores: Number of per-core counter arrays in the file. */
+	uint32_t num_cores;
+
+	/** @num_counters: Number of uint64_t counters for each core. */
+	uint32_t num_counters;
+
+	/** @schema_offset: Offset of the schema within the file. */
+	uint32_t schema_offset;
+
+	/** @schema_length: Number of bytes in the schema. */
+	uint32_t schema_length;
+
+	/**
+	 * @data_offset: Offset within the file of the counters for core 0
+	 * (always a multiple of 8).
+	 */
+	uint32_t data_offset;
+
+	uint32_t _pad1;
+};
+
+#if !defined(__cplusplus)
+_Static_assert(sizeof(struct homa_metrics_hdr) >= 40, "homa_metrics_hdr shrunk");
+_Static_assert(sizeof(struct homa_metrics_hdr) <= 40, "homa_metrics_hdr grew");
+#endif
+
 /* Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
  */
@@ -208,6 +597,12 @@ ssize_t homa_replyv(int sockfd, const struct iovec *iov,
 		    int iovcnt, const struct sockaddr *dest_addr,
 		    uint32_t addrlen,  uint64_t id);
 int homa_peeloff(int sockfd, struct sockaddr *client_addr, uint32_t addrlen);
+int homa_join_group(int sockfd, int group_fd, uint64_t cookie);
+int     homa_sendmmsg(int sockfd, struct homa_sendmmsg_msg *msgs,
+		      int count);
+ssize_t homa_reply_recv(int sockfd, const void *message_buf, size_t length,
+			const struct sockaddr *dest_addr, uint32_t addrlen,
+			uint64_t id, struct homa_reply_recv_args *args);
 #endif /* See strip.py */
 
 #ifdef __cplusplus
@@ -291,3 +291,99 @@ int homa_peeloff(int sockfd, struct sockaddr *client_addr, uint32_t addrlen)
 {
   	return getsockopt(sockfd, IPPROTO_HOMA, SO_HOMA_PEELOFF, (void *)client_addr, &addrlen);
 }
+
+/**
+ * homa_join_group() - Make a connected Homa socket a member of a socket
+ * group, so that its incoming messages are received with recvmsg on the
+ * group socket.
+ * @sockfd:     Connected socket (e.g. returned by homa_peeloff). It must not
+ *              have its own buffer region: its messages are received into
+ *              @group_fd's region.
+ * @group_fd:   Unconnected Homa socket that serves as the group, or -1 to
+ *              remove @sockfd from its current group.
+ * @cookie:     Returned as the completion cookie by recvmsg on @group_fd
+ *              for requests that arrive on @sockfd.
+ *
+ * Return:      0 means success, otherwise -1 (errno gives the error).
+ */
+int homa_join_group(int sockfd, int group_fd, uint64_t cookie)
+{
+	struct homa_group_args args = {};
+
+	args.fd = group_fd;
+	args.cookie = cookie;
+	return setsockopt(sockfd, IPPROTO_HOMA, SO_HOMA_GROUP, &args,
+			  sizeof(args));
+}
+
+/**
+ * homa_sendmmsg() - Send several request and/or response messages with a
+ * single kernel call.
+ * @sockfd:     File descriptor for the socket on which to send the messages.
+ * @msgs:       Describes the messages to send. For each request message,
+ *              the id field must be 0 on entry and will be set to the id
+ *              of the new RPC. The error field of each message that was
+ *              attempted is set to 0 or a negative errno.
+ * @count:      Number of entries in @msgs.
+ *
+ * Return:      The number of messages sent successfully (messages are sent
+ *              in order, stopping at the first one that fails). If no
+ *              message could be sent, -1 is returned and errno is set
+ *              appropriately.
+ */
+int homa_sendmmsg(int sockfd, struct homa_sendmmsg_msg *msgs, int count)
+{
+	struct homa_sendmmsg_args args = {};
+	struct msghdr hdr = {};
+
+	args.msgs = msgs;
+	args.num_msgs = count;
+	hdr.msg_control = &args;
+	hdr.msg_controllen = sizeof(args);
+	return sendmsg(sockfd, &hdr, 0);
+}
+
+/**
+ * homa_reply_recv() - Send a response message for an RPC previously
+ * received with recvmsg, then receive the next incoming message, all in
+ * a single kernel call.
+ * @sockfd:       File descriptor for the socket on which to send the
+ *                response and receive the next message.
+ * @message_buf:  First byte of buffer containing the response message.
+ * @length:       Number of bytes in the message at @message_buf.
+ * @dest_addr:    Address of the RPC's client (returned by recvmsg when
+ *                the request was received); may be NULL for connected
+ *                sockets.
+ * @addrlen:      Size of @dest_addr in bytes.
+ * @id:           Unique identifier for the request, as returned by recvmsg
+ *                when the request was received.
+ * @args:         The recv field controls the receive, as for recvmsg (in
+ *                particular, it can return the request's buffers); on
+ *                return it describes the new message and the peer field
+ *                holds the new message's sender.
+ *
+ * Return:      The length of the message received. If an error occurred,
+ *              -1 is returned and errno is set appropriately; if the
+ *              response couldn't be sent, then no message is received.
+ */
+ssize_t homa_reply_recv(int sockfd, const void *message_buf, size_t length,
+			const struct sockaddr *dest_addr, uint32_t addrlen,
+			uint64_t id, struct homa_reply_recv_args *args)
+{
+	struct msghdr hdr;
+	struct iovec vec;
+
+	args->reply_id = id;
+
+	vec.iov_base = (void *)message_buf;
+	vec.iov_len = length;
+
+	hdr.msg_name = (void *)dest_addr;
+	hdr.msg_namelen = addrlen;
+	hdr.msg_iov = &vec;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = args;
+	hdr.msg_controllen = sizeof(*args);
+	hdr.msg_flags = 0;
+	return sendmsg(sockfd, &hdr, 0);
+}
@@ -86,8 +86,8 @@ void homa_grant_add_rpc(struct homa_rpc *rpc)
 				* (time - homa->last_grantable_change));
 		homa->last_grantable_change = time;
 		homa->num_grantable_rpcs++;
-		tt_record2("Incremented num_grantable_rpcs to %d, id %d",
-			   homa->num_grantable_rpcs, rpc->id);
+		tt_rpc_record2(rpc->id, "Incremented num_grantable_rpcs to %d, id %d",
+			       homa->num_grantable_rpcs, rpc->id);
 		if (homa->num_grantable_rpcs > homa->max_grantable_rpcs)
 			homa->max_grantable_rpcs = homa->num_grantable_rpcs;
 		rpc->msgin.birth = time;
@@ -176,12 +176,13 @@ void homa_grant_remove_rpc(struct homa_rpc *rpc)
 	head =  list_first_entry(&peer->grantable_rpcs,
 				 struct homa_rpc, grantable_links);
 	list_del_init(&rpc->grantable_links);
+	INC_CONN_STAT(rpc->hsk, grant_wait_ns, time - rpc->msgin.birth);
 	INC_METRIC(grantable_rpcs_integral, homa->num_grantable_rpcs
 			* (time - homa->last_grantable_change));
 	homa->last_grantable_change = time;
 	homa->num_grantable_rpcs--;
-	tt_record2("Decremented num_grantable_rpcs to %d, id %d",
-		   homa->num_grantable_rpcs, rpc->id);
+	tt_rpc_record2(rpc->id, "Decremented num_grantable_rpcs to %d, id %d",
+		       homa->num_grantable_rpcs, rpc->id);
 	if (rpc != head)
 		return;
 
@@ -250,15 +251,19 @@ int homa_grant_send(struct homa_rpc *rpc, struct homa *homa)
 		return 0;
 
 	rpc->msgin.granted += increment;
+	if (!rpc->msgin.sent_grant) {
+		rpc->msgin.sent_grant = 1;
+		INC_LATENCY(lat_first_grant_ns, sched_clock() - rpc->msgin.birth);
+	}
 
 	/* Send the grant. */
 	grant.offset = htonl(rpc->msgin.granted);
 	grant.priority = rpc->msgin.priority;
 	grant.resend_all = rpc->msgin.resend_all;
 	rpc->msgin.resend_all = 0;
-	tt_record4("sending grant for id %llu, offset %d, priority %d, increment %d",
-		   rpc->id, rpc->msgin.granted, rpc->msgin.priority,
-		   increment);
+	tt_rpc_record4(rpc->id, "sending grant for id %llu, offset %d, priority %d, increment %d",
+		       rpc->id, rpc->msgin.granted, rpc->msgin.priority,
+		       increment);
 	homa_xmit_control(GRANT, &grant, sizeof(grant), rpc);
 	return 1;
 }
@@ -291,7 +296,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	int rank, recalc;
 
 	if (rpc->msgin.length < 0 || rpc->state == RPC_DEAD ||
-	    rpc->msgin.num_bpages <= 0) {
+	    !homa_msgin_has_space(rpc)) {
 		homa_rpc_unlock(rpc);
 		goto done;
 	}
@@ -302,9 +307,9 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 		goto done;
 	}
 
-	tt_record4("homa_grant_check_rpc starting for id %d, granted %d, recv_end %d, length %d",
-		   rpc->id, rpc->msgin.granted, rpc->msgin.recv_end,
-		   rpc->msgin.length);
+	tt_rpc_record4(rpc->id, "homa_grant_check_rpc starting for id %d, granted %d, recv_end %d, length %d",
+		       rpc->id, rpc->msgin.granted, rpc->msgin.recv_end,
+		       rpc->msgin.length);
 
 	/* This message requires grants; if it is a new message, set up
 	 * granting.
@@ -367,7 +372,7 @@ void homa_grant_check_rpc(struct homa_rpc *rpc)
 	if (recalc)
 		homa_grant_recalc(homa, 0);
 done:
-	tt_record1("homa_grant_check_rpc finished with id %d", rpc->id);
+	tt_rpc_record1(rpc->id, "homa_grant_check_rpc finished with id %d", rpc->id);
 }
 
 /**
@@ -652,8 +657,10 @@ int homa_grantable_lock_slow(struct homa *homa, int recalc)
 	__acquires(&homa->grantable_lock)
 {
 	int starting_count = atomic_read(&homa->grant_recalc_count);
+	unsigned long holder = homa_lockprof_holder(&homa->grantable_lock);
 	__u64 start = sched_clock();
 	int result = 0;
+	__u64 wait;
 
 	tt_record("beginning wait for grantable lock");
 	while (1) {
@@ -668,8 +675,13 @@ int homa_grantable_lock_slow(struct homa *homa, int recalc)
 			break;
 		}
 	}
+	wait = sched_clock() - start;
 	INC_METRIC(grantable_lock_misses, 1);
-	INC_METRIC(grantable_lock_miss_ns, sched_clock() - start);
+	INC_METRIC(grantable_lock_miss_ns, wait);
+	if (result)
+		homa_lockprof_wait(HOMA_LOCK_CLASS_GRANTABLE,
+				   &homa->grantable_lock, _RET_IP_, holder,
+				   wait);
 	return result;
 }
 
@@ -686,8 +698,8 @@ void homa_grant_log_tt(struct homa *homa)
 	tt_record1("homa_grant_log_tt found %d active RPCs:",
 		   homa->num_active_rpcs);
 	for (i = 0; i < homa->num_active_rpcs; i++) {
-		tt_record2("active_rpcs[%d]: id %d", i,
-			   homa->active_rpcs[i]->id);
+		tt_rpc_record2(homa->active_rpcs[i]->id, "active_rpcs[%d]: id %d", i,
+			       homa->active_rpcs[i]->id);
 		homa_rpc_log_tt(homa->active_rpcs[i]);
 	}
 	homa_grantable_unlock(homa);
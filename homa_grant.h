@@ -38,10 +38,12 @@ static inline int homa_grantable_lock(struct homa *homa, int recalc)
 {
 	int result;
 
-	if (spin_trylock_bh(&homa->grantable_lock))
+	if (spin_trylock_bh(&homa->grantable_lock)) {
+		homa_lockprof_acquired(&homa->grantable_lock, _THIS_IP_);
 		result = 1;
-	else
+	} else {
 		result = homa_grantable_lock_slow(homa, recalc);
+	}
 	homa->grantable_lock_time = sched_clock();
 	return result;
 }
@@ -31,8 +31,11 @@
 #include <linux/kthread.h>
 #include <linux/completion.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/sched/clock.h>
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
+#include <linux/slab.h>
 #include <linux/skbuff.h>
 #include <linux/socket.h>
 #include <linux/vmalloc.h>
@@ -41,6 +44,7 @@
 #include <net/protocol.h>
 #include <net/inet_common.h>
 #include <net/gro.h>
+#include <net/busy_poll.h>
 #include <net/rps.h>
 
 #ifndef __STRIP__ /* See strip.py --alt */
@@ -76,13 +80,34 @@ void *mock_kmalloc(size_t size, gfp_t flags);
 #undef kmalloc_array
 #define kmalloc_array(count, size, type) mock_kmalloc((count) * (size), type)
 
+#undef kmem_cache_alloc
+#define kmem_cache_alloc mock_kmem_cache_alloc
+void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags);
+
+#undef kmem_cache_create
+#define kmem_cache_create mock_kmem_cache_create
+struct kmem_cache *mock_kmem_cache_create(const char *name, unsigned int size,
+					  unsigned int align,
+					  slab_flags_t flags,
+					  void (*ctor)(void *));
+
 #define kthread_complete_and_exit(...)
 
+#define mmap_read_lock mock_mmap_read_lock
+void mock_mmap_read_lock(struct mm_struct *mm);
+
+#define mmap_read_unlock mock_mmap_read_unlock
+void mock_mmap_read_unlock(struct mm_struct *mm);
+
 #ifdef page_address
 #undef page_address
 #endif
 #define page_address(page) ((void *)page)
 
+#undef PageCompound
+#define PageCompound mock_page_compound
+bool mock_page_compound(struct page *page);
+
 #define page_ref_count mock_page_refs
 int mock_page_refs(struct page *page);
 
@@ -114,6 +139,9 @@ void mock_spin_unlock(spinlock_t *lock);
 #define vmalloc mock_vmalloc
 void *mock_vmalloc(size_t size);
 
+#define vm_flags_set mock_vm_flags_set
+void mock_vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags);
+
 #undef DECLARE_PER_CPU
 #define DECLARE_PER_CPU(type, name) extern type name[10]
 
@@ -143,6 +171,7 @@ struct homa;
 #include "timetrace.h"
 #endif /* See strip.py */
 #include "homa_metrics.h"
+#include "homa_lockprof.h"
 
 /* Declarations used in this file, so they can't be made at the end. */
 void     homa_throttle_lock_slow(struct homa *homa);
@@ -156,6 +185,30 @@ void     homa_throttle_lock_slow(struct homa *homa);
  */
 #define HOMA_MAX_GRANTS 10
 
+/**
+ * define HOMA_COPYOUT_BATCH - Number of packets that must accumulate for
+ * a large message before a helper worker is scheduled to copy them to user
+ * space (see homa_copy_work); amortizes the cost of waking the worker.
+ */
+#define HOMA_COPYOUT_BATCH 4
+
+/**
+ * define HOMA_REAP_WORK_BATCH - Number of packet buffers (and RPCs) that
+ * homa_rpc_reap_work frees in one invocation before requeueing itself.
+ */
+#ifdef __UNIT_TEST__
+#define HOMA_REAP_WORK_BATCH 5
+#else /* __UNIT_TEST__ */
+#define HOMA_REAP_WORK_BATCH 500
+#endif /* __UNIT_TEST__ */
+
+/**
+ * define HOMA_SENDMMSG_CHUNK - Number of struct homa_sendmmsg_msgs that
+ * batched sendmsg copies in (and back out) at once; bounds the stack space
+ * used by homa_sendmsg_batch.
+ */
+#define HOMA_SENDMMSG_CHUNK 8
+
 /**
  * union sockaddr_in_union - Holds either an IPv4 or IPv6 address (smaller
  * and easier to use than sockaddr_storage).
@@ -204,6 +257,13 @@ struct homa_interest {
 	 */
 	int core;
 
+	/**
+	 * @polling: Nonzero means @thread is busy-waiting and hasn't started
+	 * to go to sleep, so it doesn't need to be woken up when an RPC is
+	 * handed off to it. Zero means it may be sleeping.
+	 */
+	int polling;
+
 	/**
 	 * @reg_rpc: RPC whose @interest field points here, or
 	 * NULL if none.
@@ -235,6 +295,7 @@ static inline void homa_interest_init(struct homa_interest *interest)
 	atomic_long_set(&interest->ready_rpc, 0);
 	interest->locked = 0;
 	interest->core = raw_smp_processor_id();
+	interest->polling = 0;
 	interest->reg_rpc = NULL;
 	interest->request_links.next = LIST_POISON1;
 	interest->response_links.next = LIST_POISON1;
@@ -261,12 +322,20 @@ enum homa_freeze_type {
  */
 struct homa {
 	/**
-	 * @next_outgoing_id: Id to use for next outgoing RPC request.
-	 * This is always even: it's used only to generate client-side ids.
-	 * Accessed without locks.
+	 * @next_outgoing_id: Start of the next block of client RPC ids to
+	 * be reserved by a core (see homa_rpc_alloc_id). This is always
+	 * even: it's used only to generate client-side ids. Accessed
+	 * without locks.
 	 */
 	atomic64_t next_outgoing_id;
 
+	/**
+	 * @id_epoch: Incremented whenever @next_outgoing_id is reset by
+	 * homa_rpc_set_next_id; tells cores to discard the ids they have
+	 * already reserved.
+	 */
+	atomic_t id_epoch;
+
 	/**
 	 * @link_idle_time: The time, measured by sched_clock, at which we
 	 * estimate that all of the packets we have passed to Linux for
@@ -465,39 +534,28 @@ struct homa {
 	struct homa_peertab *peers;
 
 	/**
-	 * @page_pool_mutex: Synchronizes access to any/all of the page_pools
-	 * used for outgoing sk_buff data.
+	 * @rpc_cache: Slab cache from which all homa_rpc structs are
+	 * allocated. Created by homa_rpc_cache_init.
 	 */
-	spinlock_t page_pool_mutex __aligned(L1_CACHE_BYTES);
+	struct kmem_cache *rpc_cache;
 
 	/**
 	 * @page_pools: One page pool for each NUMA node on the machine.
-	 * If there are no cores for node, then this value is NULL.
+	 * If there are no cores for node, then this value is NULL. The
+	 * pools themselves are lock-free; see struct homa_page_pool.
 	 */
-	struct homa_page_pool *page_pools[MAX_NUMNODES];
+	struct homa_page_pool *page_pools[MAX_NUMNODES] __aligned(L1_CACHE_BYTES);
 
 	/** @max_numa: Highest NUMA node id in use by any core. */
 	int max_numa;
 
 	/**
-	 * @skb_page_frees_per_sec: Rate at which to return pages from sk_buff
-	 * page pools back to Linux. This is the total rate across all pools.
-	 * Set externally via sysctl.
+	 * @skb_page_frees_per_sec: Maximum rate at which to return unneeded
+	 * pages from sk_buff page pools back to Linux. This is the total rate
+	 * across all pools. Set externally via sysctl.
 	 */
 	int skb_page_frees_per_sec;
 
-	/**
-	 * @skb_pages_to_free: Space in which to collect pages that are
-	 * about to be released. Dynamically allocated.
-	 */
-	struct page **skb_pages_to_free;
-
-	/**
-	 * @pages_to_free_slot: Maximum number of pages that can be
-	 * stored in skb_pages_to_free;
-	 */
-	int pages_to_free_slots;
-
 	/**
 	 * @skb_page_free_time: Time (in sched_clock() units) when the
 	 * next sk_buff page should be freed. Could be in the past.
@@ -547,6 +605,16 @@ struct homa {
 	 */
 	int poll_usecs;
 
+	/**
+	 * @adaptive_poll: Nonzero means that the amount of time a thread
+	 * busy-waits for an incoming message is adjusted for each socket
+	 * based on the recent interval between messages (with @poll_usecs
+	 * as the upper limit); threads won't poll at all if messages aren't
+	 * likely to arrive during the polling interval. Set externally
+	 * via sysctl.
+	 */
+	int adaptive_poll;
+
 	/**
 	 * @num_priorities: The total number of priority levels available for
 	 * Homa's use. Internally, Homa will use priorities from 0 to
@@ -671,6 +739,22 @@ struct homa {
 	 */
 	int dead_buffs_limit;
 
+	/**
+	 * @reap_workers: Nonzero means that dead RPCs are reaped by helper
+	 * worker threads (see homa_rpc_reap_work) rather than by application
+	 * threads in homa_wait_for_message or by homa_timer. Set externally
+	 * via sysctl.
+	 */
+	int reap_workers;
+
+	/**
+	 * @reap_work_skbs: When @reap_workers is set, homa_rpc_free schedules
+	 * a worker once a socket has accumulated this many packet buffers in
+	 * dead RPCs; smaller amounts are left for homa_timer to schedule.
+	 * Set externally via sysctl.
+	 */
+	int reap_work_skbs;
+
 	/**
 	 * @max_dead_buffs: The largest aggregate number of packet buffers
 	 * in dead (but not yet reaped) RPCs that has existed so far in a
@@ -734,12 +818,46 @@ struct homa {
 	 */
 	int hijack_tcp;
 
+	/**
+	 * @zerocopy_min_bytes: Messages sent with MSG_ZEROCOPY will be
+	 * transmitted directly from user pages, without copying, only if
+	 * they contain at least this many bytes (for shorter messages,
+	 * pinning pages and delivering completion notifications costs more
+	 * than copying). Set externally via sysctl.
+	 */
+	int zerocopy_min_bytes;
+
+	/**
+	 * @copyout_workers: Nonzero means that incoming messages of at least
+	 * @copyout_min_bytes are copied to user space incrementally by
+	 * helper worker threads as packets arrive, in parallel with the
+	 * receiving thread. Set externally via sysctl.
+	 */
+	int copyout_workers;
+
+	/**
+	 * @copyout_min_bytes: Messages shorter than this are never copied by
+	 * helper workers (for short messages, the receiving thread can copy
+	 * the data faster than a worker can be scheduled). Also determines
+	 * which messages are counted in the copyout_tail metrics. Set
+	 * externally via sysctl.
+	 */
+	int copyout_min_bytes;
+
 	/**
 	 * @max_gro_skbs: Maximum number of socket buffers that can be
 	 * aggregated by the GRO mechanism.  Set externally via sysctl.
 	 */
 	int max_gro_skbs;
 
+	/**
+	 * @lock_profile: Nonzero means that waits for Homa's locks are
+	 * recorded in /proc/net/homa_locks (see homa_lockprof.c). Each
+	 * time this changes from zero to nonzero, existing profile data
+	 * is discarded. Set externally via sysctl.
+	 */
+	int lock_profile;
+
 	/**
 	 * @gro_policy: An OR'ed together collection of bits that determine
 	 * how Homa packets should be steered for SoftIRQ handling.  A value
@@ -838,6 +956,15 @@ struct homa {
 	 */
 	int metrics_active_opens;
 
+	/**
+	 * @metrics_schema: the schema for /proc/net/homa_metrics_bin (see
+	 * homa_metrics_schema); kmalloc-ed, NULL if not yet generated.
+	 */
+	char *metrics_schema;
+
+	/** @metrics_schema_length: number of bytes in @metrics_schema. */
+	int metrics_schema_length;
+
 	/**
 	 * @flags: a collection of bits that can be set using sysctl
 	 * to trigger various behaviors.
@@ -857,12 +984,19 @@ struct homa {
 	int bpage_lease_usecs;
 
 	/**
-	 * @next_id: Set via sysctl; causes next_outgoing_id to be set to
+	 * @next_id: Set via sysctl; causes the next client RPC id to be
 	 * this value; always reads as zero. Typically used while debugging to
 	 * ensure that different nodes use different ranges of ids.
 	 */
 	int next_id;
 
+	/**
+	 * @tt_sample_rate: if greater than 1, only about 1 in this many
+	 * RPCs generate per-RPC timetrace records (see tt_set_sample_rate).
+	 * Set externally via sysctl.
+	 */
+	int tt_sample_rate;
+
 	/**
 	 * @temp: the values in this array can be read and written with sysctl.
 	 * They have no officially defined purpose, and are available for
@@ -958,6 +1092,8 @@ static inline void homa_throttle_lock(struct homa *homa)
 {
 	if (!spin_trylock_bh(&homa->throttle_lock))
 		homa_throttle_lock_slow(homa);
+	else
+		homa_lockprof_acquired(&homa->throttle_lock, _THIS_IP_);
 }
 
 /**
@@ -1106,6 +1242,7 @@ struct homa_interest *homa_choose_interest(struct homa *homa,
 					   int offset);
 void     homa_close(struct sock *sock, long timeout);
 int      homa_copy_to_user(struct homa_rpc *rpc);
+void     homa_copy_work(struct work_struct *work);
 void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
 void     homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
 void     homa_destroy(struct homa *homa);
@@ -1156,6 +1293,7 @@ void     homa_pacer_stop(struct homa *homa);
 void     homa_pacer_xmit(struct homa *homa);
 __poll_t homa_poll(struct file *file, struct socket *sock,
 		   struct poll_table_struct *wait);
+__u64    homa_poll_ns(struct homa_sock *hsk);
 char    *homa_print_ipv4_addr(__be32 addr);
 char    *homa_print_ipv6_addr(const struct in6_addr *addr);
 char    *homa_print_packet(struct sk_buff *skb, char *buffer, int buf_len);
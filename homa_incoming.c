@@ -11,7 +11,9 @@
 #include "homa_pool.h"
 
 /**
- * homa_message_in_init() - Constructor for homa_message_in.
+ * homa_message_in_init() - Constructor for homa_message_in. The fields
+ * initialized by homa_rpc_ctor (packets, gaps, and copy_work) are not
+ * touched here.
  * @rpc:          RPC whose msgin structure should be initialized.
  * @length:       Total number of bytes in message.
  * @unsched:      The number of unscheduled bytes the sender is planning
@@ -21,23 +23,37 @@
  */
 int homa_message_in_init(struct homa_rpc *rpc, int length, int unsched)
 {
+	int inline_max;
 	int err;
 
 	rpc->msgin.length = length;
-	skb_queue_head_init(&rpc->msgin.packets);
 	rpc->msgin.recv_end = 0;
-	INIT_LIST_HEAD(&rpc->msgin.gaps);
 	rpc->msgin.bytes_remaining = length;
 	rpc->msgin.granted = (unsched > length) ? length : unsched;
 	rpc->msgin.rec_incoming = 0;
 	atomic_set(&rpc->msgin.rank, -1);
 	rpc->msgin.priority = 0;
 	rpc->msgin.resend_all = 0;
+	rpc->msgin.sent_grant = 0;
 	rpc->msgin.num_bpages = 0;
-	err = homa_pool_allocate(rpc);
-	if (err != 0)
-		return err;
-	if (rpc->msgin.num_bpages == 0) {
+	rpc->msgin.pool_wait_start = 0;
+	rpc->msgin.inline_msg = 0;
+	rpc->msgin.zc = NULL;
+	rpc->msgin.copiers = 0;
+	rpc->msgin.complete_ns = 0;
+	inline_max = READ_ONCE(rpc->hsk->inline_max);
+	if (inline_max > 0 && length <= inline_max) {
+		/* Small message: recvmsg will copy it directly from the
+		 * packet buffers, so don't use the buffer pool.
+		 */
+		rpc->msgin.inline_msg = 1;
+		INC_METRIC(inline_msgs, 1);
+	} else {
+		err = homa_pool_allocate(rpc);
+		if (err != 0)
+			return err;
+	}
+	if (!homa_msgin_has_space(rpc)) {
 		/* The RPC is now queued waiting for buffer space, so we're
 		 * going to discard all of its packets.
 		 */
@@ -90,9 +106,10 @@ void homa_gap_retry(struct homa_rpc *rpc)
 		resend.offset = htonl(gap->start);
 		resend.length = htonl(gap->end - gap->start);
 		resend.priority = rpc->hsk->homa->num_priorities - 1;
-		tt_record3("homa_gap_retry sending RESEND for id %d, start %d, end %d",
-			   rpc->id, gap->start, gap->end);
+		tt_rpc_record3(rpc->id, "homa_gap_retry sending RESEND for id %d, start %d, end %d",
+			       rpc->id, gap->start, gap->end);
 		homa_xmit_control(RESEND, &resend, sizeof(resend), rpc);
+		INC_CONN_STAT(rpc->hsk, resends_sent, 1);
 	}
 }
 
@@ -112,8 +129,8 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 	int end = start + length;
 
 	if ((start + length) > rpc->msgin.length) {
-		tt_record3("Packet extended past message end; id %d, offset %d, length %d",
-			   rpc->id, start, length);
+		tt_rpc_record3(rpc->id, "Packet extended past message end; id %d, offset %d, length %d",
+			       rpc->id, start, length);
 		goto discard;
 	}
 
@@ -128,8 +145,8 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 		if (!homa_gap_new(&rpc->msgin.gaps,
 				  rpc->msgin.recv_end, start)) {
 			pr_err("Homa couldn't allocate gap: insufficient memory\n");
-			tt_record2("Couldn't allocate gap for id %d (start %d): no memory",
-				   rpc->id, start);
+			tt_rpc_record2(rpc->id, "Couldn't allocate gap for id %d (start %d): no memory",
+				       rpc->id, start);
 			goto discard;
 		}
 		rpc->msgin.recv_end = end;
@@ -145,13 +162,13 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 			if (end <= gap->start)
 				continue;
 			if (start < gap->start) {
-				tt_record4("Packet overlaps gap start: id %d, start %d, end %d, gap_start %d",
-					   rpc->id, start, end, gap->start);
+				tt_rpc_record4(rpc->id, "Packet overlaps gap start: id %d, start %d, end %d, gap_start %d",
+					       rpc->id, start, end, gap->start);
 				goto discard;
 			}
 			if (end > gap->end) {
-				tt_record4("Packet overlaps gap end: id %d, start %d, end %d, gap_end %d",
-					   rpc->id, start, end, gap->start);
+				tt_rpc_record4(rpc->id, "Packet overlaps gap end: id %d, start %d, end %d, gap_end %d",
+					       rpc->id, start, end, gap->start);
 				goto discard;
 			}
 			gap->start = end;
@@ -169,8 +186,8 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 			if (start >= gap->end)
 				continue;
 			if (end > gap->end) {
-				tt_record4("Packet overlaps gap end: id %d, start %d, end %d, gap_end %d",
-					   rpc->id, start, end, gap->start);
+				tt_rpc_record4(rpc->id, "Packet overlaps gap end: id %d, start %d, end %d, gap_end %d",
+					       rpc->id, start, end, gap->start);
 				goto discard;
 			}
 			gap->end = start;
@@ -181,8 +198,8 @@ void homa_add_packet(struct homa_rpc *rpc, struct sk_buff *skb)
 		gap2 = homa_gap_new(&gap->links, gap->start, start);
 		if (!gap2) {
 			pr_err("Homa couldn't allocate gap for split: insufficient memory\n");
-			tt_record2("Couldn't allocate gap for split for id %d (start %d): no memory",
-				   rpc->id, end);
+			tt_rpc_record2(rpc->id, "Couldn't allocate gap for split for id %d (start %d): no memory",
+				       rpc->id, end);
 			goto discard;
 		}
 		gap2->time = gap->time;
@@ -195,8 +212,8 @@ discard:
 		INC_METRIC(resent_discards, 1);
 	else
 		INC_METRIC(packet_discards, 1);
-	tt_record4("homa_add_packet discarding packet for id %d, offset %d, length %d, retransmit %d",
-		   rpc->id, start, length, h->retransmit);
+	tt_rpc_record4(rpc->id, "homa_add_packet discarding packet for id %d, offset %d, length %d, retransmit %d",
+		       rpc->id, start, length, h->retransmit);
 	kfree_skb(skb);
 	return;
 
@@ -205,6 +222,8 @@ keep:
 		INC_METRIC(resent_packets_used, 1);
 	__skb_queue_tail(&rpc->msgin.packets, skb);
 	rpc->msgin.bytes_remaining -= length;
+	if (rpc->msgin.bytes_remaining == 0)
+		rpc->msgin.complete_ns = sched_clock();
 }
 
 /**
@@ -265,11 +284,12 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 		 * run out of packets); copy any available packets out to
 		 * user space.
 		 */
+		rpc->msgin.copiers++;
 		atomic_or(RPC_COPYING_TO_USER, &rpc->flags);
 		homa_rpc_unlock(rpc);
 
-		tt_record1("starting copy to user space for id %d",
-			   rpc->id);
+		tt_rpc_record1(rpc->id, "starting copy to user space for id %d",
+			       rpc->id);
 
 		/* Each iteration of this loop copies out one skb. */
 		for (i = 0; i < n; i++) {
@@ -277,7 +297,7 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 					skbs[i]->data;
 			int pkt_length = homa_data_len(skbs[i]);
 			int offset = ntohl(h->seg.offset);
-			int buf_bytes, chunk_size;
+			int buf_bytes, chunk_size, zc_bytes;
 			struct iov_iter iter;
 			int copied = 0;
 			char *dst;
@@ -298,6 +318,21 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 					}
 					chunk_size = buf_bytes;
 				}
+				if (rpc->msgin.zc) {
+					zc_bytes = homa_pool_zc_add(rpc,
+							skbs[i],
+							sizeof(*h) + copied,
+							offset + copied,
+							chunk_size);
+					if (zc_bytes < 0) {
+						error = zc_bytes;
+						goto free_skbs;
+					}
+					if (zc_bytes > 0) {
+						copied += zc_bytes;
+						continue;
+					}
+				}
 				error = import_ubuf(READ, (void __user *)dst,
 						    chunk_size, &iter);
 				if (error)
@@ -314,19 +349,23 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 			if (end_offset == 0) {
 				start_offset = offset;
 			} else if (end_offset != offset) {
-				tt_record3("copied out bytes %d-%d for id %d",
-					   start_offset, end_offset, rpc->id);
+				tt_rpc_record3(rpc->id, "copied out bytes %d-%d for id %d",
+					       start_offset, end_offset, rpc->id);
 				start_offset = offset;
 			}
 			end_offset = offset + pkt_length;
 #endif /* See strip.py */
 		}
 
+		/* Deliver any bpages that are now complete. */
+		if (rpc->msgin.zc)
+			error = homa_pool_zc_map(rpc);
+
 free_skbs:
 #ifndef __STRIP__ /* See strip.py */
 		if (end_offset != 0) {
-			tt_record3("copied out bytes %d-%d for id %d",
-				   start_offset, end_offset, rpc->id);
+			tt_rpc_record3(rpc->id, "copied out bytes %d-%d for id %d",
+				       start_offset, end_offset, rpc->id);
 			end_offset = 0;
 		}
 #endif /* See strip.py */
@@ -335,22 +374,82 @@ free_skbs:
 			kfree_skb(skbs[i]);
 		INC_METRIC(skb_free_ns, sched_clock() - start);
 		INC_METRIC(skb_frees, n);
-		tt_record2("finished freeing %d skbs for id %d",
-			   n, rpc->id);
+		tt_rpc_record2(rpc->id, "finished freeing %d skbs for id %d",
+			       n, rpc->id);
 		n = 0;
 		atomic_or(APP_NEEDS_LOCK, &rpc->flags);
 		homa_rpc_lock(rpc, "homa_copy_to_user");
-		atomic_andnot(APP_NEEDS_LOCK | RPC_COPYING_TO_USER,
-			      &rpc->flags);
+		atomic_andnot(APP_NEEDS_LOCK, &rpc->flags);
+
+		/* A helper worker may be copying concurrently (see
+		 * homa_copy_work); only the last copier clears the flag.
+		 */
+		if (--rpc->msgin.copiers == 0)
+			atomic_andnot(RPC_COPYING_TO_USER, &rpc->flags);
 		if (error)
 			break;
 	}
 	if (error)
-		tt_record2("homa_copy_to_user returning error %d for id %d",
-			   -error, rpc->id);
+		tt_rpc_record2(rpc->id, "homa_copy_to_user returning error %d for id %d",
+			       -error, rpc->id);
 	return error;
 }
 
+/**
+ * homa_copy_work() - Invoked in a helper worker thread (scheduled by
+ * homa_data_pkt) to copy data from the packets of a large incoming message
+ * to user space, in parallel with the receiving thread. The goal is for
+ * most of the message to be in its buffers by the time the last packet
+ * arrives, so that recvmsg can return quickly.
+ * @work:    The msgin.copy_work field of the RPC.
+ */
+void homa_copy_work(struct work_struct *work)
+{
+	struct homa_rpc *rpc = container_of(work, struct homa_rpc,
+					    msgin.copy_work);
+	struct mm_struct *mm = homa_sock_pool(rpc->hsk)->mm;
+	bool mm_valid;
+
+	/* Note: RPC_COPY_QUEUED keeps the RPC (and hence the socket and
+	 * buffer pool) from being freed until we clear it.
+	 */
+	mm_valid = mmget_not_zero(mm);
+	if (mm_valid)
+		kthread_use_mm(mm);
+	homa_rpc_lock(rpc, "homa_copy_work");
+	if (mm_valid && rpc->state == RPC_INCOMING && !rpc->error &&
+	    skb_queue_len(&rpc->msgin.packets) != 0) {
+		tt_rpc_record2(rpc->id, "homa_copy_work starting for id %d, %d packets",
+			       rpc->id, skb_queue_len(&rpc->msgin.packets));
+		INC_METRIC(copyout_work_calls, 1);
+		rpc->error = homa_copy_to_user(rpc);
+
+		/* If the receiving thread saw the message complete while
+		 * we were copying, it went back to waiting; hand off the
+		 * RPC again so it can be returned.
+		 */
+		if (rpc->state != RPC_DEAD &&
+		    (rpc->error || (rpc->msgin.bytes_remaining == 0 &&
+				    rpc->msgin.copiers == 0)) &&
+		    !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
+			atomic_or(RPC_PKTS_READY, &rpc->flags);
+			homa_sock_lock(rpc->hsk, HOMA_LOCK_HANDOFF);
+			homa_rpc_handoff(rpc);
+			homa_sock_unlock(rpc->hsk);
+		}
+	}
+
+	/* Once this flag is cleared the RPC could be reaped, but not until
+	 * we unlock it.
+	 */
+	atomic_andnot(RPC_COPY_QUEUED, &rpc->flags);
+	homa_rpc_unlock(rpc);
+	if (mm_valid) {
+		kthread_unuse_mm(mm);
+		mmput(mm);
+	}
+}
+
 /**
  * homa_dispatch_pkts() - Top-level function that processes a batch of packets,
  * all related to the same RPC.
@@ -408,9 +507,9 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 		else
 			icmp_send(skb, ICMP_DEST_UNREACH,
 				  ICMP_PORT_UNREACH, 0);
-		tt_record3("Discarding packet(s) for unknown port %u, id %llu, type %d",
-			   dport, homa_local_id(h->common.sender_id),
-			   h->common.type);
+		tt_rpc_record3(homa_local_id(h->common.sender_id), "Discarding packet(s) for unknown port %u, id %llu, type %d",
+			       dport, homa_local_id(h->common.sender_id),
+			       h->common.type);
 		while (skb) {
 			next = skb->next;
 			kfree_skb(skb);
@@ -432,7 +531,7 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 
 			if (flags & APP_NEEDS_LOCK) {
 				homa_rpc_unlock(rpc);
-				tt_record2("softirq released lock for id %d, flags 0x%x", rpc->id, flags);
+				tt_rpc_record2(rpc->id, "softirq released lock for id %d, flags 0x%x", rpc->id, flags);
 				homa_spin(200);
 				rpc = NULL;
 			}
@@ -470,9 +569,9 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 			    h->common.type != NEED_ACK &&
 			    h->common.type != ACK &&
 			    h->common.type != RESEND) {
-				tt_record4("Discarding packet for unknown RPC, id %u, type %d, peer 0x%x:%d",
-					   id, h->common.type, tt_addr(saddr),
-					   ntohs(h->common.sport));
+				tt_rpc_record4(id, "Discarding packet for unknown RPC, id %u, type %d, peer 0x%x:%d",
+					       id, h->common.type, tt_addr(saddr),
+					       ntohs(h->common.sport));
 				if (h->common.type != GRANT ||
 				    homa_is_client(id))
 					INC_METRIC(unknown_rpcs, 1);
@@ -515,8 +614,8 @@ void homa_dispatch_pkts(struct sk_buff *skb, struct homa *homa)
 			break;
 		case BUSY:
 			INC_METRIC(packets_received[BUSY - DATA], 1);
-			tt_record2("received BUSY for id %d, peer 0x%x",
-				   id, tt_addr(rpc->peer->addr));
+			tt_rpc_record2(id, "received BUSY for id %d, peer 0x%x",
+				       id, tt_addr(rpc->peer->addr));
 			/* Nothing to do for these packets except reset
 			 * silent_ticks, which happened above.
 			 */
@@ -556,7 +655,7 @@ discard:
 		homa_rpc_acked(hsk, &saddr, &acks[num_acks]);
 	}
 
-	if (hsk->dead_skbs >= 2 * hsk->homa->dead_buffs_limit) {
+	if (atomic_read(&hsk->dead_skbs) >= 2 * hsk->homa->dead_buffs_limit) {
 		/* We get here if neither homa_wait_for_message
 		 * nor homa_timer can keep up with reaping dead
 		 * RPCs. See reap.txt for details.
@@ -581,21 +680,28 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 	struct homa_data_hdr *h = (struct homa_data_hdr *)skb->data;
 	struct homa *homa = rpc->hsk->homa;
 
-	tt_record4("incoming data packet, id %d, peer 0x%x, offset %d/%d",
-		   homa_local_id(h->common.sender_id),
-		   tt_addr(rpc->peer->addr), ntohl(h->seg.offset),
-		   ntohl(h->message_length));
+	tt_rpc_record4(homa_local_id(h->common.sender_id), "incoming data packet, id %d, peer 0x%x, offset %d/%d",
+		       homa_local_id(h->common.sender_id),
+		       tt_addr(rpc->peer->addr), ntohl(h->seg.offset),
+		       ntohl(h->message_length));
 
 	if (rpc->state != RPC_INCOMING && homa_is_client(rpc->id)) {
 		if (unlikely(rpc->state != RPC_OUTGOING))
 			goto discard;
 		INC_METRIC(responses_received, 1);
 		rpc->state = RPC_INCOMING;
-		tt_record2("Incoming message for id %d has %d unscheduled bytes",
-			   rpc->id, ntohl(h->incoming));
+		tt_rpc_record2(rpc->id, "Incoming message for id %d has %d unscheduled bytes",
+			       rpc->id, ntohl(h->incoming));
 		if (homa_message_in_init(rpc, ntohl(h->message_length),
 					 ntohl(h->incoming)) != 0)
 			goto discard;
+		if (rpc->hsk->connect) {
+			INC_CONN_STAT(rpc->hsk, responses_received, 1);
+			INC_CONN_STAT(rpc->hsk, bytes_received,
+				      rpc->msgin.length);
+			homa_sock_rtt_sample(rpc->hsk,
+					     sched_clock() - rpc->start_ns);
+		}
 	} else if (rpc->state != RPC_INCOMING) {
 		/* Must be server; note that homa_rpc_new_server already
 		 * initialized msgin and allocated buffers.
@@ -604,29 +710,49 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 			goto discard;
 	}
 
-	if (rpc->msgin.num_bpages == 0) {
+	if (!homa_msgin_has_space(rpc)) {
 		/* Drop packets that arrive when we can't allocate buffer
 		 * space. If we keep them around, packet buffer usage can
 		 * exceed available cache space, resulting in poor
 		 * performance.
 		 */
-		tt_record4("Dropping packet because no buffer space available: id %d, offset %d, length %d, old incoming %d",
-			   rpc->id, ntohl(h->seg.offset), homa_data_len(skb),
-			   rpc->msgin.granted);
+		tt_rpc_record4(rpc->id, "Dropping packet because no buffer space available: id %d, offset %d, length %d, old incoming %d",
+			       rpc->id, ntohl(h->seg.offset), homa_data_len(skb),
+			       rpc->msgin.granted);
 		INC_METRIC(dropped_data_no_bufs, homa_data_len(skb));
 		goto discard;
 	}
 
+	/* Record the NAPI instance for the socket, so that epoll_wait can
+	 * busy-poll that device queue (net.core.busy_poll).
+	 */
+	sk_mark_napi_id(&rpc->hsk->sock, skb);
 	homa_add_packet(rpc, skb);
 
 	if (skb_queue_len(&rpc->msgin.packets) != 0 &&
 	    !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
 		atomic_or(RPC_PKTS_READY, &rpc->flags);
-		homa_sock_lock(rpc->hsk, "homa_data_pkt");
+		homa_sock_lock(rpc->hsk, HOMA_LOCK_HANDOFF);
 		homa_rpc_handoff(rpc);
 		homa_sock_unlock(rpc->hsk);
 	}
 
+	/* For large messages, start copying data to user space in a helper
+	 * worker as soon as a few packets have accumulated, rather than
+	 * leaving all of the copying to the receiving thread.
+	 */
+	if (homa->copyout_workers &&
+	    rpc->msgin.length >= homa->copyout_min_bytes &&
+	    !rpc->msgin.zc && !rpc->msgin.inline_msg &&
+	    homa_sock_pool(rpc->hsk)->mm &&
+	    !(atomic_read(&rpc->flags) & RPC_COPY_QUEUED) &&
+	    (skb_queue_len(&rpc->msgin.packets) >= HOMA_COPYOUT_BATCH ||
+	     (rpc->msgin.bytes_remaining == 0 &&
+	      skb_queue_len(&rpc->msgin.packets) != 0))) {
+		atomic_or(RPC_COPY_QUEUED, &rpc->flags);
+		queue_work(system_unbound_wq, &rpc->msgin.copy_work);
+	}
+
 	if (ntohs(h->cutoff_version) != homa->cutoff_version) {
 		/* The sender has out-of-date cutoffs. Note: we may need
 		 * to resend CUTOFFS packets if one gets lost, but we don't
@@ -667,9 +793,9 @@ void homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 	struct homa_grant_hdr *h = (struct homa_grant_hdr *)skb->data;
 	int new_offset = ntohl(h->offset);
 
-	tt_record4("processing grant for id %llu, offset %d, priority %d, increment %d",
-		   homa_local_id(h->common.sender_id), ntohl(h->offset),
-		   h->priority, new_offset - rpc->msgout.granted);
+	tt_rpc_record4(homa_local_id(h->common.sender_id), "processing grant for id %llu, offset %d, priority %d, increment %d",
+		       homa_local_id(h->common.sender_id), ntohl(h->offset),
+		       h->priority, new_offset - rpc->msgout.granted);
 	if (rpc->state == RPC_OUTGOING) {
 		if (h->resend_all)
 			homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
@@ -705,21 +831,21 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 	struct homa_busy_hdr busy;
 
 	if (!rpc) {
-		tt_record4("resend request for unknown id %d, peer 0x%x:%d, offset %d; responding with UNKNOWN",
-			   homa_local_id(h->common.sender_id), tt_addr(saddr),
-			   ntohs(h->common.sport), ntohl(h->offset));
+		tt_rpc_record4(homa_local_id(h->common.sender_id), "resend request for unknown id %d, peer 0x%x:%d, offset %d; responding with UNKNOWN",
+			       homa_local_id(h->common.sender_id), tt_addr(saddr),
+			       ntohs(h->common.sport), ntohl(h->offset));
 		homa_xmit_unknown(skb, hsk);
 		goto done;
 	}
-	tt_record4("resend request for id %llu, offset %d, length %d, prio %d",
-		   rpc->id, ntohl(h->offset), ntohl(h->length), h->priority);
+	tt_rpc_record4(rpc->id, "resend request for id %llu, offset %d, length %d, prio %d",
+		       rpc->id, ntohl(h->offset), ntohl(h->length), h->priority);
 
 	if (!homa_is_client(rpc->id) && rpc->state != RPC_OUTGOING) {
 		/* We are the server for this RPC and don't yet have a
 		 * response packet, so just send BUSY.
 		 */
-		tt_record2("sending BUSY from resend, id %d, state %d",
-			   rpc->id, rpc->state);
+		tt_rpc_record2(rpc->id, "sending BUSY from resend, id %d, state %d",
+			       rpc->id, rpc->state);
 		homa_xmit_control(BUSY, &busy, sizeof(busy), rpc);
 		goto done;
 	}
@@ -727,9 +853,9 @@ void homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 		/* We have chosen not to transmit data from this message;
 		 * send BUSY instead.
 		 */
-		tt_record3("sending BUSY from resend, id %d, offset %d, granted %d",
-			   rpc->id, rpc->msgout.next_xmit_offset,
-			   rpc->msgout.granted);
+		tt_rpc_record3(rpc->id, "sending BUSY from resend, id %d, offset %d, granted %d",
+			       rpc->id, rpc->msgout.next_xmit_offset,
+			       rpc->msgout.granted);
 		homa_xmit_control(BUSY, &busy, sizeof(busy), rpc);
 	} else {
 		if (ntohl(h->length) == 0)
@@ -755,16 +881,16 @@ done:
  */
 void homa_unknown_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 {
-	tt_record3("Received unknown for id %llu, peer %x:%d",
-		   rpc->id, tt_addr(rpc->peer->addr), rpc->dport);
+	tt_rpc_record3(rpc->id, "Received unknown for id %llu, peer %x:%d",
+		       rpc->id, tt_addr(rpc->peer->addr), rpc->dport);
 	if (homa_is_client(rpc->id)) {
 		if (rpc->state == RPC_OUTGOING) {
 			/* It appears that everything we've already transmitted
 			 * has been lost; retransmit it.
 			 */
-			tt_record4("Restarting id %d to server 0x%x:%d, lost %d bytes",
-				   rpc->id, tt_addr(rpc->peer->addr),
-				   rpc->dport, rpc->msgout.next_xmit_offset);
+			tt_rpc_record4(rpc->id, "Restarting id %d to server 0x%x:%d, lost %d bytes",
+				       rpc->id, tt_addr(rpc->peer->addr),
+				       rpc->dport, rpc->msgout.next_xmit_offset);
 			homa_freeze(rpc, RESTART_RPC,
 				    "Freezing because of RPC restart, id %d, peer 0x%x");
 			homa_resend_data(rpc, 0, rpc->msgout.next_xmit_offset,
@@ -777,9 +903,9 @@ void homa_unknown_pkt(struct sk_buff *skb, struct homa_rpc *rpc)
 		pr_err("Received unknown for RPC id %llu, peer %s:%d in bogus state %d; discarding unknown\n",
 		       rpc->id, homa_print_ipv6_addr(&rpc->peer->addr),
 		       rpc->dport, rpc->state);
-		tt_record4("Discarding unknown for RPC id %d, peer 0x%x:%d: bad state %d",
-			   rpc->id, tt_addr(rpc->peer->addr), rpc->dport,
-			   rpc->state);
+		tt_rpc_record4(rpc->id, "Discarding unknown for RPC id %d, peer 0x%x:%d: bad state %d",
+			       rpc->id, tt_addr(rpc->peer->addr), rpc->dport,
+			       rpc->state);
 	} else {
 		if (rpc->hsk->homa->verbose)
 			pr_notice("Freeing rpc id %llu from client %s:%d: unknown to client",
@@ -833,7 +959,7 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	struct homa_peer *peer;
 	struct homa_ack_hdr ack;
 
-	tt_record1("Received NEED_ACK for id %d", id);
+	tt_rpc_record1(id, "Received NEED_ACK for id %d", id);
 
 	/* Return if it's not safe for the peer to purge its state
 	 * for this RPC (the RPC still exists and we haven't received
@@ -842,8 +968,8 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	if (rpc && (rpc->state != RPC_INCOMING ||
 		    rpc->msgin.bytes_remaining)) {
 #ifndef __STRIP__ /* See strip.py */
-		tt_record3("NEED_ACK arrived for id %d before message received, state %d, remaining %d",
-			   rpc->id, rpc->state, rpc->msgin.bytes_remaining);
+		tt_rpc_record3(rpc->id, "NEED_ACK arrived for id %d before message received, state %d, remaining %d",
+			       rpc->id, rpc->state, rpc->msgin.bytes_remaining);
 		homa_freeze(rpc, NEED_ACK_MISSING_DATA,
 			    "Freezing because NEED_ACK received before message complete, id %d, peer 0x%x");
 #endif /* See strip.py */
@@ -868,8 +994,8 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 						HOMA_MAX_ACKS_PER_PKT,
 						ack.acks));
 	__homa_xmit_control(&ack, sizeof(ack), peer, hsk);
-	tt_record3("Responded to NEED_ACK for id %d, peer %0x%x with %d other acks",
-		   id, tt_addr(saddr), ntohs(ack.num_acks));
+	tt_rpc_record3(id, "Responded to NEED_ACK for id %d, peer %0x%x with %d other acks",
+		       id, tt_addr(saddr), ntohs(ack.num_acks));
 
 done:
 	kfree_skb(skb);
@@ -893,7 +1019,7 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	int i, count;
 
 	if (rpc) {
-		tt_record1("homa_ack_pkt freeing rpc id %d", rpc->id);
+		tt_rpc_record1(rpc->id, "homa_ack_pkt freeing rpc id %d", rpc->id);
 		homa_rpc_free(rpc);
 		homa_rpc_unlock(rpc);
 	}
@@ -901,8 +1027,8 @@ void homa_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	count = ntohs(h->num_acks);
 	for (i = 0; i < count; i++)
 		homa_rpc_acked(hsk, &saddr, &h->acks[i]);
-	tt_record3("ACK received for id %d, peer 0x%x, with %d other acks",
-		   homa_local_id(h->common.sender_id), tt_addr(saddr), count);
+	tt_rpc_record3(homa_local_id(h->common.sender_id), "ACK received for id %d, peer 0x%x, with %d other acks",
+		       homa_local_id(h->common.sender_id), tt_addr(saddr), count);
 	kfree_skb(skb);
 }
 
@@ -999,15 +1125,15 @@ void homa_rpc_abort(struct homa_rpc *rpc, int error)
 {
 	if (!homa_is_client(rpc->id)) {
 		INC_METRIC(server_rpc_discards, 1);
-		tt_record3("aborting server RPC: peer 0x%x, id %d, error %d",
-			   tt_addr(rpc->peer->addr), rpc->id, error);
+		tt_rpc_record3(rpc->id, "aborting server RPC: peer 0x%x, id %d, error %d",
+			       tt_addr(rpc->peer->addr), rpc->id, error);
 		homa_rpc_free(rpc);
 		return;
 	}
-	tt_record3("aborting client RPC: peer 0x%x, id %d, error %d",
-		   tt_addr(rpc->peer->addr), rpc->id, error);
+	tt_rpc_record3(rpc->id, "aborting client RPC: peer 0x%x, id %d, error %d",
+		       tt_addr(rpc->peer->addr), rpc->id, error);
 	rpc->error = error;
-	homa_sock_lock(rpc->hsk, "homa_rpc_abort");
+	homa_sock_lock(rpc->hsk, HOMA_LOCK_HANDOFF);
 	if (!rpc->hsk->shutdown)
 		homa_rpc_handoff(rpc);
 	homa_sock_unlock(rpc->hsk);
@@ -1026,6 +1152,7 @@ void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 		     int port, int error)
 {
 	struct homa_socktab_scan scan;
+	struct homa_rpc_shard *shard;
 	struct homa_rpc *rpc, *tmp;
 	struct homa_sock *hsk;
 
@@ -1035,12 +1162,11 @@ void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
 		/* Skip the (expensive) lock acquisition if there's no
 		 * work to do.
 		 */
-		if (list_empty(&hsk->active_rpcs))
+		if (!homa_sock_has_active_rpcs(hsk))
 			continue;
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_safe(rpc, tmp, &hsk->active_rpcs,
-					 active_links) {
+		homa_for_each_active_rpc_safe(rpc, tmp, shard, hsk) {
 			if (!ipv6_addr_equal(&rpc->peer->addr, addr))
 				continue;
 			if (port && rpc->dport != port)
@@ -1067,14 +1193,15 @@ void homa_abort_rpcs(struct homa *homa, const struct in6_addr *addr,
  */
 void homa_abort_sock_rpcs(struct homa_sock *hsk, int error)
 {
+	struct homa_rpc_shard *shard;
 	struct homa_rpc *rpc, *tmp;
 
 	rcu_read_lock();
-	if (list_empty(&hsk->active_rpcs))
+	if (!homa_sock_has_active_rpcs(hsk))
 		goto done;
 	if (!homa_protect_rpcs(hsk))
 		goto done;
-	list_for_each_entry_safe(rpc, tmp, &hsk->active_rpcs, active_links) {
+	homa_for_each_active_rpc_safe(rpc, tmp, shard, hsk) {
 		if (!homa_is_client(rpc->id))
 			continue;
 		homa_rpc_lock(rpc, "homa_abort_sock_rpcs");
@@ -1082,9 +1209,9 @@ void homa_abort_sock_rpcs(struct homa_sock *hsk, int error)
 			homa_rpc_unlock(rpc);
 			continue;
 		}
-		tt_record4("homa_abort_sock_rpcs aborting id %u on port %d, peer 0x%x, error %d",
-			   rpc->id, hsk->port,
-			   tt_addr(rpc->peer->addr), error);
+		tt_rpc_record4(rpc->id, "homa_abort_sock_rpcs aborting id %u on port %d, peer 0x%x, error %d",
+			       rpc->id, hsk->port,
+			       tt_addr(rpc->peer->addr), error);
 		if (error)
 			homa_rpc_abort(rpc, error);
 		else
@@ -1120,6 +1247,7 @@ int homa_register_interests(struct homa_interest *interest,
 
 	homa_interest_init(interest);
 	interest->locked = 1;
+	interest->polling = 1;
 	if (id != 0) {
 		if (!homa_is_client(id))
 			return -EINVAL;
@@ -1135,7 +1263,7 @@ int homa_register_interests(struct homa_interest *interest,
 	/* Need both the RPC lock (acquired above) and the socket lock to
 	 * avoid races.
 	 */
-	homa_sock_lock(hsk, "homa_register_interests");
+	homa_sock_lock(hsk, HOMA_LOCK_RECV);
 	if (hsk->shutdown) {
 		homa_sock_unlock(hsk);
 		if (rpc)
@@ -1184,6 +1312,12 @@ int homa_register_interests(struct homa_interest *interest,
 	return 0;
 
 claim_rpc:
+	if (unlikely(hsk->group) && !list_empty(&rpc->ready_links)) {
+		/* RPC requested by id may be queued in the socket's group. */
+		homa_sock_lock(hsk->group, HOMA_LOCK_RECV);
+		list_del_init(&rpc->ready_links);
+		homa_sock_unlock(hsk->group);
+	}
 	list_del_init(&rpc->ready_links);
 	if (!list_empty(&hsk->ready_requests) ||
 	    !list_empty(&hsk->ready_responses)) {
@@ -1208,6 +1342,54 @@ claim_rpc:
 	return 0;
 }
 
+/**
+ * homa_poll_ns() - Compute how long a thread receiving on a socket should
+ * busy-wait for an incoming message before going to sleep.
+ * @hsk:     Socket on which the thread is waiting.
+ * Return:   Polling interval, in sched_clock() units (ns).
+ */
+__u64 homa_poll_ns(struct homa_sock *hsk)
+{
+	__u64 limit = 1000ULL * hsk->homa->poll_usecs;
+	__u64 gap;
+
+	if (!hsk->homa->adaptive_poll)
+		return limit;
+
+	/* If messages arrive less often than the polling limit, polling
+	 * will usually fail, so it's just wasted CPU time. Otherwise poll
+	 * long enough to cover a bit more than the typical gap.
+	 */
+	gap = READ_ONCE(hsk->avg_handoff_gap_ns);
+	if (gap > limit) {
+		INC_METRIC(adaptive_poll_skips, 1);
+		return 0;
+	}
+	gap *= 2;
+	if (gap < limit / 4)
+		gap = limit / 4;
+	if (gap > limit)
+		gap = limit;
+	return gap;
+}
+
+/**
+ * homa_record_handoff() - Record the time between when an RPC was handed
+ * off and when a receiving thread discovered it.
+ * @rpc:        RPC that was received; rpc->handoff_ns must be set.
+ * @histogram:  Array of HOMA_HANDOFF_BUCKETS counters in which to record
+ *              the delay (bucket i counts delays less than 256 << i ns).
+ */
+static void homa_record_handoff(struct homa_rpc *rpc, __u64 *histogram)
+{
+	__u64 ns = sched_clock() - rpc->handoff_ns;
+	int bucket = fls64(ns >> 8);
+
+	if (bucket >= HOMA_HANDOFF_BUCKETS)
+		bucket = HOMA_HANDOFF_BUCKETS - 1;
+	histogram[bucket]++;
+}
+
 /**
  * homa_wait_for_message() - Wait for receipt of an incoming message
  * that matches the parameters. Various other activities can occur while
@@ -1225,9 +1407,10 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 				       __u64 id)
 	__acquires(&rpc->bucket_lock)
 {
-	__u64 poll_start, poll_end, now;
+	__u64 poll_start, poll_end, now, reap_start;
 	int error, blocked = 0, polled = 0;
 	struct homa_rpc *result = NULL;
+	__u64 *handoff_histogram;
 	struct homa_interest interest;
 	struct homa_rpc *rpc = NULL;
 
@@ -1239,6 +1422,7 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 	 */
 	while (1) {
 		error = homa_register_interests(&interest, hsk, flags, id);
+		handoff_histogram = homa_metrics_per_cpu()->handoff_queued_ns;
 		rpc = (struct homa_rpc *)atomic_long_read(&interest.ready_rpc);
 		if (rpc)
 			goto found_rpc;
@@ -1248,20 +1432,28 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 
 		/* There is no ready RPC so far. Clean up dead RPCs before
-		 * going to sleep (or returning, if in nonblocking mode).
+		 * going to sleep (or returning, if in nonblocking mode),
+		 * unless reaping is handled by helper workers; in that case
+		 * just make sure a worker will run.
 		 */
-		while (1) {
+		handoff_histogram = homa_metrics_per_cpu()->handoff_polled_ns;
+		reap_start = sched_clock();
+		while (!homa_rpc_queue_reap(hsk, 0)) {
 			int reaper_result;
 			rpc = (struct homa_rpc *)atomic_long_read(&interest
 								  .ready_rpc);
 			if (rpc) {
-				tt_record1("received RPC handoff while reaping, id %d",
-					   rpc->id);
+				tt_rpc_record1(rpc->id, "received RPC handoff while reaping, id %d",
+					       rpc->id);
+				INC_METRIC(wait_reap_ns,
+					   sched_clock() - reap_start);
 				goto found_rpc;
 			}
 			reaper_result = homa_rpc_reap(hsk,
 						      hsk->homa->reap_limit);
 			if (reaper_result == 0) {
+				INC_METRIC(wait_reap_ns,
+					   sched_clock() - reap_start);
 				break;
 			}
 
@@ -1278,18 +1470,19 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		// 	   hsk->homa->poll_usecs);
 
 		/* Busy-wait for a while before going to sleep; this avoids
-		 * context-switching overhead to wake up.
+		 * context-switching overhead to wake up. While we're polling,
+		 * homa_rpc_handoff won't bother to wake us up.
 		 */
 		now = sched_clock();
 		poll_start = now;
-		poll_end = now + (1000 * hsk->homa->poll_usecs);
+		poll_end = now + homa_poll_ns(hsk);
 		while (1) {
 			__u64 blocked;
 			rpc = (struct homa_rpc *)atomic_long_read(&interest.ready_rpc);
 			if (rpc) {
-				tt_record3("received RPC handoff while polling, id %d, socket %d, pid %d",
-					   rpc->id, hsk->port,
-					   current->pid);
+				tt_rpc_record3(rpc->id, "received RPC handoff while polling, id %d, socket %d, pid %d",
+					       rpc->id, hsk->port,
+					       current->pid);
 				polled = 1;
 				INC_METRIC(poll_ns, now - poll_start);
 				goto found_rpc;
@@ -1309,8 +1502,14 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			   hsk->port, current->pid);
 		INC_METRIC(poll_ns, now - poll_start);
 
-		/* Now it's time to sleep. */
+		/* Now it's time to sleep. Once polling is cleared, handoffs
+		 * must wake us up; set_current_state provides the memory
+		 * barrier that pairs with the one in homa_rpc_handoff, so
+		 * either we see ready_rpc here or homa_rpc_handoff sees
+		 * that we are no longer polling.
+		 */
 		per_cpu(homa_offload_core, interest.core).last_app_active = now;
+		WRITE_ONCE(interest.polling, 0);
 		set_current_state(TASK_INTERRUPTIBLE);
 		rpc = (struct homa_rpc *)atomic_long_read(&interest.ready_rpc);
 		if (!rpc && !hsk->shutdown) {
@@ -1322,6 +1521,8 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 			end = sched_clock();
 			blocked = 1;
 			INC_METRIC(blocked_ns, end - start);
+			handoff_histogram =
+					homa_metrics_per_cpu()->handoff_woken_ns;
 		}
 		__set_current_state(TASK_RUNNING);
 
@@ -1341,7 +1542,7 @@ found_rpc:
 		if (interest.reg_rpc ||
 		    interest.request_links.next != LIST_POISON1 ||
 		    interest.response_links.next != LIST_POISON1) {
-			homa_sock_lock(hsk, "homa_wait_for_message");
+			homa_sock_lock(hsk, HOMA_LOCK_RECV);
 			if (interest.reg_rpc)
 				interest.reg_rpc->interest = NULL;
 			if (interest.request_links.next != LIST_POISON1)
@@ -1357,8 +1558,9 @@ found_rpc:
 		 */
 		rpc = (struct homa_rpc *)atomic_long_read(&interest.ready_rpc);
 		if (rpc) {
-			tt_record2("homa_wait_for_message found rpc id %d, pid %d",
-				   rpc->id, current->pid);
+			tt_rpc_record2(rpc->id, "homa_wait_for_message found rpc id %d, pid %d",
+				       rpc->id, current->pid);
+			homa_record_handoff(rpc, handoff_histogram);
 			if (!interest.locked) {
 				atomic_or(APP_NEEDS_LOCK, &rpc->flags);
 				homa_rpc_lock(rpc, "homa_wait_for_message");
@@ -1367,7 +1569,7 @@ found_rpc:
 			} else {
 				atomic_andnot(RPC_HANDING_OFF, &rpc->flags);
 			}
-			if (!rpc->error) {
+			if (!rpc->error && !rpc->msgin.inline_msg) {
 				rpc->error = homa_copy_to_user(rpc);
 			}
 			if (rpc->state == RPC_DEAD) {
@@ -1378,8 +1580,15 @@ found_rpc:
 				goto done;
 			}
 			atomic_andnot(RPC_PKTS_READY, &rpc->flags);
+
+			/* If a helper worker is still copying, wait for it;
+			 * it will hand off the RPC again when it finishes.
+			 * Inline messages keep their packets until recvmsg.
+			 */
 			if (rpc->msgin.bytes_remaining == 0 &&
-			    !skb_queue_len(&rpc->msgin.packets)) {
+			    (!skb_queue_len(&rpc->msgin.packets) ||
+			     rpc->msgin.inline_msg) &&
+			    rpc->msgin.copiers == 0) {
 				goto done;
 			}
 			homa_rpc_unlock(rpc);
@@ -1442,19 +1651,49 @@ struct homa_interest *homa_choose_interest(struct homa *homa,
 /**
  * homa_rpc_handoff() - This function is called when the input message for
  * an RPC is ready for attention from a user thread. It either notifies
- * a waiting reader or queues the RPC.
+ * a waiting reader or queues the RPC. If the RPC's socket is a member of
+ * a socket group, the waiting readers and queues of the group are used.
  * @rpc:                RPC to handoff; must be locked. The caller must
  *			also have locked the socket for this RPC.
  */
 void homa_rpc_handoff(struct homa_rpc *rpc)
 {
 	struct homa_sock *hsk = rpc->hsk;
+	struct homa_sock *group = NULL;
 	struct homa_interest *interest;
+	struct task_struct *thread;
+	__u64 now, gap;
+	int polling;
 
 	if ((atomic_read(&rpc->flags) & RPC_HANDING_OFF) ||
 	    !list_empty(&rpc->ready_links))
 		return;
 
+	/* Lock order is member socket, then group socket. If the group
+	 * has been shut down, fall back to the member's own queues.
+	 */
+	if (unlikely(hsk->group)) {
+		homa_sock_lock(hsk->group, HOMA_LOCK_HANDOFF);
+		if (likely(!hsk->group->shutdown)) {
+			group = hsk->group;
+			hsk = group;
+		} else {
+			homa_sock_unlock(hsk->group);
+		}
+	}
+
+	/* Keep a running average of the time between handoffs on this
+	 * socket (used by homa_poll_ns to decide how long to poll).
+	 */
+	now = sched_clock();
+	rpc->handoff_ns = now;
+	if (hsk->last_handoff_ns != 0) {
+		gap = now - hsk->last_handoff_ns;
+		WRITE_ONCE(hsk->avg_handoff_gap_ns, hsk->avg_handoff_gap_ns
+			   - (hsk->avg_handoff_gap_ns >> 3) + (gap >> 3));
+	}
+	hsk->last_handoff_ns = now;
+
 	/* First, see if someone is interested in this RPC specifically.
 	 */
 	if (rpc->interest) {
@@ -1489,8 +1728,10 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 
 	/* Notify the poll mechanism. */
 	hsk->sock.sk_data_ready(&hsk->sock);
-	tt_record2("homa_rpc_handoff finished queuing id %d for port %d",
-		   rpc->id, hsk->port);
+	tt_rpc_record2(rpc->id, "homa_rpc_handoff finished queuing id %d for port %d",
+		       rpc->id, hsk->port);
+	if (group)
+		homa_sock_unlock(group);
 	return;
 
 thread_waiting:
@@ -1502,15 +1743,24 @@ thread_waiting:
 	atomic_or(RPC_HANDING_OFF, &rpc->flags);
 	interest->locked = 0;
 	INC_METRIC(handoffs_thread_waiting, 1);
-	tt_record3("homa_rpc_handoff handing off id %d to pid %d on core %d",
-		   rpc->id, interest->thread->pid, task_cpu(interest->thread));
+	tt_rpc_record3(rpc->id, "homa_rpc_handoff handing off id %d to pid %d on core %d",
+		       rpc->id, interest->thread->pid, task_cpu(interest->thread));
+	thread = interest->thread;
 	atomic_long_set_release(&interest->ready_rpc, (long)rpc);
 
+	/* Must read @polling after setting ready_rpc; this barrier pairs
+	 * with set_current_state in homa_wait_for_message. @polling must
+	 * also be read before clearing the interest below: once that
+	 * happens, the waiting thread can return without the socket lock
+	 * and @interest may disappear.
+	 */
+	smp_mb();
+	polling = READ_ONCE(interest->polling);
+
 	/* Update the last_app_active time for the thread's core, so Homa
 	 * will try to avoid doing any work there.
 	 */
-	per_cpu(homa_offload_core, interest->core).last_app_active =
-			sched_clock();
+	per_cpu(homa_offload_core, interest->core).last_app_active = now;
 
 	/* Clear the interest. This serves two purposes. First, it saves
 	 * the waking thread from acquiring the socket lock again, which
@@ -1525,7 +1775,12 @@ thread_waiting:
 		list_del(&interest->request_links);
 	if (interest->response_links.next != LIST_POISON1)
 		list_del(&interest->response_links);
-	wake_up_process(interest->thread);
+	if (group)
+		homa_sock_unlock(group);
+	if (polling)
+		INC_METRIC(handoffs_no_wakeup, 1);
+	else
+		wake_up_process(thread);
 }
 
 /**
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+/* This file implements Homa's lock contention profiler. When the
+ * lock_profile sysctl parameter is nonzero, each of the *_lock_slow
+ * functions reports its wait here, along with the call site that was
+ * waiting and the call site that held the lock when the wait began.
+ * The information is available in /proc/net/homa_locks.
+ */
+
+#include "homa_impl.h"
+
+/* Nonzero means lock profiling is enabled; mirrors homa->lock_profile. */
+int homa_lockprof_active;
+
+/* All of the profiling information; shared by all cores. */
+struct homa_lockprof homa_lockprof;
+
+/* Printable names for the values of enum homa_lock_class. */
+static const char * const homa_lock_class_names[HOMA_LOCK_CLASSES] = {
+	"socket",
+	"bucket",
+	"shard",
+	"grantable",
+	"throttle",
+	"peer",
+};
+
+/**
+ * homa_lockprof_find() - Find the entry in homa_lockprof.sites for a
+ * given call site, creating a new entry if needed.
+ * @lock_class:  Kind of lock acquired at @site.
+ * @site:        Code address of the call site.
+ * Return:       The entry for @site, or NULL if the table is full.
+ */
+static struct homa_lockprof_site *homa_lockprof_find(enum homa_lock_class
+						     lock_class,
+						     unsigned long site)
+{
+	struct homa_lockprof_site *entry;
+	unsigned long old;
+	int i, index;
+
+	/* A given call site always acquires the same class of lock, so
+	 * the site alone is enough to identify an entry.
+	 */
+	index = hash_long(site, ilog2(HOMA_LOCKPROF_SITES));
+	for (i = 0; i < HOMA_LOCKPROF_SITES; i++) {
+		entry = &homa_lockprof.sites[(index + i) &
+					     (HOMA_LOCKPROF_SITES - 1)];
+		old = READ_ONCE(entry->site);
+		if (old == 0) {
+			old = cmpxchg(&entry->site, 0, site);
+			if (old == 0) {
+				WRITE_ONCE(entry->lock_class, lock_class);
+				return entry;
+			}
+		}
+		if (old == site)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * homa_lockprof_record() - Record information about one wait for a lock.
+ * @lock_class:  Kind of lock that was waited for.
+ * @site:        Code address of the call site that waited.
+ * @holder:      Code address of the call site that held the lock when
+ *               the wait began, or 0 if unknown.
+ * @wait_ns:     How long the wait lasted.
+ */
+void homa_lockprof_record(enum homa_lock_class lock_class, unsigned long site,
+			  unsigned long holder, __u64 wait_ns)
+{
+	struct homa_lockprof_holder *h;
+	struct homa_lockprof_site *entry;
+	unsigned long old;
+	__s64 max, prev;
+	int bucket, i;
+
+	entry = homa_lockprof_find(lock_class, site);
+	if (!entry) {
+		atomic64_inc(&homa_lockprof.dropped);
+		return;
+	}
+	atomic64_inc(&entry->waits);
+	atomic64_add(wait_ns, &entry->wait_ns);
+	max = atomic64_read(&entry->max_wait_ns);
+	while ((__s64)wait_ns > max) {
+		prev = atomic64_cmpxchg(&entry->max_wait_ns, max, wait_ns);
+		if (prev == max)
+			break;
+		max = prev;
+	}
+	bucket = fls64(wait_ns >> 8);
+	if (bucket >= HOMA_LOCKPROF_BUCKETS)
+		bucket = HOMA_LOCKPROF_BUCKETS - 1;
+	atomic64_inc(&entry->hist[bucket]);
+
+	if (holder != 0) {
+		for (i = 0; i < HOMA_LOCKPROF_HOLDERS; i++) {
+			h = &entry->holders[i];
+			old = READ_ONCE(h->site);
+			if (old == 0)
+				old = cmpxchg(&h->site, 0, holder);
+			if (old == 0 || old == holder) {
+				atomic64_inc(&h->count);
+				return;
+			}
+		}
+	}
+	atomic64_inc(&entry->other_holders);
+}
+
+/**
+ * homa_lockprof_reset() - Discard all existing profiling information.
+ * Waits recorded concurrently with this function may be partially lost.
+ */
+void homa_lockprof_reset(void)
+{
+	memset(&homa_lockprof, 0, sizeof(homa_lockprof));
+}
+
+/**
+ * homa_lockprof_sysctl_changed() - Invoked whenever a sysctl value is
+ * changed; enables or disables lock profiling to match homa->lock_profile.
+ * Profiling information is reset each time profiling is enabled.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_lockprof_sysctl_changed(struct homa *homa)
+{
+	if (homa->lock_profile && !homa_lockprof_active)
+		homa_lockprof_reset();
+	WRITE_ONCE(homa_lockprof_active, homa->lock_profile != 0);
+}
+
+/**
+ * homa_lockprof_show() - Generates the contents of /proc/net/homa_locks,
+ * which contains one line for each call site that has waited for a lock
+ * since profiling was last enabled.
+ * @s:       Output is generated here.
+ * @v:       Not used.
+ *
+ * Return:   Always 0.
+ */
+int homa_lockprof_show(struct seq_file *s, void *v)
+{
+	struct homa_lockprof_site *entry;
+	struct homa_lockprof_holder *h;
+	__u64 waits;
+	int i, j;
+
+	seq_printf(s, "# Lock profiling is %s; waits dropped (table full): %llu\n",
+		   homa_lockprof_active ? "enabled" : "disabled",
+		   (__u64)atomic64_read(&homa_lockprof.dropped));
+	seq_printf(s, "# Histogram bucket i counts waits < 256 << i ns (last bucket: all larger)\n");
+	seq_printf(s, "%-9s %10s %14s %12s  %-40s %s | %s\n", "class", "waits",
+		   "wait_ns", "max_ns", "site", "histogram",
+		   "holders (site:count)");
+	for (i = 0; i < HOMA_LOCKPROF_SITES; i++) {
+		entry = &homa_lockprof.sites[i];
+		if (READ_ONCE(entry->site) == 0)
+			continue;
+		waits = atomic64_read(&entry->waits);
+		if (waits == 0)
+			continue;
+		seq_printf(s, "%-9s %10llu %14llu %12llu  %-40pS",
+			   homa_lock_class_names[entry->lock_class], waits,
+			   (__u64)atomic64_read(&entry->wait_ns),
+			   (__u64)atomic64_read(&entry->max_wait_ns),
+			   (void *)entry->site);
+		for (j = 0; j < HOMA_LOCKPROF_BUCKETS; j++)
+			seq_printf(s, " %llu",
+				   (__u64)atomic64_read(&entry->hist[j]));
+		seq_printf(s, " |");
+		for (j = 0; j < HOMA_LOCKPROF_HOLDERS; j++) {
+			h = &entry->holders[j];
+			if (READ_ONCE(h->site) == 0)
+				break;
+			seq_printf(s, " %pS:%llu", (void *)h->site,
+				   (__u64)atomic64_read(&h->count));
+		}
+		seq_printf(s, " other:%llu\n",
+			   (__u64)atomic64_read(&entry->other_holders));
+	}
+	return 0;
+}
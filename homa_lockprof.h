@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* This file contains declarations for Homa's lock contention profiler,
+ * which records information about waits in the *_lock_slow functions
+ * when the lock_profile sysctl parameter is nonzero.
+ */
+
+#ifndef _HOMA_LOCKPROF_H
+#define _HOMA_LOCKPROF_H
+
+#include <linux/hash.h>
+#include <linux/types.h>
+
+/**
+ * enum homa_lock_class - Identifies the kind of lock that a thread
+ * waited for.
+ * @HOMA_LOCK_CLASS_SOCKET:     A socket lock (homa_sock_lock).
+ * @HOMA_LOCK_CLASS_BUCKET:     An RPC hash table bucket (homa_bucket_lock).
+ * @HOMA_LOCK_CLASS_SHARD:      A shard of a socket's RPC lists
+ *                              (homa_rpc_shard_lock).
+ * @HOMA_LOCK_CLASS_GRANTABLE:  homa->grantable_lock.
+ * @HOMA_LOCK_CLASS_THROTTLE:   homa->throttle_lock.
+ * @HOMA_LOCK_CLASS_PEER:       A peer's ack_lock (homa_peer_lock).
+ * @HOMA_LOCK_CLASSES:          Number of distinct lock classes.
+ */
+enum homa_lock_class {
+	HOMA_LOCK_CLASS_SOCKET     = 0,
+	HOMA_LOCK_CLASS_BUCKET     = 1,
+	HOMA_LOCK_CLASS_SHARD      = 2,
+	HOMA_LOCK_CLASS_GRANTABLE  = 3,
+	HOMA_LOCK_CLASS_THROTTLE   = 4,
+	HOMA_LOCK_CLASS_PEER       = 5,
+	HOMA_LOCK_CLASSES          = 6
+};
+
+/**
+ * define HOMA_LOCKPROF_SITES - Number of entries in the table of
+ * (lock class, call site) pairs. Must be a power of 2. Waits at sites
+ * beyond this are counted in homa_lockprof::dropped.
+ */
+#define HOMA_LOCKPROF_SITES 256
+
+/**
+ * define HOMA_LOCKPROF_BUCKETS - Number of buckets in the wait-time
+ * histogram for each site. Bucket 0 counts waits less than 256 ns; each
+ * later bucket covers twice the range of its predecessor, and the last
+ * bucket also counts all larger waits (same as HOMA_HANDOFF_BUCKETS).
+ */
+#define HOMA_LOCKPROF_BUCKETS 16
+
+/**
+ * define HOMA_LOCKPROF_HOLDERS - Number of distinct lock holders
+ * recorded for each site.
+ */
+#define HOMA_LOCKPROF_HOLDERS 4
+
+/**
+ * define HOMA_LOCKPROF_OWNER_BITS - Log2 of the number of entries in
+ * homa_lockprof::owners.
+ */
+#define HOMA_LOCKPROF_OWNER_BITS 10
+
+/**
+ * struct homa_lockprof_holder - Counts how many times a waiter found
+ * a lock held by a particular call site.
+ */
+struct homa_lockprof_holder {
+	/**
+	 * @site: code address where the holder acquired the lock; 0 means
+	 * this entry is unused.
+	 */
+	unsigned long site;
+
+	/** @count: Number of waits during which @site held the lock. */
+	atomic64_t count;
+};
+
+/**
+ * struct homa_lockprof_site - Contention information for one call
+ * site of one lock class.
+ */
+struct homa_lockprof_site {
+	/**
+	 * @site: code address of the call to the lock function (within
+	 * the function that is acquiring the lock); 0 means this entry is
+	 * unused.
+	 */
+	unsigned long site;
+
+	/** @lock_class: Kind of lock acquired at @site. */
+	enum homa_lock_class lock_class;
+
+	/** @waits: Number of times a thread had to wait at @site. */
+	atomic64_t waits;
+
+	/** @wait_ns: Total time spent waiting at @site. */
+	atomic64_t wait_ns;
+
+	/** @max_wait_ns: Longest single wait at @site. */
+	atomic64_t max_wait_ns;
+
+	/** @hist: Histogram of wait times (see HOMA_LOCKPROF_BUCKETS). */
+	atomic64_t hist[HOMA_LOCKPROF_BUCKETS];
+
+	/**
+	 * @holders: The first HOMA_LOCKPROF_HOLDERS distinct sites found
+	 * holding the lock when a thread started waiting at @site.
+	 */
+	struct homa_lockprof_holder holders[HOMA_LOCKPROF_HOLDERS];
+
+	/**
+	 * @other_holders: Number of waits where the holder was unknown
+	 * or didn't fit in @holders.
+	 */
+	atomic64_t other_holders;
+};
+
+/**
+ * struct homa_lockprof_owner - Records the most recent acquirer of a lock.
+ * The two fields are updated without synchronization, so a reader may
+ * occasionally pair a lock with the wrong site; that's acceptable for
+ * profiling.
+ */
+struct homa_lockprof_owner {
+	/** @lock: Address of the lock. */
+	void *lock;
+
+	/** @site: Code address where @lock was most recently acquired. */
+	unsigned long site;
+};
+
+/**
+ * struct homa_lockprof - Overall information about lock contention.
+ * There is a single instance of this structure, shared by all cores.
+ */
+struct homa_lockprof {
+	/**
+	 * @sites: Open-addressed hash table, keyed by lock class and
+	 * call site.
+	 */
+	struct homa_lockprof_site sites[HOMA_LOCKPROF_SITES];
+
+	/** @dropped: Waits not recorded because @sites was full. */
+	atomic64_t dropped;
+
+	/**
+	 * @owners: Hash table (indexed by lock address, no collision
+	 * handling) recording the last site to acquire each lock.
+	 */
+	struct homa_lockprof_owner owners[1 << HOMA_LOCKPROF_OWNER_BITS];
+};
+
+extern int homa_lockprof_active;
+extern struct homa_lockprof homa_lockprof;
+
+void     homa_lockprof_record(enum homa_lock_class lock_class,
+			      unsigned long site, unsigned long holder,
+			      __u64 wait_ns);
+void     homa_lockprof_reset(void);
+int      homa_lockprof_show(struct seq_file *s, void *v);
+void     homa_lockprof_sysctl_changed(struct homa *homa);
+
+/**
+ * homa_lockprof_owner() - Return the entry in homa_lockprof.owners
+ * used for a given lock.
+ * @lock:    Address of the lock.
+ * Return:   See above.
+ */
+static inline struct homa_lockprof_owner *homa_lockprof_owner(void *lock)
+{
+	return &homa_lockprof.owners[hash_ptr(lock, HOMA_LOCKPROF_OWNER_BITS)];
+}
+
+/**
+ * homa_lockprof_acquired() - Invoked whenever a profiled lock has been
+ * acquired; if profiling is enabled, remembers who holds the lock so
+ * that waiters can attribute their wait.
+ * @lock:    Address of the lock that was just acquired.
+ * @site:    Code address of the call site that acquired it.
+ */
+static inline void homa_lockprof_acquired(void *lock, unsigned long site)
+{
+	struct homa_lockprof_owner *owner;
+
+	if (likely(!READ_ONCE(homa_lockprof_active)))
+		return;
+	owner = homa_lockprof_owner(lock);
+	WRITE_ONCE(owner->lock, lock);
+	WRITE_ONCE(owner->site, site);
+}
+
+/**
+ * homa_lockprof_holder() - Return the call site that most recently
+ * acquired a lock.
+ * @lock:    Address of the lock (normally held by someone else).
+ * Return:   Code address of the call site, or 0 if unknown or if
+ *           profiling is disabled.
+ */
+static inline unsigned long homa_lockprof_holder(void *lock)
+{
+	struct homa_lockprof_owner *owner;
+	unsigned long site;
+
+	if (likely(!READ_ONCE(homa_lockprof_active)))
+		return 0;
+	owner = homa_lockprof_owner(lock);
+	site = READ_ONCE(owner->site);
+	if (READ_ONCE(owner->lock) != lock)
+		return 0;
+	return site;
+}
+
+/**
+ * homa_lockprof_wait() - Invoked by the *_lock_slow functions after
+ * they have acquired a lock; records the wait if profiling is enabled.
+ * @lock_class:  Kind of lock.
+ * @lock:        Address of the lock.
+ * @site:        Code address of the call site that waited.
+ * @holder:      Value of homa_lockprof_holder() sampled before waiting.
+ * @wait_ns:     How long the caller waited.
+ */
+static inline void homa_lockprof_wait(enum homa_lock_class lock_class,
+				      void *lock, unsigned long site,
+				      unsigned long holder, __u64 wait_ns)
+{
+	if (likely(!READ_ONCE(homa_lockprof_active)))
+		return;
+	homa_lockprof_record(lock_class, site, holder, wait_ns);
+	homa_lockprof_acquired(lock, site);
+}
+
+#endif /* _HOMA_LOCKPROF_H */
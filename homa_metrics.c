@@ -73,6 +73,8 @@ void homa_metric_append(struct homa *homa, const char *format, ...)
  */
 char *homa_metrics_print(struct homa *homa)
 {
+	static const char * const lock_ops[HOMA_LOCK_OPS] = {
+		"recv", "handoff", "free", "bufs", "protect", "control"};
 	int core, i, lower = 0;
 
 	homa->metrics_length = 0;
@@ -102,6 +104,8 @@ char *homa_metrics_print(struct homa *homa)
 		  m->large_msg_count, lower);
 		M("large_msg_bytes           %15llu  Bytes in incoming messages >= %d bytes\n",
 		  m->large_msg_bytes, lower);
+		M("inline_msgs               %15llu  Incoming messages delivered without the buffer pool\n",
+		  m->inline_msgs);
 		M("sent_msg_bytes            %15llu  otal bytes in all outgoing messages\n",
 		  m->sent_msg_bytes);
 		for (i = DATA; i < BOGUS;  i++) {
@@ -136,6 +140,38 @@ char *homa_metrics_print(struct homa *homa)
 		  m->skb_page_allocs);
 		M("skb_page_alloc_ns         %15llu  Time spent allocating pages for sk_buff frags\n",
 		  m->skb_page_alloc_ns);
+		M("skb_page_mag_refills      %15llu  Magazines of pages taken from NUMA page pools\n",
+		  m->skb_page_mag_refills);
+		M("skb_page_mag_flushes      %15llu  Magazines of pages returned to NUMA page pools\n",
+		  m->skb_page_mag_flushes);
+		M("skb_page_pool_overflows   %15llu  Freed skb pages released because pool was full\n",
+		  m->skb_page_pool_overflows);
+		M("zerocopy_bytes            %15llu  Outgoing message bytes sent from user pages\n",
+		  m->zerocopy_bytes);
+		M("zerocopy_copied_bytes     %15llu  MSG_ZEROCOPY message bytes that were copied\n",
+		  m->zerocopy_copied_bytes);
+		M("zerocopy_alloc_failures   %15llu  MSG_ZEROCOPY sends that failed to allocate ubuf\n",
+		  m->zerocopy_alloc_failures);
+		M("zerocopy_recv_bytes       %15llu  Incoming message bytes mapped into user space\n",
+		  m->zerocopy_recv_bytes);
+		M("zerocopy_recv_flip_bytes  %15llu  Mapped bytes that were never copied\n",
+		  m->zerocopy_recv_flip_bytes);
+		M("zerocopy_recv_failures    %15llu  Bpages copied because mapping failed\n",
+		  m->zerocopy_recv_failures);
+		M("skb_cache_hits            %15llu  Tx sk_buffs taken from per-core recycle cache\n",
+		  m->skb_cache_hits);
+		M("skb_cache_misses          %15llu  Cacheable tx sk_buffs that had to be allocated\n",
+		  m->skb_cache_misses);
+		M("skb_recycles              %15llu  Tx sk_buffs returned to per-core recycle cache\n",
+		  m->skb_recycles);
+		M("rpc_cache_hits            %15llu  RPCs taken from per-core freelist\n",
+		  m->rpc_cache_hits);
+		M("rpc_cache_misses          %15llu  RPCs allocated from slab cache\n",
+		  m->rpc_cache_misses);
+		M("rpc_recycles              %15llu  Reaped RPCs returned to per-core freelist\n",
+		  m->rpc_recycles);
+		M("client_id_blocks          %15llu  Blocks of client RPC ids reserved by cores\n",
+		  m->client_id_blocks);
 		M("requests_received         %15llu  Incoming request messages\n",
 		  m->requests_received);
 		M("requests_queued           %15llu  Requests for which no thread was waiting\n",
@@ -152,6 +188,39 @@ char *homa_metrics_print(struct homa *homa)
 		  m->handoffs_thread_waiting);
 		M("handoffs_alt_thread       %15llu  RPC handoffs not to first on list (avoid busy core)\n",
 		  m->handoffs_alt_thread);
+		M("handoffs_no_wakeup        %15llu  RPC handoffs to threads that were still polling\n",
+		  m->handoffs_no_wakeup);
+		M("adaptive_poll_skips       %15llu  Times threads slept without polling (adaptive_poll)\n",
+		  m->adaptive_poll_skips);
+		for (i = 0; i < HOMA_HANDOFF_BUCKETS; i++)
+			M("handoff_polled_%-2d         %15llu  Handoffs to polling threads, latency < %llu ns\n",
+			  i, m->handoff_polled_ns[i], 256ULL << i);
+		for (i = 0; i < HOMA_HANDOFF_BUCKETS; i++)
+			M("handoff_woken_%-2d          %15llu  Handoffs to sleeping threads, latency < %llu ns\n",
+			  i, m->handoff_woken_ns[i], 256ULL << i);
+		for (i = 0; i < HOMA_HANDOFF_BUCKETS; i++)
+			M("handoff_queued_%-2d         %15llu  Queued handoffs, latency < %llu ns\n",
+			  i, m->handoff_queued_ns[i], 256ULL << i);
+		for (i = 0; i < HOMA_LATENCY_BUCKETS; i++)
+			M("lat_send_first_pkt_%-2d     %15llu  Sendmsg to first request packet sent, latency >= %llu ns\n",
+			  i, m->lat_send_first_pkt_ns[i],
+			  homa_latency_bucket_start(i));
+		for (i = 0; i < HOMA_LATENCY_BUCKETS; i++)
+			M("lat_first_grant_%-2d        %15llu  First packet to first grant sent, latency >= %llu ns\n",
+			  i, m->lat_first_grant_ns[i],
+			  homa_latency_bucket_start(i));
+		for (i = 0; i < HOMA_LATENCY_BUCKETS; i++)
+			M("lat_complete_to_recv_%-2d   %15llu  Last byte received to recvmsg pickup, latency >= %llu ns\n",
+			  i, m->lat_complete_to_recv_ns[i],
+			  homa_latency_bucket_start(i));
+		for (i = 0; i < HOMA_LATENCY_BUCKETS; i++)
+			M("lat_handoff_to_recv_%-2d    %15llu  Handoff to recvmsg pickup, latency >= %llu ns\n",
+			  i, m->lat_handoff_to_recv_ns[i],
+			  homa_latency_bucket_start(i));
+		for (i = 0; i < HOMA_LATENCY_BUCKETS; i++)
+			M("lat_server_service_%-2d     %15llu  Request returned by recvmsg to response sendmsg, latency >= %llu ns\n",
+			  i, m->lat_server_service_ns[i],
+			  homa_latency_bucket_start(i));
 		M("poll_ns                   %15llu  Time spent polling for incoming messages\n",
 		  m->poll_ns);
 		M("softirq_calls             %15llu  Calls to homa_softirq (i.e. # GRO pkts received)\n",
@@ -168,6 +237,12 @@ char *homa_metrics_print(struct homa *homa)
 		  m->send_ns);
 		M("send_calls                %15llu  Total invocations of homa_sendmsg for equests\n",
 		  m->send_calls);
+		M("send_batch_calls          %15llu  Sendmsg calls that sent a batch of messages\n",
+		  m->send_batch_calls);
+		M("send_batch_msgs           %15llu  Messages sent by batched sendmsg calls\n",
+		  m->send_batch_msgs);
+		M("send_batch_ns             %15llu  Time spent in batched sendmsg calls\n",
+		  m->send_batch_ns);
 		// It is possible for us to get here at a time when a
 		// thread has been blocked for a long time and has
 		// recorded blocked_ns, but hasn't finished the
@@ -181,12 +256,24 @@ char *homa_metrics_print(struct homa *homa)
 		  delta);
 		M("recv_calls                %15llu  Total invocations of recvmsg kernel call\n",
 		  m->recv_calls);
+		M("recv_batch_calls          %15llu  Recvmsg calls that received a batch of messages\n",
+		  m->recv_batch_calls);
+		M("recv_batch_msgs           %15llu  Messages returned by batched recvmsg calls\n",
+		  m->recv_batch_msgs);
+		M("copyout_tail_ns           %15llu  Time from last packet to recvmsg return (large msgs)\n",
+		  m->copyout_tail_ns);
+		M("copyout_tails             %15llu  Messages counted in copyout_tail_ns\n",
+		  m->copyout_tails);
+		M("copyout_work_calls        %15llu  Data copies to user space by helper workers\n",
+		  m->copyout_work_calls);
 		M("blocked_ns                %15llu  Time spent blocked in homa_recvmsg\n",
 		  m->blocked_ns);
 		M("reply_ns                  %15llu  Time spent in homa_sendmsg for responses\n",
 		  m->reply_ns);
 		M("reply_calls               %15llu  Total invocations of homa_sendmsg for responses\n",
 		  m->reply_calls);
+		M("reply_recv_calls          %15llu  Sendmsg calls that sent a response, then received\n",
+		  m->reply_recv_calls);
 		M("abort_ns                  %15llu  Time spent in homa_ioc_abort kernel call\n",
 		  m->reply_ns);
 		M("abort_calls               %15llu  Total invocations of abort kernel call\n",
@@ -203,6 +290,12 @@ char *homa_metrics_print(struct homa *homa)
 		  m->timer_reap_ns);
 		M("data_pkt_reap_ns          %15llu  Time in homa_data_pkt spent reaping RPCs\n",
 		  m->data_pkt_reap_ns);
+		M("wait_reap_ns              %15llu  Time app threads spent reaping in homa_wait_for_message\n",
+		  m->wait_reap_ns);
+		M("reap_work_calls           %15llu  Invocations of homa_rpc_reap_work\n",
+		  m->reap_work_calls);
+		M("reap_work_ns              %15llu  Time spent reaping in helper workers\n",
+		  m->reap_work_ns);
 		M("pacer_ns                  %15llu  Time spent in homa_pacer_main\n",
 		  m->pacer_ns);
 		M("homa_ns                   %15llu  Total time in all Homa-related functions\n",
@@ -266,6 +359,14 @@ char *homa_metrics_print(struct homa *homa)
 		  m->socket_lock_misses);
 		M("socket_lock_miss_ns       %15llu  Time lost waiting for socket locks\n",
 		  m->socket_lock_miss_ns);
+		for (i = 0; i < HOMA_LOCK_OPS; i++) {
+			M("socket_lock_ns_%-7s    %15llu  Time lost waiting for socket locks in %s operations\n",
+			  lock_ops[i], m->socket_lock_op_ns[i], lock_ops[i]);
+		}
+		M("shard_lock_misses         %15llu  RPC shard lock misses\n",
+		  m->shard_lock_misses);
+		M("shard_lock_miss_ns        %15llu  Time lost waiting for RPC shard locks\n",
+		  m->shard_lock_miss_ns);
 		M("throttle_lock_misses      %15llu  Throttle lock misses\n",
 		  m->throttle_lock_misses);
 		M("throttle_lock_miss_ns     %15llu  Time lost waiting for throttle locks\n",
@@ -422,3 +523,329 @@ int homa_metrics_release(struct inode *inode, struct file *file)
 	spin_unlock(&homa->metrics_lock);
 	return 0;
 }
+
+/**
+ * struct homa_metric_field - Describes one field of struct homa_metrics,
+ * for the schema in /proc/net/homa_metrics_bin.
+ */
+struct homa_metric_field {
+	/** @name: Name of the field in struct homa_metrics. */
+	const char *name;
+
+	/** @count: Number of __u64 counters in the field (> 1 for arrays). */
+	int count;
+};
+
+#define HM(field) {#field, sizeof_field(struct homa_metrics, field) / \
+		sizeof(__u64)}
+
+/* All of the fields in struct homa_metrics, in order. This must be
+ * updated whenever a field is added to struct homa_metrics
+ * (homa_metrics_schema checks that nothing is missing).
+ */
+static const struct homa_metric_field homa_metric_fields[] = {
+	HM(small_msg_bytes),
+	HM(medium_msg_bytes),
+	HM(large_msg_count),
+	HM(large_msg_bytes),
+	HM(inline_msgs),
+	HM(sent_msg_bytes),
+	HM(packets_sent),
+	HM(packets_received),
+	HM(priority_bytes),
+	HM(priority_packets),
+	HM(skb_allocs),
+	HM(skb_alloc_ns),
+	HM(skb_frees),
+	HM(skb_free_ns),
+	HM(skb_page_allocs),
+	HM(skb_page_alloc_ns),
+	HM(skb_page_mag_refills),
+	HM(skb_page_mag_flushes),
+	HM(skb_page_pool_overflows),
+	HM(zerocopy_bytes),
+	HM(zerocopy_copied_bytes),
+	HM(zerocopy_alloc_failures),
+	HM(zerocopy_recv_bytes),
+	HM(zerocopy_recv_flip_bytes),
+	HM(zerocopy_recv_failures),
+	HM(skb_cache_hits),
+	HM(skb_cache_misses),
+	HM(skb_recycles),
+	HM(rpc_cache_hits),
+	HM(rpc_cache_misses),
+	HM(rpc_recycles),
+	HM(client_id_blocks),
+	HM(requests_received),
+	HM(requests_queued),
+	HM(responses_received),
+	HM(responses_queued),
+	HM(fast_wakeups),
+	HM(slow_wakeups),
+	HM(handoffs_thread_waiting),
+	HM(handoffs_alt_thread),
+	HM(handoffs_no_wakeup),
+	HM(adaptive_poll_skips),
+	HM(handoff_polled_ns),
+	HM(handoff_woken_ns),
+	HM(handoff_queued_ns),
+	HM(lat_send_first_pkt_ns),
+	HM(lat_first_grant_ns),
+	HM(lat_complete_to_recv_ns),
+	HM(lat_handoff_to_recv_ns),
+	HM(lat_server_service_ns),
+	HM(poll_ns),
+	HM(softirq_calls),
+	HM(softirq_ns),
+	HM(bypass_softirq_ns),
+	HM(linux_softirq_ns),
+	HM(napi_ns),
+	HM(send_ns),
+	HM(send_calls),
+	HM(send_batch_calls),
+	HM(send_batch_msgs),
+	HM(send_batch_ns),
+	HM(recv_ns),
+	HM(recv_calls),
+	HM(recv_batch_calls),
+	HM(recv_batch_msgs),
+	HM(copyout_tail_ns),
+	HM(copyout_tails),
+	HM(copyout_work_calls),
+	HM(blocked_ns),
+	HM(reply_ns),
+	HM(reply_calls),
+	HM(reply_recv_calls),
+	HM(abort_ns),
+	HM(abort_calls),
+	HM(so_set_buf_ns),
+	HM(so_set_buf_calls),
+	HM(grantable_lock_ns),
+	HM(timer_ns),
+	HM(timer_reap_ns),
+	HM(data_pkt_reap_ns),
+	HM(wait_reap_ns),
+	HM(reap_work_calls),
+	HM(reap_work_ns),
+	HM(pacer_ns),
+	HM(pacer_lost_ns),
+	HM(pacer_bytes),
+	HM(pacer_skipped_rpcs),
+	HM(pacer_needed_help),
+	HM(throttled_ns),
+	HM(resent_packets),
+	HM(peer_hash_links),
+	HM(peer_new_entries),
+	HM(peer_kmalloc_errors),
+	HM(peer_route_errors),
+	HM(control_xmit_errors),
+	HM(data_xmit_errors),
+	HM(unknown_rpcs),
+	HM(server_cant_create_rpcs),
+	HM(unknown_packet_types),
+	HM(short_packets),
+	HM(packet_discards),
+	HM(resent_discards),
+	HM(resent_packets_used),
+	HM(rpc_timeouts),
+	HM(server_rpc_discards),
+	HM(server_rpcs_unknown),
+	HM(client_lock_misses),
+	HM(client_lock_miss_ns),
+	HM(server_lock_misses),
+	HM(server_lock_miss_ns),
+	HM(socket_lock_miss_ns),
+	HM(socket_lock_misses),
+	HM(socket_lock_op_ns),
+	HM(shard_lock_miss_ns),
+	HM(shard_lock_misses),
+	HM(throttle_lock_miss_ns),
+	HM(throttle_lock_misses),
+	HM(peer_ack_lock_miss_ns),
+	HM(peer_ack_lock_misses),
+	HM(grantable_lock_miss_ns),
+	HM(grantable_lock_misses),
+	HM(grantable_rpcs_integral),
+	HM(grant_recalc_calls),
+	HM(grant_recalc_ns),
+	HM(grant_recalc_loops),
+	HM(grant_recalc_skips),
+	HM(grant_priority_bumps),
+	HM(fifo_grants),
+	HM(fifo_grants_no_incoming),
+	HM(disabled_reaps),
+	HM(disabled_rpc_reaps),
+	HM(reaper_calls),
+	HM(reaper_dead_skbs),
+	HM(forced_reaps),
+	HM(throttle_list_adds),
+	HM(throttle_list_checks),
+	HM(ack_overflows),
+	HM(ignored_need_acks),
+	HM(bpage_reuses),
+	HM(buffer_alloc_failures),
+	HM(linux_pkt_alloc_bytes),
+	HM(dropped_data_no_bufs),
+	HM(gen3_handoffs),
+	HM(gen3_alt_handoffs),
+	HM(gro_grant_bypasses),
+	HM(gro_data_bypasses),
+	HM(temp),
+};
+
+/**
+ * homa_metrics_schema() - Generate the schema portion of
+ * /proc/net/homa_metrics_bin (see struct homa_metrics_hdr), if it hasn't
+ * already been generated. The schema never changes, so this is done only
+ * once. The caller must hold homa->metrics_lock.
+ * @homa:    Overall data about the Homa protocol implementation; the
+ *           schema is stored in homa->metrics_schema.
+ *
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_metrics_schema(struct homa *homa)
+{
+	int i, length, total, counters;
+	char *schema;
+
+	if (homa->metrics_schema)
+		return 0;
+
+	/* First pass: compute the length of the schema. */
+	length = 0;
+	counters = 0;
+	for (i = 0; i < ARRAY_SIZE(homa_metric_fields); i++) {
+		length += snprintf(NULL, 0, "%s %d\n",
+				   homa_metric_fields[i].name,
+				   homa_metric_fields[i].count);
+		counters += homa_metric_fields[i].count;
+	}
+	if (WARN_ON_ONCE(counters != sizeof(struct homa_metrics) /
+			 sizeof(__u64)))
+		return -EINVAL;
+
+	schema = kmalloc(length + 1, GFP_ATOMIC);
+	if (!schema)
+		return -ENOMEM;
+	total = 0;
+	for (i = 0; i < ARRAY_SIZE(homa_metric_fields); i++)
+		total += snprintf(schema + total, length + 1 - total,
+				  "%s %d\n", homa_metric_fields[i].name,
+				  homa_metric_fields[i].count);
+	homa->metrics_schema = schema;
+	homa->metrics_schema_length = length;
+	return 0;
+}
+
+/**
+ * homa_metrics_bin_open() - This function is invoked when
+ * /proc/net/homa_metrics_bin is opened.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+int homa_metrics_bin_open(struct inode *inode, struct file *file)
+{
+	struct homa *homa = global_homa;
+	struct homa_metrics_hdr *hdr;
+	int err;
+
+	hdr = kmalloc(sizeof(*hdr), GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	spin_lock(&homa->metrics_lock);
+	err = homa_metrics_schema(homa);
+	spin_unlock(&homa->metrics_lock);
+	if (err) {
+		kfree(hdr);
+		return err;
+	}
+
+	/* Only the header is snapshotted here; counters are copied
+	 * directly from the per-core structs when they are read, so that
+	 * readers can pread just the counters on each sample.
+	 */
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = HOMA_METRICS_MAGIC;
+	hdr->version = HOMA_METRICS_VERSION;
+	hdr->time_ns = sched_clock();
+	hdr->num_cores = nr_cpu_ids;
+	hdr->num_counters = sizeof(struct homa_metrics) / sizeof(__u64);
+	hdr->schema_offset = sizeof(*hdr);
+	hdr->schema_length = homa->metrics_schema_length;
+	hdr->data_offset = ALIGN(hdr->schema_offset + hdr->schema_length,
+				 sizeof(__u64));
+	file->private_data = hdr;
+	return 0;
+}
+
+/**
+ * homa_metrics_bin_read() - This function is invoked to handle read kernel
+ * calls on /proc/net/homa_metrics_bin.
+ * @file:    Information about the file being read.
+ * @buffer:  Address in user space of the buffer in which data from the file
+ *           should be returned.
+ * @length:  Number of bytes available at @buffer.
+ * @offset:  Current read offset within the file.
+ *
+ * Return: the number of bytes returned at @buffer. 0 means the end of the
+ * file was reached, and a negative number indicates an error (-errno).
+ */
+ssize_t homa_metrics_bin_read(struct file *file, char __user *buffer,
+			      size_t length, loff_t *offset)
+{
+	struct homa_metrics_hdr *hdr = file->private_data;
+	struct homa *homa = global_homa;
+	size_t copied = 0;
+	size_t chunk;
+	const char *src;
+	loff_t pos;
+	int core;
+
+	while (copied < length) {
+		pos = *offset;
+		if (pos < hdr->schema_offset) {
+			src = (const char *)hdr + pos;
+			chunk = hdr->schema_offset - pos;
+		} else if (pos < hdr->schema_offset + hdr->schema_length) {
+			pos -= hdr->schema_offset;
+			src = homa->metrics_schema + pos;
+			chunk = hdr->schema_length - pos;
+		} else if (pos < hdr->data_offset) {
+			/* Padding between the schema and the counters. */
+			src = "\0\0\0\0\0\0\0";
+			chunk = hdr->data_offset - pos;
+		} else {
+			pos -= hdr->data_offset;
+			core = pos / sizeof(struct homa_metrics);
+			if (core >= hdr->num_cores)
+				break;
+			pos -= (loff_t)core * sizeof(struct homa_metrics);
+			src = (const char *)&per_cpu(homa_metrics, core) + pos;
+			chunk = sizeof(struct homa_metrics) - pos;
+		}
+		if (chunk > length - copied)
+			chunk = length - copied;
+		if (copy_to_user(buffer + copied, src, chunk))
+			return -EFAULT;
+		copied += chunk;
+		*offset += chunk;
+	}
+	return copied;
+}
+
+/**
+ * homa_metrics_bin_release() - This function is invoked when the last
+ * reference to an open /proc/net/homa_metrics_bin is closed.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: always 0.
+ */
+int homa_metrics_bin_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
@@ -10,6 +10,31 @@
 
 #include "homa_wire.h"
 
+/**
+ * enum homa_lock_op - Identifies the kind of operation that is acquiring
+ * a socket lock; used to break down the time spent waiting for socket
+ * locks.
+ * @HOMA_LOCK_RECV:     Receiving threads registering or waiting for
+ *                      incoming messages.
+ * @HOMA_LOCK_HANDOFF:  Handing off an RPC to a waiting thread.
+ * @HOMA_LOCK_FREE:     Freeing an RPC that was ready or waiting for
+ *                      buffer space.
+ * @HOMA_LOCK_BUFS:     Managing the buffer pool.
+ * @HOMA_LOCK_PROTECT:  Protecting RPCs from reaping.
+ * @HOMA_LOCK_CONTROL:  Infrequent operations such as bind, shutdown,
+ *                      and setsockopt.
+ * @HOMA_LOCK_OPS:      Number of distinct operation types.
+ */
+enum homa_lock_op {
+	HOMA_LOCK_RECV          = 0,
+	HOMA_LOCK_HANDOFF       = 1,
+	HOMA_LOCK_FREE          = 2,
+	HOMA_LOCK_BUFS          = 3,
+	HOMA_LOCK_PROTECT       = 4,
+	HOMA_LOCK_CONTROL       = 5,
+	HOMA_LOCK_OPS           = 6
+};
+
 /**
  * struct homa_metrics - various performance counters kept by Homa.
  *
@@ -21,6 +46,30 @@
  */
 #define HOMA_NUM_SMALL_COUNTS 64
 #define HOMA_NUM_MEDIUM_COUNTS 128
+
+/**
+ * define HOMA_HANDOFF_BUCKETS - Number of buckets in the histograms of
+ * handoff latency. Bucket 0 counts latencies less than 256 ns; each
+ * later bucket covers twice the range of its predecessor, and the last
+ * bucket also counts all larger latencies.
+ */
+#define HOMA_HANDOFF_BUCKETS 16
+
+/**
+ * define HOMA_LATENCY_SUB_BITS - Log2 of the number of buckets per power
+ * of two in latency histograms (see homa_latency_bucket): 2 gives a
+ * resolution of 25% or better.
+ */
+#define HOMA_LATENCY_SUB_BITS 2
+
+/**
+ * define HOMA_LATENCY_BUCKETS - Number of buckets in each latency
+ * histogram. The first 2 << HOMA_LATENCY_SUB_BITS buckets are 256 ns
+ * wide; after that, each power of two is divided into
+ * 1 << HOMA_LATENCY_SUB_BITS equal buckets. 64 buckets cover latencies
+ * up to about 33 ms; the last bucket also counts all larger latencies.
+ */
+#define HOMA_LATENCY_BUCKETS 64
 struct homa_metrics {
 	/**
 	 * @small_msg_bytes: entry i holds the total number of bytes
@@ -49,6 +98,13 @@ struct homa_metrics {
 	 */
 	__u64 large_msg_bytes;
 
+	/**
+	 * @inline_msgs: the total number of incoming messages that were
+	 * delivered inline (without using the buffer pool; see
+	 * SO_HOMA_INLINE).
+	 */
+	__u64 inline_msgs;
+
 	/**
 	 * @sent_msg_bytes: The total number of bytes in outbound
 	 * messages.
@@ -98,6 +154,109 @@ struct homa_metrics {
 	/** @skb_page_alloc_ns: total time spent in homa_skb_page_alloc. */
 	__u64 skb_page_alloc_ns;
 
+	/**
+	 * @skb_page_mag_refills: total number of times a core took a
+	 * magazine of free pages from its NUMA node's page pool.
+	 */
+	__u64 skb_page_mag_refills;
+
+	/**
+	 * @skb_page_mag_flushes: total number of times a magazine of
+	 * free pages was deposited in a page pool.
+	 */
+	__u64 skb_page_mag_flushes;
+
+	/**
+	 * @skb_page_pool_overflows: total number of freed skb pages that
+	 * were returned to Linux immediately because their page pool was
+	 * full.
+	 */
+	__u64 skb_page_pool_overflows;
+
+	/**
+	 * @zerocopy_bytes: total number of bytes of outgoing message data
+	 * that were transmitted directly from user pages (MSG_ZEROCOPY).
+	 */
+	__u64 zerocopy_bytes;
+
+	/**
+	 * @zerocopy_copied_bytes: total number of bytes of outgoing message
+	 * data sent with MSG_ZEROCOPY that had to be copied anyway (e.g.
+	 * because the user buffer was too fragmented).
+	 */
+	__u64 zerocopy_copied_bytes;
+
+	/**
+	 * @zerocopy_alloc_failures: total number of times that a message
+	 * sent with MSG_ZEROCOPY had to be copied because a completion
+	 * notification structure couldn't be allocated.
+	 */
+	__u64 zerocopy_alloc_failures;
+
+	/**
+	 * @zerocopy_recv_bytes: total number of bytes of incoming message
+	 * data that were delivered to user space by mapping pages into the
+	 * buffer region rather than copying.
+	 */
+	__u64 zerocopy_recv_bytes;
+
+	/**
+	 * @zerocopy_recv_flip_bytes: the portion of @zerocopy_recv_bytes
+	 * for which packet buffer pages were mapped directly, so the data
+	 * was never copied at all.
+	 */
+	__u64 zerocopy_recv_flip_bytes;
+
+	/**
+	 * @zerocopy_recv_failures: total number of times that incoming
+	 * data eligible for mapping had to be copied instead, either because
+	 * memory couldn't be allocated or because pages couldn't be mapped.
+	 */
+	__u64 zerocopy_recv_failures;
+
+	/**
+	 * @skb_cache_hits: total number of calls to homa_skb_new_tx that
+	 * were satisfied from a core's cache of recycled sk_buffs.
+	 */
+	__u64 skb_cache_hits;
+
+	/**
+	 * @skb_cache_misses: total number of calls to homa_skb_new_tx for
+	 * cacheable sk_buffs that found the core's cache empty.
+	 */
+	__u64 skb_cache_misses;
+
+	/**
+	 * @skb_recycles: total number of tx sk_buffs that were reset and
+	 * returned to a core's cache instead of being freed.
+	 */
+	__u64 skb_recycles;
+
+	/**
+	 * @rpc_cache_hits: total number of homa_rpc structs that were
+	 * taken from a core's freelist of reaped RPCs.
+	 */
+	__u64 rpc_cache_hits;
+
+	/**
+	 * @rpc_cache_misses: total number of homa_rpc structs that had to
+	 * be allocated from the slab cache because the core's freelist
+	 * was empty.
+	 */
+	__u64 rpc_cache_misses;
+
+	/**
+	 * @rpc_recycles: total number of reaped homa_rpc structs that were
+	 * returned to a core's freelist instead of being freed.
+	 */
+	__u64 rpc_recycles;
+
+	/**
+	 * @client_id_blocks: total number of times a core reserved a new
+	 * block of HOMA_ID_BLOCK client RPC ids.
+	 */
+	__u64 client_id_blocks;
+
 	/**
 	 * @requests_received: total number of request messages received.
 	 */
@@ -145,6 +304,73 @@ struct homa_metrics {
 	 */
 	__u64 handoffs_alt_thread;
 
+	/**
+	 * @handoffs_no_wakeup: total number of times that an RPC was handed
+	 * off to a waiting thread that was still polling, so it didn't
+	 * need to be woken up.
+	 */
+	__u64 handoffs_no_wakeup;
+
+	/**
+	 * @adaptive_poll_skips: total number of times that a thread went
+	 * to sleep without polling because adaptive polling predicted that
+	 * no message would arrive during the polling interval.
+	 */
+	__u64 adaptive_poll_skips;
+
+	/**
+	 * @handoff_polled_ns: histogram of the time between homa_rpc_handoff
+	 * and the receiving thread picking up the RPC, for RPCs handed off
+	 * to threads that were polling (see HOMA_HANDOFF_BUCKETS).
+	 */
+	__u64 handoff_polled_ns[HOMA_HANDOFF_BUCKETS];
+
+	/**
+	 * @handoff_woken_ns: same as @handoff_polled_ns, except for RPCs
+	 * handed off to threads that had gone to sleep.
+	 */
+	__u64 handoff_woken_ns[HOMA_HANDOFF_BUCKETS];
+
+	/**
+	 * @handoff_queued_ns: same as @handoff_polled_ns, except for RPCs
+	 * that were queued because no thread was waiting.
+	 */
+	__u64 handoff_queued_ns[HOMA_HANDOFF_BUCKETS];
+
+	/**
+	 * @lat_send_first_pkt_ns: histogram (see HOMA_LATENCY_BUCKETS) of
+	 * the time from the start of sendmsg for a request until its first
+	 * data packet is transmitted.
+	 */
+	__u64 lat_send_first_pkt_ns[HOMA_LATENCY_BUCKETS];
+
+	/**
+	 * @lat_first_grant_ns: histogram of the time from when an incoming
+	 * message that needs grants was first seen until its first grant
+	 * was sent.
+	 */
+	__u64 lat_first_grant_ns[HOMA_LATENCY_BUCKETS];
+
+	/**
+	 * @lat_complete_to_recv_ns: histogram of the time from when the last
+	 * byte of an incoming message arrived until recvmsg collected the
+	 * message.
+	 */
+	__u64 lat_complete_to_recv_ns[HOMA_LATENCY_BUCKETS];
+
+	/**
+	 * @lat_handoff_to_recv_ns: histogram of the time from the most
+	 * recent homa_rpc_handoff for a message until recvmsg collected it.
+	 */
+	__u64 lat_handoff_to_recv_ns[HOMA_LATENCY_BUCKETS];
+
+	/**
+	 * @lat_server_service_ns: histogram of the time from when recvmsg
+	 * returned a request to the application until sendmsg was invoked
+	 * for its response.
+	 */
+	__u64 lat_server_service_ns[HOMA_LATENCY_BUCKETS];
+
 	/**
 	 * @poll_ns: total time spent in the polling loop in
 	 * homa_wait_for_message.
@@ -195,6 +421,24 @@ struct homa_metrics {
 	 */
 	__u64 send_calls;
 
+	/**
+	 * @send_batch_calls: total number of invocations of homa_sendmsg
+	 * that sent a batch of messages (struct homa_sendmmsg_args).
+	 */
+	__u64 send_batch_calls;
+
+	/**
+	 * @send_batch_msgs: total number of messages sent by the calls
+	 * in @send_batch_calls.
+	 */
+	__u64 send_batch_msgs;
+
+	/**
+	 * @send_batch_ns: total time spent in homa_sendmsg for the calls
+	 * in @send_batch_calls.
+	 */
+	__u64 send_batch_ns;
+
 	/**
 	 * @recv_ns: total time spent executing homa_recvmsg (including
 	 * time when the thread is blocked).
@@ -204,6 +448,34 @@ struct homa_metrics {
 	/** @recv_calls: total number of invocations of homa_recvmsg. */
 	__u64 recv_calls;
 
+	/**
+	 * @recv_batch_calls: total number of invocations of homa_recvmsg
+	 * that used struct homa_recvmmsg_args to receive several messages.
+	 */
+	__u64 recv_batch_calls;
+
+	/**
+	 * @recv_batch_msgs: total number of messages returned by the calls
+	 * in @recv_batch_calls.
+	 */
+	__u64 recv_batch_msgs;
+
+	/**
+	 * @copyout_tail_ns: total time between the arrival of the last
+	 * packet of a message and the return of that message by
+	 * homa_recvmsg, for messages of at least copyout_min_bytes.
+	 */
+	__u64 copyout_tail_ns;
+
+	/** @copyout_tails: number of messages counted in copyout_tail_ns. */
+	__u64 copyout_tails;
+
+	/**
+	 * @copyout_work_calls: total number of times homa_copy_work copied
+	 * data to user space in a helper worker.
+	 */
+	__u64 copyout_work_calls;
+
 	/**
 	 * @blocked_ns: total time spent by threads in blocked state
 	 * while executing the homa_recvmsg kernel call handler.
@@ -222,6 +494,14 @@ struct homa_metrics {
 	 */
 	__u64 reply_calls;
 
+	/**
+	 * @reply_recv_calls: total number of invocations of homa_sendmsg
+	 * that sent a response and then received a message (struct
+	 * homa_reply_recv_args); these are also counted in @reply_calls
+	 * and @recv_calls.
+	 */
+	__u64 reply_recv_calls;
+
 	/**
 	 * @abort_ns: total time spent executing the homa_ioc_abort
 	 * kernel call handler.
@@ -267,6 +547,25 @@ struct homa_metrics {
 	 */
 	__u64 data_pkt_reap_ns;
 
+	/**
+	 * @wait_reap_ns: total time spent by application threads in
+	 * homa_wait_for_message reaping dead RPCs (nonzero only when
+	 * homa->reap_workers is 0).
+	 */
+	__u64 wait_reap_ns;
+
+	/**
+	 * @reap_work_calls: total number of invocations of
+	 * homa_rpc_reap_work.
+	 */
+	__u64 reap_work_calls;
+
+	/**
+	 * @reap_work_ns: total time spent in homa_rpc_reap_work, which
+	 * reaps dead RPCs in helper worker threads.
+	 */
+	__u64 reap_work_ns;
+
 	/**
 	 * @pacer_ns: total time spent executing in homa_pacer_main
 	 * (not including blocked time).
@@ -447,6 +746,24 @@ struct homa_metrics {
 	 */
 	__u64 socket_lock_misses;
 
+	/**
+	 * @socket_lock_op_ns: entry i holds the total time spent waiting
+	 * for socket locks by operations of type i (an enum homa_lock_op).
+	 */
+	__u64 socket_lock_op_ns[HOMA_LOCK_OPS];
+
+	/**
+	 * @shard_lock_miss_ns: total time spent waiting for the locks on
+	 * shards of sockets' RPC lists.
+	 */
+	__u64 shard_lock_miss_ns;
+
+	/**
+	 * @shard_lock_misses: total number of times that Homa had to wait
+	 * to acquire the lock for a shard of a socket's RPC lists.
+	 */
+	__u64 shard_lock_misses;
+
 	/**
 	 * @throttle_lock_miss_ns: total time spent waiting for throttle
 	 * lock misses.
@@ -661,7 +978,53 @@ static inline struct homa_metrics *homa_metrics_per_cpu(void)
 #define INC_METRIC(metric, count) per_cpu(homa_metrics, \
 		raw_smp_processor_id()).metric += (count)
 
+/**
+ * homa_latency_bucket() - Return the index of the bucket in a latency
+ * histogram (see HOMA_LATENCY_BUCKETS) that counts a given latency.
+ * @ns:    Latency, in ns.
+ * Return: Bucket index.
+ */
+static inline int homa_latency_bucket(__u64 ns)
+{
+	int octave = fls64(ns >> (8 + HOMA_LATENCY_SUB_BITS));
+	int bucket;
+
+	if (octave == 0)
+		bucket = ns >> 8;
+	else
+		bucket = (octave << HOMA_LATENCY_SUB_BITS) +
+			 ((ns >> (octave + 7)) &
+			 ((1 << HOMA_LATENCY_SUB_BITS) - 1));
+	if (bucket >= HOMA_LATENCY_BUCKETS)
+		bucket = HOMA_LATENCY_BUCKETS - 1;
+	return bucket;
+}
+
+/**
+ * homa_latency_bucket_start() - Return the smallest latency counted by
+ * a given bucket in a latency histogram.
+ * @bucket:  Index of the bucket.
+ * Return:   Lower bound for the bucket, in ns.
+ */
+static inline __u64 homa_latency_bucket_start(int bucket)
+{
+	int octave = bucket >> HOMA_LATENCY_SUB_BITS;
+	int sub = bucket & ((1 << HOMA_LATENCY_SUB_BITS) - 1);
+
+	if (octave == 0)
+		return (__u64)sub << 8;
+	return (__u64)((1 << HOMA_LATENCY_SUB_BITS) + sub) << (octave + 7);
+}
+
+/* Record @ns in the latency histogram @metric for the current core. */
+#define INC_LATENCY(metric, ns) per_cpu(homa_metrics, \
+		raw_smp_processor_id()).metric[homa_latency_bucket(ns)]++
+
 void     homa_metric_append(struct homa *homa, const char *format, ...);
+int      homa_metrics_bin_open(struct inode *inode, struct file *file);
+ssize_t  homa_metrics_bin_read(struct file *file, char __user *buffer,
+			       size_t length, loff_t *offset);
+int      homa_metrics_bin_release(struct inode *inode, struct file *file);
 loff_t   homa_metrics_lseek(struct file *file, loff_t offset,
 			    int whence);
 int      homa_metrics_open(struct inode *inode, struct file *file);
@@ -669,6 +1032,7 @@ char    *homa_metrics_print(struct homa *homa);
 ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
 			   size_t length, loff_t *offset);
 int      homa_metrics_release(struct inode *inode, struct file *file);
+int      homa_metrics_schema(struct homa *homa);
 int      homa_proc_read_metrics(char *buffer, char **start, off_t offset,
 				int count, int *eof, void *data);
 
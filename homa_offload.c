@@ -134,9 +134,9 @@ struct sk_buff *homa_tcp_gro_receive(struct list_head *held_list,
 	struct homa_common_hdr *h = (struct homa_common_hdr *)
 			skb_transport_header(skb);
 
-	// tt_record4("homa_tcp_gro_receive got type 0x%x, flags 0x%x, "
-	//		"urgent 0x%x, id %d", h->type, h->flags,
-	//		ntohs(h->urgent), homa_local_id(h->sender_id));
+	// tt_rpc_record4(homa_local_id(h->sender_id), "homa_tcp_gro_receive got type 0x%x, flags 0x%x, "
+	    //		"urgent 0x%x, id %d", h->type, h->flags,
+	    //		ntohs(h->urgent), homa_local_id(h->sender_id));
 	if (h->flags != HOMA_TCP_FLAGS ||
 	    ntohs(h->urgent) != HOMA_TCP_URGENT)
 		return tcp_net_offload->callbacks.gro_receive(held_list, skb);
@@ -316,9 +316,9 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 				   ntohl(h_new->common.sequence));
 			h_new->seg.offset = h_new->common.sequence;
 		}
-		tt_record4("homa_gro_receive got packet from 0x%x id %llu, offset %d, priority %d",
-			   saddr, homa_local_id(h_new->common.sender_id),
-			   ntohl(h_new->seg.offset), priority);
+		tt_rpc_record4(homa_local_id(h_new->common.sender_id), "homa_gro_receive got packet from 0x%x id %llu, offset %d, priority %d",
+			       saddr, homa_local_id(h_new->common.sender_id),
+			       ntohl(h_new->seg.offset), priority);
 		if (homa_data_len(skb) == ntohl(h_new->message_length) &&
 		    (homa->gro_policy & HOMA_GRO_SHORT_BYPASS) &&
 		    !busy) {
@@ -326,10 +326,10 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			goto bypass;
 		}
 	} else if (h_new->common.type == GRANT) {
-		tt_record4("homa_gro_receive got grant from 0x%x id %llu, offset %d, priority %d",
-			   saddr, homa_local_id(h_new->common.sender_id),
-			   ntohl(((struct homa_grant_hdr *)h_new)->offset),
-			   priority);
+		tt_rpc_record4(homa_local_id(h_new->common.sender_id), "homa_gro_receive got grant from 0x%x id %llu, offset %d, priority %d",
+			       saddr, homa_local_id(h_new->common.sender_id),
+			       ntohl(((struct homa_grant_hdr *)h_new)->offset),
+			       priority);
 		/* The following optimization handles grants here at NAPI
 		 * level, bypassing the SoftIRQ mechanism (and avoiding the
 		 * delay of handing off to a different core). This makes
@@ -342,9 +342,9 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 		}
 #ifndef __STRIP__ /* See strip.py */
 	} else {
-		tt_record4("homa_gro_receive got packet from 0x%x id %llu, type 0x%x, priority %d",
-			   saddr, homa_local_id(h_new->common.sender_id),
-			   h_new->common.type, priority);
+		tt_rpc_record4(homa_local_id(h_new->common.sender_id), "homa_gro_receive got packet from 0x%x id %llu, type 0x%x, priority %d",
+			       saddr, homa_local_id(h_new->common.sender_id),
+			       h_new->common.type, priority);
 #endif /* See strip.py */
 	}
 
@@ -494,9 +494,9 @@ void homa_gro_gen2(struct homa *homa, struct sk_buff *skb)
 			continue;
 		if ((offload_core->last_gro + homa->busy_ns) > now)
 			continue;
-		tt_record3("homa_gro_gen2 chose core %d for id %d offset %d",
-			   candidate, homa_local_id(h->common.sender_id),
-			   ntohl(h->seg.offset));
+		tt_rpc_record3(homa_local_id(h->common.sender_id), "homa_gro_gen2 chose core %d for id %d offset %d",
+			       candidate, homa_local_id(h->common.sender_id),
+			       ntohl(h->seg.offset));
 		break;
 	}
 	if (i <= 0) {
@@ -512,9 +512,9 @@ void homa_gro_gen2(struct homa *homa, struct sk_buff *skb)
 		candidate = this_core + offset;
 		while (candidate >= nr_cpu_ids)
 			candidate -= nr_cpu_ids;
-		tt_record3("homa_gro_gen2 chose core %d for id %d offset %d (all cores busy)",
-			   candidate, homa_local_id(h->common.sender_id),
-			   ntohl(h->seg.offset));
+		tt_rpc_record3(homa_local_id(h->common.sender_id), "homa_gro_gen2 chose core %d for id %d offset %d (all cores busy)",
+			       candidate, homa_local_id(h->common.sender_id),
+			       ntohl(h->seg.offset));
 	}
 	atomic_inc(&per_cpu(homa_offload_core, candidate).softirq_backlog);
 	homa_set_softirq_cpu(skb, candidate);
@@ -559,10 +559,10 @@ void homa_gro_gen3(struct homa *homa, struct sk_buff *skb)
 	}
 	homa_set_softirq_cpu(skb, core);
 	per_cpu(homa_offload_core, core).last_active = now;
-	tt_record4("homa_gro_gen3 chose core %d for id %d, offset %d, delta %d",
-		   core, homa_local_id(h->common.sender_id),
-		   ntohl(h->seg.offset),
-		   now - per_cpu(homa_offload_core, core).last_app_active);
+	tt_rpc_record4(homa_local_id(h->common.sender_id), "homa_gro_gen3 chose core %d for id %d, offset %d, delta %d",
+		       core, homa_local_id(h->common.sender_id),
+		       ntohl(h->seg.offset),
+		       now - per_cpu(homa_offload_core, core).last_app_active);
 	INC_METRIC(gen3_handoffs, 1);
 	if (core != candidates[0])
 		INC_METRIC(gen3_alt_handoffs, 1);
@@ -584,10 +584,10 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 			(struct homa_data_hdr *)skb_transport_header(skb);
 	struct homa *homa = global_homa;
 
-	// tt_record4("homa_gro_complete type %d, id %d, offset %d, count %d",
-	//		h->common.type, homa_local_id(h->common.sender_id),
-	//		ntohl(h->seg.offset),
-	//		NAPI_GRO_CB(skb)->count);
+	// tt_rpc_record4(homa_local_id(h->common.sender_id), "homa_gro_complete type %d, id %d, offset %d, count %d",
+	    //		h->common.type, homa_local_id(h->common.sender_id),
+	    //		ntohl(h->seg.offset),
+	    //		NAPI_GRO_CB(skb)->count);
 
 	per_cpu(homa_offload_core, raw_smp_processor_id()).held_skb = NULL;
 	if (homa->gro_policy & HOMA_GRO_GEN3) {
@@ -619,9 +619,9 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 			}
 		}
 		homa_set_softirq_cpu(skb, best);
-		tt_record3("homa_gro_complete chose core %d for id %d offset %d with IDLE policy",
-			   best, homa_local_id(h->common.sender_id),
-			   ntohl(h->seg.offset));
+		tt_rpc_record3(homa_local_id(h->common.sender_id), "homa_gro_complete chose core %d for id %d offset %d with IDLE policy",
+			       best, homa_local_id(h->common.sender_id),
+			       ntohl(h->seg.offset));
 	} else if (homa->gro_policy & HOMA_GRO_NEXT) {
 		/* Use the next core (in circular order) to handle the
 		 * SoftIRQ processing.
@@ -631,9 +631,9 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 		if (unlikely(target >= nr_cpu_ids))
 			target = 0;
 		homa_set_softirq_cpu(skb, target);
-		tt_record3("homa_gro_complete chose core %d for id %d offset %d with NEXT policy",
-			   target, homa_local_id(h->common.sender_id),
-			   ntohl(h->seg.offset));
+		tt_rpc_record3(homa_local_id(h->common.sender_id), "homa_gro_complete chose core %d for id %d offset %d with NEXT policy",
+			       target, homa_local_id(h->common.sender_id),
+			       ntohl(h->seg.offset));
 	}
 
 	return 0;
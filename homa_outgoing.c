@@ -29,6 +29,7 @@ void homa_message_out_init(struct homa_rpc *rpc, int length)
 		rpc->msgout.unscheduled = length;
 	rpc->msgout.sched_priority = 0;
 	rpc->msgout.init_ns = sched_clock();
+	rpc->msgout.zc_uarg = NULL;
 }
 
 /**
@@ -62,8 +63,12 @@ int homa_fill_data_interleaved(struct homa_rpc *rpc, struct sk_buff *skb,
 
 		if (bytes_left < seg_length)
 			seg_length = bytes_left;
-		err = homa_skb_append_from_iter(rpc->hsk->homa, skb, iter,
-						seg_length);
+		if (rpc->msgout.zc_uarg)
+			err = homa_skb_append_zerocopy(rpc->hsk->homa, skb,
+						       iter, seg_length);
+		else
+			err = homa_skb_append_from_iter(rpc->hsk->homa, skb,
+							iter, seg_length);
 		if (err != 0)
 			return err;
 		bytes_left -= seg_length;
@@ -146,6 +151,8 @@ struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 	homa_info->seg_length = max_seg_data;
 	homa_info->offset = offset;
 
+	if (rpc->msgout.zc_uarg)
+		skb_zcopy_set(skb, rpc->msgout.zc_uarg, NULL);
 	if (segs > 1 && rpc->hsk->sock.sk_protocol != IPPROTO_TCP) {
 		homa_set_doff(h, sizeof(struct homa_data_hdr)  -
 				sizeof32(struct homa_seg_hdr));
@@ -154,8 +161,12 @@ struct sk_buff *homa_new_data_packet(struct homa_rpc *rpc,
 		err = homa_fill_data_interleaved(rpc, skb, iter);
 	} else {
 		gso_size = max_seg_data;
-		err = homa_skb_append_from_iter(rpc->hsk->homa, skb, iter,
-						length);
+		if (rpc->msgout.zc_uarg)
+			err = homa_skb_append_zerocopy(rpc->hsk->homa, skb,
+						       iter, length);
+		else
+			err = homa_skb_append_from_iter(rpc->hsk->homa, skb,
+							iter, length);
 	}
 	if (err)
 		goto error;
@@ -180,7 +191,11 @@ error:
 /**
  * homa_message_out_fill() - Initializes information for sending a message
  * for an RPC (either request or response); copies the message data from
- * user space and (possibly) begins transmitting the message.
+ * user space and (possibly) begins transmitting the message. If the
+ * RPC_ZEROCOPY flag is set for the RPC and the message is long enough,
+ * user pages are attached to the packets instead of being copied; the
+ * application is notified via the socket's error queue once the message's
+ * packets have all been freed.
  * @rpc:     RPC for which to send message; this function must not
  *           previously have been called for the RPC. Must be locked. The RPC
  *           will be unlocked while copying data, but will be locked again
@@ -225,8 +240,8 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	homa_message_out_init(rpc, iter->count);
 	if (unlikely(rpc->msgout.length > HOMA_MAX_MESSAGE_LENGTH ||
 		     rpc->msgout.length == 0)) {
-		tt_record2("homa_message_out_fill found bad length %d for id %d",
-			   rpc->msgout.length, rpc->id);
+		tt_rpc_record2(rpc->id, "homa_message_out_fill found bad length %d for id %d",
+			       rpc->msgout.length, rpc->id);
 		err = -EINVAL;
 		goto error;
 	}
@@ -259,6 +274,36 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	}
 	if (segs_per_gso == 0)
 		segs_per_gso = 1;
+
+	if ((atomic_read(&rpc->flags) & RPC_ZEROCOPY) &&
+	    rpc->msgout.length >= rpc->hsk->homa->zerocopy_min_bytes) {
+		rpc->msgout.zc_uarg = msg_zerocopy_realloc(&rpc->hsk->sock,
+							   rpc->msgout.length,
+							   NULL);
+		if (rpc->msgout.zc_uarg) {
+			__u64 max_segs;
+			int frags;
+
+			/* Each segment's data can span several user pages,
+			 * each of which needs its own frag (plus one for the
+			 * homa_seg_hdr if not hijacking), so GSO packets must
+			 * be smaller than when copying.
+			 */
+			frags = DIV_ROUND_UP(max_seg_data, PAGE_SIZE) + 1;
+			if (rpc->hsk->sock.sk_protocol == IPPROTO_TCP) {
+				max_segs = (MAX_SKB_FRAGS - 1) * PAGE_SIZE;
+				do_div(max_segs, max_seg_data);
+			} else {
+				max_segs = MAX_SKB_FRAGS / (frags + 1);
+			}
+			if (max_segs == 0)
+				max_segs = 1;
+			if (segs_per_gso > max_segs)
+				segs_per_gso = max_segs;
+		} else {
+			INC_METRIC(zerocopy_alloc_failures, 1);
+		}
+	}
 	max_gso_data = segs_per_gso * max_seg_data;
 	UNIT_LOG("; ", "mtu %d, max_seg_data %d, max_gso_data %d",
 		 mtu, max_seg_data, max_gso_data);
@@ -269,8 +314,8 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	homa_skb_stash_pages(rpc->hsk->homa, rpc->msgout.length);
 
 	/* Each iteration of the loop below creates one GSO packet. */
-	tt_record3("starting copy from user space for id %d, length %d, unscheduled %d",
-		   rpc->id, rpc->msgout.length, rpc->msgout.unscheduled);
+	tt_rpc_record3(rpc->id, "starting copy from user space for id %d, length %d, unscheduled %d",
+		       rpc->id, rpc->msgout.length, rpc->msgout.unscheduled);
 	last_link = &rpc->msgout.packets;
 	for (bytes_left = rpc->msgout.length; bytes_left > 0; ) {
 		int skb_data_bytes, offset;
@@ -290,7 +335,7 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 			skb_data_bytes = bytes_left;
 		skb = homa_new_data_packet(rpc, iter, offset, skb_data_bytes,
 					   max_seg_data);
-		if (unlikely(!skb)) {
+		if (unlikely(IS_ERR(skb))) {
 			err = PTR_ERR(skb);
 			homa_rpc_lock(rpc, "homa_message_out_fill");
 			goto error;
@@ -311,12 +356,17 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 		rpc->msgout.copied_from_user = rpc->msgout.length - bytes_left;
 		if (overlap_xmit && list_empty(&rpc->throttled_links) &&
 		    xmit && offset < rpc->msgout.granted) {
-			tt_record1("waking up pacer for id %d", rpc->id);
+			tt_rpc_record1(rpc->id, "waking up pacer for id %d", rpc->id);
 			homa_add_to_throttled(rpc);
 		}
 	}
-	tt_record2("finished copy from user space for id %d, length %d",
-		   rpc->id, rpc->msgout.length);
+	tt_rpc_record2(rpc->id, "finished copy from user space for id %d, length %d",
+		       rpc->id, rpc->msgout.length);
+	if (rpc->msgout.zc_uarg) {
+		/* Packets now hold the only references. */
+		net_zcopy_put(rpc->msgout.zc_uarg);
+		rpc->msgout.zc_uarg = NULL;
+	}
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
 	INC_METRIC(sent_msg_bytes, rpc->msgout.length);
 	if (!overlap_xmit && xmit)
@@ -324,6 +374,14 @@ int homa_message_out_fill(struct homa_rpc *rpc, struct iov_iter *iter, int xmit)
 	return 0;
 
 error:
+	if (rpc->msgout.zc_uarg) {
+		/* The send failed, so the application shouldn't receive a
+		 * notification for it (even once any packets that were
+		 * created are freed).
+		 */
+		net_zcopy_put_abort(rpc->msgout.zc_uarg, true);
+		rpc->msgout.zc_uarg = NULL;
+	}
 	atomic_andnot(RPC_COPYING_FROM_USER, &rpc->flags);
 	return err;
 }
@@ -443,13 +501,17 @@ int __homa_xmit_control(void *contents, size_t length, struct homa_peer *peer,
 #ifndef __STRIP__ /* See strip.py */
 	txq = netdev_get_tx_queue(skb->dev, skb->queue_mapping);
 	if (netif_tx_queue_stopped(txq))
-		tt_record4("__homa_xmit_control found stopped txq for id %d, qid %d, num_queued %d, limit %d",
-			   be64_to_cpu(h->sender_id), skb->queue_mapping,
-			   txq->dql.num_queued, txq->dql.adj_limit);
+		tt_rpc_record4(be64_to_cpu(h->sender_id), "__homa_xmit_control found stopped txq for id %d, qid %d, num_queued %d, limit %d",
+			       be64_to_cpu(h->sender_id), skb->queue_mapping,
+			       txq->dql.num_queued, txq->dql.adj_limit);
 #endif /* See strip.py */
 	INC_METRIC(packets_sent[h->type - DATA], 1);
 	INC_METRIC(priority_bytes[priority], skb->len);
 	INC_METRIC(priority_packets[priority], 1);
+
+	/* Don't try to recycle: the IP stack normally still holds a
+	 * reference at this point, so this just drops ours.
+	 */
 	kfree_skb(skb);
 	return result;
 }
@@ -471,9 +533,9 @@ void homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk)
 		pr_notice("sending UNKNOWN to peer %s:%d for id %llu",
 			  homa_print_ipv6_addr(&saddr),
 			  ntohs(h->sport), homa_local_id(h->sender_id));
-	tt_record3("sending unknown to 0x%x:%d for id %llu",
-		   tt_addr(saddr), ntohs(h->sport),
-		   homa_local_id(h->sender_id));
+	tt_rpc_record3(homa_local_id(h->sender_id), "sending unknown to 0x%x:%d for id %llu",
+		       tt_addr(saddr), ntohs(h->sport),
+		       homa_local_id(h->sender_id));
 	unknown.common.sport = h->dport;
 	unknown.common.dport = h->sport;
 	unknown.common.type = UNKNOWN;
@@ -515,17 +577,17 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		struct sk_buff *skb = *rpc->msgout.next_xmit;
 
 		if (rpc->msgout.next_xmit_offset >= rpc->msgout.granted) {
-			tt_record3("homa_xmit_data stopping at offset %d for id %u: granted is %d",
-				   rpc->msgout.next_xmit_offset, rpc->id,
-				   rpc->msgout.granted);
+			tt_rpc_record3(rpc->id, "homa_xmit_data stopping at offset %d for id %u: granted is %d",
+				       rpc->msgout.next_xmit_offset, rpc->id,
+				       rpc->msgout.granted);
 			break;
 		}
 
 		if ((rpc->msgout.length - rpc->msgout.next_xmit_offset)
 				>= homa->throttle_min_bytes) {
 			if (!homa_check_nic_queue(homa, skb, force)) {
-				tt_record1("homa_xmit_data adding id %u to throttle queue",
-					   rpc->id);
+				tt_rpc_record1(rpc->id, "homa_xmit_data adding id %u to throttle queue",
+					       rpc->id);
 				homa_add_to_throttled(rpc);
 				break;
 			}
@@ -537,6 +599,9 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		} else {
 			priority = rpc->msgout.sched_priority;
 		}
+		if (rpc->msgout.next_xmit_offset == 0 && homa_is_client(rpc->id))
+			INC_LATENCY(lat_send_first_pkt_ns,
+				    sched_clock() - rpc->start_ns);
 		rpc->msgout.next_xmit = &(homa_get_skb_info(skb)->next_skb);
 		rpc->msgout.next_xmit_offset +=
 				homa_get_skb_info(skb)->data_bytes;
@@ -547,9 +612,9 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 #ifndef __STRIP__ /* See strip.py */
 		txq = netdev_get_tx_queue(skb->dev, skb->queue_mapping);
 		if (netif_tx_queue_stopped(txq))
-			tt_record4("homa_xmit_data found stopped txq for id %d, qid %d, num_queued %d, limit %d",
-				   rpc->id, skb->queue_mapping,
-				   txq->dql.num_queued, txq->dql.adj_limit);
+			tt_rpc_record4(rpc->id, "homa_xmit_data found stopped txq for id %d, qid %d, num_queued %d, limit %d",
+				       rpc->id, skb->queue_mapping,
+				       txq->dql.num_queued, txq->dql.adj_limit);
 #endif /* See strip.py */
 		force = false;
 		homa_rpc_lock(rpc, "homa_xmit_data");
@@ -590,26 +655,26 @@ void __homa_xmit_data(struct sk_buff *skb, struct homa_rpc *rpc, int priority)
 	skb->csum_start = skb_transport_header(skb) - skb->head;
 	skb->csum_offset = offsetof(struct homa_common_hdr, checksum);
 	if (rpc->hsk->inet.sk.sk_family == AF_INET6) {
-		tt_record4("calling ip6_xmit: wire_bytes %d, peer 0x%x, id %d, offset %d",
-			   homa_get_skb_info(skb)->wire_bytes,
-			   tt_addr(rpc->peer->addr), rpc->id,
-			   homa_info->offset);
+		tt_rpc_record4(rpc->id, "calling ip6_xmit: wire_bytes %d, peer 0x%x, id %d, offset %d",
+			       homa_get_skb_info(skb)->wire_bytes,
+			       tt_addr(rpc->peer->addr), rpc->id,
+			       homa_info->offset);
 		err = ip6_xmit(&rpc->hsk->inet.sk, skb, &rpc->peer->flow.u.ip6,
 			       0, NULL,
 			       rpc->hsk->homa->priority_map[priority] << 4, 0);
 	} else {
-		tt_record4("calling ip_queue_xmit: wire_bytes %d, peer 0x%x, id %d, offset %d",
-			   homa_get_skb_info(skb)->wire_bytes,
-			   tt_addr(rpc->peer->addr), rpc->id,
-			   homa_info->offset);
+		tt_rpc_record4(rpc->id, "calling ip_queue_xmit: wire_bytes %d, peer 0x%x, id %d, offset %d",
+			       homa_get_skb_info(skb)->wire_bytes,
+			       tt_addr(rpc->peer->addr), rpc->id,
+			       homa_info->offset);
 
 		rpc->hsk->inet.tos =
 				rpc->hsk->homa->priority_map[priority] << 5;
 		err = ip_queue_xmit(&rpc->hsk->inet.sk, skb, &rpc->peer->flow);
 	}
-	tt_record4("Finished queueing packet: rpc id %llu, offset %d, len %d, qid %d",
-		   rpc->id, homa_info->offset,
-		   homa_get_skb_info(skb)->data_bytes, skb->queue_mapping);
+	tt_rpc_record4(rpc->id, "Finished queueing packet: rpc id %llu, offset %d, len %d, qid %d",
+		       rpc->id, homa_info->offset,
+		       homa_get_skb_info(skb)->data_bytes, skb->queue_mapping);
 	if (err)
 		INC_METRIC(data_xmit_errors, 1);
 	INC_METRIC(packets_sent[0], 1);
@@ -714,11 +779,12 @@ void homa_resend_data(struct homa_rpc *rpc, int start, int end,
 			new_homa_info->data_bytes = seg_length;
 			new_homa_info->seg_length = seg_length;
 			new_homa_info->offset = offset;
-			tt_record3("retransmitting offset %d, length %d, id %d",
-				   offset, seg_length, rpc->id);
+			tt_rpc_record3(rpc->id, "retransmitting offset %d, length %d, id %d",
+				       offset, seg_length, rpc->id);
 			homa_check_nic_queue(rpc->hsk->homa, new_skb, true);
 			__homa_xmit_data(new_skb, rpc, priority);
 			INC_METRIC(resent_packets, 1);
+			INC_CONN_STAT(rpc->hsk, retransmits, 1);
 		}
 	}
 
@@ -939,10 +1005,10 @@ void homa_pacer_xmit(struct homa *homa)
 		}
 		homa_throttle_unlock(homa);
 
-		tt_record4("pacer calling homa_xmit_data for rpc id %llu, port %d, offset %d, bytes_left %d",
-			   rpc->id, rpc->hsk->port,
-			   rpc->msgout.next_xmit_offset,
-			   rpc->msgout.length - rpc->msgout.next_xmit_offset);
+		tt_rpc_record4(rpc->id, "pacer calling homa_xmit_data for rpc id %llu, port %d, offset %d, bytes_left %d",
+			       rpc->id, rpc->hsk->port,
+			       rpc->msgout.next_xmit_offset,
+			       rpc->msgout.length - rpc->msgout.next_xmit_offset);
 		homa_xmit_data(rpc, true);
 
 		/* Note: rpc->state could be RPC_DEAD here, but the code
@@ -955,8 +1021,8 @@ void homa_pacer_xmit(struct homa *homa)
 			 */
 			homa_throttle_lock(homa);
 			if (!list_empty(&rpc->throttled_links)) {
-				tt_record2("pacer removing id %d from throttled list, offset %d",
-					   rpc->id, rpc->msgout.next_xmit_offset);
+				tt_rpc_record2(rpc->id, "pacer removing id %d from throttled list, offset %d",
+					       rpc->id, rpc->msgout.next_xmit_offset);
 				list_del_rcu(&rpc->throttled_links);
 				if (list_empty(&homa->throttled_rpcs))
 					INC_METRIC(throttled_ns, sched_clock()
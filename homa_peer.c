@@ -365,13 +365,18 @@ void homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1, int c2,
 void homa_peer_lock_slow(struct homa_peer *peer)
 	__acquires(&peer->ack_lock)
 {
+	unsigned long holder = homa_lockprof_holder(&peer->ack_lock);
 	__u64 start = sched_clock();
+	__u64 wait;
 
 	tt_record("beginning wait for peer lock");
 	spin_lock_bh(&peer->ack_lock);
 	tt_record("ending wait for peer lock");
+	wait = sched_clock() - start;
 	INC_METRIC(peer_ack_lock_misses, 1);
-	INC_METRIC(peer_ack_lock_miss_ns, sched_clock() - start);
+	INC_METRIC(peer_ack_lock_miss_ns, wait);
+	homa_lockprof_wait(HOMA_LOCK_CLASS_PEER, &peer->ack_lock, _RET_IP_,
+			   holder, wait);
 }
 
 /**
@@ -227,6 +227,8 @@ static inline void homa_peer_lock(struct homa_peer *peer)
 {
 	if (!spin_trylock_bh(&peer->ack_lock))
 		homa_peer_lock_slow(peer);
+	else
+		homa_lockprof_acquired(&peer->ack_lock, _THIS_IP_);
 }
 
 /**
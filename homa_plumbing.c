@@ -63,7 +63,7 @@ static const struct proto_ops homa_proto_ops = {
 	.getsockopt	   = sock_common_getsockopt,
 	.sendmsg	   = inet_sendmsg,
 	.recvmsg	   = inet_recvmsg,
-	.mmap		   = sock_no_mmap,
+	.mmap		   = homa_pool_mmap,
 	.set_peek_off	   = sk_set_peek_off,
 };
 
@@ -84,7 +84,7 @@ static const struct proto_ops homav6_proto_ops = {
 	.getsockopt	   = sock_common_getsockopt,
 	.sendmsg	   = inet_sendmsg,
 	.recvmsg	   = inet_recvmsg,
-	.mmap		   = sock_no_mmap,
+	.mmap		   = homa_pool_mmap,
 	.set_peek_off	   = sk_set_peek_off,
 };
 
@@ -186,6 +186,64 @@ static const struct proc_ops homa_metrics_pops = {
 /* Used to remove /proc/net/homa_metrics when the module is unloaded. */
 static struct proc_dir_entry *metrics_dir_entry;
 
+/* Describes file operations implemented for /proc/net/homa_metrics_bin. */
+static const struct proc_ops homa_metrics_bin_pops = {
+	.proc_open         = homa_metrics_bin_open,
+	.proc_read         = homa_metrics_bin_read,
+	.proc_release      = homa_metrics_bin_release,
+};
+
+/* Used to remove /proc/net/homa_metrics_bin when the module is unloaded. */
+static struct proc_dir_entry *metrics_bin_dir_entry;
+
+/**
+ * homa_conns_open() - This function is invoked when /proc/net/homa_conns
+ * is opened.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+static int homa_conns_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, homa_sock_conns_show, global_homa);
+}
+
+/* Describes file operations implemented for /proc/net/homa_conns. */
+static const struct proc_ops homa_conns_pops = {
+	.proc_open         = homa_conns_open,
+	.proc_read         = seq_read,
+	.proc_lseek        = seq_lseek,
+	.proc_release      = single_release,
+};
+
+/* Used to remove /proc/net/homa_conns when the module is unloaded. */
+static struct proc_dir_entry *conns_dir_entry;
+
+/**
+ * homa_locks_open() - This function is invoked when /proc/net/homa_locks
+ * is opened.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, otherwise a negative errno.
+ */
+static int homa_locks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, homa_lockprof_show, NULL);
+}
+
+/* Describes file operations implemented for /proc/net/homa_locks. */
+static const struct proc_ops homa_locks_pops = {
+	.proc_open         = homa_locks_open,
+	.proc_read         = seq_read,
+	.proc_lseek        = seq_lseek,
+	.proc_release      = single_release,
+};
+
+/* Used to remove /proc/net/homa_locks when the module is unloaded. */
+static struct proc_dir_entry *locks_dir_entry;
+
 /* Used to configure sysctl access to Homa configuration parameters.*/
 static struct ctl_table homa_ctl_table[] = {
 	{
@@ -195,6 +253,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "adaptive_poll",
+		.data		= &homa_data.adaptive_poll,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "bpage_lease_usecs",
 		.data		= &homa_data.bpage_lease_usecs,
@@ -209,6 +274,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "copyout_min_bytes",
+		.data		= &homa_data.copyout_min_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "copyout_workers",
+		.data		= &homa_data.copyout_workers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "cutoff_version",
 		.data		= &homa_data.cutoff_version,
@@ -293,6 +372,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "lock_profile",
+		.data		= &homa_data.lock_profile,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "max_dead_buffs",
 		.data		= &homa_data.max_dead_buffs,
@@ -398,6 +484,20 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "reap_work_skbs",
+		.data		= &homa_data.reap_work_skbs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "reap_workers",
+		.data		= &homa_data.reap_workers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "request_ack_ticks",
 		.data		= &homa_data.request_ack_ticks,
@@ -461,6 +561,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "tt_sample_rate",
+		.data		= &homa_data.tt_sample_rate,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "unsched_bytes",
 		.data		= &homa_data.unsched_bytes,
@@ -489,6 +596,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "zerocopy_min_bytes",
+		.data		= &homa_data.zerocopy_min_bytes,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
 	{}
 #endif
@@ -583,6 +697,28 @@ int __init homa_load(void)
 		status = -ENOMEM;
 		goto metrics_err;
 	}
+	metrics_bin_dir_entry = proc_create("homa_metrics_bin", 0444,
+					    init_net.proc_net,
+					    &homa_metrics_bin_pops);
+	if (!metrics_bin_dir_entry) {
+		pr_err("couldn't create /proc/net/homa_metrics_bin\n");
+		status = -ENOMEM;
+		goto metrics_bin_err;
+	}
+	conns_dir_entry = proc_create("homa_conns", 0444, init_net.proc_net,
+				      &homa_conns_pops);
+	if (!conns_dir_entry) {
+		pr_err("couldn't create /proc/net/homa_conns\n");
+		status = -ENOMEM;
+		goto conns_err;
+	}
+	locks_dir_entry = proc_create("homa_locks", 0444, init_net.proc_net,
+				      &homa_locks_pops);
+	if (!locks_dir_entry) {
+		pr_err("couldn't create /proc/net/homa_locks\n");
+		status = -ENOMEM;
+		goto locks_err;
+	}
 
 	homa_ctl_header = register_net_sysctl(&init_net, "net/homa",
 					      homa_ctl_table);
@@ -619,6 +755,12 @@ timer_err:
 offload_err:
 	unregister_net_sysctl_table(homa_ctl_header);
 sysctl_err:
+	proc_remove(locks_dir_entry);
+locks_err:
+	proc_remove(conns_dir_entry);
+conns_err:
+	proc_remove(metrics_bin_dir_entry);
+metrics_bin_err:
 	proc_remove(metrics_dir_entry);
 metrics_err:
 	homa_destroy(homa);
@@ -658,6 +800,9 @@ void __exit homa_unload(void)
 		pr_err("Homa couldn't stop offloads\n");
 	wait_for_completion(&timer_thread_done);
 	unregister_net_sysctl_table(homa_ctl_header);
+	proc_remove(locks_dir_entry);
+	proc_remove(conns_dir_entry);
+	proc_remove(metrics_bin_dir_entry);
 	proc_remove(metrics_dir_entry);
 	homa_destroy(homa);
 	inet_del_protocol(&homa_protocol, IPPROTO_HOMA);
@@ -835,6 +980,73 @@ int homa_socket(struct sock *sk)
 	return result;
 }
 
+/**
+ * homa_setsockopt_group() - Helper function for homa_setsockopt: handles
+ * the SO_HOMA_GROUP option, which adds a socket to a socket group or
+ * removes it from its current group.
+ * @hsk:     Socket whose group membership is changing.
+ * @optval:  Address in user space of a struct homa_group_args.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_group(struct homa_sock *hsk, sockptr_t optval,
+				 unsigned int optlen)
+{
+	struct homa_group_args args;
+	struct socket *sock;
+	struct sock *group;
+	int ret;
+
+	if (optlen != sizeof(args))
+		return -EINVAL;
+	if (copy_from_sockptr(&args, optval, optlen))
+		return -EFAULT;
+	if (args.fd < 0) {
+		homa_sock_leave_group(hsk);
+		return 0;
+	}
+
+	sock = sockfd_lookup(args.fd, &ret);
+	if (!sock)
+		return ret;
+	group = sock->sk;
+	if ((group->sk_prot != &homa_prot && group->sk_prot != &homav6_prot) ||
+	    group->sk_family != hsk->sock.sk_family) {
+		sockfd_put(sock);
+		return -EINVAL;
+	}
+	sock_hold(group);
+	sockfd_put(sock);
+	ret = homa_sock_join_group(hsk, homa_sk(group), args.cookie);
+	if (ret != 0)
+		sock_put(group);
+	return ret;
+}
+
+/**
+ * homa_setsockopt_inline() - Helper function for homa_setsockopt: handles
+ * the SO_HOMA_INLINE option, which sets the largest incoming message that
+ * will be delivered inline.
+ * @hsk:     Socket whose configuration is changing.
+ * @optval:  Address in user space of an int value.
+ * @optlen:  Number of bytes of data at @optval.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_setsockopt_inline(struct homa_sock *hsk, sockptr_t optval,
+				  unsigned int optlen)
+{
+	int inline_max;
+
+	if (optlen != sizeof(inline_max))
+		return -EINVAL;
+	if (copy_from_sockptr(&inline_max, optval, optlen))
+		return -EFAULT;
+	if (inline_max < 0 || inline_max > HOMA_MAX_INLINE)
+		return -EINVAL;
+	WRITE_ONCE(hsk->inline_max, inline_max);
+	return 0;
+}
+
 /**
  * homa_setsockopt() - Implements the getsockopt system call for Homa sockets.
  * @sk:      Socket on which the system call was invoked.
@@ -851,9 +1063,16 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 	struct homa_sock *hsk = homa_sk(sk);
 	struct homa_rcvbuf_args args;
 	__u64 start = sched_clock();
+	int mappable;
 	int ret;
 
-	if (level != IPPROTO_HOMA || optname != SO_HOMA_RCVBUF)
+	if (level != IPPROTO_HOMA)
+		return -ENOPROTOOPT;
+	if (optname == SO_HOMA_GROUP)
+		return homa_setsockopt_group(hsk, optval, optlen);
+	if (optname == SO_HOMA_INLINE)
+		return homa_setsockopt_inline(hsk, optval, optlen);
+	if (optname != SO_HOMA_RCVBUF)
 		return -ENOPROTOOPT;
 	if (optlen != sizeof(struct homa_rcvbuf_args))
 		return -EINVAL;
@@ -868,9 +1087,20 @@ int homa_setsockopt(struct sock *sk, int level, int optname,
 			 sizeof(args)))
 		return -EFAULT;
 
-	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_RCV_BUF");
-	ret = homa_pool_init(hsk, (__force void __user *)args.start,
-			     args.length);
+	/* Must check this before locking the socket (may sleep). */
+	mappable = homa_pool_mappable(hsk, (__force void __user *)args.start,
+				      args.length);
+
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+	if (hsk->pool_group) {
+		/* The socket uses its group's buffer pool. */
+		ret = -EINVAL;
+	} else {
+		ret = homa_pool_init(hsk, (__force void __user *)args.start,
+				     args.length);
+		if (ret == 0)
+			hsk->buffer_pool->zerocopy = mappable;
+	}
 	homa_sock_unlock(hsk);
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_ns, sched_clock() - start);
@@ -957,14 +1187,21 @@ static int homa_do_peeloff(struct sock *sk, struct sockaddr *uaddr, int addr_len
 	hlist_add_head_rcu(&hsk2->socktab_links.hash_links,
 			   &socktab->buckets[homa_port_hash(hsk2->port)]);
 	/* Other relevant fields filled by homa_sock_init */
-	INIT_LIST_HEAD(&hsk2->active_rpcs);
-	INIT_LIST_HEAD(&hsk2->dead_rpcs);
-	hsk2->dead_skbs = 0;
+	homa_sock_init_shards(hsk2);
 	INIT_LIST_HEAD(&hsk2->waiting_for_bufs);
 	INIT_LIST_HEAD(&hsk2->ready_requests);
 	INIT_LIST_HEAD(&hsk2->ready_responses);
 	INIT_LIST_HEAD(&hsk2->request_interests);
 	INIT_LIST_HEAD(&hsk2->response_interests);
+	hsk2->last_handoff_ns = 0;
+	hsk2->avg_handoff_gap_ns = 0;
+	hsk2->group = NULL;
+	hsk2->group_cookie = 0;
+	hsk2->group_members = 0;
+	INIT_LIST_HEAD(&hsk2->members);
+	INIT_LIST_HEAD(&hsk2->member_links);
+	hsk2->pool_group = NULL;
+	hsk2->inline_max = hsk->inline_max;
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
 		struct homa_rpc_bucket *bucket = &hsk2->client_rpc_buckets[i];
 
@@ -985,6 +1222,7 @@ static int homa_do_peeloff(struct sock *sk, struct sockaddr *uaddr, int addr_len
 		spin_unlock_bh(&socktab->write_lock);
 		return -ENOMEM;
 	}
+	hsk2->pool_refs = 1;
 	if (homa->hijack_tcp)
 		hsk2->sock.sk_protocol = IPPROTO_TCP;
 	spin_unlock_bh(&socktab->write_lock);
@@ -1069,6 +1307,35 @@ out:
 	return retval;
 }
 
+/**
+ * homa_getsockopt_conn_stats() - Helper function in homa_getsockopt():
+ * returns statistics for a connected socket (SO_HOMA_CONN_STATS).
+ * @hsk:     Socket on which the system call was invoked.
+ * @optval:  Address in user space where a struct homa_conn_stats should be
+ *           stored.
+ * @optlen:  Address in user space of the length of @optval; will be
+ *           overwritten with the actual number of bytes stored.
+ * @len:     Current value at @optlen.
+ * Return:   0 on success, otherwise a negative errno.
+ */
+static int homa_getsockopt_conn_stats(struct homa_sock *hsk,
+				      char __user *optval,
+				      int __user *optlen, int len)
+{
+	struct homa_conn_stats stats;
+
+	if (!hsk->connect)
+		return -ENOTCONN;
+	if (len < sizeof(stats))
+		return -EINVAL;
+	homa_sock_get_conn_stats(hsk, &stats);
+	len = sizeof(stats);
+	if (copy_to_sockptr(USER_SOCKPTR(optlen), &len, sizeof(int)))
+		return -EFAULT;
+	if (copy_to_sockptr(USER_SOCKPTR(optval), &stats, len))
+		return -EFAULT;
+	return 0;
+}
 
 /**
  * homa_getsockopt() - Implements the getsockopt system call for Homa sockets.
@@ -1093,6 +1360,8 @@ int homa_getsockopt(struct sock *sk, int level, int optname,
 	if (copy_from_sockptr(&len, USER_SOCKPTR(optlen), sizeof(uint32_t)))
 		return -EFAULT;
 
+	if (level == IPPROTO_HOMA && optname == SO_HOMA_CONN_STATS)
+		return homa_getsockopt_conn_stats(hsk, optval, optlen, len);
 	if (level != IPPROTO_HOMA || optname != SO_HOMA_RCVBUF)
 		return -ENOPROTOOPT;
 	if (len < sizeof(val))
@@ -1114,6 +1383,162 @@ peeloff:
 	return homa_getsockopt_peeloff(sk, optval, optlen);
 }
 
+/**
+ * homa_send_one() - Send a single request or response message. This is
+ * the part of sendmsg that is shared by connected and unconnected sockets
+ * and by batched sends.
+ * @hsk:       Socket on which to send the message.
+ * @addr:      For requests, the destination of the message; for responses,
+ *             the address of the client that sent the request.
+ * @args:      Id and completion cookie for the message (same meaning as
+ *             in struct homa_sendmsg_args). If the message is a request,
+ *             args->id is set to the id of the new RPC.
+ * @iter:      Contents of the message.
+ * @zerocopy:  True means the application requested MSG_ZEROCOPY.
+ * Return: 0 on success, 1 if the message is a response whose RPC no
+ * longer exists (nothing was sent), otherwise a negative errno.
+ */
+static int homa_send_one(struct homa_sock *hsk, union sockaddr_in_union *addr,
+			 struct homa_sendmsg_args *args, struct iov_iter *iter,
+			 bool zerocopy)
+{
+	struct in6_addr canonical_dest;
+	struct homa_rpc *rpc;
+	int result;
+
+	if (!args->id) {
+		/* This is a request message. */
+		rpc = homa_rpc_new_client(hsk, addr);
+		if (IS_ERR(rpc))
+			return PTR_ERR(rpc);
+		INC_METRIC(send_calls, 1);
+		tt_rpc_record4(rpc->id, "homa_sendmsg request, target 0x%x:%d, id %u, length %d",
+			       (addr->in6.sin6_family == AF_INET)
+			       ? ntohl(addr->in4.sin_addr.s_addr)
+			       : tt_addr(addr->in6.sin6_addr),
+			       ntohs(addr->in6.sin6_port), rpc->id,
+			       iov_iter_count(iter));
+		rpc->completion_cookie = args->completion_cookie;
+		if (zerocopy)
+			atomic_or(RPC_ZEROCOPY, &rpc->flags);
+		result = homa_message_out_fill(rpc, iter, 1);
+		if (result)
+			goto error;
+		INC_CONN_STAT(hsk, requests_sent, 1);
+		INC_CONN_STAT(hsk, bytes_sent, rpc->msgout.length);
+		args->id = rpc->id;
+		homa_rpc_unlock(rpc); /* Locked by homa_rpc_new_client. */
+		return 0;
+	}
+
+	/* This is a response message. */
+	INC_METRIC(reply_calls, 1);
+	tt_rpc_record4(args->id, "homa_sendmsg response, id %llu, port %d, pid %d, length %d",
+		       args->id, hsk->port, current->pid, iov_iter_count(iter));
+	if (args->completion_cookie != 0) {
+		tt_record("homa_sendmsg error: nonzero cookie");
+		return -EINVAL;
+	}
+	canonical_dest = canonical_ipv6_addr(addr);
+	rpc = homa_find_server_rpc(hsk, &canonical_dest, args->id);
+	if (!rpc) {
+		/* This is totally valid (e.g. the client is no longer
+		 * interested in the RPC), so sendmsg doesn't fail, but
+		 * homa_sendmsg_batch must not count the message as sent.
+		 */
+		tt_rpc_record2(args->id, "homa_sendmsg error: RPC id %d, peer 0x%x, doesn't exist",
+			       args->id, tt_addr(canonical_dest));
+		return 1;
+	}
+	if (rpc->error) {
+		result = rpc->error;
+		goto error;
+	}
+	if (rpc->state != RPC_IN_SERVICE) {
+		tt_rpc_record2(rpc->id, "homa_sendmsg error: RPC id %d in bad state %d",
+			       rpc->id, rpc->state);
+		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+		return -EINVAL;
+	}
+	rpc->state = RPC_OUTGOING;
+	INC_LATENCY(lat_server_service_ns, sched_clock() - rpc->service_ns);
+
+	if (zerocopy)
+		atomic_or(RPC_ZEROCOPY, &rpc->flags);
+	result = homa_message_out_fill(rpc, iter, 1);
+	if (result && rpc->state != RPC_DEAD)
+		goto error;
+	INC_CONN_STAT(hsk, responses_sent, 1);
+	INC_CONN_STAT(hsk, bytes_sent, rpc->msgout.length);
+	homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+	return 0;
+
+error:
+	homa_rpc_free(rpc);
+	homa_rpc_unlock(rpc);
+	return result;
+}
+
+/**
+ * homa_connected_addr() - Fill in the destination address for messages
+ * sent on a connected socket.
+ * @hsk:    Connected socket.
+ * @addr:   The address of the socket's peer is stored here.
+ * Return:  0 on success, otherwise a negative errno.
+ */
+static int homa_connected_addr(struct homa_sock *hsk,
+			       union sockaddr_in_union *addr)
+{
+	if (hsk->sock.sk_family == AF_INET) {
+		addr->in4.sin_family = AF_INET;
+		addr->in4.sin_addr.s_addr = hsk->remote_host.in4.sin_addr.s_addr;
+		addr->in4.sin_port = hsk->remote_host.in4.sin_port;
+	} else if (hsk->sock.sk_family == AF_INET6) {
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_addr = hsk->remote_host.in6.sin6_addr;
+		addr->in6.sin6_port = hsk->remote_host.in6.sin6_port;
+	} else {
+		pr_err("homa_sendmsg: unsupported address family\n");
+		return -EAFNOSUPPORT;
+	}
+	return 0;
+}
+
+/**
+ * homa_send_finish() - Invoked by sendmsg after a message has been sent
+ * to return the new RPC id (if any) to user space and record metrics.
+ * @hsk:     Socket on which the message was sent.
+ * @msg:     Structure describing the message; msg_control refers to a
+ *           struct homa_sendmsg_args.
+ * @args:    Arguments passed to homa_send_one (possibly modified by it).
+ * @start:   Time when sendmsg was invoked.
+ * Return: 0 on success, otherwise a negative errno.
+ */
+static int homa_send_finish(struct homa_sock *hsk, struct msghdr *msg,
+			    struct homa_sendmsg_args *args, __u64 start)
+{
+	struct homa_rpc *rpc;
+
+	if (!homa_is_client(args->id)) {
+		INC_METRIC(reply_ns, sched_clock() - start);
+		return 0;
+	}
+	if (unlikely(copy_to_user((void __user *)msg->msg_control,
+				  args, sizeof(*args)))) {
+		rpc = homa_find_client_rpc(hsk, args->id);
+		if (rpc) {
+			homa_rpc_free(rpc);
+			homa_rpc_unlock(rpc); /* Locked by homa_find_client_rpc. */
+		}
+		tt_rpc_record2(args->id, "homa_sendmsg returning error %d for id %d",
+			       -EFAULT, args->id);
+		return -EFAULT;
+	}
+	INC_METRIC(send_ns, sched_clock() - start);
+	tt_rpc_record1(args->id, "homa_sendmsg finished, id %d", args->id);
+	return 0;
+}
+
 /**
  * homa_sendmsg_original() - Send a request or response message on a Homa socket.
  * This is the unmodified homa_sendmsg() method, which was in HomaModule.
@@ -1129,132 +1554,45 @@ static int homa_sendmsg_original(struct sock *sk, struct msghdr *msg, size_t len
 	struct homa_sendmsg_args args;
 	union sockaddr_in_union *addr;
 	__u64 start = sched_clock();
-	struct homa_rpc *rpc = NULL;
-	int result = 0;
-	__u64 finish;
+	int result;
 
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
 			start;
 
 	addr = (union sockaddr_in_union *)msg->msg_name;
-	if (!addr) {
-		result = -EINVAL;
-		goto error;
-	}
+	if (!addr)
+		return -EINVAL;
 
 	if (unlikely(!msg->msg_control_is_user)) {
 		tt_record("homa_sendmsg error: !msg->msg_control_is_user");
-		result = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 	if (unlikely(copy_from_user(&args, (void __user *)msg->msg_control,
-				    sizeof(args)))) {
-		result = -EFAULT;
-		goto error;
-	}
-	if (addr->sa.sa_family != sk->sk_family) {
-		result = -EAFNOSUPPORT;
-		goto error;
-	}
+				    sizeof(args))))
+		return -EFAULT;
+	if (addr->sa.sa_family != sk->sk_family)
+		return -EAFNOSUPPORT;
 	if (msg->msg_namelen < sizeof(struct sockaddr_in) ||
 	    (msg->msg_namelen < sizeof(struct sockaddr_in6) &&
 	     addr->in6.sin6_family == AF_INET6)) {
 		tt_record("homa_sendmsg error: msg_namelen too short");
-		result = -EINVAL;
-		goto error;
-	}
-
-	if (!args.id) {
-		/* This is a request message. */
-		rpc = homa_rpc_new_client(hsk, addr);
-		if (IS_ERR(rpc)) {
-			result = PTR_ERR(rpc);
-			rpc = NULL;
-			goto error;
-		}
-		INC_METRIC(send_calls, 1);
-		tt_record4("homa_sendmsg request, target 0x%x:%d, id %u, length %d",
-			   (addr->in6.sin6_family == AF_INET)
-			   ? ntohl(addr->in4.sin_addr.s_addr)
-			   : tt_addr(addr->in6.sin6_addr),
-			   ntohs(addr->in6.sin6_port), rpc->id, length);
-		rpc->completion_cookie = args.completion_cookie;
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
-		if (result)
-			goto error;
-		args.id = rpc->id;
-		homa_rpc_unlock(rpc); /* Locked by homa_rpc_new_client. */
-		rpc = NULL;
-
-		if (unlikely(copy_to_user((void __user *)msg->msg_control,
-					  &args, sizeof(args)))) {
-			rpc = homa_find_client_rpc(hsk, args.id);
-			result = -EFAULT;
-			goto error;
-		}
-		finish = sched_clock();
-		INC_METRIC(send_ns, finish - start);
-	} else {
-		/* This is a response message. */
-		struct in6_addr canonical_dest;
-
-		INC_METRIC(reply_calls, 1);
-		tt_record4("homa_sendmsg response, id %llu, port %d, pid %d, length %d",
-			   args.id, hsk->port, current->pid, length);
-		if (args.completion_cookie != 0) {
-			tt_record("homa_sendmsg error: nonzero cookie");
-			result = -EINVAL;
-			goto error;
-		}
-		canonical_dest = canonical_ipv6_addr(addr);
-		rpc = homa_find_server_rpc(hsk, &canonical_dest, args.id);
-		if (!rpc) {
-			/* Return without an error if the RPC doesn't exist;
-			 * this could be totally valid (e.g. client is
-			 * no longer interested in it).
-			 */
-			tt_record2("homa_sendmsg error: RPC id %d, peer 0x%x, doesn't exist",
-				   args.id, tt_addr(canonical_dest));
-			return 0;
-		}
-		if (rpc->error) {
-			result = rpc->error;
-			goto error;
-		}
-		if (rpc->state != RPC_IN_SERVICE) {
-			tt_record2("homa_sendmsg error: RPC id %d in bad state %d",
-				   rpc->id, rpc->state);
-			/* Locked by homa_find_server_rpc. */
-			homa_rpc_unlock(rpc);
-			rpc = NULL;
-			result = -EINVAL;
-			goto error;
-		}
-		rpc->state = RPC_OUTGOING;
-
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
-		if (result && rpc->state != RPC_DEAD)
-			goto error;
-		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
-		finish = sched_clock();
-		INC_METRIC(reply_ns, finish - start);
+		return -EINVAL;
 	}
-	tt_record1("homa_sendmsg finished, id %d", args.id);
-	return 0;
 
-error:
-	if (rpc) {
-		homa_rpc_free(rpc);
-		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+	result = homa_send_one(hsk, addr, &args, &msg->msg_iter,
+			       msg->msg_flags & MSG_ZEROCOPY);
+	if (result < 0) {
+		tt_rpc_record2(args.id, "homa_sendmsg returning error %d for id %d",
+			       result, args.id);
+		return result;
 	}
-	tt_record2("homa_sendmsg returning error %d for id %d",
-		   result, args.id);
-	return result;
+	return homa_send_finish(hsk, msg, &args, start);
 }
 
 /**
- * homa_tcp_sendmsg() - Send a request or response message on a Homa socket.
- * This is for tcp-style homa programming, without specifying daddr in user space.
+ * homa_sendmsg_connected() - Send a request or response message on a
+ * connected Homa socket. This is for tcp-style homa programming, without
+ * specifying daddr in user space.
  * @sk:     Socket on which the system call was invoked.
  * @msg:    Structure describing the message to send; the msg_control
  *          field points to additional information.
@@ -1267,186 +1605,538 @@ static int homa_sendmsg_connected(struct sock *sk, struct msghdr *msg, size_t le
 	struct homa_sendmsg_args args;
 	union sockaddr_in_union addr;
 	__u64 start = sched_clock();
-	struct homa_rpc *rpc = NULL;
-	int result = 0;
-	__u64 finish;
-	// If the socket is not connected, report err
+	int result;
+
+	/* If the socket is not connected, report err. */
 	if (!hsk->connect) {
 		pr_err("homa_sendmsg: unconnected Homa is not supported with connected socks.\n");
-		result = -ENOTSUPP;
-		goto error;
+		return -ENOTSUPP;
 	}
 
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
 			start;
-	// Retrieve addr from connected socket
-	// ipv4
-	if (sk->sk_family == AF_INET) {
-		addr.in4.sin_family = AF_INET;
-		addr.in4.sin_addr.s_addr = hsk->remote_host.in4.sin_addr.s_addr;
-		addr.in4.sin_port = hsk->remote_host.in4.sin_port;
-	}
-	// ipv6
-	else if (sk->sk_family == AF_INET6) {
-		addr.in6.sin6_family = AF_INET6;
-		addr.in6.sin6_addr = hsk->remote_host.in6.sin6_addr;
-		addr.in6.sin6_port = hsk->remote_host.in6.sin6_port;
-	}
-	else {
-		pr_err("homa_sendmsg: unsupported address family\n");
-		return -EAFNOSUPPORT;
-	}
+	result = homa_connected_addr(hsk, &addr);
+	if (result)
+		return result;
 
 	if (unlikely(!msg->msg_control_is_user)) {
 		tt_record("homa_sendmsg error: !msg->msg_control_is_user");
 		pr_err("homa_sendmsg error: msg->msg_control_is_user is NULL\n");
-		result = -EINVAL;
-		goto error;
+		return -EINVAL;
 	}
 	if (unlikely(copy_from_user(&args, (void __user *)msg->msg_control,
 				    sizeof(args)))) {
-		result = -EFAULT;
 		pr_err("homa_sendmsg error: copy_from_user failed\n");
-		goto error;
+		return -EFAULT;
 	}
-	/**
-	 * As daddr is fully handled in kernel, msg_name and msg_namelen
+
+	/* As daddr is fully handled in kernel, msg_name and msg_namelen
 	 * do not need to be checked.
-	if (msg->msg_namelen < sizeof(struct sockaddr_in) ||
-	    (msg->msg_namelen < sizeof(struct sockaddr_in6) &&
-	     addr->in6.sin6_family == AF_INET6)) {
-		tt_record("homa_sendmsg error: msg_namelen too short");
-		result = -EINVAL;
-		goto error;
+	 */
+	result = homa_send_one(hsk, &addr, &args, &msg->msg_iter,
+			       msg->msg_flags & MSG_ZEROCOPY);
+	if (result < 0) {
+		tt_rpc_record2(args.id, "homa_sendmsg returning error %d for id %d",
+			       result, args.id);
+		return result;
+	}
+	return homa_send_finish(hsk, msg, &args, start);
+}
+
+/**
+ * homa_sendmsg_batch() - Implements sendmsg when msg_control refers to a
+ * struct homa_sendmmsg_args: sends a vector of requests and responses.
+ * Messages are sent in order; the first error ends the batch.
+ * @hsk:    Socket on which the system call was invoked.
+ * @msg:    Structure describing the batch; msg_iter and msg_name are
+ *          ignored (each message specifies its own buffer and destination).
+ * Return:  The number of messages sent (always > 0) on success, otherwise
+ *          a negative errno.
+ */
+static int homa_sendmsg_batch(struct homa_sock *hsk, struct msghdr *msg)
+{
+	struct homa_sendmmsg_msg msgs[HOMA_SENDMMSG_CHUNK];
+	struct homa_sendmmsg_args margs;
+	struct homa_sendmsg_args args;
+	union sockaddr_in_union *addr;
+	union sockaddr_in_union caddr;
+	__u64 start = sched_clock();
+	struct homa_sendmmsg_msg *m;
+	struct homa_rpc *rpc;
+	struct iov_iter iter;
+	__u32 i, j, chunk;
+	__u32 sent = 0;
+	int result = 0;
+
+	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
+			start;
+	if (unlikely(!msg->msg_control_is_user))
+		return -EINVAL;
+	if (unlikely(copy_from_user(&margs, (void __user *)msg->msg_control,
+				    sizeof(margs))))
+		return -EFAULT;
+	if (margs.flags != 0)
+		return -EINVAL;
+	if (hsk->connect) {
+		result = homa_connected_addr(hsk, &caddr);
+		if (result)
+			return result;
 	}
-	*
-	*/
-	if (!args.id) {
-		/* This is a request message. */
-		rpc = homa_rpc_new_client(hsk, &addr);
-		if (IS_ERR(rpc)) {
-			pr_err("homa_sendmsg error: homa_rpc_new_client failed\n");
-			result = PTR_ERR(rpc);
-			rpc = NULL;
-			goto error;
-		}
-		INC_METRIC(send_calls, 1);
-		tt_record4("homa_sendmsg request, target 0x%x:%d, id %u, length %d",
-			   (addr.in6.sin6_family == AF_INET)
-			   ? ntohl(addr.in4.sin_addr.s_addr)
-			   : tt_addr(addr.in6.sin6_addr),
-			   ntohs(addr.in6.sin6_port), rpc->id, length);
-		rpc->completion_cookie = args.completion_cookie;
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
-		if (result) {
-			pr_err("homa_sendmsg: homa_msg_out_fill had issues!\n");
-			goto error;
-		}
-		args.id = rpc->id;
-		homa_rpc_unlock(rpc); /* Locked by homa_rpc_new_client. */
-		rpc = NULL;
 
-		if (unlikely(copy_to_user((void __user *)msg->msg_control,
-					  &args, sizeof(args)))) {
-			rpc = homa_find_client_rpc(hsk, args.id);
-			pr_err("homa_sendmsg error: homa_find_client_rpc failed\n");
+	while (sent < margs.num_msgs && result == 0) {
+		chunk = min_t(__u32, margs.num_msgs - sent, HOMA_SENDMMSG_CHUNK);
+		if (copy_from_user(msgs, (void __user *)(margs.msgs + sent),
+				   chunk * sizeof(*msgs))) {
 			result = -EFAULT;
-			goto error;
+			break;
 		}
-		finish = sched_clock();
-		INC_METRIC(send_ns, finish - start);
-	} else {
-		/* This is a response message. */
-		struct in6_addr canonical_dest;
-
-		INC_METRIC(reply_calls, 1);
-		tt_record4("homa_sendmsg response, id %llu, port %d, pid %d, length %d",
-			   args.id, hsk->port, current->pid, length);
-		if (args.completion_cookie != 0) {
-			tt_record("homa_sendmsg error: nonzero cookie");
-			pr_err("homa_sendmsg error: nonzero cookie\n");
-			result = -EINVAL;
-			goto error;
+		for (i = 0; i < chunk; i++) {
+			m = &msgs[i];
+			if (hsk->connect) {
+				addr = &caddr;
+			} else {
+				addr = (union sockaddr_in_union *)&m->dest;
+				if (addr->sa.sa_family != hsk->sock.sk_family) {
+					result = -EAFNOSUPPORT;
+					goto msg_done;
+				}
+			}
+			result = import_ubuf(WRITE, (void __user *)m->buf,
+					     m->length, &iter);
+			if (result)
+				goto msg_done;
+			args.id = m->id;
+			args.completion_cookie = m->completion_cookie;
+			result = homa_send_one(hsk, addr, &args, &iter,
+					       msg->msg_flags & MSG_ZEROCOPY);
+			if (result > 0)
+				/* No RPC for this response. */
+				result = -EINVAL;
+			m->id = args.id;
+msg_done:
+			m->error = result;
+			if (result) {
+				i++;
+				break;
+			}
 		}
-		canonical_dest = canonical_ipv6_addr(&addr);
 
-		rpc = homa_find_server_rpc(hsk, &canonical_dest, args.id);
-		if (!rpc) {
-			/* Return without an error if the RPC doesn't exist;
-			 * this could be totally valid (e.g. client is
-			 * no longer interested in it).
+		/* Return ids and errors for this chunk. */
+		if (unlikely(copy_to_user((void __user *)(margs.msgs + sent),
+					  msgs, i * sizeof(*msgs)))) {
+			/* Nobody will ever learn about the new requests,
+			 * so delete them.
 			 */
-			tt_record2("homa_sendmsg error: RPC id %d, peer 0x%x, doesn't exist",
-				   args.id, tt_addr(canonical_dest));
-			return 0;
-		}
-		if (rpc->error) {
-			result = rpc->error;
-			pr_err("homa_sendmsg error: homa_find_client_rpc failed\n");
-			goto error;
+			for (j = 0; j < i; j++) {
+				if (msgs[j].error || !homa_is_client(msgs[j].id))
+					continue;
+				rpc = homa_find_client_rpc(hsk, msgs[j].id);
+				if (rpc) {
+					homa_rpc_free(rpc);
+					homa_rpc_unlock(rpc);
+				}
+			}
+			result = -EFAULT;
+			break;
 		}
-		if (rpc->state != RPC_IN_SERVICE) {
-			tt_record2("homa_sendmsg error: RPC id %d in bad state %d",
-				   rpc->id, rpc->state);
-			/* Locked by homa_find_server_rpc. */
-			homa_rpc_unlock(rpc);
-			rpc = NULL;
-			result = -EINVAL;
-			pr_err("homa_sendmsg error: homa_find_client_rpc failed, RPC not in service\n");
-			goto error;
+		sent += result ? i - 1 : i;
+	}
+
+	margs.num_sent = sent;
+	if (unlikely(copy_to_user((void __user *)msg->msg_control, &margs,
+				  sizeof(margs))))
+		return -EFAULT;
+	INC_METRIC(send_batch_calls, 1);
+	INC_METRIC(send_batch_msgs, sent);
+	INC_METRIC(send_batch_ns, sched_clock() - start);
+	return (sent > 0) ? sent : result;
+}
+
+/**
+ * homa_recv_collect() - Collect information about a message that is
+ * being returned by recvmsg, then release the RPC (client RPCs are freed;
+ * server RPCs move to RPC_IN_SERVICE).
+ * @hsk:          Socket on which recvmsg was invoked (may be the group of
+ *                the RPC's socket).
+ * @rpc:          RPC returned by homa_wait_for_message; must be locked.
+ *                It will be unlocked (and possibly freed) on return.
+ * @res:          Information about the message is stored here.
+ * @complete_ns:  If the message is long enough for copyout tail metrics,
+ *                its completion time is stored here; otherwise it is
+ *                set to zero.
+ * @inline_skbs:  If the message is to be delivered inline, its packets
+ *                are moved here, sorted by offset; the caller must pass
+ *                them to homa_recv_inline once the RPC is unlocked.
+ */
+static void homa_recv_collect(struct homa_sock *hsk, struct homa_rpc *rpc,
+			      struct homa_recvmmsg_result *res,
+			      __u64 *complete_ns,
+			      struct sk_buff_head *inline_skbs)
+	__releases(&rpc->bucket_lock)
+{
+	struct sk_buff *skb, *prev;
+	__u64 now = sched_clock();
+
+	memset(res, 0, sizeof(*res));
+	res->length = rpc->error ? rpc->error : rpc->msgin.length;
+	*complete_ns = 0;
+	if (rpc->handoff_ns != 0)
+		INC_LATENCY(lat_handoff_to_recv_ns, now - rpc->handoff_ns);
+	if (rpc->msgin.length >= 0 && rpc->msgin.complete_ns != 0)
+		INC_LATENCY(lat_complete_to_recv_ns,
+			    now - rpc->msgin.complete_ns);
+
+	/* Generate time traces on both ends for long elapsed times (used
+	 * for performance debugging).
+	 */
+	if (rpc->hsk->homa->freeze_type == SLOW_RPC) {
+		u64 elapsed = (sched_clock() - rpc->start_ns) >> 10;
+
+		if (elapsed <= hsk->homa->temp[1] &&
+		    elapsed >= hsk->homa->temp[0] &&
+		    homa_is_client(rpc->id) &&
+		    rpc->msgin.length >= hsk->homa->temp[2] &&
+		    rpc->msgin.length < hsk->homa->temp[3]) {
+			tt_record4("Long RTT: kcycles %d, id %d, peer 0x%x, length %d",
+				   elapsed, rpc->id, tt_addr(rpc->peer->addr),
+				   rpc->msgin.length);
+			homa_freeze(rpc, SLOW_RPC,
+				    "Freezing because of long elapsed time for RPC id %d, peer 0x%x");
 		}
-		rpc->state = RPC_OUTGOING;
+	}
 
-		result = homa_message_out_fill(rpc, &msg->msg_iter, 1);
-		if (result && rpc->state != RPC_DEAD) {
-			pr_err("homa_sendmsg error: homa_message_out_fill failed; resonse msg.\n");
-			goto error;
+	/* Collect result information. */
+	res->id = rpc->id;
+	res->completion_cookie = rpc->completion_cookie;
+	if (rpc->hsk != hsk && !homa_is_client(rpc->id)) {
+		/* Request from a member of this socket's group: identify
+		 * the member.
+		 */
+		res->completion_cookie = rpc->hsk->group_cookie;
+	}
+	if (likely(rpc->msgin.length >= 0)) {
+		res->num_bpages = rpc->msgin.num_bpages;
+		memcpy(res->bpage_offsets, rpc->msgin.bpage_offsets,
+		       sizeof(rpc->msgin.bpage_offsets));
+		if (rpc->msgin.length >= hsk->homa->copyout_min_bytes)
+			*complete_ns = rpc->msgin.complete_ns;
+	}
+	if (hsk->sock.sk_family == AF_INET6) {
+		res->peer.in6.sin6_family = AF_INET6;
+		res->peer.in6.sin6_port = htons(rpc->dport);
+		res->peer.in6.sin6_addr = rpc->peer->addr;
+	} else {
+		res->peer.in4.sin_family = AF_INET;
+		res->peer.in4.sin_port = htons(rpc->dport);
+		res->peer.in4.sin_addr.s_addr = ipv6_to_ipv4(rpc->peer->addr);
+	}
+
+	/* This indicates that the application now owns the buffers, so
+	 * we won't free them in homa_rpc_free.
+	 */
+	rpc->msgin.num_bpages = 0;
+
+	/* Take the packets of an inline message, so they survive
+	 * homa_rpc_free (there's no data to return if the RPC failed).
+	 */
+	if (rpc->msgin.inline_msg && res->length >= 0) {
+		while ((skb = __skb_dequeue(&rpc->msgin.packets))) {
+			int offset = ntohl(((struct homa_data_hdr *)
+					    skb->data)->seg.offset);
+
+			skb_queue_reverse_walk(inline_skbs, prev) {
+				if (ntohl(((struct homa_data_hdr *)
+					   prev->data)->seg.offset) < offset)
+					break;
+			}
+			__skb_queue_after(inline_skbs, prev, skb);
 		}
-		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
-		finish = sched_clock();
-		INC_METRIC(reply_ns, finish - start);
 	}
-	tt_record1("homa_sendmsg finished, id %d", args.id);
-	return 0;
 
-error:
-	pr_err("err occurred when sendmsg.");
-	if (rpc) {
+	/* Must release the RPC lock (and potentially free the RPC) before
+	 * copying the results back to user space.
+	 */
+	if (homa_is_client(rpc->id)) {
+		homa_peer_add_ack(rpc);
 		homa_rpc_free(rpc);
-		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
+	} else {
+		if (res->length < 0) {
+			homa_rpc_free(rpc);
+		} else {
+			rpc->state = RPC_IN_SERVICE;
+			rpc->service_ns = now;
+		}
 	}
-	tt_record2("homa_sendmsg returning error %d for id %d",
-		   result, args.id);
-	return result;
+	homa_rpc_unlock(rpc); /* Locked by homa_wait_for_message. */
 }
 
-int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length) {
-	struct homa_sock *hsk = homa_sk(sk);
-	if (hsk->connect) {
-		return homa_sendmsg_connected(sk, msg, length);
+/**
+ * homa_recv_inline() - Copy the data of an inline message to user space
+ * and free its packets.
+ * @skbs:    Packets of the message, sorted by offset (from
+ *           homa_recv_collect); empty on return.
+ * @iter:    Where to copy the data; advanced past the data copied. If there
+ *           isn't enough space, the message is truncated. NULL means
+ *           discard the data.
+ * @length:  Length of the message; data in the packets beyond this is
+ *           ignored.
+ * Return:   The number of bytes copied, or a negative errno.
+ */
+static int homa_recv_inline(struct sk_buff_head *skbs, struct iov_iter *iter,
+			    int length)
+{
+	struct sk_buff *skb;
+	int copied = 0;
+	int error = 0;
+	int offset;
+	int chunk;
+
+	while ((skb = __skb_dequeue(skbs))) {
+		offset = ntohl(((struct homa_data_hdr *)skb->data)->seg.offset);
+		chunk = homa_data_len(skb);
+		if (chunk > length - offset)
+			chunk = length - offset;
+		if (!iter || error)
+			chunk = 0;
+		else if (chunk > iov_iter_count(iter))
+			chunk = iov_iter_count(iter);
+		if (chunk > 0) {
+			error = skb_copy_datagram_iter(skb,
+					sizeof(struct homa_data_hdr), iter,
+					chunk);
+			copied += chunk;
+		}
+		kfree_skb(skb);
 	}
-	return homa_sendmsg_original(sk, msg, length);
+	return error ? error : copied;
+}
+
+/**
+ * homa_recvmsg_batch() - Implements recvmsg when msg_control refers to a
+ * struct homa_recvmmsg_args: waits for at least one message, then returns
+ * as many ready messages as will fit in the caller's result array.
+ * @hsk:         Socket on which the system call was invoked.
+ * @msg:         Controlling information for the receive.
+ * @flags:       Flags from system call; only MSG_DONTWAIT is used.
+ * Return:       The number of messages returned (always > 0) on success,
+ *               otherwise a negative errno.
+ */
+static int homa_recvmsg_batch(struct homa_sock *hsk, struct msghdr *msg,
+			      int flags)
+{
+	size_t iov_space = iov_iter_count(&msg->msg_iter);
+	struct homa_recvmmsg_args args;
+	__u32 offsets[HOMA_MAX_BPAGES];
+	struct homa_recvmmsg_result res;
+	struct sk_buff_head inline_skbs;
+	struct homa_rpc *rpc;
+	int result = 0;
+	int wait_flags;
+	__u32 i, count;
+	__u64 complete_ns;
+	int copied;
+
+	if (unlikely(copy_from_user(&args, (void __user *)msg->msg_control,
+				    sizeof(args))))
+		return -EFAULT;
+	if (args.max_results == 0 ||
+	    (args.flags & ~HOMA_RECVMSG_VALID_FLAGS))
+		return -EINVAL;
+
+	/* Recycle bpages from previous messages, HOMA_MAX_BPAGES at a time. */
+	for (i = 0; i < args.num_bpages; i += count) {
+		count = min_t(__u32, args.num_bpages - i, HOMA_MAX_BPAGES);
+		if (copy_from_user(offsets,
+				   (void __user *)(args.bpage_offsets + i),
+				   count * sizeof(*offsets)))
+			return -EFAULT;
+		result = homa_pool_release_buffers(homa_sock_pool(hsk), count,
+						   offsets);
+		if (result != 0)
+			return result;
+	}
+
+	/* Block (if permitted) only for the first message; after that,
+	 * just collect messages that are already available.
+	 */
+	wait_flags = args.flags | ((flags & MSG_DONTWAIT)
+			? HOMA_RECVMSG_NONBLOCKING : 0);
+	for (count = 0; count < args.max_results; count++) {
+		rpc = homa_wait_for_message(hsk, wait_flags, 0);
+		if (IS_ERR(rpc)) {
+			result = PTR_ERR(rpc);
+			break;
+		}
+		__skb_queue_head_init(&inline_skbs);
+		homa_recv_collect(hsk, rpc, &res, &complete_ns, &inline_skbs);
+		if (!skb_queue_empty(&inline_skbs)) {
+			res.inline_offset = iov_space -
+					    iov_iter_count(&msg->msg_iter);
+			copied = homa_recv_inline(&inline_skbs, &msg->msg_iter,
+						  res.length);
+			if (unlikely(copied < 0)) {
+				/* The RPC may already have been freed, so
+				 * report the error in its result (and stop)
+				 * rather than losing the message.
+				 */
+				res.length = copied;
+				result = copied;
+			} else if (copied < res.length) {
+				msg->msg_flags |= MSG_TRUNC;
+			}
+		}
+		if (unlikely(copy_to_user((void __user *)&args.results[count],
+					  &res, sizeof(res)))) {
+			/* Note: in this case the message's buffers will be
+			 * leaked.
+			 */
+			result = -EFAULT;
+			break;
+		}
+		if (complete_ns != 0) {
+			INC_METRIC(copyout_tail_ns, sched_clock() - complete_ns);
+			INC_METRIC(copyout_tails, 1);
+		}
+		if (unlikely(result < 0)) {
+			count++;
+			break;
+		}
+		wait_flags |= HOMA_RECVMSG_NONBLOCKING;
+	}
+
+	args.num_results = count;
+	if (unlikely(copy_to_user((void __user *)msg->msg_control, &args,
+				  sizeof(args))))
+		return -EFAULT;
+	INC_METRIC(recv_batch_calls, 1);
+	INC_METRIC(recv_batch_msgs, count);
+	return (count > 0) ? count : result;
 }
+
+/**
+ * homa_recv_one() - Receive a single message. This is the part of recvmsg
+ * that is shared with the combined reply-and-receive operation.
+ * @hsk:          Socket on which to receive.
+ * @control:      Arguments from user space (see struct homa_recvmsg_args);
+ *                modified to describe the message that was received.
+ * @res:          Additional information about the message (in particular,
+ *                its sender) is returned here. @res->id will be 0 if no
+ *                message was received.
+ * @nonblocking:  True means don't wait for a message, even if
+ *                HOMA_RECVMSG_NONBLOCKING isn't set in @control->flags.
+ * @complete_ns:  Set as described for homa_recv_collect.
+ * @msg:          If the message is delivered inline, its data is copied to
+ *                msg->msg_iter (MSG_TRUNC is set in msg->msg_flags if it
+ *                doesn't fit). If NULL, an inline message can't be
+ *                delivered: its data is discarded and -EOPNOTSUPP is
+ *                returned (with @res and @control identifying the RPC).
+ * Return:        The length of the message on success, otherwise a negative
+ *                errno (@res->id is nonzero if the error applies to a
+ *                specific RPC, which has already been released).
+ */
+static int homa_recv_one(struct homa_sock *hsk,
+			 struct homa_recvmsg_args *control,
+			 struct homa_recvmmsg_result *res, bool nonblocking,
+			 __u64 *complete_ns, struct msghdr *msg)
+{
+	struct sk_buff_head inline_skbs;
+	struct homa_rpc *rpc;
+	int result;
+
+	control->completion_cookie = 0;
+	res->id = 0;
+	*complete_ns = 0;
+	tt_record3("homa_recvmsg starting, port %d, pid %d, flags %d",
+		   hsk->port, current->pid, control->flags);
+
+	if (control->num_bpages > HOMA_MAX_BPAGES ||
+	    (control->flags & ~HOMA_RECVMSG_VALID_FLAGS)) {
+		pr_err("err with num_bpages or flags in control\n");
+		return -EINVAL;
+	}
+	result = homa_pool_release_buffers(homa_sock_pool(hsk),
+					   control->num_bpages,
+					   control->bpage_offsets);
+	control->num_bpages = 0;
+	if (result != 0) {
+		pr_err("err with pool_release_buffers\n");
+		return result;
+	}
+
+	rpc = homa_wait_for_message(hsk, nonblocking
+			? (control->flags | HOMA_RECVMSG_NONBLOCKING)
+			: control->flags, control->id);
+	if (IS_ERR(rpc)) {
+		/* If we get here, it means there was an error that prevented
+		 * us from finding an RPC to return. If there's an error in
+		 * the RPC itself we won't get here.
+		 */
+		return PTR_ERR(rpc);
+	}
+	__skb_queue_head_init(&inline_skbs);
+	homa_recv_collect(hsk, rpc, res, complete_ns, &inline_skbs);
+
+	/* Fill in @control before copying inline data: the RPC has
+	 * already been released, so even if the copy fails the caller
+	 * must find out which RPC it was (e.g. so it can reply).
+	 */
+	control->id = res->id;
+	control->completion_cookie = res->completion_cookie;
+	control->num_bpages = res->num_bpages;
+	memcpy(control->bpage_offsets, res->bpage_offsets,
+	       sizeof(control->bpage_offsets));
+	if (!skb_queue_empty(&inline_skbs)) {
+		if (!msg) {
+			/* There is nowhere to put the data (this can happen
+			 * if the message arrived on a group member with
+			 * SO_HOMA_INLINE set, or before SO_HOMA_INLINE was
+			 * cleared); report the message rather than
+			 * discarding it silently.
+			 */
+			homa_recv_inline(&inline_skbs, NULL, 0);
+			return -EOPNOTSUPP;
+		}
+		result = homa_recv_inline(&inline_skbs, &msg->msg_iter,
+					  res->length);
+		if (result < 0)
+			return result;
+		if (result < res->length)
+			msg->msg_flags |= MSG_TRUNC;
+	}
+	return res->length;
+}
+
 /**
  * homa_recvmsg() - Receive a message from a Homa socket.
  * @sk:          Socket on which the system call was invoked.
  * @msg:         Controlling information for the receive.
  * @len:         Total bytes of space available in msg->msg_iov; not used.
- * @flags:       Flags from system call; only MSG_DONTWAIT is used.
+ * @flags:       Flags from system call; only MSG_DONTWAIT and MSG_ERRQUEUE
+ *               are used.
  * @addr_len:    Store the length of the sender address here
  * Return:       The length of the message on success, otherwise a negative
- *               errno.
+ *               errno. If msg->msg_control refers to a struct
+ *               homa_recvmmsg_args, the return value is the number of
+ *               messages received.
  */
 int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		 int *addr_len)
 {
 	struct homa_sock *hsk = homa_sk(sk);
 	struct homa_recvmsg_args control;
+	struct homa_recvmmsg_result res;
 	__u64 start = sched_clock();
-	struct homa_rpc *rpc;
+	__u64 complete_ns;
 	__u64 finish;
 	int result;
 
+	if (unlikely(flags & MSG_ERRQUEUE)) {
+		/* Retrieve zero-copy completion notifications. */
+		if (sk->sk_family == AF_INET6)
+			return ipv6_recv_error(sk, msg, len, addr_len);
+		return ip_recv_error(sk, msg, len, addr_len);
+	}
+
 	INC_METRIC(recv_calls, 1);
 	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active = start;
 	if (unlikely(!msg->msg_control)) {
@@ -1456,6 +2146,11 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		pr_err("homa_recvmsg: !msg->msg_control \n");
 		return -EINVAL;
 	}
+	if (msg->msg_controllen == sizeof(struct homa_recvmmsg_args)) {
+		result = homa_recvmsg_batch(hsk, msg, flags);
+		INC_METRIC(recv_ns, sched_clock() - start);
+		return result;
+	}
 	if (msg->msg_controllen != sizeof(control))
 		return -EINVAL;
 	if (unlikely(copy_from_user(&control, (void __user *)msg->msg_control,
@@ -1463,151 +2158,215 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 		pr_err("homa_recvmsg: copy_from_user failed\n");
 		return -EFAULT;
 	}
-	control.completion_cookie = 0;
-	tt_record3("homa_recvmsg starting, port %d, pid %d, flags %d",
-		   hsk->port, current->pid, control.flags);
-
-	if (control.num_bpages > HOMA_MAX_BPAGES ||
-	    (control.flags & ~HOMA_RECVMSG_VALID_FLAGS)) {
-		result = -EINVAL;
-		pr_err("err with num_bpages or flags in control\n");
-		goto done;
-	}
-	result = homa_pool_release_buffers(hsk->buffer_pool, control.num_bpages,
-					   control.bpage_offsets);
-	control.num_bpages = 0;
-	if (result != 0) {
-		pr_err("err with pool_release_buffers\n");
-		goto done;
-	}
-
-	rpc = homa_wait_for_message(hsk, (flags & MSG_DONTWAIT)
-			? (control.flags | HOMA_RECVMSG_NONBLOCKING)
-			: control.flags, control.id);
-	if (IS_ERR(rpc)) {
-		/* If we get here, it means there was an error that prevented
-		 * us from finding an RPC to return. If there's an error in
-		 * the RPC itself we won't get here.
-		 */
-		result = PTR_ERR(rpc);
-		goto done;
-	}
-	result = rpc->error ? rpc->error : rpc->msgin.length;
 
-	/* Generate time traces on both ends for long elapsed times (used
-	 * for performance debugging).
-	 */
-	if (rpc->hsk->homa->freeze_type == SLOW_RPC) {
-		u64 elapsed = (sched_clock() - rpc->start_ns) >> 10;
-
-		if (elapsed <= hsk->homa->temp[1] &&
-		    elapsed >= hsk->homa->temp[0] &&
-		    homa_is_client(rpc->id) &&
-		    rpc->msgin.length >= hsk->homa->temp[2] &&
-		    rpc->msgin.length < hsk->homa->temp[3]) {
-			tt_record4("Long RTT: kcycles %d, id %d, peer 0x%x, length %d",
-				   elapsed, rpc->id, tt_addr(rpc->peer->addr),
-				   rpc->msgin.length);
-			homa_freeze(rpc, SLOW_RPC,
-				    "Freezing because of long elapsed time for RPC id %d, peer 0x%x");
+	result = homa_recv_one(hsk, &control, &res, flags & MSG_DONTWAIT,
+			       &complete_ns, msg);
+	if (res.id != 0) {
+		if (sk->sk_family == AF_INET6) {
+			memcpy(msg->msg_name, &res.peer.in6,
+			       sizeof(res.peer.in6));
+			*addr_len = sizeof(res.peer.in6);
+		} else {
+			memcpy(msg->msg_name, &res.peer.in4,
+			       sizeof(res.peer.in4));
+			*addr_len = sizeof(res.peer.in4);
 		}
 	}
 
-	/* Collect result information. */
-	control.id = rpc->id;
-	control.completion_cookie = rpc->completion_cookie;
-	if (likely(rpc->msgin.length >= 0)) {
-		control.num_bpages = rpc->msgin.num_bpages;
-		memcpy(control.bpage_offsets, rpc->msgin.bpage_offsets,
-		       sizeof(rpc->msgin.bpage_offsets));
+	if (unlikely(copy_to_user((__force void __user *)msg->msg_control,
+				  &control, sizeof(control)))) {
+		/* Note: in this case the message's buffers will be leaked. */
+		pr_notice("%s couldn't copy back args\n", __func__);
+		result = -EFAULT;
 	}
-	if (sk->sk_family == AF_INET6) {
-		struct sockaddr_in6 *in6 = msg->msg_name;
-
-		in6->sin6_family = AF_INET6;
-		in6->sin6_port = htons(rpc->dport);
-		in6->sin6_addr = rpc->peer->addr;
-		*addr_len = sizeof(*in6);
-	} else {
-		struct sockaddr_in *in4 = msg->msg_name;
 
-		in4->sin_family = AF_INET;
-		in4->sin_port = htons(rpc->dport);
-		in4->sin_addr.s_addr = ipv6_to_ipv4(rpc->peer->addr);
-		*addr_len = sizeof(*in4);
+	finish = sched_clock();
+	tt_rpc_record3(control.id, "homa_recvmsg returning id %d, length %d, bpage0 %d",
+		       control.id, result,
+		       control.bpage_offsets[0] >> HOMA_BPAGE_SHIFT);
+	INC_METRIC(recv_ns, finish - start);
+	if (complete_ns != 0) {
+		INC_METRIC(copyout_tail_ns, finish - complete_ns);
+		INC_METRIC(copyout_tails, 1);
 	}
+	return result;
+}
 
-	/* This indicates that the application now owns the buffers, so
-	 * we won't free them in homa_rpc_free.
-	 */
-	rpc->msgin.num_bpages = 0;
+/**
+ * homa_sendmsg_reply_recv() - Implements sendmsg when msg_control refers
+ * to a struct homa_reply_recv_args: sends a response message, then
+ * receives the next incoming message, all in one system call.
+ * @hsk:    Socket on which the system call was invoked.
+ * @msg:    Describes the response to send (msg_name is used as for an
+ *          ordinary response; msg_iter holds the contents).
+ * Return:  The length of the message received, or a negative errno. If
+ *          the response couldn't be sent, its error is returned and no
+ *          message is received.
+ */
+static int homa_sendmsg_reply_recv(struct homa_sock *hsk, struct msghdr *msg)
+{
+	struct homa_reply_recv_args args;
+	struct homa_sendmsg_args send_args;
+	struct homa_recvmmsg_result res;
+	union sockaddr_in_union caddr;
+	union sockaddr_in_union *addr;
+	__u64 start = sched_clock();
+	__u64 complete_ns;
+	__u64 finish;
+	int result;
 
-	/* Must release the RPC lock (and potentially free the RPC) before
-	 * copying the results back to user space.
+	per_cpu(homa_offload_core, raw_smp_processor_id()).last_app_active =
+			start;
+	if (unlikely(!msg->msg_control_is_user))
+		return -EINVAL;
+	if (unlikely(copy_from_user(&args, (void __user *)msg->msg_control,
+				    sizeof(args))))
+		return -EFAULT;
+	if (homa_is_client(args.reply_id))
+		return -EINVAL;
+
+	/* msg_iter holds the response, so there is nowhere to deliver
+	 * inline messages.
 	 */
-	if (homa_is_client(rpc->id)) {
-		homa_peer_add_ack(rpc);
-		homa_rpc_free(rpc);
+	if (READ_ONCE(hsk->inline_max))
+		return -EOPNOTSUPP;
+	if (hsk->connect) {
+		result = homa_connected_addr(hsk, &caddr);
+		if (result)
+			return result;
+		addr = &caddr;
 	} else {
-		if (result < 0)
-			homa_rpc_free(rpc);
-		else
-			rpc->state = RPC_IN_SERVICE;
+		addr = (union sockaddr_in_union *)msg->msg_name;
+		if (!addr)
+			return -EINVAL;
+		if (addr->sa.sa_family != hsk->sock.sk_family)
+			return -EAFNOSUPPORT;
+		if (msg->msg_namelen < sizeof(struct sockaddr_in) ||
+		    (msg->msg_namelen < sizeof(struct sockaddr_in6) &&
+		     addr->in6.sin6_family == AF_INET6))
+			return -EINVAL;
 	}
-	homa_rpc_unlock(rpc); /* Locked by homa_wait_for_message. */
 
-done:
-	if (unlikely(copy_to_user((__force void __user *)msg->msg_control,
-				  &control, sizeof(control)))) {
+	send_args.id = args.reply_id;
+	send_args.completion_cookie = 0;
+	result = homa_send_one(hsk, addr, &send_args, &msg->msg_iter,
+			       msg->msg_flags & MSG_ZEROCOPY);
+	if (result < 0)
+		return result;
+	finish = sched_clock();
+	INC_METRIC(reply_ns, finish - start);
+	INC_METRIC(reply_recv_calls, 1);
+
+	INC_METRIC(recv_calls, 1);
+	result = homa_recv_one(hsk, &args.recv, &res,
+			       msg->msg_flags & MSG_DONTWAIT, &complete_ns,
+			       NULL);
+	if (res.id != 0)
+		memcpy(&args.peer, &res.peer, sizeof(args.peer));
+	else
+		memset(&args.peer, 0, sizeof(args.peer));
+	if (unlikely(copy_to_user((void __user *)msg->msg_control, &args,
+				  sizeof(args)))) {
 		/* Note: in this case the message's buffers will be leaked. */
-		pr_notice("%s couldn't copy back args\n", __func__);
 		result = -EFAULT;
 	}
 
+	start = finish;
 	finish = sched_clock();
-	tt_record3("homa_recvmsg returning id %d, length %d, bpage0 %d",
-		   control.id, result,
-		   control.bpage_offsets[0] >> HOMA_BPAGE_SHIFT);
 	INC_METRIC(recv_ns, finish - start);
+	if (complete_ns != 0) {
+		INC_METRIC(copyout_tail_ns, finish - complete_ns);
+		INC_METRIC(copyout_tails, 1);
+	}
 	return result;
 }
 
-static int __homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len) {
+/**
+ * homa_sendmsg() - Send a request or response message on a Homa socket.
+ * @sk:     Socket on which the system call was invoked.
+ * @msg:    Structure describing the message to send; the msg_control
+ *          field points to additional information.
+ * @length: Number of bytes of the message.
+ * Return: 0 on success, otherwise a negative errno. If msg->msg_control
+ *         refers to a struct homa_sendmmsg_args, the return value is the
+ *         number of messages sent; if it refers to a struct
+ *         homa_reply_recv_args, the return value is the length of the
+ *         message received.
+ */
+int homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t length)
+{
+	struct homa_sock *hsk = homa_sk(sk);
+
+	if (msg->msg_controllen == sizeof(struct homa_sendmmsg_args))
+		return homa_sendmsg_batch(hsk, msg);
+	if (msg->msg_controllen == sizeof(struct homa_reply_recv_args))
+		return homa_sendmsg_reply_recv(hsk, msg);
+	if (hsk->connect)
+		return homa_sendmsg_connected(sk, msg, length);
+	return homa_sendmsg_original(sk, msg, length);
+}
+
+/**
+ * homa_connect() - Implements the connect system call for Homa sockets:
+ * after this, messages sent on the socket go to @uaddr, and only
+ * messages from @uaddr are received on it.
+ * @sk:        Socket on which the system call was invoked.
+ * @uaddr:     Address of the remote host.
+ * @addr_len:  Number of bytes at @uaddr.
+ * Return:     0 for success, otherwise a negative errno.
+ */
+int homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
+{
 	struct homa_sock *hsk = homa_sk(sk);
+	int res = 0;
+
+	/* The socket lock serializes this with homa_sock_join_group and
+	 * homa_sock_leave_group, which check @connect and update
+	 * @group_members while holding the group socket's lock.
+	 */
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
 	if (hsk->shutdown) {
-		return -ESHUTDOWN;
+		res = -ESHUTDOWN;
+		goto done;
 	}
 	if (hsk->connect) {
-		return -EISCONN;
+		res = -EISCONN;
+		goto done;
+	}
+
+	/* A socket group can't become a member of another group. */
+	if (hsk->group_members) {
+		res = -EBUSY;
+		goto done;
 	}
 	if (sk->sk_family == AF_INET) {
-		struct sockaddr_in *usin = (struct sockaddr_in *) uaddr;
-		if (addr_len < sizeof(*usin))
-			return -EINVAL;
+		struct sockaddr_in *usin = (struct sockaddr_in *)uaddr;
+
+		if (addr_len < sizeof(*usin)) {
+			res = -EINVAL;
+			goto done;
+		}
 		hsk->remote_host.in4.sin_family = AF_INET;
 		hsk->remote_host.in4.sin_addr.s_addr = usin->sin_addr.s_addr;
 		hsk->remote_host.in4.sin_port = usin->sin_port;
 		hsk->connect = true;
-		return 0;
-	}
-	if (sk->sk_family == AF_INET6) {
-		struct sockaddr_in6 *usin6 = (struct sockaddr_in6 *) uaddr;
-		if (addr_len < sizeof(*usin6))
-			return -EINVAL;
+	} else if (sk->sk_family == AF_INET6) {
+		struct sockaddr_in6 *usin6 = (struct sockaddr_in6 *)uaddr;
+
+		if (addr_len < sizeof(*usin6)) {
+			res = -EINVAL;
+			goto done;
+		}
 		hsk->remote_host.in6.sin6_family = AF_INET6;
 		hsk->remote_host.in6.sin6_addr = usin6->sin6_addr;
 		hsk->remote_host.in6.sin6_port = usin6->sin6_port;
 		hsk->connect = true;
-		return 0;
+	} else {
+		res = -EAFNOSUPPORT;
 	}
-	return -EAFNOSUPPORT;
-}
 
-int homa_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len) {
-	int res;
-	homa_sock_lock(homa_sk(sk), "homa_connect");
-	res = __homa_connect(sk, uaddr, addr_len);
-	homa_sock_unlock(homa_sk(sk));
+done:
+	homa_sock_unlock(hsk);
 	return res;
 }
 
@@ -1916,6 +2675,10 @@ __poll_t homa_poll(struct file *file, struct socket *sock,
 	if (!list_empty(&homa_sk(sk)->ready_requests) ||
 	    !list_empty(&homa_sk(sk)->ready_responses))
 		mask |= POLLIN | POLLRDNORM;
+
+	/* Zero-copy completion notifications are waiting. */
+	if (!skb_queue_empty_lockless(&sk->sk_error_queue))
+		mask |= POLLERR;
 	return (__poll_t)mask;
 }
 
@@ -1949,6 +2712,10 @@ int homa_dointvec(const struct ctl_table *table, int write,
 		 */
 		homa_incoming_sysctl_changed(homa);
 		homa_outgoing_sysctl_changed(homa);
+		homa_lockprof_sysctl_changed(homa);
+#ifndef __STRIP__ /* See strip.py */
+		tt_set_sample_rate(homa->tt_sample_rate);
+#endif /* See strip.py */
 
 		/* For this value, only call the method when this
 		 * particular value was written (don't want to increment
@@ -1960,7 +2727,7 @@ int homa_dointvec(const struct ctl_table *table, int write,
 		}
 
 		if (homa->next_id != 0) {
-			atomic64_set(&homa->next_outgoing_id, homa->next_id);
+			homa_rpc_set_next_id(homa, homa->next_id);
 			homa->next_id = 0;
 		}
 
@@ -3,6 +3,7 @@
 #include "homa_impl.h"
 #include "homa_grant.h"
 #include "homa_pool.h"
+#include "homa_skb.h"
 
 /* This file contains functions that manage user-space buffer pools. */
 
@@ -99,6 +100,10 @@ int homa_pool_init(struct homa_sock *hsk, void __user *region,
 		pool->cores[i].next_candidate = 0;
 	}
 	pool->check_waiting_invoked = 0;
+	pool->zerocopy = 0;
+	pool->mm = current->mm;
+	if (pool->mm)
+		mmgrab(pool->mm);
 
 	return 0;
 
@@ -120,6 +125,10 @@ void homa_pool_destroy(struct homa_pool *pool)
 		return;
 	kfree(pool->descriptors);
 	kfree(pool->cores);
+	if (pool->mm) {
+		mmdrop(pool->mm);
+		pool->mm = NULL;
+	}
 	pool->region = NULL;
 }
 
@@ -132,9 +141,12 @@ void homa_pool_destroy(struct homa_pool *pool)
 void homa_pool_get_rcvbuf(struct homa_sock *hsk,
 			  struct homa_rcvbuf_args *args)
 {
-	homa_sock_lock(hsk, "homa_pool_get_rcvbuf");
-	args->start = hsk->buffer_pool->region;
-	args->length = hsk->buffer_pool->num_bpages << HOMA_BPAGE_SHIFT;
+	struct homa_pool *pool;
+
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+	pool = homa_sock_pool(hsk);
+	args->start = pool->region;
+	args->length = pool->num_bpages << HOMA_BPAGE_SHIFT;
 	homa_sock_unlock(hsk);
 }
 
@@ -255,7 +267,7 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
  */
 int homa_pool_allocate(struct homa_rpc *rpc)
 {
-	struct homa_pool *pool = rpc->hsk->buffer_pool;
+	struct homa_pool *pool = homa_sock_pool(rpc->hsk);
 	int full_pages, partial, i, core_id;
 	__u32 pages[HOMA_MAX_BPAGES];
 	struct homa_pool_core *core;
@@ -275,6 +287,8 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 					HOMA_BPAGE_SHIFT;
 	}
 	rpc->msgin.num_bpages = full_pages;
+	if (full_pages && pool->zerocopy)
+		homa_pool_zc_init(rpc, full_pages);
 
 	/* The last chunk may be less than a full bpage; for this we use
 	 * the bpage that we own (and reuse it for multiple messages).
@@ -323,6 +337,7 @@ new_page:
 		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
 					  rpc->msgin.bpage_offsets);
 		rpc->msgin.num_bpages = 0;
+		homa_pool_zc_free(rpc);
 		goto out_of_space;
 	}
 	core->page_hint = pages[0];
@@ -335,9 +350,9 @@ allocate_partial:
 	core->allocated += partial;
 
 success:
-	tt_record4("Allocated %d bpage pointers on port %d for id %d, free_bpages now %d",
-		   rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
-		   atomic_read(&pool->free_bpages));
+	tt_rpc_record4(rpc->id, "Allocated %d bpage pointers on port %d for id %d, free_bpages now %d",
+		       rpc->msgin.num_bpages, pool->hsk->port, rpc->id,
+		       atomic_read(&pool->free_bpages));
 	return 0;
 
 	/* We get here if there wasn't enough buffer space for this
@@ -345,10 +360,12 @@ success:
 	 */
 out_of_space:
 	INC_METRIC(buffer_alloc_failures, 1);
-	tt_record4("Buffer allocation failed, port %d, id %d, length %d, free_bpages %d",
-		   pool->hsk->port, rpc->id, rpc->msgin.length,
-		   atomic_read(&pool->free_bpages));
-	homa_sock_lock(pool->hsk, "homa_pool_allocate");
+	tt_rpc_record4(rpc->id, "Buffer allocation failed, port %d, id %d, length %d, free_bpages %d",
+		       pool->hsk->port, rpc->id, rpc->msgin.length,
+		       atomic_read(&pool->free_bpages));
+	if (rpc->msgin.pool_wait_start == 0)
+		rpc->msgin.pool_wait_start = sched_clock();
+	homa_sock_lock(pool->hsk, HOMA_LOCK_BUFS);
 	list_for_each_entry(other, &pool->hsk->waiting_for_bufs, buf_links) {
 		if (other->msgin.length > rpc->msgin.length) {
 			list_add_tail(&rpc->buf_links, &other->buf_links);
@@ -385,7 +402,7 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 	*available = (bpage_index < (rpc->msgin.num_bpages - 1))
 			? HOMA_BPAGE_SIZE - bpage_offset
 			: rpc->msgin.length - offset;
-	return rpc->hsk->buffer_pool->region +
+	return homa_sock_pool(rpc->hsk)->region +
 			rpc->msgin.bpage_offsets[bpage_index] + bpage_offset;
 }
 
@@ -443,7 +460,7 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 	while (atomic_read(&pool->free_bpages) >= pool->bpages_needed) {
 		struct homa_rpc *rpc;
 
-		homa_sock_lock(pool->hsk, "buffer pool");
+		homa_sock_lock(pool->hsk, HOMA_LOCK_BUFS);
 		if (list_empty(&pool->hsk->waiting_for_bufs)) {
 			pool->bpages_needed = INT_MAX;
 			homa_sock_unlock(pool->hsk);
@@ -467,13 +484,16 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 		else
 			set_bpages_needed(pool);
 		homa_sock_unlock(pool->hsk);
-		tt_record4("Retrying buffer allocation for id %d, length %d, free_bpages %d, new bpages_needed %d",
-			   rpc->id, rpc->msgin.length,
-			   atomic_read(&pool->free_bpages),
-			   pool->bpages_needed);
+		tt_rpc_record4(rpc->id, "Retrying buffer allocation for id %d, length %d, free_bpages %d, new bpages_needed %d",
+			       rpc->id, rpc->msgin.length,
+			       atomic_read(&pool->free_bpages),
+			       pool->bpages_needed);
 		homa_pool_allocate(rpc);
 		if (rpc->msgin.num_bpages > 0) {
 			/* Allocation succeeded; "wake up" the RPC. */
+			INC_CONN_STAT(rpc->hsk, pool_wait_ns, sched_clock() -
+				      rpc->msgin.pool_wait_start);
+			rpc->msgin.pool_wait_start = 0;
 			rpc->msgin.resend_all = 1;
 			homa_grant_check_rpc(rpc); /* Unlocks rpc. */
 		} else {
@@ -481,3 +501,306 @@ void homa_pool_check_waiting(struct homa_pool *pool)
 		}
 	}
 }
+
+/**
+ * homa_pool_fault() - Page fault handler for buffer regions created by
+ * mmap-ing a Homa socket: each page is allocated (zero-filled) the first
+ * time it is touched, either by the application or by Homa when copying
+ * data to user space. The mapping is always private (see homa_pool_mmap),
+ * so the page belongs to this mapping alone; a write fault will replace
+ * it with an anonymous copy.
+ * @vmf:    Describes the fault.
+ * Return:  0 for success (the page is returned in vmf->page), otherwise
+ *          a VM_FAULT_ error.
+ */
+static vm_fault_t homa_pool_fault(struct vm_fault *vmf)
+{
+	struct page *page;
+
+	page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+	if (!page)
+		return VM_FAULT_OOM;
+	vmf->page = page;
+	return 0;
+}
+
+const struct vm_operations_struct homa_pool_vm_ops = {
+	.fault = homa_pool_fault,
+};
+
+/**
+ * homa_pool_mmap() - Invoked by Linux to implement mmap on a Homa socket.
+ * The resulting memory can be used as the socket's buffer region (via
+ * SO_HOMA_RCVBUF); in this case full bpages of incoming messages will be
+ * delivered by remapping pages instead of copying.
+ * @file:   Open file for the socket.
+ * @sock:   Socket being mapped.
+ * @vma:    Describes the new mapping.
+ * Return:  0 for success, otherwise a negative errno.
+ */
+int homa_pool_mmap(struct file *file, struct socket *sock,
+		   struct vm_area_struct *vma)
+{
+	/* The pages returned by homa_pool_fault and inserted by
+	 * homa_pool_zc_map aren't shared with anything else, so a shared
+	 * mapping (which other processes or mappings would expect to see
+	 * the same pages) can't be supported.
+	 */
+	if (vma->vm_flags & VM_SHARED)
+		return -EINVAL;
+
+	/* VM_MIXEDMAP allows vm_insert_pages with just the mmap read lock. */
+	vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &homa_pool_vm_ops;
+	return 0;
+}
+
+/**
+ * homa_pool_mappable() - Determine whether a buffer region was created
+ * by homa_pool_mmap for a particular socket (in which case homa_pool_zc_map
+ * can be used for the region). Must not be invoked with spinlocks held.
+ * @hsk:          Socket that will use the region.
+ * @region:       First byte of the region.
+ * @region_size:  Number of bytes in the region.
+ * Return:        Nonzero means the region is suitable for mapping.
+ */
+int homa_pool_mappable(struct homa_sock *hsk, void __user *region,
+		       __u64 region_size)
+{
+	unsigned long start = (unsigned long)region;
+	struct vm_area_struct *vma;
+	int result;
+
+	mmap_read_lock(current->mm);
+	vma = find_vma(current->mm, start);
+	result = vma && vma->vm_start <= start &&
+		 start + region_size <= vma->vm_end &&
+		 vma->vm_ops == &homa_pool_vm_ops && vma->vm_file &&
+		 vma->vm_file->private_data == hsk->sock.sk_socket;
+	mmap_read_unlock(current->mm);
+	return result;
+}
+
+/**
+ * homa_pool_zc_init() - Arrange for the full bpages of an incoming message
+ * to be delivered by mapping them into user space. If memory can't be
+ * allocated, the message is simply copied as usual.
+ * @rpc:         RPC whose incoming message is to be received. Must be
+ *               locked by caller.
+ * @num_bpages:  Number of full bpages in the message.
+ */
+void homa_pool_zc_init(struct homa_rpc *rpc, int num_bpages)
+{
+	int num_pages = num_bpages * (HOMA_BPAGE_SIZE >> PAGE_SHIFT);
+	struct homa_zc_msg *zc;
+
+	/* Called from softirq handlers, so can't sleep. */
+	zc = kmalloc(struct_size(zc, pages, num_pages),
+		     GFP_ATOMIC | __GFP_ZERO);
+	if (!zc) {
+		INC_METRIC(zerocopy_recv_failures, 1);
+		return;
+	}
+	zc->num_bpages = num_bpages;
+	rpc->msgin.zc = zc;
+}
+
+/**
+ * homa_pool_zc_free() - Release all of the resources used to map an
+ * RPC's incoming message into user space.
+ * @rpc:     RPC whose incoming message is no longer needed.
+ */
+void homa_pool_zc_free(struct homa_rpc *rpc)
+{
+	struct homa_zc_msg *zc = rpc->msgin.zc;
+	int i, num_pages;
+
+	if (!zc)
+		return;
+	num_pages = zc->num_bpages * (HOMA_BPAGE_SIZE >> PAGE_SHIFT);
+	for (i = 0; i < num_pages; i++) {
+		if (zc->pages[i])
+			put_page(zc->pages[i]);
+	}
+	kfree(zc);
+	rpc->msgin.zc = NULL;
+}
+
+/**
+ * homa_pool_zc_frag_page() - If the packet data starting at a given offset
+ * in an skb occupies a frag that consists of an entire page, return that
+ * page (so it can be mapped into user space without copying).
+ * @skb:      Packet containing the data.
+ * @offset:   Offset of the data within @skb.
+ * Return:    A page containing exactly PAGE_SIZE bytes of data starting at
+ *            @offset, or NULL if there is no such page.
+ */
+static struct page *homa_pool_zc_frag_page(struct sk_buff *skb, int offset)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	int frag_offset = skb_headlen(skb);
+	struct page *page;
+	int i;
+
+	/* Shared frags may refer to page cache pages (e.g. splice); they
+	 * must not be exposed to user space.
+	 */
+	if (skb_has_shared_frag(skb))
+		return NULL;
+	for (i = 0; i < shinfo->nr_frags; i++) {
+		skb_frag_t *frag = &shinfo->frags[i];
+
+		if (frag_offset > offset)
+			break;
+		if (frag_offset == offset) {
+			if (skb_frag_off(frag) != 0 ||
+			    skb_frag_size(frag) != PAGE_SIZE)
+				break;
+			page = skb_frag_page(frag);
+
+			/* Same restrictions as tcp_zerocopy_receive: the frag
+			 * must be an ordinary page (skb_frag_page returns
+			 * NULL for net_iovs), not file-backed (page cache
+			 * pages must not be exposed), and not part of a
+			 * compound page (neither heads nor tails can be
+			 * mapped individually).
+			 */
+			if (!page || page->mapping || PageCompound(page))
+				break;
+			return page;
+		}
+		frag_offset += skb_frag_size(frag);
+	}
+	return NULL;
+}
+
+/**
+ * homa_pool_zc_add() - Transfer data from an incoming packet into the kernel
+ * pages for a bpage that will be mapped into user space. If the data
+ * occupies an entire page in the packet, the packet's page is used
+ * directly; otherwise the data is copied into a new page.
+ * @rpc:         RPC the data belongs to; must have a non-NULL msgin.zc.
+ *               Needn't be locked, but the caller must have set
+ *               RPC_COPYING_TO_USER.
+ * @skb:         Packet containing the data.
+ * @skb_offset:  Offset of the first byte of data within @skb.
+ * @msg_offset:  Offset of the data within the message.
+ * @length:      Number of bytes of data; the data must all fall within a
+ *               single bpage.
+ * Return:       The number of bytes transferred, 0 if the data isn't in
+ *               one of the bpages being mapped (the caller must copy it
+ *               to user space in the usual way), or a negative errno.
+ */
+int homa_pool_zc_add(struct homa_rpc *rpc, struct sk_buff *skb,
+		     int skb_offset, int msg_offset, int length)
+{
+	int pages_per_bpage = HOMA_BPAGE_SIZE >> PAGE_SHIFT;
+	int bpage_index = msg_offset >> HOMA_BPAGE_SHIFT;
+	struct homa_zc_msg *zc = rpc->msgin.zc;
+	int done = 0;
+
+	if (bpage_index >= zc->num_bpages)
+		return 0;
+	while (done < length) {
+		int offset = msg_offset + done;
+		int page_offset = offset & ~PAGE_MASK;
+		int chunk = min_t(int, length - done, PAGE_SIZE - page_offset);
+		struct page **pagep;
+		struct page *page;
+
+		pagep = &zc->pages[bpage_index * pages_per_bpage +
+				   ((offset & (HOMA_BPAGE_SIZE - 1)) >>
+				    PAGE_SHIFT)];
+		if (chunk == PAGE_SIZE && !*pagep) {
+			page = homa_pool_zc_frag_page(skb, skb_offset + done);
+			if (page) {
+				get_page(page);
+				*pagep = page;
+				INC_METRIC(zerocopy_recv_flip_bytes, chunk);
+				done += chunk;
+				continue;
+			}
+		}
+		if (!*pagep) {
+			*pagep = alloc_page(GFP_KERNEL);
+			if (!*pagep)
+				return -ENOMEM;
+		}
+		homa_skb_get(skb, page_address(*pagep) + page_offset,
+			     skb_offset + done, chunk);
+		done += chunk;
+	}
+	zc->bytes[bpage_index] += length;
+	return length;
+}
+
+/**
+ * homa_pool_zc_map() - Map into user space all of the bpages of an RPC's
+ * incoming message for which all data has been collected. If a bpage
+ * can't be mapped (e.g. because the application unmapped the region),
+ * its data is copied to user space instead.
+ * @rpc:     RPC whose message is being received; must have a non-NULL
+ *           msgin.zc. Must not be locked (this function can sleep), but
+ *           the caller must have set RPC_COPYING_TO_USER.
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_pool_zc_map(struct homa_rpc *rpc)
+{
+	int pages_per_bpage = HOMA_BPAGE_SIZE >> PAGE_SHIFT;
+	struct homa_zc_msg *zc = rpc->msgin.zc;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	unsigned long addr, num;
+	struct page **pages;
+	int result = 0;
+	int i, j, err;
+
+	for (i = 0; i < zc->num_bpages; i++) {
+		if (zc->bytes[i] != HOMA_BPAGE_SIZE)
+			continue;
+		zc->bytes[i] = HOMA_ZC_MAPPED;
+		addr = (unsigned long)homa_sock_pool(rpc->hsk)->region +
+				rpc->msgin.bpage_offsets[i];
+		pages = &zc->pages[i * pages_per_bpage];
+		num = pages_per_bpage;
+		err = -EFAULT;
+
+		mmap_read_lock(mm);
+		vma = find_vma(mm, addr);
+		if (vma && vma->vm_start <= addr &&
+		    addr + HOMA_BPAGE_SIZE <= vma->vm_end &&
+		    vma->vm_ops == &homa_pool_vm_ops) {
+			/* Discard pages left over from previous messages. */
+			zap_page_range_single(vma, addr, HOMA_BPAGE_SIZE,
+					      NULL);
+			err = vm_insert_pages(vma, addr, pages, &num);
+		}
+		mmap_read_unlock(mm);
+
+		if (err == 0) {
+			INC_METRIC(zerocopy_recv_bytes, HOMA_BPAGE_SIZE);
+		} else {
+			/* On return, num indicates how many pages (at the
+			 * end) weren't mapped.
+			 */
+			INC_METRIC(zerocopy_recv_failures, 1);
+			tt_rpc_record3(rpc->id, "homa_pool_zc_map couldn't map bpage %d for id %d, error %d",
+				       i, rpc->id, -err);
+			for (j = pages_per_bpage - num; j < pages_per_bpage;
+			     j++) {
+				if (copy_to_user((void __user *)(addr +
+						 j * PAGE_SIZE),
+						 page_address(pages[j]),
+						 PAGE_SIZE))
+					result = -EFAULT;
+			}
+		}
+
+		/* vm_insert_pages took its own references. */
+		for (j = 0; j < pages_per_bpage; j++) {
+			put_page(pages[j]);
+			pages[j] = NULL;
+		}
+	}
+	return result;
+}
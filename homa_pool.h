@@ -145,8 +145,61 @@ struct homa_pool {
 	 * homa_pool_check_waiting is invoked.
 	 */
 	int check_waiting_invoked;
+
+	/**
+	 * @zerocopy: nonzero means the region was created by mmap-ing the
+	 * socket (see homa_pool_mmap), so full bpages of incoming messages
+	 * can be delivered by mapping kernel pages into the region rather
+	 * than copying to user space.
+	 */
+	int zerocopy;
+
+	/**
+	 * @mm: Address space containing @region (that of the process that
+	 * set up the pool), or NULL if unknown. Used by helper workers that
+	 * copy incoming data to user space (see homa_copy_work). We hold a
+	 * reference via mmgrab, so the structure stays valid, but the address
+	 * space itself may be torn down if the process exits.
+	 */
+	struct mm_struct *mm;
 };
 
+/**
+ * define HOMA_ZC_MAPPED - Value of an entry in homa_zc_msg->bytes once
+ * the corresponding bpage has been delivered to user space.
+ */
+#define HOMA_ZC_MAPPED -1
+
+/**
+ * struct homa_zc_msg - Holds the state for receiving the full bpages
+ * of an incoming message by mapping (rather than copying) them into
+ * user space. Data for each full bpage is collected in kernel pages;
+ * once all of the data for a bpage has arrived, the pages are mapped
+ * into the buffer region in a single operation.
+ */
+struct homa_zc_msg {
+	/**
+	 * @num_bpages: number of bpages (the first ones in the message)
+	 * that are being received this way.
+	 */
+	int num_bpages;
+
+	/**
+	 * @bytes: for each bpage, the number of bytes of data collected
+	 * so far, or HOMA_ZC_MAPPED.
+	 */
+	int bytes[HOMA_MAX_BPAGES];
+
+	/**
+	 * @pages: kernel pages holding the data for the bpages (all of the
+	 * pages for bpage 0, then all of the pages for bpage 1, etc.). NULL
+	 * means no data has been received for that page yet.
+	 */
+	struct page *pages[];
+};
+
+extern const struct vm_operations_struct homa_pool_vm_ops;
+
 int      homa_pool_allocate(struct homa_rpc *rpc);
 void     homa_pool_check_waiting(struct homa_pool *pool);
 void     homa_pool_destroy(struct homa_pool *pool);
@@ -158,7 +211,16 @@ void     homa_pool_get_rcvbuf(struct homa_sock *hsk,
 			      struct homa_rcvbuf_args *args);
 int      homa_pool_init(struct homa_sock *hsk, void *buf_region,
 			__u64 region_size);
+int      homa_pool_mappable(struct homa_sock *hsk, void __user *region,
+			    __u64 region_size);
+int      homa_pool_mmap(struct file *file, struct socket *sock,
+			struct vm_area_struct *vma);
 int      homa_pool_release_buffers(struct homa_pool *pool,
 				   int num_buffers, __u32 *buffers);
+int      homa_pool_zc_add(struct homa_rpc *rpc, struct sk_buff *skb,
+			  int skb_offset, int msg_offset, int length);
+void     homa_pool_zc_free(struct homa_rpc *rpc);
+void     homa_pool_zc_init(struct homa_rpc *rpc, int num_bpages);
+int      homa_pool_zc_map(struct homa_rpc *rpc);
 
 #endif /* _HOMA_POOL_H */
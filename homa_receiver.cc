@@ -111,4 +111,132 @@ void homa::receiver::release()
 	recvmsg(fd, &hdr, 0);
 	control.num_bpages = 0;
 	msg_length = -1;
-}
\ No newline at end of file
+}
+/**
+ * homa::batch_receiver::message::copy_out() - Copy data out of a message.
+ * @dest:     Data will be copied here.
+ * @offset:   Offset within the message of the first byte to copy.
+ * @count:    Number of bytes to copy; if the message doesn't contain
+ *            this many bytes starting at offset, then only the
+ *            available number of bytes will be copied.
+ */
+void homa::batch_receiver::message::copy_out(void *dest, size_t offset,
+		size_t count) const
+{
+	char *cdest = static_cast<char *>(dest);
+	ssize_t limit = offset + count;
+
+	if (limit > length())
+		limit = length();
+	while (static_cast<ssize_t>(offset) < limit) {
+		size_t chunk_size = contiguous(offset);
+
+		memcpy(cdest, get<char>(offset), chunk_size);
+		offset += chunk_size;
+		cdest += chunk_size;
+	}
+}
+
+/**
+ * homa::batch_receiver::batch_receiver() - Constructor for batch_receivers.
+ * @fd:           Homa socket from which this object will receive incoming
+ *                messages. The caller is responsible for setting up
+ *                buffering on the socket using setsockopt with the
+ *                SO_HOMA_RCVBUF option. The file descriptor must be valid
+ *                for the lifetime of this object.
+ * @buf_region:   Location of the buffer region that was allocated for
+ *                this socket.
+ * @max_messages: Largest number of messages to return in one batch.
+ */
+homa::batch_receiver::batch_receiver(int fd, void *buf_region,
+		size_t max_messages)
+	: fd(fd)
+	, hdr()
+	, control()
+	, results(max_messages)
+	, num_results(0)
+	, bpages()
+	, buf_region(reinterpret_cast<char *>(buf_region))
+{
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_control = &control;
+	hdr.msg_controllen = sizeof(control);
+	bpages.reserve(max_messages * HOMA_MAX_BPAGES);
+}
+
+/**
+ * homa::batch_receiver::~batch_receiver() - Destructor; returns any
+ * residual buffers to Homa.
+ */
+homa::batch_receiver::~batch_receiver()
+{
+	release();
+}
+
+/**
+ * homa::batch_receiver::collect_bpages() - Move the bpages for all of the
+ * messages in the current batch to @bpages, so they will be returned to
+ * Homa in the next recvmsg call, and discard the batch.
+ */
+void homa::batch_receiver::collect_bpages()
+{
+	for (size_t i = 0; i < num_results; i++) {
+		const struct homa_recvmmsg_result &result = results[i];
+
+		bpages.insert(bpages.end(), result.bpage_offsets,
+				result.bpage_offsets + result.num_bpages);
+	}
+	num_results = 0;
+}
+
+/**
+ * homa::batch_receiver::receive() - Release resources for the current
+ * batch of messages, if any, and receive a new batch.
+ * @flags:    Various OR'ed bits such as HOMA_RECVMSG_REQUEST and
+ *            HOMA_RECVMSG_NONBLOCKING. See the Homa documentation
+ *            for the flags field of recvmsg for details.
+ * Return:    The number of messages in the new batch (at least 1). If an
+ *            error occurs, -1 is returned and additional information is
+ *            available in errno. Errors for individual RPCs are returned
+ *            as negative message lengths.
+ */
+int homa::batch_receiver::receive(int flags)
+{
+	int count;
+
+	collect_bpages();
+	control.results = results.data();
+	control.max_results = results.size();
+	control.bpage_offsets = bpages.data();
+	control.num_bpages = bpages.size();
+	control.flags = flags;
+	hdr.msg_controllen = sizeof(control);
+	count = recvmsg(fd, &hdr, 0);
+
+	/* Homa takes the bpages back even if no message is returned. */
+	bpages.clear();
+	if (count > 0)
+		num_results = count;
+	return count;
+}
+
+/**
+ * homa::batch_receiver::release() - Return the buffers for the current
+ * batch to Homa. The messages in the batch must not be accessed again.
+ */
+void homa::batch_receiver::release()
+{
+	collect_bpages();
+	if (bpages.empty())
+		return;
+
+	/* This recvmsg request will do nothing except return buffer space. */
+	control.results = results.data();
+	control.max_results = results.size();
+	control.bpage_offsets = bpages.data();
+	control.num_bpages = bpages.size();
+	control.flags = HOMA_RECVMSG_NONBLOCKING;
+	hdr.msg_controllen = sizeof(control);
+	recvmsg(fd, &hdr, 0);
+	bpages.clear();
+}
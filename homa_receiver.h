@@ -5,6 +5,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <vector>
+
 #include "homa.h"
 
 namespace homa {
@@ -163,4 +165,199 @@ protected:
 	char *buf_region;
 };
 
+/**
+ * class homa::batch_receiver - Helper class for receiving messages from a
+ * Homa socket several at a time: each call to receive makes a single
+ * recvmsg kernel call (using struct homa_recvmmsg_args) that returns all
+ * of the messages that are ready, up to a limit. Like homa::receiver,
+ * this class returns buffer space to Homa when the application no longer
+ * needs it.
+ *
+ * Typical usage:
+ * - Call receive, which waits for at least one incoming message and
+ *   returns the number of messages received.
+ * - Iterate over the messages with operator[] and size(); each message is
+ *   accessed through a homa::batch_receiver::message, which has the same
+ *   accessor methods as homa::receiver.
+ * - Call receive again. This releases all of the resources associated
+ *   with the previous batch, so those messages can no longer be accessed.
+ *
+ * An individual homa::batch_receiver is not thread-safe.
+ */
+class batch_receiver {
+public:
+	/**
+	 * class homa::batch_receiver::message - Provides access to one of
+	 * the messages in the current batch. Valid only until the next call
+	 * to receive or release for its batch_receiver.
+	 */
+	class message {
+	public:
+		/**
+		 * homa::batch_receiver::message::message() - Constructor.
+		 * @result:      Information returned by Homa for the message.
+		 * @buf_region:  First byte of the socket's buffer region.
+		 */
+		message(const struct homa_recvmmsg_result *result,
+			char *buf_region)
+			: result(result)
+			, buf_region(buf_region)
+		{}
+
+		/**
+		 * homa::batch_receiver::message::contiguous() - Return a
+		 * count of the number of contiguous bytes that are available
+		 * in the message at a given offset; zero is returned if the
+		 * offset is beyond the end of the message.
+		 * @offset:  An offset from the beginning of the message.
+		 */
+		inline size_t contiguous(size_t offset) const
+		{
+			if (static_cast<ssize_t>(offset) >= length())
+				return 0;
+			if ((offset >> HOMA_BPAGE_SHIFT)
+					== (result->num_bpages - 1))
+				return length() - offset;
+			return HOMA_BPAGE_SIZE - (offset & (HOMA_BPAGE_SIZE - 1));
+		}
+
+		/**
+		 * homa::batch_receiver::message::completion_cookie() - Return
+		 * the completion cookie associated with the message.
+		 */
+		uint64_t completion_cookie(void) const
+		{
+			return result->completion_cookie;
+		}
+
+		void copy_out(void *dest, size_t offset, size_t count) const;
+
+		/**
+		 * homa::batch_receiver::message::get() - Make part of the
+		 * message accessible; same as homa::receiver::get.
+		 * @offset:   Offset within the message of the first byte of
+		 *            an object of type T
+		 * @storage:  If non-null and the object isn't contiguous in
+		 *            the message, it is copied here.
+		 * Return:    A pointer to the desired object (either in the
+		 *            message or at *storage), or nullptr if the object
+		 *            could not be returned.
+		 */
+		template<typename T>
+		inline T* get(size_t offset, T* storage = nullptr) const {
+			int buf_num = offset >> HOMA_BPAGE_SHIFT;
+
+			if (static_cast<ssize_t>(offset + sizeof(T)) > length())
+				return nullptr;
+			if (contiguous(offset) >= sizeof(T))
+				return reinterpret_cast<T*>(buf_region
+					+ result->bpage_offsets[buf_num]
+					+ (offset & (HOMA_BPAGE_SIZE - 1)));
+			if (storage)
+				copy_out(storage, offset, sizeof(T));
+			return storage;
+		}
+
+		/**
+		 * homa::batch_receiver::message::id() - Return the Homa RPC
+		 * identifier for the message.
+		 */
+		inline uint64_t id(void) const
+		{
+			return result->id;
+		}
+
+		/**
+		 * homa::batch_receiver::message::is_request() - Return true
+		 * if the message is a request, false if it is a response.
+		 */
+		bool is_request(void) const
+		{
+			return result->id & 1;
+		}
+
+		/**
+		 * homa::batch_receiver::message::length() - Return the total
+		 * number of bytes in the message, or a negative errno if
+		 * its RPC failed.
+		 */
+		ssize_t length(void) const
+		{
+			return result->length;
+		}
+
+		/**
+		 * homa::batch_receiver::message::src_addr() - Return a
+		 * pointer to the address of the sender of the message.
+		 */
+		const struct sockaddr *src_addr(void) const
+		{
+			return reinterpret_cast<const struct sockaddr *>(
+					&result->peer);
+		}
+
+	protected:
+		/** @result: Information from Homa about the message. */
+		const struct homa_recvmmsg_result *result;
+
+		/** @buf_region: First byte of the socket's buffer region. */
+		char *buf_region;
+	};
+
+	batch_receiver(int fd, void *buf_region, size_t max_messages);
+	~batch_receiver();
+
+	/**
+	 * homa::batch_receiver::operator[]() - Return one of the messages
+	 * in the current batch.
+	 * @index:   Index of the desired message; must be less than size().
+	 */
+	message operator[](size_t index) const
+	{
+		return message(&results[index], buf_region);
+	}
+
+	int receive(int flags);
+	void release(void);
+
+	/**
+	 * homa::batch_receiver::size() - Return the number of messages in
+	 * the current batch.
+	 */
+	size_t size(void) const
+	{
+		return num_results;
+	}
+
+protected:
+	void collect_bpages(void);
+
+	/** @fd: File descriptor for an open Homa socket. */
+	int fd;
+
+	/** @hdr: Used to pass information to the recvmsg system call. */
+	struct msghdr hdr;
+
+	/**
+	 * @control: Homa-specific information passed to the recvmsg system
+	 * call through hdr->msg_control.
+	 */
+	struct homa_recvmmsg_args control;
+
+	/** @results: Information about the messages in the current batch. */
+	std::vector<struct homa_recvmmsg_result> results;
+
+	/** @num_results: Number of valid entries in @results. */
+	size_t num_results;
+
+	/**
+	 * @bpages: Bpages from earlier batches that must be returned to
+	 * Homa in the next recvmsg call.
+	 */
+	std::vector<uint32_t> bpages;
+
+	/** @buf_region: First byte of buffer space for this socket. */
+	char *buf_region;
+};
+
 }    // namespace homa
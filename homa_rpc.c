@@ -8,6 +8,181 @@
 #include "homa_grant.h"
 #include "homa_skb.h"
 
+DEFINE_PER_CPU(struct homa_rpc_core, homa_rpc_core);
+
+/**
+ * homa_rpc_ctor() - Constructor for objects in homa->rpc_cache: initializes
+ * the fields whose values are the same in every unused RPC, so that they
+ * needn't be initialized each time an RPC is created. homa_rpc_recycle
+ * restores these values before putting an RPC on a freelist.
+ * @obj:    The homa_rpc to initialize.
+ */
+static void homa_rpc_ctor(void *obj)
+{
+	struct homa_rpc *rpc = obj;
+
+	INIT_LIST_HEAD(&rpc->ready_links);
+	INIT_LIST_HEAD(&rpc->buf_links);
+	INIT_LIST_HEAD(&rpc->dead_links);
+	INIT_LIST_HEAD(&rpc->grantable_links);
+	INIT_LIST_HEAD(&rpc->throttled_links);
+	skb_queue_head_init(&rpc->msgin.packets);
+	INIT_LIST_HEAD(&rpc->msgin.gaps);
+	INIT_WORK(&rpc->msgin.copy_work, homa_copy_work);
+}
+
+/**
+ * homa_rpc_cache_init() - Create the slab cache from which homa_rpc structs
+ * are allocated.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_rpc_cache_init(struct homa *homa)
+{
+	homa->rpc_cache = kmem_cache_create("homa_rpc", sizeof(struct homa_rpc),
+					    0, SLAB_HWCACHE_ALIGN,
+					    homa_rpc_ctor);
+	if (!homa->rpc_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * homa_rpc_cache_cleanup() - Invoked when a struct homa is deleted;
+ * releases all of the RPCs in per-core freelists, then the slab cache,
+ * and discards the cores' reserved client ids. Must not be invoked until
+ * all sockets have been destroyed.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_rpc_cache_cleanup(struct homa *homa)
+{
+	int i, j;
+
+	if (!homa->rpc_cache)
+		return;
+	for (i = 0; i < nr_cpu_ids; i++) {
+		struct homa_rpc_core *rpc_core = &per_cpu(homa_rpc_core, i);
+
+		for (j = 0; j < rpc_core->num_free; j++)
+			kmem_cache_free(homa->rpc_cache,
+					rpc_core->free_rpcs[j]);
+		rpc_core->num_free = 0;
+		rpc_core->next_id = 0;
+		rpc_core->id_limit = 0;
+	}
+	kmem_cache_destroy(homa->rpc_cache);
+	homa->rpc_cache = NULL;
+}
+
+/**
+ * homa_rpc_alloc() - Return an RPC from the current core's freelist, or
+ * allocate a new one from homa->rpc_cache if the freelist is empty.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * Return:   The new RPC (fields initialized by homa_rpc_ctor are valid,
+ *           but nothing else is), or NULL if memory couldn't be allocated.
+ */
+static struct homa_rpc *homa_rpc_alloc(struct homa *homa)
+{
+	struct homa_rpc_core *rpc_core;
+	struct homa_rpc *rpc = NULL;
+
+	local_bh_disable();
+	rpc_core = &per_cpu(homa_rpc_core, raw_smp_processor_id());
+	if (rpc_core->num_free > 0) {
+		rpc_core->num_free--;
+		rpc = rpc_core->free_rpcs[rpc_core->num_free];
+	}
+	local_bh_enable();
+	if (rpc) {
+		INC_METRIC(rpc_cache_hits, 1);
+		return rpc;
+	}
+	INC_METRIC(rpc_cache_misses, 1);
+	return kmem_cache_alloc(homa->rpc_cache, GFP_KERNEL);
+}
+
+/**
+ * homa_rpc_recycle() - Invoked when an RPC has been reaped (or was never
+ * made visible); restores the fields set by homa_rpc_ctor and saves the
+ * RPC in the current core's freelist for reuse, or returns it to the slab
+ * cache if the freelist is full.
+ * @rpc:     RPC to recycle. Its incoming packets and gaps must already
+ *           have been freed, and it must not be on any list except
+ *           possibly those that homa_rpc_free unlinks without
+ *           reinitializing (ready_links, buf_links, and dead_links).
+ *           The caller must not reference it after this function returns.
+ */
+void homa_rpc_recycle(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	struct homa_rpc_core *rpc_core;
+	bool cached = false;
+
+	INIT_LIST_HEAD(&rpc->ready_links);
+	INIT_LIST_HEAD(&rpc->buf_links);
+	INIT_LIST_HEAD(&rpc->dead_links);
+	rpc->state = 0;
+	rpc->magic = 0;
+
+	local_bh_disable();
+	rpc_core = &per_cpu(homa_rpc_core, raw_smp_processor_id());
+	if (rpc_core->num_free < HOMA_RPC_CACHE_SIZE) {
+		rpc_core->free_rpcs[rpc_core->num_free] = rpc;
+		rpc_core->num_free++;
+		cached = true;
+	}
+	local_bh_enable();
+	if (cached)
+		INC_METRIC(rpc_recycles, 1);
+	else
+		kmem_cache_free(homa->rpc_cache, rpc);
+}
+
+/**
+ * homa_rpc_alloc_id() - Return a new id for a client RPC. Ids come from a
+ * block reserved by the current core, so that cores don't contend for
+ * homa->next_outgoing_id on every RPC.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * Return:   The new id (always even, so homa_is_client will be true).
+ */
+static __u64 homa_rpc_alloc_id(struct homa *homa)
+{
+	struct homa_rpc_core *rpc_core;
+	int epoch;
+	__u64 id;
+
+	epoch = atomic_read(&homa->id_epoch);
+	smp_rmb();
+	local_bh_disable();
+	rpc_core = &per_cpu(homa_rpc_core, raw_smp_processor_id());
+	if (rpc_core->next_id >= rpc_core->id_limit ||
+	    rpc_core->id_epoch != epoch) {
+		rpc_core->next_id = atomic64_fetch_add(2 * HOMA_ID_BLOCK,
+						       &homa->next_outgoing_id);
+		rpc_core->id_limit = rpc_core->next_id + 2 * HOMA_ID_BLOCK;
+		rpc_core->id_epoch = epoch;
+		INC_METRIC(client_id_blocks, 1);
+	}
+	id = rpc_core->next_id;
+	rpc_core->next_id += 2;
+	local_bh_enable();
+	return id;
+}
+
+/**
+ * homa_rpc_set_next_id() - Arrange for the next client RPC created on any
+ * core to use a particular id (subsequent ids follow from there). Not
+ * intended for use while RPCs are being created concurrently.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @id:      Id for the next client RPC; should be even.
+ */
+void homa_rpc_set_next_id(struct homa *homa, __u64 id)
+{
+	atomic64_set(&homa->next_outgoing_id, id);
+	smp_wmb();
+	atomic_inc(&homa->id_epoch);
+}
+
 /**
  * homa_rpc_new_client() - Allocate and construct a client RPC (one that is used
  * to issue an outgoing request). Doesn't send any packets. Invoked with no
@@ -28,13 +203,13 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	struct homa_rpc *crpc;
 	int err;
 
-	crpc = kmalloc(sizeof(*crpc), GFP_KERNEL);
+	crpc = homa_rpc_alloc(hsk->homa);
 	if (unlikely(!crpc))
 		return ERR_PTR(-ENOMEM);
 
 	/* Initialize fields that don't require the socket lock. */
 	crpc->hsk = hsk;
-	crpc->id = atomic64_fetch_add(2, &hsk->homa->next_outgoing_id);
+	crpc->id = homa_rpc_alloc_id(hsk->homa);
 	bucket = homa_client_rpc_bucket(hsk, crpc->id);
 	crpc->bucket = bucket;
 	crpc->state = RPC_OUTGOING;
@@ -52,19 +227,17 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->error = 0;
 	crpc->msgin.length = -1;
 	crpc->msgin.num_bpages = 0;
+	crpc->msgin.inline_msg = 0;
 	memset(&crpc->msgout, 0, sizeof(crpc->msgout));
 	crpc->msgout.length = -1;
-	INIT_LIST_HEAD(&crpc->ready_links);
-	INIT_LIST_HEAD(&crpc->buf_links);
-	INIT_LIST_HEAD(&crpc->dead_links);
 	crpc->interest = NULL;
-	INIT_LIST_HEAD(&crpc->grantable_links);
-	INIT_LIST_HEAD(&crpc->throttled_links);
 	crpc->silent_ticks = 0;
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	crpc->done_timer_ticks = 0;
 	crpc->magic = HOMA_RPC_MAGIC;
 	crpc->start_ns = sched_clock();
+	crpc->handoff_ns = 0;
+	crpc->service_ns = 0;
 
 	/* Initialize fields that require locking. This allows the most
 	 * expensive work, such as copying in the message from user space,
@@ -72,29 +245,29 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	 * locks while doing things that could block, such as memory allocation.
 	 */
 	homa_bucket_lock(bucket, crpc->id, "homa_rpc_new_client");
-	homa_sock_lock(hsk, "homa_rpc_new_client");
-	if (hsk->shutdown) {
-		homa_sock_unlock(hsk);
+	crpc->shard = homa_rpc_shard(hsk);
+	homa_rpc_shard_lock(crpc->shard);
+	if (READ_ONCE(hsk->shutdown)) {
+		homa_rpc_shard_unlock(crpc->shard);
 		homa_rpc_unlock(crpc);
 		err = -ESHUTDOWN;
 		goto error;
 	}
 	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
-	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
-	homa_sock_unlock(hsk);
+	list_add_tail_rcu(&crpc->active_links, &crpc->shard->active_rpcs);
+	homa_rpc_shard_unlock(crpc->shard);
 
 	return crpc;
 
 error:
-	kfree(crpc);
+	homa_rpc_recycle(crpc);
 	return ERR_PTR(err);
 }
 
 /**
  * homa_rpc_new_server() - Allocate and construct a server RPC (one that is
  * used to manage an incoming request). If appropriate, the RPC will also
- * be handed off (we do it here, while we have the socket locked, to avoid
- * acquiring the socket lock a second time later for the handoff).
+ * be handed off.
  * @hsk:      Socket that owns this RPC.
  * @source:   IP address (network byte order) of the RPC's client.
  * @h:        Header for the first data packet received for this RPC; used
@@ -134,7 +307,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 
 	/* Initialize fields that don't require the socket lock. */
-	srpc = kmalloc(sizeof(*srpc), GFP_KERNEL);
+	srpc = homa_rpc_alloc(hsk->homa);
 	if (!srpc) {
 		err = -ENOMEM;
 		goto error;
@@ -155,47 +328,69 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->error = 0;
 	srpc->msgin.length = -1;
 	srpc->msgin.num_bpages = 0;
+	srpc->msgin.inline_msg = 0;
 	memset(&srpc->msgout, 0, sizeof(srpc->msgout));
 	srpc->msgout.length = -1;
-	INIT_LIST_HEAD(&srpc->ready_links);
-	INIT_LIST_HEAD(&srpc->buf_links);
-	INIT_LIST_HEAD(&srpc->dead_links);
 	srpc->interest = NULL;
-	INIT_LIST_HEAD(&srpc->grantable_links);
-	INIT_LIST_HEAD(&srpc->throttled_links);
 	srpc->silent_ticks = 0;
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->done_timer_ticks = 0;
 	srpc->magic = HOMA_RPC_MAGIC;
 	srpc->start_ns = sched_clock();
-	tt_record2("Incoming message for id %d has %d unscheduled bytes",
-		   srpc->id, ntohl(h->incoming));
+	srpc->handoff_ns = 0;
+	srpc->service_ns = 0;
+	tt_rpc_record2(srpc->id, "Incoming message for id %d has %d unscheduled bytes",
+		       srpc->id, ntohl(h->incoming));
 	err = homa_message_in_init(srpc, ntohl(h->message_length),
 				   ntohl(h->incoming));
 	if (err != 0)
 		goto error;
 
-	/* Initialize fields that require socket to be locked. */
-	homa_sock_lock(hsk, "homa_rpc_new_server");
-	if (hsk->shutdown) {
-		homa_sock_unlock(hsk);
+	/* Make the RPC visible; the shard lock synchronizes with
+	 * homa_sock_shutdown.
+	 */
+	srpc->shard = homa_rpc_shard(hsk);
+	homa_rpc_shard_lock(srpc->shard);
+	if (READ_ONCE(hsk->shutdown)) {
+		homa_rpc_shard_unlock(srpc->shard);
 		err = -ESHUTDOWN;
-		goto error;
+		goto error_msgin;
 	}
 	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
-	list_add_tail_rcu(&srpc->active_links, &hsk->active_rpcs);
-	if (ntohl(h->seg.offset) == 0 && srpc->msgin.num_bpages > 0) {
+	list_add_tail_rcu(&srpc->active_links, &srpc->shard->active_rpcs);
+	homa_rpc_shard_unlock(srpc->shard);
+	if (ntohl(h->seg.offset) == 0 && homa_msgin_has_space(srpc)) {
 		atomic_or(RPC_PKTS_READY, &srpc->flags);
+		homa_sock_lock(hsk, HOMA_LOCK_HANDOFF);
 		homa_rpc_handoff(srpc);
+		homa_sock_unlock(hsk);
 	}
-	homa_sock_unlock(hsk);
 	INC_METRIC(requests_received, 1);
+	INC_CONN_STAT(hsk, requests_received, 1);
+	INC_CONN_STAT(hsk, bytes_received, srpc->msgin.length);
 	*created = 1;
 	return srpc;
 
+error_msgin:
+	/* Release the resources allocated by homa_message_in_init. */
+	if (!list_empty(&srpc->buf_links)) {
+		/* The waiting list belongs to the socket that owns the pool
+		 * (which is the group, if @hsk has joined one).
+		 */
+		struct homa_sock *owner = homa_sock_pool(hsk)->hsk;
+
+		homa_sock_lock(owner, HOMA_LOCK_BUFS);
+		list_del_init(&srpc->buf_links);
+		homa_sock_unlock(owner);
+	}
+	homa_pool_zc_free(srpc);
+	homa_pool_release_buffers(homa_sock_pool(hsk), srpc->msgin.num_bpages,
+				  srpc->msgin.bpage_offsets);
+
 error:
 	homa_bucket_unlock(bucket, id);
-	kfree(srpc);
+	if (srpc)
+		homa_rpc_recycle(srpc);
 	return ERR_PTR(err);
 }
 
@@ -237,7 +432,7 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 			if (hsk2->port == server_port) {
 				rpc = homa_find_server_rpc(hsk2, saddr, id);
 				if (rpc) {
-					tt_record1("homa_rpc_acked freeing id %d", rpc->id);
+					tt_rpc_record1(rpc->id, "homa_rpc_acked freeing id %d", rpc->id);
 					homa_rpc_free(rpc);
 					homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
 					goto done;
@@ -247,7 +442,7 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 	}
 	rpc = homa_find_server_rpc(hsk2, saddr, id);
 	if (rpc) {
-		tt_record1("homa_rpc_acked freeing id %d", rpc->id);
+		tt_rpc_record1(rpc->id, "homa_rpc_acked freeing id %d", rpc->id);
 		homa_rpc_free(rpc);
 		homa_rpc_unlock(rpc); /* Locked by homa_find_server_rpc. */
 	}
@@ -267,6 +462,8 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	__acquires(&rpc->hsk->lock)
 	__releases(&rpc->hsk->lock)
 {
+	int dead_skbs = 0;
+
 	/* The goal for this function is to make the RPC inaccessible,
 	 * so that no other code will ever access it again. However, don't
 	 * actually release resources; leave that to homa_rpc_reap, which
@@ -284,34 +481,53 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	if (!rpc || rpc->state == RPC_DEAD)
 		return;
 	UNIT_LOG("; ", "homa_rpc_free invoked");
-	tt_record1("homa_rpc_free invoked for id %d", rpc->id);
+	tt_rpc_record1(rpc->id, "homa_rpc_free invoked for id %d", rpc->id);
 	rpc->state = RPC_DEAD;
 
-	/* The following line must occur before the socket is locked or
-	 * RPC is added to dead_rpcs. This is necessary because homa_grant_free
+	/* The following line must occur before the RPC is added to
+	 * dead_rpcs. This is necessary because homa_grant_free
 	 * releases the RPC lock and reacquires it (see comment in
 	 * homa_grant_free for more info).
 	 */
 	homa_grant_free_rpc(rpc);
 
-	/* Unlink from all lists, so no-one will ever find this RPC again. */
-	homa_sock_lock(rpc->hsk, "homa_rpc_free");
+	/* Unlink from all lists, so no-one will ever find this RPC again.
+	 * The socket lock is needed only if the RPC is linked into one of
+	 * the socket's ready or waiting lists or a thread is waiting
+	 * specifically for it. RPCs can only be added to those lists (and
+	 * rpc->interest set) while the RPC is locked, which it is now,
+	 * so checking without the socket lock is safe.
+	 */
 	__hlist_del(&rpc->hash_links);
-	list_del_rcu(&rpc->active_links);
-	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
-	__list_del_entry(&rpc->ready_links);
-	__list_del_entry(&rpc->buf_links);
-	if (rpc->interest) {
-		rpc->interest->reg_rpc = NULL;
-		wake_up_process(rpc->interest->thread);
-		rpc->interest = NULL;
+	if (!list_empty(&rpc->ready_links) || !list_empty(&rpc->buf_links) ||
+	    READ_ONCE(rpc->interest)) {
+		homa_sock_lock(rpc->hsk, HOMA_LOCK_FREE);
+		if (unlikely(rpc->hsk->group) &&
+		    !list_empty(&rpc->ready_links)) {
+			/* The RPC may be queued in the socket's group. */
+			homa_sock_lock(rpc->hsk->group, HOMA_LOCK_FREE);
+			list_del_init(&rpc->ready_links);
+			homa_sock_unlock(rpc->hsk->group);
+		}
+		if (unlikely(rpc->hsk->pool_group) &&
+		    !list_empty(&rpc->buf_links)) {
+			/* The RPC is waiting for space in the group's pool. */
+			homa_sock_lock(rpc->hsk->pool_group, HOMA_LOCK_FREE);
+			list_del_init(&rpc->buf_links);
+			homa_sock_unlock(rpc->hsk->pool_group);
+		}
+		list_del_init(&rpc->ready_links);
+		list_del_init(&rpc->buf_links);
+		if (rpc->interest) {
+			rpc->interest->reg_rpc = NULL;
+			wake_up_process(rpc->interest->thread);
+			rpc->interest = NULL;
+		}
+		homa_sock_unlock(rpc->hsk);
 	}
-//	tt_record3("Freeing rpc id %d, socket %d, dead_skbs %d", rpc->id,
-//			rpc->hsk->client_port,
-//			rpc->hsk->dead_skbs);
 
 	if (rpc->msgin.length >= 0) {
-		rpc->hsk->dead_skbs += skb_queue_len(&rpc->msgin.packets);
+		dead_skbs += skb_queue_len(&rpc->msgin.packets);
 		while (1) {
 			struct homa_gap *gap = list_first_entry_or_null(&rpc->msgin.gaps,
 									struct homa_gap,
@@ -322,16 +538,40 @@ void homa_rpc_free(struct homa_rpc *rpc)
 			kfree(gap);
 		}
 	}
-	rpc->hsk->dead_skbs += rpc->msgout.num_skbs;
-	if (rpc->hsk->dead_skbs > rpc->hsk->homa->max_dead_buffs)
+	dead_skbs += rpc->msgout.num_skbs;
+	dead_skbs = atomic_add_return(dead_skbs, &rpc->hsk->dead_skbs);
+	if (dead_skbs > rpc->hsk->homa->max_dead_buffs)
 		/* This update isn't thread-safe; it's just a
 		 * statistic so it's OK if updates occasionally get
 		 * missed.
 		 */
-		rpc->hsk->homa->max_dead_buffs = rpc->hsk->dead_skbs;
+		rpc->hsk->homa->max_dead_buffs = dead_skbs;
+
+	homa_rpc_shard_lock(rpc->shard);
+	list_del_rcu(&rpc->active_links);
+	list_add_tail_rcu(&rpc->dead_links, &rpc->shard->dead_rpcs);
+	homa_rpc_shard_unlock(rpc->shard);
 
-	homa_sock_unlock(rpc->hsk);
 	homa_remove_from_throttled(rpc);
+	homa_rpc_queue_reap(rpc->hsk, rpc->hsk->homa->reap_work_skbs);
+}
+
+/**
+ * homa_rpc_next_dead_shard() - Find the next shard of a socket that
+ * contains dead RPCs.
+ * @hsk:     Socket to search.
+ * @index:   Index in @hsk->rpc_shards at which to start searching.
+ *
+ * Return:   Index of the first shard at or after @index with a nonempty
+ *           dead_rpcs list, or HOMA_RPC_SHARDS if there is no such shard.
+ */
+static int homa_rpc_next_dead_shard(struct homa_sock *hsk, int index)
+{
+	for ( ; index < HOMA_RPC_SHARDS; index++) {
+		if (!list_empty(&hsk->rpc_shards[index].dead_rpcs))
+			break;
+	}
+	return index;
 }
 
 /**
@@ -359,19 +599,27 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 #endif /* __UNIT_TEST__ */
 	struct homa_rpc *rpcs[BATCH_MAX];
 	struct sk_buff *skbs[BATCH_MAX];
+	struct homa_rpc_shard *shard;
 	int num_skbs, num_rpcs;
 	struct homa_rpc *rpc;
 	int i, batch_size;
 	int rx_frees = 0;
-	int result;
+	int result = 0;
+	int index = 0;
 
 	INC_METRIC(reaper_calls, 1);
-	INC_METRIC(reaper_dead_skbs, hsk->dead_skbs);
+	INC_METRIC(reaper_dead_skbs, atomic_read(&hsk->dead_skbs));
 
 	/* Each iteration through the following loop will reap
-	 * BATCH_MAX skbs.
+	 * BATCH_MAX skbs from a single shard.
 	 */
 	while (count > 0) {
+		index = homa_rpc_next_dead_shard(hsk, index);
+		if (index >= HOMA_RPC_SHARDS) {
+			result = 0;
+			break;
+		}
+		shard = &hsk->rpc_shards[index];
 		batch_size = count;
 		if (batch_size > BATCH_MAX)
 			batch_size = BATCH_MAX;
@@ -379,18 +627,24 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 		num_skbs = 0;
 		num_rpcs = 0;
 
-		homa_sock_lock(hsk, "homa_rpc_reap");
+		homa_rpc_shard_lock(shard);
+
+		/* Pairs with the barrier in homa_protect_rpcs: either we
+		 * see the protection, or the protector can't see any of
+		 * the RPCs we are about to reap.
+		 */
+		smp_mb__after_spinlock();
 		if (atomic_read(&hsk->protect_count)) {
 			INC_METRIC(disabled_reaps, 1);
 			tt_record2("homa_rpc_reap returning: protect_count %d, dead_skbs %d",
 				   atomic_read(&hsk->protect_count),
-				   hsk->dead_skbs);
-			homa_sock_unlock(hsk);
+				   atomic_read(&hsk->dead_skbs));
+			homa_rpc_shard_unlock(shard);
 			return 0;
 		}
 
 		/* Collect buffers and freeable RPCs. */
-		list_for_each_entry_rcu(rpc, &hsk->dead_rpcs, dead_links) {
+		list_for_each_entry_rcu(rpc, &shard->dead_rpcs, dead_links) {
 			if ((atomic_read(&rpc->flags) & RPC_CANT_REAP) ||
 			    atomic_read(&rpc->grants_in_progress) != 0 ||
 			    atomic_read(&rpc->msgout.active_xmits) != 0) {
@@ -441,14 +695,17 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 				goto release;
 		}
 
-		/* Free all of the collected resources; release the socket
-		 * lock while doing this.
+		/* Free all of the collected resources; release the shard
+		 * lock while doing this. If there's nothing more we can
+		 * do in this shard, move on to the next one.
 		 */
 release:
-		hsk->dead_skbs -= num_skbs + rx_frees;
-		result = !list_empty(&hsk->dead_rpcs) &&
-				(num_skbs + num_rpcs) != 0;
-		homa_sock_unlock(hsk);
+		atomic_sub(num_skbs + rx_frees, &hsk->dead_skbs);
+		if (list_empty(&shard->dead_rpcs) ||
+		    (num_skbs + num_rpcs) == 0)
+			index++;
+		homa_rpc_shard_unlock(shard);
+		result = homa_rpc_next_dead_shard(hsk, index) < HOMA_RPC_SHARDS;
 		homa_skb_free_many_tx(hsk->homa, skbs, num_skbs);
 		for (i = 0; i < num_rpcs; i++) {
 			rpc = rpcs[i];
@@ -462,10 +719,11 @@ release:
 			homa_rpc_unlock(rpc);
 
 			if (unlikely(rpc->msgin.num_bpages))
-				homa_pool_release_buffers(rpc->hsk->buffer_pool,
+				homa_pool_release_buffers(homa_sock_pool(rpc->hsk),
 							  rpc->msgin.num_bpages,
 							  rpc->msgin.bpage_offsets);
 			if (rpc->msgin.length >= 0) {
+				homa_pool_zc_free(rpc);
 				while (1) {
 					struct homa_gap *gap;
 
@@ -479,21 +737,48 @@ release:
 					kfree(gap);
 				}
 			}
-			tt_record1("homa_rpc_reap finished reaping id %d",
-				   rpc->id);
-			rpc->state = 0;
-			kfree(rpc);
+			tt_rpc_record1(rpc->id, "homa_rpc_reap finished reaping id %d",
+				       rpc->id);
+			homa_rpc_recycle(rpc);
 		}
 		tt_record4("reaped %d skbs, %d rpcs; %d skbs remain for port %d",
-			   num_skbs + rx_frees, num_rpcs, hsk->dead_skbs,
-			   hsk->port);
+			   num_skbs + rx_frees, num_rpcs,
+			   atomic_read(&hsk->dead_skbs), hsk->port);
 		if (!result)
 			break;
 	}
-	homa_pool_check_waiting(hsk->buffer_pool);
+	homa_pool_check_waiting(homa_sock_pool(hsk));
 	return result;
 }
 
+/**
+ * homa_rpc_reap_work() - Invoked in a helper worker thread (scheduled by
+ * homa_rpc_queue_reap) to reap dead RPCs for a socket, so that the cost of
+ * freeing their packet buffers doesn't fall on application threads. Each
+ * invocation reaps up to HOMA_REAP_WORK_BATCH buffers, then requeues
+ * itself if there is more work, so that it doesn't monopolize a worker.
+ * @work:    The reap_work field of the socket.
+ */
+void homa_rpc_reap_work(struct work_struct *work)
+{
+	struct homa_sock *hsk = container_of(work, struct homa_sock,
+					     reap_work);
+	__u64 start = sched_clock();
+	int more;
+
+	tt_record2("homa_rpc_reap_work starting for port %d, dead_skbs %d",
+		   hsk->port, atomic_read(&hsk->dead_skbs));
+	INC_METRIC(reap_work_calls, 1);
+	more = homa_rpc_reap(hsk, HOMA_REAP_WORK_BATCH);
+
+	/* If reaping was blocked by homa_protect_rpcs, homa_timer will
+	 * reschedule us.
+	 */
+	if (more && !READ_ONCE(hsk->shutdown))
+		queue_work(system_unbound_wq, &hsk->reap_work);
+	INC_METRIC(reap_work_ns, sched_clock() - start);
+}
+
 /**
  * homa_find_client_rpc() - Locate client-side information about the RPC that
  * a packet belongs to, if there is any. Thread-safe without socket lock.
@@ -584,6 +869,7 @@ void homa_rpc_log(struct homa_rpc *rpc)
 void homa_rpc_log_active(struct homa *homa, uint64_t id)
 {
 	struct homa_socktab_scan scan;
+	struct homa_rpc_shard *shard;
 	struct homa_sock *hsk;
 	struct homa_rpc *rpc;
 	int count = 0;
@@ -592,12 +878,12 @@ void homa_rpc_log_active(struct homa *homa, uint64_t id)
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(homa->port_map, &scan);
 	     hsk; hsk = homa_socktab_next(&scan)) {
-		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
+		if (!homa_sock_has_active_rpcs(hsk) || hsk->shutdown)
 			continue;
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+		homa_for_each_active_rpc(rpc, shard, hsk) {
 			count++;
 			if (id != 0 && id != rpc->id)
 				continue;
@@ -620,35 +906,35 @@ void homa_rpc_log_tt(struct homa_rpc *rpc)
 	if (rpc->state == RPC_INCOMING) {
 		int received = rpc->msgin.length
 				- rpc->msgin.bytes_remaining;
-		tt_record4("Incoming RPC id %d, peer 0x%x, %d/%d bytes received",
-			   rpc->id, tt_addr(rpc->peer->addr),
-			   received, rpc->msgin.length);
+		tt_rpc_record4(rpc->id, "Incoming RPC id %d, peer 0x%x, %d/%d bytes received",
+			       rpc->id, tt_addr(rpc->peer->addr),
+			       received, rpc->msgin.length);
 		if (1)
-			tt_record4("RPC id %d has incoming %d, granted %d, prio %d", rpc->id,
-				   rpc->msgin.granted - received,
-				   rpc->msgin.granted, rpc->msgin.priority);
-		tt_record4("RPC id %d: length %d, remaining %d, rank %d",
-			   rpc->id, rpc->msgin.length,
-			   rpc->msgin.bytes_remaining,
-			   atomic_read(&rpc->msgin.rank));
+			tt_rpc_record4(rpc->id, "RPC id %d has incoming %d, granted %d, prio %d", rpc->id,
+				       rpc->msgin.granted - received,
+				       rpc->msgin.granted, rpc->msgin.priority);
+		tt_rpc_record4(rpc->id, "RPC id %d: length %d, remaining %d, rank %d",
+			       rpc->id, rpc->msgin.length,
+			       rpc->msgin.bytes_remaining,
+			       atomic_read(&rpc->msgin.rank));
 		if (rpc->msgin.num_bpages == 0)
-			tt_record1("RPC id %d is blocked waiting for buffers",
-				   rpc->id);
+			tt_rpc_record1(rpc->id, "RPC id %d is blocked waiting for buffers",
+				       rpc->id);
 		else
-			tt_record2("RPC id %d has %d bpages allocated",
-				   rpc->id, rpc->msgin.num_bpages);
+			tt_rpc_record2(rpc->id, "RPC id %d has %d bpages allocated",
+				       rpc->id, rpc->msgin.num_bpages);
 	} else if (rpc->state == RPC_OUTGOING) {
-		tt_record4("Outgoing RPC id %d, peer 0x%x, %d/%d bytes sent",
-			   rpc->id, tt_addr(rpc->peer->addr),
-			   rpc->msgout.next_xmit_offset,
-			   rpc->msgout.length);
+		tt_rpc_record4(rpc->id, "Outgoing RPC id %d, peer 0x%x, %d/%d bytes sent",
+			       rpc->id, tt_addr(rpc->peer->addr),
+			       rpc->msgout.next_xmit_offset,
+			       rpc->msgout.length);
 		if (rpc->msgout.granted > rpc->msgout.next_xmit_offset)
-			tt_record3("RPC id %d has %d unsent grants (granted %d)",
-				   rpc->id, rpc->msgout.granted -
-				   rpc->msgout.next_xmit_offset,
-				   rpc->msgout.granted);
+			tt_rpc_record3(rpc->id, "RPC id %d has %d unsent grants (granted %d)",
+				       rpc->id, rpc->msgout.granted -
+				       rpc->msgout.next_xmit_offset,
+				       rpc->msgout.granted);
 	} else {
-		tt_record2("RPC id %d is in state %d", rpc->id, rpc->state);
+		tt_rpc_record2(rpc->id, "RPC id %d is in state %d", rpc->id, rpc->state);
 	}
 #endif /* See strip.py */
 }
@@ -663,6 +949,7 @@ void homa_rpc_log_tt(struct homa_rpc *rpc)
 void homa_rpc_log_active_tt(struct homa *homa, int freeze_count)
 {
 	struct homa_socktab_scan scan;
+	struct homa_rpc_shard *shard;
 	struct homa_sock *hsk;
 	struct homa_rpc *rpc;
 	int count = 0;
@@ -672,12 +959,12 @@ void homa_rpc_log_active_tt(struct homa *homa, int freeze_count)
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(homa->port_map, &scan);
 			hsk; hsk = homa_socktab_next(&scan)) {
-		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
+		if (!homa_sock_has_active_rpcs(hsk) || hsk->shutdown)
 			continue;
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+		homa_for_each_active_rpc(rpc, shard, hsk) {
 			struct homa_freeze_hdr freeze;
 
 			count++;
@@ -714,6 +1001,7 @@ void homa_rpc_log_active_tt(struct homa *homa, int freeze_count)
 int homa_validate_incoming(struct homa *homa, int verbose, int *link_errors)
 {
 	struct homa_socktab_scan scan;
+	struct homa_rpc_shard *shard;
 	int total_incoming = 0;
 	struct homa_sock *hsk;
 	struct homa_rpc *rpc;
@@ -725,12 +1013,12 @@ int homa_validate_incoming(struct homa *homa, int verbose, int *link_errors)
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(homa->port_map, &scan);
 			hsk; hsk = homa_socktab_next(&scan)) {
-		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
+		if (!homa_sock_has_active_rpcs(hsk) || hsk->shutdown)
 			continue;
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+		homa_for_each_active_rpc(rpc, shard, hsk) {
 			int incoming;
 
 			if (rpc->state != RPC_INCOMING)
@@ -744,19 +1032,19 @@ int homa_validate_incoming(struct homa *homa, int verbose, int *link_errors)
 				continue;
 			total_incoming += rpc->msgin.rec_incoming;
 			if (verbose)
-				tt_record3("homa_validate_incoming: RPC id %d, ncoming %d, rec_incoming %d",
-					   rpc->id, incoming,
-					   rpc->msgin.rec_incoming);
+				tt_rpc_record3(rpc->id, "homa_validate_incoming: RPC id %d, ncoming %d, rec_incoming %d",
+					       rpc->id, incoming,
+					       rpc->msgin.rec_incoming);
 			if (rpc->msgin.granted >= rpc->msgin.length)
 				continue;
 			if (list_empty(&rpc->grantable_links)) {
-				tt_record1("homa_validate_incoming: RPC id %d not linked in grantable list",
-					   rpc->id);
+				tt_rpc_record1(rpc->id, "homa_validate_incoming: RPC id %d not linked in grantable list",
+					       rpc->id);
 				*link_errors = 1;
 			}
 			if (list_empty(&rpc->grantable_links)) {
-				tt_record1("homa_validate_incoming: RPC id %d peer not linked in grantable list",
-					   rpc->id);
+				tt_rpc_record1(rpc->id, "homa_validate_incoming: RPC id %d peer not linked in grantable list",
+					       rpc->id);
 				*link_errors = 1;
 			}
 		}
@@ -8,6 +8,7 @@
 #include <linux/percpu-defs.h>
 #include <linux/skbuff.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "homa_sock.h"
 #include "homa_wire.h"
@@ -91,6 +92,15 @@ struct homa_message_out {
 	 * initialized.  Used to find the oldest outgoing message.
 	 */
 	__u64 init_ns;
+
+	/**
+	 * @zc_uarg: Non-NULL means the message is being sent with zero-copy
+	 * (user pages are attached to packets as frags rather than being
+	 * copied); each packet holds a reference to this object, and the
+	 * application is notified once all of the packets have been freed.
+	 * Only valid while homa_message_out_fill is running.
+	 */
+	struct ubuf_info *zc_uarg;
 };
 
 /**
@@ -176,6 +186,12 @@ struct homa_message_in {
 	/** @resend_all: if nonzero, set resend_all in the next grant packet. */
 	__u8 resend_all;
 
+	/**
+	 * @sent_grant: nonzero means at least one grant has been sent for
+	 * this message (used for the lat_first_grant_ns metric).
+	 */
+	__u8 sent_grant;
+
 	/**
 	 * @birth: sched_clock() time when this RPC was added to the grantable
 	 * list. Invalid if RPC isn't in the grantable list.
@@ -194,6 +210,49 @@ struct homa_message_in {
 	 * All but the last pointer refer to areas of size HOMA_BPAGE_SIZE.
 	 */
 	__u32 bpage_offsets[HOMA_MAX_BPAGES];
+
+	/**
+	 * @pool_wait_start: sched_clock() time when this message began
+	 * waiting for buffer space (in hsk->waiting_for_bufs); 0 if it
+	 * isn't waiting.
+	 */
+	__u64 pool_wait_start;
+
+	/**
+	 * @inline_msg: Nonzero means this message is small enough to be
+	 * delivered inline (see homa_sock->inline_max): no bpages are
+	 * allocated and its packets stay in @packets until recvmsg copies
+	 * them directly to the application.
+	 */
+	__u8 inline_msg;
+
+	/**
+	 * @zc: if non-NULL, the full bpages of this message will be
+	 * delivered by mapping pages into user space rather than copying
+	 * (see homa_pool_zc_init). Dynamically allocated.
+	 */
+	struct homa_zc_msg *zc;
+
+	/**
+	 * @copiers: Number of threads currently copying data from this
+	 * message to user space with the RPC unlocked (the receiving thread
+	 * and/or a helper worker); RPC_COPYING_TO_USER is set whenever this
+	 * is nonzero.
+	 */
+	int copiers;
+
+	/**
+	 * @complete_ns: sched_clock() time when the last byte of the
+	 * message was received (0 if not yet complete).
+	 */
+	__u64 complete_ns;
+
+	/**
+	 * @copy_work: Used to schedule homa_copy_work when a helper worker
+	 * should copy data from this message to user space. Valid only if
+	 * RPC_COPY_QUEUED is set.
+	 */
+	struct work_struct copy_work;
 };
 
 /**
@@ -212,6 +271,12 @@ struct homa_rpc {
 	 */
 	struct homa_rpc_bucket *bucket;
 
+	/**
+	 * @shard: The shard of hsk->rpc_shards whose lists contain this
+	 * RPC (selected based on the core where the RPC was created).
+	 */
+	struct homa_rpc_shard *shard;
+
 	/**
 	 * @state: The current state of this RPC:
 	 *
@@ -267,15 +332,23 @@ struct homa_rpc {
 	 *                         preventing data copies to user space from
 	 *                         starting (and they limit throughput at
 	 *                         high network speeds).
+	 * RPC_ZEROCOPY -          The application requested zero-copy
+	 *                         transmission (MSG_ZEROCOPY) for the
+	 *                         outgoing message.
+	 * RPC_COPY_QUEUED -       msgin.copy_work has been queued (or is
+	 *                         running) to copy data to user space; the
+	 *                         RPC must not be reaped.
 	 */
 #define RPC_PKTS_READY        1
 #define RPC_COPYING_FROM_USER 2
 #define RPC_COPYING_TO_USER   4
 #define RPC_HANDING_OFF       8
 #define APP_NEEDS_LOCK       16
+#define RPC_ZEROCOPY         32
+#define RPC_COPY_QUEUED      64
 
 #define RPC_CANT_REAP (RPC_COPYING_FROM_USER | RPC_COPYING_TO_USER \
-		| RPC_HANDING_OFF)
+		| RPC_HANDING_OFF | RPC_COPY_QUEUED)
 
 	/**
 	 * @grants_in_progress: Count of active grant sends for this RPC;
@@ -350,13 +423,13 @@ struct homa_rpc {
 	struct list_head buf_links;
 
 	/**
-	 * @active_links: For linking this object into @hsk->active_rpcs.
+	 * @active_links: For linking this object into @shard->active_rpcs.
 	 * The next field will be LIST_POISON1 if this RPC hasn't yet been
-	 * linked into @hsk->active_rpcs. Access with RCU.
+	 * linked into @shard->active_rpcs. Access with RCU.
 	 */
 	struct list_head active_links;
 
-	/** @dead_links: For linking this object into @hsk->dead_rpcs. */
+	/** @dead_links: For linking this object into @shard->dead_rpcs. */
 	struct list_head dead_links;
 
 	/**
@@ -414,8 +487,72 @@ struct homa_rpc {
 	 * Used (sometimes) for testing.
 	 */
 	u64 start_ns;
+
+	/**
+	 * @handoff_ns: time (from sched_clock()) of the most recent call
+	 * to homa_rpc_handoff for this RPC; used to measure handoff latency.
+	 */
+	u64 handoff_ns;
+
+	/**
+	 * @service_ns: for server RPCs, the time (from sched_clock()) when
+	 * recvmsg returned the request to the application; used to measure
+	 * service time.
+	 */
+	u64 service_ns;
 };
 
+/**
+ * define HOMA_RPC_CACHE_SIZE: maximum number of reaped homa_rpc structs
+ * that each core will retain for reuse by new RPCs.
+ */
+#define HOMA_RPC_CACHE_SIZE 32
+
+/**
+ * define HOMA_ID_BLOCK: number of client RPC ids that a core reserves
+ * from homa->next_outgoing_id at once (see homa_rpc_alloc_id). Large enough
+ * that cores rarely touch the shared counter.
+ */
+#define HOMA_ID_BLOCK 1024
+
+/**
+ * struct homa_rpc_core - Stores core-specific information related to
+ * homa_rpc allocation. All values are assumed to be zero initially.
+ */
+struct homa_rpc_core {
+	/**
+	 * @next_id: Next client RPC id to assign on this core. Accessed
+	 * only on this core, with BHs disabled (as are @id_limit and
+	 * @id_epoch).
+	 */
+	__u64 next_id;
+
+	/**
+	 * @id_limit: Ids from @next_id up to (but not including) this value
+	 * are reserved for this core.
+	 */
+	__u64 id_limit;
+
+	/**
+	 * @id_epoch: Value of homa->id_epoch when the current block of ids
+	 * was reserved; if homa->id_epoch has changed since then, the
+	 * block must be discarded.
+	 */
+	int id_epoch;
+
+	/** @num_free: Number of RPCs currently in @free_rpcs. */
+	int num_free;
+
+	/**
+	 * @free_rpcs: RPCs that have been reaped and restored by
+	 * homa_rpc_recycle to the state produced by the rpc_cache
+	 * constructor, so they can be reused without going through the
+	 * slab allocator. Accessed only on this core, with BHs disabled.
+	 */
+	struct homa_rpc *free_rpcs[HOMA_RPC_CACHE_SIZE];
+};
+DECLARE_PER_CPU(struct homa_rpc_core, homa_rpc_core);
+
 void     homa_check_rpc(struct homa_rpc *rpc);
 struct homa_rpc
 	       *homa_find_client_rpc(struct homa_sock *hsk, __u64 id);
@@ -424,6 +561,8 @@ struct homa_rpc
 				     const struct in6_addr *saddr, __u64 id);
 void     homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 			struct homa_ack *ack);
+void     homa_rpc_cache_cleanup(struct homa *homa);
+int      homa_rpc_cache_init(struct homa *homa);
 void     homa_rpc_free(struct homa_rpc *rpc);
 void     homa_rpc_log(struct homa_rpc *rpc);
 void     homa_rpc_log_active(struct homa *homa, uint64_t id);
@@ -437,6 +576,9 @@ struct homa_rpc
 				    const struct in6_addr *source,
 				    struct homa_data_hdr *h, int *created);
 int      homa_rpc_reap(struct homa_sock *hsk, int count);
+void     homa_rpc_reap_work(struct work_struct *work);
+void     homa_rpc_recycle(struct homa_rpc *rpc);
+void     homa_rpc_set_next_id(struct homa *homa, __u64 id);
 char    *homa_symbol_for_state(struct homa_rpc *rpc);
 int      homa_validate_incoming(struct homa *homa, int verbose,
 				int *link_errors);
@@ -498,10 +640,14 @@ static inline int homa_protect_rpcs(struct homa_sock *hsk)
 {
 	int result;
 
-	homa_sock_lock(hsk, __func__);
+	homa_sock_lock(hsk, HOMA_LOCK_PROTECT);
 	result = !hsk->shutdown;
-	if (result)
+	if (result) {
 		atomic_inc(&hsk->protect_count);
+
+		/* Pairs with the barrier in homa_rpc_reap. */
+		smp_mb__after_atomic();
+	}
 	homa_sock_unlock(hsk);
 	return result;
 }
@@ -516,6 +662,39 @@ static inline void homa_unprotect_rpcs(struct homa_sock *hsk)
 	atomic_dec(&hsk->protect_count);
 }
 
+/**
+ * homa_rpc_queue_reap() - Schedule homa_rpc_reap_work for a socket if
+ * reaping is done by helper workers and enough dead packet buffers have
+ * accumulated.
+ * @hsk:       Socket whose dead RPCs should be reaped.
+ * @min_skbs:  Don't schedule the worker unless the socket has at least
+ *             this many packet buffers in dead RPCs. 0 means schedule
+ *             it if there are any dead RPCs at all.
+ * Return:     True if reaping for @hsk is done by workers (whether or not
+ *             one was scheduled), in which case the caller shouldn't reap.
+ */
+static inline bool homa_rpc_queue_reap(struct homa_sock *hsk, int min_skbs)
+{
+	if (!hsk->homa->reap_workers)
+		return false;
+	if (atomic_read(&hsk->dead_skbs) >= min_skbs &&
+	    homa_sock_has_dead_rpcs(hsk) &&
+	    !work_pending(&hsk->reap_work)) {
+		/* homa_sock_shutdown sets @shutdown with the socket locked
+		 * before it cancels the work, so checking it under the lock
+		 * ensures that the work can't be queued after the cancel.
+		 * The lock is only needed to queue the work, so skip it
+		 * (checked above) if the work is already pending; that's
+		 * the common case when there is a backlog of dead RPCs.
+		 */
+		homa_sock_lock(hsk, HOMA_LOCK_FREE);
+		if (!hsk->shutdown)
+			queue_work(system_unbound_wq, &hsk->reap_work);
+		homa_sock_unlock(hsk);
+	}
+	return true;
+}
+
 /**
  * homa_is_client(): returns true if we are the client for a particular RPC,
  * false if we are the server.
@@ -527,4 +706,16 @@ static inline bool homa_is_client(__u64 id)
 	return (id & 1) == 0;
 }
 
+/**
+ * homa_msgin_has_space() - Returns true if the incoming message for an RPC
+ * has somewhere to go: either buffer space has been allocated for it or
+ * it will be delivered inline.
+ * @rpc:    RPC to check.
+ * Return:  False means the RPC is waiting for buffer space.
+ */
+static inline bool homa_msgin_has_space(struct homa_rpc *rpc)
+{
+	return rpc->msgin.num_bpages > 0 || rpc->msgin.inline_msg;
+}
+
 #endif /* _HOMA_RPC_H */
@@ -22,6 +22,196 @@ static void frag_page_set(skb_frag_t *frag, struct page *page)
 	frag->netmem = page_to_netmem(page);
 }
 
+/**
+ * homa_skb_mag_take() - Claim a magazine from an array of slots in a
+ * homa_page_pool.
+ * @slots:    Either the full or the empty slots of a homa_page_pool.
+ * Return:    A magazine, which is now owned by the caller, or NULL if
+ *            there were no magazines in @slots.
+ */
+static struct homa_page_mag *homa_skb_mag_take(struct homa_page_mag **slots)
+{
+	struct homa_page_mag *mag;
+	int i;
+
+	for (i = 0; i < HOMA_PAGE_POOL_MAGS; i++) {
+		/* Read first, so idle slots don't cause cache line bouncing. */
+		if (!READ_ONCE(slots[i]))
+			continue;
+		mag = xchg(&slots[i], NULL);
+		if (mag)
+			return mag;
+	}
+	return NULL;
+}
+
+/**
+ * homa_skb_mag_give() - Deposit a magazine in an unused slot of a
+ * homa_page_pool.
+ * @slots:    Either the full or the empty slots of a homa_page_pool.
+ * @mag:      Magazine to deposit; the caller must own it.
+ * Return:    True for success (the caller no longer owns @mag), false if
+ *            no unused slot could be found.
+ */
+static bool homa_skb_mag_give(struct homa_page_mag **slots,
+			      struct homa_page_mag *mag)
+{
+	int i;
+
+	for (i = 0; i < HOMA_PAGE_POOL_MAGS; i++) {
+		if (READ_ONCE(slots[i]))
+			continue;
+		if (!cmpxchg(&slots[i], NULL, mag))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * homa_skb_mag_deposit() - Return a magazine to a page pool, placing
+ * it among either the full or the empty magazines, depending on whether
+ * it contains any pages. If this fails (which should never happen) the
+ * magazine and its pages are released.
+ * @pool:     Pool in which to deposit @mag.
+ * @mag:      Magazine owned by the caller.
+ */
+static void homa_skb_mag_deposit(struct homa_page_pool *pool,
+				 struct homa_page_mag *mag)
+{
+	int count = mag->count;
+	int i;
+
+	if (count == 0) {
+		if (homa_skb_mag_give(pool->empty, mag))
+			return;
+	} else {
+		/* Update avail first, so that it can't go negative if the
+		 * magazine is taken immediately.
+		 */
+		atomic_add(count, &pool->avail);
+		if (homa_skb_mag_give(pool->full, mag)) {
+			INC_METRIC(skb_page_mag_flushes, 1);
+			return;
+		}
+		atomic_sub(count, &pool->avail);
+	}
+	for (i = 0; i < count; i++)
+		put_page(mag->pages[i]);
+	kfree(mag);
+}
+
+/**
+ * homa_skb_mag_refill() - Exchange a core's spare magazine (which must be
+ * empty) for a magazine of pages from its NUMA node's page pool.
+ * @skb_core:   Core-specific info; BHs must be disabled.
+ * Return:      True if @skb_core->spare_mag now holds at least one page,
+ *              false if the pool had no pages.
+ */
+static bool homa_skb_mag_refill(struct homa_skb_core *skb_core)
+{
+	struct homa_page_pool *pool = skb_core->pool;
+	struct homa_page_mag *mag;
+	int avail;
+
+	mag = homa_skb_mag_take(pool->full);
+	if (!mag)
+		return false;
+	avail = atomic_sub_return(mag->count, &pool->avail);
+	if (avail < READ_ONCE(pool->low_mark))
+		WRITE_ONCE(pool->low_mark, avail);
+	atomic_add(mag->count, &pool->demand);
+	INC_METRIC(skb_page_mag_refills, 1);
+	homa_skb_mag_deposit(pool, skb_core->spare_mag);
+	skb_core->spare_mag = mag;
+	return true;
+}
+
+/**
+ * homa_skb_core_get_page() - Allocate a free page from a core's magazines,
+ * refilling them from the page pool if necessary.
+ * @skb_core:   Core-specific info; BHs must be disabled.
+ * Return:      A page of size HOMA_SKB_PAGE_SIZE with ref count 1, or NULL
+ *              if no cached pages are available.
+ */
+static struct page *homa_skb_core_get_page(struct homa_skb_core *skb_core)
+{
+	struct homa_page_mag *mag = skb_core->mag;
+
+	if (mag->count == 0) {
+		if (skb_core->spare_mag->count == 0 &&
+		    !homa_skb_mag_refill(skb_core))
+			return NULL;
+		skb_core->mag = skb_core->spare_mag;
+		skb_core->spare_mag = mag;
+		mag = skb_core->mag;
+	}
+	mag->count--;
+	return mag->pages[mag->count];
+}
+
+/**
+ * homa_skb_core_put_page() - Cache a free page in a core's magazines,
+ * flushing a full magazine to the page pool if necessary.
+ * @skb_core:   Core-specific info; BHs must be disabled. @page must
+ *              belong to the same NUMA node as this core.
+ * @page:       Page of size HOMA_SKB_PAGE_SIZE with ref count 1.
+ * Return:      True if @page was cached; false means the page pool is
+ *              full, so the caller must release @page.
+ */
+static bool homa_skb_core_put_page(struct homa_skb_core *skb_core,
+				   struct page *page)
+{
+	struct homa_page_mag *mag = skb_core->mag;
+
+	if (mag->count == HOMA_PAGE_MAG_SIZE) {
+		if (skb_core->spare_mag->count == HOMA_PAGE_MAG_SIZE) {
+			struct homa_page_mag *empty;
+
+			empty = homa_skb_mag_take(skb_core->pool->empty);
+			if (!empty)
+				return false;
+			homa_skb_mag_deposit(skb_core->pool,
+					     skb_core->spare_mag);
+			skb_core->spare_mag = empty;
+		}
+		skb_core->mag = skb_core->spare_mag;
+		skb_core->spare_mag = mag;
+		mag = skb_core->mag;
+	}
+	mag->pages[mag->count] = page;
+	mag->count++;
+	return true;
+}
+
+/**
+ * homa_skb_mag_free() - Release a magazine along with all of its pages.
+ * @mag:     Magazine to free; may be NULL.
+ */
+static void homa_skb_mag_free(struct homa_page_mag *mag)
+{
+	int i;
+
+	if (!mag)
+		return;
+	for (i = 0; i < mag->count; i++)
+		put_page(mag->pages[i]);
+	kfree(mag);
+}
+
+/**
+ * homa_skb_mag_alloc() - Allocate and initialize an empty magazine.
+ * Return:    The new magazine, or NULL if memory couldn't be allocated.
+ */
+static struct homa_page_mag *homa_skb_mag_alloc(void)
+{
+	struct homa_page_mag *mag;
+
+	mag = kmalloc(sizeof(*mag), GFP_KERNEL);
+	if (mag)
+		mag->count = 0;
+	return mag;
+}
+
 /**
  * homa_skb_init() - Invoked when a struct homa is created to initialize
  * information related to sk_buff management.
@@ -30,13 +220,10 @@ static void frag_page_set(skb_frag_t *frag, struct page *page)
  */
 int homa_skb_init(struct homa *homa)
 {
-	int i;
+	int i, j;
 
-	spin_lock_init(&homa->page_pool_mutex);
 	memset(homa->page_pools, 0, sizeof(homa->page_pools));
 	homa->skb_page_frees_per_sec = 1000;
-	homa->skb_pages_to_free = NULL;
-	homa->pages_to_free_slots = 0;
 	homa->skb_page_free_time = 0;
 	homa->skb_page_pool_min_kb = (3 * HOMA_MAX_MESSAGE_LENGTH) / 1000;
 
@@ -55,12 +242,21 @@ int homa_skb_init(struct homa *homa)
 			pool = kmalloc(sizeof(*pool), GFP_KERNEL);
 			if (!pool)
 				return -ENOMEM;
-			pool->avail = 0;
-			pool->low_mark = 0;
-			memset(pool->pages, 0, sizeof(pool->pages));
+			memset(pool, 0, sizeof(*pool));
 			homa->page_pools[numa] = pool;
+			for (j = 0; j < HOMA_PAGE_POOL_MAGS; j++) {
+				pool->empty[j] = homa_skb_mag_alloc();
+				if (!pool->empty[j])
+					return -ENOMEM;
+			}
 		}
 		skb_core->pool = homa->page_pools[numa];
+		skb_core->mag = homa_skb_mag_alloc();
+		if (!skb_core->mag)
+			return -ENOMEM;
+		skb_core->spare_mag = homa_skb_mag_alloc();
+		if (!skb_core->spare_mag)
+			return -ENOMEM;
 	}
 	pr_notice("%s found max NUMA node %d\n", __func__, homa->max_numa);
 	return 0;
@@ -84,10 +280,14 @@ void homa_skb_cleanup(struct homa *homa)
 			skb_core->page_size = 0;
 			skb_core->page_inuse = 0;
 		}
-		for (j = 0; j < skb_core->num_stashed_pages; j++)
-			put_page(skb_core->stashed_pages[j]);
+		homa_skb_mag_free(skb_core->mag);
+		skb_core->mag = NULL;
+		homa_skb_mag_free(skb_core->spare_mag);
+		skb_core->spare_mag = NULL;
 		skb_core->pool = NULL;
-		skb_core->num_stashed_pages = 0;
+		for (j = 0; j < skb_core->num_cached_skbs; j++)
+			kfree_skb(skb_core->cached_skbs[j]);
+		skb_core->num_cached_skbs = 0;
 	}
 
 	for (i = 0; i < MAX_NUMNODES; i++) {
@@ -95,18 +295,13 @@ void homa_skb_cleanup(struct homa *homa)
 
 		if (!pool)
 			continue;
-		for (j = pool->avail - 1; j >= 0; j--)
-			put_page(pool->pages[j]);
-		pool->avail = 0;
+		for (j = 0; j < HOMA_PAGE_POOL_MAGS; j++) {
+			homa_skb_mag_free(pool->full[j]);
+			homa_skb_mag_free(pool->empty[j]);
+		}
 		kfree(pool);
 		homa->page_pools[i] = NULL;
 	}
-
-	if (homa->skb_pages_to_free) {
-		kfree(homa->skb_pages_to_free);
-		homa->skb_pages_to_free = NULL;
-		homa->pages_to_free_slots = 0;
-	}
 }
 
 /**
@@ -124,52 +319,122 @@ void homa_skb_cleanup(struct homa *homa)
 struct sk_buff *homa_skb_new_tx(int length)
 {
 	__u64 start = sched_clock();
-	struct sk_buff *skb;
-
-	/* Note: allocate space for an IPv6 header, which is larger than
-	 * an IPv4 header.
-	 */
-	skb = alloc_skb(HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH +
-			sizeof(struct homa_skb_info) + length,
-			GFP_KERNEL);
+	struct homa_skb_core *skb_core;
+	struct sk_buff *skb = NULL;
+
+	if (length <= HOMA_MAX_HEADER) {
+		/* Small enough to use a recycled sk_buff, if there is one. */
+		local_bh_disable();
+		skb_core = &per_cpu(homa_skb_core, raw_smp_processor_id());
+		if (skb_core->num_cached_skbs > 0) {
+			skb_core->num_cached_skbs--;
+			skb = skb_core->cached_skbs[skb_core->num_cached_skbs];
+		}
+		local_bh_enable();
+		if (skb) {
+			INC_METRIC(skb_cache_hits, 1);
+			goto done;
+		}
+		INC_METRIC(skb_cache_misses, 1);
+
+		/* Allocate the standard size, so that this sk_buff can
+		 * be recycled later.
+		 */
+		skb = alloc_skb(HOMA_SKB_TX_SIZE, GFP_KERNEL);
+	} else {
+		/* Note: allocate space for an IPv6 header, which is larger
+		 * than an IPv4 header.
+		 */
+		skb = alloc_skb(HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH +
+				sizeof(struct homa_skb_info) + length,
+				GFP_KERNEL);
+	}
 	if (likely(skb)) {
 		skb_reserve(skb, HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH);
 		skb_reset_transport_header(skb);
 	}
 	INC_METRIC(skb_allocs, 1);
 	INC_METRIC(skb_alloc_ns, sched_clock() - start);
+done:
 	return skb;
 }
 
+/**
+ * homa_skb_recycle() - If possible, reset a tx sk_buff to its freshly
+ * allocated state and save it in the current core's cache for reuse by
+ * homa_skb_new_tx.
+ * @skb:       sk_buff that is no longer needed. Any frags must already
+ *             have been released (nr_frags must be 0).
+ * Return:     True means @skb was added to the cache (the caller must not
+ *             touch it again); false means @skb is not eligible for
+ *             recycling or the cache is full, so the caller must free it.
+ */
+bool homa_skb_recycle(struct sk_buff *skb)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+	struct homa_skb_core *skb_core;
+	bool result = false;
+
+	/* Only recycle sk_buffs that we are sure nobody else can see and
+	 * that carry no state we would have to release.
+	 */
+	if (refcount_read(&skb->users) != 1 || skb_cloned(skb) ||
+	    skb->destructor || skb->pfmemalloc || shinfo->frag_list ||
+	    skb_zcopy(skb) || skb_end_offset(skb) < HOMA_SKB_TX_SIZE)
+		return false;
+
+	local_bh_disable();
+	skb_core = &per_cpu(homa_skb_core, raw_smp_processor_id());
+	if (skb_core->num_cached_skbs < HOMA_SKB_CACHE_SIZE) {
+		/* Release the references that skb_release_head_state would
+		 * release, then mirror the initialization done by
+		 * __alloc_skb.
+		 */
+		skb_dst_drop(skb);
+		nf_reset_ct(skb);
+		skb_ext_reset(skb);
+		memset(skb, 0, offsetof(struct sk_buff, tail));
+		skb->data = skb->head;
+		skb_reset_tail_pointer(skb);
+		skb->mac_header = (typeof(skb->mac_header))~0U;
+		skb->transport_header = (typeof(skb->transport_header))~0U;
+		memset(shinfo, 0, offsetof(struct skb_shared_info, dataref));
+		atomic_set(&shinfo->dataref, 1);
+		skb_reserve(skb, HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH);
+		skb_reset_transport_header(skb);
+		skb_core->cached_skbs[skb_core->num_cached_skbs] = skb;
+		skb_core->num_cached_skbs++;
+		result = true;
+	}
+	local_bh_enable();
+	if (result)
+		INC_METRIC(skb_recycles, 1);
+	return result;
+}
+
 /**
  * homa_skb_stash_pages() - Typically invoked at the beginning of
- * preparing an output message; will collect from the page cache enough
- * pages to meet the needs of the message and stash them locally for this
- * core, so that the global lock for the page cache only needs to be acquired
- * once.
+ * preparing an output message; makes sure (if possible) that this core's
+ * magazines hold enough pages to meet the needs of the message, so that
+ * the page pool won't need to be accessed while the message is being
+ * created.
  * @homa:      Overall data about the Homa protocol implementation.
  * @length:    Length of the message being prepared. Must be <=
  *             HOMA_MAX_MESSAGE_LENGTH.
  */
 void homa_skb_stash_pages(struct homa *homa, int length)
 {
-	struct homa_skb_core *skb_core = &per_cpu(homa_skb_core,
-			raw_smp_processor_id());
-	struct homa_page_pool *pool = skb_core->pool;
 	int pages_needed = HOMA_MAX_STASHED(length);
+	struct homa_skb_core *skb_core;
 
-	if (pages_needed < 2 || skb_core->num_stashed_pages >= pages_needed)
+	if (pages_needed < 2)
 		return;
-	spin_lock_bh(&homa->page_pool_mutex);
-	while (pool->avail && (skb_core->num_stashed_pages < pages_needed)) {
-		pool->avail--;
-		if (pool->avail < pool->low_mark)
-			pool->low_mark = pool->avail;
-		skb_core->stashed_pages[skb_core->num_stashed_pages] =
-				pool->pages[pool->avail];
-		skb_core->num_stashed_pages++;
-	}
-	spin_unlock_bh(&homa->page_pool_mutex);
+	local_bh_disable();
+	skb_core = &per_cpu(homa_skb_core, raw_smp_processor_id());
+	if (skb_core->mag->count < pages_needed &&
+	    skb_core->spare_mag->count == 0)
+		homa_skb_mag_refill(skb_core);
+	local_bh_enable();
 }
 
 /**
@@ -241,7 +506,6 @@ void *homa_skb_extend_frags(struct homa *homa, struct sk_buff *skb, int *length)
  */
 bool homa_skb_page_alloc(struct homa *homa, struct homa_skb_core *skb_core)
 {
-	struct homa_page_pool *pool;
 	__u64 start;
 
 	if (skb_core->skb_page) {
@@ -255,33 +519,16 @@ bool homa_skb_page_alloc(struct homa *homa, struct homa_skb_core *skb_core)
 		put_page(skb_core->skb_page);
 	}
 
-	/* Step 1: does this core have a stashed page? */
+	/* Step 1: does this core (or its page pool) have a cached page? */
 	skb_core->page_size = HOMA_SKB_PAGE_SIZE;
 	skb_core->page_inuse = 0;
-	if (skb_core->num_stashed_pages > 0) {
-		skb_core->num_stashed_pages--;
-		skb_core->skb_page = skb_core->stashed_pages[skb_core->num_stashed_pages];
+	local_bh_disable();
+	skb_core->skb_page = homa_skb_core_get_page(skb_core);
+	local_bh_enable();
+	if (skb_core->skb_page)
 		goto success;
-	}
-
-	/* Step 2: can we retrieve a page from the pool for this NUMA node? */
-	pool = skb_core->pool;
-	if (pool->avail) {
-		spin_lock_bh(&homa->page_pool_mutex);
-
-		/* Must recheck: could have changed before locked. */
-		if (pool->avail) {
-			pool->avail--;
-			if (pool->avail < pool->low_mark)
-				pool->low_mark = pool->avail;
-			skb_core->skb_page = pool->pages[pool->avail];
-			spin_unlock_bh(&homa->page_pool_mutex);
-			goto success;
-		}
-		spin_unlock_bh(&homa->page_pool_mutex);
-	}
 
-	/* Step 3: can we allocate a new big page? */
+	/* Step 2: can we allocate a new big page? */
 	INC_METRIC(skb_page_allocs, 1);
 	start = sched_clock();
 	skb_core->skb_page = alloc_pages((GFP_KERNEL & ~__GFP_RECLAIM) | __GFP_COMP
@@ -291,7 +538,7 @@ bool homa_skb_page_alloc(struct homa *homa, struct homa_skb_core *skb_core)
 		goto success;
 	}
 
-	/* Step 4: can we allocate a normal page? */
+	/* Step 3: can we allocate a normal page? */
 	skb_core->skb_page = alloc_page(GFP_KERNEL);
 	INC_METRIC(skb_page_alloc_ns, sched_clock() - start);
 	if (likely(skb_core->skb_page)) {
@@ -363,6 +610,44 @@ int homa_skb_append_from_iter(struct homa *homa, struct sk_buff *skb,
 	return 0;
 }
 
+/**
+ * homa_skb_append_zerocopy() - Append data to an sk_buff without copying
+ * it: the user pages containing the data are pinned and attached to the
+ * sk_buff as frags. If the data is spread across too many pages, it is
+ * copied instead.
+ * @homa:       Overall data about the Homa protocol implementation.
+ * @skb:        Append to this sk_buff; must already be associated with a
+ *              zero-copy ubuf_info (see skb_zcopy_set).
+ * @iter:       Describes location of data to append; modified to reflect
+ *              the data that was appended.
+ * @length:     Number of bytes to append; iter must have at least this
+ *              many bytes.
+ * Return:      0 or a negative errno.
+ */
+int homa_skb_append_zerocopy(struct homa *homa, struct sk_buff *skb,
+			     struct iov_iter *iter, int length)
+{
+	int max_pages = DIV_ROUND_UP(length, PAGE_SIZE) + 1;
+	struct iov_iter chunk = *iter;
+	int err;
+
+	/* The caller computed packet geometry assuming that the data is
+	 * contiguous in user space; if it isn't (e.g. tiny iovecs), we
+	 * could run out of frags, so copy.
+	 */
+	iov_iter_truncate(&chunk, length);
+	if (iov_iter_npages(&chunk, max_pages + 1) > max_pages) {
+		uarg_to_msgzc(skb_zcopy(skb))->zerocopy = 0;
+		INC_METRIC(zerocopy_copied_bytes, length);
+		return homa_skb_append_from_iter(homa, skb, iter, length);
+	}
+	err = __zerocopy_sg_from_iter(NULL, NULL, skb, iter, length);
+	if (err)
+		return err;
+	INC_METRIC(zerocopy_bytes, length);
+	return 0;
+}
+
 /**
  * homa_skb_append_from_skb() - Copy data from one skb to another. The
  * data is appended into new frags at the destination. The copies are done
@@ -400,7 +685,13 @@ int homa_skb_append_from_skb(struct homa *homa, struct sk_buff *dst_skb,
 		length -= chunk_size;
 	}
 
-	/* Virtually copy bytes from source frags, if needed. */
+	/* Virtually copy bytes from source frags, if needed. If the source
+	 * refers to user pages (zero-copy), the destination must hold a
+	 * reference to the same ubuf_info so the application isn't notified
+	 * until both packets have been freed.
+	 */
+	if (skb_zcopy(src_skb))
+		skb_zcopy_set(dst_skb, skb_zcopy(src_skb), NULL);
 	src_frag_offset = head_len;
 	for (src_frags_left = src_shinfo->nr_frags, src_frag = &src_shinfo->frags[0];
 			(src_frags_left > 0) && (length > 0);
@@ -462,8 +753,9 @@ void homa_skb_free_many_tx(struct homa *homa, struct sk_buff **skbs, int count)
 		struct sk_buff *skb = skbs[i];
 
 		shinfo = skb_shinfo(skb);
-		if (refcount_read(&skb->users) != 1) {
-			/* This sk_buff is still in use somewhere, so can't
+		if (refcount_read(&skb->users) != 1 || skb_zcopy(skb)) {
+			/* This sk_buff is still in use somewhere, or some
+			 * of its frags refer to user pages, so can't
 			 * reclaim its pages.
 			 */
 			kfree_skb(skb);
@@ -488,7 +780,8 @@ void homa_skb_free_many_tx(struct homa *homa, struct sk_buff **skbs, int count)
 			}
 		}
 		shinfo->nr_frags = 0;
-		kfree_skb(skb);
+		if (!homa_skb_recycle(skb))
+			kfree_skb(skb);
 	}
 	if (num_pages > 0)
 		homa_skb_cache_pages(homa, pages_to_cache, num_pages);
@@ -497,35 +790,56 @@ void homa_skb_free_many_tx(struct homa *homa, struct sk_buff **skbs, int count)
 }
 
 /**
- * homa_skb_cache_pages() - Return pages to the global Homa cache of
- * pages for sk_buffs.
+ * homa_skb_cache_pages() - Return pages to the Homa caches of pages for
+ * sk_buffs. Pages belonging to this core's NUMA node go into the core's
+ * magazines; others are deposited directly in the pool for their node.
  * @homa:        Overall data about the Homa protocol implementation.
  * @pages:       Array of pages to cache.
  * @count:       Number of pages in @count.
  */
 void homa_skb_cache_pages(struct homa *homa, struct page **pages, int count)
 {
-#ifdef __UNIT_TEST__
-#define LIMIT 4
-#else
-#define LIMIT HOMA_PAGE_POOL_SIZE
-#endif
+	struct homa_page_pool *remote_pool = NULL;
+	struct homa_page_mag *remote_mag = NULL;
+	struct homa_skb_core *skb_core;
 	int i;
 
-	spin_lock_bh(&homa->page_pool_mutex);
+	local_bh_disable();
+	skb_core = &per_cpu(homa_skb_core, raw_smp_processor_id());
 	for (i = 0; i < count; i++) {
 		struct page *page = pages[i];
 		struct homa_page_pool *pool;
 
 		pool = homa->page_pools[page_to_nid(page)];
-		if (pool->avail < LIMIT) {
-			pool->pages[pool->avail] = page;
-			pool->avail++;
-		} else {
-			put_page(pages[i]);
+		if (pool == skb_core->pool) {
+			if (!homa_skb_core_put_page(skb_core, page)) {
+				INC_METRIC(skb_page_pool_overflows, 1);
+				put_page(page);
+			}
+			continue;
 		}
+
+		/* Page belongs to a different NUMA node: collect pages for
+		 * that node in a magazine borrowed from its pool.
+		 */
+		if (pool != remote_pool ||
+		    (remote_mag && remote_mag->count == HOMA_PAGE_MAG_SIZE)) {
+			if (remote_mag)
+				homa_skb_mag_deposit(remote_pool, remote_mag);
+			remote_pool = pool;
+			remote_mag = homa_skb_mag_take(pool->empty);
+		}
+		if (!remote_mag) {
+			INC_METRIC(skb_page_pool_overflows, 1);
+			put_page(page);
+			continue;
+		}
+		remote_mag->pages[remote_mag->count] = page;
+		remote_mag->count++;
 	}
-	spin_unlock_bh(&homa->page_pool_mutex);
+	if (remote_mag)
+		homa_skb_mag_deposit(remote_pool, remote_mag);
+	local_bh_enable();
 }
 
 /**
@@ -576,15 +890,15 @@ void homa_skb_get(struct sk_buff *skb, void *dest, int offset, int length)
 }
 
 /**
- * homa_skb_release_pages() - This function is invoked occasionally; it's
- * job is to gradually release pages from the sk_buff page pools back to
- * Linux, based on sysctl parameters such as skb_page_frees_per_sec.
+ * homa_skb_release_pages() - This function is invoked occasionally; its
+ * job is to size the sk_buff page pools to match recent demand: it
+ * gradually releases pages that have gone unused back to Linux, limited
+ * by sysctl parameters such as skb_page_frees_per_sec.
  * @homa:  Overall information about the Homa transport.
  */
 void homa_skb_release_pages(struct homa *homa)
 {
-	int i, max_low_mark, min_pages, release, release_max;
-	struct homa_page_pool *max_pool;
+	int i, j, min_pages, release_max, released;
 	__u64 now = sched_clock();
 
 	if (now < homa->skb_page_free_time)
@@ -593,53 +907,56 @@ void homa_skb_release_pages(struct homa *homa)
 	/* Free pages every 0.5 second. */
 	homa->skb_page_free_time = now + 500000000ULL;
 	release_max = homa->skb_page_frees_per_sec / 2;
-	if (homa->pages_to_free_slots < release_max) {
-		if (homa->skb_pages_to_free)
-			kfree(homa->skb_pages_to_free);
-		homa->skb_pages_to_free = kmalloc_array(release_max,
-							sizeof(struct page *),
-							GFP_KERNEL);
-		homa->pages_to_free_slots = release_max;
-	}
+	min_pages = ((homa->skb_page_pool_min_kb * 1000)
+			+ (HOMA_SKB_PAGE_SIZE - 1)) / HOMA_SKB_PAGE_SIZE;
+	released = 0;
 
-	/* Find the pool with the largest low-water mark. */
-	max_low_mark = -1;
-	spin_lock_bh(&homa->page_pool_mutex);
 	for (i = 0; i <= homa->max_numa; i++) {
 		struct homa_page_pool *pool = homa->page_pools[i];
+		int demand, excess, low_mark, target;
 
 		if (!pool)
 			continue;
-		if (pool->low_mark > max_low_mark) {
-			max_low_mark = pool->low_mark;
-			max_pool = pool;
-		}
-		tt_record3("NUMA node %d has %d pages in skb page pool, low mark %d",
-			   i, pool->avail, pool->low_mark);
-		pool->low_mark = pool->avail;
-	}
 
-	/* Collect pages to free (but don't free them until after
-	 * releasing the lock, since freeing is expensive).
-	 */
-	min_pages = ((homa->skb_page_pool_min_kb * 1000)
-			+ (HOMA_SKB_PAGE_SIZE - 1)) / HOMA_SKB_PAGE_SIZE;
-	release = max_low_mark - min_pages;
-	if (release > release_max)
-		release = release_max;
-	for (i = 0; i < release; i++) {
-		max_pool->avail--;
-		homa->skb_pages_to_free[i] = max_pool->pages[max_pool->avail];
-	}
-	max_pool->low_mark = max_pool->avail;
-	spin_unlock_bh(&homa->page_pool_mutex);
-
-	/* Free the pages that were collected. */
-	for (i = 0; i < release; i++) {
-		struct page *page = homa->skb_pages_to_free[i];
-
-		tt_record2("homa_skb_release_pages releasing page 0x%08x%08x",
-			   tt_hi(page), tt_lo(page));
-		put_page(page);
+		/* The target size for the pool tracks the peak demand over
+		 * recent intervals, decaying slowly so that occasional bursts
+		 * of large messages still find pages waiting for them.
+		 */
+		demand = atomic_xchg(&pool->demand, 0);
+		target = pool->target - pool->target / 8;
+		if (demand > target)
+			target = demand;
+		if (target < min_pages)
+			target = min_pages;
+		pool->target = target;
+
+		/* Only release pages that were never needed during the last
+		 * interval.
+		 */
+		low_mark = READ_ONCE(pool->low_mark);
+		if (low_mark > atomic_read(&pool->avail))
+			low_mark = atomic_read(&pool->avail);
+		tt_record4("NUMA node %d has %d pages in skb page pool, low mark %d, target %d",
+			   i, atomic_read(&pool->avail), low_mark, target);
+		excess = low_mark - target;
+		while (excess >= HOMA_PAGE_MAG_SIZE && released < release_max) {
+			struct homa_page_mag *mag;
+
+			mag = homa_skb_mag_take(pool->full);
+			if (!mag)
+				break;
+			atomic_sub(mag->count, &pool->avail);
+			for (j = 0; j < mag->count; j++) {
+				tt_record2("homa_skb_release_pages releasing page 0x%08x%08x",
+					   tt_hi(mag->pages[j]),
+					   tt_lo(mag->pages[j]));
+				put_page(mag->pages[j]);
+			}
+			excess -= mag->count;
+			released += mag->count;
+			mag->count = 0;
+			homa_skb_mag_deposit(pool, mag);
+		}
+		WRITE_ONCE(pool->low_mark, atomic_read(&pool->avail));
 	}
 }
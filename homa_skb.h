@@ -22,28 +22,98 @@
 #define HOMA_SKB_PAGE_SIZE (PAGE_SIZE << HOMA_SKB_PAGE_ORDER)
 
 /**
- * struct homa_page_pool - A cache of free pages available for use in tx skbs.
- * Each page is of size HOMA_SKB_PAGE_SIZE, and a pool is dedicated for
- * use by a single NUMA node. Access to these objects is synchronized with
- * @homa->page_pool_mutex.
+ * define HOMA_SKB_CACHE_SIZE: maximum number of recycled tx sk_buffs
+ * that will be retained in a single core's cache.
+ */
+#define HOMA_SKB_CACHE_SIZE 64
+
+/**
+ * define HOMA_SKB_TX_SIZE: number of bytes to allocate for the linear
+ * part of every tx sk_buff that is eligible for caching (all Homa headers,
+ * plus space for IP and Ethernet headers and the homa_skb_info). Using a
+ * single size means that any cached sk_buff can be used for any request.
+ */
+#define HOMA_SKB_TX_SIZE (HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH + \
+		sizeof(struct homa_skb_info) + HOMA_MAX_HEADER)
+
+/**
+ * define HOMA_PAGE_MAG_SIZE: number of pages that fit in a struct
+ * homa_page_mag. Each core holds at most two magazines, so this also
+ * limits the number of free pages that can be stranded on an idle core.
+ */
+#ifdef __UNIT_TEST__
+#define HOMA_PAGE_MAG_SIZE 4
+#else
+#define HOMA_PAGE_MAG_SIZE 8
+#endif
+
+/**
+ * struct homa_page_mag - A "magazine" of free pages for use in tx skbs.
+ * Magazines move as a unit between cores and the page pool for their NUMA
+ * node, so a core only needs to touch shared state once for every
+ * HOMA_PAGE_MAG_SIZE pages it allocates or frees. A magazine is owned
+ * either by a single core or by a single slot in a homa_page_pool, so
+ * its contents never need synchronization.
+ */
+struct homa_page_mag {
+	/** @count: Number of valid entries in @pages. */
+	int count;
+
+	/**
+	 * @pages: Pointers to pages that are currently free; each page
+	 * is HOMA_SKB_PAGE_SIZE bytes and its ref count is 1.
+	 */
+	struct page *pages[HOMA_PAGE_MAG_SIZE];
+};
+
+/**
+ * struct homa_page_pool - A cache (or "depot") of magazines of free pages
+ * available for use in tx skbs. A pool is dedicated for use by a single
+ * NUMA node. Pools are accessed without locks: a magazine is claimed by
+ * xchg-ing NULL into its slot and deposited by cmpxchg-ing it into a NULL
+ * slot. The number of magazines in a pool (@full plus @empty) never exceeds
+ * HOMA_PAGE_POOL_MAGS, so a free slot can always be found.
  */
 struct homa_page_pool {
-	/** @avail: Number of free pages currently in the pool. */
-	int avail;
+#ifdef __UNIT_TEST__
+#define HOMA_PAGE_POOL_MAGS 4
+#else
+#define HOMA_PAGE_POOL_MAGS 128
+#endif
+
+	/**
+	 * @full: Magazines containing at least one free page. NULL entries
+	 * are unused slots.
+	 */
+	struct homa_page_mag *full[HOMA_PAGE_POOL_MAGS];
+
+	/**
+	 * @empty: Magazines with no pages, available to cores that need
+	 * to deposit a full magazine. NULL entries are unused slots.
+	 */
+	struct homa_page_mag *empty[HOMA_PAGE_POOL_MAGS];
+
+	/** @avail: Total number of free pages in all of @full. */
+	atomic_t avail;
+
+	/**
+	 * @demand: Number of pages that cores have taken from this pool
+	 * since the last call to homa_skb_release_pages.
+	 */
+	atomic_t demand;
 
 	/**
 	 * @low_mark: Low water mark: smallest value of avail since the
-	 * last time homa_skb_release_pages reset it.
+	 * last time homa_skb_release_pages reset it. Updated without
+	 * synchronization, so it is only approximate.
 	 */
 	int low_mark;
 
-#define HOMA_PAGE_POOL_SIZE 1000
-
 	/**
-	 * @pages: Pointers to pages that are currently free; the ref count
-	 * is 1 in each of these pages.
+	 * @target: Number of free pages this pool should retain, based
+	 * on recent demand. Computed by homa_skb_release_pages.
 	 */
-	struct page *pages[HOMA_PAGE_POOL_SIZE];
+	int target;
 };
 
 /**
@@ -81,18 +151,34 @@ struct homa_skb_core {
 #define HOMA_MAX_STASHED(size) ((((size) - 1) / HOMA_SKB_PAGE_SIZE) + 1)
 
 	/**
-	 * @num_stashed_pages: number of pages currently available in
-	 * stashed_pages.
+	 * @mag: Magazine from which this core allocates skb pages and to
+	 * which it returns freed pages. Accessed only on this core, with
+	 * BHs disabled. Never NULL after homa_skb_init.
+	 */
+	struct homa_page_mag *mag;
+
+	/**
+	 * @spare_mag: A second magazine, which is swapped with @mag when
+	 * @mag becomes empty or full; this keeps a core that alternates
+	 * between allocating and freeing pages near a magazine boundary from
+	 * bouncing magazines to and from @pool. Same synchronization as @mag.
+	 */
+	struct homa_page_mag *spare_mag;
+
+	/**
+	 * @num_cached_skbs: number of sk_buffs currently available in
+	 * @cached_skbs.
 	 */
-	int num_stashed_pages;
+	int num_cached_skbs;
 
 	/**
-	 * @stashed_pages: use to prefetch from the cache all of the pages a
-	 * message will need with a single operation, to avoid having to
-	 * synchronize separately for each page. Note: these pages are all
-	 * HOMA_SKB_PAGE_SIZE in length.
+	 * @cached_skbs: tx sk_buffs that have been freed and reset by
+	 * homa_skb_recycle, so they can be reused by homa_skb_new_tx
+	 * without going through the Linux allocator. Each has
+	 * HOMA_SKB_TX_SIZE bytes of linear space, no frags, and a reference
+	 * count of 1. Accessed only on this core, with BHs disabled.
 	 */
-	struct page *stashed_pages[HOMA_MAX_STASHED(HOMA_MAX_MESSAGE_LENGTH)];
+	struct sk_buff *cached_skbs[HOMA_SKB_CACHE_SIZE];
 };
 DECLARE_PER_CPU(struct homa_skb_core, homa_skb_core);
 
@@ -105,6 +191,8 @@ int      homa_skb_append_from_skb(struct homa *homa,
 				  int length);
 int      homa_skb_append_to_frag(struct homa *homa, struct sk_buff *skb,
 				 void *buf, int length);
+int      homa_skb_append_zerocopy(struct homa *homa, struct sk_buff *skb,
+				  struct iov_iter *iter, int length);
 void     homa_skb_cache_pages(struct homa *homa, struct page **pages,
 			      int count);
 void     homa_skb_cleanup(struct homa *homa);
@@ -119,6 +207,7 @@ int      homa_skb_init(struct homa *homa);
 struct sk_buff *homa_skb_new_tx(int length);
 bool     homa_skb_page_alloc(struct homa *homa,
 			     struct homa_skb_core *core);
+bool     homa_skb_recycle(struct sk_buff *skb);
 void     homa_skb_release_pages(struct homa *homa);
 void     homa_skb_stash_pages(struct homa *homa, int length);
 
@@ -162,14 +162,21 @@ int homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->remote_host.in4.sin_port = htons(0);
 	hlist_add_head_rcu(&hsk->socktab_links.hash_links,
 			   &socktab->buckets[homa_port_hash(hsk->port)]);
-	INIT_LIST_HEAD(&hsk->active_rpcs);
-	INIT_LIST_HEAD(&hsk->dead_rpcs);
-	hsk->dead_skbs = 0;
+	homa_sock_init_shards(hsk);
 	INIT_LIST_HEAD(&hsk->waiting_for_bufs);
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
 	INIT_LIST_HEAD(&hsk->request_interests);
 	INIT_LIST_HEAD(&hsk->response_interests);
+	hsk->last_handoff_ns = 0;
+	hsk->avg_handoff_gap_ns = 0;
+	hsk->group = NULL;
+	hsk->group_cookie = 0;
+	hsk->group_members = 0;
+	INIT_LIST_HEAD(&hsk->members);
+	INIT_LIST_HEAD(&hsk->member_links);
+	hsk->pool_group = NULL;
+	hsk->inline_max = 0;
 	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
 		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
 
@@ -187,12 +194,34 @@ int homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	hsk->buffer_pool = kzalloc(sizeof(*hsk->buffer_pool), GFP_KERNEL);
 	if (!hsk->buffer_pool)
 		result = -ENOMEM;
+	hsk->pool_refs = 1;
 	if (homa->hijack_tcp)
 		hsk->sock.sk_protocol = IPPROTO_TCP;
 	spin_unlock_bh(&socktab->write_lock);
 	return result;
 }
 
+/**
+ * homa_sock_init_shards() - Initialize the shards holding a socket's
+ * active and dead RPCs (there must not be any RPCs for the socket yet).
+ * @hsk:    Socket whose shards should be initialized.
+ */
+void homa_sock_init_shards(struct homa_sock *hsk)
+{
+	int i;
+
+	for (i = 0; i < HOMA_RPC_SHARDS; i++) {
+		struct homa_rpc_shard *shard = &hsk->rpc_shards[i];
+
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->active_rpcs);
+		INIT_LIST_HEAD(&shard->dead_rpcs);
+	}
+	atomic_set(&hsk->dead_skbs, 0);
+	INIT_WORK(&hsk->reap_work, homa_rpc_reap_work);
+	memset(&hsk->conn_stats, 0, sizeof(hsk->conn_stats));
+}
+
 /*
  * homa_sock_unlink() - Unlinks a socket from its socktab and does
  * related cleanups. Once this method returns, the socket will not be
@@ -217,6 +246,31 @@ void homa_sock_unlink(struct homa_sock *hsk)
 	spin_unlock_bh(&socktab->write_lock);
 }
 
+/**
+ * homa_sock_put_pool() - Release one of the references to a socket's
+ * buffer pool (see @pool_refs in struct homa_sock); if this is the last
+ * reference, the pool is destroyed.
+ * @hsk:       Socket that owns the pool.
+ */
+static void homa_sock_put_pool(struct homa_sock *hsk)
+	__acquires(&hsk->lock)
+	__releases(&hsk->lock)
+{
+	struct homa_pool *pool = NULL;
+
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+	hsk->pool_refs--;
+	if (hsk->pool_refs == 0) {
+		pool = hsk->buffer_pool;
+		hsk->buffer_pool = NULL;
+	}
+	homa_sock_unlock(hsk);
+	if (pool) {
+		homa_pool_destroy(pool);
+		kfree(pool);
+	}
+}
+
 /**
  * homa_sock_shutdown() - Disable a socket so that it can no longer
  * be used for either sending or receiving messages. Any system calls
@@ -227,13 +281,15 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	__acquires(&hsk->lock)
 	__releases(&hsk->lock)
 {
+	struct homa_rpc_shard *shard;
 	struct homa_interest *interest;
+	struct homa_sock *member;
 	struct homa_rpc *rpc;
 #ifndef __STRIP__ /* See strip.py */
 	int i = 0;
 #endif /* See strip.py */
 
-	homa_sock_lock(hsk, "homa_socket_shutdown");
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
 	if (hsk->shutdown) {
 		homa_sock_unlock(hsk);
 		return;
@@ -245,32 +301,63 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 	 *    this socket (though some creations might already be in progress).
 	 * 2. Remove the socket from its socktab: this ensures that
 	 *    incoming packets for the socket will be dropped.
-	 * 3. Go through all of the RPCs and delete them; this will
+	 * 3. Acquire and release each of the shard locks. RPC creation
+	 *    checks @shutdown while holding a shard lock, so once this step
+	 *    completes no new RPCs can appear in the shards.
+	 * 4. Go through all of the RPCs and delete them; this will
 	 *    synchronize with any operations in progress.
-	 * 4. Perform other socket cleanup: at this point we know that
+	 * 5. Perform other socket cleanup: at this point we know that
 	 *    there will be no concurrent activities on individual RPCs.
-	 * 5. Don't delete the buffer pool until after all of the RPCs
-	 *    have been reaped.
+	 * 6. Don't delete the buffer pool until after all of the RPCs
+	 *    have been reaped. If members of this socket's group are still
+	 *    using the pool, the last of them to be destroyed deletes it.
 	 * See sync.txt for additional information about locking.
 	 */
-	hsk->shutdown = true;
+	WRITE_ONCE(hsk->shutdown, true);
 	homa_sock_unlink(hsk);
 	homa_sock_unlock(hsk);
 
-	list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+	for (shard = &hsk->rpc_shards[0];
+	     shard < &hsk->rpc_shards[HOMA_RPC_SHARDS]; shard++) {
+		homa_rpc_shard_lock(shard);
+		homa_rpc_shard_unlock(shard);
+	}
+
+	homa_for_each_active_rpc(rpc, shard, hsk) {
 		homa_rpc_lock(rpc, "homa_sock_shutdown");
 		homa_rpc_free(rpc);
 		homa_rpc_unlock(rpc);
 	}
 
-	homa_sock_lock(hsk, "homa_socket_shutdown #2");
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
 	list_for_each_entry(interest, &hsk->request_interests, request_links)
 		wake_up_process(interest->thread);
 	list_for_each_entry(interest, &hsk->response_interests, response_links)
 		wake_up_process(interest->thread);
 	homa_sock_unlock(hsk);
+	homa_sock_leave_group(hsk);
+
+	/* If this socket is a group, remove its members; their messages
+	 * that are waiting here move back to the members' own queues. The
+	 * socket lock must be released before removing each member (lock
+	 * order is member, then group); no new members can join once
+	 * @shutdown is set.
+	 */
+	while (1) {
+		homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+		member = list_first_entry_or_null(&hsk->members,
+						  struct homa_sock,
+						  member_links);
+		if (member)
+			sock_hold(&member->sock);
+		homa_sock_unlock(hsk);
+		if (!member)
+			break;
+		homa_sock_leave_group(member);
+		sock_put(&member->sock);
+	}
 
-	while (!list_empty(&hsk->dead_rpcs)) {
+	while (homa_sock_has_dead_rpcs(hsk)) {
 		homa_rpc_reap(hsk, 1000);
 #ifndef __STRIP__ /* See strip.py */
 		i++;
@@ -280,11 +367,13 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 		}
 #endif /* See strip.py */
 	}
+	cancel_work_sync(&hsk->reap_work);
 
-	if (hsk->buffer_pool) {
-		homa_pool_destroy(hsk->buffer_pool);
-		kfree(hsk->buffer_pool);
-		hsk->buffer_pool = NULL;
+	homa_sock_put_pool(hsk);
+	if (hsk->pool_group) {
+		homa_sock_put_pool(hsk->pool_group);
+		sock_put(&hsk->pool_group->sock);
+		hsk->pool_group = NULL;
 	}
 }
 
@@ -320,7 +409,7 @@ int homa_sock_bind(struct homa_socktab *socktab, struct homa_sock *hsk,
 		return result;
 	if (port >= HOMA_MIN_DEFAULT_PORT)
 		return -EINVAL;
-	homa_sock_lock(hsk, "homa_sock_bind");
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
 	spin_lock_bh(&socktab->write_lock);
 	if (hsk->shutdown) {
 		result = -ESHUTDOWN;
@@ -434,23 +523,275 @@ struct homa_sock *homa_sock_find_connected(struct homa_socktab *socktab, struct
 	return result ? result : listen;
 }
 
+/**
+ * homa_sock_join_group() - Make a socket a member of a socket group, so
+ * that its incoming messages are received with recvmsg on the group
+ * socket. This allows a single thread (or pool of threads) to wait for
+ * messages on any of a large number of connected sockets.
+ * @hsk:     Socket to add to the group; must be connected, must not
+ *           already be in a group, and must not have a buffer region of
+ *           its own (from now on it uses @group's buffer pool).
+ * @group:   Unconnected socket whose waiting threads and ready queues
+ *           will be used for @hsk. The caller must hold a reference to
+ *           @group->sock; if this function succeeds, the reference is
+ *           transferred to @hsk.
+ * @cookie:  Returned as the completion cookie by recvmsg on @group for
+ *           requests that arrived on @hsk.
+ * Return:   0 for success, otherwise a negative errno.
+ */
+int homa_sock_join_group(struct homa_sock *hsk, struct homa_sock *group,
+			 __u64 cookie)
+{
+	int result = 0;
+
+	if (group == hsk)
+		return -EINVAL;
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+	if (hsk->shutdown) {
+		result = -ESHUTDOWN;
+		goto unlock_hsk;
+	}
+	if (!hsk->connect) {
+		result = -ENOTCONN;
+		goto unlock_hsk;
+	}
+	if (hsk->group) {
+		result = -EBUSY;
+		goto unlock_hsk;
+	}
+
+	/* Members use the group's buffer pool, so that bpage_offsets
+	 * returned by recvmsg on either socket refer to the same region
+	 * (and buffers can be returned on either). This requires that the
+	 * socket has no buffer region of its own (there could be buffers
+	 * from it that the application hasn't returned yet), and once a
+	 * socket has used a group's pool it can't switch to another one.
+	 */
+	if (hsk->buffer_pool->region ||
+	    (hsk->pool_group && hsk->pool_group != group)) {
+		result = -EINVAL;
+		goto unlock_hsk;
+	}
+
+	/* Groups can't be nested: only unconnected sockets can be groups
+	 * and only connected sockets can be members. This also guarantees
+	 * that member sockets are always locked before group sockets.
+	 */
+	homa_sock_lock(group, HOMA_LOCK_CONTROL);
+	if (group->shutdown) {
+		result = -ESHUTDOWN;
+		goto unlock_group;
+	}
+	if (group->connect) {
+		result = -EINVAL;
+		goto unlock_group;
+	}
+	hsk->group = group;
+	hsk->group_cookie = cookie;
+	group->group_members++;
+	list_add_tail(&hsk->member_links, &group->members);
+	if (!hsk->pool_group) {
+		sock_hold(&group->sock);
+		group->pool_refs++;
+		WRITE_ONCE(hsk->pool_group, group);
+	}
+
+	/* Messages that are already waiting move to the group. */
+	if (!list_empty(&hsk->ready_requests) ||
+	    !list_empty(&hsk->ready_responses)) {
+		list_splice_tail_init(&hsk->ready_requests,
+				      &group->ready_requests);
+		list_splice_tail_init(&hsk->ready_responses,
+				      &group->ready_responses);
+		group->sock.sk_data_ready(&group->sock);
+	}
+
+unlock_group:
+	homa_sock_unlock(group);
+unlock_hsk:
+	homa_sock_unlock(hsk);
+	return result;
+}
+
+/**
+ * homa_sock_leave_group() - Remove a socket from its socket group (if
+ * any), so that its messages are once again received with recvmsg on
+ * the socket itself.
+ * @hsk:     Socket to remove from its group.
+ */
+void homa_sock_leave_group(struct homa_sock *hsk)
+{
+	struct homa_rpc *rpc, *tmp;
+	struct homa_sock *group;
+
+	homa_sock_lock(hsk, HOMA_LOCK_CONTROL);
+	group = hsk->group;
+	if (!group) {
+		homa_sock_unlock(hsk);
+		return;
+	}
+
+	/* Reclaim this socket's messages that are waiting in the group. */
+	homa_sock_lock(group, HOMA_LOCK_CONTROL);
+	list_for_each_entry_safe(rpc, tmp, &group->ready_requests, ready_links) {
+		if (rpc->hsk == hsk)
+			list_move_tail(&rpc->ready_links, &hsk->ready_requests);
+	}
+	list_for_each_entry_safe(rpc, tmp, &group->ready_responses,
+				 ready_links) {
+		if (rpc->hsk == hsk)
+			list_move_tail(&rpc->ready_links, &hsk->ready_responses);
+	}
+	hsk->group = NULL;
+	group->group_members--;
+	list_del_init(&hsk->member_links);
+	homa_sock_unlock(group);
+	if (!list_empty(&hsk->ready_requests) ||
+	    !list_empty(&hsk->ready_responses))
+		hsk->sock.sk_data_ready(&hsk->sock);
+	homa_sock_unlock(hsk);
+	sock_put(&group->sock);
+}
+
+/**
+ * homa_sock_rtt_sample() - Incorporate a new round-trip measurement into
+ * a connected socket's smoothed RTT estimate.
+ * @hsk:     Socket whose estimate should be updated; must be connected.
+ * @sample:  Time between sending a request and receiving the first
+ *           packet of its response, in ns.
+ */
+void homa_sock_rtt_sample(struct homa_sock *hsk, __u64 sample)
+{
+	__s64 srtt = atomic64_read(&hsk->conn_stats.srtt_ns);
+
+	/* Same weighting as TCP's srtt (1/8 for the new sample). Concurrent
+	 * updates may occasionally lose a sample; that's harmless for an
+	 * average, and cheaper than a lock.
+	 */
+	if (srtt == 0)
+		srtt = sample;
+	else
+		srtt += ((__s64)sample - srtt) / 8;
+	atomic64_set(&hsk->conn_stats.srtt_ns, srtt);
+}
+
+/**
+ * homa_sock_get_conn_stats() - Return a snapshot of a socket's
+ * per-connection statistics.
+ * @hsk:     Socket whose statistics are desired.
+ * @stats:   The statistics are stored here.
+ */
+void homa_sock_get_conn_stats(struct homa_sock *hsk,
+			      struct homa_conn_stats *stats)
+{
+	struct homa_conn_counters *c = &hsk->conn_stats;
+
+	stats->requests_sent = atomic64_read(&c->requests_sent);
+	stats->responses_sent = atomic64_read(&c->responses_sent);
+	stats->requests_received = atomic64_read(&c->requests_received);
+	stats->responses_received = atomic64_read(&c->responses_received);
+	stats->bytes_sent = atomic64_read(&c->bytes_sent);
+	stats->bytes_received = atomic64_read(&c->bytes_received);
+	stats->resends_sent = atomic64_read(&c->resends_sent);
+	stats->retransmits = atomic64_read(&c->retransmits);
+	stats->timeouts = atomic64_read(&c->timeouts);
+	stats->pool_wait_ns = atomic64_read(&c->pool_wait_ns);
+	stats->grant_wait_ns = atomic64_read(&c->grant_wait_ns);
+	stats->srtt_ns = atomic64_read(&c->srtt_ns);
+}
+
+/**
+ * homa_sock_conns_show() - Generates the contents of /proc/net/homa_conns,
+ * which contains one line of statistics for each connected Homa socket.
+ * @s:       Output is generated here; s->private refers to the
+ *           struct homa.
+ * @v:       Not used.
+ *
+ * Return:   Always 0.
+ */
+int homa_sock_conns_show(struct seq_file *s, void *v)
+{
+	struct homa *homa = s->private;
+	struct homa_socktab_scan scan;
+	struct homa_conn_stats stats;
+	struct in6_addr remote;
+	struct homa_sock *hsk;
+
+	seq_printf(s, "%5s %-40s %5s %10s %10s %10s %10s %14s %14s %8s %8s %8s %14s %14s %10s\n",
+		   "port", "remote", "rport", "req_sent", "resp_sent",
+		   "req_rcvd", "resp_rcvd", "bytes_sent", "bytes_rcvd",
+		   "resends", "retrans", "timeouts", "pool_wait_ns",
+		   "grant_wait_ns", "srtt_ns");
+	rcu_read_lock();
+	for (hsk = homa_socktab_start_scan(homa->port_map, &scan); hsk;
+	     hsk = homa_socktab_next(&scan)) {
+		if (!hsk->connect || hsk->shutdown)
+			continue;
+		homa_sock_get_conn_stats(hsk, &stats);
+		remote = canonical_ipv6_addr(&hsk->remote_host);
+		seq_printf(s, "%5u %-40s %5u %10llu %10llu %10llu %10llu %14llu %14llu %8llu %8llu %8llu %14llu %14llu %10llu\n",
+			   hsk->port, homa_print_ipv6_addr(&remote),
+			   ntohs(hsk->remote_host.in6.sin6_port),
+			   stats.requests_sent, stats.responses_sent,
+			   stats.requests_received, stats.responses_received,
+			   stats.bytes_sent, stats.bytes_received,
+			   stats.resends_sent, stats.retransmits,
+			   stats.timeouts, stats.pool_wait_ns,
+			   stats.grant_wait_ns, stats.srtt_ns);
+	}
+	homa_socktab_end_scan(&scan);
+	rcu_read_unlock();
+	return 0;
+}
+
 /**
  * homa_sock_lock_slow() - This function implements the slow path for
- * acquiring a socketC lock. It is invoked when a socket lock isn't immediately
+ * acquiring a socket lock. It is invoked when a socket lock isn't immediately
  * available. It waits for the lock, but also records statistics about
  * the waiting time.
  * @hsk:    socket to  lock.
+ * @op:     Kind of operation that is acquiring the lock.
  */
-void homa_sock_lock_slow(struct homa_sock *hsk)
+void homa_sock_lock_slow(struct homa_sock *hsk, enum homa_lock_op op)
 	__acquires(&hsk->lock)
 {
+	unsigned long holder = homa_lockprof_holder(&hsk->lock);
 	__u64 start = sched_clock();
+	__u64 wait;
 
-	tt_record("beginning wait for socket lock");
+	tt_record1("beginning wait for socket lock, op %d", op);
 	spin_lock_bh(&hsk->lock);
 	tt_record("ending wait for socket lock");
+	wait = sched_clock() - start;
 	INC_METRIC(socket_lock_misses, 1);
-	INC_METRIC(socket_lock_miss_ns, sched_clock() - start);
+	INC_METRIC(socket_lock_miss_ns, wait);
+	INC_METRIC(socket_lock_op_ns[op], wait);
+	homa_lockprof_wait(HOMA_LOCK_CLASS_SOCKET, &hsk->lock, _RET_IP_,
+			   holder, wait);
+}
+
+/**
+ * homa_rpc_shard_lock_slow() - This function implements the slow path for
+ * acquiring the lock for a shard of a socket's RPC lists. It is invoked
+ * when the lock isn't immediately available. It waits for the lock, but
+ * also records statistics about the waiting time.
+ * @shard:    Shard to lock.
+ */
+void homa_rpc_shard_lock_slow(struct homa_rpc_shard *shard)
+	__acquires(&shard->lock)
+{
+	unsigned long holder = homa_lockprof_holder(&shard->lock);
+	__u64 start = sched_clock();
+	__u64 wait;
+
+	tt_record("beginning wait for RPC shard lock");
+	spin_lock_bh(&shard->lock);
+	tt_record("ending wait for RPC shard lock");
+	wait = sched_clock() - start;
+	INC_METRIC(shard_lock_misses, 1);
+	INC_METRIC(shard_lock_miss_ns, wait);
+	homa_lockprof_wait(HOMA_LOCK_CLASS_SHARD, &shard->lock, _RET_IP_,
+			   holder, wait);
 }
 
 /**
@@ -465,18 +806,23 @@ void homa_sock_lock_slow(struct homa_sock *hsk)
 void homa_bucket_lock_slow(struct homa_rpc_bucket *bucket, __u64 id)
 	__acquires(&bucket->lock)
 {
+	unsigned long holder = homa_lockprof_holder(&bucket->lock);
 	__u64 start = sched_clock();
+	__u64 wait;
 
-	tt_record2("beginning wait for rpc lock, id %d (bucket %d)",
-		   id, bucket->id);
+	tt_rpc_record2(id, "beginning wait for rpc lock, id %d (bucket %d)",
+		       id, bucket->id);
 	spin_lock_bh(&bucket->lock);
-	tt_record2("ending wait for bucket lock, id %d (bucket %d)",
-		   id, bucket->id);
+	tt_rpc_record2(id, "ending wait for bucket lock, id %d (bucket %d)",
+		       id, bucket->id);
+	wait = sched_clock() - start;
 	if (homa_is_client(id)) {
 		INC_METRIC(client_lock_misses, 1);
-		INC_METRIC(client_lock_miss_ns, sched_clock() - start);
+		INC_METRIC(client_lock_miss_ns, wait);
 	} else {
 		INC_METRIC(server_lock_misses, 1);
-		INC_METRIC(server_lock_miss_ns, sched_clock() - start);
+		INC_METRIC(server_lock_miss_ns, wait);
 	}
+	homa_lockprof_wait(HOMA_LOCK_CLASS_BUCKET, &bucket->lock, _RET_IP_,
+			   holder, wait);
 }
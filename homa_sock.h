@@ -8,8 +8,10 @@
 /* Forward declarations. */
 struct homa;
 struct homa_pool;
+struct homa_rpc_shard;
 
-void     homa_sock_lock_slow(struct homa_sock *hsk);
+void     homa_rpc_shard_lock_slow(struct homa_rpc_shard *shard);
+void     homa_sock_lock_slow(struct homa_sock *hsk, enum homa_lock_op op);
 
 /**
  * define HOMA_SOCKTAB_BUCKETS - Number of hash buckets in a homa_socktab.
@@ -124,6 +126,76 @@ struct homa_rpc_bucket {
  */
 #define HOMA_SERVER_RPC_BUCKETS 1024
 
+/**
+ * define HOMA_RPC_SHARDS - Number of shards in the lists of active and
+ * dead RPCs for a socket. Must be a power of 2.
+ */
+#define HOMA_RPC_SHARDS 16
+
+/**
+ * struct homa_rpc_shard - Holds a subset of the RPCs for a socket. A new
+ * RPC is added to the shard for the core on which it was created, so
+ * threads creating and freeing RPCs on different cores don't contend
+ * for a single lock. See sync.txt for more on how shards are used.
+ */
+struct homa_rpc_shard {
+	/**
+	 * @lock: Must be held when modifying @active_rpcs or @dead_rpcs
+	 * (and when reading @dead_rpcs). Also used to synchronize RPC
+	 * creation with socket shutdown.
+	 */
+	spinlock_t lock;
+
+	/**
+	 * @active_rpcs: List of existing RPCs in this shard, including
+	 * both client and server RPCs. This list isn't strictly
+	 * needed, since RPCs are already in one of the hash tables of
+	 * the socket, but it's more efficient for homa_timer to have this
+	 * list (so it doesn't have to scan large numbers of hash buckets).
+	 * Within this shard the list is sorted, with the oldest RPC first
+	 * (there is no ordering across shards). Manipulate with RCU so
+	 * timer can access without locking.
+	 */
+	struct list_head active_rpcs;
+
+	/**
+	 * @dead_rpcs: Contains RPCs from this shard for which homa_rpc_free
+	 * has been called, but their packet buffers haven't yet been freed.
+	 */
+	struct list_head dead_rpcs;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * struct homa_conn_counters - Statistics kept for a connected socket; see
+ * struct homa_conn_stats in homa.h for the meaning of each field. The
+ * counters are atomic because a socket's RPCs are processed concurrently
+ * on different cores.
+ */
+struct homa_conn_counters {
+	atomic64_t requests_sent;
+	atomic64_t responses_sent;
+	atomic64_t requests_received;
+	atomic64_t responses_received;
+	atomic64_t bytes_sent;
+	atomic64_t bytes_received;
+	atomic64_t resends_sent;
+	atomic64_t retransmits;
+	atomic64_t timeouts;
+	atomic64_t pool_wait_ns;
+	atomic64_t grant_wait_ns;
+	atomic64_t srtt_ns;
+};
+
+/**
+ * INC_CONN_STAT() - Add @count to the statistic named @stat for @hsk,
+ * if @hsk is connected (statistics aren't kept for unconnected sockets,
+ * whose RPCs involve many different peers).
+ */
+#define INC_CONN_STAT(hsk, stat, count) do {				\
+	if ((hsk)->connect)						\
+		atomic64_add(count, &(hsk)->conn_stats.stat);		\
+} while (0)
+
 /**
  * struct homa_sock - Information about an open socket.
  */
@@ -145,7 +217,7 @@ struct homa_sock {
 
 	/**
 	 * @lock: Must be held when modifying fields such as interests
-	 * and lists of RPCs. This lock is used in place of sk->sk_lock
+	 * and lists of ready RPCs. This lock is used in place of sk->sk_lock
 	 * because it's used differently (it's always used as a simple
 	 * spin lock).  See sync.txt for more on Homa's synchronization
 	 * strategy.
@@ -171,7 +243,12 @@ struct homa_sock {
 	 */
 	struct homa *homa;
 
-	/** @shutdown: True means the socket is no longer usable. */
+	/**
+	 * @shutdown: True means the socket is no longer usable. Set while
+	 * holding @lock, but read without it (with READ_ONCE) on fast paths;
+	 * RPC creation checks it under a shard lock, and homa_sock_shutdown
+	 * drains the shard locks after setting it.
+	 */
 	bool shutdown;
 
 	/**
@@ -193,24 +270,20 @@ struct homa_sock {
 	struct homa_socktab_links socktab_links;
 
 	/**
-	 * @active_rpcs: List of all existing RPCs related to this socket,
-	 * including both client and server RPCs. This list isn't strictly
-	 * needed, since RPCs are already in one of the hash tables below,
-	 * but it's more efficient for homa_timer to have this list
-	 * (so it doesn't have to scan large numbers of hash buckets).
-	 * The list is sorted, with the oldest RPC first. Manipulate with
-	 * RCU so timer can access without locking.
+	 * @rpc_shards: Lists of active and dead RPCs for this socket,
+	 * divided into shards to reduce lock contention. Use
+	 * homa_for_each_active_rpc to scan all of the active RPCs.
 	 */
-	struct list_head active_rpcs;
+	struct homa_rpc_shard rpc_shards[HOMA_RPC_SHARDS];
+
+	/** @dead_skbs: Total number of socket buffers in dead RPCs. */
+	atomic_t dead_skbs;
 
 	/**
-	 * @dead_rpcs: Contains RPCs for which homa_rpc_free has been
-	 * called, but their packet buffers haven't yet been freed.
+	 * @reap_work: Used to schedule homa_rpc_reap_work, which reaps
+	 * dead RPCs in a helper worker when homa->reap_workers is set.
 	 */
-	struct list_head dead_rpcs;
-
-	/** @dead_skbs: Total number of socket buffers in RPCs on dead_rpcs. */
-	int dead_skbs;
+	struct work_struct reap_work;
 
 	/**
 	 * @waiting_for_bufs: Contains RPCs that are blocked because there
@@ -245,6 +318,19 @@ struct homa_sock {
 	 */
 	struct list_head response_interests;
 
+	/**
+	 * @last_handoff_ns: sched_clock() time of the most recent call to
+	 * homa_rpc_handoff for this socket. Protected by @lock.
+	 */
+	__u64 last_handoff_ns;
+
+	/**
+	 * @avg_handoff_gap_ns: Exponentially weighted average of the
+	 * interval between recent handoffs for this socket; used for
+	 * adaptive polling. Updated under @lock but read without it.
+	 */
+	__u64 avg_handoff_gap_ns;
+
 	/**
 	 * @client_rpc_buckets: Hash table for fast lookup of client RPCs.
 	 * Modifications are synchronized with bucket locks, not
@@ -261,10 +347,18 @@ struct homa_sock {
 
 	/**
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
-	 * Storage is dynamically allocated.
+	 * Storage is dynamically allocated. Not used once the socket has
+	 * joined a group (see @pool_group and homa_sock_pool).
 	 */
 	struct homa_pool *buffer_pool;
 
+	/**
+	 * @pool_refs: Number of sockets using @buffer_pool: this socket plus
+	 * any sockets whose @pool_group refers to it. The pool is destroyed
+	 * when this drops to zero. Protected by @lock.
+	 */
+	int pool_refs;
+
 	/**
 	 * @remote_host: information about the remote host, only used under the connected semantics.
 	 * For client this is set after calling connect(), and for server this is set for the branched-off socket after calling homa_peeloff()
@@ -274,6 +368,65 @@ struct homa_sock {
 
 	/** @connect: True means the hsk is one-to-one */
 	bool connect;
+
+	/**
+	 * @group: If non-NULL, this (connected) socket is a member of the
+	 * socket group whose waiting threads and ready queues are in
+	 * @group: its incoming messages are delivered to threads receiving
+	 * on @group (except for RPCs that a thread is waiting for by id on
+	 * this socket). Holds a reference to @group->sock. Modified only
+	 * with both sockets locked (this socket first).
+	 */
+	struct homa_sock *group;
+
+	/**
+	 * @group_cookie: Value returned as the completion cookie when
+	 * recvmsg on @group returns a request that arrived on this socket.
+	 */
+	__u64 group_cookie;
+
+	/**
+	 * @group_members: Number of sockets whose @group refers to this
+	 * socket. Protected by @lock.
+	 */
+	int group_members;
+
+	/**
+	 * @members: Sockets whose @group refers to this socket, linked
+	 * through their @member_links (used to remove the members when
+	 * this socket is shut down). Protected by @lock.
+	 */
+	struct list_head members;
+
+	/**
+	 * @member_links: Used to link this socket into @group->members
+	 * while it is a member of @group.
+	 */
+	struct list_head member_links;
+
+	/**
+	 * @pool_group: If non-NULL, this socket has joined @pool_group and
+	 * its incoming messages use @pool_group's buffer pool. Unlike
+	 * @group, this isn't cleared when the socket leaves the group:
+	 * buffers allocated from the group's pool may still be in use, so
+	 * the socket keeps using that pool until it is destroyed. Holds a
+	 * reference to @pool_group->sock. Set only with this socket locked.
+	 */
+	struct homa_sock *pool_group;
+
+	/**
+	 * @inline_max: Incoming messages no longer than this are delivered
+	 * inline by recvmsg (copied into msg_iov) instead of being placed in
+	 * the buffer pool; 0 means never. Set with SO_HOMA_INLINE.
+	 */
+	int inline_max;
+
+	/**
+	 * @conn_stats: Statistics about this socket, kept only while it is
+	 * connected. Returned by getsockopt(SO_HOMA_CONN_STATS) and listed
+	 * in /proc/net/homa_conns.
+	 */
+	struct homa_conn_counters conn_stats;
 };
 
 /**
@@ -292,10 +445,18 @@ void               homa_bucket_lock_slow(struct homa_rpc_bucket *bucket,
 					 __u64 id);
 int                homa_sock_bind(struct homa_socktab *socktab,
 				  struct homa_sock *hsk, __u16 port);
+int                homa_sock_conns_show(struct seq_file *s, void *v);
 void               homa_sock_destroy(struct homa_sock *hsk);
+void               homa_sock_init_shards(struct homa_sock *hsk);
+int                homa_sock_join_group(struct homa_sock *hsk,
+					struct homa_sock *group, __u64 cookie);
+void               homa_sock_leave_group(struct homa_sock *hsk);
 struct homa_sock  *homa_sock_find(struct homa_socktab *socktab, __u16 port);
+void               homa_sock_get_conn_stats(struct homa_sock *hsk,
+					    struct homa_conn_stats *stats);
 struct homa_sock *homa_sock_find_connected(struct homa_socktab *socktab, struct sockaddr *remote_host, __u16 port);
 int                homa_sock_init(struct homa_sock *hsk, struct homa *homa);
+void               homa_sock_rtt_sample(struct homa_sock *hsk, __u64 sample);
 void               homa_sock_shutdown(struct homa_sock *hsk);
 void               homa_sock_unlink(struct homa_sock *hsk);
 int                homa_socket(struct sock *sk);
@@ -310,15 +471,16 @@ struct homa_sock  *homa_socktab_start_scan(struct homa_socktab *socktab,
  * homa_sock_lock() - Acquire the lock for a socket. If the socket
  * isn't immediately available, record stats on the waiting time.
  * @hsk:     Socket to lock.
- * @locker:  Static string identifying where the socket was locked;
- *           used to track down deadlocks.
+ * @op:      Identifies the kind of operation that needs the lock; used
+ *           to break down the time spent waiting for socket locks.
  */
-static inline void homa_sock_lock(struct homa_sock *hsk, const char *locker)
+static inline void homa_sock_lock(struct homa_sock *hsk, enum homa_lock_op op)
 	__acquires(&hsk->lock)
 {
 	if (!spin_trylock_bh(&hsk->lock))
-		homa_sock_lock_slow(hsk);
-//	hsk->last_locker = locker;
+		homa_sock_lock_slow(hsk, op);
+	else
+		homa_lockprof_acquired(&hsk->lock, _THIS_IP_);
 }
 
 /**
@@ -331,6 +493,120 @@ static inline void homa_sock_unlock(struct homa_sock *hsk)
 	spin_unlock_bh(&hsk->lock);
 }
 
+/**
+ * homa_rpc_shard() - Returns the shard in which a new RPC created on the
+ * current core should be stored.
+ * @hsk:    Socket that will own the RPC.
+ * Return:  See above.
+ */
+static inline struct homa_rpc_shard *homa_rpc_shard(struct homa_sock *hsk)
+{
+	return &hsk->rpc_shards[raw_smp_processor_id() &
+				(HOMA_RPC_SHARDS - 1)];
+}
+
+/**
+ * homa_rpc_shard_lock() - Acquire the lock for a shard of a socket's RPCs.
+ * @shard:    Shard to lock.
+ */
+static inline void homa_rpc_shard_lock(struct homa_rpc_shard *shard)
+	__acquires(&shard->lock)
+{
+	if (!spin_trylock_bh(&shard->lock))
+		homa_rpc_shard_lock_slow(shard);
+	else
+		homa_lockprof_acquired(&shard->lock, _THIS_IP_);
+}
+
+/**
+ * homa_rpc_shard_unlock() - Release the lock for a shard of a socket's RPCs.
+ * @shard:    Shard to unlock.
+ */
+static inline void homa_rpc_shard_unlock(struct homa_rpc_shard *shard)
+	__releases(&shard->lock)
+{
+	spin_unlock_bh(&shard->lock);
+}
+
+/**
+ * homa_for_each_active_rpc() - Iterate over all of the active RPCs
+ * in a socket (the body is invoked once for each RPC). The caller must
+ * hold an RCU read lock, and typically uses homa_protect_rpcs as well.
+ * Don't use "break" in the body: it will only terminate the scan of the
+ * current shard.
+ * @rpc:     Variable that will refer to each RPC in turn.
+ * @shard:   Variable that will refer to the shard containing @rpc.
+ * @hsk:     Socket whose RPCs should be scanned.
+ */
+#define homa_for_each_active_rpc(rpc, shard, hsk)			\
+	for (shard = &(hsk)->rpc_shards[0];				\
+	     shard < &(hsk)->rpc_shards[HOMA_RPC_SHARDS]; shard++)	\
+		list_for_each_entry_rcu(rpc, &shard->active_rpcs,	\
+					active_links)
+
+/**
+ * homa_for_each_active_rpc_safe() - Same as homa_for_each_active_rpc
+ * except that it is safe for the body to delete the current RPC.
+ * @rpc:     Variable that will refer to each RPC in turn.
+ * @tmp:     Used internally for the iteration.
+ * @shard:   Variable that will refer to the shard containing @rpc.
+ * @hsk:     Socket whose RPCs should be scanned.
+ */
+#define homa_for_each_active_rpc_safe(rpc, tmp, shard, hsk)		\
+	for (shard = &(hsk)->rpc_shards[0];				\
+	     shard < &(hsk)->rpc_shards[HOMA_RPC_SHARDS]; shard++)	\
+		list_for_each_entry_safe(rpc, tmp, &shard->active_rpcs,	\
+					 active_links)
+
+/**
+ * homa_sock_pool() - Returns the buffer pool used for a socket's incoming
+ * messages (the pool of its group, if it has ever joined one).
+ * @hsk:    Socket of interest.
+ * Return:  See above.
+ */
+static inline struct homa_pool *homa_sock_pool(struct homa_sock *hsk)
+{
+	struct homa_sock *group = READ_ONCE(hsk->pool_group);
+
+	return unlikely(group) ? group->buffer_pool : hsk->buffer_pool;
+}
+
+/**
+ * homa_sock_has_active_rpcs() - Returns true if there are any active
+ * RPCs for a socket. Doesn't lock anything, so the result may be
+ * out of date by the time the caller sees it.
+ * @hsk:    Socket of interest.
+ * Return:  See above.
+ */
+static inline bool homa_sock_has_active_rpcs(struct homa_sock *hsk)
+{
+	int i;
+
+	for (i = 0; i < HOMA_RPC_SHARDS; i++) {
+		if (!list_empty(&hsk->rpc_shards[i].active_rpcs))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * homa_sock_has_dead_rpcs() - Returns true if there are any RPCs for a
+ * socket that have been freed but not yet reaped. Doesn't lock anything,
+ * so the result may be out of date by the time the caller sees it.
+ * @hsk:    Socket of interest.
+ * Return:  See above.
+ */
+static inline bool homa_sock_has_dead_rpcs(struct homa_sock *hsk)
+{
+	int i;
+
+	for (i = 0; i < HOMA_RPC_SHARDS; i++) {
+		if (!list_empty(&hsk->rpc_shards[i].dead_rpcs))
+			return true;
+	}
+	return false;
+}
+
 /**
  * homa_port_hash() - Hash function for port numbers.
  * @port:   Port number being looked up.
@@ -397,6 +673,8 @@ static inline void homa_bucket_lock(struct homa_rpc_bucket *bucket,
 {
 	if (!spin_trylock_bh(&bucket->lock))
 		homa_bucket_lock_slow(bucket, id);
+	else
+		homa_lockprof_acquired(&bucket->lock, _THIS_IP_);
 }
 
 /**
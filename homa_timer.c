@@ -35,11 +35,11 @@ void homa_check_rpc(struct homa_rpc *rpc)
 				struct homa_need_ack_hdr h;
 
 				homa_xmit_control(NEED_ACK, &h, sizeof(h), rpc);
-				tt_record4("Sent NEED_ACK for RPC id %d to peer 0x%x, port %d, ticks %d",
-					   rpc->id,
-					   tt_addr(rpc->peer->addr),
-					   rpc->dport, homa->timer_ticks
-					   - rpc->done_timer_ticks);
+				tt_rpc_record4(rpc->id, "Sent NEED_ACK for RPC id %d to peer 0x%x, port %d, ticks %d",
+					       rpc->id,
+					       tt_addr(rpc->peer->addr),
+					       rpc->dport, homa->timer_ticks
+					       - rpc->done_timer_ticks);
 			}
 		}
 	}
@@ -53,7 +53,7 @@ void homa_check_rpc(struct homa_rpc *rpc)
 			rpc->silent_ticks = 0;
 			return;
 		}
-		if (rpc->msgin.num_bpages == 0) {
+		if (!homa_msgin_has_space(rpc)) {
 			/* Waiting for buffer space, so no problem. */
 			rpc->silent_ticks = 0;
 			return;
@@ -80,8 +80,8 @@ void homa_check_rpc(struct homa_rpc *rpc)
 		return;
 	if (rpc->silent_ticks >= homa->timeout_ticks) {
 		INC_METRIC(rpc_timeouts, 1);
-		tt_record3("RPC id %d, peer 0x%x, aborted because of timeout, state %d",
-			   rpc->id, tt_addr(rpc->peer->addr), rpc->state);
+		tt_rpc_record3(rpc->id, "RPC id %d, peer 0x%x, aborted because of timeout, state %d",
+			       rpc->id, tt_addr(rpc->peer->addr), rpc->state);
 		homa_rpc_log_active_tt(homa, 0);
 		tt_record1("Freezing because of RPC abort (id %d)", rpc->id);
 		homa_freeze_peers(homa);
@@ -91,6 +91,7 @@ void homa_check_rpc(struct homa_rpc *rpc)
 				  rpc->id,
 				  homa_print_ipv6_addr(&rpc->peer->addr),
 				  rpc->state);
+		INC_CONN_STAT(rpc->hsk, timeouts, 1);
 		homa_rpc_abort(rpc, -ETIMEDOUT);
 		return;
 	}
@@ -118,13 +119,14 @@ void homa_check_rpc(struct homa_rpc *rpc)
 	}
 	resend.priority = homa->num_priorities - 1;
 	homa_xmit_control(RESEND, &resend, sizeof(resend), rpc);
+	INC_CONN_STAT(rpc->hsk, resends_sent, 1);
 #ifndef __STRIP__ /* See strip.py */
 	if (homa_is_client(rpc->id)) {
 		us = "client";
 		them = "server";
-		tt_record4("Sent RESEND for client RPC id %llu, server 0x%x:%d, offset %d",
-			   rpc->id, tt_addr(rpc->peer->addr),
-			   rpc->dport, rpc->msgin.recv_end);
+		tt_rpc_record4(rpc->id, "Sent RESEND for client RPC id %llu, server 0x%x:%d, offset %d",
+			       rpc->id, tt_addr(rpc->peer->addr),
+			       rpc->dport, rpc->msgin.recv_end);
 		tt_record4("length %d, granted %d, rem %d, rec_incoming %d",
 			   rpc->msgin.length, rpc->msgin.granted,
 			   rpc->msgin.bytes_remaining,
@@ -132,9 +134,9 @@ void homa_check_rpc(struct homa_rpc *rpc)
 	} else {
 		us = "server";
 		them = "client";
-		tt_record4("Sent RESEND for server RPC id %llu, client 0x%x:%d offset %d",
-			   rpc->id, tt_addr(rpc->peer->addr), rpc->dport,
-			   rpc->msgin.recv_end);
+		tt_rpc_record4(rpc->id, "Sent RESEND for server RPC id %llu, client 0x%x:%d offset %d",
+			       rpc->id, tt_addr(rpc->peer->addr), rpc->dport,
+			       rpc->msgin.recv_end);
 		tt_record4("length %d, granted %d, rem %d, rec_incoming %d",
 			   rpc->msgin.length, rpc->msgin.granted,
 			   rpc->msgin.bytes_remaining,
@@ -159,6 +161,7 @@ void homa_timer(struct homa *homa)
 	static __u64 prev_grant_count;
 	int total_incoming_rpcs = 0;
 	int sum_incoming_rec = 0;
+	struct homa_rpc_shard *shard;
 	struct homa_sock *hsk;
 	static int zero_count;
 	struct homa_rpc *rpc;
@@ -205,7 +208,12 @@ void homa_timer(struct homa *homa)
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(homa->port_map, &scan);
 			hsk; hsk = homa_socktab_next(&scan)) {
-		while (hsk->dead_skbs >= homa->dead_buffs_limit) {
+		/* When reaping is done by workers, make sure that small
+		 * accumulations of dead RPCs (below reap_work_skbs) and
+		 * reaps blocked by homa_protect_rpcs eventually get done.
+		 */
+		while (!homa_rpc_queue_reap(hsk, 0) &&
+		       atomic_read(&hsk->dead_skbs) >= homa->dead_buffs_limit) {
 			/* If we get here, it means that homa_wait_for_message
 			 * isn't keeping up with RPC reaping, so we'll help
 			 * out.  See reap.txt for more info.
@@ -218,12 +226,12 @@ void homa_timer(struct homa *homa)
 			INC_METRIC(timer_reap_ns, sched_clock() - start);
 		}
 
-		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
+		if (!homa_sock_has_active_rpcs(hsk) || hsk->shutdown)
 			continue;
 
 		if (!homa_protect_rpcs(hsk))
 			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
+		homa_for_each_active_rpc(rpc, shard, hsk) {
 			total_rpcs++;
 			homa_rpc_lock(rpc, "homa_timer");
 			if (rpc->state == RPC_IN_SERVICE) {
@@ -29,6 +29,7 @@ int homa_init(struct homa *homa)
 	homa->pacer_kthread = NULL;
 	init_completion(&homa_pacer_kthread_done);
 	atomic64_set(&homa->next_outgoing_id, 2);
+	atomic_set(&homa->id_epoch, 0);
 	atomic64_set(&homa->link_idle_time, sched_clock());
 	spin_lock_init(&homa->grantable_lock);
 	homa->grantable_lock_time = 0;
@@ -80,12 +81,18 @@ int homa_init(struct homa *homa)
 		       -err);
 		return err;
 	}
+	err = homa_rpc_cache_init(homa);
+	if (err) {
+		pr_err("Couldn't create homa_rpc cache (errno %d)\n", -err);
+		return err;
+	}
 
 	/* Wild guesses to initialize configuration values... */
 	homa->unsched_bytes = 40000;
 	homa->window_param = 100000;
 	homa->link_mbps = 25000;
 	homa->poll_usecs = 50;
+	homa->adaptive_poll = 0;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
@@ -111,10 +118,14 @@ int homa_init(struct homa *homa)
 	homa->resend_interval = 5;
 	homa->timeout_ticks = 100;
 	homa->timeout_resends = 5;
+	homa->tt_sample_rate = 0;
 	homa->request_ack_ticks = 2;
 	homa->reap_limit = 10;
 	homa->dead_buffs_limit = 5000;
+	homa->reap_workers = 1;
+	homa->reap_work_skbs = 200;
 	homa->max_dead_buffs = 0;
+	homa->lock_profile = 0;
 	homa->pacer_kthread = kthread_run(homa_pacer_main, homa,
 					  "homa_pacer");
 	if (IS_ERR(homa->pacer_kthread)) {
@@ -130,6 +141,9 @@ int homa_init(struct homa *homa)
 	homa->max_gso_size = 10000;
 	homa->gso_force_software = 0;
 	homa->hijack_tcp = 0;
+	homa->zerocopy_min_bytes = 10000;
+	homa->copyout_workers = 1;
+	homa->copyout_min_bytes = 200000;
 	homa->max_gro_skbs = 20;
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->busy_usecs = 100;
@@ -140,6 +154,8 @@ int homa_init(struct homa *homa)
 	homa->metrics_capacity = 0;
 	homa->metrics_length = 0;
 	homa->metrics_active_opens = 0;
+	homa->metrics_schema = NULL;
+	homa->metrics_schema_length = 0;
 	homa->flags = 0;
 	homa->freeze_type = 0;
 	homa->bpage_lease_usecs = 10000;
@@ -175,9 +191,12 @@ void homa_destroy(struct homa *homa)
 		kfree(homa->peers);
 		homa->peers = NULL;
 	}
+	homa_rpc_cache_cleanup(homa);
 	homa_skb_cleanup(homa);
 	kfree(homa->metrics);
 	homa->metrics = NULL;
+	kfree(homa->metrics_schema);
+	homa->metrics_schema = NULL;
 }
 
 /**
@@ -678,13 +697,18 @@ void homa_spin(int ns)
 void homa_throttle_lock_slow(struct homa *homa)
 	__acquires(&homa->throttle_lock)
 {
+	unsigned long holder = homa_lockprof_holder(&homa->throttle_lock);
 	__u64 start = sched_clock();
+	__u64 wait;
 
 	tt_record("beginning wait for throttle lock");
 	spin_lock_bh(&homa->throttle_lock);
 	tt_record("ending wait for throttle lock");
+	wait = sched_clock() - start;
 	INC_METRIC(throttle_lock_misses, 1);
-	INC_METRIC(throttle_lock_miss_ns, sched_clock() - start);
+	INC_METRIC(throttle_lock_miss_ns, wait);
+	homa_lockprof_wait(HOMA_LOCK_CLASS_THROTTLE, &homa->throttle_lock,
+			   _RET_IP_, holder, wait);
 }
 
 /**
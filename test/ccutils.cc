@@ -11,7 +11,9 @@
  */
 
 #include <cassert>
+#include <chrono>
 #include <cstdarg>
+#include <cstdio>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -39,6 +41,52 @@ static std::string unit_log;
 typedef void(*hook_func)(char *id);
 static std::vector<hook_func> hooks;
 
+/* Nonzero means the --bench option was specified, so microbenchmark
+ * tests should run their full iteration counts and print results.
+ * Not reset between tests.
+ */
+int unit_bench;
+
+/**
+ * unit_bench_iters() - Returns the number of iterations that a
+ * microbenchmark test should execute.
+ * @count:      Desired number of iterations when measuring performance.
+ *
+ * Return:      @count if --bench was specified; otherwise a small number
+ *              that is enough to check the code's behavior.
+ */
+int unit_bench_iters(int count)
+{
+	return unit_bench ? count : 10;
+}
+
+/**
+ * unit_bench_report() - Print the results of a microbenchmark (only if
+ * --bench was specified).
+ * @name:       Describes the operation that was measured.
+ * @count:      Number of times the operation was executed.
+ * @ns:         Total elapsed time for all @count operations, in
+ *              nanoseconds (see unit_clock_ns).
+ */
+void unit_bench_report(const char *name, int count, unsigned long long ns)
+{
+	if (!unit_bench || count <= 0)
+		return;
+	printf("%-40s %8.1f ns/op (%d ops)\n", name,
+	       static_cast<double>(ns) / count, count);
+}
+
+/**
+ * unit_clock_ns() - Return the current wall-clock time in nanoseconds
+ * (unlike sched_clock, which is mocked in unit tests).
+ */
+unsigned long long unit_clock_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+}
+
 /**
  * unit_hash_erase() - Remove an entry from hash table, if it exists.
  * @hash:       The hash table
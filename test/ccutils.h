@@ -12,6 +12,13 @@
 
 struct unit_hash;
 
+CEXTERN int           unit_bench;
+
+CEXTERN int           unit_bench_iters(int count);
+CEXTERN void          unit_bench_report(const char *name, int count,
+				unsigned long long ns);
+CEXTERN unsigned long long
+                      unit_clock_ns(void);
 CEXTERN void          unit_fill_data(unsigned char *data, int length,
 			int first_value);
 CEXTERN void          unit_hash_erase(struct unit_hash *hash, const void *key);
@@ -4,12 +4,15 @@
 
 #include "homa_impl.h"
 #include "kselftest_harness.h"
+#include "ccutils.h"
 #include "mock.h"
 
 static char *helpMessage =
 	"This program runs unit tests written in the Linux kernel kselftest style.\n"
 	"    Usage: %s options test_name test_name ...\n"
 	"The following options are supported:\n"
+	"    --bench           Run microbenchmark tests with full iteration counts\n"
+	"                      and print their results\n"
 	"    --help or -h      Print this message\n"
 	"    --ipv4            Simulate IPv4 for all packets (default: use IPv6)\n"
 	"    --verbose or -v   Print the names of all tests as they run (default:\n"
@@ -32,6 +35,8 @@ int main(int argc, char **argv)
 			(strcmp(argv[i], "--help") == 0)) {
 			printf(helpMessage, argv[0]);
 			return 0;
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			unit_bench = 1;
 		} else if (strcmp(argv[i], "--ipv4") == 0) {
 			mock_ipv6_default = false;
 		} else if ((strcmp(argv[i], "-v") == 0) ||
@@ -48,7 +48,9 @@ int mock_register_protosw_errors;
 int mock_route_errors;
 int mock_spin_lock_held;
 int mock_trylock_errors;
+int mock_vm_insert_errors;
 int mock_vmalloc_errors;
+int mock_zerocopy_errors;
 
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending;
@@ -78,6 +80,9 @@ int mock_log_rcu_sched;
  */
 int mock_copy_to_user_dont_copy;
 
+/* Value returned by find_vma. */
+struct vm_area_struct *mock_vma;
+
 /* HOMA_BPAGE_SIZE will evaluate to this. */
 int mock_bpage_size = 0x10000;
 
@@ -120,6 +125,12 @@ static struct unit_hash *vmallocs_in_use;
  */
 static int mock_active_locks;
 
+/* The number of times mmap_read_lock has been called minus the number
+ * of times mmap_read_unlock has been called.
+ * Should be 0 at the end of each test.
+ */
+static int mock_active_mmap_locks;
+
 /* The number of times rcu_read_lock has been called minus the number
  * of times rcu_read_unlock has been called.
  * Should be 0 at the end of each test.
@@ -190,6 +201,7 @@ struct net_offload tcp_v6_offload;
 static struct hrtimer_clock_base clock_base;
 unsigned int cpu_khz = 1000000;
 struct task_struct *current_task = &mock_task;
+struct workqueue_struct *system_unbound_wq;
 unsigned long ex_handler_refcount;
 struct net init_net;
 unsigned long volatile jiffies = 1100;
@@ -245,6 +257,11 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+bool cancel_work_sync(struct work_struct *work)
+{
+	return false;
+}
+
 void __check_object_size(const void *ptr, unsigned long n, bool to_user) {}
 
 size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
@@ -270,6 +287,9 @@ size_t _copy_from_iter(void *addr, size_t bytes, struct iov_iter *iter)
 		bytes_left -= chunk_bytes;
 		iter->count -= chunk_bytes;
 		iov->iov_base = (void *) (int_base + chunk_bytes);
+		if (iter_is_ubuf(iter))
+			/* iov_len is the same as count for ITER_UBUF. */
+			continue;
 		iov->iov_len -= chunk_bytes;
 		if (iov->iov_len == 0)
 			iter->__iov++;
@@ -346,6 +366,11 @@ void dst_release(struct dst_entry *dst)
 	free(dst);
 }
 
+struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
+{
+	return mock_vma;
+}
+
 void finish_wait(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry)
 {}
@@ -549,6 +574,28 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->count = count;
 }
 
+unsigned long iov_iter_npages(const struct iov_iter *i, int maxpages)
+{
+	const struct iovec *iov = iter_iov(i);
+	size_t bytes_left = i->count;
+	unsigned long npages = 0;
+
+	while (bytes_left > 0) {
+		__u64 base = (__u64) iov->iov_base;
+		size_t chunk_bytes = iov->iov_len;
+
+		if (chunk_bytes > bytes_left)
+			chunk_bytes = bytes_left;
+		npages += DIV_ROUND_UP(base + chunk_bytes, PAGE_SIZE) -
+				base / PAGE_SIZE;
+		if (npages >= maxpages)
+			return maxpages;
+		bytes_left -= chunk_bytes;
+		iov++;
+	}
+	return npages;
+}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
@@ -596,6 +643,11 @@ int ip6_xmit(const struct sock *sk, struct sk_buff *skb, struct flowi6 *fl6,
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+
+	/* The real stack sets this during routing; recycled skbs won't
+	 * have it set already.
+	 */
+	skb->dev = &mock_net_device;
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -631,6 +683,11 @@ int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 		kfree_skb(skb);
 		return -ENETDOWN;
 	}
+
+	/* The real stack sets this during routing; recycled skbs won't
+	 * have it set already.
+	 */
+	skb->dev = &mock_net_device;
 	if (mock_xmit_prios_offset == 0)
 		prefix = "";
 	mock_xmit_prios_offset += snprintf(
@@ -653,6 +710,19 @@ int ip_queue_xmit(struct sock *sk, struct sk_buff *skb, struct flowi *fl)
 	return 0;
 }
 
+int ip_recv_error(struct sock *sk, struct msghdr *msg, int len, int *addr_len)
+{
+	unit_log_printf("; ", "ip_recv_error");
+	return -EAGAIN;
+}
+
+int ipv6_recv_error(struct sock *sk, struct msghdr *msg, int len,
+		    int *addr_len)
+{
+	unit_log_printf("; ", "ipv6_recv_error");
+	return -EAGAIN;
+}
+
 unsigned int ipv4_mtu(const struct dst_entry *dst)
 {
 	return mock_mtu;
@@ -737,6 +807,8 @@ void __kfree_skb(struct sk_buff *skb)
 		return;
 	}
 	unit_hash_erase(skbs_in_use, skb);
+	if (skb_zcopy(skb))
+		skb_zcopy_clear(skb, true);
 	while (shinfo->frag_list) {
 		struct sk_buff *next = shinfo->frag_list->next;
 
@@ -773,6 +845,65 @@ void *__kmalloc_noprof(size_t size, gfp_t flags)
 	return mock_kmalloc(size, flags);
 }
 
+/* The real struct kmem_cache is private to the slab allocator; this
+ * version holds just what the mocks below need.
+ */
+struct kmem_cache {
+	unsigned int size;
+	void (*ctor)(void *);
+};
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	kfree(cache);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	kfree(obj);
+}
+
+/**
+ * mock_kmem_cache_alloc() - Called instead of kmem_cache_alloc when Homa
+ * is compiled for unit testing. Every object is freshly allocated (and
+ * constructed), so failures can be simulated with mock_kmalloc_errors.
+ * @cache:   Cache from which to allocate.
+ * @flags:   Allocation flags.
+ * Return:   The new object, or NULL if allocation failed.
+ */
+void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	void *obj = mock_kmalloc(cache->size, flags);
+
+	if (obj && cache->ctor)
+		cache->ctor(obj);
+	return obj;
+}
+
+/**
+ * mock_kmem_cache_create() - Called instead of kmem_cache_create when Homa
+ * is compiled for unit testing.
+ * @name:    Name of the cache (ignored).
+ * @size:    Size of objects in the cache.
+ * @align:   Alignment (ignored).
+ * @flags:   Slab flags (ignored).
+ * @ctor:    Constructor to invoke on new objects, or NULL.
+ * Return:   The new cache, or NULL if allocation failed.
+ */
+struct kmem_cache *mock_kmem_cache_create(const char *name, unsigned int size,
+					  unsigned int align,
+					  slab_flags_t flags,
+					  void (*ctor)(void *))
+{
+	struct kmem_cache *cache = mock_kmalloc(sizeof(*cache), GFP_KERNEL);
+
+	if (!cache)
+		return NULL;
+	cache->size = size;
+	cache->ctor = ctor;
+	return cache;
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -788,6 +919,16 @@ int kthread_stop(struct task_struct *k)
 	return 0;
 }
 
+void kthread_unuse_mm(struct mm_struct *mm)
+{
+	UNIT_LOG("; ", "kthread_unuse_mm");
+}
+
+void kthread_use_mm(struct mm_struct *mm)
+{
+	UNIT_LOG("; ", "kthread_use_mm");
+}
+
 #ifdef CONFIG_DEBUG_LIST
 bool __list_add_valid(struct list_head *new,
 		struct list_head *prev,
@@ -810,6 +951,51 @@ void lock_sock_nested(struct sock *sk, int subclass)
 	sk->sk_lock.owned = 1;
 }
 
+static void mock_zerocopy_complete(struct sk_buff *skb,
+				   struct ubuf_info *uarg, bool success)
+{
+	if (!refcount_dec_and_test(&uarg->refcnt))
+		return;
+	unit_log_printf("; ", "zerocopy complete, %s",
+			uarg_to_msgzc(uarg)->zerocopy ? "zerocopy" : "copied");
+	kfree(uarg_to_msgzc(uarg));
+}
+
+const struct ubuf_info_ops msg_zerocopy_ubuf_ops = {
+	.complete = mock_zerocopy_complete,
+};
+
+void msg_zerocopy_put_abort(struct ubuf_info *uarg, bool have_uref)
+{
+	unit_log_printf("; ", "msg_zerocopy_put_abort");
+	if (have_uref)
+		mock_zerocopy_complete(NULL, uarg, true);
+}
+
+struct ubuf_info *msg_zerocopy_realloc(struct sock *sk, size_t size,
+				       struct ubuf_info *uarg)
+{
+	struct ubuf_info_msgzc *uarg_zc;
+
+	if (mock_check_error(&mock_zerocopy_errors))
+		return NULL;
+	uarg_zc = kmalloc(sizeof(*uarg_zc), GFP_KERNEL | __GFP_ZERO);
+	uarg_zc->ubuf.ops = &msg_zerocopy_ubuf_ops;
+	uarg_zc->ubuf.flags = SKBFL_ZEROCOPY_FRAG;
+	refcount_set(&uarg_zc->ubuf.refcnt, 1);
+	uarg_zc->len = 1;
+	uarg_zc->bytelen = size;
+	uarg_zc->zerocopy = 1;
+	return &uarg_zc->ubuf;
+}
+
+void __mmdrop(struct mm_struct *mm) {}
+
+void mmput(struct mm_struct *mm)
+{
+	atomic_dec(&mm->mm_users);
+}
+
 ssize_t __modver_version_show(struct module_attribute *a,
 		struct module_kobject *b, char *c)
 {
@@ -842,6 +1028,9 @@ int netif_receive_skb(struct sk_buff *skb)
 	return 0;
 }
 
+void nf_conntrack_destroy(struct nf_conntrack *nfct)
+{}
+
 long prepare_to_wait_event(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry, int state)
 {
@@ -921,6 +1110,13 @@ int proto_register(struct proto *prot, int alloc_slab)
 
 void proto_unregister(struct proto *prot) {}
 
+bool queue_work_on(int cpu, struct workqueue_struct *wq,
+		   struct work_struct *work)
+{
+	UNIT_LOG("; ", "queue_work");
+	return true;
+}
+
 void *__pskb_pull_tail(struct sk_buff *skb, int delta)
 {
 	return NULL;
@@ -993,13 +1189,51 @@ void security_sk_classify_flow(const struct sock *sk,
 		struct flowi_common *flic)
 {}
 
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return 0;
+}
+
+void seq_printf(struct seq_file *m, const char *f, ...)
+{
+	char buffer[1000];
+	va_list ap;
+
+	va_start(ap, f);
+	vsnprintf(buffer, sizeof(buffer), f, ap);
+	va_end(ap);
+	unit_log_printf(NULL, "%s", buffer);
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		loff_t *ppos)
+{
+	return 0;
+}
+
 void __show_free_areas(unsigned int filter, nodemask_t *nodemask,
 		int max_zone_idx)
 {}
 
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
 void sk_common_release(struct sock *sk)
 {}
 
+void sk_free(struct sock *sk)
+{
+	unit_log_printf("; ", "sk_free");
+}
+
 int sk_set_peek_off(struct sock *sk, int val)
 {
 	return 0;
@@ -1049,6 +1283,9 @@ int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 	return 0;
 }
 
+void __skb_ext_put(struct skb_ext *ext)
+{}
+
 struct sk_buff *skb_dequeue(struct sk_buff_head *list)
 {
 	return __skb_dequeue(list);
@@ -1162,6 +1399,8 @@ void unregister_net_sysctl_table(struct ctl_table_header *header)
 
 void vfree(const void *block)
 {
+	if (!block)
+		return;
 	if (!vmallocs_in_use || unit_hash_get(vmallocs_in_use, block) == NULL) {
 		FAIL("%s on unknown block", __func__);
 		return;
@@ -1175,6 +1414,17 @@ int vfs_fsync(struct file *file, int datasync)
 	return 0;
 }
 
+int vm_insert_pages(struct vm_area_struct *vma, unsigned long addr,
+		    struct page **pages, unsigned long *num)
+{
+	if (mock_check_error(&mock_vm_insert_errors))
+		return -EBUSY;
+	unit_log_printf("; ", "vm_insert_pages %lu pages at 0x%lx", *num,
+			addr);
+	*num = 0;
+	return 0;
+}
+
 void wait_for_completion(struct completion *x) {}
 
 long wait_woken(struct wait_queue_entry *wq_entry, unsigned int mode,
@@ -1197,6 +1447,55 @@ int wake_up_process(struct task_struct *tsk)
 
 void __warn_printk(const char *s, ...) {}
 
+void zap_page_range_single(struct vm_area_struct *vma, unsigned long address,
+			   unsigned long size, struct zap_details *details)
+{
+	unit_log_printf("; ", "zap_page_range_single 0x%lx bytes at 0x%lx",
+			size, address);
+}
+
+int __zerocopy_sg_from_iter(struct msghdr *msg, struct sock *sk,
+			    struct sk_buff *skb, struct iov_iter *from,
+			    size_t length)
+{
+	struct skb_shared_info *shinfo = skb_shinfo(skb);
+
+	if (mock_check_error(&mock_copy_data_errors))
+		return -EFAULT;
+	while (length > 0) {
+		struct iovec *iov = (struct iovec *) iter_iov(from);
+		__u64 int_base = (__u64) iov->iov_base;
+		size_t chunk_bytes = iov->iov_len;
+		struct page *page;
+
+		if (chunk_bytes > length)
+			chunk_bytes = length;
+		if (chunk_bytes > PAGE_SIZE - (int_base & (PAGE_SIZE - 1)))
+			chunk_bytes = PAGE_SIZE - (int_base & (PAGE_SIZE - 1));
+		if (shinfo->nr_frags >= MAX_SKB_FRAGS)
+			return -EMSGSIZE;
+		unit_log_printf("; ", "zerocopy %lu bytes at %llu",
+				chunk_bytes, int_base);
+
+		/* Each user page is simulated with a separate mock page. */
+		page = mock_alloc_pages(GFP_KERNEL, 0);
+		skb_frag_fill_page_desc(&shinfo->frags[shinfo->nr_frags], page,
+					int_base & (PAGE_SIZE - 1),
+					chunk_bytes);
+		shinfo->nr_frags++;
+		skb->len += chunk_bytes;
+		skb->data_len += chunk_bytes;
+		skb->truesize += chunk_bytes;
+		length -= chunk_bytes;
+		from->count -= chunk_bytes;
+		iov->iov_base = (void *) (int_base + chunk_bytes);
+		iov->iov_len -= chunk_bytes;
+		if (iov->iov_len == 0)
+			from->__iov++;
+	}
+	return 0;
+}
+
 int woken_wake_function(struct wait_queue_entry *wq_entry, unsigned int mode,
 		int sync, void *key)
 {
@@ -1214,6 +1513,11 @@ struct page *mock_alloc_pages(gfp_t gfp, unsigned int order)
 	if (mock_check_error(&mock_alloc_page_errors))
 		return NULL;
 	page = (struct page *)malloc(PAGE_SIZE << order);
+
+	/* Fields such as mapping must start out cleared, as in a real
+	 * struct page.
+	 */
+	memset(page, 0, sizeof(*page));
 	if (!pages_in_use)
 		pages_in_use = unit_hash_new();
 	unit_hash_set(pages_in_use, page, (char *)1);
@@ -1317,6 +1621,35 @@ void mock_get_page(struct page *page)
 		unit_hash_set(pages_in_use, page, (void *) (ref_count+1));
 }
 
+/**
+ * mock_mmap_read_lock() - Called instead of mmap_read_lock when Homa is
+ * compiled for unit testing.
+ * @mm:   Memory map to lock (ignored).
+ */
+void mock_mmap_read_lock(struct mm_struct *mm)
+{
+	mock_active_mmap_locks++;
+}
+
+/**
+ * mock_mmap_read_unlock() - Called instead of mmap_read_unlock when Homa is
+ * compiled for unit testing.
+ * @mm:   Memory map to unlock (ignored).
+ */
+void mock_mmap_read_unlock(struct mm_struct *mm)
+{
+	mock_active_mmap_locks--;
+}
+
+/**
+ * mock_page_compound() - Replacement for PageCompound; controlled by
+ * mock_compound_order_mask, just like mock_compound_order.
+ */
+bool mock_page_compound(struct page *page)
+{
+	return mock_compound_order(page) != 0;
+}
+
 /**
  * mock_page_refs() - Returns current reference count for page (0 if no
  * such page exists).
@@ -1544,6 +1877,7 @@ void mock_sock_init(struct homa_sock *hsk, struct homa *homa, int port)
 	memset(hsk, 0, sizeof(*hsk));
 	sk->sk_data_ready = mock_data_ready;
 	sk->sk_family = mock_ipv6 ? AF_INET6 : AF_INET;
+	skb_queue_head_init(&sk->sk_error_queue);
 	if ((port != 0) && (port >= HOMA_MIN_DEFAULT_PORT))
 		homa->next_client_port = port;
 	homa_sock_init(hsk, homa);
@@ -1607,6 +1941,9 @@ void mock_teardown(void)
 	mock_route_errors = 0;
 	mock_trylock_errors = 0;
 	mock_vmalloc_errors = 0;
+	mock_vm_insert_errors = 0;
+	mock_vma = NULL;
+	mock_zerocopy_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
 	mock_signal_pending = 0;
 	mock_xmit_log_verbose = 0;
@@ -1670,11 +2007,27 @@ void mock_teardown(void)
 				mock_active_rcu_locks);
 	mock_active_rcu_locks = 0;
 
+	if (mock_active_mmap_locks != 0)
+		FAIL(" %d mmap_read_locks still active after test",
+				mock_active_mmap_locks);
+	mock_active_mmap_locks = 0;
+
 	memset(homa_metrics, 0, sizeof(homa_metrics));
 
 	unit_hook_clear();
 }
 
+/**
+ * mock_vm_flags_set() - Called instead of vm_flags_set when Homa is
+ * compiled for unit testing.
+ * @vma:    Memory area to modify.
+ * @flags:  Flags to set in @vma.
+ */
+void mock_vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags)
+{
+	ACCESS_PRIVATE(vma, __vm_flags) |= flags;
+}
+
 /**
  * mock_vmalloc() - Called instead of vmalloc when Homa is compiled
  * for unit testing.
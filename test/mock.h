@@ -40,9 +40,13 @@ extern int         mock_spin_lock_held;
 extern struct task_struct
 		   mock_task;
 extern int         mock_trylock_errors;
+extern struct vm_area_struct
+		   *mock_vma;
+extern int         mock_vm_insert_errors;
 extern int         mock_vmalloc_errors;
 extern int         mock_xmit_log_verbose;
 extern int         mock_xmit_log_homa_info;
+extern int         mock_zerocopy_errors;
 
 struct page *
 		   mock_alloc_pages(gfp_t gfp, unsigned order);
@@ -430,6 +430,23 @@ TEST_F(homa_grant, homa_grant_send__basics)
 	EXPECT_EQ(10000, rpc->msgin.granted);
 	EXPECT_STREQ("xmit GRANT 10000@3", unit_log_get());
 }
+TEST_F(homa_grant, homa_grant_send__first_grant_latency)
+{
+	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
+
+	rpc->msgin.birth = 1000;
+	mock_ns = 6000;
+	EXPECT_EQ(1, homa_grant_send(rpc, &self->homa));
+	EXPECT_EQ(1, rpc->msgin.sent_grant);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_first_grant_ns[
+			homa_latency_bucket(5000)]);
+
+	/* Later grants aren't recorded. */
+	rpc->msgin.bytes_remaining -= 10000;
+	EXPECT_EQ(1, homa_grant_send(rpc, &self->homa));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_first_grant_ns[
+			homa_latency_bucket(5000)]);
+}
 TEST_F(homa_grant, homa_grant_send__incoming_negative)
 {
 	struct homa_rpc *rpc = test_rpc(self, 100, self->server_ip, 20000);
@@ -921,6 +938,37 @@ TEST_F(homa_grant, homa_grant_recalc__rpc_fully_granted_but_skip_recalc)
 	EXPECT_EQ(0, rpc4->msgin.granted);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->grant_recalc_skips);
 }
+TEST_F(homa_grant, homa_grant_recalc__microbenchmark)
+{
+	int count = unit_bench_iters(10000);
+	struct in6_addr addr = self->server_ip[0];
+	unsigned long long start;
+	char name[100];
+	int i, n, rpcs;
+
+	/* Each iteration adds more grantable RPCs, spread over peers
+	 * so that max_rpcs_per_peer doesn't limit the ones considered.
+	 */
+	self->homa.max_incoming = 1000000000;
+	rpcs = 0;
+	for (n = 10; n <= unit_bench_iters(1000); n *= 10) {
+		for ( ; rpcs < n; rpcs++) {
+			addr.s6_addr32[3] = htonl(ntohl(
+					self->server_ip[0].s6_addr32[3])
+					+ rpcs / 5);
+			test_rpc(self, 100 + 2 * rpcs, &addr,
+				 100000 + 100 * rpcs);
+		}
+		start = unit_clock_ns();
+		for (i = 0; i < count; i++) {
+			homa_grant_recalc(&self->homa, 0);
+			unit_log_clear();
+		}
+		snprintf(name, sizeof(name), "homa_grant_recalc (%d rpcs)", n);
+		unit_bench_report(name, count, unit_clock_ns() - start);
+		EXPECT_EQ(n, self->homa.num_grantable_rpcs);
+	}
+}
 
 TEST_F(homa_grant, homa_grant_pick_rpcs__basics)
 {
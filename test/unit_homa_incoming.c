@@ -212,6 +212,27 @@ TEST_F(homa_incoming, homa_message_in_init__no_buffers_available)
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 	EXPECT_EQ(0, crpc->msgin.granted);
 }
+TEST_F(homa_incoming, homa_message_in_init__inline)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, 99, 1000, 1000);
+
+	self->hsk.inline_max = 200;
+	atomic_set(&self->hsk.buffer_pool->free_bpages, 0);
+	EXPECT_EQ(0, homa_message_in_init(crpc, 200, 200));
+	EXPECT_EQ(1, crpc->msgin.inline_msg);
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+	EXPECT_EQ(200, crpc->msgin.granted);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->inline_msgs);
+
+	/* Too large to deliver inline. */
+	atomic_set(&self->hsk.buffer_pool->free_bpages, 100);
+	EXPECT_EQ(0, homa_message_in_init(crpc, 201, 201));
+	EXPECT_EQ(0, crpc->msgin.inline_msg);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->inline_msgs);
+}
 TEST_F(homa_incoming, homa_message_in_init__update_metrics)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -646,6 +667,62 @@ TEST_F(homa_incoming, homa_add_packet__metrics)
 	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
 	EXPECT_EQ(1, homa_metrics_per_cpu()->resent_packets_used);
 }
+TEST_F(homa_incoming, homa_add_packet__microbenchmark)
+{
+#define PKTS 100
+	static const char * const orders[] = {"in order", "reversed",
+					      "interleaved"};
+	int rounds = unit_bench_iters(10000) / PKTS + 1;
+	struct sk_buff *skbs[PKTS];
+	unsigned long long total;
+	struct homa_rpc *crpc;
+	char name[100];
+	int i, j, order;
+
+	/* Each message has PKTS packets, which arrive sequentially,
+	 * in reverse order, or with all the even packets before the odd
+	 * ones (which creates many gaps). Only the homa_add_packet calls
+	 * are timed.
+	 */
+	for (order = 0; order < ARRAY_SIZE(orders); order++) {
+		total = 0;
+		for (i = 0; i < rounds; i++) {
+			unsigned long long start;
+
+			crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+					       self->client_ip, self->server_ip,
+					       self->server_port, 100 + 2 * i,
+					       1000, 1000);
+			ASSERT_NE(NULL, crpc);
+			homa_message_in_init(crpc, PKTS * 1400, 0);
+			for (j = 0; j < PKTS; j++) {
+				int pkt = j;
+
+				if (order == 1)
+					pkt = PKTS - 1 - j;
+				else if (order == 2)
+					pkt = (j < PKTS / 2) ? 2 * j
+						: 2 * (j - PKTS / 2) + 1;
+				self->data.seg.offset = htonl(pkt * 1400);
+				skbs[j] = mock_skb_new(self->client_ip,
+						       &self->data.common, 1400,
+						       pkt * 1400);
+			}
+			start = unit_clock_ns();
+			for (j = 0; j < PKTS; j++)
+				homa_add_packet(crpc, skbs[j]);
+			total += unit_clock_ns() - start;
+			EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+			homa_rpc_free(crpc);
+			homa_rpc_reap(&self->hsk, 1000);
+			unit_log_clear();
+		}
+		snprintf(name, sizeof(name), "homa_add_packet (%s)",
+			 orders[order]);
+		unit_bench_report(name, rounds * PKTS, total);
+	}
+#undef PKTS
+}
 
 TEST_F(homa_incoming, homa_copy_to_user__basics)
 {
@@ -772,6 +849,167 @@ TEST_F(homa_incoming, homa_copy_to_user__many_chunks_for_one_skb)
 			"skb_copy_datagram_iter: 440 bytes to 0x1000a00: 103560-103999",
 			unit_log_get());
 }
+TEST_F(homa_incoming, homa_copy_to_user__zerocopy)
+{
+	struct homa_rpc *crpc;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 70000);
+	ASSERT_NE(NULL, crpc);
+	ASSERT_NE(NULL, crpc->msgin.zc);
+	self->data.message_length = htonl(70000);
+	self->data.seg.offset = htonl(65536);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 65536), crpc);
+
+	/* Only the packet in the partial bpage is copied. */
+	unit_log_clear();
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("skb_copy_datagram_iter: 1400 bytes to 0x1010000: 65536-66935",
+			unit_log_get());
+	EXPECT_EQ(1400, crpc->msgin.zc->bytes[0]);
+	EXPECT_NE(NULL, crpc->msgin.zc->pages[0]);
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+}
+TEST_F(homa_incoming, homa_copy_to_user__zerocopy_alloc_fails)
+{
+	struct homa_rpc *crpc;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 70000);
+	ASSERT_NE(NULL, crpc);
+
+	unit_log_clear();
+	mock_alloc_page_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+}
+TEST_F(homa_incoming, homa_copy_to_user__concurrent_copier)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+
+	/* Another thread is also copying: flag must stay set. */
+	crpc->msgin.copiers = 1;
+	atomic_or(RPC_COPYING_TO_USER, &crpc->flags);
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(1, crpc->msgin.copiers);
+	EXPECT_TRUE(atomic_read(&crpc->flags) & RPC_COPYING_TO_USER);
+
+	crpc->msgin.copiers = 0;
+	atomic_andnot(RPC_COPYING_TO_USER, &crpc->flags);
+}
+
+TEST_F(homa_incoming, homa_copy_work__basics)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	atomic_set(&mm.mm_users, 1);
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	atomic_or(RPC_COPY_QUEUED, &crpc->flags);
+
+	unit_log_clear();
+	mock_copy_to_user_dont_copy = -1;
+	homa_copy_work(&crpc->msgin.copy_work);
+	EXPECT_STREQ("kthread_use_mm; "
+		     "skb_copy_datagram_iter: 1400 bytes to 0x1000000: 0-1399; "
+		     "kthread_unuse_mm", unit_log_get());
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_FALSE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	EXPECT_EQ(1, atomic_read(&mm.mm_users));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->copyout_work_calls);
+
+	/* Message not complete, so no handoff. */
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	self->hsk.buffer_pool->mm = NULL;
+}
+TEST_F(homa_incoming, homa_copy_work__address_space_gone)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	atomic_set(&mm.mm_users, 0);
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	atomic_or(RPC_COPY_QUEUED, &crpc->flags);
+
+	unit_log_clear();
+	homa_copy_work(&crpc->msgin.copy_work);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_FALSE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	self->hsk.buffer_pool->mm = NULL;
+}
+TEST_F(homa_incoming, homa_copy_work__rpc_dead)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	atomic_set(&mm.mm_users, 1);
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	atomic_or(RPC_COPY_QUEUED, &crpc->flags);
+	homa_rpc_free(crpc);
+
+	/* RPC can't be reaped while work is pending. */
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(1, unit_count_dead_rpcs(&self->hsk));
+
+	unit_log_clear();
+	homa_copy_work(&crpc->msgin.copy_work);
+	EXPECT_STREQ("kthread_use_mm; kthread_unuse_mm", unit_log_get());
+	EXPECT_FALSE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(0, unit_count_dead_rpcs(&self->hsk));
+	self->hsk.buffer_pool->mm = NULL;
+}
+TEST_F(homa_incoming, homa_copy_work__handoff_complete_message)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	atomic_set(&mm.mm_users, 1);
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 1400);
+	ASSERT_NE(NULL, crpc);
+
+	/* Simulate the receiving thread having claimed the RPC. */
+	list_del_init(&crpc->ready_links);
+	atomic_andnot(RPC_PKTS_READY, &crpc->flags);
+	atomic_or(RPC_COPY_QUEUED, &crpc->flags);
+
+	mock_copy_to_user_dont_copy = -1;
+	homa_copy_work(&crpc->msgin.copy_work);
+	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_TRUE(atomic_read(&crpc->flags) & RPC_PKTS_READY);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+	self->hsk.buffer_pool->mm = NULL;
+}
+
 TEST_F(homa_incoming, homa_copy_to_user__error_in_import_single_range)
 {
 	struct homa_rpc *crpc;
@@ -854,7 +1092,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_ipv4)
 
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
 	homa_dispatch_pkts(skb, &self->homa);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_STREQ("icmp_send type 3, code 3", unit_log_get());
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_ipv6)
@@ -870,7 +1108,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_ipv6)
 
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
 	homa_dispatch_pkts(skb, &self->homa);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_STREQ("icmp6_send type 1, code 4", unit_log_get());
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_free_many_packets)
@@ -890,14 +1128,14 @@ TEST_F(homa_incoming, homa_dispatch_pkts__unknown_socket_free_many_packets)
 	skb->next = skb2;
 	skb2->next = skb3;
 	homa_dispatch_pkts(skb, &self->homa);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_STREQ("icmp6_send type 1, code 4", unit_log_get());
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__new_server_rpc)
 {
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
 			1400, 0), &self->homa);
-	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk2));
 	EXPECT_EQ(1, mock_skb_count());
 }
 TEST_F(homa_incoming, homa_dispatch_pkts__cant_create_server_rpc)
@@ -905,7 +1143,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__cant_create_server_rpc)
 	mock_kmalloc_errors = 1;
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
 			1400, 0), &self->homa);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(0, mock_skb_count());
 	EXPECT_EQ(1, homa_metrics_per_cpu()->server_cant_create_rpcs);
 }
@@ -1123,7 +1361,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 	mock_ns_tick = 10;
 
 	homa_rpc_free(dead);
-	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 	srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->client_port, self->server_id,
 			10000, 5000);
@@ -1134,7 +1372,7 @@ TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 	self->data.common.dport = htons(self->hsk.port);
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
 			1400, 0), &self->homa);
-	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 	EXPECT_EQ(0, homa_metrics_per_cpu()->data_pkt_reap_ns);
 
 	/* Second packet: must reap. */
@@ -1142,9 +1380,93 @@ TEST_F(homa_incoming, homa_dispatch_pkts__forced_reap)
 	self->homa.reap_limit = 10;
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &self->data.common,
 			1400, 0), &self->homa);
-	EXPECT_EQ(21, self->hsk.dead_skbs);
+	EXPECT_EQ(21, atomic_read(&self->hsk.dead_skbs));
 	EXPECT_NE(0, homa_metrics_per_cpu()->data_pkt_reap_ns);
 }
+TEST_F(homa_incoming, homa_dispatch_pkts__microbenchmark)
+{
+#define BATCH 100
+	int batches = unit_bench_iters(100000) / BATCH + 1;
+	struct homa_rpc_shard *shard;
+	struct homa_sock *socks, *conn;
+	struct homa_rpc *rpc, *tmp;
+	struct sk_buff *skbs[BATCH];
+	unsigned long long total;
+	int i, j, n, id = 0;
+	char name[100];
+
+	/* Each iteration creates n connected sockets on server_port (in
+	 * addition to the listening socket hsk2), then measures the cost
+	 * of dispatching single-packet requests to one of them. The
+	 * target socket is created first so that it ends up at the end
+	 * of its hash chain.
+	 */
+	for (n = 10; n <= unit_bench_iters(1000); n *= 10) {
+		socks = kmalloc_array(n, sizeof(*socks), GFP_KERNEL);
+		ASSERT_NE(NULL, socks);
+		for (i = 0; i < n; i++) {
+			struct homa_sock *hsk = &socks[i];
+			struct in6_addr addr = self->client_ip[i == 0 ? 0 : 1];
+			int port = i == 0 ? self->client_port : 1000 + i;
+
+			mock_sock_init(hsk, &self->homa, 0);
+			homa_sock_unlink(hsk);
+			hsk->port = self->server_port;
+			hsk->inet.inet_num = hsk->port;
+			hsk->inet.inet_sport = htons(hsk->port);
+			hsk->connect = true;
+			if (hsk->sock.sk_family == AF_INET6) {
+				hsk->remote_host.in6.sin6_family = AF_INET6;
+				hsk->remote_host.in6.sin6_addr = addr;
+				hsk->remote_host.in6.sin6_port = htons(port);
+			} else {
+				hsk->remote_host.in4.sin_family = AF_INET;
+				hsk->remote_host.in4.sin_addr.s_addr =
+						addr.s6_addr32[3];
+				hsk->remote_host.in4.sin_port = htons(port);
+			}
+			hlist_add_head_rcu(&hsk->socktab_links.hash_links,
+					   &self->homa.port_map->buckets[
+					   homa_port_hash(hsk->port)]);
+		}
+		conn = &socks[0];
+
+		total = 0;
+		self->data.message_length = htonl(1400);
+		for (i = 0; i < batches; i++) {
+			unsigned long long start;
+
+			for (j = 0; j < BATCH; j++) {
+				self->data.common.sender_id =
+						cpu_to_be64(1234 + 2 * id++);
+				skbs[j] = mock_skb_new(self->client_ip,
+						       &self->data.common,
+						       1400, 0);
+			}
+			start = unit_clock_ns();
+			for (j = 0; j < BATCH; j++)
+				homa_dispatch_pkts(skbs[j], &self->homa);
+			total += unit_clock_ns() - start;
+			EXPECT_EQ(BATCH, unit_count_active_rpcs(conn));
+			homa_for_each_active_rpc_safe(rpc, tmp, shard, conn)
+				homa_rpc_free(rpc);
+			while (homa_rpc_reap(conn, 1000) != 0)
+				;
+			unit_log_clear();
+		}
+		snprintf(name, sizeof(name),
+			 "homa_dispatch_pkts (%d connected sockets)", n);
+		unit_bench_report(name, batches * BATCH, total);
+		EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk2));
+
+		for (i = 0; i < n; i++) {
+			socks[i].connect = false;
+			homa_sock_destroy(&socks[i]);
+		}
+		kfree(socks);
+	}
+#undef BATCH
+}
 
 TEST_F(homa_incoming, homa_data_pkt__basics)
 {
@@ -1165,6 +1487,26 @@ TEST_F(homa_incoming, homa_data_pkt__basics)
 	EXPECT_EQ(1600, crpc->msgin.granted);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->responses_received);
 }
+TEST_F(homa_incoming, homa_data_pkt__conn_stats_for_response)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1600);
+
+	ASSERT_NE(NULL, crpc);
+	crpc->msgout.next_xmit_offset = crpc->msgout.length;
+	crpc->start_ns = 1000;
+	mock_ns = 5000;
+	self->hsk.connect = true;
+	self->data.message_length = htonl(1600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc);
+	EXPECT_EQ(RPC_INCOMING, crpc->state);
+	EXPECT_EQ(1, atomic64_read(&self->hsk.conn_stats.responses_received));
+	EXPECT_EQ(1600, atomic64_read(&self->hsk.conn_stats.bytes_received));
+	EXPECT_EQ(4000, atomic64_read(&self->hsk.conn_stats.srtt_ns));
+	self->hsk.connect = false;
+}
 TEST_F(homa_incoming, homa_data_pkt__wrong_client_rpc_state)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1235,6 +1577,24 @@ TEST_F(homa_incoming, homa_data_pkt__no_buffers)
 	EXPECT_EQ(1400, homa_metrics_per_cpu()->dropped_data_no_bufs);
 	EXPECT_EQ(0, skb_queue_len(&crpc->msgin.packets));
 }
+TEST_F(homa_incoming, homa_data_pkt__inline_message_needs_no_buffers)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 1000);
+
+	EXPECT_NE(NULL, crpc);
+	unit_log_clear();
+
+	self->hsk.inline_max = 1000;
+	atomic_set(&self->hsk.buffer_pool->free_bpages, 0);
+	self->data.message_length = htonl(1000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1000, 0), crpc);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->dropped_data_no_bufs);
+	EXPECT_EQ(1, skb_queue_len(&crpc->msgin.packets));
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+}
 TEST_F(homa_incoming, homa_data_pkt__update_delta)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -1291,6 +1651,93 @@ TEST_F(homa_incoming, homa_data_pkt__handoff)
 			200, 0), crpc);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_incoming, homa_data_pkt__queue_copy_work)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+	int offset;
+
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 300000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(300000);
+
+	/* First packets don't fill a batch. */
+	unit_log_clear();
+	for (offset = 1400; offset < 4200; offset += 1400) {
+		self->data.seg.offset = htonl(offset);
+		homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+				1400, offset), crpc);
+	}
+	EXPECT_STREQ("", unit_log_get());
+
+	/* This packet completes a batch. */
+	self->data.seg.offset = htonl(4200);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 4200), crpc);
+	EXPECT_STREQ("queue_work", unit_log_get());
+	EXPECT_TRUE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+
+	/* Work already queued. */
+	unit_log_clear();
+	self->data.seg.offset = htonl(5600);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 5600), crpc);
+	EXPECT_STREQ("", unit_log_get());
+	atomic_andnot(RPC_COPY_QUEUED, &crpc->flags);
+	self->hsk.buffer_pool->mm = NULL;
+}
+TEST_F(homa_incoming, homa_data_pkt__copy_work_for_last_packet)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	self->hsk.buffer_pool->mm = &mm;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.copyout_min_bytes = 2000;
+	self->data.message_length = htonl(3000);
+	self->data.seg.offset = htonl(0);
+	self->data.incoming = htonl(3000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc);
+	EXPECT_FALSE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	self->data.seg.offset = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1600, 1400), crpc);
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+	EXPECT_TRUE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	atomic_andnot(RPC_COPY_QUEUED, &crpc->flags);
+	self->hsk.buffer_pool->mm = NULL;
+}
+TEST_F(homa_incoming, homa_data_pkt__copy_work_disabled)
+{
+	struct homa_rpc *crpc;
+	static struct mm_struct mm;
+
+	self->hsk.buffer_pool->mm = &mm;
+	self->homa.copyout_workers = 0;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 3000);
+	ASSERT_NE(NULL, crpc);
+	self->homa.copyout_min_bytes = 2000;
+	self->data.message_length = htonl(3000);
+	self->data.seg.offset = htonl(1400);
+	self->data.incoming = htonl(3000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1600, 1400), crpc);
+	self->data.seg.offset = htonl(0);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 0), crpc);
+	EXPECT_EQ(0, crpc->msgin.bytes_remaining);
+	EXPECT_FALSE(atomic_read(&crpc->flags) & RPC_COPY_QUEUED);
+	self->hsk.buffer_pool->mm = NULL;
+}
 TEST_F(homa_incoming, homa_data_pkt__send_cutoffs)
 {
 	self->homa.cutoff_version = 2;
@@ -1771,12 +2218,12 @@ TEST_F(homa_incoming, homa_ack_pkt__target_rpc_exists)
 			.num_acks = htons(0)};
 
 	ASSERT_NE(NULL, srpc);
-	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk2));
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
 			&self->homa);
-	EXPECT_EQ(0, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk2));
 	EXPECT_EQ(1, homa_metrics_per_cpu()->packets_received[ACK - DATA]);
 }
 TEST_F(homa_incoming, homa_ack_pkt__target_rpc_doesnt_exist)
@@ -1796,7 +2243,7 @@ TEST_F(homa_incoming, homa_ack_pkt__target_rpc_doesnt_exist)
 
 	ASSERT_NE(NULL, srpc1);
 	ASSERT_NE(NULL, srpc2);
-	EXPECT_EQ(2, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(2, unit_count_active_rpcs(&self->hsk2));
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
 	h.acks[0] = (struct homa_ack) {.server_port = htons(self->server_port),
@@ -1805,7 +2252,7 @@ TEST_F(homa_incoming, homa_ack_pkt__target_rpc_doesnt_exist)
 			.client_id = cpu_to_be64(self->server_id+1)};
 	homa_dispatch_pkts(mock_skb_new(self->client_ip, &h.common, 0, 0),
 			&self->homa);
-	EXPECT_EQ(1, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk2));
 	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc1));
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc2));
 }
@@ -1886,7 +2333,7 @@ TEST_F(homa_incoming, homa_abort_rpcs__multiple_sockets)
 	EXPECT_EQ(0, list_empty(&crpc2->ready_links));
 	EXPECT_EQ(EPROTONOSUPPORT, -crpc2->error);
 	EXPECT_EQ(0, list_empty(&crpc3->ready_links));
-	EXPECT_EQ(2, unit_list_length(&self->hsk2.active_rpcs));
+	EXPECT_EQ(2, unit_count_active_rpcs(&self->hsk2));
 	EXPECT_EQ(2, unit_list_length(&self->hsk2.ready_responses));
 }
 TEST_F(homa_incoming, homa_abort_rpcs__select_addr)
@@ -2046,7 +2493,7 @@ TEST_F(homa_incoming, homa_abort_sock_rpcs__free_rpcs)
 	homa_abort_sock_rpcs(&self->hsk, 0);
 	EXPECT_EQ(RPC_DEAD, crpc1->state);
 	EXPECT_EQ(RPC_DEAD, crpc2->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 
 TEST_F(homa_incoming, homa_register_interests__id_not_for_client_rpc)
@@ -2218,6 +2665,61 @@ TEST_F(homa_incoming, homa_register_interests__call_sk_data_ready)
 	homa_rpc_unlock(srpc2);
 }
 
+TEST_F(homa_incoming, homa_register_interests__claim_rpc_queued_in_group)
+{
+	struct homa_rpc *crpc;
+	struct homa_sock hsk2;
+	int result;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	crpc = unit_client_rpc(&hsk2, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			20000, 1600);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+
+	result = homa_register_interests(&self->interest, &hsk2,
+			HOMA_RECVMSG_RESPONSE, crpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(crpc, (struct homa_rpc *)
+			atomic_long_read(&self->interest.ready_rpc));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+	homa_rpc_unlock(crpc);
+	homa_sock_destroy(&hsk2);
+}
+
+TEST_F(homa_incoming, homa_poll_ns__adaptive_poll_disabled)
+{
+	self->homa.poll_usecs = 50;
+	self->homa.adaptive_poll = 0;
+	self->hsk.avg_handoff_gap_ns = 1000000;
+	EXPECT_EQ(50000, homa_poll_ns(&self->hsk));
+}
+TEST_F(homa_incoming, homa_poll_ns__gap_too_long)
+{
+	self->homa.poll_usecs = 50;
+	self->homa.adaptive_poll = 1;
+	self->hsk.avg_handoff_gap_ns = 50001;
+	EXPECT_EQ(0, homa_poll_ns(&self->hsk));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->adaptive_poll_skips);
+}
+TEST_F(homa_incoming, homa_poll_ns__limits)
+{
+	self->homa.poll_usecs = 40;
+	self->homa.adaptive_poll = 1;
+	self->hsk.avg_handoff_gap_ns = 1000;
+	EXPECT_EQ(10000, homa_poll_ns(&self->hsk));
+	self->hsk.avg_handoff_gap_ns = 15000;
+	EXPECT_EQ(30000, homa_poll_ns(&self->hsk));
+	self->hsk.avg_handoff_gap_ns = 30000;
+	EXPECT_EQ(40000, homa_poll_ns(&self->hsk));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->adaptive_poll_skips);
+}
+
 TEST_F(homa_incoming, homa_wait_for_message__rpc_from_register_interests)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2226,10 +2728,13 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_from_register_interests)
 	struct homa_rpc *rpc;
 
 	ASSERT_NE(NULL, crpc);
+	crpc->handoff_ns = 500;
+	mock_ns = 1500;
 	rpc = homa_wait_for_message(&self->hsk,
 			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING,
 			self->client_id);
 	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoff_queued_ns[2]);
 	homa_rpc_unlock(crpc);
 }
 TEST_F(homa_incoming, homa_wait_for_message__error_from_register_interests)
@@ -2262,8 +2767,10 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_polling)
 	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
 	EXPECT_EQ(crpc1, rpc);
 	EXPECT_EQ(NULL, crpc1->interest);
-	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
-	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_no_wakeup);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoff_polled_ns[0]);
+	EXPECT_EQ(0, atomic_read(&self->hsk.dead_skbs));
 	homa_rpc_unlock(rpc);
 }
 TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
@@ -2295,8 +2802,9 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
 			self->server_port, self->client_id+2, 20000, 20000);
 	self->homa.reap_limit = 5;
+	self->homa.reap_workers = 0;
 	homa_rpc_free(crpc2);
-	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 	unit_log_clear();
 
 	hook_rpc = crpc1;
@@ -2306,9 +2814,36 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 	EXPECT_EQ(NULL, crpc1->interest);
 	EXPECT_STREQ("reaped 1236; wake_up_process pid 0; 0 in ready_requests, 0 in ready_responses, 0 in request_interests, 0 in response_interests",
 			unit_log_get());
-	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoff_woken_ns[0]);
+	EXPECT_EQ(0, atomic_read(&self->hsk.dead_skbs));
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__reap_workers)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 20000, 20000);
+	struct homa_rpc *rpc;
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc2);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
+	unit_log_clear();
+
+	/* The application thread shouldn't reap; it should leave that
+	 * to a worker.
+	 */
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_NONBLOCKING,
+			self->client_id);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_SUBSTR("queue_work", unit_log_get());
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->wait_reap_ns);
+}
 TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_after_giving_up)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2465,6 +3000,27 @@ TEST_F(homa_incoming, homa_wait_for_message__message_complete)
 			& (RPC_PKTS_READY|RPC_COPYING_TO_USER));
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__inline_message)
+{
+	struct homa_rpc *crpc;
+	struct homa_rpc *rpc;
+
+	self->hsk.inline_max = 2000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			20000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, crpc->msgin.inline_msg);
+	unit_log_clear();
+
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(2, skb_queue_len(&crpc->msgin.packets));
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__signal)
 {
 	struct homa_rpc *rpc;
@@ -2732,6 +3288,109 @@ TEST_F(homa_incoming, homa_rpc_handoff__update_last_app_active)
 	EXPECT_EQ(10000, per_cpu(homa_offload_core, 2).last_app_active);
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
+TEST_F(homa_incoming, homa_rpc_handoff__socket_group)
+{
+	struct homa_interest interest;
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	srpc = unit_server_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			20000, 100);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	/* First handoff: queued in the group. */
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(0, unit_list_length(&hsk2.ready_requests));
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+
+	/* Second handoff: thread waiting on the group. */
+	list_del_init(&srpc->ready_links);
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	list_add_tail(&interest.request_links, &self->hsk.request_interests);
+	unit_log_clear();
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(srpc, (struct homa_rpc *)
+			atomic_long_read(&interest.ready_rpc));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.request_interests));
+	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
+	atomic_andnot(RPC_HANDING_OFF, &srpc->flags);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_incoming, homa_rpc_handoff__socket_group_shut_down)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	srpc = unit_server_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			20000, 100);
+	ASSERT_NE(NULL, srpc);
+	self->hsk.shutdown = 1;
+
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&hsk2.ready_requests));
+	self->hsk.shutdown = 0;
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_incoming, homa_rpc_handoff__update_avg_handoff_gap)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+
+	ASSERT_NE(NULL, crpc);
+
+	/* First handoff: no previous handoff, so no gap. */
+	mock_ns = 10000;
+	homa_rpc_handoff(crpc);
+	EXPECT_EQ(0, self->hsk.avg_handoff_gap_ns);
+	EXPECT_EQ(10000, self->hsk.last_handoff_ns);
+	EXPECT_EQ(10000, crpc->handoff_ns);
+
+	/* Second handoff. */
+	list_del_init(&crpc->ready_links);
+	self->hsk.avg_handoff_gap_ns = 800;
+	mock_ns = 18000;
+	homa_rpc_handoff(crpc);
+	EXPECT_EQ(1700, self->hsk.avg_handoff_gap_ns);
+	EXPECT_EQ(18000, self->hsk.last_handoff_ns);
+}
+TEST_F(homa_incoming, homa_rpc_handoff__thread_polling)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	struct homa_interest interest;
+
+	ASSERT_NE(NULL, crpc);
+	unit_log_clear();
+
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	interest.polling = 1;
+	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	homa_rpc_handoff(crpc);
+	EXPECT_EQ(crpc, (struct homa_rpc *)
+			atomic_long_read(&interest.ready_rpc));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(1, homa_metrics_per_cpu()->handoffs_no_wakeup);
+	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
+}
 
 TEST_F(homa_incoming, homa_incoming_sysctl_changed__grant_nonfifo)
 {
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: BSD-2-Clause
+
+#include "homa_impl.h"
+#include "homa_sock.h"
+#define KSELFTEST_NOT_MAIN 1
+#include "kselftest_harness.h"
+#include "ccutils.h"
+#include "mock.h"
+#include "utils.h"
+
+/* Returns the entry in homa_lockprof.sites for a site, or NULL. */
+static struct homa_lockprof_site *find_site(unsigned long site)
+{
+	int i;
+
+	for (i = 0; i < HOMA_LOCKPROF_SITES; i++) {
+		if (homa_lockprof.sites[i].site == site)
+			return &homa_lockprof.sites[i];
+	}
+	return NULL;
+}
+
+FIXTURE(homa_lockprof) {
+	struct homa homa;
+	struct homa_sock hsk;
+};
+FIXTURE_SETUP(homa_lockprof)
+{
+	homa_init(&self->homa);
+	mock_sock_init(&self->hsk, &self->homa, 0);
+	self->homa.lock_profile = 1;
+	homa_lockprof_sysctl_changed(&self->homa);
+}
+FIXTURE_TEARDOWN(homa_lockprof)
+{
+	self->homa.lock_profile = 0;
+	homa_lockprof_sysctl_changed(&self->homa);
+	homa_lockprof_reset();
+	homa_destroy(&self->homa);
+	unit_teardown();
+}
+
+TEST_F(homa_lockprof, homa_lockprof_find__table_full)
+{
+	int i;
+
+	for (i = 1; i <= HOMA_LOCKPROF_SITES; i++)
+		homa_lockprof_record(HOMA_LOCK_CLASS_PEER, i, 0, 100);
+	EXPECT_EQ(0, atomic64_read(&homa_lockprof.dropped));
+	EXPECT_EQ(1, atomic64_read(&find_site(HOMA_LOCKPROF_SITES)->waits));
+
+	homa_lockprof_record(HOMA_LOCK_CLASS_PEER, 5000, 0, 100);
+	EXPECT_EQ(1, atomic64_read(&homa_lockprof.dropped));
+	EXPECT_EQ(NULL, find_site(5000));
+
+	/* Existing sites can still be found. */
+	homa_lockprof_record(HOMA_LOCK_CLASS_PEER, 7, 0, 100);
+	EXPECT_EQ(2, atomic64_read(&find_site(7)->waits));
+}
+
+TEST_F(homa_lockprof, homa_lockprof_record__basics)
+{
+	struct homa_lockprof_site *entry;
+
+	homa_lockprof_record(HOMA_LOCK_CLASS_THROTTLE, 1000, 0, 300);
+	homa_lockprof_record(HOMA_LOCK_CLASS_THROTTLE, 1000, 0, 5000);
+	homa_lockprof_record(HOMA_LOCK_CLASS_THROTTLE, 1000, 0, 100);
+	homa_lockprof_record(HOMA_LOCK_CLASS_THROTTLE, 1000, 0,
+			     1000000000);
+	homa_lockprof_record(HOMA_LOCK_CLASS_PEER, 2000, 0, 10);
+	entry = find_site(1000);
+	ASSERT_NE(NULL, entry);
+	EXPECT_EQ(HOMA_LOCK_CLASS_THROTTLE, entry->lock_class);
+	EXPECT_EQ(4, atomic64_read(&entry->waits));
+	EXPECT_EQ(1000005400, atomic64_read(&entry->wait_ns));
+	EXPECT_EQ(1000000000, atomic64_read(&entry->max_wait_ns));
+	EXPECT_EQ(1, atomic64_read(&entry->hist[0]));
+	EXPECT_EQ(1, atomic64_read(&entry->hist[1]));
+	EXPECT_EQ(1, atomic64_read(&entry->hist[5]));
+	EXPECT_EQ(1, atomic64_read(&entry->hist[HOMA_LOCKPROF_BUCKETS - 1]));
+	EXPECT_EQ(4, atomic64_read(&entry->other_holders));
+	EXPECT_EQ(HOMA_LOCK_CLASS_PEER, find_site(2000)->lock_class);
+}
+TEST_F(homa_lockprof, homa_lockprof_record__holders)
+{
+	struct homa_lockprof_site *entry;
+	int i;
+
+	for (i = 1; i <= HOMA_LOCKPROF_HOLDERS + 1; i++)
+		homa_lockprof_record(HOMA_LOCK_CLASS_BUCKET, 1000, 100 * i,
+				     100);
+	homa_lockprof_record(HOMA_LOCK_CLASS_BUCKET, 1000, 200, 100);
+	entry = find_site(1000);
+	ASSERT_NE(NULL, entry);
+	EXPECT_EQ(100, entry->holders[0].site);
+	EXPECT_EQ(1, atomic64_read(&entry->holders[0].count));
+	EXPECT_EQ(200, entry->holders[1].site);
+	EXPECT_EQ(2, atomic64_read(&entry->holders[1].count));
+	EXPECT_EQ(100 * HOMA_LOCKPROF_HOLDERS,
+		  entry->holders[HOMA_LOCKPROF_HOLDERS - 1].site);
+	EXPECT_EQ(1, atomic64_read(&entry->other_holders));
+}
+
+TEST_F(homa_lockprof, homa_lockprof_sysctl_changed)
+{
+	homa_lockprof_record(HOMA_LOCK_CLASS_PEER, 1000, 0, 100);
+	EXPECT_EQ(1, homa_lockprof_active);
+
+	/* Already enabled: data is retained. */
+	homa_lockprof_sysctl_changed(&self->homa);
+	EXPECT_NE(NULL, find_site(1000));
+
+	self->homa.lock_profile = 0;
+	homa_lockprof_sysctl_changed(&self->homa);
+	EXPECT_EQ(0, homa_lockprof_active);
+	EXPECT_NE(NULL, find_site(1000));
+
+	/* Reenabling discards old data. */
+	self->homa.lock_profile = 1;
+	homa_lockprof_sysctl_changed(&self->homa);
+	EXPECT_EQ(1, homa_lockprof_active);
+	EXPECT_EQ(NULL, find_site(1000));
+}
+
+TEST_F(homa_lockprof, homa_lockprof_show)
+{
+	homa_lockprof_record(HOMA_LOCK_CLASS_GRANTABLE, 1000, 2000, 300);
+	homa_lockprof_record(HOMA_LOCK_CLASS_GRANTABLE, 1000, 0, 300);
+	unit_log_clear();
+	homa_lockprof_show(NULL, NULL);
+	EXPECT_SUBSTR("# Lock profiling is enabled; waits dropped (table full): 0",
+		      unit_log_get());
+	EXPECT_SUBSTR("grantable          2            600          300",
+		      unit_log_get());
+	EXPECT_SUBSTR(" 0 2 0 0 0 0 0 0 0 0 0 0 0 0 0 0 |", unit_log_get());
+	EXPECT_SUBSTR(":1 other:1", unit_log_get());
+}
+
+TEST_F(homa_lockprof, homa_lockprof_holder__disabled)
+{
+	homa_lockprof_acquired(&self->hsk.lock, 1000);
+	EXPECT_EQ(1000, homa_lockprof_holder(&self->hsk.lock));
+	self->homa.lock_profile = 0;
+	homa_lockprof_sysctl_changed(&self->homa);
+	EXPECT_EQ(0, homa_lockprof_holder(&self->hsk.lock));
+}
+TEST_F(homa_lockprof, homa_lockprof_holder__different_lock)
+{
+	homa_lockprof_acquired(&self->hsk.lock, 1000);
+	homa_lockprof_owner(&self->hsk.lock)->lock = &self->homa;
+	EXPECT_EQ(0, homa_lockprof_holder(&self->hsk.lock));
+}
+
+TEST_F(homa_lockprof, lock_slow_records_wait_and_holder)
+{
+	struct homa_lockprof_site *entry = NULL;
+	unsigned long holder;
+	int i;
+
+	mock_ns_tick = 100;
+	homa_sock_lock(&self->hsk, HOMA_LOCK_RECV);
+	holder = homa_lockprof_holder(&self->hsk.lock);
+	EXPECT_NE(0, holder);
+	homa_sock_unlock(&self->hsk);
+
+	mock_trylock_errors = 1;
+	homa_sock_lock(&self->hsk, HOMA_LOCK_RECV);
+	homa_sock_unlock(&self->hsk);
+	for (i = 0; i < HOMA_LOCKPROF_SITES; i++) {
+		if (homa_lockprof.sites[i].site != 0) {
+			entry = &homa_lockprof.sites[i];
+			break;
+		}
+	}
+	ASSERT_NE(NULL, entry);
+	EXPECT_EQ(HOMA_LOCK_CLASS_SOCKET, entry->lock_class);
+	EXPECT_EQ(1, atomic64_read(&entry->waits));
+	EXPECT_EQ(100, atomic64_read(&entry->wait_ns));
+	EXPECT_EQ(holder, entry->holders[0].site);
+	EXPECT_EQ(entry->site, homa_lockprof_holder(&self->hsk.lock));
+}
+TEST_F(homa_lockprof, lock_slow_profiling_disabled)
+{
+	int i;
+
+	self->homa.lock_profile = 0;
+	homa_lockprof_sysctl_changed(&self->homa);
+	mock_trylock_errors = 1;
+	homa_throttle_lock(&self->homa);
+	homa_throttle_unlock(&self->homa);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->throttle_lock_misses);
+	for (i = 0; i < HOMA_LOCKPROF_SITES; i++)
+		EXPECT_EQ(0, homa_lockprof.sites[i].site);
+}
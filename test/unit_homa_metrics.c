@@ -95,3 +95,177 @@ TEST_F(homa_metrics, homa_metrics_release)
 	EXPECT_EQ(0, homa_metrics_release(NULL, NULL));
 	EXPECT_EQ(0, self->homa.metrics_active_opens);
 }
+
+TEST_F(homa_metrics, homa_latency_bucket)
+{
+	EXPECT_EQ(0, homa_latency_bucket(0));
+	EXPECT_EQ(0, homa_latency_bucket(255));
+	EXPECT_EQ(1, homa_latency_bucket(256));
+	EXPECT_EQ(3, homa_latency_bucket(1023));
+	EXPECT_EQ(4, homa_latency_bucket(1024));
+	EXPECT_EQ(4, homa_latency_bucket(1279));
+	EXPECT_EQ(5, homa_latency_bucket(1280));
+	EXPECT_EQ(7, homa_latency_bucket(2047));
+	EXPECT_EQ(8, homa_latency_bucket(2048));
+	EXPECT_EQ(8, homa_latency_bucket(2559));
+	EXPECT_EQ(9, homa_latency_bucket(2560));
+	EXPECT_EQ(HOMA_LATENCY_BUCKETS - 1, homa_latency_bucket(~0ULL));
+}
+TEST_F(homa_metrics, homa_latency_bucket_start)
+{
+	int i;
+
+	EXPECT_EQ(0, homa_latency_bucket_start(0));
+	EXPECT_EQ(1024, homa_latency_bucket_start(4));
+	EXPECT_EQ(2560, homa_latency_bucket_start(9));
+	for (i = 1; i < HOMA_LATENCY_BUCKETS; i++) {
+		EXPECT_EQ(i, homa_latency_bucket(homa_latency_bucket_start(i)));
+		EXPECT_EQ(i - 1, homa_latency_bucket(
+				homa_latency_bucket_start(i) - 1));
+	}
+}
+TEST_F(homa_metrics, homa_metrics_schema__covers_all_counters)
+{
+	int counters = 0;
+	char *p, *end;
+
+	ASSERT_EQ(0, homa_metrics_schema(&self->homa));
+	ASSERT_NE(NULL, self->homa.metrics_schema);
+	EXPECT_EQ(strlen(self->homa.metrics_schema),
+			self->homa.metrics_schema_length);
+	EXPECT_EQ(0, strncmp("small_msg_bytes 64\n",
+			self->homa.metrics_schema, 19));
+	EXPECT_NE(NULL, strstr(self->homa.metrics_schema,
+			"\npackets_sent 9\n"));
+
+	p = self->homa.metrics_schema;
+	while (*p != 0) {
+		p = strchr(p, ' ');
+		ASSERT_NE(NULL, p);
+		counters += strtol(p + 1, &end, 10);
+		ASSERT_EQ('\n', *end);
+		p = end + 1;
+	}
+	EXPECT_EQ(sizeof(struct homa_metrics) / sizeof(__u64), counters);
+}
+TEST_F(homa_metrics, homa_metrics_schema__only_generated_once)
+{
+	char *schema;
+
+	ASSERT_EQ(0, homa_metrics_schema(&self->homa));
+	schema = self->homa.metrics_schema;
+	ASSERT_EQ(0, homa_metrics_schema(&self->homa));
+	EXPECT_EQ(schema, self->homa.metrics_schema);
+}
+TEST_F(homa_metrics, homa_metrics_schema__kmalloc_error)
+{
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_metrics_schema(&self->homa));
+	EXPECT_EQ(NULL, self->homa.metrics_schema);
+}
+TEST_F(homa_metrics, homa_metrics_bin_open__basics)
+{
+	struct homa_metrics_hdr *hdr;
+	struct file file;
+
+	mock_ns = 12345;
+	ASSERT_EQ(0, homa_metrics_bin_open(NULL, &file));
+	hdr = file.private_data;
+	EXPECT_EQ(HOMA_METRICS_MAGIC, hdr->magic);
+	EXPECT_EQ(HOMA_METRICS_VERSION, hdr->version);
+	EXPECT_EQ(12345, hdr->time_ns);
+	EXPECT_EQ(nr_cpu_ids, hdr->num_cores);
+	EXPECT_EQ(sizeof(struct homa_metrics) / sizeof(__u64),
+			hdr->num_counters);
+	EXPECT_EQ(sizeof(*hdr), hdr->schema_offset);
+	EXPECT_EQ(self->homa.metrics_schema_length, hdr->schema_length);
+	EXPECT_EQ(0, hdr->data_offset % 8);
+	EXPECT_TRUE(hdr->data_offset >= hdr->schema_offset +
+			hdr->schema_length);
+	EXPECT_TRUE(hdr->data_offset < hdr->schema_offset +
+			hdr->schema_length + 8);
+	homa_metrics_bin_release(NULL, &file);
+}
+TEST_F(homa_metrics, homa_metrics_bin_open__kmalloc_error)
+{
+	struct file file;
+
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_metrics_bin_open(NULL, &file));
+}
+TEST_F(homa_metrics, homa_metrics_bin_read__whole_file)
+{
+	struct homa_metrics_hdr *hdr;
+	struct homa_metrics *m;
+	struct file file;
+	loff_t offset = 0;
+	size_t size;
+	char *buffer;
+
+	ASSERT_EQ(0, homa_metrics_bin_open(NULL, &file));
+	hdr = file.private_data;
+	size = hdr->data_offset + hdr->num_cores * sizeof(struct homa_metrics);
+	buffer = malloc(size + 100);
+	memset(buffer, 'x', size + 100);
+	homa_metrics_per_cpu()->packets_sent[2] = 77;
+
+	EXPECT_EQ(size, homa_metrics_bin_read(&file, buffer, size + 100,
+			&offset));
+	EXPECT_EQ(size, offset);
+	EXPECT_EQ(0, memcmp(buffer, hdr, sizeof(*hdr)));
+	EXPECT_EQ(0, memcmp(buffer + hdr->schema_offset,
+			self->homa.metrics_schema, hdr->schema_length));
+	EXPECT_EQ(0, buffer[hdr->data_offset - 1]);
+	m = (struct homa_metrics *)(buffer + hdr->data_offset +
+			raw_smp_processor_id() * sizeof(struct homa_metrics));
+	EXPECT_EQ(77, m->packets_sent[2]);
+	EXPECT_EQ('x', buffer[size]);
+
+	EXPECT_EQ(0, homa_metrics_bin_read(&file, buffer, 100, &offset));
+	free(buffer);
+	homa_metrics_bin_release(NULL, &file);
+}
+TEST_F(homa_metrics, homa_metrics_bin_read__counters_only)
+{
+	struct homa_metrics_hdr *hdr;
+	struct file file;
+	loff_t offset;
+	__u64 value;
+
+	ASSERT_EQ(0, homa_metrics_bin_open(NULL, &file));
+	hdr = file.private_data;
+	homa_metrics_per_cpu()->packets_sent[2] = 77;
+	offset = hdr->data_offset + raw_smp_processor_id() *
+			sizeof(struct homa_metrics) +
+			offsetof(struct homa_metrics, packets_sent[2]);
+
+	unit_log_clear();
+	EXPECT_EQ(8, homa_metrics_bin_read(&file, (char *)&value, 8,
+			&offset));
+	EXPECT_EQ(77, value);
+	EXPECT_EQ(offsetof(struct homa_metrics, packets_sent[3]),
+			offset - hdr->data_offset - raw_smp_processor_id() *
+			sizeof(struct homa_metrics));
+	homa_metrics_bin_release(NULL, &file);
+}
+TEST_F(homa_metrics, homa_metrics_bin_read__error_copying_to_user)
+{
+	struct file file;
+	loff_t offset = 0;
+	char buffer[100];
+
+	ASSERT_EQ(0, homa_metrics_bin_open(NULL, &file));
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_metrics_bin_read(&file, buffer, 100,
+			&offset));
+	EXPECT_EQ(0, offset);
+	homa_metrics_bin_release(NULL, &file);
+}
+TEST_F(homa_metrics, homa_metrics_bin_release)
+{
+	struct file file;
+
+	ASSERT_EQ(0, homa_metrics_bin_open(NULL, &file));
+	EXPECT_EQ(0, homa_metrics_bin_release(NULL, &file));
+	EXPECT_EQ(NULL, file.private_data);
+}
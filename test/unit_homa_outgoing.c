@@ -298,7 +298,7 @@ TEST_F(homa_outgoing, homa_message_out_fill__basics)
 			unit_iov_iter((void *) 1000, 3000), 0));
 	homa_rpc_unlock(crpc);
 	EXPECT_EQ(3000, crpc->msgout.granted);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	EXPECT_STREQ("mtu 1496, max_seg_data 1400, max_gso_data 1400; "
 			"_copy_from_iter 1400 bytes at 1000; "
 			"_copy_from_iter 1400 bytes at 2400; "
@@ -524,6 +524,103 @@ TEST_F(homa_outgoing, homa_message_out_fill__too_short_for_pipelining)
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_basics)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	atomic_or(RPC_ZEROCOPY, &crpc->flags);
+	self->homa.zerocopy_min_bytes = 3000;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 4096, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("zerocopy 1400 bytes at 4096; "
+			"zerocopy 1400 bytes at 5496; "
+			"zerocopy 200 bytes at 6896", unit_log_get());
+	EXPECT_EQ(3, crpc->msgout.num_skbs);
+	EXPECT_NE(NULL, skb_zcopy(crpc->msgout.packets));
+	EXPECT_EQ(NULL, crpc->msgout.zc_uarg);
+	EXPECT_EQ(3000, homa_metrics_per_cpu()->zerocopy_bytes);
+
+	/* The notification shouldn't happen until all packets are freed. */
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_STREQ("", unit_log_get());
+	homa_rpc_reap(&self->hsk, 100);
+	EXPECT_STREQ("zerocopy complete, zerocopy", unit_log_get());
+}
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_message_too_short)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	atomic_or(RPC_ZEROCOPY, &crpc->flags);
+	self->homa.zerocopy_min_bytes = 3001;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 4096, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("_copy_from_iter 1400 bytes at 4096", unit_log_get());
+	EXPECT_EQ(NULL, skb_zcopy(crpc->msgout.packets));
+}
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_alloc_fails)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	atomic_or(RPC_ZEROCOPY, &crpc->flags);
+	self->homa.zerocopy_min_bytes = 1000;
+	mock_zerocopy_errors = 1;
+	unit_log_clear();
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 4096, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("_copy_from_iter 1400 bytes at 4096", unit_log_get());
+	EXPECT_EQ(NULL, skb_zcopy(crpc->msgout.packets));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_alloc_failures);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_gso_geometry)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	atomic_or(RPC_ZEROCOPY, &crpc->flags);
+	self->homa.zerocopy_min_bytes = 1000;
+	mock_net_device.gso_max_size = 60000;
+	self->homa.max_gso_size = 60000;
+	ASSERT_EQ(0, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 4096, 60000), 0));
+	homa_rpc_unlock(crpc);
+
+	/* Each segment needs one frag for its header and two for data
+	 * (it could straddle a page boundary).
+	 */
+	EXPECT_EQ(1400 * (MAX_SKB_FRAGS / 3),
+		  homa_get_skb_info(crpc->msgout.packets)->data_bytes);
+}
+TEST_F(homa_outgoing, homa_message_out_fill__zerocopy_error_after_packets_created)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+
+	ASSERT_FALSE(crpc == NULL);
+	atomic_or(RPC_ZEROCOPY, &crpc->flags);
+	self->homa.zerocopy_min_bytes = 1000;
+	mock_copy_data_errors = 2;
+	unit_log_clear();
+	EXPECT_EQ(EFAULT, -homa_message_out_fill(crpc,
+			unit_iov_iter((void *) 4096, 3000), 0));
+	homa_rpc_unlock(crpc);
+	EXPECT_SUBSTR("zerocopy 1400 bytes at 4096; msg_zerocopy_put_abort",
+		      unit_log_get());
+	EXPECT_EQ(NULL, crpc->msgout.zc_uarg);
+	EXPECT_EQ(1, crpc->msgout.num_skbs);
+}
 
 TEST_F(homa_outgoing, homa_xmit_control__server_request)
 {
@@ -694,6 +791,24 @@ TEST_F(homa_outgoing, homa_xmit_data__basics)
 	unit_log_throttled(&self->homa);
 	EXPECT_STREQ("", unit_log_get());
 }
+TEST_F(homa_outgoing, homa_xmit_data__first_packet_latency)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 6000, 1000);
+	int bucket = homa_latency_bucket(2000);
+
+	crpc->msgout.granted = 2800;
+	crpc->start_ns = 1000;
+	mock_ns = 3000;
+	homa_xmit_data(crpc, false);
+	EXPECT_EQ(2800, crpc->msgout.next_xmit_offset);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_send_first_pkt_ns[bucket]);
+
+	crpc->msgout.granted = 6000;
+	homa_xmit_data(crpc, false);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_send_first_pkt_ns[bucket]);
+}
 TEST_F(homa_outgoing, homa_xmit_data__stop_because_no_more_granted)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
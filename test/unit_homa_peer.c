@@ -213,6 +213,36 @@ TEST_F(homa_peer, homa_peer_find__route_error)
 
 	EXPECT_EQ(1, homa_metrics_per_cpu()->peer_route_errors);
 }
+TEST_F(homa_peer, homa_peer_find__microbenchmark)
+{
+	int count = unit_bench_iters(1000000);
+	struct in6_addr addr = *ip1111;
+	unsigned long long start;
+	struct homa_peer *peer;
+	char name[100];
+	int i, n;
+
+	/* Lookups of existing peers, with different numbers of peers
+	 * in the table.
+	 */
+	for (n = 10; n <= unit_bench_iters(10000); n *= 10) {
+		for (i = 0; i < n; i++) {
+			addr.s6_addr32[3] = htonl(i);
+			peer = homa_peer_find(&self->peertab, &addr,
+					      &self->hsk.inet);
+			ASSERT_FALSE(IS_ERR(peer));
+		}
+		start = unit_clock_ns();
+		for (i = 0; i < count; i++) {
+			addr.s6_addr32[3] = htonl(i % n);
+			peer = homa_peer_find(&self->peertab, &addr,
+					      &self->hsk.inet);
+		}
+		snprintf(name, sizeof(name), "homa_peer_find (%d peers)", n);
+		unit_bench_report(name, count, unit_clock_ns() - start);
+		EXPECT_EQ_IP(addr, peer->addr);
+	}
+}
 
 TEST_F(homa_peer, homa_dst_refresh__basics)
 {
@@ -216,7 +216,7 @@ TEST_F(homa_plumbing, homa_ioc_abort__basics)
 	ASSERT_NE(NULL, crpc);
 	EXPECT_EQ(0, homa_ioc_abort(&self->hsk.inet.sk, (int *) &args));
 	EXPECT_EQ(RPC_DEAD, crpc->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_ioc_abort__cant_read_user_args)
 {
@@ -240,7 +240,7 @@ TEST_F(homa_plumbing, homa_ioc_abort__abort_multiple_rpcs)
 	EXPECT_EQ(0, homa_ioc_abort(&self->hsk.inet.sk, (int *) &args));
 	EXPECT_EQ(-ECANCELED, crpc1->error);
 	EXPECT_EQ(-ECANCELED, crpc2->error);
-	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(2, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_ioc_abort__nonexistent_rpc)
 {
@@ -314,6 +314,57 @@ TEST_F(homa_plumbing, homa_setsockopt__success)
 	EXPECT_EQ(64, self->hsk.buffer_pool->num_bpages);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_setsockopt__socket_uses_group_pool)
+{
+	struct homa_rcvbuf_args args;
+	struct homa_sock hsk2;
+	char buffer[5000];
+
+	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
+			& ~(PAGE_SIZE - 1));
+	args.length = 64*HOMA_BPAGE_SIZE;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 777));
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&hsk2.sock, IPPROTO_HOMA,
+			SO_HOMA_RCVBUF, self->optval,
+			sizeof(struct homa_rcvbuf_args)));
+	EXPECT_EQ(NULL, hsk2.buffer_pool->region);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_setsockopt_inline__bad_optlen)
+{
+	int value = 100;
+
+	self->optval.user = &value;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(value) + 1));
+	EXPECT_EQ(0, self->hsk.inline_max);
+}
+TEST_F(homa_plumbing, homa_setsockopt_inline__value_out_of_range)
+{
+	int value = HOMA_MAX_INLINE + 1;
+
+	self->optval.user = &value;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(value)));
+	value = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(value)));
+	EXPECT_EQ(0, self->hsk.inline_max);
+}
+TEST_F(homa_plumbing, homa_setsockopt_inline__success)
+{
+	int value = HOMA_MAX_INLINE;
+
+	self->optval.user = &value;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_INLINE, self->optval, sizeof(value)));
+	EXPECT_EQ(HOMA_MAX_INLINE, self->hsk.inline_max);
+}
 
 
 TEST_F(homa_plumbing, homa_getsockopt__success)
@@ -390,34 +441,68 @@ TEST_F(homa_plumbing, homa_getsockopt__cant_copy_out_value)
 	EXPECT_EQ(NULL, val.start);
 	EXPECT_EQ(sizeof32(val), size);
 }
+TEST_F(homa_plumbing, homa_getsockopt_conn_stats__not_connected)
+{
+	struct homa_conn_stats stats;
+	int size = sizeof32(stats);
+
+	EXPECT_EQ(ENOTCONN, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_CONN_STATS, (char *)&stats, &size));
+}
+TEST_F(homa_plumbing, homa_getsockopt_conn_stats__bad_length)
+{
+	struct homa_conn_stats stats;
+	int size = sizeof32(stats) - 1;
+
+	self->hsk.connect = true;
+	EXPECT_EQ(EINVAL, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_CONN_STATS, (char *)&stats, &size));
+	self->hsk.connect = false;
+}
+TEST_F(homa_plumbing, homa_getsockopt_conn_stats__success)
+{
+	struct homa_conn_stats stats;
+	int size = sizeof32(stats) + 10;
+
+	self->hsk.connect = true;
+	atomic64_set(&self->hsk.conn_stats.requests_sent, 3);
+	atomic64_set(&self->hsk.conn_stats.srtt_ns, 12345);
+	EXPECT_EQ(0, -homa_getsockopt(&self->hsk.sock, IPPROTO_HOMA,
+		  SO_HOMA_CONN_STATS, (char *)&stats, &size));
+	EXPECT_EQ(3, stats.requests_sent);
+	EXPECT_EQ(0, stats.responses_sent);
+	EXPECT_EQ(12345, stats.srtt_ns);
+	EXPECT_EQ(sizeof32(stats), size);
+	self->hsk.connect = false;
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__msg_name_null)
 {
 	self->sendmsg_hdr.msg_name = NULL;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__args_not_in_user_space)
 {
 	self->sendmsg_hdr.msg_control_is_user = 0;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__cant_read_args)
 {
 	mock_copy_data_errors = 1;
 	EXPECT_EQ(EFAULT, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__bad_address_family)
 {
 	self->client_addr.in4.sin_family = 1;
 	EXPECT_EQ(EAFNOSUPPORT, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__address_too_short)
 {
@@ -426,54 +511,66 @@ TEST_F(homa_plumbing, homa_sendmsg__address_too_short)
 	self->sendmsg_hdr.msg_namelen = sizeof(struct sockaddr_in) - 1;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 
 	self->client_addr.in4.sin_family = AF_INET6;
 	self->hsk.inet.sk.sk_family = AF_INET6;
 	self->sendmsg_hdr.msg_namelen = sizeof(struct sockaddr_in6) - 1;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__error_in_homa_rpc_new_client)
 {
 	mock_kmalloc_errors = 2;
 	EXPECT_EQ(ENOMEM, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__error_in_homa_message_out_fill)
 {
 	self->sendmsg_hdr.msg_iter.count = HOMA_MAX_MESSAGE_LENGTH+1;
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__cant_update_user_arguments)
 {
 	mock_copy_to_user_errors = 1;
-	atomic64_set(&self->homa.next_outgoing_id, 1234);
+	homa_rpc_set_next_id(&self->homa, 1234);
 	EXPECT_EQ(EFAULT, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_SUBSTR("xmit DATA 200@0", unit_log_get());
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__request_sent_successfully)
 {
 	struct homa_rpc *crpc;
 
-	atomic64_set(&self->homa.next_outgoing_id, 1234);
+	homa_rpc_set_next_id(&self->homa, 1234);
 	self->sendmsg_args.completion_cookie = 88888;
 	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_SUBSTR("xmit DATA 200@0", unit_log_get());
 	EXPECT_EQ(1234L, self->sendmsg_args.id);
-	ASSERT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	ASSERT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
 	ASSERT_NE(NULL, crpc);
 	EXPECT_EQ(88888, crpc->completion_cookie);
 	homa_rpc_unlock(crpc);
 }
+TEST_F(homa_plumbing, homa_sendmsg__request_with_MSG_ZEROCOPY)
+{
+	struct homa_rpc *crpc;
+
+	self->sendmsg_hdr.msg_flags = MSG_ZEROCOPY;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	crpc = homa_find_client_rpc(&self->hsk, self->sendmsg_args.id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_NE(0, atomic_read(&crpc->flags) & RPC_ZEROCOPY);
+	homa_rpc_unlock(crpc);
+}
 TEST_F(homa_plumbing, homa_sendmsg__response_nonzero_completion_cookie)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
@@ -485,7 +582,7 @@ TEST_F(homa_plumbing, homa_sendmsg__response_nonzero_completion_cookie)
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__response_cant_find_rpc)
 {
@@ -497,7 +594,7 @@ TEST_F(homa_plumbing, homa_sendmsg__response_cant_find_rpc)
 	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__response_error_in_rpc)
 {
@@ -510,7 +607,7 @@ TEST_F(homa_plumbing, homa_sendmsg__response_error_in_rpc)
 	EXPECT_EQ(ENOMEM, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_DEAD, srpc->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__response_wrong_state)
 {
@@ -522,7 +619,7 @@ TEST_F(homa_plumbing, homa_sendmsg__response_wrong_state)
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_INCOMING, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__homa_message_out_fill_returns_error)
 {
@@ -535,7 +632,7 @@ TEST_F(homa_plumbing, homa_sendmsg__homa_message_out_fill_returns_error)
 	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_DEAD, srpc->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__rpc_freed_during_homa_message_out_fill)
 {
@@ -550,7 +647,7 @@ TEST_F(homa_plumbing, homa_sendmsg__rpc_freed_during_homa_message_out_fill)
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_DEAD, srpc->state);
 	EXPECT_EQ(0, srpc->msgout.num_skbs);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_sendmsg__response_succeeds)
 {
@@ -562,9 +659,532 @@ TEST_F(homa_plumbing, homa_sendmsg__response_succeeds)
 	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
 		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
 	EXPECT_EQ(RPC_OUTGOING, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_sendmsg__response_service_latency)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 2000, 100);
+
+	srpc->service_ns = 1000;
+	mock_ns = 5000;
+	self->sendmsg_args.id = self->server_id;
+	EXPECT_EQ(0, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_server_service_ns[
+			homa_latency_bucket(4000)]);
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__cant_read_args)
+{
+	struct homa_sendmmsg_args margs;
+
+	memset(&margs, 0, sizeof(margs));
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, 0));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__nonzero_flags)
+{
+	struct homa_sendmmsg_args margs;
+
+	memset(&margs, 0, sizeof(margs));
+	margs.flags = 1;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, 0));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__requests_and_response)
+{
+	struct homa_sendmmsg_msg msgs[3];
+	struct homa_sendmmsg_args margs;
+	struct homa_rpc *srpc;
+	int i;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 100);
+	ASSERT_NE(NULL, srpc);
+	homa_rpc_set_next_id(&self->homa, 1234);
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 3; i++) {
+		msgs[i].buf = self->buffer;
+		msgs[i].length = 100;
+		memcpy(&msgs[i].dest, &self->client_addr,
+				sizeof(msgs[i].dest));
+	}
+	msgs[0].completion_cookie = 111;
+	msgs[1].completion_cookie = 222;
+	msgs[2].id = self->server_id;
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 3;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(3, homa_sendmsg(&self->hsk.inet.sk, &self->sendmsg_hdr, 0));
+	EXPECT_EQ(3, margs.num_sent);
+	EXPECT_EQ(1234, msgs[0].id);
+	EXPECT_EQ(1236, msgs[1].id);
+	EXPECT_EQ(self->server_id, msgs[2].id);
+	EXPECT_EQ(0, msgs[2].error);
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+	EXPECT_EQ(3, unit_count_active_rpcs(&self->hsk));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->send_batch_calls);
+	EXPECT_EQ(3, homa_metrics_per_cpu()->send_batch_msgs);
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__stop_at_first_error)
+{
+	struct homa_sendmmsg_msg msgs[3];
+	struct homa_sendmmsg_args margs;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 3; i++) {
+		msgs[i].buf = self->buffer;
+		msgs[i].length = 100;
+		memcpy(&msgs[i].dest, &self->client_addr,
+				sizeof(msgs[i].dest));
+	}
+	msgs[1].dest.in6.sin6_family = 1;
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 3;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(1, homa_sendmsg(&self->hsk.inet.sk, &self->sendmsg_hdr, 0));
+	EXPECT_EQ(1, margs.num_sent);
+	EXPECT_EQ(0, msgs[0].error);
+	EXPECT_EQ(-EAFNOSUPPORT, msgs[1].error);
+	EXPECT_EQ(0, msgs[2].id);
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__response_for_missing_rpc)
+{
+	struct homa_sendmmsg_msg msgs[2];
+	struct homa_sendmmsg_args margs;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 2; i++) {
+		msgs[i].buf = self->buffer;
+		msgs[i].length = 100;
+		memcpy(&msgs[i].dest, &self->client_addr,
+				sizeof(msgs[i].dest));
+	}
+	msgs[0].id = self->server_id;
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 2;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, 0));
+	EXPECT_EQ(0, margs.num_sent);
+	EXPECT_EQ(-EINVAL, msgs[0].error);
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__first_message_fails)
+{
+	struct homa_sendmmsg_msg msgs[2];
+	struct homa_sendmmsg_args margs;
+
+	memset(msgs, 0, sizeof(msgs));
+	msgs[0].buf = self->buffer;
+	msgs[0].length = HOMA_MAX_MESSAGE_LENGTH + 1;
+	memcpy(&msgs[0].dest, &self->client_addr, sizeof(msgs[0].dest));
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 2;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, 0));
+	EXPECT_EQ(0, margs.num_sent);
+	EXPECT_EQ(-EINVAL, msgs[0].error);
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__more_than_one_chunk)
+{
+	struct homa_sendmmsg_msg msgs[HOMA_SENDMMSG_CHUNK + 2];
+	struct homa_sendmmsg_args margs;
+	int i;
+
+	homa_rpc_set_next_id(&self->homa, 1000);
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < HOMA_SENDMMSG_CHUNK + 2; i++) {
+		msgs[i].buf = self->buffer;
+		msgs[i].length = 100;
+		memcpy(&msgs[i].dest, &self->client_addr,
+				sizeof(msgs[i].dest));
+	}
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = HOMA_SENDMMSG_CHUNK + 2;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(HOMA_SENDMMSG_CHUNK + 2, homa_sendmsg(&self->hsk.inet.sk,
+			&self->sendmsg_hdr, 0));
+	EXPECT_EQ(1000 + 2*(HOMA_SENDMMSG_CHUNK + 1),
+			msgs[HOMA_SENDMMSG_CHUNK + 1].id);
+	EXPECT_EQ(HOMA_SENDMMSG_CHUNK + 2, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__connected_socket)
+{
+	struct homa_sendmmsg_msg msgs[1];
+	struct homa_sendmmsg_args margs;
+	struct homa_rpc *crpc;
+
+	self->hsk.connect = true;
+	self->hsk.remote_host = self->server_addr;
+	memset(msgs, 0, sizeof(msgs));
+	msgs[0].buf = self->buffer;
+	msgs[0].length = 100;
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 1;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+
+	EXPECT_EQ(1, homa_sendmsg(&self->hsk.inet.sk, &self->sendmsg_hdr, 0));
+	crpc = homa_find_client_rpc(&self->hsk, msgs[0].id);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(self->server_port, crpc->dport);
+	homa_rpc_unlock(crpc);
+	self->hsk.connect = false;
+}
+TEST_F(homa_plumbing, homa_sendmsg_batch__cant_copy_out_results)
+{
+	struct homa_sendmmsg_msg msgs[2];
+	struct homa_sendmmsg_args margs;
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 2; i++) {
+		msgs[i].buf = self->buffer;
+		msgs[i].length = 100;
+		memcpy(&msgs[i].dest, &self->client_addr,
+				sizeof(msgs[i].dest));
+	}
+	memset(&margs, 0, sizeof(margs));
+	margs.msgs = msgs;
+	margs.num_msgs = 2;
+	self->sendmsg_hdr.msg_control = &margs;
+	self->sendmsg_hdr.msg_controllen = sizeof(margs);
+	mock_copy_to_user_errors = 1;
+
+	EXPECT_EQ(EFAULT, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, 0));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+
+TEST_F(homa_plumbing, homa_recvmsg_batch__cant_read_args)
+{
+	struct homa_recvmmsg_args args;
+
+	memset(&args, 0, sizeof(args));
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__max_results_zero)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.flags = HOMA_RECVMSG_RESPONSE | HOMA_RECVMSG_NONBLOCKING;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
 }
+TEST_F(homa_plumbing, homa_recvmsg_batch__bogus_flags)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
 
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.flags = 1 << 10;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__release_buffers)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+	__u32 offsets[HOMA_MAX_BPAGES + 2];
+	int i;
+
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool,
+			HOMA_MAX_BPAGES + 2, offsets, 0));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool->descriptors[0].refs));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.bpage_offsets = offsets;
+	args.num_bpages = HOMA_MAX_BPAGES + 2;
+	args.flags = HOMA_RECVMSG_RESPONSE | HOMA_RECVMSG_NONBLOCKING;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	for (i = 0; i < HOMA_MAX_BPAGES + 2; i++)
+		EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[
+				offsets[i] >> HOMA_BPAGE_SHIFT].refs));
+	EXPECT_EQ(0, args.num_results);
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__release_buffers_from_group_member)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+	struct homa_sock hsk2;
+	__u32 offset;
+	int refs;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 777));
+	ASSERT_NE(NULL, unit_server_rpc(&hsk2, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 200));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.flags = HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_NONBLOCKING;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+
+	/* Receive the member's message on the group: its buffer is in the
+	 * group's pool.
+	 */
+	EXPECT_EQ(1, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(777, results[0].completion_cookie);
+	ASSERT_EQ(1, results[0].num_bpages);
+	offset = results[0].bpage_offsets[0];
+	refs = atomic_read(&pool->descriptors[offset >> HOMA_BPAGE_SHIFT].refs);
+	EXPECT_NE(0, refs);
+
+	/* Return the buffer on the group. */
+	args.bpage_offsets = &offset;
+	args.num_bpages = 1;
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(refs - 1, atomic_read(&pool->descriptors[
+			offset >> HOMA_BPAGE_SHIFT].refs));
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__error_in_release_buffers)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+	__u32 offset;
+
+	offset = self->hsk.buffer_pool->num_bpages << HOMA_BPAGE_SHIFT;
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.bpage_offsets = &offset;
+	args.num_bpages = 1;
+	args.flags = HOMA_RECVMSG_RESPONSE | HOMA_RECVMSG_NONBLOCKING;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+
+	EXPECT_EQ(EINVAL, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__several_messages)
+{
+	struct homa_recvmmsg_result results[4];
+	struct homa_recvmmsg_args args;
+	struct homa_rpc *srpc;
+
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000));
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id + 2, 100, 3000));
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			400, 200);
+	ASSERT_NE(NULL, srpc);
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 4;
+	args.flags = HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_RESPONSE;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+
+	EXPECT_EQ(3, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(3, args.num_results);
+	EXPECT_EQ(self->client_id, results[0].id);
+	EXPECT_EQ(2000, results[0].length);
+	EXPECT_EQ(1, results[0].num_bpages);
+	EXPECT_EQ(self->client_id + 2, results[1].id);
+	EXPECT_EQ(3000, results[1].length);
+	EXPECT_EQ(self->server_id, results[2].id);
+	EXPECT_EQ(400, results[2].length);
+	EXPECT_EQ(self->hsk.inet.sk.sk_family, results[2].peer.in6.sin6_family);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->recv_batch_calls);
+	EXPECT_EQ(3, homa_metrics_per_cpu()->recv_batch_msgs);
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__stop_at_max_results)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000));
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id + 2, 100, 3000));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 1;
+	args.flags = HOMA_RECVMSG_RESPONSE;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+
+	EXPECT_EQ(1, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, results[0].id);
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__error_copying_out_result)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.flags = HOMA_RECVMSG_RESPONSE;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	mock_copy_to_user_errors = 1;
+
+	EXPECT_EQ(EFAULT, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, args.num_results);
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__inline_messages)
+{
+	struct homa_recvmmsg_result results[3];
+	struct homa_recvmmsg_args args;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 300));
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id + 2, 100, 3000));
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id + 4, 100, 400));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 3;
+	args.flags = HOMA_RECVMSG_RESPONSE;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	iov.iov_base = self->buffer;
+	iov.iov_len = 500;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 500);
+	unit_log_clear();
+
+	EXPECT_EQ(3, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(300, results[0].length);
+	EXPECT_EQ(0, results[0].num_bpages);
+	EXPECT_EQ(0, results[0].inline_offset);
+	EXPECT_EQ(3000, results[1].length);
+	EXPECT_EQ(1, results[1].num_bpages);
+	EXPECT_EQ(400, results[2].length);
+	EXPECT_EQ(300, results[2].inline_offset);
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 300 bytes", unit_log_get());
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 200 bytes", unit_log_get());
+	EXPECT_EQ(MSG_TRUNC, self->recvmsg_hdr.msg_flags & MSG_TRUNC);
+}
+TEST_F(homa_plumbing, homa_recvmsg_batch__error_copying_inline_message)
+{
+	struct homa_recvmmsg_result results[2];
+	struct homa_recvmmsg_args args;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 300));
+	ASSERT_NE(NULL, unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id + 2, 100, 400));
+	memset(&args, 0, sizeof(args));
+	args.results = results;
+	args.max_results = 2;
+	args.flags = HOMA_RECVMSG_RESPONSE;
+	self->recvmsg_hdr.msg_control = &args;
+	self->recvmsg_hdr.msg_controllen = sizeof(args);
+	iov.iov_base = self->buffer;
+	iov.iov_len = 1000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 1000);
+
+	/* The first copy is for the args. */
+	mock_copy_data_errors = 2;
+	EXPECT_EQ(1, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, args.num_results);
+	EXPECT_EQ(self->client_id, results[0].id);
+	EXPECT_EQ(-EFAULT, results[0].length);
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg__MSG_ERRQUEUE)
+{
+	mock_ipv6 = false;
+	homa_sock_destroy(&self->hsk);
+	mock_sock_init(&self->hsk, &self->homa, 0);
+	unit_log_clear();
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, MSG_ERRQUEUE, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_STREQ("ip_recv_error", unit_log_get());
+
+	mock_ipv6 = true;
+	homa_sock_destroy(&self->hsk);
+	mock_sock_init(&self->hsk, &self->homa, 0);
+	unit_log_clear();
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, MSG_ERRQUEUE, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_STREQ("ipv6_recv_error", unit_log_get());
+}
 TEST_F(homa_plumbing, homa_recvmsg__wrong_args_length)
 {
 	self->recvmsg_hdr.msg_controllen -= 1;
@@ -614,6 +1234,30 @@ TEST_F(homa_plumbing, homa_recvmsg__release_buffers)
 	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[0].refs));
 	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[1].refs));
 }
+TEST_F(homa_plumbing, homa_recvmsg__release_buffers_on_group_member)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 777));
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2,
+			self->recvmsg_args.bpage_offsets, 0));
+	self->recvmsg_args.num_bpages = 2;
+	self->recvmsg_args.bpage_offsets[0] = 0;
+	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
+
+	/* The buffers came from the group's pool, so that's where they
+	 * must be returned even though the call is on the member.
+	 */
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&hsk2.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[1].refs));
+	homa_sock_destroy(&hsk2);
+}
 TEST_F(homa_plumbing, homa_recvmsg__error_in_release_buffers)
 {
 	self->recvmsg_args.num_bpages = 1;
@@ -658,7 +1302,7 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv4)
 			self->server_ip, self->server_port, self->client_id,
 			100, 2000);
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	crpc->completion_cookie = 44444;
 
 	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
@@ -670,10 +1314,122 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv4)
 			self->addr.in4.sin_addr.s_addr));
 	EXPECT_EQ(sizeof32(struct sockaddr_in),
 			self->recvmsg_hdr.msg_namelen);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(1, self->recvmsg_args.num_bpages);
 	EXPECT_EQ(2*HOMA_BPAGE_SIZE, self->recvmsg_args.bpage_offsets[0]);
 }
+TEST_F(homa_plumbing, homa_recvmsg__inline_message)
+{
+	struct homa_rpc *crpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 600);
+	ASSERT_NE(NULL, crpc);
+	iov.iov_base = self->buffer;
+	iov.iov_len = 1000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 1000);
+	unit_log_clear();
+
+	EXPECT_EQ(600, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, self->recvmsg_args.id);
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 600 bytes", unit_log_get());
+	EXPECT_EQ(400, iov_iter_count(&self->recvmsg_hdr.msg_iter));
+	EXPECT_EQ(0, self->recvmsg_hdr.msg_flags & MSG_TRUNC);
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg__inline_message_truncated)
+{
+	struct homa_rpc *crpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 600);
+	ASSERT_NE(NULL, crpc);
+	iov.iov_base = self->buffer;
+	iov.iov_len = 250;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 250);
+	unit_log_clear();
+
+	EXPECT_EQ(600, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 250 bytes", unit_log_get());
+	EXPECT_EQ(MSG_TRUNC, self->recvmsg_hdr.msg_flags & MSG_TRUNC);
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg__inline_message_longer_than_length)
+{
+	struct homa_rpc *crpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 600);
+	ASSERT_NE(NULL, crpc);
+	crpc->msgin.length = 500;
+	iov.iov_base = self->buffer;
+	iov.iov_len = 1000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 1000);
+	unit_log_clear();
+
+	EXPECT_EQ(500, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_SUBSTR("skb_copy_datagram_iter: 500 bytes", unit_log_get());
+	EXPECT_EQ(500, iov_iter_count(&self->recvmsg_hdr.msg_iter));
+}
+TEST_F(homa_plumbing, homa_recvmsg__error_copying_inline_message)
+{
+	struct homa_rpc *srpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			600, 100);
+	ASSERT_NE(NULL, srpc);
+	iov.iov_base = self->buffer;
+	iov.iov_len = 1000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 1000);
+
+	/* The first copy is for the args. */
+	mock_copy_data_errors = 2;
+	EXPECT_EQ(EFAULT, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+}
+TEST_F(homa_plumbing, homa_recvmsg__inline_message_rpc_has_error)
+{
+	struct homa_rpc *crpc;
+	struct iovec iov;
+
+	self->hsk.inline_max = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 600);
+	ASSERT_NE(NULL, crpc);
+	crpc->error = -ETIMEDOUT;
+	iov.iov_base = self->buffer;
+	iov.iov_len = 1000;
+	iov_iter_init(&self->recvmsg_hdr.msg_iter, READ, &iov, 1, 1000);
+	unit_log_clear();
+
+	EXPECT_EQ(ETIMEDOUT, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, self->recvmsg_args.id);
+	EXPECT_NOSUBSTR("skb_copy_datagram_iter", unit_log_get());
+	EXPECT_EQ(1000, iov_iter_count(&self->recvmsg_hdr.msg_iter));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+}
 TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv6)
 {
 	struct in6_addr server_ip6;
@@ -689,7 +1445,7 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv6)
 			&server_ip6, self->server_port, self->client_id,
 			100, 2000);
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	crpc->completion_cookie = 44444;
 
 	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
@@ -701,9 +1457,58 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv6)
 			&self->addr.in6.sin6_addr));
 	EXPECT_EQ(sizeof32(struct sockaddr_in6),
 			self->recvmsg_hdr.msg_namelen);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 }
+TEST_F(homa_plumbing, homa_recvmsg__request_from_group_member)
+{
+	struct homa_rpc *srpc;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 777));
+	srpc = unit_server_rpc(&hsk2, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+
+	EXPECT_EQ(100, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
+	EXPECT_EQ(777, self->recvmsg_args.completion_cookie);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_plumbing, homa_recvmsg__copyout_tail_metrics)
+{
+	struct homa_rpc *crpc;
+
+	self->homa.copyout_min_bytes = 2000;
+	mock_ns = 1000;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			100, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1000, crpc->msgin.complete_ns);
+
+	mock_ns = 5000;
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(4000, homa_metrics_per_cpu()->copyout_tail_ns);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->copyout_tails);
+
+	/* Message too short to count. */
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id + 2,
+			100, 1999);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1999, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->copyout_tails);
+}
 TEST_F(homa_plumbing, homa_recvmsg__rpc_has_error)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
@@ -723,7 +1528,7 @@ TEST_F(homa_plumbing, homa_recvmsg__rpc_has_error)
 	EXPECT_EQ(AF_INET6, self->addr.in6.sin6_family);
 	EXPECT_STREQ("1.2.3.4", homa_print_ipv6_addr(
 			&self->addr.in6.sin6_addr));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
 }
 TEST_F(homa_plumbing, homa_recvmsg__add_ack)
@@ -733,7 +1538,7 @@ TEST_F(homa_plumbing, homa_recvmsg__add_ack)
 			self->client_id, 100, 2000);
 
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	crpc->completion_cookie = 44444;
 
 	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
@@ -752,7 +1557,25 @@ TEST_F(homa_plumbing, homa_recvmsg__server_normal_completion)
 	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
 	EXPECT_EQ(0, srpc->peer->num_acks);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
+}
+TEST_F(homa_plumbing, homa_recvmsg__latency_metrics)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 200);
+
+	EXPECT_NE(NULL, srpc);
+	srpc->handoff_ns = 1000;
+	srpc->msgin.complete_ns = 2000;
+	mock_ns = 10000;
+	EXPECT_EQ(100, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_handoff_to_recv_ns[
+			homa_latency_bucket(9000)]);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->lat_complete_to_recv_ns[
+			homa_latency_bucket(8000)]);
+	EXPECT_EQ(10000, srpc->service_ns);
 }
 TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
 {
@@ -767,7 +1590,7 @@ TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
 			0, 0, &self->recvmsg_hdr.msg_namelen));
 	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
 	EXPECT_EQ(RPC_DEAD, srpc->state);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_recvmsg__error_copying_out_args)
 {
@@ -776,13 +1599,13 @@ TEST_F(homa_plumbing, homa_recvmsg__error_copying_out_args)
 			self->client_id, 100, 2000);
 
 	EXPECT_NE(NULL, crpc);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	mock_copy_to_user_errors = 1;
 
 	EXPECT_EQ(EFAULT, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
 			0, 0, &self->recvmsg_hdr.msg_namelen));
 	EXPECT_EQ(0, self->recvmsg_args.id);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_recvmsg__copy_back_args_even_after_error)
 {
@@ -798,6 +1621,229 @@ TEST_F(homa_plumbing, homa_recvmsg__copy_back_args_even_after_error)
 			0, 0, &self->recvmsg_hdr.msg_namelen));
 	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
 }
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__cant_read_args)
+{
+	struct homa_reply_recv_args rr;
+
+	memset(&rr, 0, sizeof(rr));
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	mock_copy_data_errors = 1;
+	EXPECT_EQ(EFAULT, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__id_not_for_response)
+{
+	struct homa_reply_recv_args rr;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->client_id;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__inline_not_supported)
+{
+	struct homa_reply_recv_args rr;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	self->hsk.inline_max = 100;
+	EXPECT_EQ(EOPNOTSUPP, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__msg_name_null)
+{
+	struct homa_reply_recv_args rr;
+
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	self->sendmsg_hdr.msg_name = NULL;
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__error_sending_response)
+{
+	struct homa_reply_recv_args rr;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			100, 200);
+	ASSERT_NE(NULL, srpc);
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+
+	EXPECT_EQ(EINVAL, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+
+	/* The request must not have been received. */
+	EXPECT_EQ(RPC_INCOMING, srpc->state);
+	EXPECT_EQ(0, rr.recv.id);
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__response_rpc_doesnt_exist)
+{
+	struct homa_reply_recv_args rr;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			300, 100);
+	ASSERT_NE(NULL, srpc);
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+
+	EXPECT_EQ(300, homa_sendmsg(&self->hsk.inet.sk, &self->sendmsg_hdr,
+			self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
+	EXPECT_EQ(self->server_id + 2, rr.recv.id);
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__inline_message_received)
+{
+	struct homa_rpc *srpc1, *srpc2;
+	struct homa_reply_recv_args rr;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 100);
+	ASSERT_NE(NULL, srpc1);
+
+	/* The request arrived while SO_HOMA_INLINE was set. */
+	self->hsk.inline_max = 1000;
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			300, 100);
+	ASSERT_NE(NULL, srpc2);
+	self->hsk.inline_max = 0;
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+
+	EXPECT_EQ(EOPNOTSUPP, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(RPC_OUTGOING, srpc1->state);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc2->state);
+	EXPECT_EQ(self->server_id + 2, rr.recv.id);
+	EXPECT_EQ(htons(self->client_port), rr.peer.in6.sin6_port);
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__success)
+{
+	struct homa_rpc *srpc1, *srpc2;
+	struct homa_reply_recv_args rr;
+
+	srpc1 = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 100);
+	ASSERT_NE(NULL, srpc1);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->client_port, self->server_id + 2,
+			300, 100);
+	ASSERT_NE(NULL, srpc2);
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	unit_log_clear();
+
+	EXPECT_EQ(300, homa_sendmsg(&self->hsk.inet.sk, &self->sendmsg_hdr,
+			self->sendmsg_hdr.msg_iter.count));
+	EXPECT_SUBSTR("xmit DATA 200@0", unit_log_get());
+	EXPECT_EQ(RPC_OUTGOING, srpc1->state);
+	EXPECT_EQ(RPC_IN_SERVICE, srpc2->state);
+	EXPECT_EQ(self->server_id + 2, rr.recv.id);
+	EXPECT_EQ(1, rr.recv.num_bpages);
+	EXPECT_EQ(self->hsk.inet.sk.sk_family, rr.peer.in6.sin6_family);
+	EXPECT_EQ(htons(self->client_port), rr.peer.in6.sin6_port);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reply_recv_calls);
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__release_buffers)
+{
+	struct homa_reply_recv_args rr;
+	struct homa_rpc *srpc;
+	__u32 pages[2];
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 100);
+	ASSERT_NE(NULL, srpc);
+	memset(&rr, 0, sizeof(rr));
+	EXPECT_EQ(0, -homa_pool_get_pages(self->hsk.buffer_pool, 2, pages, 0));
+	memcpy(rr.recv.bpage_offsets, pages, sizeof(pages));
+	rr.recv.num_bpages = 2;
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST | HOMA_RECVMSG_NONBLOCKING;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+
+	EXPECT_EQ(EAGAIN, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+	EXPECT_EQ(0, rr.recv.num_bpages);
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[
+			pages[0] >> HOMA_BPAGE_SHIFT].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool->descriptors[
+			pages[1] >> HOMA_BPAGE_SHIFT].refs));
+	EXPECT_EQ(0, rr.peer.in6.sin6_family);
+}
+TEST_F(homa_plumbing, homa_sendmsg_reply_recv__MSG_DONTWAIT)
+{
+	struct homa_reply_recv_args rr;
+	struct homa_rpc *srpc;
+
+	srpc = unit_server_rpc(&self->hsk, UNIT_IN_SERVICE, self->client_ip,
+			self->server_ip, self->client_port, self->server_id,
+			2000, 100);
+	ASSERT_NE(NULL, srpc);
+	memset(&rr, 0, sizeof(rr));
+	rr.reply_id = self->server_id;
+	rr.recv.flags = HOMA_RECVMSG_REQUEST;
+	self->sendmsg_hdr.msg_control = &rr;
+	self->sendmsg_hdr.msg_controllen = sizeof(rr);
+	self->sendmsg_hdr.msg_flags = MSG_DONTWAIT;
+
+	EXPECT_EQ(EAGAIN, -homa_sendmsg(&self->hsk.inet.sk,
+		&self->sendmsg_hdr, self->sendmsg_hdr.msg_iter.count));
+	EXPECT_EQ(RPC_OUTGOING, srpc->state);
+}
+
+TEST_F(homa_plumbing, homa_connect__success)
+{
+	EXPECT_EQ(0, -homa_connect(&self->hsk.sock,
+		  &self->server_addr.sa, sizeof(self->server_addr)));
+	EXPECT_TRUE(self->hsk.connect);
+	EXPECT_EQ(htons(self->server_port), self->hsk.remote_host.in6.sin6_port);
+	EXPECT_EQ(EISCONN, -homa_connect(&self->hsk.sock,
+		  &self->server_addr.sa, sizeof(self->server_addr)));
+	self->hsk.connect = false;
+}
+TEST_F(homa_plumbing, homa_connect__address_too_short)
+{
+	EXPECT_EQ(EINVAL, -homa_connect(&self->hsk.sock,
+		  &self->server_addr.sa, sizeof(struct sockaddr_in) - 1));
+	EXPECT_FALSE(self->hsk.connect);
+}
+TEST_F(homa_plumbing, homa_connect__socket_is_group)
+{
+	self->hsk.group_members = 1;
+	EXPECT_EQ(EBUSY, -homa_connect(&self->hsk.sock,
+		  &self->server_addr.sa, sizeof(self->server_addr)));
+	EXPECT_FALSE(self->hsk.connect);
+	self->hsk.group_members = 0;
+}
 
 TEST_F(homa_plumbing, homa_softirq__basics)
 {
@@ -805,7 +1851,7 @@ TEST_F(homa_plumbing, homa_softirq__basics)
 
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
 	homa_softirq(skb);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_softirq__cant_pull_header)
 {
@@ -823,7 +1869,7 @@ TEST_F(homa_plumbing, homa_softirq__remove_extra_headers)
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
 	__skb_push(skb, 10);
 	homa_softirq(skb);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 {
@@ -834,7 +1880,7 @@ TEST_F(homa_plumbing, homa_softirq__packet_too_short)
 	skb = mock_skb_new(self->client_ip, &h.common, 0, 0);
 	skb->len -= 1;
 	homa_softirq(skb);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(1, homa_metrics_per_cpu()->short_packets);
 }
 TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
@@ -844,7 +1890,7 @@ TEST_F(homa_plumbing, homa_softirq__bogus_packet_type)
 	self->data.common.type = BOGUS;
 	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
 	homa_softirq(skb);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(1, homa_metrics_per_cpu()->short_packets);
 }
 TEST_F(homa_plumbing, homa_softirq__process_short_messages_first)
@@ -1102,3 +2148,14 @@ TEST_F(homa_plumbing, homa_poll__socket_readable)
 	EXPECT_EQ(POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM,
 		  homa_poll(NULL, &sock, NULL));
 }
+TEST_F(homa_plumbing, homa_poll__zerocopy_notification_pending)
+{
+	struct socket sock = {.sk = &self->hsk.sock};
+	struct sk_buff *skb = alloc_skb(100, GFP_KERNEL);
+
+	__skb_queue_tail(&self->hsk.sock.sk_error_queue, skb);
+	EXPECT_EQ(POLLERR | POLLOUT | POLLWRNORM,
+		  homa_poll(NULL, &sock, NULL));
+	__skb_unlink(skb, &self->hsk.sock.sk_error_queue);
+	kfree_skb(skb);
+}
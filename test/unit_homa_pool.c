@@ -238,6 +238,46 @@ TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 			pool->descriptors[pages[1]].expiration);
 	EXPECT_EQ(2, atomic_read(&pool->descriptors[1].refs));
 }
+TEST_F(homa_pool, homa_pool_get_pages__microbenchmark)
+{
+	static const int occupancies[] = {0, 50, 90, 99};
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	int count = unit_bench_iters(1000000);
+	unsigned long long start;
+	__u32 pages[1], offset;
+	char name[100];
+	int i, j, used;
+
+	/* Each iteration marks a given percentage of the bpages as in use
+	 * (spread across the pool), then measures the cost of allocating
+	 * and releasing a single bpage.
+	 */
+	for (i = 0; i < ARRAY_SIZE(occupancies); i++) {
+		ASSERT_EQ(0, -homa_pool_init(&self->hsk, (void *)0x1000000,
+					     1000 * HOMA_BPAGE_SIZE));
+		used = 0;
+		for (j = 0; j < pool->num_bpages; j++) {
+			if ((j % 100) >= occupancies[i])
+				continue;
+			atomic_set(&pool->descriptors[j].refs, 1);
+			used++;
+		}
+		atomic_set(&pool->free_bpages, pool->num_bpages - used);
+
+		start = unit_clock_ns();
+		for (j = 0; j < count; j++) {
+			homa_pool_get_pages(pool, 1, pages, 0);
+			offset = pages[0] << HOMA_BPAGE_SHIFT;
+			homa_pool_release_buffers(pool, 1, &offset);
+		}
+		snprintf(name, sizeof(name),
+			 "homa_pool_get_pages+release (%d%% full)",
+			 occupancies[i]);
+		unit_bench_report(name, count, unit_clock_ns() - start);
+		EXPECT_EQ(pool->num_bpages - used,
+			  atomic_read(&pool->free_bpages));
+	}
+}
 
 TEST_F(homa_pool, homa_pool_allocate__basics)
 {
@@ -406,6 +446,21 @@ TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 	EXPECT_EQ(0, atomic_read(&pool->descriptors[4].refs));
 	EXPECT_EQ(5, atomic_read(&pool->free_bpages));
 }
+TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage_free_zc)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+
+	pool->zerocopy = 1;
+	atomic_set(&pool->free_bpages, 5);
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000,
+			5*HOMA_BPAGE_SIZE + 100);
+	ASSERT_NE(NULL, crpc);
+
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+	EXPECT_EQ(NULL, crpc->msgin.zc);
+}
 TEST_F(homa_pool, homa_pool_allocate__out_of_space)
 {
 	struct homa_pool *pool = self->hsk.buffer_pool;
@@ -631,3 +686,340 @@ TEST_F(homa_pool, homa_pool_check_waiting__reallocation_fails)
 	EXPECT_STREQ("", unit_log_get());
 	EXPECT_EQ(4, pool->bpages_needed);
 }
+
+TEST_F(homa_pool, homa_pool_mmap__basics)
+{
+	struct vm_area_struct vma;
+
+	memset(&vma, 0, sizeof(vma));
+	EXPECT_EQ(0, -homa_pool_mmap(NULL, NULL, &vma));
+	EXPECT_EQ(VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP, vma.vm_flags);
+	EXPECT_EQ(&homa_pool_vm_ops, vma.vm_ops);
+}
+TEST_F(homa_pool, homa_pool_mmap__shared_mapping)
+{
+	struct vm_area_struct vma;
+
+	memset(&vma, 0, sizeof(vma));
+	ACCESS_PRIVATE(&vma, __vm_flags) = VM_SHARED;
+	EXPECT_EQ(EINVAL, -homa_pool_mmap(NULL, NULL, &vma));
+	EXPECT_EQ(NULL, vma.vm_ops);
+}
+
+TEST_F(homa_pool, homa_pool_mappable)
+{
+	struct vm_area_struct vma;
+	struct socket sock;
+	struct file file;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	vma.vm_end = 0x1000000 + 10*HOMA_BPAGE_SIZE;
+	vma.vm_ops = &homa_pool_vm_ops;
+	vma.vm_file = &file;
+	file.private_data = &sock;
+	self->hsk.sock.sk_socket = &sock;
+
+	/* No VMA. */
+	EXPECT_EQ(0, homa_pool_mappable(&self->hsk, (void *) 0x1000000,
+					10*HOMA_BPAGE_SIZE));
+
+	/* Region extends beyond VMA. */
+	mock_vma = &vma;
+	EXPECT_EQ(0, homa_pool_mappable(&self->hsk, (void *) 0x1000000,
+					11*HOMA_BPAGE_SIZE));
+
+	/* Mapping created for a different socket. */
+	file.private_data = NULL;
+	EXPECT_EQ(0, homa_pool_mappable(&self->hsk, (void *) 0x1000000,
+					10*HOMA_BPAGE_SIZE));
+
+	/* Not created by homa_pool_mmap. */
+	file.private_data = &sock;
+	vma.vm_ops = NULL;
+	EXPECT_EQ(0, homa_pool_mappable(&self->hsk, (void *) 0x1000000,
+					10*HOMA_BPAGE_SIZE));
+
+	/* Success. */
+	vma.vm_ops = &homa_pool_vm_ops;
+	EXPECT_EQ(1, homa_pool_mappable(&self->hsk, (void *) 0x1000000,
+					10*HOMA_BPAGE_SIZE));
+	self->hsk.sock.sk_socket = NULL;
+}
+
+TEST_F(homa_pool, homa_pool_zc_init__basics)
+{
+	struct homa_rpc *crpc;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	ASSERT_NE(NULL, crpc->msgin.zc);
+	EXPECT_EQ(2, crpc->msgin.zc->num_bpages);
+	EXPECT_EQ(0, crpc->msgin.zc->bytes[1]);
+	EXPECT_EQ(NULL, crpc->msgin.zc->pages[2*HOMA_BPAGE_SIZE/PAGE_SIZE - 1]);
+}
+TEST_F(homa_pool, homa_pool_zc_init__no_full_bpages)
+{
+	struct homa_rpc *crpc;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 20000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(NULL, crpc->msgin.zc);
+}
+TEST_F(homa_pool, homa_pool_zc_init__kmalloc_fails)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(NULL, crpc->msgin.zc);
+	mock_kmalloc_errors = 1;
+	homa_pool_zc_init(crpc, 2);
+	EXPECT_EQ(NULL, crpc->msgin.zc);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_recv_failures);
+}
+
+TEST_F(homa_pool, homa_pool_zc_free)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	homa_pool_zc_init(crpc, 2);
+	ASSERT_NE(NULL, crpc->msgin.zc);
+	crpc->msgin.zc->pages[3] = mock_alloc_pages(GFP_KERNEL, 0);
+	crpc->msgin.zc->pages[20] = mock_alloc_pages(GFP_KERNEL, 0);
+	homa_pool_zc_free(crpc);
+	EXPECT_EQ(NULL, crpc->msgin.zc);
+}
+
+TEST_F(homa_pool, homa_pool_zc_add__copy_data)
+{
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+	struct homa_zc_msg *zc;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+	ASSERT_NE(NULL, zc);
+	skb = skb_peek(&crpc->msgin.packets);
+
+	/* The data straddles a page boundary. */
+	EXPECT_EQ(1400, homa_pool_zc_add(crpc, skb,
+			sizeof(struct homa_data_hdr), PAGE_SIZE - 1000, 1400));
+	EXPECT_EQ(1400, zc->bytes[0]);
+	ASSERT_NE(NULL, zc->pages[0]);
+	ASSERT_NE(NULL, zc->pages[1]);
+	EXPECT_EQ(NULL, zc->pages[2]);
+	EXPECT_EQ(0, *((int *) (page_address(zc->pages[0]) + PAGE_SIZE
+			- 1000)));
+	EXPECT_EQ(1000, *((int *) page_address(zc->pages[1])));
+
+	/* Second bpage. */
+	EXPECT_EQ(100, homa_pool_zc_add(crpc, skb,
+			sizeof(struct homa_data_hdr), HOMA_BPAGE_SIZE + 8, 100));
+	EXPECT_EQ(100, zc->bytes[1]);
+	EXPECT_NE(NULL, zc->pages[HOMA_BPAGE_SIZE/PAGE_SIZE]);
+}
+TEST_F(homa_pool, homa_pool_zc_add__data_not_in_full_bpage)
+{
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	skb = skb_peek(&crpc->msgin.packets);
+	EXPECT_EQ(0, homa_pool_zc_add(crpc, skb, sizeof(struct homa_data_hdr),
+			2*HOMA_BPAGE_SIZE, 1000));
+}
+TEST_F(homa_pool, homa_pool_zc_add__cant_allocate_page)
+{
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	skb = skb_peek(&crpc->msgin.packets);
+	mock_alloc_page_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_zc_add(crpc, skb,
+			sizeof(struct homa_data_hdr), 0, 1000));
+	EXPECT_EQ(0, crpc->msgin.zc->bytes[0]);
+}
+TEST_F(homa_pool, homa_pool_zc_add__use_skb_page)
+{
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+	struct homa_zc_msg *zc;
+	struct page *page;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+
+	/* Create a packet whose data is in a single full page. */
+	skb = alloc_skb(100, GFP_KERNEL);
+	skb_put(skb, 60);
+	page = mock_alloc_pages(GFP_KERNEL, 0);
+	skb_frag_fill_page_desc(&skb_shinfo(skb)->frags[0], page, 0,
+				PAGE_SIZE);
+	skb_shinfo(skb)->nr_frags = 1;
+	skb->len += PAGE_SIZE;
+	skb->data_len += PAGE_SIZE;
+
+	mock_compound_order_mask = 1;
+	EXPECT_EQ(PAGE_SIZE, homa_pool_zc_add(crpc, skb, 60, PAGE_SIZE,
+			PAGE_SIZE));
+	EXPECT_EQ(page, zc->pages[1]);
+	EXPECT_EQ(2, mock_page_refs(page));
+	EXPECT_EQ(PAGE_SIZE, homa_metrics_per_cpu()->zerocopy_recv_flip_bytes);
+
+	/* Page is compound: must copy. */
+	EXPECT_EQ(PAGE_SIZE, homa_pool_zc_add(crpc, skb, 60, 2*PAGE_SIZE,
+			PAGE_SIZE));
+	EXPECT_NE(page, zc->pages[2]);
+	EXPECT_EQ(PAGE_SIZE, homa_metrics_per_cpu()->zerocopy_recv_flip_bytes);
+	kfree_skb(skb);
+}
+TEST_F(homa_pool, homa_pool_zc_add__dont_map_file_backed_page)
+{
+	struct homa_rpc *crpc;
+	struct sk_buff *skb;
+	struct homa_zc_msg *zc;
+	struct page *page;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+
+	skb = alloc_skb(100, GFP_KERNEL);
+	skb_put(skb, 60);
+	page = mock_alloc_pages(GFP_KERNEL, 0);
+	page->mapping = (struct address_space *)1;
+	skb_frag_fill_page_desc(&skb_shinfo(skb)->frags[0], page, 0,
+				PAGE_SIZE);
+	skb_shinfo(skb)->nr_frags = 1;
+	skb->len += PAGE_SIZE;
+	skb->data_len += PAGE_SIZE;
+
+	mock_compound_order_mask = 1;
+	EXPECT_EQ(PAGE_SIZE, homa_pool_zc_add(crpc, skb, 60, PAGE_SIZE,
+			PAGE_SIZE));
+	EXPECT_NE(page, zc->pages[1]);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->zerocopy_recv_flip_bytes);
+	page->mapping = NULL;
+	kfree_skb(skb);
+}
+
+TEST_F(homa_pool, homa_pool_zc_map__basics)
+{
+	struct vm_area_struct vma;
+	struct homa_zc_msg *zc;
+	struct homa_rpc *crpc;
+	int i;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	vma.vm_end = 0x1000000 + 100*HOMA_BPAGE_SIZE;
+	vma.vm_ops = &homa_pool_vm_ops;
+	mock_vma = &vma;
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+	ASSERT_NE(NULL, zc);
+	for (i = 0; i < 2*HOMA_BPAGE_SIZE/PAGE_SIZE; i++)
+		zc->pages[i] = mock_alloc_pages(GFP_KERNEL, 0);
+	zc->bytes[1] = HOMA_BPAGE_SIZE;
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_pool_zc_map(crpc));
+	EXPECT_STREQ("zap_page_range_single 0x10000 bytes at 0x1010000; "
+		     "vm_insert_pages 16 pages at 0x1010000", unit_log_get());
+	EXPECT_EQ(0, zc->bytes[0]);
+	EXPECT_EQ(HOMA_ZC_MAPPED, zc->bytes[1]);
+	EXPECT_NE(NULL, zc->pages[HOMA_BPAGE_SIZE/PAGE_SIZE - 1]);
+	EXPECT_EQ(NULL, zc->pages[HOMA_BPAGE_SIZE/PAGE_SIZE]);
+	EXPECT_EQ(HOMA_BPAGE_SIZE,
+		  homa_metrics_per_cpu()->zerocopy_recv_bytes);
+
+	/* Second call: nothing more to map. */
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_pool_zc_map(crpc));
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_pool, homa_pool_zc_map__no_vma)
+{
+	struct homa_zc_msg *zc;
+	struct homa_rpc *crpc;
+	int i;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+	ASSERT_NE(NULL, zc);
+	for (i = 0; i < HOMA_BPAGE_SIZE/PAGE_SIZE; i++)
+		zc->pages[i] = mock_alloc_pages(GFP_KERNEL, 0);
+	zc->bytes[0] = HOMA_BPAGE_SIZE;
+
+	unit_log_clear();
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_pool_zc_map(crpc));
+	EXPECT_SUBSTR("_copy_to_user copied 4096 bytes to 0x100f000",
+		      unit_log_get());
+	EXPECT_EQ(NULL, zc->pages[0]);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_recv_failures);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->zerocopy_recv_bytes);
+}
+TEST_F(homa_pool, homa_pool_zc_map__insert_fails)
+{
+	struct vm_area_struct vma;
+	struct homa_zc_msg *zc;
+	struct homa_rpc *crpc;
+	int i;
+
+	memset(&vma, 0, sizeof(vma));
+	vma.vm_start = 0x1000000;
+	vma.vm_end = 0x1000000 + 100*HOMA_BPAGE_SIZE;
+	vma.vm_ops = &homa_pool_vm_ops;
+	mock_vma = &vma;
+	self->hsk.buffer_pool->zerocopy = 1;
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, &self->client_ip,
+			&self->server_ip, 4000, 98, 1000, 150000);
+	ASSERT_NE(NULL, crpc);
+	zc = crpc->msgin.zc;
+	ASSERT_NE(NULL, zc);
+	for (i = 0; i < HOMA_BPAGE_SIZE/PAGE_SIZE; i++)
+		zc->pages[i] = mock_alloc_pages(GFP_KERNEL, 0);
+	zc->bytes[0] = HOMA_BPAGE_SIZE;
+
+	unit_log_clear();
+	mock_vm_insert_errors = 1;
+	mock_copy_to_user_errors = 2;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(EFAULT, -homa_pool_zc_map(crpc));
+	EXPECT_SUBSTR("zap_page_range_single 0x10000 bytes at 0x1000000; "
+		      "_copy_to_user copied 4096 bytes to 0x1002000;",
+		      unit_log_get());
+	EXPECT_EQ(NULL, zc->pages[0]);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->zerocopy_recv_failures);
+}
@@ -64,7 +64,8 @@ FIXTURE_TEARDOWN(homa_rpc)
 }
 
 /**
- * dead_rpcs() - Logs the ids for all of the RPCS in hsk->dead_rpcs.
+ * dead_rpcs() - Logs the ids for all of the dead RPCs in all of the
+ * shards of a socket.
  * @hsk:  Homa socket to check for dead RPCs.
  *
  * Return: the contents of the unit test log.
@@ -72,12 +73,146 @@ FIXTURE_TEARDOWN(homa_rpc)
 static const char *dead_rpcs(struct homa_sock *hsk)
 {
 	struct homa_rpc *rpc;
+	int i;
 
-	list_for_each_entry_rcu(rpc, &hsk->dead_rpcs, dead_links)
-		UNIT_LOG(" ", "%llu", rpc->id);
+	for (i = 0; i < HOMA_RPC_SHARDS; i++)
+		list_for_each_entry_rcu(rpc, &hsk->rpc_shards[i].dead_rpcs,
+					dead_links)
+			UNIT_LOG(" ", "%llu", rpc->id);
 	return unit_log_get();
 }
 
+TEST_F(homa_rpc, homa_rpc_cache_init__kmalloc_failure)
+{
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_rpc_cache_init(&homa2));
+	EXPECT_EQ(NULL, homa2.rpc_cache);
+}
+
+TEST_F(homa_rpc, homa_rpc_cache_cleanup__free_cached_rpcs)
+{
+	struct homa_rpc *crpc;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	mock_set_core(2);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(1, per_cpu(homa_rpc_core, 2).num_free);
+
+	homa_rpc_cache_cleanup(&self->homa);
+	EXPECT_EQ(0, per_cpu(homa_rpc_core, 2).num_free);
+	EXPECT_EQ(NULL, self->homa.rpc_cache);
+}
+TEST_F(homa_rpc, homa_rpc_cache_cleanup__no_cache)
+{
+	struct homa homa2;
+
+	memset(&homa2, 0, sizeof(homa2));
+	homa_rpc_cache_cleanup(&homa2);
+	EXPECT_EQ(NULL, homa2.rpc_cache);
+}
+
+TEST_F(homa_rpc, homa_rpc_recycle__basics)
+{
+	struct homa_rpc *crpc;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(1, per_cpu(homa_rpc_core, 1).num_free);
+	EXPECT_EQ(crpc, per_cpu(homa_rpc_core, 1).free_rpcs[0]);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_recycles);
+	EXPECT_EQ(0, crpc->magic);
+	EXPECT_TRUE(list_empty(&crpc->ready_links));
+	EXPECT_TRUE(list_empty(&crpc->dead_links));
+}
+TEST_F(homa_rpc, homa_rpc_recycle__freelist_full)
+{
+	struct homa_rpc *crpc;
+	int i;
+
+	for (i = 0; i <= HOMA_RPC_CACHE_SIZE; i++) {
+		crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+		ASSERT_FALSE(IS_ERR(crpc));
+		homa_rpc_free(crpc);
+		homa_rpc_unlock(crpc);
+	}
+	homa_rpc_reap(&self->hsk, 1000);
+	EXPECT_EQ(0, unit_count_dead_rpcs(&self->hsk));
+	EXPECT_EQ(HOMA_RPC_CACHE_SIZE, per_cpu(homa_rpc_core, 1).num_free);
+	EXPECT_EQ(HOMA_RPC_CACHE_SIZE,
+		  homa_metrics_per_cpu()->rpc_recycles);
+}
+
+TEST_F(homa_rpc, homa_rpc_alloc_id__consecutive_ids_from_block)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(2, crpc1->id);
+	EXPECT_EQ(4, crpc2->id);
+	EXPECT_EQ(2 + 2*HOMA_ID_BLOCK,
+		  atomic64_read(&self->homa.next_outgoing_id));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->client_id_blocks);
+}
+TEST_F(homa_rpc, homa_rpc_alloc_id__block_exhausted)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	per_cpu(homa_rpc_core, 1).next_id = per_cpu(homa_rpc_core, 1).id_limit;
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(2 + 2*HOMA_ID_BLOCK, crpc->id);
+	EXPECT_EQ(2, homa_metrics_per_cpu()->client_id_blocks);
+}
+TEST_F(homa_rpc, homa_rpc_alloc_id__separate_blocks_per_core)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	mock_set_core(3);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(2, crpc1->id);
+	EXPECT_EQ(2 + 2*HOMA_ID_BLOCK, crpc2->id);
+	EXPECT_TRUE(homa_is_client(crpc2->id));
+}
+
+TEST_F(homa_rpc, homa_rpc_set_next_id)
+{
+	struct homa_rpc *crpc;
+
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(2, crpc->id);
+	homa_rpc_set_next_id(&self->homa, 5000);
+	EXPECT_EQ(1, atomic_read(&self->homa.id_epoch));
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, 0, 1000, 1000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(5000, crpc->id);
+}
+
 TEST_F(homa_rpc, homa_rpc_new_client__normal)
 {
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
@@ -96,6 +231,71 @@ TEST_F(homa_rpc, homa_rpc_new_client__malloc_error)
 	EXPECT_TRUE(IS_ERR(crpc));
 	EXPECT_EQ(ENOMEM, -PTR_ERR(crpc));
 }
+TEST_F(homa_rpc, homa_rpc_new_client__reuse_recycled_rpc)
+{
+	struct homa_rpc *crpc, *crpc2;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	crpc->handoff_ns = 1000;
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->rpc_cache_hits);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_cache_misses);
+
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc2));
+	EXPECT_EQ(crpc, crpc2);
+	EXPECT_EQ(HOMA_RPC_MAGIC, crpc2->magic);
+	EXPECT_EQ(RPC_OUTGOING, crpc2->state);
+	EXPECT_EQ(0, crpc2->handoff_ns);
+	EXPECT_EQ(0, per_cpu(homa_rpc_core, 1).num_free);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_cache_hits);
+	homa_rpc_free(crpc2);
+	homa_rpc_unlock(crpc2);
+}
+TEST_F(homa_rpc, homa_rpc_new_client__freelist_is_per_core)
+{
+	struct homa_rpc *crpc;
+
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	homa_rpc_reap(&self->hsk, 10);
+
+	mock_set_core(3);
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	EXPECT_EQ(1, per_cpu(homa_rpc_core, 1).num_free);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->rpc_cache_hits);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_cache_misses);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
+TEST_F(homa_rpc, homa_rpc_new_client__microbenchmark)
+{
+	int count = unit_bench_iters(100000);
+	unsigned long long start;
+	struct homa_rpc *crpc;
+	int i;
+
+	start = unit_clock_ns();
+	for (i = 0; i < count; i++) {
+		crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+		ASSERT_FALSE(IS_ERR(crpc));
+		homa_rpc_free(crpc);
+		homa_rpc_unlock(crpc);
+		homa_rpc_reap(&self->hsk, 10);
+		unit_log_clear();
+	}
+	unit_bench_report("homa_rpc create/free/reap", count,
+			  unit_clock_ns() - start);
+	EXPECT_EQ(count - 1, homa_metrics_per_cpu()->rpc_cache_hits);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->rpc_cache_misses);
+	EXPECT_EQ(count, homa_metrics_per_cpu()->rpc_recycles);
+}
 TEST_F(homa_rpc, homa_rpc_new_client__route_error)
 {
 	struct homa_rpc *crpc;
@@ -115,6 +315,37 @@ TEST_F(homa_rpc, homa_rpc_new_client__socket_shutdown)
 	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(crpc));
 	self->hsk.shutdown = 0;
 }
+TEST_F(homa_rpc, homa_rpc_new_client__shard_for_current_core)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	mock_set_core(2);
+	crpc1 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc1));
+	homa_rpc_unlock(crpc1);
+	mock_set_core(3);
+	crpc2 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc2));
+	homa_rpc_unlock(crpc2);
+	EXPECT_EQ(&self->hsk.rpc_shards[2], crpc1->shard);
+	EXPECT_EQ(&self->hsk.rpc_shards[3], crpc2->shard);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.rpc_shards[2].active_rpcs));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.rpc_shards[3].active_rpcs));
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+}
+TEST_F(homa_rpc, homa_rpc_new_client__dont_lock_socket)
+{
+	struct homa_rpc *crpc;
+
+	mock_trylock_errors = 0xff;
+	crpc = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->shard_lock_misses);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->socket_lock_misses);
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+}
 
 TEST_F(homa_rpc, homa_rpc_new_server__normal)
 {
@@ -129,10 +360,31 @@ TEST_F(homa_rpc, homa_rpc_new_server__normal)
 	homa_data_pkt(mock_skb_new(self->client_ip, &self->data.common,
 			1400, 0), srpc);
 	EXPECT_EQ(RPC_INCOMING, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(1, created);
 	homa_rpc_free(srpc);
 }
+TEST_F(homa_rpc, homa_rpc_new_server__reuse_recycled_rpc)
+{
+	struct homa_rpc *srpc, *srpc2;
+	int created;
+
+	srpc = homa_rpc_new_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	ASSERT_FALSE(IS_ERR(srpc));
+	homa_rpc_unlock(srpc);
+	srpc->handoff_ns = 1000;
+	homa_rpc_free(srpc);
+	homa_rpc_reap(&self->hsk, 10);
+
+	srpc2 = homa_rpc_new_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	ASSERT_FALSE(IS_ERR(srpc2));
+	homa_rpc_unlock(srpc2);
+	EXPECT_EQ(srpc, srpc2);
+	EXPECT_EQ(0, srpc2->handoff_ns);
+	homa_rpc_free(srpc2);
+}
 TEST_F(homa_rpc, homa_rpc_new_server__already_exists)
 {
 	struct homa_rpc *srpc1, *srpc2, *srpc3;
@@ -193,7 +445,22 @@ TEST_F(homa_rpc, homa_rpc_new_server__socket_shutdown)
 			&created);
 	EXPECT_TRUE(IS_ERR(srpc));
 	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(srpc));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+	self->hsk.shutdown = 0;
+}
+TEST_F(homa_rpc, homa_rpc_new_server__socket_shutdown_release_buffers)
+{
+	struct homa_rpc *srpc;
+	int created;
+
+	self->hsk.buffer_pool->zerocopy = 1;
+	self->hsk.shutdown = 1;
+	self->data.message_length = N(3*HOMA_BPAGE_SIZE);
+	srpc = homa_rpc_new_server(&self->hsk, self->client_ip, &self->data,
+			&created);
+	EXPECT_TRUE(IS_ERR(srpc));
+	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(srpc));
+	EXPECT_EQ(100, atomic_read(&self->hsk.buffer_pool->free_bpages));
 	self->hsk.shutdown = 0;
 }
 TEST_F(homa_rpc, homa_rpc_new_server__allocate_buffers)
@@ -232,7 +499,7 @@ TEST_F(homa_rpc, homa_rpc_new_server__handoff_rpc)
 	ASSERT_FALSE(IS_ERR(srpc));
 	homa_rpc_unlock(srpc);
 	EXPECT_EQ(RPC_INCOMING, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
 	homa_rpc_free(srpc);
 }
@@ -262,7 +529,7 @@ TEST_F(homa_rpc, homa_rpc_new_server__dont_handoff_rpc)
 	ASSERT_FALSE(IS_ERR(srpc));
 	homa_rpc_unlock(srpc);
 	EXPECT_EQ(RPC_INCOMING, srpc->state);
-	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&self->hsk));
 	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
 	homa_rpc_free(srpc);
 }
@@ -310,7 +577,7 @@ TEST_F(homa_rpc, homa_rpc_acked__basics)
 	ack.server_port = htons(self->server_port);
 	ack.client_id = cpu_to_be64(self->client_id);
 	homa_rpc_acked(&hsk, self->client_ip, &ack);
-	EXPECT_EQ(0, unit_list_length(&hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&hsk));
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 	homa_sock_destroy(&hsk);
 }
@@ -328,7 +595,7 @@ TEST_F(homa_rpc, homa_rpc_acked__lookup_socket)
 	ack.server_port = htons(self->server_port);
 	ack.client_id = cpu_to_be64(self->client_id);
 	homa_rpc_acked(&self->hsk, self->client_ip, &ack);
-	EXPECT_EQ(0, unit_list_length(&hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&hsk));
 	EXPECT_STREQ("DEAD", homa_symbol_for_state(srpc));
 	homa_sock_destroy(&hsk);
 }
@@ -346,7 +613,7 @@ TEST_F(homa_rpc, homa_rpc_acked__no_such_socket)
 	ack.server_port = htons(self->server_port+1);
 	ack.client_id = cpu_to_be64(self->client_id);
 	homa_rpc_acked(&hsk, self->client_ip, &ack);
-	EXPECT_EQ(1, unit_list_length(&hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&hsk));
 	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc));
 	homa_sock_destroy(&hsk);
 }
@@ -364,7 +631,7 @@ TEST_F(homa_rpc, homa_rpc_acked__no_such_rpc)
 	ack.server_port = htons(self->server_port);
 	ack.client_id = cpu_to_be64(self->client_id+10);
 	homa_rpc_acked(&hsk, self->client_ip, &ack);
-	EXPECT_EQ(1, unit_list_length(&hsk.active_rpcs));
+	EXPECT_EQ(1, unit_count_active_rpcs(&hsk));
 	EXPECT_STREQ("OUTGOING", homa_symbol_for_state(srpc));
 	homa_sock_destroy(&hsk);
 }
@@ -382,8 +649,8 @@ TEST_F(homa_rpc, homa_rpc_free__basics)
 	homa_rpc_free(crpc);
 	EXPECT_EQ(0, self->homa.num_grantable_rpcs);
 	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, crpc->id));
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
-	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
+	EXPECT_EQ(1, unit_count_dead_rpcs(&self->hsk));
 }
 TEST_F(homa_rpc, homa_rpc_free__already_dead)
 {
@@ -411,6 +678,54 @@ TEST_F(homa_rpc, homa_rpc_free__state_ready)
 	homa_rpc_free(crpc);
 	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
 }
+TEST_F(homa_rpc, homa_rpc_free__dont_lock_socket)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 100);
+
+	ASSERT_NE(NULL, crpc);
+	mock_trylock_errors = 0xff;
+	homa_rpc_free(crpc);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->shard_lock_misses);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->socket_lock_misses);
+	EXPECT_EQ(1, unit_count_dead_rpcs(&self->hsk));
+}
+TEST_F(homa_rpc, homa_rpc_free__lock_socket_for_ready_rpc)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 1000, 100);
+
+	ASSERT_NE(NULL, crpc);
+	mock_trylock_errors = 0xff;
+	mock_ns_tick = 10;
+	homa_rpc_free(crpc);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->socket_lock_misses);
+	EXPECT_NE(0, homa_metrics_per_cpu()->socket_lock_op_ns[HOMA_LOCK_FREE]);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+}
+TEST_F(homa_rpc, homa_rpc_free__rpc_queued_in_group)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *crpc;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	crpc = unit_client_rpc(&hsk2, UNIT_RCVD_MSG, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 100);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_responses));
+
+	homa_rpc_free(crpc);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_responses));
+	EXPECT_TRUE(list_empty(&crpc->ready_links));
+	homa_sock_destroy(&hsk2);
+}
 TEST_F(homa_rpc, homa_rpc_free__wakeup_interest)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -458,14 +773,14 @@ TEST_F(homa_rpc, homa_rpc_free__dead_buffs)
 	ASSERT_NE(NULL, crpc1);
 	homa_rpc_free(crpc1);
 	EXPECT_EQ(9, self->homa.max_dead_buffs);
-	EXPECT_EQ(9, self->hsk.dead_skbs);
+	EXPECT_EQ(9, atomic_read(&self->hsk.dead_skbs));
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
 			self->server_port, self->client_id+2, 5000, 1000);
 	ASSERT_NE(NULL, crpc2);
 	homa_rpc_free(crpc2);
 	EXPECT_EQ(14, self->homa.max_dead_buffs);
-	EXPECT_EQ(14, self->hsk.dead_skbs);
+	EXPECT_EQ(14, atomic_read(&self->hsk.dead_skbs));
 }
 TEST_F(homa_rpc, homa_rpc_free__remove_from_throttled_list)
 {
@@ -479,6 +794,72 @@ TEST_F(homa_rpc, homa_rpc_free__remove_from_throttled_list)
 	homa_rpc_free(crpc);
 	EXPECT_EQ(0, unit_list_length(&self->homa.throttled_rpcs));
 }
+TEST_F(homa_rpc, homa_rpc_free__queue_reap_work)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 1000);
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	self->homa.reap_work_skbs = 10;
+
+	/* First RPC: not enough dead skbs yet. */
+	unit_log_clear();
+	homa_rpc_free(crpc1);
+	EXPECT_EQ(9, atomic_read(&self->hsk.dead_skbs));
+	EXPECT_STREQ("homa_rpc_free invoked", unit_log_get());
+
+	/* Second RPC: crosses the threshold. */
+	unit_log_clear();
+	homa_rpc_free(crpc2);
+	EXPECT_STREQ("homa_rpc_free invoked; queue_work", unit_log_get());
+}
+TEST_F(homa_rpc, homa_rpc_free__dont_queue_reap_work_after_shutdown)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.reap_work_skbs = 1;
+	self->hsk.shutdown = true;
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_STREQ("homa_rpc_free invoked", unit_log_get());
+	self->hsk.shutdown = false;
+}
+TEST_F(homa_rpc, homa_rpc_free__reap_work_already_pending)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.reap_work_skbs = 1;
+	set_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(&self->hsk.reap_work));
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_STREQ("homa_rpc_free invoked", unit_log_get());
+	clear_bit(WORK_STRUCT_PENDING_BIT,
+		  work_data_bits(&self->hsk.reap_work));
+}
+TEST_F(homa_rpc, homa_rpc_free__reap_workers_disabled)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.reap_work_skbs = 1;
+	self->homa.reap_workers = 0;
+	unit_log_clear();
+	homa_rpc_free(crpc);
+	EXPECT_STREQ("homa_rpc_free invoked", unit_log_get());
+}
 
 TEST_F(homa_rpc, homa_rpc_reap__basics)
 {
@@ -500,13 +881,59 @@ TEST_F(homa_rpc, homa_rpc_reap__basics)
 	homa_rpc_free(crpc3);
 	unit_log_clear();
 	EXPECT_STREQ("1234 1236 1238", dead_rpcs(&self->hsk));
-	EXPECT_EQ(11, self->hsk.dead_skbs);
+	EXPECT_EQ(11, atomic_read(&self->hsk.dead_skbs));
 	unit_log_clear();
 	EXPECT_EQ(1, homa_rpc_reap(&self->hsk, 7));
 	EXPECT_STREQ("reaped 1234", unit_log_get());
 	unit_log_clear();
 	EXPECT_STREQ("1236 1238", dead_rpcs(&self->hsk));
-	EXPECT_EQ(2, self->hsk.dead_skbs);
+	EXPECT_EQ(2, atomic_read(&self->hsk.dead_skbs));
+}
+TEST_F(homa_rpc, homa_rpc_reap__multiple_shards)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	mock_set_core(2);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 100);
+	mock_set_core(5);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+2,
+			1000, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
+	EXPECT_STREQ("reaped 1234; reaped 1236", unit_log_get());
+	EXPECT_EQ(0, unit_count_dead_rpcs(&self->hsk));
+	EXPECT_EQ(0, atomic_read(&self->hsk.dead_skbs));
+}
+TEST_F(homa_rpc, homa_rpc_reap__skip_shard_with_no_reapable_rpcs)
+{
+	struct homa_rpc *crpc1, *crpc2;
+
+	mock_set_core(2);
+	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 100);
+	mock_set_core(5);
+	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id+2,
+			1000, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	atomic_or(RPC_COPYING_TO_USER, &crpc1->flags);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
+	EXPECT_STREQ("reaped 1236", unit_log_get());
+	unit_log_clear();
+	EXPECT_STREQ("1234", dead_rpcs(&self->hsk));
+	atomic_andnot(RPC_COPYING_TO_USER, &crpc1->flags);
 }
 TEST_F(homa_rpc, homa_rpc_reap__protected)
 {
@@ -600,11 +1027,11 @@ TEST_F(homa_rpc, homa_rpc_reap__hit_limit_in_msgout_packets)
 
 	ASSERT_NE(NULL, crpc);
 	homa_rpc_free(crpc);
-	EXPECT_EQ(9, self->hsk.dead_skbs);
+	EXPECT_EQ(9, atomic_read(&self->hsk.dead_skbs));
 	unit_log_clear();
 	homa_rpc_reap(&self->hsk, 5);
 	EXPECT_STREQ("1234", dead_rpcs(&self->hsk));
-	EXPECT_EQ(4, self->hsk.dead_skbs);
+	EXPECT_EQ(4, atomic_read(&self->hsk.dead_skbs));
 }
 TEST_F(homa_rpc, homa_rpc_reap__release_buffers)
 {
@@ -644,24 +1071,66 @@ TEST_F(homa_rpc, homa_rpc_reap__nothing_to_reap)
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
 }
 
+TEST_F(homa_rpc, homa_rpc_reap_work__reap_everything)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 2000, 100);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	unit_log_clear();
+	homa_rpc_reap_work(&self->hsk.reap_work);
+	EXPECT_STREQ("reaped 1234", unit_log_get());
+	EXPECT_EQ(0, atomic_read(&self->hsk.dead_skbs));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->reap_work_calls);
+}
+TEST_F(homa_rpc, homa_rpc_reap_work__requeue_if_more_work)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(9, atomic_read(&self->hsk.dead_skbs));
+	unit_log_clear();
+	homa_rpc_reap_work(&self->hsk.reap_work);
+	EXPECT_STREQ("queue_work", unit_log_get());
+	EXPECT_EQ(4, atomic_read(&self->hsk.dead_skbs));
+}
+TEST_F(homa_rpc, homa_rpc_reap_work__dont_requeue_after_shutdown)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 10000, 1000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	unit_log_clear();
+	self->hsk.shutdown = true;
+	homa_rpc_reap_work(&self->hsk.reap_work);
+	self->hsk.shutdown = false;
+	EXPECT_STREQ("", unit_log_get());
+}
+
 TEST_F(homa_rpc, homa_find_client_rpc)
 {
 	struct homa_rpc *crpc1, *crpc2, *crpc3, *crpc4;
 
-	atomic64_set(&self->homa.next_outgoing_id, 3);
+	homa_rpc_set_next_id(&self->homa, 3);
 	crpc1 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id,
 			10000, 1000);
-	atomic64_set(&self->homa.next_outgoing_id, 3 + 3*HOMA_CLIENT_RPC_BUCKETS);
+	homa_rpc_set_next_id(&self->homa, 3 + 3*HOMA_CLIENT_RPC_BUCKETS);
 	crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id+2,
 			10000, 1000);
-	atomic64_set(&self->homa.next_outgoing_id,
-			3 + 10*HOMA_CLIENT_RPC_BUCKETS);
+	homa_rpc_set_next_id(&self->homa, 3 + 10*HOMA_CLIENT_RPC_BUCKETS);
 	crpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id+4,
 			10000, 1000);
-	atomic64_set(&self->homa.next_outgoing_id, 40);
+	homa_rpc_set_next_id(&self->homa, 40);
 	crpc4 = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
 			self->server_ip, self->server_port, self->client_id+6,
 			10000, 1000);
@@ -52,28 +52,32 @@ static struct sk_buff *test_skb(struct homa *homa)
 static void add_to_pool(struct homa *homa, int num_pages, int core)
 {
 	struct homa_page_pool *pool = get_skb_core(core)->pool;
-	int i;
+	struct homa_page_mag *mag = NULL;
+	int i, j;
 
 	for (i = 0; i < num_pages; i++) {
-		pool->pages[pool->avail] = alloc_pages(GFP_KERNEL,
+		if (!mag || mag->count == HOMA_PAGE_MAG_SIZE) {
+			for (j = 0; j < HOMA_PAGE_POOL_MAGS; j++) {
+				if (pool->empty[j]) {
+					mag = pool->empty[j];
+					pool->empty[j] = NULL;
+					break;
+				}
+			}
+			for (j = 0; j < HOMA_PAGE_POOL_MAGS; j++) {
+				if (!pool->full[j]) {
+					pool->full[j] = mag;
+					break;
+				}
+			}
+		}
+		mag->pages[mag->count] = alloc_pages(GFP_KERNEL,
 				HOMA_SKB_PAGE_ORDER);
-		pool->avail++;
+		mag->count++;
+		atomic_inc(&pool->avail);
 	}
 }
 
-static struct homa_page_pool *hook_pool;
-
-/* Used to remove a page from hook_pool when a lock is acquired. */
-static void spinlock_hook(char *id)
-{
-	if (strcmp(id, "spin_lock") != 0)
-		return;
-	if ((hook_pool == NULL) || (hook_pool->avail == 0))
-		return;
-	hook_pool->avail--;
-	put_page(hook_pool->pages[hook_pool->avail]);
-}
-
 FIXTURE(homa_skb) {
 	struct homa homa;
 	struct sk_buff *skb;
@@ -107,6 +111,11 @@ TEST_F(homa_skb, homa_skb_init__success)
 	EXPECT_EQ(self->homa.page_pools[0], get_skb_core(6)->pool);
 	EXPECT_EQ(self->homa.page_pools[1], get_skb_core(7)->pool);
 	EXPECT_EQ(1, self->homa.max_numa);
+	EXPECT_NE(NULL, self->homa.page_pools[0]->empty[0]);
+	EXPECT_NE(NULL, self->homa.page_pools[1]->empty[HOMA_PAGE_POOL_MAGS-1]);
+	EXPECT_EQ(NULL, self->homa.page_pools[1]->full[0]);
+	EXPECT_NE(NULL, get_skb_core(0)->mag);
+	EXPECT_NE(NULL, get_skb_core(7)->spare_mag);
 }
 TEST_F(homa_skb, homa_skb_init__kmalloc_failure)
 {
@@ -129,18 +138,117 @@ TEST_F(homa_skb, homa_skb_cleanup)
 	add_to_pool(&self->homa, 4, 3);
 	mock_set_core(3);
 	homa_skb_stash_pages(&self->homa, 2 * HOMA_SKB_PAGE_SIZE - 100);
-	EXPECT_EQ(5, get_skb_core(2)->pool->avail);
-	EXPECT_EQ(2, get_skb_core(3)->pool->avail);
-	EXPECT_EQ(2, get_skb_core(3)->num_stashed_pages);
+	EXPECT_EQ(5, atomic_read(&get_skb_core(2)->pool->avail));
+	EXPECT_EQ(0, atomic_read(&get_skb_core(3)->pool->avail));
+	EXPECT_EQ(4, get_skb_core(3)->spare_mag->count);
 
 	homa_skb_cleanup(&self->homa);
 	EXPECT_EQ(NULL, skb_core->pool);
 	EXPECT_EQ(NULL, skb_core->skb_page);
-	EXPECT_EQ(0, get_skb_core(3)->num_stashed_pages);
+	EXPECT_EQ(NULL, get_skb_core(3)->mag);
+	EXPECT_EQ(NULL, get_skb_core(3)->spare_mag);
 
 	skb_core = get_skb_core(nr_cpu_ids-1);
 	EXPECT_EQ(NULL, skb_core->pool);
 }
+TEST_F(homa_skb, homa_skb_cleanup__free_cached_skbs)
+{
+	struct sk_buff *skb1, *skb2;
+
+	skb1 = homa_skb_new_tx(100);
+	skb2 = homa_skb_new_tx(100);
+	homa_skb_free_tx(&self->homa, skb1);
+	homa_skb_free_tx(&self->homa, skb2);
+	EXPECT_EQ(2, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+
+	homa_skb_cleanup(&self->homa);
+	EXPECT_EQ(0, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+}
+
+TEST_F(homa_skb, homa_skb_new_tx__cache_hit)
+{
+	struct sk_buff *skb1, *skb2;
+
+	skb1 = homa_skb_new_tx(100);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_cache_misses);
+	homa_skb_free_tx(&self->homa, skb1);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_recycles);
+
+	skb2 = homa_skb_new_tx(200);
+	EXPECT_EQ(skb1, skb2);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_cache_hits);
+	EXPECT_EQ(0, skb2->len);
+	EXPECT_EQ(HOMA_SKB_EXTRA + HOMA_IPV6_HEADER_LENGTH,
+		  skb_headroom(skb2));
+	EXPECT_EQ(0, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+	kfree_skb(skb2);
+}
+TEST_F(homa_skb, homa_skb_new_tx__length_too_large_for_cache)
+{
+	struct sk_buff *skb1, *skb2;
+
+	skb1 = homa_skb_new_tx(100);
+	homa_skb_free_tx(&self->homa, skb1);
+	EXPECT_EQ(1, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+
+	skb2 = homa_skb_new_tx(HOMA_MAX_HEADER + 1);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->skb_cache_hits);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_cache_misses);
+	EXPECT_EQ(1, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+	kfree_skb(skb2);
+}
+TEST_F(homa_skb, homa_skb_new_tx__alloc_fails)
+{
+	mock_alloc_skb_errors = 1;
+	EXPECT_EQ(NULL, homa_skb_new_tx(100));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_cache_misses);
+}
+
+TEST_F(homa_skb, homa_skb_recycle__basics)
+{
+	struct sk_buff *skb;
+
+	skb = homa_skb_new_tx(100);
+	skb_put(skb, 50);
+	skb->priority = 3;
+	EXPECT_TRUE(homa_skb_recycle(skb));
+	EXPECT_EQ(0, skb->len);
+	EXPECT_EQ(0, skb->priority);
+	EXPECT_EQ(1, refcount_read(&skb->users));
+	EXPECT_EQ(1, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+}
+TEST_F(homa_skb, homa_skb_recycle__extra_reference)
+{
+	struct sk_buff *skb;
+
+	skb = homa_skb_new_tx(100);
+	skb_get(skb);
+	EXPECT_FALSE(homa_skb_recycle(skb));
+	EXPECT_EQ(0, get_skb_core(raw_smp_processor_id())->num_cached_skbs);
+	kfree_skb(skb);
+	kfree_skb(skb);
+}
+TEST_F(homa_skb, homa_skb_recycle__linear_area_too_small)
+{
+	struct sk_buff *skb;
+
+	skb = alloc_skb(100, GFP_ATOMIC);
+	EXPECT_FALSE(homa_skb_recycle(skb));
+	kfree_skb(skb);
+}
+TEST_F(homa_skb, homa_skb_recycle__cache_full)
+{
+	struct homa_skb_core *skb_core;
+	struct sk_buff *skb;
+
+	skb_core = get_skb_core(raw_smp_processor_id());
+	skb = homa_skb_new_tx(100);
+	skb_core->num_cached_skbs = HOMA_SKB_CACHE_SIZE;
+	EXPECT_FALSE(homa_skb_recycle(skb));
+	EXPECT_EQ(0, homa_metrics_per_cpu()->skb_recycles);
+	skb_core->num_cached_skbs = 0;
+	kfree_skb(skb);
+}
 
 TEST_F(homa_skb, homa_skb_stash_pages)
 {
@@ -148,26 +256,34 @@ TEST_F(homa_skb, homa_skb_stash_pages)
 	struct homa_skb_core *skb_core;
 
 	skb_core = get_skb_core(id);
-	add_to_pool(&self->homa, 5, id);
-	EXPECT_EQ(5, skb_core->pool->avail);
-	EXPECT_EQ(0, skb_core->num_stashed_pages);
+	add_to_pool(&self->homa, 6, id);
+	EXPECT_EQ(6, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(0, skb_core->mag->count);
 
 	/* First attempt: message too small. */
 	homa_skb_stash_pages(&self->homa, 10000);
-	EXPECT_EQ(0, skb_core->num_stashed_pages);
+	EXPECT_EQ(0, skb_core->spare_mag->count);
 
-	/* Second attempt: stash pages. */
+	/* Second attempt: refill spare magazine from pool. */
 	homa_skb_stash_pages(&self->homa, 3*HOMA_SKB_PAGE_SIZE - 100);
-	EXPECT_EQ(3, skb_core->num_stashed_pages);
-	EXPECT_EQ(2, skb_core->pool->avail);
+	EXPECT_EQ(4, skb_core->spare_mag->count);
+	EXPECT_EQ(2, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(4, atomic_read(&skb_core->pool->demand));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_page_mag_refills);
 
-	/* Third attempt: existing stash adequate. */
+	/* Third attempt: spare magazine isn't empty. */
 	homa_skb_stash_pages(&self->homa, 3 * HOMA_SKB_PAGE_SIZE - 100);
-	EXPECT_EQ(3, skb_core->num_stashed_pages);
+	EXPECT_EQ(4, skb_core->spare_mag->count);
+	EXPECT_EQ(2, atomic_read(&skb_core->pool->avail));
+}
+TEST_F(homa_skb, homa_skb_stash_pages__pool_empty)
+{
+	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
 
-	/* Fourth attempt: not enough pages in pool. */
-	homa_skb_stash_pages(&self->homa, 8 * HOMA_SKB_PAGE_SIZE - 100);
-	EXPECT_EQ(5, skb_core->num_stashed_pages);
+	homa_skb_stash_pages(&self->homa, 3*HOMA_SKB_PAGE_SIZE - 100);
+	EXPECT_EQ(0, skb_core->mag->count);
+	EXPECT_EQ(0, skb_core->spare_mag->count);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->skb_page_mag_refills);
 }
 
 TEST_F(homa_skb, homa_skb_extend_frags__basics)
@@ -312,45 +428,47 @@ TEST_F(homa_skb, homa_skb_page_alloc__from_stash)
 
 	add_to_pool(&self->homa, 5, raw_smp_processor_id());
 	homa_skb_stash_pages(&self->homa, 3*HOMA_SKB_PAGE_SIZE - 100);
+	EXPECT_EQ(1, atomic_read(&skb_core->pool->avail));
 	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
 	EXPECT_NE(NULL, skb_core->skb_page);
 	EXPECT_EQ(HOMA_SKB_PAGE_SIZE, skb_core->page_size);
 	EXPECT_EQ(0, skb_core->page_inuse);
-	EXPECT_EQ(2, skb_core->num_stashed_pages);
+	EXPECT_EQ(3, skb_core->mag->count);
+	EXPECT_EQ(0, skb_core->spare_mag->count);
+	EXPECT_EQ(1, atomic_read(&skb_core->pool->avail));
 }
 TEST_F(homa_skb, homa_skb_page_alloc__from_pool)
 {
 	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
 
 	add_to_pool(&self->homa, 5, raw_smp_processor_id());
-	EXPECT_EQ(5, skb_core->pool->avail);
-	EXPECT_EQ(0, skb_core->num_stashed_pages);
+	EXPECT_EQ(5, atomic_read(&skb_core->pool->avail));
 	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
 	EXPECT_NE(NULL, skb_core->skb_page);
-	EXPECT_EQ(4, skb_core->pool->avail);
+	EXPECT_EQ(1, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(3, skb_core->mag->count);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_page_mag_refills);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->skb_page_allocs);
 }
-TEST_F(homa_skb, homa_skb_page_alloc__pool_page_taken_while_locking)
+TEST_F(homa_skb, homa_skb_page_alloc__from_spare_magazine)
 {
 	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
+	struct homa_page_mag *spare = skb_core->spare_mag;
 
-	add_to_pool(&self->homa, 1, raw_smp_processor_id());
-	EXPECT_EQ(1, skb_core->pool->avail);
-	EXPECT_EQ(0, skb_core->num_stashed_pages);
-	hook_pool = skb_core->pool;
-	unit_hook_register(spinlock_hook);
-	mock_alloc_page_errors = 3;
-
-	EXPECT_FALSE(homa_skb_page_alloc(&self->homa, skb_core));
-	EXPECT_EQ(NULL, skb_core->skb_page);
-	EXPECT_EQ(0, skb_core->pool->avail);
+	spare->pages[0] = alloc_pages(GFP_KERNEL, HOMA_SKB_PAGE_ORDER);
+	spare->count = 1;
+	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
+	EXPECT_EQ(spare, skb_core->mag);
+	EXPECT_EQ(0, skb_core->mag->count);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->skb_page_mag_refills);
 }
 TEST_F(homa_skb, homa_skb_page_alloc__new_large_page)
 {
 	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
 
 	mock_ns_tick = 100;
-	EXPECT_EQ(0, skb_core->pool->avail);
-	EXPECT_EQ(0, skb_core->num_stashed_pages);
+	EXPECT_EQ(0, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(0, skb_core->mag->count);
 	EXPECT_TRUE(homa_skb_page_alloc(&self->homa, skb_core));
 	EXPECT_NE(NULL, skb_core->skb_page);
 	EXPECT_EQ(HOMA_SKB_PAGE_SIZE, skb_core->page_size);
@@ -448,6 +566,55 @@ TEST_F(homa_skb, homa_skb_append_from_iter__no_memory)
 			iter, 2000));
 }
 
+TEST_F(homa_skb, homa_skb_append_zerocopy__basics)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 4000, 6000);
+	struct sk_buff *skb = homa_skb_new_tx(100);
+	struct ubuf_info *uarg;
+
+	uarg = msg_zerocopy_realloc(NULL, 5000, NULL);
+	skb_zcopy_set(skb, uarg, NULL);
+	net_zcopy_put(uarg);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_skb_append_zerocopy(&self->homa, skb, iter, 5000));
+	EXPECT_STREQ("zerocopy 96 bytes at 4000; "
+			"zerocopy 4096 bytes at 4096; "
+			"zerocopy 808 bytes at 8192",
+			unit_log_get());
+	EXPECT_EQ(3, skb_shinfo(skb)->nr_frags);
+	EXPECT_EQ(5000, skb->len);
+	EXPECT_EQ(1000, iter->count);
+	EXPECT_EQ(5000, homa_metrics_per_cpu()->zerocopy_bytes);
+
+	unit_log_clear();
+	kfree_skb(skb);
+	EXPECT_STREQ("zerocopy complete, zerocopy", unit_log_get());
+}
+TEST_F(homa_skb, homa_skb_append_zerocopy__too_many_pages)
+{
+	struct iovec iovecs[3] = {{(void *) 100, 10}, {(void *) 8192, 10},
+				  {(void *) 16384, 10}};
+	struct sk_buff *skb = homa_skb_new_tx(100);
+	struct ubuf_info *uarg;
+	struct iov_iter iter;
+
+	iov_iter_init(&iter, WRITE, iovecs, 3, 30);
+	uarg = msg_zerocopy_realloc(NULL, 30, NULL);
+	skb_zcopy_set(skb, uarg, NULL);
+	net_zcopy_put(uarg);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_skb_append_zerocopy(&self->homa, skb, &iter, 30));
+	EXPECT_STREQ("_copy_from_iter 10 bytes at 100; "
+			"_copy_from_iter 10 bytes at 8192; "
+			"_copy_from_iter 10 bytes at 16384",
+			unit_log_get());
+	EXPECT_EQ(30, homa_metrics_per_cpu()->zerocopy_copied_bytes);
+
+	unit_log_clear();
+	kfree_skb(skb);
+	EXPECT_STREQ("zerocopy complete, copied", unit_log_get());
+}
+
 TEST_F(homa_skb, homa_skb_append_from_skb__header_only)
 {
 	struct sk_buff *src_skb = test_skb(&self->homa);
@@ -558,7 +725,7 @@ TEST_F(homa_skb, homa_skb_free_many_tx__basics)
 	homa_skb_extend_frags(&self->homa, skbs[1], &length);
 
 	homa_skb_free_many_tx(&self->homa, skbs, 2);
-	EXPECT_EQ(3, self->homa.page_pools[0]->avail);
+	EXPECT_EQ(3, get_skb_core(raw_smp_processor_id())->mag->count);
 }
 TEST_F(homa_skb, homa_skb_free_many_tx__skb_ref_count_not_one)
 {
@@ -595,35 +762,92 @@ TEST_F(homa_skb, homa_skb_free_many_tx__check_page_order)
 
 	mock_compound_order_mask = 3;
 	homa_skb_free_many_tx(&self->homa, &skb, 1);
-	EXPECT_EQ(1, self->homa.page_pools[0]->avail);
-	EXPECT_EQ(page, self->homa.page_pools[0]->pages[0]);
+	EXPECT_EQ(1, get_skb_core(raw_smp_processor_id())->mag->count);
+	EXPECT_EQ(page, get_skb_core(raw_smp_processor_id())->mag->pages[0]);
 }
+TEST_F(homa_skb, homa_skb_free_many_tx__zerocopy_skb)
+{
+	struct iov_iter *iter = unit_iov_iter((void *) 4096, 5000);
+	struct sk_buff *skb = homa_skb_new_tx(100);
+	struct ubuf_info *uarg;
 
-TEST_F(homa_skb, homa_skb_cache_pages__different_numa_nodes)
+	uarg = msg_zerocopy_realloc(NULL, 5000, NULL);
+	skb_zcopy_set(skb, uarg, NULL);
+	net_zcopy_put(uarg);
+	EXPECT_EQ(0, homa_skb_append_zerocopy(&self->homa, skb, iter, 5000));
+	unit_log_clear();
+
+	/* User pages must not end up in the page pool. */
+	homa_skb_free_many_tx(&self->homa, &skb, 1);
+	EXPECT_EQ(0, get_skb_core(raw_smp_processor_id())->mag->count);
+	EXPECT_STREQ("zerocopy complete, zerocopy", unit_log_get());
+}
+
+TEST_F(homa_skb, homa_skb_cache_pages__local_pages)
 {
-	struct page *pages[4];
+	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
+	struct page *pages[6];
 	int i;
 
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < 6; i++)
 		pages[i] = alloc_pages(GFP_KERNEL, HOMA_SKB_PAGE_ORDER);
-	mock_page_nid_mask = 7;
-	homa_skb_cache_pages(&self->homa, pages, 4);
-	EXPECT_EQ(1, self->homa.page_pools[0]->avail);
-	EXPECT_EQ(3, self->homa.page_pools[1]->avail);
-	EXPECT_EQ(pages[3], self->homa.page_pools[0]->pages[0]);
-	EXPECT_EQ(pages[1], self->homa.page_pools[1]->pages[1]);
+	homa_skb_cache_pages(&self->homa, pages, 6);
+	EXPECT_EQ(2, skb_core->mag->count);
+	EXPECT_EQ(4, skb_core->spare_mag->count);
+	EXPECT_EQ(pages[5], skb_core->mag->pages[1]);
+	EXPECT_EQ(0, atomic_read(&skb_core->pool->avail));
 }
-TEST_F(homa_skb, homa_skb_cache_pages__pool_size_exceeded)
+TEST_F(homa_skb, homa_skb_cache_pages__flush_full_magazine)
 {
+	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
+	struct page *pages[10];
+	int i;
+
+	for (i = 0; i < 10; i++)
+		pages[i] = alloc_pages(GFP_KERNEL, HOMA_SKB_PAGE_ORDER);
+	homa_skb_cache_pages(&self->homa, pages, 10);
+	EXPECT_EQ(2, skb_core->mag->count);
+	EXPECT_EQ(4, skb_core->spare_mag->count);
+	EXPECT_EQ(4, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_page_mag_flushes);
+}
+TEST_F(homa_skb, homa_skb_cache_pages__different_numa_nodes)
+{
+	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
 	struct page *pages[6];
 	int i;
 
 	for (i = 0; i < 6; i++)
 		pages[i] = alloc_pages(GFP_KERNEL, HOMA_SKB_PAGE_ORDER);
-	homa_skb_cache_pages(&self->homa, pages, 4);
-	EXPECT_EQ(4, self->homa.page_pools[0]->avail);
-	put_page(pages[4]);
-	put_page(pages[5]);
+	mock_page_nid_mask = 0x3d;
+	homa_skb_cache_pages(&self->homa, pages, 6);
+	EXPECT_EQ(1, skb_core->mag->count);
+	EXPECT_EQ(pages[1], skb_core->mag->pages[0]);
+	EXPECT_EQ(0, atomic_read(&self->homa.page_pools[0]->avail));
+	EXPECT_EQ(5, atomic_read(&self->homa.page_pools[1]->avail));
+	EXPECT_EQ(2, homa_metrics_per_cpu()->skb_page_mag_flushes);
+}
+TEST_F(homa_skb, homa_skb_cache_pages__pool_full)
+{
+	struct homa_skb_core *skb_core = get_skb_core(raw_smp_processor_id());
+	struct homa_page_mag *empty[HOMA_PAGE_POOL_MAGS];
+	struct page *pages[9];
+	int i;
+
+	for (i = 0; i < HOMA_PAGE_POOL_MAGS; i++) {
+		empty[i] = skb_core->pool->empty[i];
+		skb_core->pool->empty[i] = NULL;
+	}
+	for (i = 0; i < 9; i++)
+		pages[i] = alloc_pages(GFP_KERNEL, HOMA_SKB_PAGE_ORDER);
+	homa_skb_cache_pages(&self->homa, pages, 9);
+	EXPECT_EQ(4, skb_core->mag->count);
+	EXPECT_EQ(4, skb_core->spare_mag->count);
+	EXPECT_EQ(0, atomic_read(&skb_core->pool->avail));
+	EXPECT_EQ(1, homa_metrics_per_cpu()->skb_page_pool_overflows);
+	EXPECT_EQ(0, mock_page_refs(pages[8]));
+	for (i = 0; i < HOMA_PAGE_POOL_MAGS; i++)
+		skb_core->pool->empty[i] = empty[i];
 }
 
 TEST_F(homa_skb, homa_skb_get)
@@ -670,73 +894,99 @@ TEST_F(homa_skb, homa_skb_get)
 
 TEST_F(homa_skb, homa_skb_release_pages__basics)
 {
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
 	EXPECT_EQ(0UL, self->homa.skb_page_free_time);
 	mock_ns = 1000000;
 	self->homa.skb_page_free_time = 500000;
-	self->homa.skb_page_frees_per_sec = 10;
 	self->homa.skb_page_pool_min_kb = 0;
-	add_to_pool(&self->homa, 10, 0);
-	get_skb_core(0)->pool->low_mark = 7;
-	add_to_pool(&self->homa, 3, 1);
-	get_skb_core(1)->pool->low_mark = 2;
+	add_to_pool(&self->homa, 12, 1);
+	pool->low_mark = 12;
+	pool->target = 8;
 
 	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(5, get_skb_core(0)->pool->avail);
-	EXPECT_EQ(3, get_skb_core(1)->pool->avail);
+	EXPECT_EQ(7, pool->target);
+	EXPECT_EQ(8, atomic_read(&pool->avail));
+	EXPECT_EQ(8, pool->low_mark);
 	EXPECT_EQ(501000000UL, self->homa.skb_page_free_time);
 }
 TEST_F(homa_skb, homa_skb_release_pages__not_time_to_free)
 {
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
 	EXPECT_EQ(0UL, self->homa.skb_page_free_time);
 	mock_ns = 1000000;
 	self->homa.skb_page_free_time = 1000001;
-	self->homa.skb_page_frees_per_sec = 10;
 	self->homa.skb_page_pool_min_kb = 0;
-	add_to_pool(&self->homa, 10, 0);
-	get_skb_core(0)->pool->low_mark = 7;
+	add_to_pool(&self->homa, 12, 1);
+	pool->low_mark = 12;
 	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(10, get_skb_core(0)->pool->avail);
+	EXPECT_EQ(12, atomic_read(&pool->avail));
 }
-TEST_F(homa_skb, homa_skb_release_pages__allocate_skb_pages_to_free)
+TEST_F(homa_skb, homa_skb_release_pages__demand_raises_target)
 {
-	EXPECT_EQ(0, self->homa.pages_to_free_slots);
-	mock_ns= 1000000;
-	self->homa.skb_page_frees_per_sec = 10;
-	self->homa.skb_page_free_time = 500000;
+	struct homa_page_pool *pool = self->homa.page_pools[0];
 
-	/* First call: no current allocation. */
-	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(5, self->homa.pages_to_free_slots);
+	mock_ns = 1000000;
+	self->homa.skb_page_pool_min_kb = 0;
+	add_to_pool(&self->homa, 12, 1);
+	pool->low_mark = 12;
+	atomic_set(&pool->demand, 10);
 
-	/* Second call: free current allocation. */
-	self->homa.pages_to_free_slots -= 1;
-	self->homa.skb_page_free_time = 500000;
 	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(5, self->homa.pages_to_free_slots);
+	EXPECT_EQ(10, pool->target);
+	EXPECT_EQ(0, atomic_read(&pool->demand));
+	EXPECT_EQ(12, atomic_read(&pool->avail));
 }
 TEST_F(homa_skb, homa_skb_release_pages__limited_by_min_kb)
 {
-	EXPECT_EQ(0UL, self->homa.skb_page_free_time);
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
 	mock_ns = 1000000;
-	self->homa.skb_page_free_time = 500000;
-	self->homa.skb_page_frees_per_sec = 20;
 	self->homa.skb_page_pool_min_kb = (5 * HOMA_SKB_PAGE_SIZE) / 1000;
-	add_to_pool(&self->homa, 10, 0);
-	get_skb_core(0)->pool->low_mark = 9;
+	add_to_pool(&self->homa, 12, 1);
+	pool->low_mark = 12;
 
 	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(6, get_skb_core(0)->pool->avail);
+	EXPECT_EQ(5, pool->target);
+	EXPECT_EQ(8, atomic_read(&pool->avail));
+}
+TEST_F(homa_skb, homa_skb_release_pages__limited_by_low_mark)
+{
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
+	mock_ns = 1000000;
+	self->homa.skb_page_pool_min_kb = 0;
+	add_to_pool(&self->homa, 12, 1);
+	pool->low_mark = 6;
+
+	homa_skb_release_pages(&self->homa);
+	EXPECT_EQ(8, atomic_read(&pool->avail));
+}
+TEST_F(homa_skb, homa_skb_release_pages__limited_by_frees_per_sec)
+{
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
+	mock_ns = 1000000;
+	self->homa.skb_page_frees_per_sec = 10;
+	self->homa.skb_page_pool_min_kb = 0;
+	add_to_pool(&self->homa, 16, 1);
+	pool->low_mark = 16;
+
+	homa_skb_release_pages(&self->homa);
+	EXPECT_EQ(8, atomic_read(&pool->avail));
 }
 TEST_F(homa_skb, homa_skb_release_pages__empty_pool)
 {
-	EXPECT_EQ(0UL, self->homa.skb_page_free_time);
-	mock_ns= 2000000;
-	self->homa.skb_page_free_time = 500000;
-	self->homa.skb_page_frees_per_sec = 1000;
+	struct homa_page_pool *pool = self->homa.page_pools[0];
+
+	mock_ns = 2000000;
 	self->homa.skb_page_pool_min_kb = 0;
-	add_to_pool(&self->homa, 5, 0);
-	get_skb_core(0)->pool->low_mark = 5;
+	add_to_pool(&self->homa, 8, 1);
+	pool->low_mark = 8;
 
 	homa_skb_release_pages(&self->homa);
-	EXPECT_EQ(0, get_skb_core(0)->pool->avail);
+	EXPECT_EQ(0, atomic_read(&pool->avail));
+	EXPECT_NE(NULL, pool->empty[0]);
+	EXPECT_NE(NULL, pool->empty[1]);
 }
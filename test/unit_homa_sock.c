@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: BSD-2-Clause
 
 #include "homa_impl.h"
+#include "homa_pool.h"
 #include "homa_sock.h"
 #define KSELFTEST_NOT_MAIN 1
 #include "kselftest_harness.h"
@@ -262,7 +263,7 @@ TEST_F(homa_sock, homa_sock_shutdown__already_shutdown)
 	self->hsk.shutdown = 1;
 	homa_sock_shutdown(&self->hsk);
 	EXPECT_TRUE(self->hsk.shutdown);
-	EXPECT_EQ(2, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(2, unit_count_active_rpcs(&self->hsk));
 	self->hsk.shutdown = 0;
 }
 TEST_F(homa_sock, homa_sock_shutdown__delete_rpcs)
@@ -275,7 +276,7 @@ TEST_F(homa_sock, homa_sock_shutdown__delete_rpcs)
 			5000, 5000);
 	homa_sock_shutdown(&self->hsk);
 	EXPECT_TRUE(self->hsk.shutdown);
-	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, unit_count_active_rpcs(&self->hsk));
 }
 TEST_F(homa_sock, homa_sock_shutdown__wakeup_interests)
 {
@@ -298,6 +299,60 @@ TEST_F(homa_sock, homa_sock_shutdown__wakeup_interests)
 			"wake_up_process pid 200; wake_up_process pid 300",
 			unit_log_get());
 }
+TEST_F(homa_sock, homa_sock_shutdown__group_pool_outlives_group)
+{
+	struct homa_pool *pool = self->hsk.buffer_pool;
+	struct homa_sock hsk2;
+	struct homa_rpc *srpc;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	srpc = unit_server_rpc(&hsk2, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->client_port, self->client_id,
+			20000, 100);
+	ASSERT_NE(NULL, srpc);
+	EXPECT_EQ(1, srpc->msgin.num_bpages);
+	EXPECT_EQ(99, atomic_read(&pool->free_bpages));
+
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(pool, self->hsk.buffer_pool);
+	EXPECT_EQ(1, self->hsk.pool_refs);
+
+	homa_sock_shutdown(&hsk2);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool);
+	EXPECT_EQ(NULL, hsk2.buffer_pool);
+	EXPECT_EQ(NULL, hsk2.pool_group);
+}
+TEST_F(homa_sock, homa_sock_shutdown__remove_group_members)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *srpc;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	srpc = unit_server_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->client_id + 1,
+			20000, 100);
+	ASSERT_NE(NULL, srpc);
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	unit_log_clear();
+
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(0, self->hsk.group_members);
+	EXPECT_TRUE(list_empty(&self->hsk.members));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&hsk2.ready_requests));
+	EXPECT_SUBSTR("sk->sk_data_ready invoked", unit_log_get());
+	homa_sock_destroy(&hsk2);
+}
 
 TEST_F(homa_sock, homa_sock_bind)
 {
@@ -377,18 +432,252 @@ TEST_F(homa_sock, homa_sock_find__long_hash_chain)
 	homa_sock_destroy(&hsk4);
 }
 
+TEST_F(homa_sock, homa_sock_join_group__not_connected)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	EXPECT_EQ(ENOTCONN, -homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(NULL, hsk2.group);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_join_group__already_in_group)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	EXPECT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(EBUSY, -homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(1, self->hsk.group_members);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_join_group__group_is_connected)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	self->hsk.connect = true;
+	EXPECT_EQ(EINVAL, -homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(0, self->hsk.group_members);
+	EXPECT_EQ(NULL, hsk2.pool_group);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_join_group__member_has_buffer_region)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk2.connect = true;
+	EXPECT_EQ(EINVAL, -homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(NULL, hsk2.pool_group);
+	homa_sock_destroy(&hsk2);
+}
+TEST_F(homa_sock, homa_sock_join_group__already_used_other_groups_pool)
+{
+	struct homa_sock hsk2, hsk3;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	mock_sock_init(&hsk3, &self->homa, 0);
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	homa_sock_leave_group(&hsk2);
+	EXPECT_EQ(EINVAL, -homa_sock_join_group(&hsk2, &hsk3, 99));
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(0, hsk3.group_members);
+
+	/* Rejoining the original group is fine. */
+	sock_hold(&self->hsk.sock);
+	EXPECT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 100));
+	EXPECT_EQ(2, self->hsk.pool_refs);
+	homa_sock_destroy(&hsk2);
+	homa_sock_destroy(&hsk3);
+}
+TEST_F(homa_sock, homa_sock_join_group__use_group_pool)
+{
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	EXPECT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(&self->hsk, hsk2.pool_group);
+	EXPECT_EQ(self->hsk.buffer_pool, homa_sock_pool(&hsk2));
+	EXPECT_EQ(2, self->hsk.pool_refs);
+	homa_sock_destroy(&hsk2);
+	EXPECT_EQ(1, self->hsk.pool_refs);
+}
+TEST_F(homa_sock, homa_sock_join_group__move_ready_rpcs)
+{
+	struct homa_sock hsk2;
+	struct homa_rpc *srpc;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	hsk2.inline_max = 1000;
+	srpc = unit_server_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->client_id + 1,
+			1000, 100);
+	ASSERT_NE(NULL, srpc);
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(1, unit_list_length(&hsk2.ready_requests));
+	unit_log_clear();
+
+	sock_hold(&self->hsk.sock);
+	EXPECT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	EXPECT_EQ(&self->hsk, hsk2.group);
+	EXPECT_EQ(99, hsk2.group_cookie);
+	EXPECT_EQ(0, unit_list_length(&hsk2.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	homa_sock_destroy(&hsk2);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+}
+
+TEST_F(homa_sock, homa_sock_leave_group__not_in_group)
+{
+	unit_log_clear();
+	homa_sock_leave_group(&self->hsk);
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_sock, homa_sock_leave_group__reclaim_ready_rpcs)
+{
+	struct homa_rpc *srpc1, *srpc2;
+	struct homa_sock hsk2;
+
+	mock_sock_init(&hsk2, &self->homa, 0);
+	homa_pool_destroy(hsk2.buffer_pool);
+	hsk2.connect = true;
+	sock_hold(&self->hsk.sock);
+	ASSERT_EQ(0, homa_sock_join_group(&hsk2, &self->hsk, 99));
+	srpc1 = unit_server_rpc(&hsk2, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->client_id + 1,
+			20000, 100);
+	srpc2 = unit_server_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->client_port, self->client_id + 3,
+			20000, 100);
+	ASSERT_NE(NULL, srpc1);
+	ASSERT_NE(NULL, srpc2);
+	homa_rpc_handoff(srpc1);
+	homa_rpc_handoff(srpc2);
+	EXPECT_EQ(2, unit_list_length(&self->hsk.ready_requests));
+	unit_log_clear();
+
+	homa_sock_leave_group(&hsk2);
+	EXPECT_EQ(NULL, hsk2.group);
+	EXPECT_EQ(0, self->hsk.group_members);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_EQ(1, unit_list_length(&hsk2.ready_requests));
+	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
+	EXPECT_EQ(&self->hsk, hsk2.pool_group);
+
+	/* The group reference for the pool is released at destroy. */
+	unit_log_clear();
+	homa_sock_destroy(&hsk2);
+	EXPECT_SUBSTR("sk_free", unit_log_get());
+}
+
+TEST_F(homa_sock, homa_sock_rtt_sample)
+{
+	homa_sock_rtt_sample(&self->hsk, 8000);
+	EXPECT_EQ(8000, atomic64_read(&self->hsk.conn_stats.srtt_ns));
+	homa_sock_rtt_sample(&self->hsk, 16000);
+	EXPECT_EQ(9000, atomic64_read(&self->hsk.conn_stats.srtt_ns));
+	homa_sock_rtt_sample(&self->hsk, 1000);
+	EXPECT_EQ(8000, atomic64_read(&self->hsk.conn_stats.srtt_ns));
+}
+TEST_F(homa_sock, homa_sock_get_conn_stats)
+{
+	struct homa_conn_stats stats;
+
+	atomic64_set(&self->hsk.conn_stats.requests_received, 5);
+	atomic64_set(&self->hsk.conn_stats.timeouts, 2);
+	atomic64_set(&self->hsk.conn_stats.grant_wait_ns, 999);
+	homa_sock_get_conn_stats(&self->hsk, &stats);
+	EXPECT_EQ(5, stats.requests_received);
+	EXPECT_EQ(2, stats.timeouts);
+	EXPECT_EQ(999, stats.grant_wait_ns);
+	EXPECT_EQ(0, stats.bytes_sent);
+}
+TEST_F(homa_sock, homa_sock_conns_show)
+{
+	struct homa_sock hsk2, hsk3;
+	struct seq_file s;
+	char *log;
+
+	s.private = &self->homa;
+	mock_sock_init(&hsk2, &self->homa, 0);
+	hsk2.connect = true;
+	hsk2.remote_host.in6.sin6_family = AF_INET6;
+	hsk2.remote_host.in6.sin6_addr = self->server_ip[0];
+	hsk2.remote_host.in6.sin6_port = htons(self->server_port);
+	atomic64_set(&hsk2.conn_stats.requests_sent, 4444);
+	mock_sock_init(&hsk3, &self->homa, 0);
+	hsk3.shutdown = true;
+	hsk3.connect = true;
+
+	unit_log_clear();
+	EXPECT_EQ(0, homa_sock_conns_show(&s, NULL));
+	log = unit_log_get();
+	EXPECT_SUBSTR("req_sent", log);
+	EXPECT_SUBSTR("1.2.3.4", log);
+	EXPECT_SUBSTR(" 4444 ", log);
+
+	/* Only the header and hsk2 should appear. */
+	EXPECT_NE(NULL, strchr(log, '\n'));
+	EXPECT_NE(NULL, strchr(strchr(log, '\n') + 1, '\n'));
+	EXPECT_EQ(NULL, strchr(strchr(strchr(log, '\n') + 1, '\n') + 1,
+			'\n'));
+	EXPECT_EQ(0, num_active_scans(self->homa.port_map));
+	hsk2.connect = false;
+	homa_sock_destroy(&hsk2);
+	hsk3.connect = false;
+	hsk3.shutdown = false;
+	homa_sock_destroy(&hsk3);
+}
 TEST_F(homa_sock, homa_sock_lock_slow)
 {
 	mock_ns_tick = 100;
 
-	homa_sock_lock(&self->hsk, "unit test");
+	homa_sock_lock(&self->hsk, HOMA_LOCK_RECV);
 	EXPECT_EQ(0, homa_metrics_per_cpu()->socket_lock_misses);
 	EXPECT_EQ(0, homa_metrics_per_cpu()->socket_lock_miss_ns);
 	homa_sock_unlock(&self->hsk);
 
 	mock_trylock_errors = 1;
-	homa_sock_lock(&self->hsk, "unit test");
+	homa_sock_lock(&self->hsk, HOMA_LOCK_RECV);
 	EXPECT_EQ(1, homa_metrics_per_cpu()->socket_lock_misses);
 	EXPECT_EQ(100, homa_metrics_per_cpu()->socket_lock_miss_ns);
+	EXPECT_EQ(100, homa_metrics_per_cpu()->socket_lock_op_ns[
+			HOMA_LOCK_RECV]);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->socket_lock_op_ns[
+			HOMA_LOCK_CONTROL]);
 	homa_sock_unlock(&self->hsk);
 }
+
+TEST_F(homa_sock, homa_rpc_shard_lock_slow)
+{
+	struct homa_rpc_shard *shard = &self->hsk.rpc_shards[3];
+
+	mock_ns_tick = 100;
+
+	homa_rpc_shard_lock(shard);
+	EXPECT_EQ(0, homa_metrics_per_cpu()->shard_lock_misses);
+	homa_rpc_shard_unlock(shard);
+
+	mock_trylock_errors = 1;
+	homa_rpc_shard_lock(shard);
+	EXPECT_EQ(1, homa_metrics_per_cpu()->shard_lock_misses);
+	EXPECT_EQ(100, homa_metrics_per_cpu()->shard_lock_miss_ns);
+	homa_rpc_shard_unlock(shard);
+}
@@ -273,17 +273,33 @@ TEST_F(homa_timer, homa_timer__reap_dead_rpcs)
 
 	ASSERT_NE(NULL, dead);
 	homa_rpc_free(dead);
-	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 
 	// First call to homa_timer: not enough dead skbs.
+	self->homa.reap_workers = 0;
 	self->homa.dead_buffs_limit = 32;
 	homa_timer(&self->homa);
-	EXPECT_EQ(31, self->hsk.dead_skbs);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 
 	// Second call to homa_timer: must reap.
 	self->homa.dead_buffs_limit = 15;
 	homa_timer(&self->homa);
-	EXPECT_EQ(11, self->hsk.dead_skbs);
+	EXPECT_EQ(11, atomic_read(&self->hsk.dead_skbs));
+}
+TEST_F(homa_timer, homa_timer__queue_reap_work)
+{
+	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 40000, 1000);
+
+	ASSERT_NE(NULL, dead);
+	homa_rpc_free(dead);
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
+	self->homa.dead_buffs_limit = 15;
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_SUBSTR("queue_work", unit_log_get());
+	EXPECT_EQ(31, atomic_read(&self->hsk.dead_skbs));
 }
 TEST_F(homa_timer, homa_timer__rpc_in_service)
 {
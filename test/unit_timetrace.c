@@ -9,10 +9,12 @@
 
 FIXTURE(timetrace) {
 	struct file file;
+	struct file stream;
 };
 FIXTURE_SETUP(timetrace)
 {
 	self->file.private_data = 0;
+	self->stream.private_data = 0;
 	tt_buffer_size = 64;
 	tt_test_no_khz = true;
 	tt_init("tt", NULL);
@@ -22,10 +24,13 @@ FIXTURE_TEARDOWN(timetrace)
 {
 	if (self->file.private_data)
 		tt_proc_release(NULL, &self->file);
+	if (self->stream.private_data)
+		tt_stream_release(NULL, &self->stream);
 	tt_destroy();
 	tt_test_no_khz = false;
 	tt_buffer_size = TT_BUF_SIZE;
 	tt_pf_storage = TT_PF_BUF_SIZE;
+	tt_set_sample_rate(0);
 	unit_teardown();
 }
 
@@ -88,6 +93,46 @@ TEST_F(timetrace, tt_record_buf__wraparound)
 			"1004 [C01] Message 5\n", buffer);
 }
 
+TEST_F(timetrace, tt_set_sample_rate)
+{
+	tt_set_sample_rate(4);
+	EXPECT_EQ(0x40000000, tt_sample_threshold);
+	tt_set_sample_rate(3);
+	EXPECT_EQ(0x55555555, tt_sample_threshold);
+	tt_set_sample_rate(1);
+	EXPECT_EQ(0, tt_sample_threshold);
+	tt_set_sample_rate(-5);
+	EXPECT_EQ(0, tt_sample_threshold);
+}
+
+TEST_F(timetrace, tt_rpc_sampled)
+{
+	EXPECT_TRUE(tt_rpc_sampled(4));
+	tt_set_sample_rate(2);
+
+	/* Client and server ids differ only in the low-order bit. */
+	EXPECT_TRUE(tt_rpc_sampled(2));
+	EXPECT_TRUE(tt_rpc_sampled(3));
+	EXPECT_FALSE(tt_rpc_sampled(4));
+	EXPECT_FALSE(tt_rpc_sampled(5));
+
+	/* High-order bits are ignored. */
+	EXPECT_TRUE(tt_rpc_sampled(0x100000002));
+}
+TEST_F(timetrace, tt_rpc_record__sampling)
+{
+	char buffer[1000];
+
+	tt_set_sample_rate(2);
+	tt_rpc_record1(2, "id %d", 2);
+	tt_rpc_record2(4, "id %d, arg %d", 4, 10);
+	tt_rpc_record3(3, "id %d, args %d %d", 3, 10, 20);
+	tt_rpc_record4(5, "id %d, args %d %d %d", 5, 10, 20, 30);
+	tt_record("not RPC-specific");
+	tt_get_messages(buffer, sizeof(buffer));
+	EXPECT_STREQ("id 2; id 3, args 10 20; not RPC-specific", buffer);
+}
+
 TEST_F(timetrace, tt_find_oldest)
 {
 	int pos[nr_cpu_ids];
@@ -302,3 +347,149 @@ TEST_F(timetrace, tt_proc_release__unfreeze)
 	EXPECT_EQ(NULL, tt_buffers[1]->events[3].format);
 	EXPECT_EQ(0, tt_buffers[1]->next_index);
 }
+TEST_F(timetrace, tt_proc_release__dont_reset_while_streaming)
+{
+	tt_buffer_size = 4;
+	tt_record_buf(tt_buffers[1], 1000, "Buf1", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1100, "Buf1", 0, 0, 0, 0);
+	tt_stream_open(NULL, &self->stream);
+	tt_proc_open(NULL, &self->file);
+	tt_proc_release(NULL, &self->file);
+	EXPECT_EQ(2, tt_buffers[1]->next_index);
+	EXPECT_EQ(2, tt_buffers[1]->total);
+}
+
+TEST_F(timetrace, tt_stream_open__not_initialized)
+{
+	tt_destroy();
+	EXPECT_EQ(EINVAL, -tt_stream_open(NULL, &self->stream));
+	EXPECT_EQ(0, tt_stream_readers);
+}
+TEST_F(timetrace, tt_stream_open__no_memory)
+{
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -tt_stream_open(NULL, &self->stream));
+}
+TEST_F(timetrace, tt_stream_open__buffer_already_wrapped)
+{
+	char buffer[1000];
+
+	memset(buffer, 0, sizeof(buffer));
+	tt_buffer_size = 4;
+	tt_record_buf(tt_buffers[2], 1000, "Event 1", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[2], 1100, "Event 2", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[2], 1200, "Event 3", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[2], 1300, "Event 4", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[2], 1400, "Event 5", 0, 0, 0, 0);
+	EXPECT_EQ(0, tt_stream_open(NULL, &self->stream));
+	EXPECT_EQ(1, tt_stream_readers);
+	EXPECT_EQ(2, ((struct tt_stream_file *)
+		      self->stream.private_data)->seq[2]);
+	tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("1200 [C02] Event 3\n"
+		     "1300 [C02] Event 4\n"
+		     "1400 [C02] Event 5\n", buffer);
+}
+
+TEST_F(timetrace, tt_stream_read__basics)
+{
+	char buffer[1000];
+	int length;
+
+	memset(buffer, 0, sizeof(buffer));
+	tt_record_buf(tt_buffers[0], 1500, "Buf0 first", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1000, "Buf1 value %d", 5, 0, 0, 0);
+	tt_stream_open(NULL, &self->stream);
+	tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("1000 [C01] Buf1 value 5\n"
+		     "1500 [C00] Buf0 first\n", buffer);
+
+	/* Nothing new to read. */
+	EXPECT_EQ(0, tt_stream_read(&self->stream, buffer, sizeof(buffer),
+				    0));
+
+	/* Only new events are returned, and the trace isn't frozen. */
+	EXPECT_EQ(0, tt_freeze_count.counter);
+	tt_record_buf(tt_buffers[0], 2000, "Buf0 second", 0, 0, 0, 0);
+	memset(buffer, 0, sizeof(buffer));
+	length = tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_EQ(23, length);
+	EXPECT_STREQ("2000 [C00] Buf0 second\n", buffer);
+}
+TEST_F(timetrace, tt_stream_read__bogus_file)
+{
+	struct tt_stream_file sf;
+
+	sf.file = NULL;
+	EXPECT_EQ(EINVAL, -tt_stream_read(&self->stream, (char *) 1000, 100,
+					  0));
+	self->stream.private_data = &sf;
+	EXPECT_EQ(EINVAL, -tt_stream_read(&self->stream, (char *) 1000, 100,
+					  0));
+	self->stream.private_data = NULL;
+}
+TEST_F(timetrace, tt_stream_read__overrun)
+{
+	char buffer[1000];
+
+	memset(buffer, 0, sizeof(buffer));
+	tt_buffer_size = 4;
+	tt_stream_open(NULL, &self->stream);
+	tt_record_buf(tt_buffers[1], 1000, "Event 1", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1100, "Event 2", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1200, "Event 3", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1300, "Event 4", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1400, "Event 5", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[1], 1500, "Event 6", 0, 0, 0, 0);
+	tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("1300 [C01] timetrace stream dropped 3 events\n"
+		     "1300 [C01] Event 4\n"
+		     "1400 [C01] Event 5\n"
+		     "1500 [C01] Event 6\n", buffer);
+}
+TEST_F(timetrace, tt_stream_read__leftovers)
+{
+	char buffer[1000];
+
+	memset(buffer, 0, sizeof(buffer));
+	tt_record_buf(tt_buffers[0], 1000, "AAAA", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1100, "BBBB", 0, 0, 0, 0);
+	tt_stream_open(NULL, &self->stream);
+	EXPECT_EQ(8, tt_stream_read(&self->stream, buffer, 8, 0));
+	EXPECT_STREQ("1000 [C0", buffer);
+	memset(buffer, 0, sizeof(buffer));
+	tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("0] AAAA\n1100 [C00] BBBB\n", buffer);
+}
+TEST_F(timetrace, tt_stream_read__storage_full)
+{
+	char buffer[1000];
+
+	memset(buffer, 0, sizeof(buffer));
+	tt_pf_storage = 20;
+	tt_record_buf(tt_buffers[0], 1000, "AAAA", 0, 0, 0, 0);
+	tt_record_buf(tt_buffers[0], 1100, "BBBB", 0, 0, 0, 0);
+	tt_stream_open(NULL, &self->stream);
+	tt_stream_read(&self->stream, buffer, sizeof(buffer), 0);
+	EXPECT_STREQ("1000 [C00] AAAA\n1100 [C00] BBBB\n", buffer);
+}
+TEST_F(timetrace, tt_stream_read__copy_error)
+{
+	char buffer[1000];
+
+	tt_record_buf(tt_buffers[0], 1000, "AAAA", 0, 0, 0, 0);
+	tt_stream_open(NULL, &self->stream);
+	mock_copy_to_user_errors = 1;
+	EXPECT_EQ(EFAULT, -tt_stream_read(&self->stream, buffer,
+					  sizeof(buffer), 0));
+}
+
+TEST_F(timetrace, tt_stream_release)
+{
+	tt_stream_open(NULL, &self->stream);
+	EXPECT_EQ(1, tt_stream_readers);
+	EXPECT_EQ(0, tt_stream_release(NULL, &self->stream));
+	EXPECT_EQ(0, tt_stream_readers);
+	EXPECT_EQ(NULL, self->stream.private_data);
+	EXPECT_EQ(EINVAL, -tt_stream_release(NULL, &self->stream));
+}
@@ -42,7 +42,7 @@ struct homa_rpc *unit_client_rpc(struct homa_sock *hsk,
 	server_addr.in6.sin6_addr = *server_ip;
 	server_addr.in6.sin6_port =  htons(server_port);
 	if (id != 0)
-		atomic64_set(&hsk->homa->next_outgoing_id, id);
+		homa_rpc_set_next_id(hsk->homa, id);
 	crpc = homa_rpc_new_client(hsk, &server_addr);
 	if (IS_ERR(crpc))
 		return NULL;
@@ -52,7 +52,7 @@ struct homa_rpc *unit_client_rpc(struct homa_sock *hsk,
 	}
 	homa_rpc_unlock(crpc);
 	if (id != 0)
-		atomic64_set(&hsk->homa->next_outgoing_id, saved_id);
+		homa_rpc_set_next_id(hsk->homa, saved_id);
 	EXPECT_EQ(RPC_OUTGOING, crpc->state);
 	if (state == UNIT_OUTGOING)
 		return crpc;
@@ -145,12 +145,41 @@ int unit_list_length(struct list_head *head)
  */
 void unit_log_active_ids(struct homa_sock *hsk)
 {
+	struct homa_rpc_shard *shard;
 	struct homa_rpc *rpc;
 
-	list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links)
+	homa_for_each_active_rpc(rpc, shard, hsk)
 		unit_log_printf(" ", "%llu", rpc->id);
 }
 
+/**
+ * unit_count_active_rpcs() - Return the number of active RPCs in a socket
+ * (across all of its shards).
+ * @hsk:   Socket whose RPCs should be counted.
+ */
+int unit_count_active_rpcs(struct homa_sock *hsk)
+{
+	int i, count = 0;
+
+	for (i = 0; i < HOMA_RPC_SHARDS; i++)
+		count += unit_list_length(&hsk->rpc_shards[i].active_rpcs);
+	return count;
+}
+
+/**
+ * unit_count_dead_rpcs() - Return the number of dead (but not yet reaped)
+ * RPCs in a socket (across all of its shards).
+ * @hsk:   Socket whose RPCs should be counted.
+ */
+int unit_count_dead_rpcs(struct homa_sock *hsk)
+{
+	int i, count = 0;
+
+	for (i = 0; i < HOMA_RPC_SHARDS; i++)
+		count += unit_list_length(&hsk->rpc_shards[i].dead_rpcs);
+	return count;
+}
+
 /**
  * unit_log_hashed_rpcs() - And to the test log a list of the RPC ids
  * all RPCs present in the hash table for a socket.
@@ -36,6 +36,8 @@ extern struct homa_rpc
 			enum unit_rpc_state state, struct in6_addr *client_ip,
 			struct in6_addr *server_ip, int server_port, int id,
 			int req_length, int resp_length);
+extern int           unit_count_active_rpcs(struct homa_sock *hsk);
+extern int           unit_count_dead_rpcs(struct homa_sock *hsk);
 extern struct in6_addr
 		     unit_get_in_addr(char *s);
 extern void          unit_homa_destroy(struct homa *homa);
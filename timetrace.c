@@ -60,6 +60,25 @@ static const struct proc_ops tt_pops = {
 /* Used to remove the /proc file during tt_destroy. */
 static struct proc_dir_entry *tt_dir_entry;
 
+/* Describes file operations implemented for streaming timetraces
+ * from /proc.
+ */
+static const struct proc_ops tt_stream_pops = {
+	.proc_open              = tt_stream_open,
+	.proc_read              = tt_stream_read,
+	.proc_lseek             = tt_proc_lseek,
+	.proc_release           = tt_stream_release
+};
+
+/* Used to remove the streaming /proc file during tt_destroy. */
+static struct proc_dir_entry *tt_stream_dir_entry;
+
+/* Number of streaming /proc files currently open. While this is nonzero
+ * the buffers are not cleared when a frozen timetrace has been read,
+ * since that would discard events the stream hasn't yet returned.
+ */
+int tt_stream_readers;
+
 /* Synchronizes accesses to global state such as frozen and init.  A mutex
  * isn't safe here, because tt_freeze gets called at times when threads
  * can't sleep.
@@ -80,23 +99,38 @@ bool tt_frozen;
 /* True means timetrace has been successfully initialized. */
 static bool init;
 
-/* Used instead of TT_BUF_SIZE in places that are not performance
- * critical, so tests can override to simplify testing. Must be a
- * power of 2.
+/* Number of events in each tt_buffer; must be a power of 2. Set from
+ * tt_buf_exp by tt_init (tests set it directly, to simplify testing).
  */
-int tt_buffer_size = TT_BUF_SIZE;
+int tt_buffer_size __read_mostly = TT_BUF_SIZE;
+
+#ifndef __UNIT_TEST__
+/* Log2 of the number of events in each core's tt_buffer; can be set when
+ * the module is loaded, e.g. "insmod homa.ko tt_buf_exp=18".
+ */
+static int tt_buf_exp = TT_BUF_SIZE_EXP;
+module_param(tt_buf_exp, int, 0444);
+MODULE_PARM_DESC(tt_buf_exp, "log2 of the number of events in each core's timetrace buffer");
+#endif /* __UNIT_TEST__ */
 
 /* Used instead of PF_BUF_SIZE, so tests can override to simplify testing. */
 int tt_pf_storage = TT_PF_BUF_SIZE;
 
+/* Controls sampling of per-RPC events (see tt_rpc_sampled): an RPC is
+ * traced if its hashed id is less than this value. 0 means trace all RPCs.
+ */
+__u32 tt_sample_threshold;
+
 /* Set during tests to disable "cpu_khz" line in trace output. */
 bool tt_test_no_khz;
 
 /**
  * tt_init(): Enable time tracing, create /proc file for reading traces.
  * @proc_file: Name of a file in /proc; this file can be read to extract
- *             the current timetrace. NULL means don't create a /proc file
- *             (such as when running unit tests).
+ *             the current timetrace. A second file with "_stream" appended
+ *             to the name returns events continuously, without freezing
+ *             the trace. NULL means don't create /proc files (such as
+ *             when running unit tests).
  * @temp:      Pointer to homa's "temp" configuration parameters, which
  *             we should make available to the kernel. NULL means no
  *             such variables available.
@@ -106,20 +140,31 @@ bool tt_test_no_khz;
  */
 int tt_init(char *proc_file, int *temp)
 {
+	char stream_file[100];
 	int i;
 
 	if (init)
 		return 0;
 
+#ifndef __UNIT_TEST__
+	if (tt_buf_exp < TT_BUF_MIN_EXP || tt_buf_exp > TT_BUF_MAX_EXP) {
+		pr_warn("%s: tt_buf_exp %d out of range [%d, %d]; using %d\n",
+			__func__, tt_buf_exp, TT_BUF_MIN_EXP, TT_BUF_MAX_EXP,
+			TT_BUF_SIZE_EXP);
+		tt_buf_exp = TT_BUF_SIZE_EXP;
+	}
+	tt_buffer_size = 1 << tt_buf_exp;
+#endif /* __UNIT_TEST__ */
 	for (i = 0; i < nr_cpu_ids; i++) {
 		struct tt_buffer *buffer;
+		size_t size = struct_size(buffer, events, tt_buffer_size);
 
-		buffer = kmalloc(sizeof(*buffer), GFP_KERNEL);
+		buffer = vmalloc(size);
 		if (!buffer) {
 			pr_err("%s couldn't allocate tt_buffers\n", __func__);
 			goto error;
 		}
-		memset(buffer, 0, sizeof(*buffer));
+		memset(buffer, 0, size);
 		tt_buffers[i] = buffer;
 	}
 
@@ -130,8 +175,20 @@ int tt_init(char *proc_file, int *temp)
 			       proc_file);
 			goto error;
 		}
+		snprintf(stream_file, sizeof(stream_file), "%s_stream",
+			 proc_file);
+		tt_stream_dir_entry = proc_create(stream_file, 0444, NULL,
+						  &tt_stream_pops);
+		if (!tt_stream_dir_entry) {
+			pr_err("couldn't create /proc/%s for timetrace streaming\n",
+			       stream_file);
+			proc_remove(tt_dir_entry);
+			tt_dir_entry = NULL;
+			goto error;
+		}
 	} else {
 		tt_dir_entry = NULL;
+		tt_stream_dir_entry = NULL;
 	}
 
 	spin_lock_init(&tt_lock);
@@ -159,7 +216,7 @@ int tt_init(char *proc_file, int *temp)
 
 error:
 	for (i = 0; i < nr_cpu_ids; i++) {
-		kfree(tt_buffers[i]);
+		vfree(tt_buffers[i]);
 		tt_buffers[i] = NULL;
 	}
 	return -1;
@@ -178,9 +235,11 @@ void tt_destroy(void)
 		init = false;
 		if (tt_dir_entry)
 			proc_remove(tt_dir_entry);
+		if (tt_stream_dir_entry)
+			proc_remove(tt_stream_dir_entry);
 	}
 	for (i = 0; i < nr_cpu_ids; i++) {
-		kfree(tt_buffers[i]);
+		vfree(tt_buffers[i]);
 		tt_buffers[i] = NULL;
 	}
 	tt_freeze_count.counter = 1;
@@ -258,12 +317,7 @@ void tt_record_buf(struct tt_buffer *buffer, __u64 timestamp,
 	}
 
 	event = &buffer->events[buffer->next_index];
-	buffer->next_index = (buffer->next_index + 1)
-#ifdef __UNIT_TEST__
-		& (tt_buffer_size - 1);
-#else /* __UNIT_TEST__ */
-		& (TT_BUF_SIZE - 1);
-#endif /* __UNIT_TEST__ */
+	buffer->next_index = (buffer->next_index + 1) & (tt_buffer_size - 1);
 
 	event->timestamp = timestamp;
 	event->format = format;
@@ -271,6 +325,30 @@ void tt_record_buf(struct tt_buffer *buffer, __u64 timestamp,
 	event->arg1 = arg1;
 	event->arg2 = arg2;
 	event->arg3 = arg3;
+
+	/* Streaming readers use total to tell whether the event they
+	 * just copied was complete, so it must not advance until the
+	 * event has been written.
+	 */
+	smp_wmb();
+	WRITE_ONCE(buffer->total, buffer->total + 1);
+}
+
+/**
+ * tt_set_sample_rate() - Configure sampling of per-RPC timetrace events
+ * (those recorded with tt_rpc_recordN). Sampling makes it practical to
+ * leave timetracing enabled under production load: the buffers hold
+ * complete histories for a subset of RPCs over a much longer interval.
+ * @rate:   Approximately 1 out of every @rate RPCs will be traced; values
+ *          <= 1 mean trace all RPCs. Events not associated with an RPC
+ *          are always recorded.
+ */
+void tt_set_sample_rate(int rate)
+{
+	if (rate <= 1)
+		WRITE_ONCE(tt_sample_threshold, 0);
+	else
+		WRITE_ONCE(tt_sample_threshold, (__u32)(0x100000000ULL / rate));
 }
 
 /**
@@ -524,7 +602,8 @@ int tt_proc_release(struct inode *inode, struct file *file)
 			tt_frozen = false;
 		}
 
-		if (atomic_read(&tt_freeze_count) == 1) {
+		if (atomic_read(&tt_freeze_count) == 1 &&
+		    tt_stream_readers == 0) {
 			/* We are the last active open of the file; reset all of
 			 * the buffers to "empty".
 			 */
@@ -533,6 +612,7 @@ int tt_proc_release(struct inode *inode, struct file *file)
 
 				buffer->events[tt_buffer_size - 1].format = NULL;
 				buffer->next_index = 0;
+				buffer->total = 0;
 			}
 		}
 		atomic_dec(&tt_freeze_count);
@@ -542,6 +622,224 @@ int tt_proc_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/**
+ * tt_stream_open() - This function is invoked when /proc/timetrace_stream
+ * is opened. The first read will return all of the events currently in
+ * the buffers.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return:    0 for success, else a negative errno.
+ */
+int tt_stream_open(struct inode *inode, struct file *file)
+{
+	struct tt_stream_file *sf;
+	__u64 total;
+	int i;
+
+	sf = vmalloc(sizeof(*sf));
+	if (!sf)
+		return -ENOMEM;
+	spin_lock(&tt_lock);
+	if (!init) {
+		spin_unlock(&tt_lock);
+		vfree(sf);
+		return -EINVAL;
+	}
+	sf->file = file;
+	for (i = 0; i < nr_cpu_ids; i++) {
+		total = READ_ONCE(tt_buffers[i]->total);
+		sf->seq[i] = (total >= tt_buffer_size) ?
+				total - tt_buffer_size + 1 : 0;
+		sf->dropped[i] = 0;
+	}
+	sf->next_byte = sf->msg_storage;
+	sf->bytes_available = 0;
+	if (!tt_test_no_khz)
+		sf->bytes_available = snprintf(sf->msg_storage,
+					       TT_PF_BUF_SIZE,
+					       "cpu_khz: %u\n", cpu_khz);
+	tt_stream_readers++;
+	file->private_data = sf;
+	spin_unlock(&tt_lock);
+	return 0;
+}
+
+/**
+ * tt_stream_fill() - Format as many unread events as will fit into the
+ * storage for a streaming /proc file. Events are merged across cores in
+ * timestamp order. Events that were overwritten before they could be
+ * read are counted, and the count is reported (as an event with the
+ * timestamp of the next event from the same core) once reading resumes
+ * on that core. The caller must hold tt_lock.
+ * @sf:      The open file.
+ */
+static void tt_stream_fill(struct tt_stream_file *sf)
+{
+	__u64 earliest_time, total;
+	struct tt_buffer *buffer;
+	struct tt_event event;
+	int available, length;
+	int core, i;
+
+	while (1) {
+		/* Find the core whose next event is the earliest. */
+		earliest_time = ~0;
+		core = -1;
+		for (i = 0; i < nr_cpu_ids; i++) {
+			buffer = tt_buffers[i];
+			total = smp_load_acquire(&buffer->total);
+			if (sf->seq[i] >= total)
+				continue;
+			if (total - sf->seq[i] >= tt_buffer_size) {
+				sf->dropped[i] += total - sf->seq[i]
+						- tt_buffer_size + 1;
+				sf->seq[i] = total - tt_buffer_size + 1;
+			}
+			event.timestamp = READ_ONCE(buffer->events[sf->seq[i]
+					& (tt_buffer_size - 1)].timestamp);
+			if (event.timestamp < earliest_time) {
+				earliest_time = event.timestamp;
+				core = i;
+			}
+		}
+		if (core < 0)
+			return;
+
+		/* Copy the event, then make sure it wasn't overwritten
+		 * while we were copying it.
+		 */
+		buffer = tt_buffers[core];
+		event = buffer->events[sf->seq[core] & (tt_buffer_size - 1)];
+		smp_rmb();
+		if (READ_ONCE(buffer->total) - sf->seq[core] >= tt_buffer_size) {
+			sf->dropped[core]++;
+			sf->seq[core]++;
+			continue;
+		}
+
+		available = tt_pf_storage - (sf->next_byte +
+				sf->bytes_available - sf->msg_storage);
+		if (sf->dropped[core] != 0) {
+			length = snprintf(sf->next_byte + sf->bytes_available,
+					  available,
+					  "%lu [C%02d] timetrace stream dropped %llu events\n",
+					  (unsigned long)event.timestamp, core,
+					  sf->dropped[core]);
+			if (length >= available)
+				return;
+			sf->bytes_available += length;
+			available -= length;
+			sf->dropped[core] = 0;
+		}
+		length = snprintf(sf->next_byte + sf->bytes_available,
+				  available, "%lu [C%02d] ",
+				  (unsigned long)event.timestamp, core);
+		if (length < available)
+			length += snprintf(sf->next_byte + sf->bytes_available
+					   + length, available - length,
+					   event.format, event.arg0,
+					   event.arg1, event.arg2, event.arg3);
+		if (length >= available) {
+			/* Not enough room for this entry. */
+			if (sf->bytes_available != 0)
+				return;
+
+			/* Even a full buffer isn't enough for this entry;
+			 * truncate it.
+			 */
+			length = available - 1;
+		}
+		sf->next_byte[sf->bytes_available + length] = '\n';
+		sf->bytes_available += length + 1;
+		sf->seq[core]++;
+	}
+}
+
+/**
+ * tt_stream_read() - This function is invoked to handle read kernel calls
+ * on /proc/timetrace_stream. It returns events that have been recorded
+ * since the previous read, without freezing the timetrace. A return value
+ * of 0 doesn't mean the file is finished: it means there are currently
+ * no new events, so the caller should wait a while and read again.
+ * @file:     Information about the file being read.
+ * @user_buf: Address in user space of the buffer in which data from the file
+ *            should be returned.
+ * @length:   Number of bytes available at @buffer.
+ * @offset:   Current read offset within the file; ignored.
+ *
+ * Return: the number of bytes returned at @buffer, or a negative errno.
+ */
+ssize_t tt_stream_read(struct file *file, char __user *user_buf,
+		       size_t length, loff_t *offset)
+{
+	struct tt_stream_file *sf = file->private_data;
+	int copied_to_user = 0;
+	int chunk_size;
+
+	if (!sf || sf->file != file) {
+		pr_err("%s found damaged private_data: 0x%p\n", __func__,
+		       file->private_data);
+		return -EINVAL;
+	}
+
+	while (copied_to_user < length) {
+		if (sf->bytes_available == 0) {
+			spin_lock(&tt_lock);
+			if (init) {
+				sf->next_byte = sf->msg_storage;
+				tt_stream_fill(sf);
+			}
+			spin_unlock(&tt_lock);
+			if (sf->bytes_available == 0)
+				break;
+		}
+
+		/* Copy without holding tt_lock, since copy_to_user
+		 * may sleep.
+		 */
+		chunk_size = sf->bytes_available;
+		if (chunk_size > (length - copied_to_user))
+			chunk_size = length - copied_to_user;
+		if (copy_to_user(user_buf + copied_to_user, sf->next_byte,
+				 chunk_size) != 0) {
+			/* Leave the data in place to retry on the next read. */
+			if (copied_to_user == 0)
+				copied_to_user = -EFAULT;
+			break;
+		}
+		sf->bytes_available -= chunk_size;
+		sf->next_byte += chunk_size;
+		copied_to_user += chunk_size;
+	}
+	return copied_to_user;
+}
+
+/**
+ * tt_stream_release() - This function is invoked when the last reference
+ * to an open /proc/timetrace_stream is closed.
+ * @inode:    The inode corresponding to the file.
+ * @file:     Information about the open file.
+ *
+ * Return: 0 for success, or a negative errno if there was an error.
+ */
+int tt_stream_release(struct inode *inode, struct file *file)
+{
+	struct tt_stream_file *sf = file->private_data;
+
+	if (!sf || sf->file != file) {
+		pr_err("%s found damaged private_data: 0x%p\n", __func__,
+		       file->private_data);
+		return -EINVAL;
+	}
+	spin_lock(&tt_lock);
+	tt_stream_readers--;
+	spin_unlock(&tt_lock);
+	vfree(sf);
+	file->private_data = NULL;
+	return 0;
+}
+
 /**
  * tt_print_file() - Print the contents of the timetrace to a given file.
  * Useful in situations where the system is too unstable to extract a
@@ -4,6 +4,7 @@
 #define HOMA_TIMETRACE_H
 
 #include <asm/types.h>
+#include <linux/hash.h>
 
 #ifdef __UNIT_TEST__
 #undef get_cycles
@@ -49,10 +50,17 @@ struct tt_event {
 	__u32 arg3;
 };
 
-/* The number of events in a tt_buffer, as a power of 2. */
-#define TT_BUF_SIZE_EXP 14
+/* Default number of events in a tt_buffer, as a power of 2; the actual
+ * size is set when the module is loaded (tt_buf_exp parameter) and
+ * stored in tt_buffer_size.
+ */
+#define TT_BUF_SIZE_EXP 16
 #define TT_BUF_SIZE BIT(TT_BUF_SIZE_EXP)
 
+/* Limits on the tt_buf_exp module parameter. */
+#define TT_BUF_MIN_EXP 8
+#define TT_BUF_MAX_EXP 20
+
 /**
  * Represents a sequence of events, typically consisting of all those
  * generated by one thread.  Has a fixed capacity, so slots are re-used
@@ -64,12 +72,20 @@ struct tt_buffer {
 	 */
 	int next_index;
 
+	/**
+	 * Total number of events ever recorded in this buffer; next_index
+	 * is always this value modulo the buffer size. Incremented after
+	 * each event has been written, so streaming readers can detect
+	 * events that were overwritten before they could be read.
+	 */
+	__u64 total;
+
 	/**
 	 *  Holds information from the most recent calls to tt_record.
 	 * Updated circularly, so each new event replaces the oldest
-	 * existing event.
+	 * existing event. Has tt_buffer_size entries.
 	 */
-	struct tt_event events[TT_BUF_SIZE];
+	struct tt_event events[];
 };
 
 /**
@@ -98,12 +114,46 @@ struct tt_proc_file {
 	char *next_byte;
 };
 
+/**
+ * Holds information about an open of the streaming timetrace /proc file
+ * (e.g. /proc/timetrace_stream). Unlike tt_proc_file, reading through
+ * one of these doesn't freeze the timetrace: each read returns the
+ * events recorded since the previous read, and overruns are reported
+ * in the output.
+ */
+struct tt_stream_file {
+	/* Identifies a particular open file. */
+	struct file *file;
+
+	/* For each tt_buffer, the value of its total field corresponding
+	 * to the next event to return.
+	 */
+	__u64 seq[NR_CPUS];
+
+	/* For each tt_buffer, the number of events that were overwritten
+	 * before they could be returned and haven't yet been reported.
+	 */
+	__u64 dropped[NR_CPUS];
+
+	/* Formatted events waiting to be copied to user space. */
+	char msg_storage[TT_PF_BUF_SIZE];
+
+	/* Number of bytes in msg_storage currently available to
+	 * copy to application.
+	 */
+	int bytes_available;
+
+	/* Address of next byte in msg_storage to copy to application. */
+	char *next_byte;
+};
+
 void      tt_destroy(void);
 void      tt_freeze(void);
 int       tt_init(char *proc_file, int *temp);
 void      tt_record_buf(struct tt_buffer *buffer, __u64 timestamp,
 			const char *format, __u32 arg0, __u32 arg1,
 			__u32 arg2, __u32 arg3);
+void      tt_set_sample_rate(int rate);
 
 /* Private methods and variables: exposed so they can be accessed
  * by unit tests.
@@ -120,11 +170,17 @@ ssize_t   tt_proc_read(struct file *file, char __user *user_buf,
 		       size_t length, loff_t *offset);
 int       tt_proc_release(struct inode *inode, struct file *file);
 loff_t    tt_proc_lseek(struct file *file, loff_t offset, int whence);
+int       tt_stream_open(struct inode *inode, struct file *file);
+ssize_t   tt_stream_read(struct file *file, char __user *user_buf,
+			 size_t length, loff_t *offset);
+int       tt_stream_release(struct inode *inode, struct file *file);
 extern struct    tt_buffer *tt_buffers[];
 extern int       tt_buffer_size;
 extern atomic_t  tt_freeze_count;
 extern bool      tt_frozen;
 extern int       tt_pf_storage;
+extern int       tt_stream_readers;
+extern __u32     tt_sample_threshold;
 extern bool      tt_test_no_khz;
 
 /* Debugging variables exposed by the version of timetrace built into
@@ -204,6 +260,65 @@ static inline void tt_record(const char *format)
 #endif
 }
 
+/**
+ * tt_rpc_sampled(): returns true if timetrace events for a given RPC
+ * should be recorded (see tt_set_sample_rate).
+ * @id:        Identifier for the RPC. The client and server ids for an
+ *             RPC differ only in their low-order bit, which is ignored,
+ *             so both ends of an RPC make the same decision. Only the
+ *             low-order 32 bits are used, so callers may pass truncated
+ *             ids.
+ */
+static inline bool tt_rpc_sampled(__u64 id)
+{
+	__u32 threshold = READ_ONCE(tt_sample_threshold);
+
+	return threshold == 0 || hash_32(((__u32)id) >> 1, 32) < threshold;
+}
+
+/**
+ * tt_rpc_recordN(): record an event pertaining to a particular RPC, along
+ * with N parameters. The event is discarded unless the RPC is being
+ * sampled (see tt_rpc_sampled). Other arguments are the same as for
+ * tt_recordN.
+ *
+ * @id:        Identifier for the RPC the event pertains to.
+ */
+static inline void tt_rpc_record4(__u64 id, const char *format, __u32 arg0,
+				  __u32 arg1, __u32 arg2, __u32 arg3)
+{
+#if ENABLE_TIME_TRACE
+	if (tt_rpc_sampled(id))
+		tt_record4(format, arg0, arg1, arg2, arg3);
+#endif
+}
+
+static inline void tt_rpc_record3(__u64 id, const char *format, __u32 arg0,
+				  __u32 arg1, __u32 arg2)
+{
+#if ENABLE_TIME_TRACE
+	if (tt_rpc_sampled(id))
+		tt_record3(format, arg0, arg1, arg2);
+#endif
+}
+
+static inline void tt_rpc_record2(__u64 id, const char *format, __u32 arg0,
+				  __u32 arg1)
+{
+#if ENABLE_TIME_TRACE
+	if (tt_rpc_sampled(id))
+		tt_record2(format, arg0, arg1);
+#endif
+}
+
+static inline void tt_rpc_record1(__u64 id, const char *format, __u32 arg0)
+{
+#if ENABLE_TIME_TRACE
+	if (tt_rpc_sampled(id))
+		tt_record1(format, arg0);
+#endif
+}
+
 static inline __u32 tt_hi(void *p)
 {
 #pragma GCC diagnostic push
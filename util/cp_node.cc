@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <execinfo.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <poll.h>
@@ -54,12 +55,14 @@ using std::string;
 uint32_t client_max = 1;
 uint32_t client_port_max = 1;
 int client_ports = 0;
+int conn_threads = 1;
 int first_port = -1;
 bool is_server = false;
 int node_id = -1;
 double net_gbps = 0.0;
 bool tcp_trunc = true;
 bool one_way = false;
+bool open_loop = false;
 int port_receivers = 1;
 int port_threads = 1;
 std::string protocol_string;
@@ -78,6 +81,38 @@ int buf_bpages = 1000;
 /* Node ids for client to send requests to. */
 std::vector<int> server_ids;
 
+/**
+ * struct arrival - One request from the file given with the --arrivals
+ * client option.
+ */
+struct arrival {
+	/**
+	 * @interval: time (in rdtsc cycles) between the start of this
+	 * request and the start of the next one.
+	 */
+	double interval;
+
+	/**
+	 * @length: number of bytes in the request; 0 means choose a length
+	 * from --workload.
+	 */
+	int length;
+};
+
+/**
+ * @arrivals: the requests from the --arrivals client option, if any, in
+ * order. Empty means use Poisson arrivals at the rate given by --gbps.
+ */
+std::vector<arrival> arrivals;
+
+/**
+ * define OPEN_LOOP_MAX: with --open-loop, the maximum number of requests
+ * that a single client port may have outstanding. If this limit is reached
+ * the sender stalls, but the stall is still charged to the latency of the
+ * delayed requests.
+ */
+#define OPEN_LOOP_MAX 10000
+
 /** @rand_gen: random number generator. */
 static std::mt19937 rand_gen(
 		std::chrono::system_clock::now().time_since_epoch().count());
@@ -257,6 +292,12 @@ void print_help(const char *name)
 		"commands are supported, each followed by a list of options supported\n"
 		"by that command:\n\n"
 	        "client [options]      Start one or more client threads\n");
+	printf("    --arrivals        Replay requests from the given file instead of\n"
+		"                      generating Poisson arrivals from --gbps; each line\n"
+		"                      holds the time in microseconds until the next request\n"
+		"                      and optionally the request length (default: lengths\n"
+		"                      come from --workload). Each port replays the file\n"
+		"                      independently, starting at a random line\n");
 	printf("    --buf-bpages      Number of bpages to allocate in the buffer poool for\n"
 		"                      incoming messages (default: %d)\n",
 			buf_bpages);
@@ -278,6 +319,11 @@ void print_help(const char *name)
 	printf("    --no-trunc        For TCP, allow messages longer than Homa's limit\n");
 	printf("    --one-way         Make all response messages 100 B, instead of the same\n"\
 		"                      size as request messages\n");
+	printf("    --open-loop       Issue requests at their scheduled times regardless\n"
+		"                      of how many are outstanding (up to %d per port), and\n"
+		"                      measure latency from the scheduled time rather than\n"
+		"                      the time the request was actually sent\n",
+			OPEN_LOOP_MAX);
 	printf("    --ports           Number of ports on which to send requests (one\n"
 		"                      sending thread per port (default: %d)\n",
 		client_ports);
@@ -285,7 +331,9 @@ void print_help(const char *name)
 		"                      port (default: %d). Zero means senders wait for their\n"
 		"                      own requests synchronously\n",
 			port_receivers);
-	printf("    --protocol        Transport protocol to use: homa or tcp (default: %s)\n",
+	printf("    --protocol        Transport protocol to use: homa, homa_conn (Homa\n"
+		"                      with one connected socket per server port), or tcp\n"
+		"                      (default: %s)\n",
 			protocol);
 	printf("    --server-nodes    Number of nodes running server threads (default: 1)\n");
 	printf("    --server-ports    Number of server ports on each server node\n"
@@ -302,6 +350,9 @@ void print_help(const char *name)
 			workload);
 	printf("debug value value ... Set one or more int64_t values that may be used for\n"
 		"                      various debugging purposes\n\n");
+	printf("dump_hist file [exp]  Write a histogram of RTTs for clients running\n");
+	printf("                      experiment exp (or all clients) to file, in\n");
+	printf("                      HdrHistogram's percentile format, then reset it\n\n");
 	printf("dump_times file [exp] Log RTT times (and lengths) for clients running\n");
 	printf("                      experiment exp to file; if exp is omitted, dump\n");
 	printf("                      all RTTs\n\n");
@@ -317,6 +368,10 @@ void print_help(const char *name)
 	printf("    --buf-bpages      Number of bpages to allocate in the buffer poool for\n"
 		"                      incoming messages (default: %d)\n",
 			buf_bpages);
+	printf("    --conn-threads    Number of server threads to service each connected\n"
+		"                      socket peeled off from a port (homa_conn only,\n"
+		"                      default: %d)\n",
+			conn_threads);
 	printf("    --exp             Name of the experiment in which these server ports\n");
 	printf("                      will be participating; used to label measurement data\n");
 	printf("                      (defaults to <protocol>_<workload>)\n");
@@ -326,10 +381,13 @@ void print_help(const char *name)
 	printf("    --ipv6            Use IPv6 instead of IPv4\n");
 	printf("    --pin             All server threads will be restricted to run only\n"
 	        "                      on the givevn core\n");
-	printf("    --protocol        Transport protocol to use: homa or tcp (default: %s)\n",
+	printf("    --protocol        Transport protocol to use: homa, homa_conn (peel\n"
+		"                      off a connected socket for each client), or tcp\n"
+		"                      (default: %s)\n",
 			protocol);
 	printf("    --port-threads    Number of server threads to service each port\n"
-		"                      (Homa only, default: %d)\n",
+		"                      (Homa only; for homa_conn, these threads service\n"
+		"                      the listening socket) (default: %d)\n",
 			port_threads);
 	printf("    --ports           Number of ports to listen on (default: %d)\n\n",
 			server_ports);
@@ -1122,148 +1180,165 @@ void homa_server::server(int thread_id, server_metrics *metrics)
 }
 
 /**
- * class tcp_server - Holds information about a single TCP server,
- * which consists of a thread that handles requests on a given port.
+ * class homa_conn_server - Holds information about a single Homa port
+ * that is serviced with connected sockets. The first request from each
+ * client arrives on an unconnected listening socket; the server answers
+ * it there and then uses homa_peeloff to create a connected socket for
+ * that client, which receives all of the client's later requests and is
+ * serviced by its own threads.
  */
-class tcp_server {
+class homa_conn_server {
 public:
-	tcp_server(int port, int id, int num_threads, std::string& experiment);
-	~tcp_server();
-	void accept(int epoll_fd);
-	void read(int fd, int pid);
-	void server(int thread_id);
+	/**
+	 * struct connection - Information about one connected socket
+	 * peeled off from the listening socket.
+	 */
+	struct connection {
+		/** @id: Index of this connection among those for the port. */
+		int id;
+
+		/** @fd: File descriptor for the connected socket. */
+		int fd;
+
+		/**
+		 * @buf_region: mmapped region of memory in which receive
+		 * buffers for @fd are allocated.
+		 */
+		char *buf_region;
+
+		/** @threads: Threads that service requests arriving on @fd. */
+		std::vector<std::thread> threads;
+	};
+
+	homa_conn_server(int port, int id, int inet_family, int num_threads,
+			int conn_threads, std::string& experiment);
+	~homa_conn_server();
+	void listener(int thread_id);
+	void peeloff(const struct sockaddr *client_addr);
+	void server(connection *conn, int thread_id);
 
 	/**
-	 * @mutex: For synchronizing access to server-wide state, such
-	 * as listen_fd.
+	 * @mutex: For synchronizing access to @connections and for
+	 * serializing peeloffs.
 	 */
 	std::atomic_bool mutex;
 
-	/** @port: Port on which we listen for connections. */
-	int port;
-
-	/** @id: Unique identifier for this server. */
+	/** @id: Unique identifier for this server among all Homa servers. */
 	int id;
 
-	/**  @experiment: name of the experiment this server is running. */
-	string experiment;
+	/** @fd: File descriptor for the listening Homa socket. */
+	int fd;
 
-	/** @listen_fd: File descriptor for the listen socket. */
-	int listen_fd;
+	/** @port: Homa port number managed by this object. */
+	int port;
 
-	/** @epoll_fd: File descriptor used for epolling. */
-	int epoll_fd;
+	/**  @experiment: name of the experiment this server is running. */
+	string experiment;
 
 	/**
-	 * @epollet: EPOLLET if this flag should be used, or 0 otherwise.
-	 * We only use edge triggering if there are multiple receiving
-	 * threads (it's unneeded if there's only a single thread, and
-	 * it's faster not to use it).
+	 * @buf_region: mmapped region of memory in which receive buffers
+	 * for @fd are allocated.
 	 */
-	int epollet;
+	char *buf_region;
 
 	/**
-	 * @connections: Entry i contains information for a client
-	 * connection on fd i, or NULL if no such connection.
+	 * @buf_size: number of bytes available at @buf_region (also used
+	 * for the region of each connection).
 	 */
-	tcp_connection *connections[MAX_FDS];
+	size_t buf_size;
 
-	/** @metrics: Performance statistics. Not owned by this class. */
-	server_metrics *metrics;
+	/** @conn_threads: Number of threads to service each connection. */
+	int conn_threads;
 
 	/**
-	 * @thread: Background threads that both accept connections and
-	 * service requests on them.
+	 * @metrics: Performance statistics, shared by all of the threads
+	 * for this port. Not owned by this class.
 	 */
-	std::vector<std::thread> threads;
+	server_metrics *metrics;
 
-	/** @stop: True means that background threads should exit. */
-	bool stop;
+	/** @connections: All of the sockets peeled off so far. */
+	std::vector<connection *> connections;
+
+	/** @threads: Threads that service the listening socket. */
+	std::vector<std::thread> threads;
 };
 
-/** @tcp_servers: keeps track of all existing Homa clients. */
-std::vector<tcp_server *> tcp_servers;
+/** @homa_conn_servers: keeps track of all existing homa_conn_servers. */
+std::vector<homa_conn_server *> homa_conn_servers;
 
 /**
- * tcp_server::tcp_server() - Constructor for tcp_server objects.
- * @port:         Port number on which this server should listen for incoming
- *                requests.
- * @id:           Unique identifier for this server.
- * @num_threads:  Number of threads to service this listening socket and
- *                all of the other sockets excepted from it.
- * @experiment:   Name of the experiment in which this server is participating.
+ * homa_conn_server::homa_conn_server() - Constructor for homa_conn_servers.
+ * Sets up the listening socket and starts up the threads to service it.
+ * @port:          Homa port number for this port.
+ * @id:            Unique identifier for this port; used in thread
+ *                 identifiers for time traces.
+ * @inet_family:   AF_INET or AF_INET6: determines whether we use IPv4 or
+ *                 IPv6.
+ * @num_threads:   How many threads should collectively service requests
+ *                 on the listening socket.
+ * @conn_threads:  How many threads should service requests on each
+ *                 connected socket.
+ * @experiment:    Name of the experiment in which this server is
+ *                 participating.
  */
-tcp_server::tcp_server(int port, int id, int num_threads,
-		std::string& experiment)
+homa_conn_server::homa_conn_server(int port, int id, int inet_family,
+		int num_threads, int conn_threads, std::string& experiment)
 	: mutex(0)
-	, port(port)
-        , id(id)
-	, listen_fd(-1)
-	, epoll_fd(-1)
-        , epollet((num_threads > 0) ? EPOLLET : 0)
-        , connections()
+	, id(id)
+        , fd(-1)
+        , port(port)
+	, experiment(experiment)
+        , buf_region(NULL)
+        , buf_size(buf_bpages*HOMA_BPAGE_SIZE)
+        , conn_threads(conn_threads)
         , metrics()
+        , connections()
         , threads()
-        , stop(false)
 {
+	sockaddr_in_union addr;
+	struct homa_rcvbuf_args arg;
+
 	if (std::find(experiments.begin(), experiments.end(), experiment)
 			== experiments.end())
 		experiments.emplace_back(experiment);
 
-	memset(connections, 0, sizeof(connections));
-	listen_fd = socket(inet_family, SOCK_STREAM, 0);
-	if (listen_fd == -1) {
-		log(NORMAL, "FATAL: couldn't open server socket: %s\n",
-				strerror(errno));
-		exit(1);
-	}
-	int option_value = 1;
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option_value,
-			sizeof(option_value)) != 0) {
-		log(NORMAL, "FATAL: couldn't set SO_REUSEADDR on listen "
-				"socket: %s",
-				strerror(errno));
-		exit(1);
-	}
-	if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0) {
-		log(NORMAL, "FATAL: couldn't set O_NONBLOCK on listen "
-				"socket: %s",
+	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		log(NORMAL, "FATAL: homa_conn_server couldn't open Homa "
+				"socket: %s\n",
 				strerror(errno));
 		exit(1);
 	}
-	sockaddr_in_union addr;
-	if (inet_family == AF_INET) {
-		addr.in4.sin_family = AF_INET;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.in4.sin_family = inet_family;
+	if (inet_family == AF_INET)
 		addr.in4.sin_port = htons(port);
-		addr.in4.sin_addr.s_addr = INADDR_ANY;
-	} else {
+	else {
 		addr.in6.sin6_family = AF_INET6;
 		addr.in6.sin6_port = htons(port);
-		addr.in6.sin6_addr = in6addr_any;
-	}
-	if (bind(listen_fd, &addr.sa, sizeof(addr)) == -1) {
-		log(NORMAL, "FATAL: couldn't bind to port %d: %s\n", port,
-				strerror(errno));
-		exit(1);
 	}
-	if (listen(listen_fd, 1000) == -1) {
-		log(NORMAL, "FATAL: couldn't listen on socket: %s",
+	if (bind(fd, &addr.sa, sizeof(addr)) != 0) {
+		log(NORMAL, "FATAL: homa_conn_server couldn't bind socket "
+				"to Homa port %d: %s\n", port,
 				strerror(errno));
 		exit(1);
 	}
+	log(NORMAL, "Successfully bound to Homa port %d (connected)\n", port);
 
-	epoll_fd = epoll_create(10);
-	if (epoll_fd < 0) {
-		log(NORMAL, "FATAL: couldn't create epoll instance for "
-				"TCP server: %s\n",
-				strerror(errno));
+	buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (buf_region == MAP_FAILED) {
+		printf("Couldn't mmap buffer region for server on port %d: %s\n",
+				port, strerror(errno));
 		exit(1);
 	}
-	struct epoll_event ev;
-	ev.events = EPOLLIN;
-	ev.data.fd = listen_fd;
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
-		log(NORMAL, "FATAL: couldn't add listen socket to epoll: %s\n",
+	arg.start = buf_region;
+	arg.length = buf_size;
+	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &arg,
+			sizeof(arg));
+	if (status < 0) {
+		printf("FATAL: error in setsockopt(SO_HOMA_RCVBUF): %s\n",
 				strerror(errno));
 		exit(1);
 	}
@@ -1272,202 +1347,202 @@ tcp_server::tcp_server(int port, int id, int num_threads,
 	::metrics.push_back(metrics);
 
 	for (int i = 0; i < num_threads; i++)
-		threads.emplace_back(&tcp_server::server, this, i);
-	kfreeze_count = 0;
+		threads.emplace_back(&homa_conn_server::listener, this, i);
 }
 
 /**
- * tcp_server::~tcp_server() - Destructor for TCP servers. Terminates the
- * server's background thread.
+ * homa_conn_server::~homa_conn_server() - Destructor for homa_conn_servers.
  */
-tcp_server::~tcp_server()
+homa_conn_server::~homa_conn_server()
 {
-	int fds[2];
-
-	stop = true;
-
-	/* In order to wake up the background threads, open a file that is
-	 * readable and add it to the epoll set.
-	 */
-	if (pipe2(fds, 0) < 0) {
-		log(NORMAL, "FATAL: couldn't create pipe to shutdown TCP "
-				"server: %s\n", strerror(errno));
-		exit(1);
-	}
-	struct epoll_event ev;
-	ev.events = EPOLLIN;
-	ev.data.fd = fds[0];
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &ev);
-	if (write(fds[1], "xxxx", 4) < 0) {
-		log(NORMAL, "FATAL: couldn't write to TCP shutdown pipe: %s\n",
-				strerror(errno));
-		exit(1);
-	}
-
-	for (size_t i = 0; i < threads.size(); i++)
-		threads[i].join();
-	close(listen_fd);
-	close(epoll_fd);
-	close(fds[0]);
-	close(fds[1]);
-	for (unsigned i = 0; i < MAX_FDS; i++) {
-		if (connections[i] != NULL) {
-			if (close(i) < 0)
-				log(NORMAL, "Error closing TCP connection to "
-						"%s: %s\n",
-						print_address(
-						&connections[i]->peer),
-						strerror(errno));
-			delete connections[i];
-			log(NORMAL, "Deleted connection at 0x%p, size %lu\n",
-				connections[i], sizeof(*connections[i]));
-			connections[i] = NULL;
-		}
+	log(NORMAL, "Homa connected server on port %d shutting down\n", port);
+	shutdown(fd, SHUT_RDWR);
+	for (std::thread &thread: threads)
+		thread.join();
+	for (connection *conn: connections) {
+		shutdown(conn->fd, SHUT_RDWR);
+		for (std::thread &thread: conn->threads)
+			thread.join();
+		close(conn->fd);
+		munmap(conn->buf_region, buf_size);
+		delete conn;
 	}
+	close(fd);
+	munmap(buf_region, buf_size);
 }
 
 /**
- * tcp_server::server() - Handles incoming TCP requests on a listen socket
- * and all of the connections accepted via that socket. Normally invoked as
- * top-level method in a thread. There can potentially be multiple instances
- * of this function running simultaneously.
- * @thread_id:  Unique id for this particular thread among all of the
- *              threads in this server.
+ * homa_conn_server::listener() - Handles requests arriving on the listening
+ * socket (normally just the first request from each client) and peels off
+ * a connected socket for each new client. Normally invoked as top-level
+ * method in a thread.
+ * @thread_id:   Unique identifier for this thread among all those for the
+ *               listening socket.
  */
-void tcp_server::server(int thread_id)
+void homa_conn_server::listener(int thread_id)
 {
+	message_header *header;
+	int length, num_vecs, result;
 	char thread_name[50];
+	homa::receiver receiver(fd, buf_region);
+	struct iovec vecs[HOMA_MAX_BPAGES];
+	int offset;
 
 	snprintf(thread_name, sizeof(thread_name), "S%d.%d", id, thread_id);
 	time_trace::thread_buffer thread_buffer(thread_name);
-	int pid = syscall(__NR_gettid);
 	if (server_core >= 0) {
 		printf("Pinning thread %s to core %d\n", thread_name,
 				server_core);
 		pin_thread(server_core);
 	}
 
-	/* Each iteration through this loop processes a batch of epoll events. */
 	while (1) {
-#define MAX_EVENTS 20
-		struct epoll_event events[MAX_EVENTS];
-		int num_events;
-
 		while (1) {
-			num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-			if (stop)
-				return;
-			if (num_events >= 0)
+			length = receiver.receive(HOMA_RECVMSG_REQUEST, 0);
+			if (length >= 0)
 				break;
-			if ((errno == EAGAIN) || (errno == EINTR))
-				continue;
-			log(NORMAL, "FATAL: epoll_wait failed: %s\n",
-					strerror(errno));
-			exit(1);
+			if ((errno == EBADF) || (errno == ESHUTDOWN)) {
+				log(NORMAL, "Homa listener thread %s exiting "
+						"(socket closed)\n",
+						thread_name);
+				return;
+			}
+			else if ((errno != EINTR) && (errno != EAGAIN))
+				log(NORMAL, "recvmsg failed: %s\n",
+						strerror(errno));
 		}
-		tt("epoll_wait returned %d events in server pid %d",
-				num_events, pid);
-		for (int i = 0; i < num_events; i++) {
-			int fd = events[i].data.u32;
-			if (fd == listen_fd) {
-				spin_lock lock_guard(&mutex);
-				accept(epoll_fd);
-			} else {
-				spin_lock lock_guard(&fd_locks[fd]);
-				if ((events[i].events & EPOLLIN) &&
-						(connections[fd] != NULL))
-					read(fd, pid);
-				if ((events[i].events & EPOLLOUT) &&
-						(connections[fd] != NULL)) {
-					if (connections[fd]->xmit())
-						connections[fd]->set_epoll_events(
-								epoll_fd,
-								EPOLLIN|epollet);
-				}
-			}
+		header = receiver.get<message_header>(0);
+		tt("Received Homa request on listening socket, cid 0x%08x, "
+				"id %u, length %d",
+				header->cid, header->msg_id, header->length);
+		if ((header->short_response) && (header->length > 100)) {
+			header->length = 100;
+		}
+
+		num_vecs = 0;
+		offset = 0;
+		while (offset < header->length) {
+			size_t chunk_size = header->length - offset;
+			if (chunk_size > HOMA_BPAGE_SIZE)
+				chunk_size = HOMA_BPAGE_SIZE;
+			vecs[num_vecs].iov_len = chunk_size;
+			vecs[num_vecs].iov_base = receiver.get<char>(offset);
+			offset += chunk_size;
+			num_vecs++;
+		}
+		result = homa_replyv(fd, vecs, num_vecs, receiver.src_addr(),
+				     sockaddr_size(receiver.src_addr()),
+				     receiver.id());
+		if (result < 0) {
+			log(NORMAL, "FATAL: homa_reply failed for server "
+					"port %d: %s\n",
+					port, strerror(errno));
+			exit(1);
 		}
+		metrics->requests++;
+		metrics->bytes_in += length;
+		metrics->bytes_out += header->length;
+		peeloff(receiver.src_addr());
 	}
-	log(NORMAL, "TCP server thread %s exiting\n", thread_name);
 }
 
 /**
- * tcp_server::accept() - Accepts a new incoming TCP connection and
- * initializes state for that connection.
- * @epoll_fd:   Used to arrange for epolling on the new connection.
+ * homa_conn_server::peeloff() - Create a connected socket for a client,
+ * if there isn't one already, and start threads to service it.
+ * @client_addr:  Address of the client's socket.
  */
-void tcp_server::accept(int epoll_fd)
+void homa_conn_server::peeloff(const struct sockaddr *client_addr)
 {
-	int fd;
-	sockaddr_in_union client_addr;
-	socklen_t addr_len = sizeof(client_addr);
+	struct homa_rcvbuf_args arg;
+	sockaddr_in_union addr;
+	connection *conn;
+	int conn_fd;
 
-	fd = ::accept4(listen_fd, &client_addr.sa, &addr_len, SOCK_NONBLOCK);
-	if (fd < 0) {
-		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	/* Serialize peeloffs so that the kernel's EISCONN check is
+	 * reliable when several requests from a new client arrive on the
+	 * listening socket.
+	 */
+	spin_lock lock_guard(&mutex);
+	memcpy(&addr, client_addr, sockaddr_size(client_addr));
+	conn_fd = homa_peeloff(fd, &addr.sa, sockaddr_size(&addr.sa));
+	if (conn_fd < 0) {
+		if (errno == EISCONN)
 			return;
-		log(NORMAL, "FATAL: couldn't accept incoming TCP connection: "
-				"%s\n", strerror(errno));
+		log(NORMAL, "FATAL: homa_peeloff failed for server port %d "
+				"(client %s): %s\n", port,
+				print_address(&addr), strerror(errno));
 		exit(1);
 	}
 
-	/* Make sure the connection appears to be coming from someone
-	 * we trust (as of August 2023, at CloudLab, external sites
-	 * could open connections).
-	 */
-	if (client_addr.in4.sin_family == AF_INET) {
-		uint8_t *ipaddr = (uint8_t *) &client_addr.in4.sin_addr;
-		bool is_internet = true;
-
-		if (ipaddr[0] == 10) {
-			is_internet = false;
-		}
-		else if (ipaddr[0] == 172 && (ipaddr[1] >= 16 && ipaddr[1] <= 31)) {
-			is_internet = false;
-		}
-		else if (ipaddr[0] == 192 && ipaddr[1] == 168) {
-			is_internet = false;
-		}
-
-		if (is_internet) {
-			log(NORMAL, "ERROR: tcp_server::accept rejecting "
-					"rogue TCP connection from %s\n",
-					print_address(&client_addr));
-			::close(fd);
-			return;
-		}
+	conn = new connection;
+	conn->id = connections.size();
+	conn->fd = conn_fd;
+	conn->buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (conn->buf_region == MAP_FAILED) {
+		printf("Couldn't mmap buffer region for connection on port "
+				"%d: %s\n", port, strerror(errno));
+		exit(1);
 	}
-	log(NORMAL, "tcp_server on port %d accepted connection from %s, fd %d\n",
-			port, print_address(&client_addr), fd);
-	int flag = 1;
-	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-	if (fd >= MAX_FDS) {
-		log(NORMAL, "FATAL: TCP socket fd %d is greater than MAX_FDS\n",
-				fd);
+	arg.start = conn->buf_region;
+	arg.length = buf_size;
+	if (setsockopt(conn_fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &arg,
+			sizeof(arg)) < 0) {
+		printf("FATAL: error in setsockopt(SO_HOMA_RCVBUF) for "
+				"connected socket: %s\n", strerror(errno));
 		exit(1);
 	}
-	spin_lock lock_guard(&fd_locks[fd]);
-	tcp_connection *connection = new tcp_connection(fd, fd, port,
-			client_addr);
-	connections[fd] = connection;
-	connection->set_epoll_events(epoll_fd, EPOLLIN|epollet);
+	for (int i = 0; i < conn_threads; i++)
+		conn->threads.emplace_back(&homa_conn_server::server, this,
+				conn, i);
+	connections.push_back(conn);
+	log(NORMAL, "Peeled off connection %d on Homa port %d for %s\n",
+			conn->id, port, print_address(&addr));
 }
 
 /**
- * tcp_server::read() - Reads available data from a TCP connection; once an
- * entire request has been read, sends an appropriate response.
- * @fd:        File descriptor for connection; connections must hold
- *             state information for this descriptor.
- * @pid:       Pid for the thread (for messages).
+ * homa_conn_server::server() - Handles incoming requests arriving on a
+ * connected socket. Normally invoked as top-level method in a thread.
+ * @conn:        Connection whose requests this thread will service.
+ * @thread_id:   Unique identifier for this thread among all those for
+ *               @conn.
  */
-void tcp_server::read(int fd, int pid)
+void homa_conn_server::server(connection *conn, int thread_id)
 {
-	int error = connections[fd]->read(epollet,
-			[this, fd, pid](message_header *header) {
-		metrics->requests++;
-		metrics->bytes_in += header->length;
-		tt("Received TCP request, cid 0x%08x, id %u, length %d, pid %d",
-				header->cid, header->msg_id, header->length,
-				pid);
+	message_header *header;
+	int length, result;
+	char thread_name[50];
+	homa::receiver receiver(conn->fd, conn->buf_region);
+
+	/* homa_reply_connected needs the response in a single contiguous
+	 * buffer; only the header matters to the client.
+	 */
+	std::vector<char> response(HOMA_MAX_MESSAGE_LENGTH);
+
+	snprintf(thread_name, sizeof(thread_name), "S%d.c%d.%d", id, conn->id,
+			thread_id);
+	time_trace::thread_buffer thread_buffer(thread_name);
+	if (server_core >= 0)
+		pin_thread(server_core);
+
+	while (1) {
+		while (1) {
+			length = receiver.receive(HOMA_RECVMSG_REQUEST, 0);
+			if (length >= 0)
+				break;
+			if ((errno == EBADF) || (errno == ESHUTDOWN)) {
+				log(NORMAL, "Homa connection thread %s exiting "
+						"(socket closed)\n",
+						thread_name);
+				return;
+			}
+			else if ((errno != EINTR) && (errno != EAGAIN))
+				log(NORMAL, "recvmsg failed: %s\n",
+						strerror(errno));
+		}
+		header = receiver.get<message_header>(0);
+		tt("Received Homa request, cid 0x%08x, id %u, length %d",
+				header->cid, header->msg_id, header->length);
 		if ((header->freeze) && !time_trace::frozen) {
 			tt("Freezing timetrace because of request on "
 					"cid 0x%08x", header->cid);
@@ -1476,431 +1551,1385 @@ void tcp_server::read(int fd, int pid)
 			time_trace::freeze();
 			kfreeze();
 		}
-		if ((header->short_response) && (header->length > 100))
+		if ((header->short_response) && (header->length > 100)) {
 			header->length = 100;
-		metrics->bytes_out += header->length;
-		if (!connections[fd]->send_message(header))
-			connections[fd]->set_epoll_events(epoll_fd,
-					EPOLLIN|EPOLLOUT|epollet);
-	});
-	if (error) {
-		log(NORMAL, "Closing client connection: %s\n",
-				connections[fd]->error_message);
-		spin_lock lock_guard(&mutex);
-		if (close(fd) < 0) {
-			log(NORMAL, "Error closing TCP connection to %s: %s\n",
-					print_address(&connections[fd]->peer),
-					strerror(errno));
 		}
-		delete connections[fd];
-		connections[fd] = NULL;
+
+		memcpy(response.data(), header, sizeof(*header));
+		result = homa_reply_connected(conn->fd, response.data(),
+				header->length, receiver.id());
+		if (result < 0) {
+			log(NORMAL, "FATAL: homa_reply_connected failed for "
+					"server port %d: %s\n",
+					port, strerror(errno));
+			exit(1);
+		}
+		metrics->requests++;
+		metrics->bytes_in += length;
+		metrics->bytes_out += header->length;
 	}
 }
 
 /**
- * class client - Holds information that is common to both Homa clients
- * and TCP clients.
+ * class tcp_server - Holds information about a single TCP server,
+ * which consists of a thread that handles requests on a given port.
  */
-class client {
+class tcp_server {
 public:
+	tcp_server(int port, int id, int num_threads, std::string& experiment);
+	~tcp_server();
+	void accept(int epoll_fd);
+	void read(int fd, int pid);
+	void server(int thread_id);
+
 	/**
-	 * struct rinfo - Holds information about a request that we will
-	 * want when we get the response.
+	 * @mutex: For synchronizing access to server-wide state, such
+	 * as listen_fd.
 	 */
-	struct rinfo {
-		/** @start_time: rdtsc time when the request was sent. */
-		uint64_t start_time;
-
-		/** @request_length: number of bytes in the request message. */
-		int request_length;
-
-		/**
-		 * @active: true means the request has been sent but
-		 * a response hasn't yet been received.
-		 */
-		bool active;
-
-		rinfo() : start_time(0), request_length(0), active(false) {}
-	};
+	std::atomic_bool mutex;
 
-	client(int id, std::string& experiment);
-	virtual ~client();
-	void check_completion(const char *protocol);
-	int get_rinfo();
-	void record(uint64_t end_time, message_header *header);
-	virtual void stop_sender(void) {}
+	/** @port: Port on which we listen for connections. */
+	int port;
 
-	/**
-	 * @id: unique identifier for this client (index starting at
-	 * 0 for the first client.
-	 */
+	/** @id: Unique identifier for this server. */
 	int id;
 
-	/**  @experiment: name of the experiment this client is running. */
+	/**  @experiment: name of the experiment this server is running. */
 	string experiment;
 
-	/**
-	 * @server_addrs: Internet addresses for each of the server ports
-	 * where this client will send RPCs.
-	 */
-	std::vector<sockaddr_in_union> server_addrs;
-
-	/**
-	 * @server_conns: for each entry in @server_addrs, a connection
-	 * identifier with all fields filled in except client_port, which
-	 * will be 0.
-	 */
-	std::vector<conn_id> server_conns;
+	/** @listen_fd: File descriptor for the listen socket. */
+	int listen_fd;
 
-	/**
-	 * @freeze: one entry for each node index; 1 means messages to that
-	 * node should contain a flag telling the node to freeze its time trace.
-	 */
-	std::vector<int> freeze;
+	/** @epoll_fd: File descriptor used for epolling. */
+	int epoll_fd;
 
 	/**
-	 * @first_id: entry i contains the index in server_addrs of the first
-	 * entry for the server ports on node i.
+	 * @epollet: EPOLLET if this flag should be used, or 0 otherwise.
+	 * We only use edge triggering if there are multiple receiving
+	 * threads (it's unneeded if there's only a single thread, and
+	 * it's faster not to use it).
 	 */
-	std::vector<int> first_id;
+	int epollet;
 
 	/**
-	 * @rinfos: storage for more than enough rinfos to handle all of the
-	 * outstanding requests.
+	 * @connections: Entry i contains information for a client
+	 * connection on fd i, or NULL if no such connection.
 	 */
-	std::vector<rinfo> rinfos;
+	tcp_connection *connections[MAX_FDS];
 
-	/** @last_rinfo: index into rinfos of last slot that was allocated. */
-	int last_rinfo;
+	/** @metrics: Performance statistics. Not owned by this class. */
+	server_metrics *metrics;
 
 	/**
-	 * @receivers_running: number of receiving threads that have
-	 * initialized and are ready to receive responses.
+	 * @thread: Background threads that both accept connections and
+	 * service requests on them.
 	 */
-	std::atomic<size_t> receivers_running;
+	std::vector<std::thread> threads;
 
-	/**
-	 * @cycles_per_second: caches get_cycles_per_second() result.
-	 */
-	uint64_t cycles_per_second;
+	/** @stop: True means that background threads should exit. */
+	bool stop;
+};
 
-	/** @server_dist: used to select server indexes for outgoing RPCs. */
-	std::uniform_int_distribution<int> server_dist;
-
-        /**
-	 * @interval_dist: generator for the time intervals between RPCs.
-	 */
-	std::exponential_distribution<double> interval_dist;
-
-	/** @length_dist: Generator of message lengths. */
-	dist_point_gen length_dist;
-
-	/**
-	 * @actual_lengths: a circular buffer that holds the actual payload
-	 * sizes used for the most recent RPCs.
-	 */
-	std::vector<int> actual_lengths;
-
-	/**
-	 * @actual_rtts: a circular buffer that holds the actual round trip
-	 * times (measured in rdtsc cycles) for the most recent RPCs. Entries
-	 * in this array correspond to those in @actual_lengths.
-	 */
-	std::vector<uint64_t> actual_rtts;
-
-	/**
-	 * define NUM_CLENT_STATS: number of records in actual_lengths
-	 * and actual_rtts.
-	 */
-#define NUM_CLIENT_STATS 500000
-
-	/** @requests: total number of RPCs issued so far for each server. */
-	std::vector<uint64_t> requests;
-
-	/** @responses: total number of responses received so far from
-	 * each server. Dynamically allocated (as of 3/2020, can't use
-	 * vector with std::atomic).
-	 */
-	std::atomic<uint64_t> *responses;
-
-	/**
-	 * @total_requests: total number of RPCs issued so far across all
-	 * servers.
-	 */
-	uint64_t total_requests;
-
-	/**
-	 * @total_responses: total number of responses received so far from all
-	 * servers.
-	 */
-	std::atomic<uint64_t> total_responses;
-
-	/**
-	 * @request_bytes: total amount of data sent in all requests for
-	 * which responses have been received.
-	 */
-	std::atomic<uint64_t> request_bytes;
-
-	/**
-	 * @response_bytes: total amount of data in all response messages
-	 * received so far.
-	 */
-	std::atomic<uint64_t> response_bytes;
-
-	/**
-	 * @total_rtt: sum of round-trip times (in rdtsc cycles) for
-	 * all responses received so far.
-	 */
-	std::atomic<uint64_t> total_rtt;
-
-	/**
-	 * @lag: time in rdtsc cycles by which we are running behind
-	 * because client_port_max was exceeded (i.e., the request
-	 * we just sent should have been sent @lag cycles ago).
-	 */
-	uint64_t lag;
-};
-
-/** @clients: keeps track of all existing clients. */
-std::vector<client *> clients;
+/** @tcp_servers: keeps track of all existing Homa clients. */
+std::vector<tcp_server *> tcp_servers;
 
 /**
- * client::client() - Constructor for client objects. Uses configuration
- * information from global variables to initialize.
- *
- * @id:         Unique identifier for this client (index starting at 0?)
- * @experiment: Name of experiment in which this client will participate.
+ * tcp_server::tcp_server() - Constructor for tcp_server objects.
+ * @port:         Port number on which this server should listen for incoming
+ *                requests.
+ * @id:           Unique identifier for this server.
+ * @num_threads:  Number of threads to service this listening socket and
+ *                all of the other sockets excepted from it.
+ * @experiment:   Name of the experiment in which this server is participating.
  */
-client::client(int id, std::string& experiment)
-	: id(id)
-	, experiment(experiment)
-	, server_addrs()
-	, server_conns()
-	, freeze()
-	, first_id()
-        , last_rinfo(0)
-	, receivers_running(0)
-	, cycles_per_second(get_cycles_per_sec())
-	, server_dist()
-	, length_dist(workload, HOMA_MAX_MESSAGE_LENGTH)
-	, actual_lengths(NUM_CLIENT_STATS, 0)
-	, actual_rtts(NUM_CLIENT_STATS, 0)
-	, total_requests(0)
-	, total_responses(0)
-	, request_bytes(0)
-	, response_bytes(0)
-        , total_rtt(0)
-        , lag(0)
+tcp_server::tcp_server(int port, int id, int num_threads,
+		std::string& experiment)
+	: mutex(0)
+	, port(port)
+        , id(id)
+	, listen_fd(-1)
+	, epoll_fd(-1)
+        , epollet((num_threads > 0) ? EPOLLET : 0)
+        , connections()
+        , metrics()
+        , threads()
+        , stop(false)
 {
 	if (std::find(experiments.begin(), experiments.end(), experiment)
 			== experiments.end())
 		experiments.emplace_back(experiment);
 
-	server_addrs.clear();
-	server_conns.clear();
-	freeze.clear();
-	first_id.clear();
-	for (int node: server_ids) {
-		char host[100];
-		struct addrinfo hints;
-		struct addrinfo *matching_addresses;
-		sockaddr_in_union *dest;
+	memset(connections, 0, sizeof(connections));
+	listen_fd = socket(inet_family, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		log(NORMAL, "FATAL: couldn't open server socket: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+	int option_value = 1;
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option_value,
+			sizeof(option_value)) != 0) {
+		log(NORMAL, "FATAL: couldn't set SO_REUSEADDR on listen "
+				"socket: %s",
+				strerror(errno));
+		exit(1);
+	}
+	if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0) {
+		log(NORMAL, "FATAL: couldn't set O_NONBLOCK on listen "
+				"socket: %s",
+				strerror(errno));
+		exit(1);
+	}
+	sockaddr_in_union addr;
+	if (inet_family == AF_INET) {
+		addr.in4.sin_family = AF_INET;
+		addr.in4.sin_port = htons(port);
+		addr.in4.sin_addr.s_addr = INADDR_ANY;
+	} else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(port);
+		addr.in6.sin6_addr = in6addr_any;
+	}
+	if (bind(listen_fd, &addr.sa, sizeof(addr)) == -1) {
+		log(NORMAL, "FATAL: couldn't bind to port %d: %s\n", port,
+				strerror(errno));
+		exit(1);
+	}
+	if (listen(listen_fd, 1000) == -1) {
+		log(NORMAL, "FATAL: couldn't listen on socket: %s",
+				strerror(errno));
+		exit(1);
+	}
 
-		if (node == node_id)
-			continue;
-		snprintf(host, sizeof(host), "node%d", node);
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = inet_family;
-		hints.ai_socktype = SOCK_DGRAM;
-		int status = getaddrinfo(host, NULL, &hints,
-				&matching_addresses);
-		if (status != 0) {
-			log(NORMAL, "FATAL: couldn't look up address "
-					"for %s: %s\n",
-					host, gai_strerror(status));
-			exit(1);
-		}
-		dest = reinterpret_cast<sockaddr_in_union *>
-				(matching_addresses->ai_addr);
-		while (((int) first_id.size()) < node)
-			first_id.push_back(-1);
-		first_id.push_back((int) server_addrs.size());
-		for (int thread = 0; thread < server_ports; thread++) {
-			dest->in4.sin_port = htons(first_port + thread);
-			server_addrs.push_back(*dest);
-			server_conns.emplace_back(node, thread, node_id, 0);
-		}
-		while (((int) freeze.size()) <= node)
-			freeze.push_back(0);
-		freeaddrinfo(matching_addresses);
+	epoll_fd = epoll_create(10);
+	if (epoll_fd < 0) {
+		log(NORMAL, "FATAL: couldn't create epoll instance for "
+				"TCP server: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		log(NORMAL, "FATAL: couldn't add listen socket to epoll: %s\n",
+				strerror(errno));
+		exit(1);
 	}
 
-	server_dist.param(std::uniform_int_distribution<>::param_type(0,
-			static_cast<int>(server_addrs.size() - 1)));
+	metrics = new server_metrics(experiment);
+	::metrics.push_back(metrics);
 
-	rinfos.resize(2*client_port_max + 5);
-	double avg_length = length_dist.get_mean();
-	double rate = 1e09*(net_gbps/8.0)/(avg_length*client_ports);
-	interval_dist = std::exponential_distribution<double>(rate);
-	requests.resize(server_addrs.size());
-	responses = new std::atomic<uint64_t>[server_addrs.size()];
-	for (size_t i = 0; i < server_addrs.size(); i++)
-		responses[i] = 0;
-	log(NORMAL, "Average message length %.1f KB, rate %.2f K/sec, "
-			"expected BW %.1f Gbps\n",
-			avg_length*1e-3, rate*1e-3, avg_length*rate*8e-9);
+	for (int i = 0; i < num_threads; i++)
+		threads.emplace_back(&tcp_server::server, this, i);
 	kfreeze_count = 0;
 }
 
 /**
- * Destructor for clients.
+ * tcp_server::~tcp_server() - Destructor for TCP servers. Terminates the
+ * server's background thread.
  */
-client::~client()
+tcp_server::~tcp_server()
 {
-	delete[] responses;
-}
+	int fds[2];
 
-/**
- * check_completion() - Make sure that all outstanding requests have
- * completed; if not, generate log messages.
- * @protocol:  String that identifies the current protocol for the log
- *             message, if any.
- */
-void client::check_completion(const char *protocol)
-{
-	string server_info;
-	int incomplete = total_requests - total_responses;
-	for (size_t i = 0; i < requests.size(); i++) {
-		char buffer[100];
-		int diff = requests[i] - responses[i];
-		if (diff == 0)
-			continue;
-		if (!server_info.empty())
-			server_info.append(", ");
-		snprintf(buffer, sizeof(buffer), "node%d.%d: %d",
-				server_conns[i].server,
-				server_conns[i].server_port, diff);
+	stop = true;
+
+	/* In order to wake up the background threads, open a file that is
+	 * readable and add it to the epoll set.
+	 */
+	if (pipe2(fds, 0) < 0) {
+		log(NORMAL, "FATAL: couldn't create pipe to shutdown TCP "
+				"server: %s\n", strerror(errno));
+		exit(1);
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fds[0];
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &ev);
+	if (write(fds[1], "xxxx", 4) < 0) {
+		log(NORMAL, "FATAL: couldn't write to TCP shutdown pipe: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	close(listen_fd);
+	close(epoll_fd);
+	close(fds[0]);
+	close(fds[1]);
+	for (unsigned i = 0; i < MAX_FDS; i++) {
+		if (connections[i] != NULL) {
+			if (close(i) < 0)
+				log(NORMAL, "Error closing TCP connection to "
+						"%s: %s\n",
+						print_address(
+						&connections[i]->peer),
+						strerror(errno));
+			delete connections[i];
+			log(NORMAL, "Deleted connection at 0x%p, size %lu\n",
+				connections[i], sizeof(*connections[i]));
+			connections[i] = NULL;
+		}
+	}
+}
+
+/**
+ * tcp_server::server() - Handles incoming TCP requests on a listen socket
+ * and all of the connections accepted via that socket. Normally invoked as
+ * top-level method in a thread. There can potentially be multiple instances
+ * of this function running simultaneously.
+ * @thread_id:  Unique id for this particular thread among all of the
+ *              threads in this server.
+ */
+void tcp_server::server(int thread_id)
+{
+	char thread_name[50];
+
+	snprintf(thread_name, sizeof(thread_name), "S%d.%d", id, thread_id);
+	time_trace::thread_buffer thread_buffer(thread_name);
+	int pid = syscall(__NR_gettid);
+	if (server_core >= 0) {
+		printf("Pinning thread %s to core %d\n", thread_name,
+				server_core);
+		pin_thread(server_core);
+	}
+
+	/* Each iteration through this loop processes a batch of epoll events. */
+	while (1) {
+#define MAX_EVENTS 20
+		struct epoll_event events[MAX_EVENTS];
+		int num_events;
+
+		while (1) {
+			num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+			if (stop)
+				return;
+			if (num_events >= 0)
+				break;
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue;
+			log(NORMAL, "FATAL: epoll_wait failed: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		tt("epoll_wait returned %d events in server pid %d",
+				num_events, pid);
+		for (int i = 0; i < num_events; i++) {
+			int fd = events[i].data.u32;
+			if (fd == listen_fd) {
+				spin_lock lock_guard(&mutex);
+				accept(epoll_fd);
+			} else {
+				spin_lock lock_guard(&fd_locks[fd]);
+				if ((events[i].events & EPOLLIN) &&
+						(connections[fd] != NULL))
+					read(fd, pid);
+				if ((events[i].events & EPOLLOUT) &&
+						(connections[fd] != NULL)) {
+					if (connections[fd]->xmit())
+						connections[fd]->set_epoll_events(
+								epoll_fd,
+								EPOLLIN|epollet);
+				}
+			}
+		}
+	}
+	log(NORMAL, "TCP server thread %s exiting\n", thread_name);
+}
+
+/**
+ * tcp_server::accept() - Accepts a new incoming TCP connection and
+ * initializes state for that connection.
+ * @epoll_fd:   Used to arrange for epolling on the new connection.
+ */
+void tcp_server::accept(int epoll_fd)
+{
+	int fd;
+	sockaddr_in_union client_addr;
+	socklen_t addr_len = sizeof(client_addr);
+
+	fd = ::accept4(listen_fd, &client_addr.sa, &addr_len, SOCK_NONBLOCK);
+	if (fd < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return;
+		log(NORMAL, "FATAL: couldn't accept incoming TCP connection: "
+				"%s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* Make sure the connection appears to be coming from someone
+	 * we trust (as of August 2023, at CloudLab, external sites
+	 * could open connections).
+	 */
+	if (client_addr.in4.sin_family == AF_INET) {
+		uint8_t *ipaddr = (uint8_t *) &client_addr.in4.sin_addr;
+		bool is_internet = true;
+
+		if (ipaddr[0] == 10) {
+			is_internet = false;
+		}
+		else if (ipaddr[0] == 172 && (ipaddr[1] >= 16 && ipaddr[1] <= 31)) {
+			is_internet = false;
+		}
+		else if (ipaddr[0] == 192 && ipaddr[1] == 168) {
+			is_internet = false;
+		}
+
+		if (is_internet) {
+			log(NORMAL, "ERROR: tcp_server::accept rejecting "
+					"rogue TCP connection from %s\n",
+					print_address(&client_addr));
+			::close(fd);
+			return;
+		}
+	}
+	log(NORMAL, "tcp_server on port %d accepted connection from %s, fd %d\n",
+			port, print_address(&client_addr), fd);
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	if (fd >= MAX_FDS) {
+		log(NORMAL, "FATAL: TCP socket fd %d is greater than MAX_FDS\n",
+				fd);
+		exit(1);
+	}
+	spin_lock lock_guard(&fd_locks[fd]);
+	tcp_connection *connection = new tcp_connection(fd, fd, port,
+			client_addr);
+	connections[fd] = connection;
+	connection->set_epoll_events(epoll_fd, EPOLLIN|epollet);
+}
+
+/**
+ * tcp_server::read() - Reads available data from a TCP connection; once an
+ * entire request has been read, sends an appropriate response.
+ * @fd:        File descriptor for connection; connections must hold
+ *             state information for this descriptor.
+ * @pid:       Pid for the thread (for messages).
+ */
+void tcp_server::read(int fd, int pid)
+{
+	int error = connections[fd]->read(epollet,
+			[this, fd, pid](message_header *header) {
+		metrics->requests++;
+		metrics->bytes_in += header->length;
+		tt("Received TCP request, cid 0x%08x, id %u, length %d, pid %d",
+				header->cid, header->msg_id, header->length,
+				pid);
+		if ((header->freeze) && !time_trace::frozen) {
+			tt("Freezing timetrace because of request on "
+					"cid 0x%08x", header->cid);
+			log(NORMAL, "Freezing timetrace because of request on "
+					"cid 0x%08x", int(header->cid));
+			time_trace::freeze();
+			kfreeze();
+		}
+		if ((header->short_response) && (header->length > 100))
+			header->length = 100;
+		metrics->bytes_out += header->length;
+		if (!connections[fd]->send_message(header))
+			connections[fd]->set_epoll_events(epoll_fd,
+					EPOLLIN|EPOLLOUT|epollet);
+	});
+	if (error) {
+		log(NORMAL, "Closing client connection: %s\n",
+				connections[fd]->error_message);
+		spin_lock lock_guard(&mutex);
+		if (close(fd) < 0) {
+			log(NORMAL, "Error closing TCP connection to %s: %s\n",
+					print_address(&connections[fd]->peer),
+					strerror(errno));
+		}
+		delete connections[fd];
+		connections[fd] = NULL;
+	}
+}
+
+/**
+ * class latency_hist - A histogram of latencies in the style of
+ * HdrHistogram: buckets are spaced linearly within each power of two, so
+ * every value is recorded with a precision of better than 1% (1/128) over
+ * a range from 1 ns to about 18 minutes, in about 35 Kbytes. Counts may be
+ * incremented concurrently by any number of threads.
+ */
+class latency_hist {
+public:
+	/**
+	 * define HIST_SUB_BITS: number of significant bits retained for
+	 * each value.
+	 */
+#define HIST_SUB_BITS 8
+
+	/**
+	 * define HIST_MAX_BITS: values of 2^HIST_MAX_BITS ns or more are
+	 * recorded in the last bucket.
+	 */
+#define HIST_MAX_BITS 40
+
+	/** define HIST_BUCKETS: number of entries in @counts. */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) \
+		<< (HIST_SUB_BITS - 1))
+
+	latency_hist();
+	~latency_hist();
+	static int bucket(uint64_t ns);
+	static uint64_t highest(int bucket);
+	void record(uint64_t ns);
+	void reset();
+
+	/**
+	 * @counts: entry i is the number of values recorded in bucket i.
+	 * Dynamically allocated (can't use vector with std::atomic).
+	 */
+	std::atomic<uint64_t> *counts;
+};
+
+/**
+ * latency_hist::latency_hist() - Constructor for latency_hists.
+ */
+latency_hist::latency_hist()
+	: counts(new std::atomic<uint64_t>[HIST_BUCKETS])
+{
+	reset();
+}
+
+/**
+ * latency_hist::~latency_hist() - Destructor for latency_hists.
+ */
+latency_hist::~latency_hist()
+{
+	delete[] counts;
+}
+
+/**
+ * latency_hist::bucket() - Returns the index of the bucket in which a
+ * given value is recorded.
+ * @ns:     Value to record, in nanoseconds.
+ */
+int latency_hist::bucket(uint64_t ns)
+{
+	int shift;
+
+	if (ns >= (1ULL << HIST_MAX_BITS))
+		ns = (1ULL << HIST_MAX_BITS) - 1;
+	if (ns < (1ULL << HIST_SUB_BITS))
+		return ns;
+	shift = 63 - __builtin_clzll(ns) - (HIST_SUB_BITS - 1);
+	return (shift << (HIST_SUB_BITS - 1)) + (ns >> shift);
+}
+
+/**
+ * latency_hist::highest() - Returns the largest value (in ns) that is
+ * recorded in a given bucket.
+ * @bucket:   Index of a bucket.
+ */
+uint64_t latency_hist::highest(int bucket)
+{
+	int shift, sub;
+
+	if (bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+	shift = (bucket >> (HIST_SUB_BITS - 1)) - 1;
+	sub = bucket - (shift << (HIST_SUB_BITS - 1));
+	return ((static_cast<uint64_t>(sub) + 1) << shift) - 1;
+}
+
+/**
+ * latency_hist::record() - Add a value to the histogram.
+ * @ns:     Value to record, in nanoseconds.
+ */
+void latency_hist::record(uint64_t ns)
+{
+	counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * latency_hist::reset() - Discard all of the values recorded so far.
+ */
+void latency_hist::reset()
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		counts[i] = 0;
+}
+
+/**
+ * class client - Holds information that is common to both Homa clients
+ * and TCP clients.
+ */
+class client {
+public:
+	/**
+	 * struct rinfo - Holds information about a request that we will
+	 * want when we get the response.
+	 */
+	struct rinfo {
+		/**
+		 * @start_time: rdtsc time when the request was sent (with
+		 * --open-loop, when it was scheduled to be sent).
+		 */
+		uint64_t start_time;
+
+		/** @request_length: number of bytes in the request message. */
+		int request_length;
+
+		/**
+		 * @active: true means the request has been sent but
+		 * a response hasn't yet been received.
+		 */
+		bool active;
+
+		rinfo() : start_time(0), request_length(0), active(false) {}
+	};
+
+	client(int id, std::string& experiment);
+	virtual ~client();
+	void check_completion(const char *protocol);
+	int get_rinfo();
+	double next_interval();
+	int next_length();
+	void record(uint64_t end_time, message_header *header);
+	virtual void stop_sender(void) {}
+
+	/**
+	 * @id: unique identifier for this client (index starting at
+	 * 0 for the first client.
+	 */
+	int id;
+
+	/**  @experiment: name of the experiment this client is running. */
+	string experiment;
+
+	/**
+	 * @server_addrs: Internet addresses for each of the server ports
+	 * where this client will send RPCs.
+	 */
+	std::vector<sockaddr_in_union> server_addrs;
+
+	/**
+	 * @server_conns: for each entry in @server_addrs, a connection
+	 * identifier with all fields filled in except client_port, which
+	 * will be 0.
+	 */
+	std::vector<conn_id> server_conns;
+
+	/**
+	 * @freeze: one entry for each node index; 1 means messages to that
+	 * node should contain a flag telling the node to freeze its time trace.
+	 */
+	std::vector<int> freeze;
+
+	/**
+	 * @first_id: entry i contains the index in server_addrs of the first
+	 * entry for the server ports on node i.
+	 */
+	std::vector<int> first_id;
+
+	/**
+	 * @rinfos: storage for more than enough rinfos to handle all of the
+	 * outstanding requests.
+	 */
+	std::vector<rinfo> rinfos;
+
+	/** @last_rinfo: index into rinfos of last slot that was allocated. */
+	int last_rinfo;
+
+	/**
+	 * @max_outstanding: the sender won't issue a new request while
+	 * this many are outstanding.
+	 */
+	uint32_t max_outstanding;
+
+	/**
+	 * @next_arrival: index in @arrivals of the next request to issue
+	 * (only used if @arrivals isn't empty).
+	 */
+	size_t next_arrival;
+
+	/**
+	 * @receivers_running: number of receiving threads that have
+	 * initialized and are ready to receive responses.
+	 */
+	std::atomic<size_t> receivers_running;
+
+	/**
+	 * @cycles_per_second: caches get_cycles_per_second() result.
+	 */
+	uint64_t cycles_per_second;
+
+	/** @server_dist: used to select server indexes for outgoing RPCs. */
+	std::uniform_int_distribution<int> server_dist;
+
+        /**
+	 * @interval_dist: generator for the time intervals between RPCs.
+	 */
+	std::exponential_distribution<double> interval_dist;
+
+	/** @length_dist: Generator of message lengths. */
+	dist_point_gen length_dist;
+
+	/**
+	 * @actual_lengths: a circular buffer that holds the actual payload
+	 * sizes used for the most recent RPCs.
+	 */
+	std::vector<int> actual_lengths;
+
+	/**
+	 * @actual_rtts: a circular buffer that holds the actual round trip
+	 * times (measured in rdtsc cycles) for the most recent RPCs. Entries
+	 * in this array correspond to those in @actual_lengths.
+	 */
+	std::vector<uint64_t> actual_rtts;
+
+	/**
+	 * @hist: round-trip times for all of the responses received since
+	 * the histogram was last dumped. Unlike @actual_rtts, this never
+	 * drops samples, so it gives accurate tail latencies for long runs.
+	 */
+	latency_hist hist;
+
+	/**
+	 * define NUM_CLENT_STATS: number of records in actual_lengths
+	 * and actual_rtts.
+	 */
+#define NUM_CLIENT_STATS 500000
+
+	/** @requests: total number of RPCs issued so far for each server. */
+	std::vector<uint64_t> requests;
+
+	/** @responses: total number of responses received so far from
+	 * each server. Dynamically allocated (as of 3/2020, can't use
+	 * vector with std::atomic).
+	 */
+	std::atomic<uint64_t> *responses;
+
+	/**
+	 * @total_requests: total number of RPCs issued so far across all
+	 * servers.
+	 */
+	uint64_t total_requests;
+
+	/**
+	 * @total_responses: total number of responses received so far from all
+	 * servers.
+	 */
+	std::atomic<uint64_t> total_responses;
+
+	/**
+	 * @request_bytes: total amount of data sent in all requests for
+	 * which responses have been received.
+	 */
+	std::atomic<uint64_t> request_bytes;
+
+	/**
+	 * @response_bytes: total amount of data in all response messages
+	 * received so far.
+	 */
+	std::atomic<uint64_t> response_bytes;
+
+	/**
+	 * @total_rtt: sum of round-trip times (in rdtsc cycles) for
+	 * all responses received so far.
+	 */
+	std::atomic<uint64_t> total_rtt;
+
+	/**
+	 * @lag: time in rdtsc cycles by which we are running behind
+	 * because max_outstanding was exceeded (i.e., the request
+	 * we just sent should have been sent @lag cycles ago).
+	 */
+	uint64_t lag;
+};
+
+/** @clients: keeps track of all existing clients. */
+std::vector<client *> clients;
+
+/**
+ * client::client() - Constructor for client objects. Uses configuration
+ * information from global variables to initialize.
+ *
+ * @id:         Unique identifier for this client (index starting at 0?)
+ * @experiment: Name of experiment in which this client will participate.
+ */
+client::client(int id, std::string& experiment)
+	: id(id)
+	, experiment(experiment)
+	, server_addrs()
+	, server_conns()
+	, freeze()
+	, first_id()
+        , last_rinfo(0)
+	, max_outstanding(open_loop ? OPEN_LOOP_MAX : client_port_max)
+	, next_arrival(0)
+	, receivers_running(0)
+	, cycles_per_second(get_cycles_per_sec())
+	, server_dist()
+	, length_dist(workload, HOMA_MAX_MESSAGE_LENGTH)
+	, actual_lengths(NUM_CLIENT_STATS, 0)
+	, actual_rtts(NUM_CLIENT_STATS, 0)
+	, hist()
+	, total_requests(0)
+	, total_responses(0)
+	, request_bytes(0)
+	, response_bytes(0)
+        , total_rtt(0)
+        , lag(0)
+{
+	if (std::find(experiments.begin(), experiments.end(), experiment)
+			== experiments.end())
+		experiments.emplace_back(experiment);
+
+	server_addrs.clear();
+	server_conns.clear();
+	freeze.clear();
+	first_id.clear();
+	for (int node: server_ids) {
+		char host[100];
+		struct addrinfo hints;
+		struct addrinfo *matching_addresses;
+		sockaddr_in_union *dest;
+
+		if (node == node_id)
+			continue;
+		snprintf(host, sizeof(host), "node%d", node);
+		memset(&hints, 0, sizeof(struct addrinfo));
+		hints.ai_family = inet_family;
+		hints.ai_socktype = SOCK_DGRAM;
+		int status = getaddrinfo(host, NULL, &hints,
+				&matching_addresses);
+		if (status != 0) {
+			log(NORMAL, "FATAL: couldn't look up address "
+					"for %s: %s\n",
+					host, gai_strerror(status));
+			exit(1);
+		}
+		dest = reinterpret_cast<sockaddr_in_union *>
+				(matching_addresses->ai_addr);
+		while (((int) first_id.size()) < node)
+			first_id.push_back(-1);
+		first_id.push_back((int) server_addrs.size());
+		for (int thread = 0; thread < server_ports; thread++) {
+			dest->in4.sin_port = htons(first_port + thread);
+			server_addrs.push_back(*dest);
+			server_conns.emplace_back(node, thread, node_id, 0);
+		}
+		while (((int) freeze.size()) <= node)
+			freeze.push_back(0);
+		freeaddrinfo(matching_addresses);
+	}
+
+	server_dist.param(std::uniform_int_distribution<>::param_type(0,
+			static_cast<int>(server_addrs.size() - 1)));
+
+	rinfos.resize(2*max_outstanding + 5);
+	double avg_length = length_dist.get_mean();
+	double rate = 1e09*(net_gbps/8.0)/(avg_length*client_ports);
+	interval_dist = std::exponential_distribution<double>(rate);
+	requests.resize(server_addrs.size());
+	responses = new std::atomic<uint64_t>[server_addrs.size()];
+	for (size_t i = 0; i < server_addrs.size(); i++)
+		responses[i] = 0;
+	if (!arrivals.empty()) {
+		next_arrival = std::uniform_int_distribution<size_t>(0,
+				arrivals.size() - 1)(rand_gen);
+		log(NORMAL, "Replaying %lu arrivals starting at index %lu\n",
+				arrivals.size(), next_arrival);
+	} else
+		log(NORMAL, "Average message length %.1f KB, rate %.2f K/sec, "
+				"expected BW %.1f Gbps\n",
+				avg_length*1e-3, rate*1e-3,
+				avg_length*rate*8e-9);
+	kfreeze_count = 0;
+}
+
+/**
+ * Destructor for clients.
+ */
+client::~client()
+{
+	delete[] responses;
+}
+
+/**
+ * check_completion() - Make sure that all outstanding requests have
+ * completed; if not, generate log messages.
+ * @protocol:  String that identifies the current protocol for the log
+ *             message, if any.
+ */
+void client::check_completion(const char *protocol)
+{
+	string server_info;
+	int incomplete = total_requests - total_responses;
+	for (size_t i = 0; i < requests.size(); i++) {
+		char buffer[100];
+		int diff = requests[i] - responses[i];
+		if (diff == 0)
+			continue;
+		if (!server_info.empty())
+			server_info.append(", ");
+		snprintf(buffer, sizeof(buffer), "node%d.%d: %d",
+				server_conns[i].server,
+				server_conns[i].server_port, diff);
 		server_info.append(buffer);
 	}
-	if ((incomplete != 0) || !server_info.empty())
-		log(NORMAL, "ERROR: %d incomplete %s requests (%s)\n",
-				incomplete, protocol, server_info.c_str());
+	if ((incomplete != 0) || !server_info.empty())
+		log(NORMAL, "ERROR: %d incomplete %s requests (%s)\n",
+				incomplete, protocol, server_info.c_str());
+}
+
+/**
+ * get_rinfo() - Find an available rinfo slot and return its index in
+ * rinfos.
+ */
+int client::get_rinfo()
+{
+	int next = last_rinfo;
+
+	while (true) {
+		next++;
+		if (next >= static_cast<int>(rinfos.size()))
+			next = 0;
+		if (!rinfos[next].active) {
+			rinfos[next].active = true;
+			last_rinfo = next;
+			return next;
+		}
+		if (next == last_rinfo) {
+			log(NORMAL, "FATAL: ran out of rinfos (%lu in use, "
+					"total_requests %ld, "
+					"total_responses %ld, last_rinfo %d)\n",
+					rinfos.size(), total_requests,
+				        total_responses.load(), last_rinfo);
+			exit(1);
+		}
+	}
+}
+
+/**
+ * next_length() - Returns the length to use for the next request.
+ */
+int client::next_length()
+{
+	if (!arrivals.empty() && (arrivals[next_arrival].length > 0))
+		return arrivals[next_arrival].length;
+	return length_dist(rand_gen);
+}
+
+/**
+ * next_interval() - Returns the time (in rdtsc cycles) from the start of
+ * the request just issued until the start of the next request.
+ */
+double client::next_interval()
+{
+	double interval;
+
+	if (arrivals.empty())
+		return interval_dist(rand_gen)*cycles_per_second;
+	interval = arrivals[next_arrival].interval;
+	next_arrival++;
+	if (next_arrival >= arrivals.size())
+		next_arrival = 0;
+	return interval;
+}
+
+/**
+ * record() - Records statistics about a particular request.
+ * @end_time:   Completion time for the request, in rdtsc cycles.
+ * @header:     The header from the response.
+ */
+void client::record(uint64_t end_time, message_header *header)
+{
+	int server_id;
+	int slot = total_responses.fetch_add(1) % NUM_CLIENT_STATS;
+	int64_t rtt;
+
+	if (header->msg_id >= rinfos.size()) {
+		log(NORMAL, "ERROR: msg_id (%u) exceed rinfos.size (%lu)\n",
+			header->msg_id, rinfos.size());
+		return;
+	}
+	rinfo *r = &rinfos[header->msg_id];
+	if (!r->active) {
+		log(NORMAL, "ERROR: response arrived for inactive msg_id %u\n",
+			header->msg_id);
+		return;
+	}
+	rtt = end_time - r->start_time;
+	r->active = false;
+
+	int kcycles = rtt>>10;
+	tt("Received response, cid 0x%08x, id %u, length %d, "
+			"rtt %d kcycles",
+			header->cid, header->msg_id,
+			header->length, kcycles);
+	if ((kcycles > debug[0]) && (kcycles < debug[1])
+			&& (header->length < 1500) && !time_trace::frozen) {
+		freeze[header->cid.server] = 1;
+		tt("Freezing timetrace because of long RTT for "
+				"cid 0x%08x, id %u, length %d, kcycles %d",
+				header->cid, header->msg_id, header->length,
+				kcycles);
+		log(NORMAL, "Freezing timetrace because of long RTT for "
+				"cid 0x%08x, id %u",
+				int(header->cid), header->msg_id);
+		time_trace::freeze();
+		kfreeze();
+	}
+
+	server_id = first_id[header->cid.server];
+	if (server_id == -1) {
+		log(NORMAL, "WARNING: response received from unknown "
+				"cid 0x%08x\n", (int) header->cid);
+		return;
+	}
+	server_id += header->cid.server_port;
+	responses[server_id].fetch_add(1);
+	request_bytes += r->request_length;
+	response_bytes += header->length;
+	total_rtt += rtt;
+	actual_lengths[slot] = header->length;
+	actual_rtts[slot] = rtt;
+	hist.record(static_cast<uint64_t>(1e09*to_seconds(rtt)));
+}
+
+/**
+ * class homa_client - Holds information about a single Homa client,
+ * which consists of one thread issuing requests and one or more threads
+ * receiving responses.
+ */
+class homa_client : public client {
+public:
+	homa_client(int id, std::string& experiment);
+	virtual ~homa_client();
+	void measure_unloaded(int count);
+	uint64_t measure_rtt(int server, int length, char *buffer,
+			homa::receiver *receiver);
+	void receiver(int id);
+	void sender(void);
+	virtual void stop_sender(void);
+	bool wait_response(homa::receiver *receiver, uint64_t rpc_id);
+
+	/** @fd: file descriptor for Homa socket. */
+	int fd;
+
+	/**
+	 * @buf_region: mmapped region of memory in which receive buffers
+	 * are alloocated.
+	 */
+	char *buf_region;
+
+	/** @buf_size: number of bytes available at @buf_region. */
+	size_t buf_size;
+
+	/** @stop_sending: true means the sending thread should exit ASAP. */
+	bool exit_sender;
+
+	/** @stop: true means receiving threads should exit ASAP. */
+	bool exit_receivers;
+
+	/** @server_exited:  just what you'd guess from the name. */
+	bool sender_exited;
+
+	/**
+	 * @sender_buffer: used by the sender to send requests, and also
+	 * by measure_unloaded; malloced, size HOMA_MAX_MESSAGE_LENGTH.
+	 */
+	char *sender_buffer;
+
+	/** @receiver: threads that receive responses. */
+	std::vector<std::thread> receiving_threads;
+
+	/**
+	 * @sender: thread that sends requests (may also receive
+	 * responses if port_receivers is 0).
+	 */
+	std::optional<std::thread> sending_thread;
+};
+
+/**
+ * homa_client::homa_client() - Constructor for homa_client objects.
+ *
+ * @id:          Unique identifier for this client (index starting at 0?).
+ * @experiment:  Name of experiment in which this client will participate.
+ */
+homa_client::homa_client(int id, std::string& experiment)
+	: client(id, experiment)
+	, fd(-1)
+        , buf_region(nullptr)
+	, buf_size(buf_bpages*HOMA_BPAGE_SIZE)
+        , exit_sender(false)
+        , exit_receivers(false)
+        , sender_exited(false)
+        , sender_buffer(new char[HOMA_MAX_MESSAGE_LENGTH])
+        , receiving_threads()
+        , sending_thread()
+{
+	struct homa_rcvbuf_args arg;
+
+	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		log(NORMAL, "Couldn't open Homa socket: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (buf_region == MAP_FAILED) {
+		printf("Couldn't mmap buffer region for homa_client id %d: %s\n",
+				id, strerror(errno));
+		exit(1);
+	}
+	arg.start = buf_region;
+	arg.length = buf_size;
+	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &arg,
+			sizeof(arg));
+	if (status < 0) {
+		printf("FATAL: error in setsockopt(SO_HOMA_RCVBUF): %s\n",
+				strerror(errno));
+		exit(1);
+	}
+
+	if (unloaded) {
+		measure_unloaded(unloaded);
+		sender_exited = true;
+	} else {
+		for (int i = 0; i < port_receivers; i++) {
+			receiving_threads.emplace_back(&homa_client::receiver,
+					this, i);
+		}
+		while (receivers_running < receiving_threads.size()) {
+			/* Wait for the receivers to begin execution before
+			 * starting the sender; otherwise the initial RPCs
+			 * may appear to take a long time.
+			 */
+		}
+		sending_thread.emplace(&homa_client::sender, this);
+	}
+}
+
+/**
+ * homa_client::~homa_client() - Destructor for homa_client objects;
+ * will terminate threads created for this client.
+ */
+homa_client::~homa_client()
+{
+	uint64_t start = rdtsc();
+	exit_sender = true;
+	exit_receivers = true;
+	while (!sender_exited || (total_responses != total_requests)) {
+		if (to_seconds(rdtsc() - start) > 2.0)
+			break;
+	}
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+	delete[] sender_buffer;
+	if (sending_thread)
+		sending_thread->join();
+	for (std::thread &thread: receiving_threads)
+		thread.join();
+	munmap(buf_region, buf_size);
+	check_completion("homa");
+}
+
+/**
+ * homa_client::stop_sender() - Ask the sending thread to stop sending,
+ * and wait until it exits (but give up if that takes too long).
+ */
+void homa_client::stop_sender(void)
+{
+	uint64_t start = rdtsc();
+	exit_sender = true;
+	while (1) {
+		if (sender_exited) {
+			if (sending_thread) {
+				sending_thread->join();
+				sending_thread.reset();
+			}
+		}
+		if (to_seconds(rdtsc() - start) > 0.5)
+			break;
+	}
+}
+
+/**
+ * homa_client::wait_response() - Wait for a response to arrive and
+ * update statistics.
+ * @receiver: Use this for receiving the response and managing its buffers.
+ * @rpc_id:   Id of a specific RPC to wait for, or 0 for "any response".
+ * Return:    True means that a response was received; false means the client
+ *            has been stopped and the socket has been shut down.
+ */
+bool homa_client::wait_response(homa::receiver *receiver, uint64_t rpc_id)
+{
+	message_header *header;
+
+	rpc_id = 0;
+	ssize_t length;
+	do {
+		length = receiver->receive(HOMA_RECVMSG_RESPONSE, rpc_id);
+	} while ((length < 0) && ((errno == EAGAIN) || (errno == EINTR)));
+	if (length < 0) {
+		if (exit_receivers)
+			return false;
+		log(NORMAL, "FATAL: error in Homa recvmsg: %s (id %lu, "
+				"server %s)\n",
+				strerror(errno), rpc_id,
+				print_address((union sockaddr_in_union *)
+					      receiver->src_addr()));
+		exit(1);
+	}
+	header = receiver->get<message_header>(0);
+	if (header == nullptr) {
+		log(NORMAL, "FATAL: Homa response message contained %lu bytes; "
+			"need at least %lu", length, sizeof(*header));
+		exit(1);
+	}
+	uint64_t end_time = rdtsc();
+	tt("Received response, cid 0x%08x, id %x, %d bytes",
+			header->cid, header->msg_id, length);
+	record(end_time, header);
+	return true;
+}
+
+/**
+ * homa_client::sender() - Invoked as the top-level method in a thread;
+ * invokes a pseudo-random stream of RPCs continuously.
+ */
+void homa_client::sender()
+{
+	message_header *header = reinterpret_cast<message_header *>(sender_buffer);
+	uint64_t next_start = rdtsc();
+	char thread_name[50];
+	homa::receiver receiver(fd, buf_region);
+
+	snprintf(thread_name, sizeof(thread_name), "C%d", id);
+	time_trace::thread_buffer thread_buffer(thread_name);
+
+	while (1) {
+		uint64_t now;
+		uint64_t rpc_id;
+		int server;
+		int status;
+		int slot = get_rinfo();
+
+		/* Wait until (a) we have reached the next start time
+		 * and (b) there aren't too many requests outstanding.
+		 */
+		while (1) {
+			if (exit_sender) {
+				sender_exited = true;
+				rinfos[slot].active = false;
+				return;
+			}
+			now = rdtsc();
+			if (now < next_start)
+				continue;
+			if ((total_requests - total_responses)
+					< max_outstanding)
+				break;
+		}
+
+		rinfos[slot].start_time = open_loop ? next_start : now;
+		server = server_dist(rand_gen);
+		header->length = next_length();
+		if (header->length > HOMA_MAX_MESSAGE_LENGTH)
+			header->length = HOMA_MAX_MESSAGE_LENGTH;
+		if (header->length < sizeof32(*header))
+			header->length = sizeof32(*header);
+		rinfos[slot].request_length = header->length;
+		header->cid = server_conns[server];
+		header->cid.client_port = id;
+		header->freeze = freeze[header->cid.server];
+		header->short_response = one_way;
+		header->msg_id = slot;
+		tt("sending request, cid 0x%08x, id %u, length %d",
+				header->cid, header->msg_id, header->length);
+		if (client_iovec && (header->length > 20)) {
+			struct iovec vec[2];
+			vec[0].iov_base = sender_buffer;
+			vec[0].iov_len = 20;
+			vec[1].iov_base = sender_buffer + 20;
+			vec[1].iov_len = header->length - 20;
+			status = homa_sendv(fd, vec, 2,
+				            &server_addrs[server].sa,
+					    sockaddr_size(&server_addrs[server].sa),
+					    &rpc_id, 0);
+		} else
+			status = homa_send(fd, sender_buffer, header->length,
+					   &server_addrs[server].sa,
+					   sockaddr_size(&server_addrs[server].sa),
+					   &rpc_id, 0);
+		if (status < 0) {
+			log(NORMAL, "FATAL: error in homa_send: %s (request "
+					"length %d)\n", strerror(errno),
+					header->length);
+			exit(1);
+		}
+		requests[server]++;
+		total_requests++;
+		lag = now - next_start;
+		next_start += next_interval();
+		if (receivers_running == 0) {
+			/* There isn't a separate receiver thread; wait for
+			 * the response here. */
+			wait_response(&receiver, rpc_id);
+		}
+	}
 }
 
 /**
- * get_rinfo() - Find an available rinfo slot and return its index in
- * rinfos.
+ * homa_client::receiver() - Invoked as the top-level method in a thread
+ * that waits for RPC responses and then logs statistics about them.
+ * @receiver_id:   Unique id for this receiver within its client.
  */
-int client::get_rinfo()
+void homa_client::receiver(int receiver_id)
 {
-	int next = last_rinfo;
+	char thread_name[50];
+	snprintf(thread_name, sizeof(thread_name), "R%d.%d", node_id, receiver_id);
+	time_trace::thread_buffer thread_buffer(thread_name);
+	homa::receiver receiver(fd, buf_region);
 
-	while (true) {
-		next++;
-		if (next >= static_cast<int>(rinfos.size()))
-			next = 0;
-		if (!rinfos[next].active) {
-			rinfos[next].active = true;
-			last_rinfo = next;
-			return next;
-		}
-		if (next == last_rinfo) {
-			log(NORMAL, "FATAL: ran out of rinfos (%lu in use, "
-					"total_requests %ld, "
-					"total_responses %ld, last_rinfo %d)\n",
-					rinfos.size(), total_requests,
-				        total_responses.load(), last_rinfo);
-			exit(1);
-		}
-	}
+	receivers_running++;
+	while (wait_response(&receiver, 0)) {}
 }
 
 /**
- * record() - Records statistics about a particular request.
- * @end_time:   Completion time for the request, in rdtsc cycles.
- * @header:     The header from the response.
+ * homa_client::measure_rtt() - Make a single request to a given server and
+ * return the RTT.
+ * @server:      Identifier of server to use for the request.
+ * @length:      Number of message bytes in the request.
+ * @buffer:      Block of memory to use for request; must
+ *               contain HOMA_MAX_MESSAGE_LENGTH bytes.
+ * @receiver:    Use this to receive responses.
+ *
+ * Return:       Round-trip time to service the request, in rdtsc cycles.
  */
-void client::record(uint64_t end_time, message_header *header)
+uint64_t homa_client::measure_rtt(int server, int length, char *buffer,
+		homa::receiver *receiver)
 {
-	int server_id;
-	int slot = total_responses.fetch_add(1) % NUM_CLIENT_STATS;
-	int64_t rtt;
+	message_header *header = reinterpret_cast<message_header *>(buffer);
+	uint64_t start;
+	uint64_t rpc_id;
+	int status;
 
-	if (header->msg_id >= rinfos.size()) {
-		log(NORMAL, "ERROR: msg_id (%u) exceed rinfos.size (%lu)\n",
-			header->msg_id, rinfos.size());
-		return;
+	header->length = length;
+	if (header->length > HOMA_MAX_MESSAGE_LENGTH)
+		header->length = HOMA_MAX_MESSAGE_LENGTH;
+	if (header->length < sizeof32(*header))
+		header->length = sizeof32(*header);
+	header->cid = server_conns[server];
+	header->cid.client_port = id;
+	start = rdtsc();
+	status = homa_send(fd, buffer, header->length, &server_addrs[server].sa,
+			   sockaddr_size(&server_addrs[server].sa), &rpc_id, 0);
+	if (status < 0) {
+		log(NORMAL, "FATAL: error in homa_send: %s (request "
+				"length %d)\n", strerror(errno),
+				header->length);
+		exit(1);
 	}
-	rinfo *r = &rinfos[header->msg_id];
-	if (!r->active) {
-		log(NORMAL, "ERROR: response arrived for inactive msg_id %u\n",
-			header->msg_id);
-		return;
+	do {
+		status = receiver->receive(0, rpc_id);
+	} while ((status < 0) && ((errno == EAGAIN) || (errno == EINTR)));
+	if (status < 0) {
+		log(NORMAL, "FATAL: measure_rtt got error in recvmsg: %s "
+				"(id %lu, server %s)\n",
+				strerror(errno), rpc_id,
+				print_address((union sockaddr_in_union *)
+					      receiver->src_addr()));
+		exit(1);
 	}
-	rtt = end_time - r->start_time;
-	r->active = false;
+	return rdtsc() - start;
+}
 
-	int kcycles = rtt>>10;
-	tt("Received response, cid 0x%08x, id %u, length %d, "
-			"rtt %d kcycles",
-			header->cid, header->msg_id,
-			header->length, kcycles);
-	if ((kcycles > debug[0]) && (kcycles < debug[1])
-			&& (header->length < 1500) && !time_trace::frozen) {
-		freeze[header->cid.server] = 1;
-		tt("Freezing timetrace because of long RTT for "
-				"cid 0x%08x, id %u, length %d, kcycles %d",
-				header->cid, header->msg_id, header->length,
-				kcycles);
-		log(NORMAL, "Freezing timetrace because of long RTT for "
-				"cid 0x%08x, id %u",
-				int(header->cid), header->msg_id);
-		time_trace::freeze();
-		kfreeze();
-	}
+/**
+ * homa_client::measure_unloaded() - Gather baseline measurements of Homa
+ * under best-case conditions. This method will fill in the actual_lengths
+ * and actual_rtts arrays with several measurements for each message length
+ * in the current workload.
+ * @count:    How many samples to measure for each length in the distribution.
+ */
+void homa_client::measure_unloaded(int count)
+{
+	dist_point_gen length_dist(workload, HOMA_MAX_MESSAGE_LENGTH);
+	std::vector<int> dist_sizes = length_dist.values();
+	int server = 0;
+	int slot;
+	uint64_t ms100 = get_cycles_per_sec()/10;
+	uint64_t end;
+	homa::receiver receiver(fd, buf_region);
 
-	server_id = first_id[header->cid.server];
-	if (server_id == -1) {
-		log(NORMAL, "WARNING: response received from unknown "
-				"cid 0x%08x\n", (int) header->cid);
-		return;
+	/* Make one request for each size in the distribution, just to warm
+	 * up the system.
+	 */
+	for (int length: dist_sizes)
+		measure_rtt(server, length, sender_buffer, &receiver);
+
+	/* Now do the real measurements. Stop with each size after 10
+	 * measurements if more than 0.1 second has elapsed (otherwise
+	 * this takes too long).
+	 */
+	slot = 0;
+	for (int length: dist_sizes) {
+		end = rdtsc() + ms100;
+		log(NORMAL, "Starting unloaded measurement for length %d\n", length);
+		for (int i = 0; i < count; i++) {
+			if ((rdtsc() >= end) && (i >= 10))
+				break;
+			actual_lengths[slot] = length;
+			actual_rtts[slot] = measure_rtt(server, length,
+					sender_buffer, &receiver);
+			slot++;
+			if (slot >= NUM_CLIENT_STATS) {
+				log(NORMAL, "WARNING: not enough space to "
+						"record all unloaded RTTs\n");
+				slot = 0;
+			}
+		}
 	}
-	server_id += header->cid.server_port;
-	responses[server_id].fetch_add(1);
-	request_bytes += r->request_length;
-	response_bytes += header->length;
-	total_rtt += rtt;
-	actual_lengths[slot] = header->length;
-	actual_rtts[slot] = rtt;
 }
 
 /**
- * class homa_client - Holds information about a single Homa client,
- * which consists of one thread issuing requests and one or more threads
- * receiving responses.
+ * class homa_conn_client - Holds information about a single client that
+ * uses connected Homa sockets: there is one socket for each server port,
+ * connected with connect() and used with homa_send_connected. One thread
+ * issues requests on all of the connections, and each connection has its
+ * own threads receiving responses.
  */
-class homa_client : public client {
+class homa_conn_client : public client {
 public:
-	homa_client(int id, std::string& experiment);
-	virtual ~homa_client();
-	void measure_unloaded(int count);
-	uint64_t measure_rtt(int server, int length, char *buffer,
-			homa::receiver *receiver);
-	void receiver(int id);
+	/**
+	 * struct connection - Information about the connected socket
+	 * used to communicate with one server port.
+	 */
+	struct connection {
+		/** @fd: File descriptor for the connected socket. */
+		int fd;
+
+		/**
+		 * @buf_region: mmapped region of memory in which receive
+		 * buffers for @fd are allocated.
+		 */
+		char *buf_region;
+
+		/** @receiving_threads: threads that receive responses. */
+		std::vector<std::thread> receiving_threads;
+	};
+
+	homa_conn_client(int id, std::string& experiment);
+	virtual ~homa_conn_client();
+	void receiver(connection *conn, int receiver_id);
 	void sender(void);
 	virtual void stop_sender(void);
-	bool wait_response(homa::receiver *receiver, uint64_t rpc_id);
-
-	/** @fd: file descriptor for Homa socket. */
-	int fd;
+	bool wait_response(homa::receiver *receiver);
 
 	/**
-	 * @buf_region: mmapped region of memory in which receive buffers
-	 * are alloocated.
+	 * @connections: One entry for each server in server_addrs; used to
+	 * communicate with that server.
 	 */
-	char *buf_region;
+	std::vector<connection *> connections;
 
-	/** @buf_size: number of bytes available at @buf_region. */
+	/** @buf_size: number of bytes in each connection's buf_region. */
 	size_t buf_size;
 
 	/** @stop_sending: true means the sending thread should exit ASAP. */
@@ -1913,14 +2942,11 @@ public:
 	bool sender_exited;
 
 	/**
-	 * @sender_buffer: used by the sender to send requests, and also
-	 * by measure_unloaded; malloced, size HOMA_MAX_MESSAGE_LENGTH.
+	 * @sender_buffer: used by the sender to send requests; malloced,
+	 * size HOMA_MAX_MESSAGE_LENGTH.
 	 */
 	char *sender_buffer;
 
-	/** @receiver: threads that receive responses. */
-	std::vector<std::thread> receiving_threads;
-
 	/**
 	 * @sender: thread that sends requests (may also receive
 	 * responses if port_receivers is 0).
@@ -1929,71 +2955,86 @@ public:
 };
 
 /**
- * homa_client::homa_client() - Constructor for homa_client objects.
+ * homa_conn_client::homa_conn_client() - Constructor for homa_conn_client
+ * objects: opens and connects one socket for each server port.
  *
  * @id:          Unique identifier for this client (index starting at 0?).
  * @experiment:  Name of experiment in which this client will participate.
  */
-homa_client::homa_client(int id, std::string& experiment)
+homa_conn_client::homa_conn_client(int id, std::string& experiment)
 	: client(id, experiment)
-	, fd(-1)
-        , buf_region(nullptr)
+	, connections()
 	, buf_size(buf_bpages*HOMA_BPAGE_SIZE)
         , exit_sender(false)
         , exit_receivers(false)
         , sender_exited(false)
         , sender_buffer(new char[HOMA_MAX_MESSAGE_LENGTH])
-        , receiving_threads()
         , sending_thread()
 {
 	struct homa_rcvbuf_args arg;
+	size_t num_receivers = 0;
 
-	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
-	if (fd < 0) {
-		log(NORMAL, "Couldn't open Homa socket: %s\n", strerror(errno));
-		exit(1);
-	}
-
-	buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-	if (buf_region == MAP_FAILED) {
-		printf("Couldn't mmap buffer region for homa_client id %d: %s\n",
-				id, strerror(errno));
-		exit(1);
-	}
-	arg.start = buf_region;
-	arg.length = buf_size;
-	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &arg,
-			sizeof(arg));
-	if (status < 0) {
-		printf("FATAL: error in setsockopt(SO_HOMA_RCVBUF): %s\n",
-				strerror(errno));
-		exit(1);
-	}
+	for (sockaddr_in_union &server_addr: server_addrs) {
+		connection *conn = new connection;
 
-	if (unloaded) {
-		measure_unloaded(unloaded);
-		sender_exited = true;
-	} else {
-		for (int i = 0; i < port_receivers; i++) {
-			receiving_threads.emplace_back(&homa_client::receiver,
-					this, i);
+		conn->fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+		if (conn->fd < 0) {
+			log(NORMAL, "Couldn't open Homa socket: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		conn->buf_region = (char *) mmap(NULL, buf_size,
+				PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+		if (conn->buf_region == MAP_FAILED) {
+			printf("Couldn't mmap buffer region for "
+					"homa_conn_client id %d: %s\n",
+					id, strerror(errno));
+			exit(1);
+		}
+		arg.start = conn->buf_region;
+		arg.length = buf_size;
+		int status = setsockopt(conn->fd, IPPROTO_HOMA,
+				SO_HOMA_RCVBUF, &arg, sizeof(arg));
+		if (status < 0) {
+			printf("FATAL: error in setsockopt(SO_HOMA_RCVBUF): "
+					"%s\n", strerror(errno));
+			exit(1);
+		}
+		if (connect(conn->fd, &server_addr.sa,
+				sockaddr_size(&server_addr.sa)) < 0) {
+			log(NORMAL, "FATAL: couldn't connect Homa socket "
+					"to %s: %s\n",
+					print_address(&server_addr),
+					strerror(errno));
+			exit(1);
 		}
-		while (receivers_running < receiving_threads.size()) {
-			/* Wait for the receivers to begin execution before
-			 * starting the sender; otherwise the initial RPCs
-			 * may appear to take a long time.
-			 */
+		connections.push_back(conn);
+	}
+
+	for (connection *conn: connections) {
+		for (int i = 0; i < port_receivers; i++) {
+			conn->receiving_threads.emplace_back(
+					&homa_conn_client::receiver, this,
+					conn, num_receivers);
+			num_receivers++;
 		}
-		sending_thread.emplace(&homa_client::sender, this);
 	}
+	while (receivers_running < num_receivers) {
+		/* Wait for the receivers to begin execution before
+		 * starting the sender; otherwise the initial RPCs
+		 * may appear to take a long time.
+		 */
+	}
+	sending_thread.emplace(&homa_conn_client::sender, this);
 }
 
 /**
- * homa_client::~homa_client() - Destructor for homa_client objects;
- * will terminate threads created for this client.
+ * homa_conn_client::~homa_conn_client() - Destructor for homa_conn_client
+ * objects; will terminate threads and close connections created for this
+ * client.
  */
-homa_client::~homa_client()
+homa_conn_client::~homa_conn_client()
 {
 	uint64_t start = rdtsc();
 	exit_sender = true;
@@ -2002,22 +3043,26 @@ homa_client::~homa_client()
 		if (to_seconds(rdtsc() - start) > 2.0)
 			break;
 	}
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
-	delete[] sender_buffer;
+	for (connection *conn: connections)
+		shutdown(conn->fd, SHUT_RDWR);
 	if (sending_thread)
 		sending_thread->join();
-	for (std::thread &thread: receiving_threads)
-		thread.join();
-	munmap(buf_region, buf_size);
-	check_completion("homa");
+	for (connection *conn: connections) {
+		for (std::thread &thread: conn->receiving_threads)
+			thread.join();
+		close(conn->fd);
+		munmap(conn->buf_region, buf_size);
+		delete conn;
+	}
+	delete[] sender_buffer;
+	check_completion("homa_conn");
 }
 
 /**
- * homa_client::stop_sender() - Ask the sending thread to stop sending,
+ * homa_conn_client::stop_sender() - Ask the sending thread to stop sending,
  * and wait until it exits (but give up if that takes too long).
  */
-void homa_client::stop_sender(void)
+void homa_conn_client::stop_sender(void)
 {
 	uint64_t start = rdtsc();
 	exit_sender = true;
@@ -2034,30 +3079,26 @@ void homa_client::stop_sender(void)
 }
 
 /**
- * homa_client::wait_response() - Wait for a response to arrive and
- * update statistics.
- * @receiver: Use this for receiving the response and managing its buffers.
- * @rpc_id:   Id of a specific RPC to wait for, or 0 for "any response".
+ * homa_conn_client::wait_response() - Wait for a response to arrive on
+ * a connection and update statistics.
+ * @receiver: Use this for receiving the response and managing its buffers
+ *            (determines the connection).
  * Return:    True means that a response was received; false means the client
  *            has been stopped and the socket has been shut down.
  */
-bool homa_client::wait_response(homa::receiver *receiver, uint64_t rpc_id)
+bool homa_conn_client::wait_response(homa::receiver *receiver)
 {
 	message_header *header;
-
-	rpc_id = 0;
 	ssize_t length;
+
 	do {
-		length = receiver->receive(HOMA_RECVMSG_RESPONSE, rpc_id);
+		length = receiver->receive(HOMA_RECVMSG_RESPONSE, 0);
 	} while ((length < 0) && ((errno == EAGAIN) || (errno == EINTR)));
 	if (length < 0) {
 		if (exit_receivers)
 			return false;
-		log(NORMAL, "FATAL: error in Homa recvmsg: %s (id %lu, "
-				"server %s)\n",
-				strerror(errno), rpc_id,
-				print_address((union sockaddr_in_union *)
-					      receiver->src_addr()));
+		log(NORMAL, "FATAL: error in Homa recvmsg on connected "
+				"socket: %s\n", strerror(errno));
 		exit(1);
 	}
 	header = receiver->get<message_header>(0);
@@ -2074,22 +3115,21 @@ bool homa_client::wait_response(homa::receiver *receiver, uint64_t rpc_id)
 }
 
 /**
- * homa_client::sender() - Invoked as the top-level method in a thread;
- * invokes a pseudo-random stream of RPCs continuously.
+ * homa_conn_client::sender() - Invoked as the top-level method in a thread;
+ * invokes a pseudo-random stream of RPCs continuously, each sent on the
+ * connection for its server.
  */
-void homa_client::sender()
+void homa_conn_client::sender()
 {
 	message_header *header = reinterpret_cast<message_header *>(sender_buffer);
 	uint64_t next_start = rdtsc();
 	char thread_name[50];
-	homa::receiver receiver(fd, buf_region);
 
 	snprintf(thread_name, sizeof(thread_name), "C%d", id);
 	time_trace::thread_buffer thread_buffer(thread_name);
 
 	while (1) {
 		uint64_t now;
-		uint64_t rpc_id;
 		int server;
 		int status;
 		int slot = get_rinfo();
@@ -2106,13 +3146,14 @@ void homa_client::sender()
 			now = rdtsc();
 			if (now < next_start)
 				continue;
-			if ((total_requests - total_responses) < client_port_max)
+			if ((total_requests - total_responses)
+					< max_outstanding)
 				break;
 		}
 
-		rinfos[slot].start_time = now;
+		rinfos[slot].start_time = open_loop ? next_start : now;
 		server = server_dist(rand_gen);
-		header->length = length_dist(rand_gen);
+		header->length = next_length();
 		if (header->length > HOMA_MAX_MESSAGE_LENGTH)
 			header->length = HOMA_MAX_MESSAGE_LENGTH;
 		if (header->length < sizeof32(*header))
@@ -2125,149 +3166,44 @@ void homa_client::sender()
 		header->msg_id = slot;
 		tt("sending request, cid 0x%08x, id %u, length %d",
 				header->cid, header->msg_id, header->length);
-		if (client_iovec && (header->length > 20)) {
-			struct iovec vec[2];
-			vec[0].iov_base = sender_buffer;
-			vec[0].iov_len = 20;
-			vec[1].iov_base = sender_buffer + 20;
-			vec[1].iov_len = header->length - 20;
-			status = homa_sendv(fd, vec, 2,
-				            &server_addrs[server].sa,
-					    sockaddr_size(&server_addrs[server].sa),
-					    &rpc_id, 0);
-		} else
-			status = homa_send(fd, sender_buffer, header->length,
-					   &server_addrs[server].sa,
-					   sockaddr_size(&server_addrs[server].sa),
-					   &rpc_id, 0);
+		status = homa_send_connected(connections[server]->fd,
+				sender_buffer, header->length, 0);
 		if (status < 0) {
-			log(NORMAL, "FATAL: error in homa_send: %s (request "
-					"length %d)\n", strerror(errno),
-					header->length);
+			log(NORMAL, "FATAL: error in homa_send_connected: %s "
+					"(request length %d)\n",
+					strerror(errno), header->length);
 			exit(1);
 		}
 		requests[server]++;
 		total_requests++;
 		lag = now - next_start;
-		next_start += interval_dist(rand_gen)*cycles_per_second;
+		next_start += next_interval();
 		if (receivers_running == 0) {
-			/* There isn't a separate receiver thread; wait for
+			/* There aren't separate receiver threads; wait for
 			 * the response here. */
-			wait_response(&receiver, rpc_id);
+			homa::receiver receiver(connections[server]->fd,
+					connections[server]->buf_region);
+			wait_response(&receiver);
 		}
 	}
 }
 
 /**
- * homa_client::receiver() - Invoked as the top-level method in a thread
- * that waits for RPC responses and then logs statistics about them.
+ * homa_conn_client::receiver() - Invoked as the top-level method in a
+ * thread that waits for RPC responses on one connection and then logs
+ * statistics about them.
+ * @conn:          Connection on which to receive responses.
  * @receiver_id:   Unique id for this receiver within its client.
  */
-void homa_client::receiver(int receiver_id)
+void homa_conn_client::receiver(connection *conn, int receiver_id)
 {
 	char thread_name[50];
 	snprintf(thread_name, sizeof(thread_name), "R%d.%d", node_id, receiver_id);
 	time_trace::thread_buffer thread_buffer(thread_name);
-	homa::receiver receiver(fd, buf_region);
+	homa::receiver receiver(conn->fd, conn->buf_region);
 
 	receivers_running++;
-	while (wait_response(&receiver, 0)) {}
-}
-
-/**
- * homa_client::measure_rtt() - Make a single request to a given server and
- * return the RTT.
- * @server:      Identifier of server to use for the request.
- * @length:      Number of message bytes in the request.
- * @buffer:      Block of memory to use for request; must
- *               contain HOMA_MAX_MESSAGE_LENGTH bytes.
- * @receiver:    Use this to receive responses.
- *
- * Return:       Round-trip time to service the request, in rdtsc cycles.
- */
-uint64_t homa_client::measure_rtt(int server, int length, char *buffer,
-		homa::receiver *receiver)
-{
-	message_header *header = reinterpret_cast<message_header *>(buffer);
-	uint64_t start;
-	uint64_t rpc_id;
-	int status;
-
-	header->length = length;
-	if (header->length > HOMA_MAX_MESSAGE_LENGTH)
-		header->length = HOMA_MAX_MESSAGE_LENGTH;
-	if (header->length < sizeof32(*header))
-		header->length = sizeof32(*header);
-	header->cid = server_conns[server];
-	header->cid.client_port = id;
-	start = rdtsc();
-	status = homa_send(fd, buffer, header->length, &server_addrs[server].sa,
-			   sockaddr_size(&server_addrs[server].sa), &rpc_id, 0);
-	if (status < 0) {
-		log(NORMAL, "FATAL: error in homa_send: %s (request "
-				"length %d)\n", strerror(errno),
-				header->length);
-		exit(1);
-	}
-	do {
-		status = receiver->receive(0, rpc_id);
-	} while ((status < 0) && ((errno == EAGAIN) || (errno == EINTR)));
-	if (status < 0) {
-		log(NORMAL, "FATAL: measure_rtt got error in recvmsg: %s "
-				"(id %lu, server %s)\n",
-				strerror(errno), rpc_id,
-				print_address((union sockaddr_in_union *)
-					      receiver->src_addr()));
-		exit(1);
-	}
-	return rdtsc() - start;
-}
-
-/**
- * homa_client::measure_unloaded() - Gather baseline measurements of Homa
- * under best-case conditions. This method will fill in the actual_lengths
- * and actual_rtts arrays with several measurements for each message length
- * in the current workload.
- * @count:    How many samples to measure for each length in the distribution.
- */
-void homa_client::measure_unloaded(int count)
-{
-	dist_point_gen length_dist(workload, HOMA_MAX_MESSAGE_LENGTH);
-	std::vector<int> dist_sizes = length_dist.values();
-	int server = 0;
-	int slot;
-	uint64_t ms100 = get_cycles_per_sec()/10;
-	uint64_t end;
-	homa::receiver receiver(fd, buf_region);
-
-	/* Make one request for each size in the distribution, just to warm
-	 * up the system.
-	 */
-	for (int length: dist_sizes)
-		measure_rtt(server, length, sender_buffer, &receiver);
-
-	/* Now do the real measurements. Stop with each size after 10
-	 * measurements if more than 0.1 second has elapsed (otherwise
-	 * this takes too long).
-	 */
-	slot = 0;
-	for (int length: dist_sizes) {
-		end = rdtsc() + ms100;
-		log(NORMAL, "Starting unloaded measurement for length %d\n", length);
-		for (int i = 0; i < count; i++) {
-			if ((rdtsc() >= end) && (i >= 10))
-				break;
-			actual_lengths[slot] = length;
-			actual_rtts[slot] = measure_rtt(server, length,
-					sender_buffer, &receiver);
-			slot++;
-			if (slot >= NUM_CLIENT_STATS) {
-				log(NORMAL, "WARNING: not enough space to "
-						"record all unloaded RTTs\n");
-				slot = 0;
-			}
-		}
-	}
+	while (wait_response(&receiver)) {}
 }
 
 /**
@@ -2499,7 +3435,7 @@ void tcp_client::sender()
 			now = rdtsc();
 			if ((now >= next_start)
 					&& ((total_requests - total_responses)
-					< client_port_max))
+					< max_outstanding))
 				break;
 
 			/* Try to finish I/O on backed up connections. */
@@ -2513,9 +3449,9 @@ void tcp_client::sender()
 				next_blocked++;
 		}
 
-		rinfos[slot].start_time = now;
+		rinfos[slot].start_time = open_loop ? next_start : now;
 		server = server_dist(rand_gen);
-		header.length = length_dist(rand_gen);
+		header.length = next_length();
 		if ((header.length > HOMA_MAX_MESSAGE_LENGTH) && tcp_trunc)
 			header.length = HOMA_MAX_MESSAGE_LENGTH;
 		rinfos[slot].request_length = header.length;
@@ -2552,7 +3488,7 @@ void tcp_client::sender()
 			backups++;
 		bytes_sent[server] += header.length;
 		lag = now - next_start;
-		next_start += interval_dist(rand_gen)*cycles_per_second;
+		next_start += next_interval();
 	}
 }
 
@@ -2843,6 +3779,62 @@ void log_stats()
 	}
 }
 
+/**
+ * read_arrivals() - Read a file of request arrivals (as given with the
+ * --arrivals client option) into @arrivals.
+ * @file:   Name of the file to read.
+ *
+ * Return:  Nonzero means success, zero means there was an error.
+ */
+int read_arrivals(const char *file)
+{
+	double cycles_per_usec = get_cycles_per_sec()*1e-06;
+	char line[200];
+	int line_num = 0;
+	FILE *f;
+
+	arrivals.clear();
+	f = fopen(file, "r");
+	if (f == NULL) {
+		printf("Couldn't open arrivals file %s: %s\n", file,
+				strerror(errno));
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double usecs;
+		arrival a;
+		int count;
+
+		line_num++;
+		a.length = 0;
+		count = sscanf(line, "%lf %d", &usecs, &a.length);
+		if (count < 1) {
+			if ((line[strspn(line, " \t\n")] == 0)
+					|| (line[strspn(line, " \t")] == '#'))
+				continue;
+			printf("Bad line %d in arrivals file %s: %s", line_num,
+					file, line);
+			fclose(f);
+			return 0;
+		}
+		if ((usecs < 0) || (a.length < 0)
+				|| (a.length > HOMA_MAX_MESSAGE_LENGTH)) {
+			printf("Bad values on line %d of arrivals file %s: %s",
+					line_num, file, line);
+			fclose(f);
+			return 0;
+		}
+		a.interval = usecs*cycles_per_usec;
+		arrivals.push_back(a);
+	}
+	fclose(f);
+	if (arrivals.empty()) {
+		printf("Arrivals file %s contains no requests\n", file);
+		return 0;
+	}
+	return 1;
+}
+
 /**
  * client_cmd() - Parse the arguments for a "client" command and execute it.
  * @words:  Command arguments (including the command name as @words[0]).
@@ -2856,6 +3848,7 @@ int client_cmd(std::vector<string> &words)
 	std::string servers;
 	std::string experiment;
 
+	arrivals.clear();
 	buf_bpages = 1000;
 	client_iovec = false;
 	client_max = 1;
@@ -2867,12 +3860,22 @@ int client_cmd(std::vector<string> &words)
 	protocol = "homa";
 	tcp_trunc = true;
 	one_way = false;
+	open_loop = false;
 	unloaded = 0;
 	workload = "100";
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
 
-		if (strcmp(option, "--buf-bpages") == 0) {
+		if (strcmp(option, "--arrivals") == 0) {
+			if ((i + 1) >= words.size()) {
+				printf("No value provided for %s\n",
+						option);
+				return 0;
+			}
+			if (!read_arrivals(words[i+1].c_str()))
+				return 0;
+			i++;
+		} else if (strcmp(option, "--buf-bpages") == 0) {
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
@@ -2913,6 +3916,8 @@ int client_cmd(std::vector<string> &words)
 			tcp_trunc = false;
 		} else if (strcmp(option, "--one-way") == 0) {
 			one_way = true;
+		} else if (strcmp(option, "--open-loop") == 0) {
+			open_loop = true;
 		} else if (strcmp(option, "--ports") == 0) {
 			if (!parse(words, i+1, &client_ports, option, "integer"))
 				return 0;
@@ -2998,6 +4003,21 @@ int client_cmd(std::vector<string> &words)
 	client_port_max = client_max/client_ports;
 	if (client_port_max < 1)
 		client_port_max = 1;
+	if (open_loop) {
+		/* Waiting for responses in the sender, or sending as fast
+		 * as possible, would make the sender's schedule depend on
+		 * response times.
+		 */
+		if (port_receivers < 1) {
+			printf("--open-loop requires --port-receivers > 0\n");
+			return 0;
+		}
+		if ((net_gbps <= 0.0) && arrivals.empty()) {
+			printf("--open-loop requires --gbps > 0 or "
+					"--arrivals\n");
+			return 0;
+		}
+	}
 
 	/* Create clients. */
 	for (int i = 0; i < client_ports; i++) {
@@ -3005,6 +4025,10 @@ int client_cmd(std::vector<string> &words)
 			if (first_port == -1)
 				first_port = 4000;
 			clients.push_back(new homa_client(i, experiment));
+		} else if (strcmp(protocol, "homa_conn") == 0) {
+			if (first_port == -1)
+				first_port = 4000;
+			clients.push_back(new homa_conn_client(i, experiment));
 		} else {
 			if (first_port == -1)
 				first_port = 5000;
@@ -3101,6 +4125,102 @@ int dump_times_cmd(std::vector<string> &words)
 	return 1;
 }
 
+/**
+ * dump_hist_cmd() - Parse the arguments for a "dump_hist" command and
+ * execute it. The histograms of all the selected clients are merged and
+ * written in the format of HdrHistogram's outputPercentileDistribution,
+ * with one line per nonempty bucket, and then the histograms are reset.
+ * @words:  Command arguments (including the command name as @words[0]).
+ *
+ * Return:  Nonzero means success, zero means there was an error.
+ */
+int dump_hist_cmd(std::vector<string> &words)
+{
+	std::vector<uint64_t> counts(HIST_BUCKETS, 0);
+	double mean, sum, sum_squares, usecs;
+	uint64_t total, cumulative;
+	char time_buffer[100];
+	std::string exp;
+	int last;
+	time_t now;
+	FILE *f;
+
+	if (words.size() == 3)
+		exp = words[2];
+	else if (words.size() != 2) {
+		printf("Wrong # args; must be 'dump_hist file [experiment]'\n");
+		return 0;
+	}
+	f = fopen(words[1].c_str(), "w");
+	if (f == NULL) {
+		printf("Couldn't open file %s: %s\n", words[1].c_str(),
+				strerror(errno));
+		return 0;
+	}
+
+	total = 0;
+	last = 0;
+	sum = 0.0;
+	sum_squares = 0.0;
+	for (client *client: clients) {
+		if (!exp.empty() && (client->experiment != exp))
+			continue;
+		for (int i = 0; i < HIST_BUCKETS; i++)
+			counts[i] += client->hist.counts[i].exchange(0);
+	}
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (counts[i] == 0)
+			continue;
+		usecs = 1e-03*latency_hist::highest(i);
+		total += counts[i];
+		sum += counts[i]*usecs;
+		sum_squares += counts[i]*usecs*usecs;
+		last = i;
+	}
+
+	time(&now);
+	strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S",
+			localtime(&now));
+	fprintf(f, "# Histogram of round-trip times (usec) measured by cp_node "
+			"at %s for experiment %s\n",
+			time_buffer, exp.empty() ? "<none>" : exp.c_str());
+	fprintf(f, "# --protocol %s, --workload %s, --gbps %.1f --threads %d,\n",
+			protocol, workload, net_gbps, client_ports);
+	fprintf(f, "# --server-nodes %lu --server-ports %d, --client-max %d%s\n",
+			server_ids.size(), server_ports, client_max,
+			open_loop ? ", --open-loop" : "");
+	fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+			"TotalCount", "1/(1-Percentile)");
+	cumulative = 0;
+	for (int i = 0; i <= last; i++) {
+		double fraction;
+
+		if (counts[i] == 0)
+			continue;
+		cumulative += counts[i];
+		usecs = 1e-03*latency_hist::highest(i);
+		fraction = static_cast<double>(cumulative)/total;
+		if (cumulative < total)
+			fprintf(f, "%12.3f %2.12f %10lu %14.2f\n", usecs,
+					fraction, cumulative,
+					1.0/(1.0 - fraction));
+		else
+			fprintf(f, "%12.3f %2.12f %10lu\n", usecs, fraction,
+					cumulative);
+	}
+	mean = (total > 0) ? sum/total : 0.0;
+	fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean,
+			(total > 0) ? sqrt(std::max(0.0,
+			sum_squares/total - mean*mean)) : 0.0);
+	fprintf(f, "#[Max     = %12.3f, Total count    = %12lu]\n",
+			(total > 0) ? 1e-03*latency_hist::highest(last) : 0.0,
+			total);
+	fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+			HIST_MAX_BITS - HIST_SUB_BITS + 2, 1 << HIST_SUB_BITS);
+	fclose(f);
+	return 1;
+}
+
 /**
  * info_cmd() - Parse the arguments for an "info" command and execute it.
  * @words:  Command arguments (including the command name as @words[0]).
@@ -3214,6 +4334,7 @@ int server_cmd(std::vector<string> &words)
 {
 	std::string experiment;
 	buf_bpages = 1000;
+	conn_threads = 1;
 	first_port = -1;
 	inet_family = AF_INET;
         protocol = "homa";
@@ -3229,6 +4350,11 @@ int server_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &buf_bpages, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--conn-threads") == 0) {
+			if (!parse(words, i+1, &conn_threads, option,
+					"integer"))
+				return 0;
+			i++;
 		} else if (strcmp(option, "--exp") == 0) {
 			if ((i + 1) >= words.size()) {
 				printf("No value provided for %s\n",
@@ -3286,6 +4412,15 @@ int server_cmd(std::vector<string> &words)
 					experiment);
 			homa_servers.push_back(server);
 		}
+	} else if (strcmp(protocol, "homa_conn") == 0) {
+		if (first_port == -1)
+			first_port = 4000;
+		for (int i = 0; i < server_ports; i++) {
+			homa_conn_server *server = new homa_conn_server(
+					first_port + i, i, inet_family,
+					port_threads, conn_threads, experiment);
+			homa_conn_servers.push_back(server);
+		}
 	} else {
 		if (first_port == -1)
 			first_port = 5000;
@@ -3321,6 +4456,9 @@ int stop_cmd(std::vector<string> &words)
 			for (homa_server *server: homa_servers)
 				delete server;
 			homa_servers.clear();
+			for (homa_conn_server *server: homa_conn_servers)
+				delete server;
+			homa_conn_servers.clear();
 			for (tcp_server *server: tcp_servers)
 				delete server;
 			tcp_servers.clear();
@@ -3395,6 +4533,8 @@ int exec_words(std::vector<string> &words)
 		return client_cmd(words);
 	} else if (words[0].compare("debug") == 0) {
 		return debug_cmd(words);
+	} else if (words[0].compare("dump_hist") == 0) {
+		return dump_hist_cmd(words);
 	} else if (words[0].compare("dump_times") == 0) {
 		return dump_times_cmd(words);
 	} else if (words[0].compare("info") == 0) {
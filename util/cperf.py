@@ -73,6 +73,7 @@ default_defaults = {
     # unlimited load (throttle queue inserts take a long time).
     'client_max':          200,
     'client_ports':        3,
+    'conn_threads':        1,
     'log_dir':             'logs/' + time.strftime('%Y%m%d%H%M%S'),
     'mtu':                 0,
     'no_trunc':            '',
@@ -133,6 +134,9 @@ tcp_color3 =     '#96E296'
 homa_color =     '#1759BB'
 homa_color2 =    '#6099EE'
 homa_color3 =    '#A6C6F6'
+conn_color =     '#8E44AD'
+conn_color2 =    '#B57EDC'
+conn_color3 =    '#D7BDE2'
 dctcp_color =    '#7A4412'
 dctcp_color2 =   '#CB701D'
 dctcp_color3 =   '#EAA668'
@@ -183,6 +187,14 @@ def vlog(message):
     log_file.write(message)
     log_file.write("\n")
 
+def homa_protocol(protocol):
+    """
+    Returns True if protocol (a value for the --protocol option) runs
+    over Homa, either with unconnected sockets ("homa") or with connected
+    sockets ("homa_conn"), False otherwise.
+    """
+    return protocol in ["homa", "homa_conn"]
+
 def get_parser(description, usage, defaults = {}):
     """
     Returns an ArgumentParser for options that are commonly used in
@@ -216,6 +228,11 @@ def get_parser(description, usage, defaults = {}):
             metavar='count', default=defaults['client_ports'],
             help='Number of ports on which each client should issue requests '
             '(default: %d)' % (defaults['client_ports']))
+    parser.add_argument('--conn-threads', type=int, dest='conn_threads',
+            metavar='count', default=defaults['conn_threads'],
+            help='Number of threads servicing each connected socket peeled '
+            'off by a homa_conn server (default: %d)'
+            % (defaults['conn_threads']))
     parser.add_argument('--cperf-log', dest='cperf_log',
             metavar='F', default='cperf.log',
             help='Name to use for the cperf log file (default: cperf.log)')
@@ -241,6 +258,12 @@ def get_parser(description, usage, defaults = {}):
     parser.add_argument('--no-homa-prio', dest='no_homa_prio',
             action='store_true', default=False,
             help='Don\'t run homa_prio on nodes to adjust unscheduled cutoffs')
+    parser.add_argument('--open-loop', dest='open_loop',
+            action='store_true', default=False,
+            help='Issue client requests open-loop, on a schedule that doesn\'t '
+            'depend on when responses arrive, and measure each RTT from the '
+            'request\'s scheduled start time; also collects a latency '
+            'histogram (.hist file) from each client')
     parser.add_argument('--old-slowdown', dest='old_slowdown',
             action='store_true', default=False,
             help='Compute slowdowns using the approach of the Homa ATC '
@@ -257,7 +280,8 @@ def get_parser(description, usage, defaults = {}):
             help='Number of threads listening on each Homa server port '
             '(default: %d)'% (defaults['port_threads']))
     parser.add_argument('-p', '--protocol', dest='protocol',
-            choices=['homa', 'tcp', 'dctcp'], default=defaults['protocol'],
+            choices=['homa', 'homa_conn', 'tcp', 'dctcp'],
+            default=defaults['protocol'],
             help='Transport protocol to use (default: %s)'
             % (defaults['protocol']))
     parser.add_argument('-s', '--seconds', type=int, dest='seconds',
@@ -441,7 +465,7 @@ def wait_output(string, nodes, cmd, time_limit=10.0):
 def start_nodes(ids, options):
     """
     Start up cp_node on a group of nodes. Also starts homa_prio on the
-    nodes, if protocol is "homa".
+    nodes, if protocol is "homa" or "homa_conn".
 
     ids:      List of node ids on which to start cp_node, if it isn't already
               running
@@ -462,7 +486,7 @@ def start_nodes(ids, options):
             fcntl.fcntl(node.stdout, fcntl.F_SETFL, fl | os.O_NONBLOCK)
             active_nodes[id] = node
             started.append(id)
-        if options.protocol == "homa":
+        if homa_protocol(options.protocol):
             if options.set_ids:
                 set_sysctl_parameter(".net.homa.next_id",
                         str(100000000*(id+1)), [id])
@@ -614,6 +638,7 @@ def start_servers(exp, ids, options):
                  server_ports
                  port_threads
                  protocol
+                 conn_threads (if protocol is homa_conn)
     """
     global server_nodes
     log("Starting servers for %s experiment on nodes %s" % (exp, ids))
@@ -621,10 +646,13 @@ def start_servers(exp, ids, options):
         do_cmd("stop servers", server_nodes)
         server_nodes = []
     start_nodes(ids, options)
-    if options.protocol == "homa":
-        do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s"
-               % (options.server_ports, options.port_threads,
-                options.protocol, exp, options.ipv6), ids)
+    if homa_protocol(options.protocol):
+        command = "server --ports %d --port-threads %d --protocol %s " \
+                "--exp %s %s" % (options.server_ports, options.port_threads,
+                options.protocol, exp, options.ipv6)
+        if options.protocol == "homa_conn":
+            command += " --conn-threads %d" % (options.conn_threads)
+        do_cmd(command, ids)
     else:
         do_cmd("server --ports %d --port-threads %d --protocol %s --exp %s %s"
                % (options.tcp_server_ports, options.tcp_port_threads,
@@ -660,7 +688,7 @@ def run_experiment(name, clients, options):
     nodes = []
     log("Starting clients for %s experiment on nodes %s" % (name, clients))
     for id in clients:
-        if options.protocol == "homa":
+        if homa_protocol(options.protocol):
             command = "client --ports %d --port-receivers %d --server-ports %d " \
                     "--workload %s --servers %s --gbps %.3f --client-max %d " \
                     "--protocol %s --id %d --exp %s %s" % (
@@ -700,6 +728,8 @@ def run_experiment(name, clients, options):
                     id,
                     name,
                     options.ipv6)
+        if "open_loop" in options and options.open_loop:
+            command += " --open-loop"
         active_nodes[id].stdin.write(command + "\n")
         try:
             active_nodes[id].stdin.flush()
@@ -709,7 +739,7 @@ def run_experiment(name, clients, options):
         vlog("Command for node%d: %s" % (id, command))
     wait_output("% ", nodes, command, 40.0)
     if not "unloaded" in options:
-        if options.protocol == "homa":
+        if homa_protocol(options.protocol):
             # Wait a bit so that homa_prio can set priorities appropriately
             time.sleep(2)
             vlog("Recording initial metrics")
@@ -717,6 +747,8 @@ def run_experiment(name, clients, options):
                 do_subprocess(["ssh", "node%d" % (id), "metrics.py"])
         if not "no_rtt_files" in options:
             do_cmd("dump_times /dev/null %s" % (name), clients)
+        if "open_loop" in options and options.open_loop:
+            do_cmd("dump_hist /dev/null %s" % (name), clients)
         do_cmd("log Starting measurements for %s experiment" % (name),
                 server_nodes, clients)
         log("Starting measurements")
@@ -728,7 +760,7 @@ def run_experiment(name, clients, options):
             do_cmd("debug 2000 3000", clients)
             log("Finished setting debug info")
         time.sleep(options.seconds - debug_delay)
-        if options.protocol == "homa" and options.tt_freeze:
+        if homa_protocol(options.protocol) and options.tt_freeze:
             log("Freezing timetraces via node%d" % nodes[0])
             set_sysctl_parameter(".net.homa.action", "7", nodes[0:1])
         do_cmd("log Ending measurements for %s experiment" % (name),
@@ -736,7 +768,9 @@ def run_experiment(name, clients, options):
     log("Retrieving data for %s experiment" % (name))
     if not "no_rtt_files" in options:
         do_cmd("dump_times rtts %s" % (name), clients)
-    if (options.protocol == "homa") and not "unloaded" in options:
+    if "open_loop" in options and options.open_loop:
+        do_cmd("dump_hist hist %s" % (name), clients)
+    if homa_protocol(options.protocol) and not "unloaded" in options:
         vlog("Recording final metrics from nodes %s" % (exp_nodes))
         for id in exp_nodes:
             f = open("%s/%s-%d.metrics" % (options.log_dir, name, id), 'w')
@@ -757,6 +791,10 @@ def run_experiment(name, clients, options):
         for id in clients:
             do_subprocess(["rsync", "-rtvq", "node%d:rtts" % (id),
                     "%s/%s-%d.rtts" % (options.log_dir, name, id)])
+    if "open_loop" in options and options.open_loop:
+        for id in clients:
+            do_subprocess(["rsync", "-rtvq", "node%d:hist" % (id),
+                    "%s/%s-%d.hist" % (options.log_dir, name, id)])
 
 def run_experiments(*args):
     """
@@ -772,7 +810,7 @@ def run_experiments(*args):
                          experiment (if the same server is in multiple
                          experiments, the parameters from the first experiment
                          are used to start the server).
-             protocol:   tcp or homa
+             protocol:   tcp, homa, or homa_conn
              gbps
              seconds
              workload
@@ -783,6 +821,7 @@ def run_experiments(*args):
              port_receivers
              server_ports
              port_threads
+             conn_threads (homa_conn only)
 
              For TCP experiments the following values must be present:
              tcp_client_max (or client_max)
@@ -799,7 +838,7 @@ def run_experiments(*args):
     homa_servers= []
     tcp_nodes = []
     for exp in args:
-        if exp.protocol == "homa":
+        if homa_protocol(exp.protocol):
             homa_clients.extend(exp.clients)
             homa_nodes.extend(exp.clients)
             homa_servers.extend(exp.servers)
@@ -820,11 +859,13 @@ def run_experiments(*args):
             log("Starting servers for %s experiment on nodes %s" % (exp.name,
                     exp.servers))
             start_nodes(exp.servers, exp)
-            if exp.protocol == "homa":
-                do_cmd("server --ports %d --port-threads %d --protocol homa "
-                       "--exp %s %s"
-                        % (exp.server_ports, exp.port_threads,
-                        exp.name, exp.ipv6), exp.servers)
+            if homa_protocol(exp.protocol):
+                command = "server --ports %d --port-threads %d " \
+                        "--protocol %s --exp %s %s" % (exp.server_ports,
+                        exp.port_threads, exp.protocol, exp.name, exp.ipv6)
+                if exp.protocol == "homa_conn":
+                    command += " --conn-threads %d" % (exp.conn_threads)
+                do_cmd(command, exp.servers)
             else:
                 do_cmd("server --ports %d --port-threads %d --protocol tcp "
                        "--exp %s %s"
@@ -837,10 +878,10 @@ def run_experiments(*args):
                 exp.clients))
         start_nodes(exp.clients, exp)
         for id in exp.clients:
-            if exp.protocol == "homa":
+            if homa_protocol(exp.protocol):
                 command = "client --ports %d --port-receivers %d --server-ports %d " \
                         "--workload %s --servers %s --gbps %.3f --client-max %d " \
-                        "--protocol homa --id %d --exp %s %s" % (
+                        "--protocol %s --id %d --exp %s %s" % (
                         exp.client_ports,
                         exp.port_receivers,
                         exp.server_ports,
@@ -848,6 +889,7 @@ def run_experiments(*args):
                         ",".join([str(x) for x in exp.servers]),
                         exp.gbps,
                         exp.client_max,
+                        exp.protocol,
                         id,
                         exp.name,
                         exp.ipv6)
@@ -868,6 +910,8 @@ def run_experiments(*args):
                         id,
                         exp.name,
                         exp.ipv6)
+            if "open_loop" in exp and exp.open_loop:
+                command += " --open-loop"
             active_nodes[id].stdin.write(command + "\n")
             try:
                 active_nodes[id].stdin.flush()
@@ -883,6 +927,9 @@ def run_experiments(*args):
         vlog("Initializing metrics")
         do_ssh(["metrics.py > /dev/null"], homa_nodes)
     do_cmd("dump_times /dev/null", all_nodes)
+    for exp in args:
+        if "open_loop" in exp and exp.open_loop:
+            do_cmd("dump_hist /dev/null %s" % (exp.name), exp.clients)
     do_cmd("log Starting measurements", all_nodes)
     log("Starting measurements")
 
@@ -896,6 +943,9 @@ def run_experiments(*args):
     log("Retrieving data")
     for exp in args:
         do_cmd("dump_times %s.rtts %s" % (exp.name, exp.name), exp.clients)
+        if "open_loop" in exp and exp.open_loop:
+            do_cmd("dump_hist %s.hist %s" % (exp.name, exp.name),
+                    exp.clients)
     if homa_nodes:
         vlog("Recording final metrics from nodes %s" % (homa_nodes))
         for id in homa_nodes:
@@ -912,6 +962,10 @@ def run_experiments(*args):
         for id in exp.clients:
             do_subprocess(["rsync", "-rtvq", "node%d:%s.rtts" % (id, exp.name),
                     "%s/%s-%d.rtts" % (exp.log_dir, exp.name, id)])
+            if "open_loop" in exp and exp.open_loop:
+                do_subprocess(["rsync", "-rtvq",
+                        "node%d:%s.hist" % (id, exp.name),
+                        "%s/%s-%d.hist" % (exp.log_dir, exp.name, id)])
 
 def scan_log(file, node, experiments):
     """
@@ -1209,6 +1263,65 @@ def read_rtts(file, rtts, min_rtt = 0.0, link_mbps = 0.0):
         return 0, 0
     return num_rtts, slowdown_sum/num_rtts
 
+def read_hist(file, hist):
+    """
+    Read a file generated by cp_node's "dump_hist" command and add its
+    data to the information present in hist.
+
+    file:       Name of the file.
+    hist:       Dictionary whose keys are RTTs in usecs (the largest value
+                in a histogram bucket); each value is the number of RTTs
+                recorded in that bucket.
+    Returns:    The total number of rtts read from the file.
+    """
+
+    total = 0
+    cumulative = 0
+    f = open(file, "r")
+    for line in f:
+        words = line.split()
+        if (len(words) < 3) or (words[0][0] == '#') or (words[0] == "Value"):
+            continue
+        usec = float(words[0])
+        count = int(words[2]) - cumulative
+        cumulative = int(words[2])
+        hist[usec] = hist.get(usec, 0) + count
+        total += count
+    f.close()
+    return total
+
+def get_hist_percentiles(experiment, percentiles):
+    """
+    Merges the .hist files for all of the clients in an experiment and
+    returns RTTs at particular percentiles.
+
+    experiment:   Name of the experiment; must have been run with the
+                  --open-loop option.
+    percentiles:  List of percentiles (between 0 and 100) to return.
+    Returns:      A list of RTTs in usecs, one for each entry in percentiles,
+                  followed by the total number of RTTs in the histograms.
+    """
+
+    hist = {}
+    total = 0
+    files = sorted(glob.glob("%s/%s-*.hist" % (log_dir, experiment)))
+    if len(files) == 0:
+        raise Exception("Couldn't find %s histogram data" % (experiment))
+    for file in files:
+        total += read_hist(file, hist)
+    result = []
+    for percentile in percentiles:
+        target = total*percentile/100
+        cumulative = 0
+        value = 0.0
+        for value in sorted(hist.keys()):
+            cumulative += hist[value]
+            if cumulative >= target:
+                break
+        result.append(value)
+    result.append(total)
+    return result
+
 def get_buckets(rtts, total):
     """
     Generates buckets for histogramming the information in rtts.
@@ -4,72 +4,73 @@
 # SPDX-License-Identifier: BSD-1-Clause
 
 """
-This program reads 2 Homa metrics files (/proc/net/homa_metrics)
-and prints out all of the statistics that have changed, in the
-same format as the original files.
+This program reads 2 Homa metrics files (/proc/net/homa_metrics or
+/proc/net/homa_metrics_bin, or copies of them such as the file saved by
+metrics.py) and prints out all of the statistics that have changed, in the
+same format as the original text files. Counts for individual cores are
+summed. The two files needn't have the same format, but there is no
+documentation for metrics unless the second file is text.
 
 Usage:
 diff_metrics file1 file2
 """
 
 from __future__ import division, print_function
-from glob import glob
-from optparse import OptionParser
-import math
-import os
 import re
-import string
 import sys
 
-# Contains values for all the metrics from the first file. Keys are
-# metric names, values are metric values.
-metrics = {}
+import metrics_bin
 
-def scan_first(name):
+def read_metrics(name):
     """
-    Scan the metrics file given by 'name' and record its metrics.
+    Read the metrics file given by 'name' and return a tuple (symbols,
+    totals, docs), where symbols lists the metric names in the order they
+    appear in the file, totals maps from metric name to its value summed
+    over all cores, and docs maps from metric name to its documentation.
     """
-    global metrics
-    f = open(name)
-
-    for line in f:
-        match = re.match('^([^ ]+) *([0-9]+) *(.*)', line)
-        if not match:
-            print("Didn't match: %s\n" % (line))
-            continue
-        metrics[match.group(1)] = long(match.group(2))
+    f = open(name, "rb")
+    data = f.read()
     f.close()
 
-def scan_second(name):
-    """
-    Scan the metrics file given by 'name', compare its metrics to
-    those that have been recorded, and print an output line with
-    the difference, if there is any.
-    """
-    global metrics
-    f = open(name)
+    totals = {}
+    docs = {}
+    if metrics_bin.is_binary(data):
+        time_ns, symbols, cores = metrics_bin.read_binary(data)
+        for symbol in symbols:
+            totals[symbol] = sum(core[symbol] for core in cores)
+            docs[symbol] = ""
+        symbols.insert(0, "time_ns")
+        totals["time_ns"] = time_ns
+        docs["time_ns"] = ""
+        return (symbols, totals, docs)
 
-    for line in f:
+    symbols = []
+    for line in data.decode().splitlines():
         match = re.match('^([^ ]+) *([0-9]+) *(.*)', line)
         if not match:
             print("Didn't match: %s\n" % (line))
             continue
-        name = match.group(1)
-        value = long(match.group(2))
-        comment = match.group(3)
-        if not name in metrics:
-            print("No metric for %s\n" % (name))
+        symbol = match.group(1)
+        if symbol == "core":
             continue
-        # print("%s: %d %d\n" % (name, metrics[name], value))
-        diff = value - metrics[name]
-        if diff == 0:
-            continue
-        print("%-22s %15lu  %s" % (name, diff, comment))
-    f.close()
+        if not symbol in totals:
+            symbols.append(symbol)
+            totals[symbol] = 0
+            docs[symbol] = match.group(3)
+        totals[symbol] += int(match.group(2))
+    return (symbols, totals, docs)
 
 if len(sys.argv) != 3:
-    printf("Usage: %s file file2\n" % sys.argv[0])
+    print("Usage: %s file file2" % sys.argv[0])
     exit(1)
 
-scan_first(sys.argv[1])
-scan_second(sys.argv[2])
\ No newline at end of file
+_, first, _ = read_metrics(sys.argv[1])
+symbols, second, docs = read_metrics(sys.argv[2])
+for name in symbols:
+    if not name in first:
+        print("No metric for %s\n" % (name))
+        continue
+    diff = second[name] - first[name]
+    if diff == 0:
+        continue
+    print("%-22s %15d  %s" % (name, diff, docs[name]))
@@ -24,9 +24,13 @@
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <linux/errqueue.h>
 
+#include <atomic>
 #include <thread>
+#include <vector>
 
 #include "homa.h"
 #include "test_utils.h"
@@ -40,6 +44,9 @@ int count = 1000;
 /* Used to generate "somewhat random but predictable" contents for buffers. */
 int seed = 12345;
 
+/* Largest number of concurrent sending threads for the sendscale test. */
+int max_threads = 32;
+
 /* Buffer space used for receiving messages. */
 char *buf_region;
 
@@ -68,6 +75,42 @@ void close_fd(int fd)
 	}
 }
 
+/**
+ * send_abort_loop() - Helper method for "sendscale" test: opens a Homa
+ * socket, waits for a signal to start, then repeatedly sends a request and
+ * immediately aborts it, so the cost is dominated by creating and deleting
+ * client RPCs.
+ * @dest:     Where to send requests.
+ * @request:  Request message.
+ * @go:       The loop starts once this becomes true.
+ * @sends:    The number of successful sends is added to this.
+ */
+void send_abort_loop(const sockaddr_in_union *dest, char *request,
+		std::atomic<bool> *go, std::atomic<uint64_t> *sends)
+{
+	uint64_t id, completed = 0;
+	int fd;
+
+	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		printf("Couldn't open Homa socket: %s\n", strerror(errno));
+		return;
+	}
+	while (!go->load())
+		;
+	for (int i = 0; i < count; i++) {
+		if (homa_send(fd, request, length, &dest->sa,
+				sockaddr_size(&dest->sa), &id, 0) < 0) {
+			printf("Error in homa_send: %s\n", strerror(errno));
+			break;
+		}
+		homa_abort(fd, id, 0);
+		completed++;
+	}
+	*sends += completed;
+	close(fd);
+}
+
 /**
  * send_fd() - Helper method for "poll" test: sleeps a while, then sends
  * a request to a socket.
@@ -106,6 +149,58 @@ void shutdown_fd(int fd)
 	}
 }
 
+/**
+ * zerocopy_drain() - Read MSG_ZEROCOPY completion notifications from the
+ * error queue of a Homa socket.
+ * @fd:       Homa socket.
+ * @wait:     True means wait (up to 1 second) for a notification if none
+ *            is available immediately.
+ * @copied:   Incremented for each notification that indicates that data
+ *            was copied after all.
+ * Return:    The number of sends covered by the notifications that were read.
+ */
+int zerocopy_drain(int fd, bool wait, int *copied)
+{
+	struct sock_extended_err *serr;
+	struct pollfd poll_info;
+	struct cmsghdr *cm;
+	char control[100];
+	int completed = 0;
+	struct msghdr msg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if ((errno != EAGAIN) || !wait || (completed > 0))
+				break;
+			poll_info.fd = fd;
+			poll_info.events = 0;
+			poll_info.revents = 0;
+			if (poll(&poll_info, 1, 1000) <= 0)
+				break;
+			continue;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+				cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP)
+					&& (cm->cmsg_type == IP_RECVERR))
+					&& !((cm->cmsg_level == SOL_IPV6)
+					&& (cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = reinterpret_cast<struct sock_extended_err *>(
+					CMSG_DATA(cm));
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			completed += serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				(*copied)++;
+		}
+	}
+	return completed;
+}
+
 /**
  * print_help() - Print out usage information for this program.
  * @name:   Name of the program (argv[0])
@@ -119,7 +214,9 @@ void print_help(const char *name)
 		"--count      Number of times to repeat a test (default: 1000)\n"
 		"--ipv6       Use IPv6 instead of IPv4 (default: IPv4)\n"
 		"--length     Size of messages, in bytes (default: 100)\n"
-		"--seed       Used to compute message contents (default: 12345)\n",
+		"--seed       Used to compute message contents (default: 12345)\n"
+		"--threads    Maximum number of sending threads for sendscale\n"
+		"             (default: 32)\n",
 		name);
 }
 
@@ -151,6 +248,119 @@ void test_close()
 	}
 }
 
+/**
+ * sum_metric() - Read /proc/net/homa_metrics and return the sum of the
+ * values for a given metric across all cores.
+ * @name:     Name of the desired metric.
+ * Return:    The total value of the metric (0 if the file couldn't be read).
+ */
+uint64_t sum_metric(const char *name)
+{
+	char line[500], symbol[100];
+	unsigned long long value;
+	uint64_t total = 0;
+	FILE *f;
+
+	f = fopen("/proc/net/homa_metrics", "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%99s %llu", symbol, &value) != 2)
+			continue;
+		if (strcmp(symbol, name) == 0)
+			total += value;
+	}
+	fclose(f);
+	return total;
+}
+
+/**
+ * set_param() - Modify a Homa sysctl value.
+ * @name:     Name of the parameter.
+ * @value:    New value for the parameter.
+ * Return:    True for success, false if the parameter couldn't be written
+ *            (e.g. because of insufficient privileges).
+ */
+bool set_param(const char *name, int value)
+{
+	char path[200];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/sys/net/homa/%s", name);
+	f = fopen(path, "w");
+	if (f == NULL)
+		return false;
+	fprintf(f, "%d\n", value);
+	return fclose(f) == 0;
+}
+
+/**
+ * test_copyout() - Measure the latency of RPCs with large responses (use
+ * --length 1000000 for 1 MB messages), along with the time between the
+ * arrival of the last packet of each response and the return from recvmsg
+ * (from the copyout_tail_ns metric). The test is run first with helper
+ * workers disabled and then with them enabled (this requires permission to
+ * modify /proc/sys/net/homa/copyout_workers; if that isn't possible the
+ * test is run once with the current configuration).
+ * @fd:       Homa socket.
+ * @dest:     Where to send requests.
+ * @request:  Request message.
+ */
+void test_copyout(int fd, const sockaddr_in_union *dest, char *request)
+{
+	uint64_t *times = new uint64_t[count];
+	uint64_t tail_ns, tails;
+	ssize_t resp_length;
+	bool can_set;
+	int status;
+
+	can_set = set_param("copyout_workers", 0);
+	for (int workers = can_set ? 0 : 1; workers < 2; workers++) {
+		if (can_set && workers)
+			set_param("copyout_workers", 1);
+		tail_ns = sum_metric("copyout_tail_ns");
+		tails = sum_metric("copyout_tails");
+		for (int i = -10; i < count; i++) {
+			uint64_t start = rdtsc();
+
+			status = homa_send(fd, request, length, &dest->sa,
+					sockaddr_size(&dest->sa), NULL, 0);
+			if (status < 0) {
+				printf("Error in homa_send: %s\n",
+						strerror(errno));
+				goto done;
+			}
+			recv_args.id = 0;
+			recv_args.flags = HOMA_RECVMSG_RESPONSE;
+			recv_hdr.msg_controllen = sizeof(recv_args);
+			resp_length = recvmsg(fd, &recv_hdr, 0);
+			if (i >= 0)
+				times[i] = rdtsc() - start;
+			if (resp_length < 0) {
+				printf("Error in recvmsg: %s\n",
+						strerror(errno));
+				goto done;
+			}
+		}
+		tail_ns = sum_metric("copyout_tail_ns") - tail_ns;
+		tails = sum_metric("copyout_tails") - tails;
+		if (can_set)
+			printf("Helper workers %s:\n",
+					workers ? "enabled" : "disabled");
+		print_dist(times, count);
+		if (tails > 0)
+			printf("Last packet to recvmsg return: %.2f usec "
+					"average (%lu messages)\n",
+					1e-03*tail_ns/tails, tails);
+		else
+			printf("No copyout_tail_ns data (messages shorter "
+					"than copyout_min_bytes?)\n");
+	}
+
+done:
+	delete[] times;
+}
+
 /**
  * test_fill_memory() - Send requests to a server, but never read responses;
  * eventually, this will cause memory to fill up.
@@ -421,6 +631,47 @@ void test_send(int fd, const sockaddr_in_union *dest, char *request)
 	}
 }
 
+/**
+ * test_sendscale() - Measure the aggregate rate at which client RPCs can be
+ * created and deleted as the number of sending threads (each with its own
+ * socket) grows from 1 to --threads. Each thread issues --count sends,
+ * aborting each RPC right after sending it, so the server needn't
+ * respond. Run this on kernels with and without a change to compare how
+ * the RPC creation path scales.
+ * @dest:     Where to send requests.
+ * @request:  Request message.
+ */
+void test_sendscale(const sockaddr_in_union *dest, char *request)
+{
+	for (int threads = 1; ; threads *= 2) {
+		std::vector<std::thread> workers;
+		std::atomic<uint64_t> sends(0);
+		std::atomic<bool> go(false);
+		uint64_t start, blocks;
+		double secs;
+
+		if (threads > max_threads)
+			threads = max_threads;
+		for (int i = 0; i < threads; i++)
+			workers.emplace_back(send_abort_loop, dest, request,
+					&go, &sends);
+		blocks = sum_metric("client_id_blocks");
+		start = rdtsc();
+		go = true;
+		for (std::thread &worker: workers)
+			worker.join();
+		secs = to_seconds(rdtsc() - start);
+		blocks = sum_metric("client_id_blocks") - blocks;
+		printf("%3d threads: %8.3f Msends/sec total, %6.2f usec/send "
+				"per thread, %lu id blocks reserved\n",
+				threads, 1e-06*sends/secs,
+				1e06*secs*threads/(sends ? sends.load() : 1),
+				blocks);
+		if (threads >= max_threads)
+			break;
+	}
+}
+
 /**
  * test_set_buf() - Invoke homa_set_buf on a Homa socket.
  * @fd:       Homa socket.
@@ -746,6 +997,96 @@ void test_tcpstream(char *server_name, int port)
 	printf("TCP throughput using %d byte buffers: %.2f GB/sec\n",
 			length, rate*1e-09);
 }
+/**
+ * test_zerocopy() - Measure the CPU cost of sending large requests,
+ * first with normal copying and then with MSG_ZEROCOPY. Note: CPU time
+ * is only measured for this process, so it includes time in sendmsg
+ * (where data is copied) but not work done in other contexts, such
+ * as softirq handlers on other cores.
+ * @fd:       Homa socket.
+ * @dest:     Where to send requests.
+ * @request:  Request message.
+ */
+void test_zerocopy(int fd, const sockaddr_in_union *dest, char *request)
+{
+	struct homa_sendmsg_args args;
+	struct rusage start_usage, end_usage;
+	ssize_t resp_length;
+	struct msghdr hdr;
+	struct iovec vec;
+	uint64_t start;
+
+	for (int zerocopy = 0; zerocopy < 2; zerocopy++) {
+		int completed = 0;
+		int copied = 0;
+
+		getrusage(RUSAGE_SELF, &start_usage);
+		start = rdtsc();
+		for (int i = 0; i < count; i++) {
+			args.id = 0;
+			args.completion_cookie = 0;
+			vec.iov_base = request;
+			vec.iov_len = length;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = (void *) &dest->sa;
+			hdr.msg_namelen = sockaddr_size(&dest->sa);
+			hdr.msg_iov = &vec;
+			hdr.msg_iovlen = 1;
+			hdr.msg_control = &args;
+			hdr.msg_controllen = 0;
+			if (sendmsg(fd, &hdr, zerocopy ? MSG_ZEROCOPY : 0) < 0) {
+				printf("Error in sendmsg: %s\n",
+						strerror(errno));
+				return;
+			}
+			recv_args.id = 0;
+			recv_args.flags = HOMA_RECVMSG_RESPONSE;
+			recv_hdr.msg_controllen = sizeof(recv_args);
+			resp_length = recvmsg(fd, &recv_hdr, 0);
+			if (resp_length < 0) {
+				printf("Error in recvmsg: %s\n",
+						strerror(errno));
+				return;
+			}
+			if (zerocopy)
+				completed += zerocopy_drain(fd, false, &copied);
+		}
+
+		/* Notifications are generated when requests are freed,
+		 * which can happen after the responses have been returned.
+		 */
+		while (zerocopy && (completed < count)) {
+			int new_completions = zerocopy_drain(fd, true, &copied);
+
+			if (new_completions == 0) {
+				printf("Timed out waiting for zero-copy "
+						"notifications\n");
+				break;
+			}
+			completed += new_completions;
+		}
+		double elapsed = to_seconds(rdtsc() - start);
+		getrusage(RUSAGE_SELF, &end_usage);
+
+		double cpu_usecs = 1e06*(end_usage.ru_utime.tv_sec
+				- start_usage.ru_utime.tv_sec
+				+ end_usage.ru_stime.tv_sec
+				- start_usage.ru_stime.tv_sec)
+				+ (end_usage.ru_utime.tv_usec
+				- start_usage.ru_utime.tv_usec
+				+ end_usage.ru_stime.tv_usec
+				- start_usage.ru_stime.tv_usec);
+		double gbytes = 1e-09 * count * length;
+		printf("%-9s %.1f usec CPU per GB sent, %.2f Gbps",
+				zerocopy ? "zerocopy:" : "copy:",
+				cpu_usecs/gbytes, 8*gbytes/elapsed);
+		if (zerocopy)
+			printf(", %d/%d sends completed (%d copied)",
+					completed, count, copied);
+		printf("\n");
+	}
+}
+
 /**
  * test_tmp() - Placeholder for temporary tests used for debugging, etc.
  * @fd:     Fd for Homa socket.
@@ -886,6 +1227,16 @@ int main(int argc, char** argv)
 			next_arg++;
 			seed = get_int(argv[next_arg],
 				"Bad seed %s; must be positive integer\n");
+		} else if (strcmp(argv[next_arg], "--threads") == 0) {
+			if (next_arg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[next_arg]);
+				exit(1);
+			}
+			next_arg++;
+			max_threads = get_int(argv[next_arg],
+				"Bad thread count %s; must be positive "
+				"integer\n");
 		} else {
 			printf("Unknown option %s; type '%s --help' for help\n",
 				argv[next_arg], argv[0]);
@@ -949,6 +1300,8 @@ int main(int argc, char** argv)
 	for ( ; next_arg < argc; next_arg++) {
 		if (strcmp(argv[next_arg], "close") == 0) {
 			test_close();
+		} else if (strcmp(argv[next_arg], "copyout") == 0) {
+			test_copyout(fd, &dest, buffer);
 		} else if (strcmp(argv[next_arg], "fill_memory") == 0) {
 			test_fill_memory(fd, &dest, buffer);
 		} else if (strcmp(argv[next_arg], "invoke") == 0) {
@@ -959,6 +1312,8 @@ int main(int argc, char** argv)
 			test_poll(fd, buffer);
 		} else if (strcmp(argv[next_arg], "send") == 0) {
 			test_send(fd, &dest, buffer);
+		} else if (strcmp(argv[next_arg], "sendscale") == 0) {
+			test_sendscale(&dest, buffer);
 		} else if (strcmp(argv[next_arg], "read") == 0) {
 			test_read(fd, count);
 		} else if (strcmp(argv[next_arg], "rtt") == 0) {
@@ -977,6 +1332,8 @@ int main(int argc, char** argv)
 			test_tmp(fd, count);
 		} else if (strcmp(argv[next_arg], "udpclose") == 0) {
 			test_udpclose();
+		} else if (strcmp(argv[next_arg], "zerocopy") == 0) {
+			test_zerocopy(fd, &dest, buffer);
 		} else {
 			printf("Unknown operation '%s'\n", argv[next_arg]);
 			exit(1);
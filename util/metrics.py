@@ -11,6 +11,11 @@ Usage: metrics.py [file]
 If file is specified, it gives the name of a file in which this program
 saves current metrics each time it is run, so that the next run can determine
 what has changed. File defaults to ~/.homa_metrics.
+
+If /proc/net/homa_metrics_bin exists, metrics are read from it in binary
+form (much cheaper for the kernel to produce) and the saved file will
+also be binary; in this case there is no documentation for individual
+metrics.
 """
 
 from __future__ import division, print_function
@@ -22,6 +27,8 @@ import re
 import string
 import sys
 
+import metrics_bin
+
 # Both prev and cur below are arrays of dictionaries: each element of
 # the array stores information for one core in the form of a dictionary,
 # where keys are metric names and values are metric values.
@@ -39,6 +46,23 @@ deltas = {}
 # Maps from metric name to the documentation for that metric.
 docs = {}
 
+def read_binary_metrics(data):
+    """
+    Parse the contents of /proc/net/homa_metrics_bin, passed as "data"
+    (bytes) and return a data structure in the format described above
+    for "prev". Metric names are the same as in /proc/net/homa_metrics.
+    The binary format has no documentation for metrics, so docs are empty.
+    """
+
+    global symbols, docs
+    time_ns, names, metrics = metrics_bin.read_binary(data)
+    symbols.append("time_ns")
+    symbols.extend(names)
+    for symbol in symbols:
+        docs[symbol] = ""
+    metrics[0]["time_ns"] = time_ns
+    return metrics
+
 # Read in metrics, parse the results for internal use, and, optionally
 # copy the raw metrics to an output file. Also reinitialize symbols
 
@@ -47,19 +71,25 @@ def read_metrics(metrics_file, out):
     Read metrics from the file whose name is "metrics_file" and generate
     a data structure in the format described above for "prev". In
     addition, if out is not None, write the raw metrics to that file.
-    Returns the parsed metrics.
+    Returns the parsed metrics. The file may be in either the text
+    format of /proc/net/homa_metrics or the binary format of
+    /proc/net/homa_metrics_bin.
     """
 
     global symbols, docs
     symbols.clear()
+    f = open(metrics_file, "rb")
+    data = f.read()
+    f.close()
+    if out:
+        out.write(data)
+    if metrics_bin.is_binary(data):
+        return read_binary_metrics(data)
+
     metrics = []
     metrics.append({})
     core = 0
-    f = open(metrics_file)
-    for line in f:
-        if out:
-            out.write(line)
-
+    for line in data.decode().splitlines(True):
         match = re.match('^([^ ]*) *([0-9]+) *(.*)', line)
         if not match:
             print("Ignoring bogus line in metrics file %s: %s" %
@@ -77,9 +107,53 @@ def read_metrics(metrics_file, out):
             symbols.append(symbol)
             docs[symbol] = doc
         metrics[core][symbol] = count
-    f.close()
     return metrics
 
+# Must match HOMA_LATENCY_BUCKETS and HOMA_LATENCY_SUB_BITS in homa_metrics.h.
+LATENCY_BUCKETS = 64
+LATENCY_SUB_BITS = 2
+
+# Names of the latency histograms in the metrics, with descriptions.
+latency_histograms = [
+    ["lat_send_first_pkt", "Sendmsg to first request packet"],
+    ["lat_first_grant", "First packet to first grant"],
+    ["lat_complete_to_recv", "Last byte received to recvmsg"],
+    ["lat_handoff_to_recv", "Handoff to recvmsg"],
+    ["lat_server_service", "Server in-service time"]]
+
+def latency_bucket_start(bucket):
+    """
+    Returns the smallest latency (in ns) counted in a given bucket of
+    a kernel latency histogram (same as homa_latency_bucket_start).
+    """
+    octave = bucket >> LATENCY_SUB_BITS
+    sub = bucket & ((1 << LATENCY_SUB_BITS) - 1)
+    if octave == 0:
+        return sub << 8
+    return ((1 << LATENCY_SUB_BITS) + sub) << (octave + 7)
+
+def latency_percentile(name, fraction):
+    """
+    Returns the approximate latency (in ns) at a given percentile
+    (fraction between 0 and 1) of the changes in the latency histogram
+    with a given name (from latency_histograms), or None if the
+    histogram is empty. The result is the upper end of the bucket
+    containing the percentile.
+    """
+    counts = [deltas["%s_%d" % (name, i)] for i in range(LATENCY_BUCKETS)]
+    total = sum(counts)
+    if total == 0:
+        return None
+    target = fraction * total
+    cumulative = 0
+    for i in range(LATENCY_BUCKETS):
+        cumulative += counts[i]
+        if cumulative >= target:
+            break
+    if i == LATENCY_BUCKETS - 1:
+        return latency_bucket_start(i)
+    return latency_bucket_start(i + 1)
+
 def scale_number(number):
     """
     Return a string describing a number, but with a "K", "M", or "G"
@@ -107,8 +181,11 @@ try:
 except IOError:
     prev = []
     pass
-data = open(data_file, "w")
-cur = read_metrics("/proc/net/homa_metrics", data)
+data = open(data_file, "wb")
+if os.path.exists("/proc/net/homa_metrics_bin"):
+    cur = read_metrics("/proc/net/homa_metrics_bin", data)
+else:
+    cur = read_metrics("/proc/net/homa_metrics", data)
 data.close()
 num_cores = len(cur)
 
@@ -354,7 +431,8 @@ if elapsed_secs != 0:
     print("\nLock Misses:")
     print("------------")
     print("            Misses/sec.  ns/Miss   %CPU")
-    for lock in ["client", "server", "socket", "grantable", "throttle", "peer_ack"]:
+    for lock in ["client", "server", "socket", "shard", "grantable",
+            "throttle", "peer_ack"]:
         misses = float(deltas[lock + "_lock_misses"])
         ns = float(deltas[lock + "_lock_miss_ns"])
         if misses == 0:
@@ -365,6 +443,11 @@ if elapsed_secs != 0:
                 scale_number(misses/elapsed_secs),
                 ns_per_miss, 100.0*ns/time_delta))
 
+    print("\nSocket lock wait by operation (%CPU):")
+    for op in ["recv", "handoff", "free", "bufs", "protect", "control"]:
+        ns = float(deltas["socket_lock_ns_" + op])
+        print("%-10s    %5.1f" % (op, 100.0*ns/time_delta))
+
     total_messages = float(deltas["requests_received"]
             + deltas["responses_received"])
     if total_messages > 0.0:
@@ -401,6 +484,21 @@ if elapsed_secs != 0:
         print("GRO bypass for data packets:  %5.1f%%" % (data_bypass_percent))
         print("GRO bypass for grant packets: %5.1f%%" % (grant_bypass_percent))
 
+    if ("lat_send_first_pkt_0" in deltas):
+        print("\nLatency percentiles (us, upper bucket bounds):")
+        print("---------------------------------------------")
+        print("%-32s %8s %8s %8s %8s" % ("", "Count", "P50", "P99",
+                "P99.9"))
+        for name, desc in latency_histograms:
+            count = sum(deltas["%s_%d" % (name, i)]
+                    for i in range(LATENCY_BUCKETS))
+            if count == 0:
+                continue
+            print("%-32s %8d %8.1f %8.1f %8.1f" % (desc, count,
+                    latency_percentile(name, 0.5)*1e-3,
+                    latency_percentile(name, 0.99)*1e-3,
+                    latency_percentile(name, 0.999)*1e-3))
+
     print("\nMiscellaneous:")
     print("--------------")
     if packets_received > 0:
@@ -433,6 +531,20 @@ if elapsed_secs != 0:
         print("Skb page alloc time:  %5.2f  usec/skb" % (
                 float(deltas["skb_page_alloc_ns"]) / 1000 /
                 deltas["skb_page_allocs"]))
+    if "skb_cache_hits" in deltas:
+        calls = deltas["skb_cache_hits"] + deltas["skb_cache_misses"]
+    else:
+        calls = 0
+    if calls != 0:
+        print("Skb cache hit rate:   %5.1f  %%" % (
+                100.0 * deltas["skb_cache_hits"] / calls))
+    if "rpc_cache_hits" in deltas:
+        calls = deltas["rpc_cache_hits"] + deltas["rpc_cache_misses"]
+    else:
+        calls = 0
+    if calls != 0:
+        print("RPC cache hit rate:   %5.1f  %%" % (
+                100.0 * deltas["rpc_cache_hits"] / calls))
     if deltas["grant_recalc_calls"] != 0:
         print("homa_grant_recalc:    %5.2f  usec/call" % (
                 float(deltas["grant_recalc_ns"]) / 1000 /
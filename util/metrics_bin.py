@@ -0,0 +1,102 @@
+#!/usr/bin/python3
+
+# Copyright (c) 2025 Homa Developers
+# SPDX-License-Identifier: BSD-1-Clause
+
+# This file contains library functions for reading the binary form of
+# Homa's metrics (/proc/net/homa_metrics_bin, see struct homa_metrics_hdr
+# in homa.h); they are shared by metrics.py and diff_metrics.py. Counters
+# are given the same names as in the text form (/proc/net/homa_metrics).
+
+import struct
+
+# Must match HOMA_METRICS_MAGIC and struct homa_metrics_hdr in homa.h.
+HOMA_METRICS_MAGIC = 0x484d4554
+HOMA_METRICS_HDR = struct.Struct("<IIQIIIIII")
+
+# Packet types, in the order used for the packets_sent and packets_received
+# arrays in struct homa_metrics.
+packet_types = ["DATA", "GRANT", "RESEND", "UNKNOWN", "BUSY", "CUTOFFS",
+        "FREEZE", "NEED_ACK", "ACK"]
+
+# Operations for the socket_lock_op_ns array in struct homa_metrics.
+lock_ops = ["recv", "handoff", "free", "bufs", "protect", "control"]
+
+def legacy_names(field, count):
+    """
+    Returns a list of the names used in /proc/net/homa_metrics for the
+    counters in the field of struct homa_metrics named "field" (which
+    contains "count" counters). None in the result means the counter
+    isn't output in the text format.
+    """
+
+    if count == 1:
+        return [field]
+    if field == "small_msg_bytes":
+        return ["msg_bytes_%d" % ((i+1)*64) for i in range(count)]
+    if field == "medium_msg_bytes":
+        return [None if i < 4 else "msg_bytes_%d" % ((i+1)*1024)
+                for i in range(count)]
+    if field == "packets_sent":
+        return ["packets_sent_" + t for t in packet_types[0:count]]
+    if field == "packets_received":
+        return ["packets_rcvd_" + t for t in packet_types[0:count]]
+    if field == "priority_bytes":
+        return ["priority%d_bytes" % (i) for i in range(count)]
+    if field == "priority_packets":
+        return ["priority%d_packets" % (i) for i in range(count)]
+    if field == "socket_lock_op_ns":
+        return ["socket_lock_ns_" + op for op in lock_ops[0:count]]
+    if field.endswith("_ns"):
+        # handoff_polled_ns etc.
+        return ["%s_%d" % (field[:-3], i) for i in range(count)]
+    return ["%s%d" % (field, i) for i in range(count)]
+
+def is_binary(data):
+    """
+    Returns True if "data" (bytes read from a metrics file) is in the
+    format of /proc/net/homa_metrics_bin, False if it is text.
+    """
+
+    return ((len(data) >= HOMA_METRICS_HDR.size) and
+            (struct.unpack_from("<I", data)[0] == HOMA_METRICS_MAGIC))
+
+def read_binary(data):
+    """
+    Parse the contents of /proc/net/homa_metrics_bin, passed as "data"
+    (bytes). Returns a tuple (time_ns, symbols, cores), where time_ns is
+    the time when the metrics were gathered, symbols is a list of metric
+    names in the order used by /proc/net/homa_metrics, and cores is a list
+    with one dictionary for each core, mapping from metric name to value.
+    As in the text file, recv_ns excludes blocked_ns and homa_ns is the
+    total time spent in Homa.
+    """
+
+    (magic, version, time_ns, num_cores, num_counters, schema_offset,
+            schema_length, data_offset, _) = HOMA_METRICS_HDR.unpack_from(data)
+    names = []
+    schema = data[schema_offset:schema_offset+schema_length].decode()
+    for line in schema.splitlines():
+        field, count = line.split()
+        names.extend(legacy_names(field, int(count)))
+    if len(names) != num_counters:
+        raise ValueError("Homa metrics schema describes %d counters, "
+                "header says %d" % (len(names), num_counters))
+    symbols = [name for name in names if name != None]
+    symbols.append("homa_ns")
+
+    cores = []
+    counters = struct.Struct("<%dQ" % (num_counters))
+    for core in range(num_cores):
+        values = counters.unpack_from(data, data_offset
+                + core*counters.size)
+        m = {}
+        for name, value in zip(names, values):
+            if name != None:
+                m[name] = value
+        m["recv_ns"] = max(0, m["recv_ns"] - m["blocked_ns"])
+        m["homa_ns"] = (m["softirq_ns"] + m["napi_ns"] + m["send_ns"]
+                + m["recv_ns"] + m["reply_ns"] + m["timer_ns"]
+                + m["pacer_ns"])
+        cores.append(m)
+    return (time_ns, symbols, cores)
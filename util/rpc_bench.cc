@@ -0,0 +1,953 @@
+/* Copyright (c) 2025 Homa Developers
+ * SPDX-License-Identifier: BSD-1-Clause
+ */
+
+/* This program is a self-contained RPC benchmark that can run both the
+ * client and the server on a single machine (over loopback), or run them
+ * separately (e.g., in two network namespaces). It measures Homa with
+ * unconnected sockets ("homa"), Homa with connected sockets ("homa_conn",
+ * using connect/homa_send_connected on clients and homa_peeloff/
+ * homa_reply_connected on servers), and TCP. Request lengths are drawn
+ * from one of the workloads in dist.cc. For each protocol, the benchmark
+ * sweeps a list of concurrency levels (number of client threads, each with
+ * one outstanding RPC at a time) and prints one line of results for each
+ * level, in CSV or JSON form, containing throughput and P50/P99/P999
+ * latency.
+ *
+ * Usage:
+ * rpc_bench [options]
+ *
+ * Type "rpc_bench --help" for documentation on the options.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dist.h"
+#include "homa.h"
+#include "homa_receiver.h"
+#include "test_utils.h"
+
+/**
+ * struct bench_header - Every request and response begins with one of
+ * these. The server uses it to determine how long the response should be;
+ * TCP also uses it to find message boundaries.
+ */
+struct bench_header {
+	/** @length: Total length of this message, in bytes. */
+	int32_t length;
+
+	/** @response_length: Number of bytes in the response message. */
+	int32_t response_length;
+};
+
+/* Value of bench_header.response_length in the last request sent by a
+ * homa_conn client before it closes its socket: it tells the server to
+ * close the socket it peeled off for that client.
+ */
+#define BENCH_CLOSE -1
+
+/* Number of bpages to allocate for each Homa socket's receive buffers. */
+int buf_bpages = 1000;
+
+/* Comma-separated list of concurrency levels to sweep. */
+const char *concurrency = "1,4,16,64";
+
+/* Number of threads to service each connected socket (homa_conn). */
+int conn_threads = 1;
+
+/* Output format: "csv" or "json". */
+const char *format = "csv";
+
+/* Either AF_INET or AF_INET6: indicates whether to use IPv6 instead of IPv4. */
+int inet_family = AF_INET;
+
+/* What to run: "both" (client and server), "client", or "server". */
+const char *mode = "both";
+
+/* True means all responses are 100 bytes; false means they are the same
+ * length as their requests.
+ */
+bool one_way = false;
+
+/* Base port number; see protocol_port(). */
+int port = 4100;
+
+/* Comma-separated list of protocols to measure. */
+const char *protocols = "homa,homa_conn,tcp";
+
+/* Number of seconds to measure at each concurrency level. */
+double seconds = 2.0;
+
+/* Host name or address of the server; NULL means loopback. */
+const char *server_name = NULL;
+
+/* Number of threads servicing each server port. */
+int server_threads = 4;
+
+/* Seconds to run at each concurrency level before measuring. */
+double warmup = 0.5;
+
+/* Name of workload from dist.cc, or an integer fixed message length. */
+const char *workload = "w3";
+
+/* Address of the server (port number not filled in). */
+sockaddr_in_union server_addr;
+
+/**
+ * print_help() - Print out usage information for this program.
+ * @name:   Name of the program (argv[0])
+ */
+void print_help(const char *name)
+{
+	printf("Usage: %s [options]\n\n"
+		"Runs a closed-loop RPC benchmark for Homa, connected Homa, and TCP,\n"
+		"printing throughput and latency for each protocol and concurrency\n"
+		"level. The following options are supported:\n\n", name);
+	printf("--buf-bpages    Number of bpages in each Homa socket's buffer pool\n"
+		"                (default: %d)\n", buf_bpages);
+	printf("--concurrency   Comma-separated list of numbers of client threads\n"
+		"                (each with one outstanding RPC) (default: %s)\n",
+		concurrency);
+	printf("--conn-threads  Number of server threads for each connected socket\n"
+		"                peeled off by the homa_conn server (default: %d)\n",
+		conn_threads);
+	printf("--format        Output format: csv or json (one object per line)\n"
+		"                (default: %s)\n", format);
+	printf("--help          Print this message and exit\n");
+	printf("--ipv6          Use IPv6 instead of IPv4\n");
+	printf("--mode          both (client and server in this process), client,\n"
+		"                or server (runs until killed) (default: %s)\n",
+		mode);
+	printf("--one-way       Make all responses 100 bytes, instead of the same\n"
+		"                length as requests\n");
+	printf("--port          Base port number: homa uses this Homa port,\n"
+		"                homa_conn the next one, and tcp this TCP port\n"
+		"                (default: %d)\n", port);
+	printf("--protocols     Comma-separated list of protocols to measure, from\n"
+		"                homa, homa_conn, and tcp (default: %s)\n",
+		protocols);
+	printf("--seconds       Length of each measurement (default: %.1f)\n",
+		seconds);
+	printf("--server        Host name or address of the server (default:\n"
+		"                loopback)\n");
+	printf("--server-threads Number of threads servicing each server port\n"
+		"                (default: %d)\n", server_threads);
+	printf("--warmup        Seconds to run before each measurement (default:\n"
+		"                %.1f)\n", warmup);
+	printf("--workload      Name of distribution for request lengths (e.g.,\n"
+		"                'w1') or integer for fixed length (default: %s)\n",
+		workload);
+}
+
+/**
+ * protocol_port() - Returns the port number to use for a given protocol.
+ * @protocol:   "homa", "homa_conn", or "tcp".
+ */
+int protocol_port(const std::string &protocol)
+{
+	if (protocol == "homa_conn")
+		return port + 1;
+	return port;
+}
+
+/**
+ * homa_set_buffers() - Allocate a receive buffer region for a Homa socket.
+ * @fd:       Homa socket.
+ * @region:   The address of the buffer region is stored here.
+ */
+void homa_set_buffers(int fd, char **region)
+{
+	struct homa_rcvbuf_args arg;
+
+	*region = (char *) mmap(NULL, buf_bpages*HOMA_BPAGE_SIZE,
+			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (*region == MAP_FAILED) {
+		fprintf(stderr, "Couldn't mmap buffer region: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+	arg.start = *region;
+	arg.length = buf_bpages*HOMA_BPAGE_SIZE;
+	if (setsockopt(fd, IPPROTO_HOMA, SO_HOMA_RCVBUF, &arg,
+			sizeof(arg)) < 0) {
+		fprintf(stderr, "Error in setsockopt(SO_HOMA_RCVBUF): %s\n",
+				strerror(errno));
+		exit(1);
+	}
+}
+
+/**
+ * homa_socket() - Open a Homa socket and set up its receive buffers.
+ * @region:   The address of the buffer region is stored here.
+ * Return:    The file descriptor for the new socket.
+ */
+int homa_socket(char **region)
+{
+	int fd;
+
+	fd = socket(inet_family, SOCK_DGRAM, IPPROTO_HOMA);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open Homa socket: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+	homa_set_buffers(fd, region);
+	return fd;
+}
+
+/**
+ * bind_port() - Bind a socket to a given port on all local addresses.
+ * @fd:      Socket to bind.
+ * @port:    Port number.
+ */
+void bind_port(int fd, int port)
+{
+	sockaddr_in_union addr;
+
+	memset(&addr, 0, sizeof(addr));
+	if (inet_family == AF_INET) {
+		addr.in4.sin_family = AF_INET;
+		addr.in4.sin_port = htons(port);
+	} else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(port);
+	}
+	if (bind(fd, &addr.sa, sockaddr_size(&addr.sa)) != 0) {
+		fprintf(stderr, "Couldn't bind socket to port %d: %s\n", port,
+				strerror(errno));
+		exit(1);
+	}
+}
+
+/**
+ * response_length() - Returns the response length requested by an
+ * incoming message.
+ * @receiver:   Holds the request.
+ */
+int response_length(homa::receiver *receiver)
+{
+	bench_header storage;
+	bench_header *header = receiver->get<bench_header>(0, &storage);
+
+	if ((header == nullptr)
+			|| (header->response_length < sizeof32(*header)))
+		return sizeof32(*header);
+	if (header->response_length > HOMA_MAX_MESSAGE_LENGTH)
+		return HOMA_MAX_MESSAGE_LENGTH;
+	return header->response_length;
+}
+
+/**
+ * struct homa_conn - Information shared by the threads servicing a
+ * connected socket peeled off by the homa_conn server.
+ */
+struct homa_conn {
+	/** @fd: The connected socket. */
+	int fd;
+
+	/** @region: Receive buffer region for @fd. */
+	char *region;
+
+	/**
+	 * @threads: Number of threads still servicing @fd; the last one
+	 * to exit closes the socket and frees the region.
+	 */
+	std::atomic<int> threads;
+};
+
+void homa_server_thread(int fd, char *region, bool connected,
+		int peeloff_fd);
+
+/**
+ * homa_conn_thread() - Top-level function for a thread servicing a
+ * connected socket peeled off by the homa_conn server; returns once the
+ * client has closed.
+ * @conn:   Describes the socket; the last thread to exit frees it.
+ */
+void homa_conn_thread(homa_conn *conn)
+{
+	homa_server_thread(conn->fd, conn->region, true, -1);
+	if (conn->threads.fetch_sub(1) == 1) {
+		close(conn->fd);
+		munmap(conn->region, buf_bpages*HOMA_BPAGE_SIZE);
+		delete conn;
+	}
+}
+
+/**
+ * @peeloff_mutex: serializes peeloffs, so that the kernel's EISCONN check
+ * is reliable when several requests from a new client arrive on the
+ * listening socket.
+ */
+std::mutex peeloff_mutex;
+
+/**
+ * homa_peeloff_client() - Create a connected socket for a client (unless
+ * one already exists) and start threads to service it. The socket is
+ * closed when the client sends a BENCH_CLOSE request.
+ * @fd:        Listening socket.
+ * @client:    Address of the client.
+ */
+void homa_peeloff_client(int fd, const struct sockaddr *client)
+{
+	std::lock_guard<std::mutex> lock(peeloff_mutex);
+	sockaddr_in_union addr;
+	homa_conn *conn;
+	int conn_fd;
+
+	memcpy(&addr, client, sockaddr_size(client));
+	conn_fd = homa_peeloff(fd, &addr.sa, sockaddr_size(&addr.sa));
+	if (conn_fd < 0) {
+		if (errno == EISCONN)
+			return;
+		fprintf(stderr, "homa_peeloff failed for %s: %s\n",
+				print_address(&addr), strerror(errno));
+		exit(1);
+	}
+	conn = new homa_conn;
+	conn->fd = conn_fd;
+	homa_set_buffers(conn_fd, &conn->region);
+	conn->threads = conn_threads;
+	for (int i = 0; i < conn_threads; i++) {
+		std::thread thread(homa_conn_thread, conn);
+		thread.detach();
+	}
+}
+
+/**
+ * homa_server_thread() - Handles requests arriving on a Homa socket.
+ * Returns only if @fd is connected and its client has closed (or if
+ * recvmsg fails).
+ * @fd:          Homa socket (connected or not).
+ * @region:      Receive buffer region for @fd.
+ * @connected:   True means @fd is connected (use homa_reply_connected).
+ * @peeloff_fd:  If >= 0, this is an unconnected listening socket: before
+ *               replying to a request, peel off a connected socket for
+ *               the client, if that hasn't already been done. Peeling
+ *               off first ensures that the client's later requests,
+ *               including BENCH_CLOSE, arrive on the connected socket.
+ */
+void homa_server_thread(int fd, char *region, bool connected,
+		int peeloff_fd)
+{
+	std::vector<char> response(HOMA_MAX_MESSAGE_LENGTH);
+	homa::receiver receiver(fd, region);
+	bench_header *header;
+	bench_header storage;
+	bool closing;
+	uint64_t id;
+	int length;
+	int result;
+
+	while (1) {
+		if (receiver.receive(HOMA_RECVMSG_REQUEST, 0) < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			if (connected && (errno == ESHUTDOWN))
+				return;
+			fprintf(stderr, "Homa recvmsg failed: %s\n",
+					strerror(errno));
+			return;
+		}
+		header = receiver.get<bench_header>(0, &storage);
+		closing = (header != nullptr)
+				&& (header->response_length == BENCH_CLOSE);
+		if ((peeloff_fd >= 0) && !closing)
+			homa_peeloff_client(peeloff_fd, receiver.src_addr());
+		length = response_length(&receiver);
+		header = reinterpret_cast<bench_header *>(response.data());
+		header->length = length;
+		header->response_length = 0;
+		id = receiver.id();
+		if (connected)
+			result = homa_reply_connected(fd, response.data(),
+					length, id);
+		else
+			result = homa_reply(fd, response.data(), length,
+					receiver.src_addr(),
+					sockaddr_size(receiver.src_addr()), id);
+		if (result < 0) {
+			fprintf(stderr, "Homa reply failed: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		if (closing && connected) {
+			/* Wake up the other threads servicing this socket. */
+			shutdown(fd, SHUT_RDWR);
+			return;
+		}
+	}
+}
+
+/**
+ * read_fully() - Read a given number of bytes from a TCP socket.
+ * @fd:       Socket to read from.
+ * @buffer:   Where to store the data.
+ * @length:   Number of bytes to read.
+ * Return:    True for success, false if the connection was closed.
+ */
+bool read_fully(int fd, char *buffer, int length)
+{
+	while (length > 0) {
+		ssize_t count = read(fd, buffer, length);
+
+		if (count <= 0) {
+			if ((count < 0) && (errno == EINTR))
+				continue;
+			return false;
+		}
+		buffer += count;
+		length -= count;
+	}
+	return true;
+}
+
+/**
+ * write_fully() - Write a given number of bytes to a TCP socket.
+ * @fd:       Socket to write to.
+ * @buffer:   Data to write.
+ * @length:   Number of bytes to write.
+ * Return:    True for success, false if the connection failed.
+ */
+bool write_fully(int fd, const char *buffer, int length)
+{
+	while (length > 0) {
+		ssize_t count = write(fd, buffer, length);
+
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buffer += count;
+		length -= count;
+	}
+	return true;
+}
+
+/**
+ * tcp_server_connection() - Handles requests arriving on a TCP connection
+ * until the connection is closed.
+ * @fd:   The connection.
+ */
+void tcp_server_connection(int fd)
+{
+	std::vector<char> buffer(HOMA_MAX_MESSAGE_LENGTH);
+	bench_header *header = reinterpret_cast<bench_header *>(buffer.data());
+	int flag = 1;
+	int length;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	while (1) {
+		if (!read_fully(fd, buffer.data(), sizeof32(*header)))
+			break;
+		if ((header->length < sizeof32(*header))
+				|| (header->length > HOMA_MAX_MESSAGE_LENGTH)) {
+			fprintf(stderr, "Bad TCP request length %d\n",
+					header->length);
+			break;
+		}
+		if (!read_fully(fd, buffer.data() + sizeof(*header),
+				header->length - sizeof32(*header)))
+			break;
+		length = header->response_length;
+		if (length < sizeof32(*header))
+			length = sizeof32(*header);
+		if (length > HOMA_MAX_MESSAGE_LENGTH)
+			length = HOMA_MAX_MESSAGE_LENGTH;
+		header->length = length;
+		header->response_length = 0;
+		if (!write_fully(fd, buffer.data(), length))
+			break;
+	}
+	close(fd);
+}
+
+/**
+ * tcp_server_thread() - Accepts connections on a TCP listen socket and
+ * starts a thread to handle each one; never returns.
+ * @listen_fd:   Socket on which to accept connections.
+ */
+void tcp_server_thread(int listen_fd)
+{
+	while (1) {
+		int fd = accept(listen_fd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Couldn't accept TCP connection: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		std::thread thread(tcp_server_connection, fd);
+		thread.detach();
+	}
+}
+
+/**
+ * start_server() - Open the server socket for a protocol and start
+ * threads to service it. When this function returns, the server is ready
+ * to accept requests.
+ * @protocol:   "homa", "homa_conn", or "tcp".
+ */
+void start_server(const std::string &protocol)
+{
+	char *region;
+	int fd;
+
+	if (protocol == "tcp") {
+		int option_value = 1;
+
+		fd = socket(inet_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			fprintf(stderr, "Couldn't open TCP socket: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option_value,
+				sizeof(option_value));
+		bind_port(fd, protocol_port(protocol));
+		if (listen(fd, 1000) != 0) {
+			fprintf(stderr, "Couldn't listen on TCP socket: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		std::thread thread(tcp_server_thread, fd);
+		thread.detach();
+		return;
+	}
+
+	fd = homa_socket(&region);
+	bind_port(fd, protocol_port(protocol));
+	for (int i = 0; i < server_threads; i++) {
+		std::thread thread(homa_server_thread, fd, region, false,
+				(protocol == "homa_conn") ? fd : -1);
+		thread.detach();
+	}
+}
+
+/**
+ * struct client_config - Information shared by all of the client threads
+ * in one measurement.
+ */
+struct client_config {
+	/** @protocol: "homa", "homa_conn", or "tcp". */
+	std::string protocol;
+
+	/** @dest: Server address, including port. */
+	sockaddr_in_union dest;
+
+	/**
+	 * @measure_start: rdtsc time when measurement begins; RPCs that
+	 * start before this are not recorded.
+	 */
+	uint64_t measure_start;
+
+	/**
+	 * @measure_end: rdtsc time when measurement ends; no new RPCs are
+	 * started after this, and RPCs that end after it are not recorded.
+	 */
+	uint64_t measure_end;
+};
+
+/**
+ * struct client_results - Measurements gathered by one client thread.
+ */
+struct client_results {
+	/** @rtts: Round-trip times (rdtsc cycles) of all recorded RPCs. */
+	std::vector<uint64_t> rtts;
+
+	/** @bytes: Total request and response bytes in recorded RPCs. */
+	uint64_t bytes;
+
+	client_results() : rtts(), bytes(0) {}
+};
+
+/**
+ * client_thread() - Top-level function for a client thread: issues RPCs
+ * one at a time until the end of the measurement interval.
+ * @config:    Parameters for the measurement.
+ * @seed:      Seed for this thread's random number generator.
+ * @results:   Measurements are recorded here.
+ */
+void client_thread(const client_config *config, int seed,
+		client_results *results)
+{
+	std::vector<char> buffer(HOMA_MAX_MESSAGE_LENGTH);
+	bench_header *header = reinterpret_cast<bench_header *>(buffer.data());
+	dist_point_gen length_dist(workload, HOMA_MAX_MESSAGE_LENGTH);
+	const struct sockaddr *dest = &config->dest.sa;
+	std::mt19937 rand_gen(seed);
+	char *region = NULL;
+	int fd;
+
+	if (config->protocol == "tcp") {
+		int flag = 1;
+
+		fd = socket(inet_family, SOCK_STREAM, 0);
+		if ((fd < 0) || (connect(fd, dest, sockaddr_size(dest)) != 0)) {
+			fprintf(stderr, "Couldn't open TCP connection to %s: "
+					"%s\n", print_address(&config->dest),
+					strerror(errno));
+			exit(1);
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	} else {
+		fd = homa_socket(&region);
+		if ((config->protocol == "homa_conn")
+				&& (connect(fd, dest, sockaddr_size(dest)) != 0)) {
+			fprintf(stderr, "Couldn't connect Homa socket to %s: "
+					"%s\n", print_address(&config->dest),
+					strerror(errno));
+			exit(1);
+		}
+	}
+
+	{
+		homa::receiver receiver(fd, region);
+
+		while (1) {
+			uint64_t start, end, id;
+			int length, status;
+
+			start = rdtsc();
+			if (start >= config->measure_end)
+				break;
+			length = length_dist(rand_gen);
+			if (length < sizeof32(*header))
+				length = sizeof32(*header);
+			if (length > HOMA_MAX_MESSAGE_LENGTH)
+				length = HOMA_MAX_MESSAGE_LENGTH;
+			header->length = length;
+			header->response_length = one_way ? 100 : length;
+			if (header->response_length < sizeof32(*header))
+				header->response_length = sizeof32(*header);
+
+			if (config->protocol == "tcp") {
+				if (!write_fully(fd, buffer.data(), length)
+						|| !read_fully(fd, buffer.data(),
+						header->response_length)) {
+					fprintf(stderr, "TCP RPC failed: %s\n",
+							strerror(errno));
+					exit(1);
+				}
+				status = header->length;
+			} else {
+				if (config->protocol == "homa_conn") {
+					status = homa_send_connected(fd,
+							buffer.data(), length,
+							0);
+					id = 0;
+				} else {
+					status = homa_send(fd, buffer.data(),
+							length, dest,
+							sockaddr_size(dest),
+							&id, 0);
+				}
+				if (status < 0) {
+					fprintf(stderr, "Homa send failed: %s\n",
+							strerror(errno));
+					exit(1);
+				}
+				do {
+					status = receiver.receive(
+							HOMA_RECVMSG_RESPONSE,
+							id);
+				} while ((status < 0) && ((errno == EINTR)
+						|| (errno == EAGAIN)));
+				if (status < 0) {
+					fprintf(stderr, "Homa recvmsg failed: "
+							"%s\n", strerror(errno));
+					exit(1);
+				}
+			}
+			end = rdtsc();
+			if ((start >= config->measure_start)
+					&& (end <= config->measure_end)) {
+				results->rtts.push_back(end - start);
+				results->bytes += length + status;
+			}
+		}
+
+		if (config->protocol == "homa_conn") {
+			int status;
+
+			/* Let the server close its socket for this client. */
+			header->length = sizeof32(*header);
+			header->response_length = BENCH_CLOSE;
+			if (homa_send_connected(fd, buffer.data(),
+					header->length, 0) < 0) {
+				fprintf(stderr, "Homa send failed: %s\n",
+						strerror(errno));
+				exit(1);
+			}
+			do {
+				status = receiver.receive(
+						HOMA_RECVMSG_RESPONSE, 0);
+			} while ((status < 0) && ((errno == EINTR)
+					|| (errno == EAGAIN)));
+		}
+	}
+	close(fd);
+	if (region)
+		munmap(region, buf_bpages*HOMA_BPAGE_SIZE);
+}
+
+/**
+ * percentile() - Return a given percentile from a sorted list of times,
+ * in microseconds.
+ * @rtts:        Round-trip times in rdtsc cycles, in increasing order.
+ * @fraction:    Desired percentile (e.g. 0.99).
+ */
+double percentile(const std::vector<uint64_t> &rtts, double fraction)
+{
+	if (rtts.empty())
+		return 0.0;
+	return 1e06*to_seconds(rtts[static_cast<size_t>(
+			fraction*(rtts.size() - 1))]);
+}
+
+/**
+ * measure() - Run one measurement and print its results.
+ * @protocol:     Protocol to measure.
+ * @num_threads:  Number of client threads (concurrency level).
+ */
+void measure(const std::string &protocol, int num_threads)
+{
+	std::vector<client_results> results(num_threads);
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> rtts;
+	double cycles_per_sec = get_cycles_per_sec();
+	client_config config;
+	uint64_t bytes = 0;
+	double rate, gbps;
+
+	config.protocol = protocol;
+	config.dest = server_addr;
+	if (inet_family == AF_INET)
+		config.dest.in4.sin_port = htons(protocol_port(protocol));
+	else
+		config.dest.in6.sin6_port = htons(protocol_port(protocol));
+	config.measure_start = rdtsc() + static_cast<uint64_t>(
+			warmup*cycles_per_sec);
+	config.measure_end = config.measure_start + static_cast<uint64_t>(
+			seconds*cycles_per_sec);
+	for (int i = 0; i < num_threads; i++)
+		threads.emplace_back(client_thread, &config, i + 1,
+				&results[i]);
+	for (std::thread &thread: threads)
+		thread.join();
+
+	for (client_results &r: results) {
+		rtts.insert(rtts.end(), r.rtts.begin(), r.rtts.end());
+		bytes += r.bytes;
+	}
+	std::sort(rtts.begin(), rtts.end());
+	rate = rtts.size()/seconds;
+	gbps = 8e-09*bytes/seconds;
+	if (strcmp(format, "json") == 0)
+		printf("{\"protocol\": \"%s\", \"workload\": \"%s\", "
+				"\"concurrency\": %d, \"seconds\": %.2f, "
+				"\"rpcs\": %lu, \"rpcs_per_sec\": %.1f, "
+				"\"gbps\": %.3f, \"p50_us\": %.2f, "
+				"\"p99_us\": %.2f, \"p999_us\": %.2f}\n",
+				protocol.c_str(), workload, num_threads,
+				seconds, rtts.size(), rate, gbps,
+				percentile(rtts, 0.5), percentile(rtts, 0.99),
+				percentile(rtts, 0.999));
+	else
+		printf("%s,%s,%d,%.2f,%lu,%.1f,%.3f,%.2f,%.2f,%.2f\n",
+				protocol.c_str(), workload, num_threads,
+				seconds, rtts.size(), rate, gbps,
+				percentile(rtts, 0.5), percentile(rtts, 0.99),
+				percentile(rtts, 0.999));
+	fflush(stdout);
+}
+
+/**
+ * get_double() - Parse a floating-point option value, and exit if the
+ * parse fails.
+ * @s:      String to parse.
+ * @option: Name of the option (for error messages).
+ */
+double get_double(const char *s, const char *option)
+{
+	char *end;
+	double value = strtod(s, &end);
+
+	if ((*end != 0) || (end == s) || (value < 0)) {
+		printf("Bad value '%s' for %s; must be a non-negative number\n",
+				s, option);
+		exit(1);
+	}
+	return value;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> protocol_list, levels;
+	const char *option;
+
+	for (int i = 1; i < argc; i++) {
+		option = argv[i];
+		if (strcmp(option, "--help") == 0) {
+			print_help(argv[0]);
+			exit(0);
+		} else if (strcmp(option, "--ipv6") == 0) {
+			inet_family = AF_INET6;
+			continue;
+		} else if (strcmp(option, "--one-way") == 0) {
+			one_way = true;
+			continue;
+		}
+		if (i == (argc-1)) {
+			printf("No value provided for %s option\n", option);
+			exit(1);
+		}
+		i++;
+		if (strcmp(option, "--buf-bpages") == 0) {
+			buf_bpages = get_int(argv[i],
+				"Bad buf-bpages %s; must be positive integer\n");
+		} else if (strcmp(option, "--concurrency") == 0) {
+			concurrency = argv[i];
+		} else if (strcmp(option, "--conn-threads") == 0) {
+			conn_threads = get_int(argv[i],
+				"Bad conn-threads %s; must be positive integer\n");
+		} else if (strcmp(option, "--format") == 0) {
+			format = argv[i];
+			if ((strcmp(format, "csv") != 0)
+					&& (strcmp(format, "json") != 0)) {
+				printf("Bad format '%s'; must be csv or json\n",
+						format);
+				exit(1);
+			}
+		} else if (strcmp(option, "--mode") == 0) {
+			mode = argv[i];
+			if ((strcmp(mode, "both") != 0)
+					&& (strcmp(mode, "client") != 0)
+					&& (strcmp(mode, "server") != 0)) {
+				printf("Bad mode '%s'; must be both, client, "
+						"or server\n", mode);
+				exit(1);
+			}
+		} else if (strcmp(option, "--port") == 0) {
+			port = get_int(argv[i],
+				"Bad port %s; must be positive integer\n");
+		} else if (strcmp(option, "--protocols") == 0) {
+			protocols = argv[i];
+		} else if (strcmp(option, "--seconds") == 0) {
+			seconds = get_double(argv[i], option);
+		} else if (strcmp(option, "--server") == 0) {
+			server_name = argv[i];
+		} else if (strcmp(option, "--server-threads") == 0) {
+			server_threads = get_int(argv[i],
+				"Bad server-threads %s; must be positive integer\n");
+		} else if (strcmp(option, "--warmup") == 0) {
+			warmup = get_double(argv[i], option);
+		} else if (strcmp(option, "--workload") == 0) {
+			workload = argv[i];
+		} else {
+			printf("Unknown option %s; type '%s --help' for help\n",
+				option, argv[0]);
+			exit(1);
+		}
+	}
+	if (seconds <= 0) {
+		printf("--seconds must be greater than zero\n");
+		exit(1);
+	}
+
+	split(protocols, ',', protocol_list);
+	for (std::string &protocol: protocol_list) {
+		if ((protocol != "homa") && (protocol != "homa_conn")
+				&& (protocol != "tcp")) {
+			printf("Unknown protocol '%s'; must be homa, "
+					"homa_conn, or tcp\n",
+					protocol.c_str());
+			exit(1);
+		}
+	}
+	split(concurrency, ',', levels);
+
+	if (strcmp(mode, "client") != 0) {
+		bool homa_started = false;
+
+		/* The homa and homa_conn servers both need a Homa server
+		 * port, so start both if either is requested (this keeps
+		 * a "server" process usable for all clients).
+		 */
+		for (std::string &protocol: protocol_list) {
+			if (protocol == "tcp") {
+				start_server(protocol);
+			} else if (!homa_started) {
+				start_server("homa");
+				start_server("homa_conn");
+				homa_started = true;
+			}
+		}
+		if (strcmp(mode, "server") == 0) {
+			fprintf(stderr, "Servers running on port %d\n", port);
+			while (1)
+				pause();
+		}
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	if (server_name == NULL) {
+		if (inet_family == AF_INET) {
+			server_addr.in4.sin_family = AF_INET;
+			server_addr.in4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		} else {
+			server_addr.in6.sin6_family = AF_INET6;
+			server_addr.in6.sin6_addr = in6addr_loopback;
+		}
+	} else {
+		struct addrinfo hints;
+		struct addrinfo *matching_addresses;
+		int status;
+
+		memset(&hints, 0, sizeof(struct addrinfo));
+		hints.ai_family = inet_family;
+		hints.ai_socktype = SOCK_DGRAM;
+		status = getaddrinfo(server_name, NULL, &hints,
+				&matching_addresses);
+		if (status != 0) {
+			printf("Couldn't look up address for %s: %s\n",
+					server_name, gai_strerror(status));
+			exit(1);
+		}
+		memcpy(&server_addr, matching_addresses->ai_addr,
+				matching_addresses->ai_addrlen);
+		freeaddrinfo(matching_addresses);
+	}
+
+	if (strcmp(format, "csv") == 0)
+		printf("protocol,workload,concurrency,seconds,rpcs,"
+				"rpcs_per_sec,gbps,p50_us,p99_us,p999_us\n");
+	for (std::string &protocol: protocol_list) {
+		for (std::string &level: levels) {
+			int num_threads = get_int(level.c_str(),
+					"Bad concurrency level %s; must be "
+					"positive integer\n");
+			measure(protocol, num_threads);
+		}
+	}
+	exit(0);
+}
@@ -247,7 +247,7 @@ def scan(file, alt_mode):
                 skip_statement = False
             check_braces = True
             continue
-        match = re.match('(//[ \t]*)?tt_record[1-4]?[(]', pline)
+        match = re.match('(//[ \t]*)?tt_(?:rpc_)?record[1-4]?[(]', pline)
         if match:
             # If this is the only statement in its block, delete the
             # outer block statement (if, while, etc.). Don't delete case
@@ -0,0 +1,115 @@
+#!/usr/bin/python3
+
+# Copyright (c) 2025 Homa Developers
+# SPDX-License-Identifier: BSD-1-Clause
+
+"""
+Continuously drain the kernel's timetrace from /proc/timetrace_stream
+and write it to a file, without freezing the timetrace. Events from
+different cores are reordered so the output is sorted by timestamp, in
+the same format as /proc/timetrace, so it can be processed with ttprint.py,
+ttsync.py, tthoma.py, etc. Runs until interrupted (e.g. with ^C), then
+prints a summary of how many events were lost because the reader didn't
+keep up with the trace.
+Usage: ttstream.py [options] output_file
+"""
+
+from __future__ import division, print_function
+from optparse import OptionParser
+import heapq
+import re
+import signal
+import sys
+import time
+
+parser = OptionParser(usage='%prog [options] output_file')
+parser.add_option('--proc', dest='proc', default='/proc/timetrace_stream',
+        metavar='FILE', help='Streaming timetrace file to read (default: '
+        '%default)')
+parser.add_option('--interval', type='float', dest='interval',
+        default=0.01, metavar='SECS', help='How long to wait before '
+        'reading again when no new events are available (default: '
+        '%default)')
+parser.add_option('--window', type='float', dest='window', default=10000,
+        metavar='USECS', help='Events are held back for this long (in '
+        'microseconds of trace time) so that events from other cores can '
+        'be sorted in ahead of them (default: %default)')
+(options, args) = parser.parse_args()
+if len(args) != 1:
+    parser.print_help()
+    sys.exit(1)
+
+stop = False
+def handle_signal(signum, frame):
+    global stop
+    stop = True
+signal.signal(signal.SIGINT, handle_signal)
+signal.signal(signal.SIGTERM, handle_signal)
+
+src = open(options.proc, 'rb', buffering=0)
+out = open(args[0], 'w')
+
+# Events not yet written: a heap of (timestamp, sequence, line).
+pending = []
+
+# Used to keep events with equal timestamps in the order they were read.
+sequence = 0
+
+# Largest timestamp seen so far.
+newest = 0
+
+# Partial line left over from the previous read.
+partial = ''
+
+# Number of cycles corresponding to options.window (known once the
+# cpu_khz line has been read).
+window_cycles = None
+
+events = 0
+dropped = 0
+drop_reports = 0
+
+def flush(limit):
+    """
+    Write all of the pending events with timestamps less than limit.
+    """
+    global events
+    while pending and pending[0][0] < limit:
+        out.write(heapq.heappop(pending)[2])
+        events += 1
+
+while not stop:
+    data = src.read(1000000)
+    if not data:
+        flush(newest - window_cycles if window_cycles != None else 0)
+        out.flush()
+        time.sleep(options.interval)
+        continue
+    lines = (partial + data.decode(errors='replace')).split('\n')
+    partial = lines.pop()
+    for line in lines:
+        match = re.match('cpu_khz: ([0-9.]+)', line)
+        if match:
+            window_cycles = options.window * float(match.group(1)) / 1000
+            out.write(line + '\n')
+            continue
+        match = re.match('([0-9]+) ', line)
+        if not match:
+            continue
+        t = int(match.group(1))
+        match = re.search('timetrace stream dropped ([0-9]+) events', line)
+        if match:
+            dropped += int(match.group(1))
+            drop_reports += 1
+        heapq.heappush(pending, (t, sequence, line + '\n'))
+        sequence += 1
+        if t > newest:
+            newest = t
+    if window_cycles != None:
+        flush(newest - window_cycles)
+
+flush(float('inf'))
+out.close()
+print('Wrote %d events to %s; %d events were dropped (%d reports)' % (
+        events - drop_reports, args[0], dropped, drop_reports),
+        file=sys.stderr)